@@ -0,0 +1,230 @@
+/**
+ * Decoder for the server's lossless screen codec, image/x-collabvm-screen,
+ * which is described in src/guacamole/screen_codec.h.
+ *
+ * A client lists CollabVMScreenCodec.getMimetypes() in the arguments of its
+ * connect instruction, and must have negotiated the guacamole-binary
+ * subprotocol, since the codec is only sent as raw bytes. Images of that
+ * mimetype are then sent in img instructions like WebP, and the bytes of
+ * their blobs are given to decode(), whose ImageData is drawn to the layer.
+ *
+ * Images are only compressed with zstd for clients that also set
+ * CollabVMScreenCodec.decompress to a function taking the compressed bytes
+ * and their decompressed size, and returning a Uint8Array, such as the
+ * decompress function of the fzstd library.
+ */
+(function(root) {
+	"use strict";
+
+	var SOLID = 0, LEFT = 1, ABOVE = 2, PALETTE = 3, PIXELS = 4;
+	var TILE_SIZE = 16;
+	var HEADER_SIZE = 9;
+	var FLAG_ZSTD = 1;
+
+	function fail(message) {
+		throw new Error("Invalid screen codec image: " + message);
+	}
+
+	/**
+	 * Decodes the tiles of an image into RGBA pixels.
+	 */
+	function decodeTiles(src, pos, width, height, out) {
+		var stride = width * 4;
+
+		// The state of the QOI operations, which carries on between tiles
+		var index = new Uint8Array(64 * 3);
+		var pr = 0, pg = 0, pb = 0;
+
+		function need(count) {
+			if(pos + count > src.length)
+				fail("truncated");
+		}
+
+		for(var ty = 0; ty < height; ty += TILE_SIZE) {
+			var th = Math.min(TILE_SIZE, height - ty);
+			for(var tx = 0; tx < width; tx += TILE_SIZE) {
+				var tw = Math.min(TILE_SIZE, width - tx);
+				var start = ty * stride + tx * 4;
+				var x, y, o, r, g, b;
+
+				need(1);
+				var mode = src[pos++];
+				switch(mode) {
+					case SOLID:
+						need(3);
+						r = src[pos];
+						g = src[pos + 1];
+						b = src[pos + 2];
+						pos += 3;
+						for(y = 0; y < th; y++) {
+							o = start + y * stride;
+							for(x = 0; x < tw; x++, o += 4) {
+								out[o] = r;
+								out[o + 1] = g;
+								out[o + 2] = b;
+								out[o + 3] = 255;
+							}
+						}
+						break;
+
+					case LEFT:
+					case ABOVE:
+						var offset = mode === LEFT ? TILE_SIZE * 4 : TILE_SIZE * stride;
+						if(mode === LEFT ? tx < TILE_SIZE : ty < TILE_SIZE)
+							fail("tile copied from outside the image");
+						for(y = 0; y < th; y++) {
+							o = start + y * stride;
+							out.copyWithin(o, o - offset, o - offset + tw * 4);
+						}
+						break;
+
+					case PALETTE:
+						need(1);
+						var count = src[pos++] + 1;
+						need(count * 3);
+						var colors = src.subarray(pos, pos + count * 3);
+						pos += count * 3;
+						var bits = count <= 2 ? 1 : count <= 4 ? 2 : 4;
+						var mask = (1 << bits) - 1;
+						need(Math.ceil(tw * th * bits / 8));
+						var bit = 8;
+						for(y = 0; y < th; y++) {
+							o = start + y * stride;
+							for(x = 0; x < tw; x++, o += 4) {
+								if(bit === 0) {
+									pos++;
+									bit = 8;
+								}
+								bit -= bits;
+								var c = ((src[pos] >> bit) & mask) * 3;
+								if(c >= count * 3)
+									fail("palette index out of range");
+								out[o] = colors[c];
+								out[o + 1] = colors[c + 1];
+								out[o + 2] = colors[c + 2];
+								out[o + 3] = 255;
+							}
+						}
+						pos++;
+						break;
+
+					case PIXELS:
+						var run = 0;
+						for(y = 0; y < th; y++) {
+							o = start + y * stride;
+							for(x = 0; x < tw; x++, o += 4) {
+								if(run > 0)
+									run--;
+								else {
+									need(1);
+									var op = src[pos++];
+									if(op === 0xfe) {
+										need(3);
+										pr = src[pos];
+										pg = src[pos + 1];
+										pb = src[pos + 2];
+										pos += 3;
+									} else if(op === 0xff) {
+										fail("unknown operation");
+									} else if((op & 0xc0) === 0x00) {
+										var i = op * 3;
+										pr = index[i];
+										pg = index[i + 1];
+										pb = index[i + 2];
+									} else if((op & 0xc0) === 0x40) {
+										pr = (pr + ((op >> 4) & 3) - 2) & 0xff;
+										pg = (pg + ((op >> 2) & 3) - 2) & 0xff;
+										pb = (pb + (op & 3) - 2) & 0xff;
+									} else if((op & 0xc0) === 0x80) {
+										need(1);
+										var dg = (op & 0x3f) - 32;
+										var second = src[pos++];
+										pr = (pr + dg + (second >> 4) - 8) & 0xff;
+										pg = (pg + dg) & 0xff;
+										pb = (pb + dg + (second & 0x0f) - 8) & 0xff;
+									} else {
+										run = op & 0x3f;
+									}
+									var h = ((pr * 3 + pg * 5 + pb * 7 + 255 * 11) % 64) * 3;
+									index[h] = pr;
+									index[h + 1] = pg;
+									index[h + 2] = pb;
+								}
+								out[o] = pr;
+								out[o + 1] = pg;
+								out[o + 2] = pb;
+								out[o + 3] = 255;
+							}
+						}
+						if(run > 0)
+							fail("run past the end of a tile");
+						break;
+
+					default:
+						fail("unknown tile mode " + mode);
+				}
+			}
+		}
+	}
+
+	var CollabVMScreenCodec = {
+		MIMETYPE: "image/x-collabvm-screen",
+		ZSTD_MIMETYPE: "image/x-collabvm-screen+zstd",
+
+		/**
+		 * Decompresses zstd frames, or null if images mustn't be compressed.
+		 * @type {?function(Uint8Array, number): Uint8Array}
+		 */
+		decompress: null,
+
+		/**
+		 * Gets the mimetypes to list when connecting to a VM.
+		 * @return {string[]}
+		 */
+		getMimetypes: function() {
+			return this.decompress ? [this.MIMETYPE, this.ZSTD_MIMETYPE] : [this.MIMETYPE];
+		},
+
+		/**
+		 * Decodes an image to RGBA pixels.
+		 * @param {Uint8Array} bytes The image.
+		 * @return {{width: number, height: number, data: Uint8ClampedArray}}
+		 */
+		decode: function(bytes) {
+			if(bytes.length < HEADER_SIZE || bytes[0] !== 0x43 || bytes[1] !== 0x56 || bytes[2] !== 0x53 || bytes[3] !== 0x31)
+				fail("bad header");
+			var width = bytes[4] | bytes[5] << 8;
+			var height = bytes[6] | bytes[7] << 8;
+			var flags = bytes[8];
+			var tiles = bytes;
+			var pos = HEADER_SIZE;
+			if(flags & FLAG_ZSTD) {
+				if(!this.decompress)
+					fail("compressed with zstd, but no decompressor was set");
+				if(bytes.length < HEADER_SIZE + 4)
+					fail("truncated");
+				var size = (bytes[9] | bytes[10] << 8 | bytes[11] << 16 | bytes[12] << 24) >>> 0;
+				tiles = this.decompress(bytes.subarray(HEADER_SIZE + 4), size);
+				pos = 0;
+			}
+			var data = new Uint8ClampedArray(width * height * 4);
+			decodeTiles(tiles, pos, width, height, data);
+			return { width: width, height: height, data: data };
+		},
+
+		/**
+		 * Decodes an image to ImageData, which can be drawn with putImageData().
+		 * @param {Uint8Array} bytes The image.
+		 * @return {ImageData}
+		 */
+		decodeImageData: function(bytes) {
+			var image = this.decode(bytes);
+			return new ImageData(image.data, image.width, image.height);
+		}
+	};
+
+	if(typeof module === "object" && module.exports)
+		module.exports = CollabVMScreenCodec;
+	else
+		root.CollabVMScreenCodec = CollabVMScreenCodec;
+})(this);
@@ -65,5 +65,12 @@ build(){
 	log "Writing preprocessed page(s)..."
 	echo $INSRC > http/index.html.in
 	mv http/index.html.in http/index.html
+
+	# The server sends the compressed copies to clients that accept them
+	log "Compressing..."
+	find http -type f \( -name "*.html" -o -name "*.css" -o -name "*.js" \) | while read -r file; do
+		command -v gzip >/dev/null 2>&1 && gzip -9 -k -f "$file"
+		command -v brotli >/dev/null 2>&1 && brotli -k -f "$file"
+	done
 	log "Finished."
 }; build $1;
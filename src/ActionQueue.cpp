@@ -0,0 +1,68 @@
+#include "ActionQueue.h"
+
+#include <new>
+
+namespace {
+	struct FreeBlock {
+		FreeBlock* next;
+	};
+
+	/**
+	 * Blocks that have been freed by any thread, for each size class.
+	 */
+	std::atomic<FreeBlock*> free_blocks[ActionPool::kSizeClasses];
+
+	/**
+	 * Blocks taken from free_blocks by the current thread.
+	 * They're given back when the thread exits.
+	 */
+	struct BlockCache {
+		FreeBlock* blocks[ActionPool::kSizeClasses] = {};
+
+		~BlockCache() {
+			for(size_t i = 0; i < ActionPool::kSizeClasses; i++) {
+				while(blocks[i] != nullptr) {
+					FreeBlock* block = blocks[i];
+					blocks[i] = block->next;
+					ActionPool::Free(block, (i + 1) * ActionPool::kBlockSize);
+				}
+			}
+		}
+	};
+
+	thread_local BlockCache block_cache;
+} // namespace
+
+void* ActionPool::Allocate(size_t size) {
+	size_t size_class = (size - 1) / kBlockSize;
+	if(size == 0 || size_class >= kSizeClasses)
+		return ::operator new(size);
+
+	FreeBlock*& cache = block_cache.blocks[size_class];
+	if(cache == nullptr)
+		cache = free_blocks[size_class].exchange(nullptr, std::memory_order_acquire);
+
+	if(cache == nullptr)
+		return ::operator new((size_class + 1) * kBlockSize);
+
+	FreeBlock* block = cache;
+	cache = block->next;
+	return block;
+}
+
+void ActionPool::Free(void* ptr, size_t size) {
+	size_t size_class = (size - 1) / kBlockSize;
+	if(size == 0 || size_class >= kSizeClasses) {
+		::operator delete(ptr);
+		return;
+	}
+
+	// The list is only ever taken as a whole, so pushing onto it can't
+	// be confused by a block that was popped and pushed again
+	FreeBlock* block = static_cast<FreeBlock*>(ptr);
+	std::atomic<FreeBlock*>& list = free_blocks[size_class];
+	FreeBlock* head = list.load(std::memory_order_relaxed);
+	do {
+		block->next = head;
+	} while(!list.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+}
@@ -0,0 +1,118 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+/**
+ * The classes that the processing thread sorts actions into, from the most
+ * urgent. Each class gets a share of the actions handled in proportion to
+ * its weight while it has any waiting, so none of them starve.
+ */
+enum class ActionClass {
+	kInput,	  // Input that waited in the queue, turns and votes
+	kVMState, // Changes to the state of VMs and their agents
+	kChat,	  // Chat and the rest of the users' instructions
+	kBulk,	  // Admin commands, VM lists, uploads and thumbnails
+	kCount
+};
+
+/**
+ * A queue with any number of producers and a single consumer that doesn't
+ * take a lock to push or pop. Producers push nodes onto an intrusive stack,
+ * and the consumer takes every pending node with a single exchange, so it
+ * handles actions in batches instead of contending for each one.
+ * TNode must have a TNode* member named next.
+ */
+template<typename TNode>
+class ActionQueue {
+   public:
+	ActionQueue()
+		: head_(nullptr) {
+	}
+
+	/**
+	 * Adds a node to the queue, waking the consumer if it is waiting.
+	 */
+	void Push(TNode* node) {
+		TNode* head = head_.load(std::memory_order_relaxed);
+		do {
+			node->next = head;
+		} while(!head_.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+
+		// The consumer only waits once the queue is empty, so only the
+		// first node pushed after that needs to wake it up
+		if(head == nullptr) {
+			std::lock_guard<std::mutex> lock(wait_mutex_);
+			wait_cv_.notify_one();
+		}
+	}
+
+	/**
+	 * Takes every node in the queue.
+	 *
+	 * @return The nodes linked in the order they were pushed,
+	 *         or nullptr if the queue was empty.
+	 */
+	TNode* PopAll() {
+		TNode* node = head_.exchange(nullptr, std::memory_order_acquire);
+
+		// Reverse the stack so the oldest node comes first
+		TNode* first = nullptr;
+		while(node != nullptr) {
+			TNode* next = node->next;
+			node->next = first;
+			first = node;
+			node = next;
+		}
+		return first;
+	}
+
+	/**
+	 * Waits until the queue isn't empty, then takes every node in it.
+	 */
+	TNode* WaitAll() {
+		TNode* nodes;
+		while((nodes = PopAll()) == nullptr) {
+			std::unique_lock<std::mutex> lock(wait_mutex_);
+			wait_cv_.wait(lock, [this] { return head_.load(std::memory_order_relaxed) != nullptr; });
+		}
+		return nodes;
+	}
+
+   private:
+	/**
+	 * The most recently pushed node.
+	 */
+	std::atomic<TNode*> head_;
+
+	/**
+	 * Only used while the consumer is waiting for the queue to be filled.
+	 */
+	std::mutex wait_mutex_;
+	std::condition_variable wait_cv_;
+};
+
+/**
+ * Recycles the memory of small objects that are allocated on one thread and
+ * freed on another, such as the actions that the websocket threads post to
+ * the processing thread. Freed blocks go onto a shared list with one
+ * compare-and-swap, and a thread that runs out of blocks takes the whole
+ * list into its own cache with a single exchange.
+ */
+class ActionPool {
+   public:
+	static void* Allocate(size_t size);
+	static void Free(void* ptr, size_t size);
+
+	/**
+	 * Objects are rounded up to a multiple of this size.
+	 */
+	static constexpr size_t kBlockSize = 64;
+
+	/**
+	 * The number of block sizes that are pooled. Larger objects
+	 * use the global allocator.
+	 */
+	static constexpr size_t kSizeClasses = 4;
+};
@@ -72,7 +72,19 @@ namespace AgentProtocol {
 		kFileDlPart,
 		kFileDlEnd,
 		kFileDlEndShellExec,
-		kTerminate
+		kTerminate,
+		kFileDlPartDeflate // A part of the file's raw deflate stream
+	};
+
+	/**
+	 * Flags that newer agents send after the largest part size in their
+	 * connect packet, for what they can do beyond the original protocol.
+	 */
+	enum Capability {
+		// The agent inflates kFileDlPartDeflate packets. Their bodies are one
+		// raw deflate stream for each file, flushed at the end of every write,
+		// so kFileDlPart packets can follow once compressing stops paying off.
+		kCapDeflate = 1 << 0
 	};
 
 	enum ShowWindow {
@@ -84,4 +96,22 @@ namespace AgentProtocol {
 	const int kHeaderSize = sizeof(uint16_t) + sizeof(uint8_t);
 	const int kBodySize = kBufferSize - kHeaderSize;
 
+	/**
+	 * The size of each of the buffers file uploads are sent from. Several
+	 * kFileDlPart packets are packed into a buffer so they're sent with one
+	 * write, and it fits at least one packet of the largest size an agent
+	 * can ask for.
+	 */
+	const size_t kUploadBufferSize = 128 * 1024; // 128 KiB
+	static_assert(kUploadBufferSize >= kHeaderSize + UINT16_MAX, "An upload buffer must fit the largest packet");
+
+	/**
+	 * The number of bytes of a file that are compressed at a time. Once
+	 * kDeflateSampleSize bytes have been, the file stops being compressed
+	 * if it shrank by less than an eighth, so files that already are, like
+	 * archives and packed executables, are mostly sent as they are.
+	 */
+	const size_t kDeflateInputSize = 32 * 1024; // 32 KiB
+	const size_t kDeflateSampleSize = 64 * 1024; // 64 KiB
+
 } // namespace AgentProtocol
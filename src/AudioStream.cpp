@@ -0,0 +1,172 @@
+#include "AudioStream.h"
+#include "Logger.h"
+#include "GuacClient.h"
+#include "guacamole/protocol.h"
+#include "guacamole/user-constants.h"
+
+/**
+ * The index of the audio stream, after the one used for images so that
+ * it can't collide with the streams that viewers open.
+ */
+#define GUAC_AUDIO_STREAM_INDEX (GUAC_USER_MAX_STREAMS + 1)
+
+/**
+ * The number of bytes in a frame of PCM samples.
+ */
+#define GUAC_AUDIO_FRAME_BYTES (AudioStream::kFrameSamples * AudioStream::kChannels * 2)
+
+/**
+ * The most samples that are queued before the oldest are dropped, one
+ * second, so audio doesn't fall further behind if encoding can't keep up.
+ */
+#define GUAC_AUDIO_MAX_PENDING (AudioStream::kSampleRate * AudioStream::kChannels * 2)
+
+#ifdef USE_OPUS
+/**
+ * The bitrate of the Opus stream in bits per second.
+ */
+#define GUAC_AUDIO_OPUS_BITRATE 96000
+
+/**
+ * The largest Opus packet that can be produced, as recommended by libopus.
+ */
+#define GUAC_AUDIO_OPUS_MAX_PACKET 4000
+#endif
+
+AudioStream::AudioStream(GuacClient& client)
+	: client_(client),
+	  stream_(),
+	  open_(false),
+	  stopping_(false) {
+	stream_.index = GUAC_AUDIO_STREAM_INDEX;
+
+#ifdef USE_OPUS
+	int error;
+	encoder_ = opus_encoder_create(kSampleRate, kChannels, OPUS_APPLICATION_AUDIO, &error);
+	if(encoder_)
+		opus_encoder_ctl(encoder_, OPUS_SET_BITRATE(GUAC_AUDIO_OPUS_BITRATE));
+	else
+		Logger::Error() << "Failed to create Opus encoder: " << opus_strerror(error);
+	packet_.resize(GUAC_AUDIO_OPUS_MAX_PACKET);
+#endif
+}
+
+AudioStream::~AudioStream() {
+	End();
+
+#ifdef USE_OPUS
+	if(encoder_)
+		opus_encoder_destroy(encoder_);
+#endif
+}
+
+const char* AudioStream::GetMimetype() {
+#ifdef USE_OPUS
+	return "audio/opus;rate=48000,channels=2";
+#else
+	return "audio/L16;rate=48000,channels=2";
+#endif
+}
+
+void AudioStream::Begin() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(open_)
+			return;
+
+		open_ = true;
+		stopping_ = false;
+		pending_.clear();
+		guac_protocol_send_audio(client_.broadcast_socket_, &stream_, 0, GetMimetype(), 0);
+		if(client_.HasScaledUsers())
+			guac_protocol_send_audio(client_.scaled_socket_, &stream_, 0, GetMimetype(), 0);
+	}
+
+#ifdef USE_OPUS
+	if(encoder_)
+		opus_encoder_ctl(encoder_, OPUS_RESET_STATE);
+#endif
+	thread_ = std::thread(&AudioStream::EncoderThread, this);
+}
+
+void AudioStream::Write(const unsigned char* data, size_t length) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(!open_ || stopping_)
+			return;
+
+		if(pending_.size() + length > GUAC_AUDIO_MAX_PENDING)
+			pending_.clear();
+		pending_.insert(pending_.end(), data, data + length);
+
+		if(pending_.size() < GUAC_AUDIO_FRAME_BYTES)
+			return;
+	}
+	pending_cv_.notify_one();
+}
+
+void AudioStream::End() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(!open_)
+			return;
+		stopping_ = true;
+	}
+	pending_cv_.notify_one();
+	thread_.join();
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	guac_protocol_send_end(client_.broadcast_socket_, &stream_);
+	if(client_.HasScaledUsers())
+		guac_protocol_send_end(client_.scaled_socket_, &stream_);
+	open_ = false;
+}
+
+void AudioStream::Dup(GuacSocket& socket) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if(open_ && !stopping_)
+		guac_protocol_send_audio(socket, &stream_, 0, GetMimetype(), 0);
+}
+
+void AudioStream::EncoderThread() {
+	std::vector<unsigned char> frames;
+	std::unique_lock<std::mutex> lock(mutex_);
+	while(true) {
+		pending_cv_.wait(lock, [this] { return stopping_ || pending_.size() >= GUAC_AUDIO_FRAME_BYTES; });
+
+		// Take every whole frame, leaving the remainder for the next ones
+		size_t length = pending_.size() - pending_.size() % GUAC_AUDIO_FRAME_BYTES;
+		frames.assign(pending_.begin(), pending_.begin() + length);
+		pending_.erase(pending_.begin(), pending_.begin() + length);
+		bool stopping = stopping_;
+		lock.unlock();
+
+		for(size_t i = 0; i < length; i += GUAC_AUDIO_FRAME_BYTES)
+			SendFrame(&frames[i]);
+
+		if(stopping)
+			return;
+		lock.lock();
+	}
+}
+
+void AudioStream::SendFrame(const unsigned char* pcm) {
+#ifdef USE_OPUS
+	if(!encoder_)
+		return;
+
+	// The samples are little-endian, as are the hosts that the server runs on
+	int length = opus_encode(encoder_, reinterpret_cast<const opus_int16*>(pcm), kFrameSamples,
+							 packet_.data(), packet_.size());
+	if(length <= 0)
+		return;
+	unsigned char* data = packet_.data();
+#else
+	unsigned char* data = const_cast<unsigned char*>(pcm);
+	int length = GUAC_AUDIO_FRAME_BYTES;
+#endif
+
+	guac_protocol_send_blob(client_.broadcast_socket_, &stream_, data, length);
+	if(client_.HasScaledUsers())
+		guac_protocol_send_blob(client_.scaled_socket_, &stream_, data, length);
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include "guacamole/stream.h"
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef USE_OPUS
+#include <opus/opus.h>
+#endif
+
+class GuacSocket;
+class GuacClient;
+
+/**
+ * A single audio stream broadcast to every viewer of a VM. PCM samples
+ * written to the stream are encoded on a worker thread, so the audio is
+ * encoded once no matter how many viewers are listening, and the VNC thread
+ * only has to copy the samples. Viewers of the scaled down display are
+ * sent the same packets from the client's scaled socket.
+ */
+class AudioStream {
+   public:
+	/**
+	 * The format of the PCM samples written to the stream, which are
+	 * signed 16-bit little-endian and interleaved.
+	 */
+	constexpr static int kSampleRate = 48000;
+	constexpr static int kChannels = 2;
+
+	/**
+	 * The number of samples per channel in each encoded packet, 20 ms.
+	 */
+	constexpr static int kFrameSamples = kSampleRate / 50;
+
+	explicit AudioStream(GuacClient& client);
+	~AudioStream();
+
+	/**
+	 * Opens the stream on the viewers and starts the encoder thread.
+	 * Does nothing if the stream is already open.
+	 */
+	void Begin();
+
+	/**
+	 * Queues PCM samples to be encoded and sent to the viewers.
+	 * Samples written while the stream is closed are dropped.
+	 */
+	void Write(const unsigned char* data, size_t length);
+
+	/**
+	 * Closes the stream on the viewers once the samples that have
+	 * been queued are sent, and stops the encoder thread.
+	 */
+	void End();
+
+	/**
+	 * Opens the stream on a viewer that joined while it was open.
+	 */
+	void Dup(GuacSocket& socket);
+
+	/**
+	 * Gets the mimetype of the blobs sent on the stream.
+	 * With Opus, each blob is a single raw Opus packet, otherwise
+	 * blobs contain PCM samples in the format they were written.
+	 */
+	static const char* GetMimetype();
+
+   private:
+	void EncoderThread();
+
+	/**
+	 * Encodes a frame of kFrameSamples samples and broadcasts it.
+	 */
+	void SendFrame(const unsigned char* pcm);
+
+	GuacClient& client_;
+	guac_stream stream_;
+
+	std::thread thread_;
+
+	/**
+	 * PCM samples that haven't been encoded yet.
+	 * Guarded by mutex_, along with open_ and stopping_.
+	 */
+	std::vector<unsigned char> pending_;
+	std::mutex mutex_;
+	std::condition_variable pending_cv_;
+
+	/**
+	 * Whether the stream has been opened on the viewers.
+	 */
+	bool open_;
+	bool stopping_;
+
+#ifdef USE_OPUS
+	OpusEncoder* encoder_;
+	std::vector<unsigned char> packet_;
+#endif
+};
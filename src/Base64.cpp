@@ -0,0 +1,69 @@
+#include "Base64.h"
+#include "SIMD.h"
+
+#if defined(SIMD_X86)
+	#include <immintrin.h>
+#endif
+
+static void EncodeTripletsScalar(const unsigned char* in, size_t count, char* out) {
+	while(count--) {
+		unsigned int a = in[0];
+		unsigned int b = in[1];
+		unsigned int c = in[2];
+
+		out[0] = __guac_socket_BASE64_CHARACTERS[a >> 2];
+		out[1] = __guac_socket_BASE64_CHARACTERS[((a & 0x03) << 4) | (b >> 4)];
+		out[2] = __guac_socket_BASE64_CHARACTERS[((b & 0x0F) << 2) | (c >> 6)];
+		out[3] = __guac_socket_BASE64_CHARACTERS[c & 0x3F];
+
+		in += 3;
+		out += 4;
+	}
+}
+
+#if defined(SIMD_X86)
+SIMD_TARGET_SSE42
+static void EncodeTripletsSSE42(const unsigned char* in, size_t count, char* out) {
+	/* Encode 12 bytes at a time, while at least 16 bytes can be loaded */
+	while(count >= 6) {
+		__m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+
+		/* Split each triplet into four 6-bit indices */
+		input = _mm_shuffle_epi8(input, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+		const __m128i t0 = _mm_and_si128(input, _mm_set1_epi32(0x0fc0fc00));
+		const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+		const __m128i t2 = _mm_and_si128(input, _mm_set1_epi32(0x003f03f0));
+		const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+		const __m128i indices = _mm_or_si128(t1, t3);
+
+		/* Translate the indices to characters */
+		__m128i offsets = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+		const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+		offsets = _mm_or_si128(offsets, _mm_and_si128(less, _mm_set1_epi8(13)));
+		const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+												'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+												'/' - 63, 'A', 0, 0);
+		const __m128i result = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, offsets), indices);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), result);
+		in += 12;
+		out += 16;
+		count -= 4;
+	}
+	EncodeTripletsScalar(in, count, out);
+}
+#endif
+
+using EncodeTripletsFunc = void(const unsigned char* in, size_t count, char* out);
+
+void (*const Base64::EncodeTriplets)(const unsigned char* in, size_t count, char* out) =
+	SIMD::Select<EncodeTripletsFunc>("base64", {
+		EncodeTripletsScalar,
+#if defined(SIMD_X86)
+		EncodeTripletsSSE42,
+#else
+		nullptr,
+#endif
+		nullptr,
+		nullptr,
+		nullptr });
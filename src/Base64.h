@@ -1,5 +1,5 @@
 #pragma once
-#include <sstream>
+#include "ByteBuffer.h"
 
 static const char __guac_socket_BASE64_CHARACTERS[64] = {
 	'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O',
@@ -11,8 +11,8 @@ static const char __guac_socket_BASE64_CHARACTERS[64] = {
 
 class Base64 {
    public:
-	Base64(std::ostringstream& ss)
-		: ss_(ss),
+	Base64(ByteBuffer& buffer)
+		: buffer_(buffer),
 		  base64_ready_(0) {
 	}
 
@@ -41,6 +41,22 @@ class Base64 {
 		const unsigned char* char_buf = (const unsigned char*)buf;
 		const unsigned char* end = char_buf + count;
 
+		/* Complete any partially filled triplet first */
+		while(base64_ready_ > 0 && char_buf < end) {
+			retval = WriteBase64Byte(*(char_buf++));
+			if(retval < 0) {
+				return retval;
+			}
+		}
+
+		/* Encode all of the whole triplets directly into the output buffer */
+		size_t triplets = (end - char_buf) / 3;
+		if(triplets) {
+			EncodeTriplets(char_buf, triplets, reinterpret_cast<char*>(buffer_.Extend(triplets * 4)));
+			char_buf += triplets * 3;
+		}
+
+		/* Keep the remaining bytes until more data is written or the buffer is flushed */
 		while(char_buf < end) {
 			retval = WriteBase64Byte(*(char_buf++));
 			if(retval < 0) {
@@ -66,29 +82,35 @@ class Base64 {
 	}
 
    private:
+	/**
+	 * Encodes count complete triplets from in to out, which must have
+	 * room for count * 4 characters. The variant is picked for the CPU.
+	 */
+	static void (*const EncodeTriplets)(const unsigned char* in, size_t count, char* out);
+
 	size_t WriteBase64Triplet(int a, int b, int c) {
-		std::ostringstream& ss = ss_;
+		ByteBuffer& buffer = buffer_;
 
 		/* Byte 1 */
-		ss << __guac_socket_BASE64_CHARACTERS[(a & 0xFC) >> 2]; /* [AAAAAA]AABBBB BBBBCC CCCCCC */
+		buffer.Append(__guac_socket_BASE64_CHARACTERS[(a & 0xFC) >> 2]); /* [AAAAAA]AABBBB BBBBCC CCCCCC */
 
 		if(b >= 0) {
-			ss << __guac_socket_BASE64_CHARACTERS[((a & 0x03) << 4) | ((b & 0xF0) >> 4)]; /* AAAAAA[AABBBB]BBBBCC CCCCCC */
+			buffer.Append(__guac_socket_BASE64_CHARACTERS[((a & 0x03) << 4) | ((b & 0xF0) >> 4)]); /* AAAAAA[AABBBB]BBBBCC CCCCCC */
 
 			if(c >= 0) {
-				ss << __guac_socket_BASE64_CHARACTERS[((b & 0x0F) << 2) | ((c & 0xC0) >> 6)]; /* AAAAAA AABBBB[BBBBCC]CCCCCC */
-				ss << __guac_socket_BASE64_CHARACTERS[c & 0x3F];							  /* AAAAAA AABBBB BBBBCC[CCCCCC] */
+				buffer.Append(__guac_socket_BASE64_CHARACTERS[((b & 0x0F) << 2) | ((c & 0xC0) >> 6)]); /* AAAAAA AABBBB[BBBBCC]CCCCCC */
+				buffer.Append(__guac_socket_BASE64_CHARACTERS[c & 0x3F]);							  /* AAAAAA AABBBB BBBBCC[CCCCCC] */
 			} else {
-				ss << __guac_socket_BASE64_CHARACTERS[((b & 0x0F) << 2)]; /* AAAAAA AABBBB[BBBB--]------ */
-				ss << '=';												  /* AAAAAA AABBBB BBBB--[------] */
+				buffer.Append(__guac_socket_BASE64_CHARACTERS[((b & 0x0F) << 2)]); /* AAAAAA AABBBB[BBBB--]------ */
+				buffer.Append('=');															  /* AAAAAA AABBBB BBBB--[------] */
 			}
 		} else {
-			ss << __guac_socket_BASE64_CHARACTERS[((a & 0x03) << 4)]; /* AAAAAA[AA----]------ ------ */
-			ss << "==";												  /* AAAAAA AA----[------]------ */
-			//ss << '='; /* AAAAAA AA---- ------[------] */
+			buffer.Append(__guac_socket_BASE64_CHARACTERS[((a & 0x03) << 4)]); /* AAAAAA[AA----]------ ------ */
+			buffer.Append("==");											  /* AAAAAA AA----[------]------ */
+			//buffer.Append('=');			 /* AAAAAA AA---- ------[------] */
 		}
 
-		/* At this point, 4 bytes have been ss_ */
+		/* At this point, 4 bytes have been written */
 		if(b < 0)
 			return 1;
 
@@ -98,7 +120,7 @@ class Base64 {
 		return 3;
 	}
 
-	std::ostringstream& ss_;
+	ByteBuffer& buffer_;
 
 	/**
 	* The number of bytes present in the base64 "ready" buffer.
@@ -0,0 +1,498 @@
+/**
+ * Micro-benchmarks of the display pipeline, from converting the VNC
+ * server's pixels to writing the instructions sent to viewers.
+ *
+ * Built with "make bench", which requires Google Benchmark. The frames are
+ * read from the PNG screenshots in the directory named by the
+ * COLLABVM_BENCH_FRAMES environment variable, which should be recorded from
+ * real desktops. Without it, synthetic frames are drawn instead.
+ *
+ * The BM_VNCWorkload benchmarks connect libvncclient to a SyntheticVNCServer
+ * instead, to measure everything from reading RFB updates to encoding them
+ * on scripted workloads.
+ */
+#include "GuacInstructionParser.h"
+#include "GuacSocket.h"
+#include "GuacVNCClient.h"
+#include "ImageEncoder.h"
+#include "SyntheticVNCServer.h"
+#include "guacamole/guac_surface.h"
+#include "guacamole/layer.h"
+
+#include <benchmark/benchmark.h>
+#include <cairo/cairo.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * A socket that throws away everything written to it once each
+ * instruction has been written.
+ */
+class NullSocket : public GuacSocket {
+   public:
+	void InstructionBegin() override {
+		mutex_.lock();
+		ClearBuffers();
+	}
+
+	void InstructionEnd() override {
+		sent_bytes += buffer_.Size();
+		mutex_.unlock();
+	}
+
+	uint64_t sent_bytes = 0;
+};
+
+/**
+ * Frames of a desktop that are all the same size, as 32-bit RGB surfaces.
+ */
+struct Frames {
+	std::vector<cairo_surface_t*> surfaces;
+	int width = 0;
+	int height = 0;
+
+	cairo_surface_t* operator[](size_t i) const {
+		return surfaces[i % surfaces.size()];
+	}
+};
+
+/**
+ * Draws a desktop with a gradient wallpaper, windows of flat color and rows
+ * of glyph-like noise as text. Each frame moves the windows, so that
+ * consecutive frames differ like they would while someone uses the VM.
+ */
+static cairo_surface_t* DrawSyntheticFrame(int width, int height, int frame) {
+	cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	unsigned char* data = cairo_image_surface_get_data(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+
+	uint32_t seed = 12345;
+	for(int y = 0; y < height; y++) {
+		uint32_t* row = reinterpret_cast<uint32_t*>(data + y * stride);
+		for(int x = 0; x < width; x++)
+			row[x] = (x * 255 / width) << 16 | (y * 255 / height) << 8 | 0x80;
+	}
+
+	for(int window = 0; window < 4; window++) {
+		int x0 = (window * 211 + frame * 37) % (width / 2);
+		int y0 = (window * 131 + frame * 23) % (height / 2);
+		int w = width / 3;
+		int h = height / 3;
+		for(int y = y0; y < std::min(y0 + h, height); y++) {
+			uint32_t* row = reinterpret_cast<uint32_t*>(data + y * stride);
+			for(int x = x0; x < std::min(x0 + w, width); x++) {
+				// Dark glyphs on every other band of 16 rows
+				seed = seed * 1103515245 + 12345;
+				bool glyph = (y - y0) % 16 < 12 && (y - y0) / 16 % 2 && (seed >> 16) % 3 == 0;
+				row[x] = glyph ? 0x202020 : 0xF0F0F0 - window * 0x101010;
+			}
+		}
+	}
+
+	cairo_surface_mark_dirty(surface);
+	return surface;
+}
+
+/**
+ * Loads the recorded frames, or draws synthetic ones if there are none.
+ */
+static const Frames& GetFrames() {
+	static Frames frames = []() {
+		Frames frames;
+		if(const char* dir = std::getenv("COLLABVM_BENCH_FRAMES")) {
+			std::vector<std::filesystem::path> paths;
+			for(const auto& entry : std::filesystem::directory_iterator(dir))
+				if(entry.path().extension() == ".png")
+					paths.push_back(entry.path());
+			std::sort(paths.begin(), paths.end());
+
+			for(const auto& path : paths) {
+				cairo_surface_t* png = cairo_image_surface_create_from_png(path.c_str());
+				if(cairo_surface_status(png) != CAIRO_STATUS_SUCCESS) {
+					cairo_surface_destroy(png);
+					continue;
+				}
+
+				int width = cairo_image_surface_get_width(png);
+				int height = cairo_image_surface_get_height(png);
+				if(frames.surfaces.empty()) {
+					frames.width = width;
+					frames.height = height;
+				} else if(width != frames.width || height != frames.height) {
+					std::cerr << "Skipping " << path << ", it's a different size than the first frame" << std::endl;
+					cairo_surface_destroy(png);
+					continue;
+				}
+
+				// Surfaces are always RGB24, so the screenshot is drawn onto one
+				cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+				cairo_t* cr = cairo_create(surface);
+				cairo_set_source_surface(cr, png, 0, 0);
+				cairo_paint(cr);
+				cairo_destroy(cr);
+				cairo_surface_destroy(png);
+				cairo_surface_flush(surface);
+				frames.surfaces.push_back(surface);
+			}
+		}
+
+		if(frames.surfaces.empty()) {
+			frames.width = 1024;
+			frames.height = 768;
+			for(int i = 0; i < 4; i++)
+				frames.surfaces.push_back(DrawSyntheticFrame(frames.width, frames.height, i));
+		}
+		return frames;
+	}();
+	return frames;
+}
+
+static guac_layer default_layer = { 0 };
+
+/**
+ * Converts whole frames from the VNC server's pixel format into a surface,
+ * like guac_vnc_update() does when the framebuffer isn't shared.
+ *
+ * @param state.range(0) The bytes per pixel of the VNC server, 4 for BGRX
+ *                       or 2 for RGB565.
+ */
+static void BM_ConvertPixels(benchmark::State& state) {
+	const Frames& frames = GetFrames();
+	const int bpp = state.range(0);
+
+	rfbPixelFormat format {};
+	format.bitsPerPixel = bpp * 8;
+	format.trueColour = 1;
+	if(bpp == 4) {
+		format.depth = 24;
+		format.redMax = format.greenMax = format.blueMax = 0xff;
+		format.redShift = 0;
+		format.greenShift = 8;
+		format.blueShift = 16;
+	} else {
+		format.depth = 16;
+		format.redMax = 31;
+		format.greenMax = 63;
+		format.blueMax = 31;
+		format.redShift = 11;
+		format.greenShift = 5;
+		format.blueShift = 0;
+	}
+
+	// Convert the frames to the VNC server's format beforehand
+	std::vector<std::vector<unsigned char>> framebuffers;
+	for(cairo_surface_t* surface : frames.surfaces) {
+		const unsigned char* data = cairo_image_surface_get_data(surface);
+		int stride = cairo_image_surface_get_stride(surface);
+		std::vector<unsigned char> framebuffer(static_cast<size_t>(frames.width) * frames.height * bpp);
+		for(int y = 0; y < frames.height; y++) {
+			const uint32_t* row = reinterpret_cast<const uint32_t*>(data + y * stride);
+			for(int x = 0; x < frames.width; x++) {
+				uint32_t r = row[x] >> 16 & 0xff, g = row[x] >> 8 & 0xff, b = row[x] & 0xff;
+				uint32_t pixel = (r * format.redMax / 255) << format.redShift |
+								 (g * format.greenMax / 255) << format.greenShift |
+								 (b * format.blueMax / 255) << format.blueShift;
+				std::memcpy(&framebuffer[(static_cast<size_t>(y) * frames.width + x) * bpp], &pixel, bpp);
+			}
+		}
+		framebuffers.push_back(std::move(framebuffer));
+	}
+
+	GuacVNCPixelConversion conversion;
+	guac_common_surface_convert_func* convert = GuacVNCClient::CreatePixelConverter(format, false, conversion);
+
+	NullSocket socket;
+	guac_common_surface* surface = guac_common_surface_alloc(socket, &default_layer, frames.width, frames.height);
+
+	// Only the conversion is measured, flushing throws the updates away
+	surface->suspended = 1;
+
+	size_t i = 0;
+	for(auto _ : state) {
+		const std::vector<unsigned char>& framebuffer = framebuffers[i++ % framebuffers.size()];
+		guac_common_surface_draw_pixels(surface, 0, 0, frames.width, frames.height, framebuffer.data(),
+										frames.width * bpp, bpp, convert, &conversion);
+		guac_common_surface_flush(surface);
+	}
+
+	state.SetBytesProcessed(state.iterations() * frames.width * frames.height * bpp);
+	guac_common_surface_free(surface);
+}
+BENCHMARK(BM_ConvertPixels)->Arg(4)->Arg(2);
+
+/**
+ * Draws small updates scattered across the screen and flushes them, which
+ * combines them into rects and encodes the rects as images.
+ *
+ * @param state.range(0) The number of 64x32 updates drawn in each frame.
+ */
+static void BM_SurfaceFlush(benchmark::State& state) {
+	const Frames& frames = GetFrames();
+	const int updates = state.range(0);
+	const int width = 64;
+	const int height = 32;
+
+	NullSocket socket;
+	guac_common_surface* surface = guac_common_surface_alloc(socket, &default_layer, frames.width, frames.height);
+
+	size_t i = 0;
+	uint32_t seed = 1;
+	for(auto _ : state) {
+		cairo_surface_t* frame = frames[i++];
+		const unsigned char* data = cairo_image_surface_get_data(frame);
+		int stride = cairo_image_surface_get_stride(frame);
+
+		for(int update = 0; update < updates; update++) {
+			seed = seed * 1103515245 + 12345;
+			int x = (seed >> 8) % (frames.width - width);
+			seed = seed * 1103515245 + 12345;
+			int y = (seed >> 8) % (frames.height - height);
+			guac_common_surface_draw_pixels(surface, x, y, width, height, data + y * stride + x * 4,
+											stride, 4, NULL, NULL);
+		}
+		guac_common_surface_flush(surface);
+	}
+
+	guac_common_surface_free(surface);
+}
+BENCHMARK(BM_SurfaceFlush)->Arg(16)->Arg(256);
+
+/**
+ * Crops a square from the middle of a frame, or copies all of it if size is 0.
+ */
+static cairo_surface_t* CropFrame(cairo_surface_t* frame, int size) {
+	int width = cairo_image_surface_get_width(frame);
+	int height = cairo_image_surface_get_height(frame);
+	int w = size ? std::min(size, width) : width;
+	int h = size ? std::min(size, height) : height;
+
+	cairo_surface_t* crop = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+	cairo_t* cr = cairo_create(crop);
+	cairo_set_source_surface(cr, frame, -(width - w) / 2, -(height - h) / 2);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	cairo_surface_flush(crop);
+	return crop;
+}
+
+/**
+ * The default PNG profile with the fast encoder for updates, to compare it
+ * with zlib.
+ */
+static const guac_png_profile kFastPNGProfile = { 2, 6, 1, 1 };
+
+/**
+ * Encodes images with the backend that encodes the format on this host.
+ *
+ * @param state.range(0) The width and height of the images, or 0 for
+ *                       whole frames.
+ */
+static void BM_Encode(benchmark::State& state, ImageFormat format, const guac_png_profile* png_profile) {
+	const Frames& frames = GetFrames();
+	std::vector<cairo_surface_t*> images;
+	for(cairo_surface_t* frame : frames.surfaces)
+		images.push_back(CropFrame(frame, state.range(0)));
+
+	ImageEncodeParams params;
+	params.format = format;
+	params.layer = &default_layer;
+	params.png_profile = png_profile;
+	params.jpeg_quality = 80;
+
+	std::vector<unsigned char> buffer;
+	size_t i = 0;
+	size_t encoded = 0;
+	for(auto _ : state) {
+		if(ImageEncoders::Get().Encode(images[i++ % images.size()], params, buffer)) {
+			state.SkipWithError("Encoding failed");
+			break;
+		}
+		encoded += buffer.size();
+	}
+
+	int width = cairo_image_surface_get_width(images[0]);
+	int height = cairo_image_surface_get_height(images[0]);
+	state.SetBytesProcessed(state.iterations() * width * height * 4);
+	state.counters["encoded_bytes"] = benchmark::Counter(encoded, benchmark::Counter::kAvgIterations);
+
+	for(cairo_surface_t* image : images)
+		cairo_surface_destroy(image);
+}
+BENCHMARK_CAPTURE(BM_Encode, png, ImageFormat::kPNG, &GUAC_PNG_DEFAULT_PROFILE)->Arg(128)->Arg(0);
+BENCHMARK_CAPTURE(BM_Encode, png_fast, ImageFormat::kPNG, &kFastPNGProfile)->Arg(128)->Arg(0);
+BENCHMARK_CAPTURE(BM_Encode, jpeg, ImageFormat::kJPEG, &GUAC_PNG_DEFAULT_PROFILE)->Arg(128)->Arg(0);
+BENCHMARK_CAPTURE(BM_Encode, screen, ImageFormat::kScreen, &GUAC_PNG_DEFAULT_PROFILE)->Arg(128)->Arg(0);
+
+/**
+ * Base64 encodes a PNG image of a whole frame, as every image is for
+ * viewers of the text protocol.
+ */
+static void BM_WriteBase64(benchmark::State& state) {
+	ImageEncodeParams params;
+	params.layer = &default_layer;
+	params.png_profile = &GUAC_PNG_DEFAULT_PROFILE;
+
+	std::vector<unsigned char> png;
+	ImageEncoders::Get().Encode(GetFrames()[0], params, png);
+
+	ByteBuffer buffer;
+	Base64 base64(buffer);
+	for(auto _ : state) {
+		buffer.Clear();
+		base64.WriteBase64(png.data(), png.size());
+		base64.FlushBase64();
+		benchmark::DoNotOptimize(buffer.Data());
+	}
+
+	state.SetBytesProcessed(state.iterations() * png.size());
+}
+BENCHMARK(BM_WriteBase64);
+
+/**
+ * The surface a benchmark's VNC client draws to, like a GuacVNCClient
+ * whose framebuffer isn't shared.
+ */
+struct VNCBenchmarkViewer {
+	NullSocket socket;
+	guac_common_surface* surface = nullptr;
+	std::vector<unsigned char> cursor;
+	std::vector<unsigned char> cursor_png;
+	uint64_t cursor_bytes = 0;
+};
+
+static int vnc_viewer_key;
+
+static void OnVNCUpdate(rfbClient* client, int x, int y, int w, int h) {
+	VNCBenchmarkViewer* viewer = static_cast<VNCBenchmarkViewer*>(rfbClientGetClientData(client, &vnc_viewer_key));
+	if(viewer->surface->width != client->width || viewer->surface->height != client->height)
+		guac_common_surface_resize(viewer->surface, client->width, client->height);
+
+	// The client's pixel format is the same as the surface's, so nothing is converted
+	int stride = client->width * 4;
+	guac_common_surface_draw_pixels(viewer->surface, x, y, w, h, client->frameBuffer + y * stride + x * 4,
+									stride, 4, NULL, NULL);
+}
+
+static void OnVNCCopyRect(rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y) {
+	VNCBenchmarkViewer* viewer = static_cast<VNCBenchmarkViewer*>(rfbClientGetClientData(client, &vnc_viewer_key));
+	guac_common_surface_copy(viewer->surface, src_x, src_y, w, h, viewer->surface, dest_x, dest_y);
+}
+
+static void OnVNCCursor(rfbClient* client, int x, int y, int w, int h, int bpp) {
+	VNCBenchmarkViewer* viewer = static_cast<VNCBenchmarkViewer*>(rfbClientGetClientData(client, &vnc_viewer_key));
+
+	// Converted to ARGB and encoded as a PNG, like the cursor sent to viewers
+	int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, w);
+	viewer->cursor.resize(static_cast<size_t>(h) * stride);
+	for(int dy = 0; dy < h; dy++) {
+		uint32_t* row = reinterpret_cast<uint32_t*>(viewer->cursor.data() + dy * stride);
+		for(int dx = 0; dx < w; dx++) {
+			uint32_t pixel;
+			std::memcpy(&pixel, client->rcSource + (dy * w + dx) * bpp, sizeof(pixel));
+			row[dx] = (client->rcMask[dy * w + dx] ? 0xFF000000 : 0) | (pixel & 0xFFFFFF);
+		}
+	}
+	cairo_surface_t* image = cairo_image_surface_create_for_data(viewer->cursor.data(), CAIRO_FORMAT_ARGB32, w, h, stride);
+
+	ImageEncodeParams params;
+	params.layer = &default_layer;
+	params.png_profile = &GUAC_PNG_DEFAULT_PROFILE;
+	if(!ImageEncoders::Get().Encode(image, params, viewer->cursor_png))
+		viewer->cursor_bytes += viewer->cursor_png.size();
+	cairo_surface_destroy(image);
+
+	/* libvncclient does not free rcMask as it does rcSource */
+	free(client->rcMask);
+}
+
+/**
+ * Reads a workload's frames from a synthetic VNC server over loopback,
+ * draws them to a surface and flushes it after each one, which combines
+ * the updates and encodes them. The frames are the same on every run.
+ */
+static void BM_VNCWorkload(benchmark::State& state, SyntheticVNCServer::Workload workload) {
+	SyntheticVNCServer server(workload, 1024, 768);
+	uint16_t port = server.Start();
+	if(!port) {
+		state.SkipWithError("The VNC server couldn't listen");
+		return;
+	}
+
+	rfbClient* client = rfbGetClient(8, 3, 4);
+	VNCBenchmarkViewer viewer;
+	rfbClientSetClientData(client, &vnc_viewer_key, &viewer);
+	client->GotFrameBufferUpdate = OnVNCUpdate;
+	client->GotCopyRect = OnVNCCopyRect;
+	client->GotCursorShape = OnVNCCursor;
+	client->appData.useRemoteCursor = true;
+	client->canHandleNewFBSize = 1;
+	client->format.redShift = 16;
+	client->format.greenShift = 8;
+	client->format.blueShift = 0;
+	client->appData.encodingsString = strdup("copyrect raw");
+	client->serverHost = strdup("127.0.0.1");
+	client->serverPort = port;
+
+	// libvncclient frees the client if connecting fails
+	if(!rfbInitClient(client, NULL, NULL)) {
+		state.SkipWithError("Connecting to the VNC server failed");
+		return;
+	}
+	viewer.surface = guac_common_surface_alloc(viewer.socket, &default_layer, client->width, client->height);
+
+	// The whole screen that is asked for when connecting isn't measured
+	bool failed = WaitForMessage(client, 1000000) <= 0 || !HandleRFBServerMessage(client);
+	guac_common_surface_flush(viewer.surface);
+
+	for(auto _ : state) {
+		if(failed)
+			break;
+		SendFramebufferUpdateRequest(client, 0, 0, client->width, client->height, TRUE);
+		if(WaitForMessage(client, 1000000) <= 0 || !HandleRFBServerMessage(client)) {
+			failed = true;
+			break;
+		}
+		guac_common_surface_flush(viewer.surface);
+	}
+	if(failed)
+		state.SkipWithError("Reading from the VNC server failed");
+
+	state.SetItemsProcessed(state.iterations());
+	state.counters["sent_bytes"] = benchmark::Counter(viewer.socket.sent_bytes + viewer.cursor_bytes,
+													  benchmark::Counter::kAvgIterations);
+
+	rfbClientCleanup(client);
+	server.Stop();
+	guac_common_surface_free(viewer.surface);
+}
+BENCHMARK_CAPTURE(BM_VNCWorkload, static, SyntheticVNCServer::Workload::kStatic);
+BENCHMARK_CAPTURE(BM_VNCWorkload, scrolling, SyntheticVNCServer::Workload::kScrolling);
+BENCHMARK_CAPTURE(BM_VNCWorkload, window_drag, SyntheticVNCServer::Workload::kWindowDrag);
+BENCHMARK_CAPTURE(BM_VNCWorkload, video, SyntheticVNCServer::Workload::kVideo);
+BENCHMARK_CAPTURE(BM_VNCWorkload, cursor, SyntheticVNCServer::Workload::kCursor);
+BENCHMARK_CAPTURE(BM_VNCWorkload, resize, SyntheticVNCServer::Workload::kResize);
+
+/**
+ * Decodes the instructions sent by viewers, from the mouse moves that are
+ * sent the most often to long chat messages.
+ */
+static void BM_DecodeInstruction(benchmark::State& state, std::string instruction) {
+	std::array<std::string_view, GuacInstructionParser::MAX_GUAC_ELEMENTS> elements;
+	for(auto _ : state) {
+		size_t count = GuacInstructionParser::DecodeInstruction(instruction, elements);
+		benchmark::DoNotOptimize(count);
+	}
+
+	state.SetBytesProcessed(state.iterations() * instruction.length());
+}
+BENCHMARK_CAPTURE(BM_DecodeInstruction, mouse, std::string("5.mouse,3.512,3.384,1.0;"));
+BENCHMARK_CAPTURE(BM_DecodeInstruction, key, std::string("3.key,5.65293,1.1;"));
+BENCHMARK_CAPTURE(BM_DecodeInstruction, chat, "4.chat,100." + std::string(100, 'a') + ';');
+
+BENCHMARK_MAIN();
@@ -0,0 +1,327 @@
+/**
+ * Micro-benchmarks of broadcasting the display to a VM's viewers, without
+ * the network. A GuacBroadcastSocket is given mock viewers whose messages
+ * go to counting sinks instead of websockets, so only the cost of building
+ * the messages and handing them to each viewer is measured. Meant for
+ * comparing changes to how messages are shared and how the user list is
+ * read, which the load test can't separate from the network.
+ *
+ * Each benchmark reports the time per viewer per instruction and the
+ * allocations per iteration. Contention on the socket and the viewers'
+ * queues shows as the time per instruction growing with the threads.
+ *
+ * Built into bin/collab-vm-bench with the display pipeline benchmarks. The
+ * images come from the first screenshot in COLLABVM_BENCH_FRAMES, or are
+ * drawn synthetically when it isn't set.
+ */
+#include "CollabVMUser.h"
+#include "GuacBroadcastSocket.h"
+#include "ImageEncoder.h"
+#include "Metrics.h"
+#include "UserList.h"
+#include "guacamole/layer.h"
+#include "guacamole/protocol.h"
+
+#include <benchmark/benchmark.h>
+#include <cairo/cairo.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <websocketmm/websocket_user.h>
+
+/**
+ * Every allocation made by the benchmark binary, including the ones on the
+ * threads that send to the shards.
+ */
+static std::atomic<uint64_t> allocations { 0 };
+
+void* operator new(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if(void* ptr = std::malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+	std::free(ptr);
+}
+
+/**
+ * Stands in for the websocket_user of each viewer. A viewer's messages are
+ * queued under a lock of its own like they would be, and the last one is
+ * kept so its reference is taken and dropped like a queued message's.
+ */
+class CountingSink : public GuacMessageSink {
+   public:
+	explicit CountingSink(size_t viewers)
+		: viewers_(viewers) {
+	}
+
+	void SendGuacMessage(const CollabVMUser& user, const std::shared_ptr<const websocketmm::websocket_message>& message) override {
+		Viewer& viewer = viewers_[user.connection_index];
+		{
+			std::lock_guard<std::mutex> lock(viewer.lock);
+			viewer.last = message;
+			viewer.bytes += message->data.size();
+		}
+		delivered_.fetch_add(1, std::memory_order_release);
+	}
+
+	/**
+	 * Waits until the messages of the instructions that were just written
+	 * have reached every viewer, since rooms with shards send them later.
+	 *
+	 * @param messages The messages the caller expects to have been sent
+	 *                 since it last waited.
+	 */
+	void Wait(uint64_t messages) {
+		uint64_t target = expected_.fetch_add(messages, std::memory_order_relaxed) + messages;
+		while(delivered_.load(std::memory_order_acquire) < target)
+			std::this_thread::yield();
+	}
+
+	uint64_t GetBytes() {
+		uint64_t bytes = 0;
+		for(Viewer& viewer : viewers_) {
+			std::lock_guard<std::mutex> lock(viewer.lock);
+			bytes += viewer.bytes;
+		}
+		return bytes;
+	}
+
+   private:
+	struct alignas(64) Viewer {
+		std::mutex lock;
+		std::shared_ptr<const websocketmm::websocket_message> last;
+		uint64_t bytes = 0;
+	};
+
+	std::vector<Viewer> viewers_;
+	std::atomic<uint64_t> delivered_ { 0 };
+	std::atomic<uint64_t> expected_ { 0 };
+};
+
+/**
+ * A room of mock viewers watching a broadcast socket. The shards of large
+ * rooms are run by threads of their own, like the server's shards are by
+ * GuacBroadcastSocket::GetShardService().
+ */
+struct FanOutRoom {
+	explicit FanOutRoom(size_t viewers)
+		: sink(viewers),
+		  work(net::make_work_guard(context)),
+		  socket(sink, context, users, sent_bytes) {
+		for(size_t i = 0; i < viewers; i++) {
+			auto user = std::make_shared<CollabVMUser>(std::weak_ptr<websocketmm::websocket_user>(), ip_data);
+			user->connection_index = i;
+			users.AddUser(*user, [](CollabVMUser&) {});
+			members.push_back(std::move(user));
+		}
+
+		const size_t thread_count = std::max(1u, std::thread::hardware_concurrency() / 2);
+		for(size_t i = 0; i < thread_count; i++)
+			threads.emplace_back([this]() { context.run(); });
+	}
+
+	~FanOutRoom() {
+		work.reset();
+		for(std::thread& thread : threads)
+			thread.join();
+		for(const std::shared_ptr<CollabVMUser>& user : members)
+			users.RemoveUser(*user, [](CollabVMUser&) {});
+	}
+
+	CountingSink sink;
+	net::io_context context;
+	net::executor_work_guard<net::io_context::executor_type> work;
+	std::vector<std::thread> threads;
+
+	IPv4Data ip_data { 0x7f000001, false };
+	UserList users;
+	std::vector<std::shared_ptr<CollabVMUser>> members;
+	MetricCounter sent_bytes;
+	GuacBroadcastSocket socket;
+};
+
+static guac_layer default_layer = { 0 };
+
+/**
+ * Draws a tile with a background and a few dark boxes like glyphs, for
+ * when there's no screenshot.
+ */
+static cairo_surface_t* DrawSyntheticTile(int size, int tile) {
+	cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, size, size);
+	cairo_t* cr = cairo_create(surface);
+	cairo_set_source_rgb(cr, 0.9, 0.9, 0.5 + tile % 4 * 0.1);
+	cairo_paint(cr);
+
+	cairo_set_source_rgb(cr, 0.1, 0.1, 0.1);
+	for(int box = 0; box < 6; box++)
+		cairo_rectangle(cr, (box * 13 + tile * 7) % size, (box * 29 + tile * 3) % size, 8, 4);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+	cairo_surface_flush(surface);
+	return surface;
+}
+
+/**
+ * The PNG tiles that frames are made of, encoded once so that only
+ * writing and broadcasting them is measured.
+ */
+static const std::vector<std::vector<unsigned char>>& GetTiles() {
+	static std::vector<std::vector<unsigned char>> tiles = []() {
+		constexpr int kTileSize = 64;
+		constexpr int kTileCount = 16;
+
+		cairo_surface_t* screenshot = nullptr;
+		if(const char* dir = std::getenv("COLLABVM_BENCH_FRAMES")) {
+			std::vector<std::filesystem::path> paths;
+			for(const auto& entry : std::filesystem::directory_iterator(dir))
+				if(entry.path().extension() == ".png")
+					paths.push_back(entry.path());
+			if(!paths.empty()) {
+				screenshot = cairo_image_surface_create_from_png(std::min_element(paths.begin(), paths.end())->c_str());
+				if(cairo_surface_status(screenshot) != CAIRO_STATUS_SUCCESS ||
+				   cairo_image_surface_get_width(screenshot) < kTileSize * kTileCount ||
+				   cairo_image_surface_get_height(screenshot) < kTileSize) {
+					cairo_surface_destroy(screenshot);
+					screenshot = nullptr;
+				}
+			}
+		}
+
+		ImageEncodeParams params;
+		params.format = ImageFormat::kPNG;
+		params.layer = &default_layer;
+		params.png_profile = &GUAC_PNG_DEFAULT_PROFILE;
+
+		std::vector<std::vector<unsigned char>> tiles(kTileCount);
+		for(int i = 0; i < kTileCount; i++) {
+			cairo_surface_t* tile;
+			if(screenshot) {
+				tile = cairo_image_surface_create(CAIRO_FORMAT_RGB24, kTileSize, kTileSize);
+				cairo_t* cr = cairo_create(tile);
+				cairo_set_source_surface(cr, screenshot, -i * kTileSize, 0);
+				cairo_paint(cr);
+				cairo_destroy(cr);
+				cairo_surface_flush(tile);
+			} else {
+				tile = DrawSyntheticTile(kTileSize, i);
+			}
+			ImageEncoders::Get().Encode(tile, params, tiles[i]);
+			cairo_surface_destroy(tile);
+		}
+
+		if(screenshot)
+			cairo_surface_destroy(screenshot);
+		return tiles;
+	}();
+	return tiles;
+}
+
+/**
+ * Reports the time per viewer per instruction, the allocations per
+ * iteration and the bytes the viewers were sent.
+ */
+static void ReportFanOut(benchmark::State& state, FanOutRoom& room, size_t viewers, size_t instructions,
+						 uint64_t allocations_before) {
+	state.counters["per_viewer_instruction"] = benchmark::Counter(
+		static_cast<double>(viewers * instructions),
+		benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+	state.counters["allocations"] = benchmark::Counter(
+		static_cast<double>(allocations.load(std::memory_order_relaxed) - allocations_before),
+		benchmark::Counter::kAvgIterations);
+	state.counters["sent_bytes"] = benchmark::Counter(static_cast<double>(room.sink.GetBytes()),
+													  benchmark::Counter::kAvgIterations);
+}
+
+/**
+ * Broadcasts frames of images, copies and a sync, each as one message like
+ * the frames of GuacVNCClient, and waits for every viewer to be sent it.
+ *
+ * @param state.range(0) The number of viewers.
+ * @param state.range(1) The number of image tiles in each frame.
+ */
+static void BM_FanOutFrame(benchmark::State& state) {
+	const size_t viewers = state.range(0);
+	const int images = state.range(1);
+	const std::vector<std::vector<unsigned char>>& tiles = GetTiles();
+
+	FanOutRoom room(viewers);
+	GuacBroadcastSocket& socket = room.socket;
+
+	// Each image is an img, blob and end instruction
+	const size_t instructions = images * 3 + 2 + 1;
+	uint64_t allocations_before = allocations.load(std::memory_order_relaxed);
+	guac_timestamp timestamp = 0;
+	size_t frame = 0;
+	for(auto _ : state) {
+		socket.BeginFrame();
+		for(int i = 0; i < images; i++) {
+			guac_protocol_send_encoded_img(socket, GUAC_COMP_OVER, &default_layer, "image/png",
+										   i % 16 * 64, (i / 16 + frame) % 12 * 64, tiles[(i + frame) % tiles.size()]);
+		}
+		guac_protocol_send_copy(socket, &default_layer, 0, 64, 1024, 640, GUAC_COMP_OVER, &default_layer, 0, 0);
+		guac_protocol_send_copy(socket, &default_layer, 512, 0, 64, 64, GUAC_COMP_OVER, &default_layer, 0, 704);
+		guac_protocol_send_sync(socket, timestamp += 33);
+		socket.EndFrame();
+		room.sink.Wait(viewers);
+		frame++;
+	}
+
+	ReportFanOut(state, room, viewers, instructions, allocations_before);
+}
+BENCHMARK(BM_FanOutFrame)
+	->ArgsProduct({ { 1, 16, 64, 256, 1024 }, { 1, 16 } })
+	->UseRealTime();
+
+/**
+ * Broadcasts instructions written outside of a frame, which are each sent
+ * as a message of their own, like the cursor. With more than one thread,
+ * the threads write to the same socket, so they contend for its lock and
+ * the viewers' queues like the VNC thread and the cursor timer do.
+ *
+ * @param state.range(0) The number of viewers.
+ */
+static void BM_FanOutInstruction(benchmark::State& state) {
+	const size_t viewers = state.range(0);
+
+	// The room is shared by the benchmark's threads
+	static std::unique_ptr<FanOutRoom> room;
+	static uint64_t allocations_before;
+	if(state.thread_index() == 0) {
+		room = std::make_unique<FanOutRoom>(viewers);
+		allocations_before = allocations.load(std::memory_order_relaxed);
+	}
+
+	// Google Benchmark starts the threads' loops together, after the setup above
+	int x = state.thread_index();
+	for(auto _ : state) {
+		guac_protocol_send_move(room->socket, &default_layer, &default_layer, x = (x + 7) % 1024, 0, 0);
+		room->sink.Wait(viewers);
+	}
+
+	if(state.thread_index() == 0) {
+		ReportFanOut(state, *room, viewers, 1, allocations_before);
+		room.reset();
+	}
+}
+BENCHMARK(BM_FanOutInstruction)
+	->Arg(16)
+	->Arg(256)
+	->Arg(1024)
+	->ThreadRange(1, 4)
+	->UseRealTime();
@@ -0,0 +1,697 @@
+/**
+ * Opens many viewer connections to a running server to measure how many
+ * of them it can keep up with. Each viewer joins a VM like the web client
+ * does, and some of them can read slowly, chat or ask for turns.
+ *
+ * Built with "make bench", and run as:
+ *   collab-vm-loadtest [options] <vm>
+ *
+ * Every second it prints the number of viewers connected, how fast they
+ * receive data and how long chat messages took to reach them. Chat messages
+ * carry the time they were sent, so the latency is measured to every viewer
+ * rather than only to the sender. With --metrics-token, it also prints the
+ * bytes queued for sending, the actions waiting for the processing thread,
+ * and how long actions waited for it and took to handle, from the server's
+ * /metrics endpoint.
+ *
+ * With --action-rate, a steady number of chat, turn and rename actions per
+ * second is also sent from the connected viewers in turn, mixed in the
+ * proportions given by --mix, to find the rate at which the processing
+ * thread stops keeping up.
+ *
+ * Every connection comes from the same address, so the server's limits on
+ * connections and chat messages per IP need to be raised for large tests.
+ */
+#include <websocketmm/beast/beast.h>
+#include <websocketmm/beast/net.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using std::chrono::steady_clock;
+
+struct Options {
+	std::string host = "127.0.0.1";
+	std::string port = "6004";
+	std::string vm;
+	std::string metrics_token;
+	size_t clients = 100;
+	size_t connect_rate = 100;
+	size_t threads = std::max(1u, std::thread::hardware_concurrency());
+	int duration = 60;
+	bool binary = false;
+
+	/**
+	 * The fraction of viewers that read slowly, and how many bytes
+	 * per second each of them reads.
+	 */
+	double slow_fraction = 0;
+	size_t slow_rate = 64 * 1024;
+
+	/**
+	 * How many viewers send chat messages, and how often each sends one.
+	 */
+	size_t chat_clients = 1;
+	int chat_interval = 1000;
+
+	/**
+	 * How often each viewer asks for a turn, in milliseconds, or 0 to never.
+	 */
+	int turn_interval = 0;
+
+	/**
+	 * How many actions are sent each second by the viewers in turn, or 0
+	 * for none, and the weights of chat messages, turn requests and
+	 * renames among them.
+	 */
+	size_t action_rate = 0;
+	double mix[3] = { 70, 20, 10 };
+};
+
+/**
+ * The kinds of actions sent at the action rate, in the order of their weights.
+ */
+enum class ActionKind {
+	kChat,
+	kTurn,
+	kRename
+};
+
+/**
+ * The counters shared by every viewer, which are reset by the reporter
+ * after each interval except for the connection counts.
+ */
+struct Stats {
+	std::atomic<size_t> connected { 0 };
+	std::atomic<size_t> failed { 0 };
+	std::atomic<size_t> closed { 0 };
+	std::atomic<uint64_t> bytes { 0 };
+	std::atomic<uint64_t> messages { 0 };
+
+	/**
+	 * The microseconds each chat message took to reach each viewer.
+	 */
+	std::vector<uint32_t> latencies;
+	std::mutex mutex;
+
+	void AddLatency(uint32_t latency) {
+		std::lock_guard<std::mutex> lock(mutex);
+		latencies.push_back(latency);
+	}
+};
+
+static const steady_clock::time_point start_time = steady_clock::now();
+
+static uint64_t GetMicroseconds() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now() - start_time).count();
+}
+
+/**
+ * Appends an element of an instruction, with its length in characters.
+ */
+static void AppendElement(std::string& instr, std::string_view element) {
+	instr += std::to_string(element.length());
+	instr += '.';
+	instr += element;
+}
+
+/**
+ * Splits a message into instructions and calls handler with the elements
+ * of each one. Lengths are counted in Unicode characters, like the web
+ * client does.
+ */
+template<typename Handler>
+static void ParseInstructions(std::string_view message, Handler handler) {
+	std::vector<std::string_view> elements;
+	size_t i = 0;
+	while(i < message.length()) {
+		size_t dot = message.find('.', i);
+		if(dot == std::string_view::npos)
+			return;
+
+		size_t length = std::strtoul(message.data() + i, nullptr, 10);
+		size_t end = dot + 1;
+		for(size_t chars = 0; chars < length && end < message.length(); chars++) {
+			// Skip the continuation bytes of UTF-8 characters
+			end++;
+			while(end < message.length() && (message[end] & 0xC0) == 0x80)
+				end++;
+		}
+		if(end >= message.length())
+			return;
+
+		elements.push_back(message.substr(dot + 1, end - dot - 1));
+		i = end + 1;
+		if(message[end] == ';') {
+			handler(elements);
+			elements.clear();
+		} else if(message[end] != ',') {
+			return;
+		}
+	}
+}
+
+/**
+ * A viewer, which joins the VM and reads everything the server sends.
+ * Its handlers run on its own strand.
+ */
+class LoadClient : public std::enable_shared_from_this<LoadClient> {
+   public:
+	LoadClient(net::io_context& io_context, const Options& options, Stats& stats, bool slow, bool chatter)
+		: options_(options),
+		  stats_(stats),
+		  slow_(slow),
+		  chatter_(chatter),
+		  ws_(net::make_strand(io_context)),
+		  read_timer_(ws_.get_executor()),
+		  chat_timer_(ws_.get_executor()),
+		  turn_timer_(ws_.get_executor()),
+		  writing_(false),
+		  connected_(false) {
+	}
+
+	/**
+	 * Sends an action from the viewer's strand, if it's still connected.
+	 */
+	void PostAction(ActionKind kind) {
+		net::post(ws_.get_executor(), [self = shared_from_this(), kind]() {
+			if(!self->connected_)
+				return;
+
+			switch(kind) {
+				case ActionKind::kChat:
+					self->SendChat();
+					break;
+				case ActionKind::kTurn:
+					self->Send("4.turn;");
+					break;
+				case ActionKind::kRename: {
+					// Names are unique so that every rename is accepted
+					static std::atomic<uint32_t> renames { 0 };
+					std::string rename = "6.rename,";
+					AppendElement(rename, "load" + std::to_string(renames++));
+					rename += ';';
+					self->Send(std::move(rename));
+					break;
+				}
+			}
+		});
+	}
+
+	void Start(const tcp::resolver::results_type& endpoints) {
+		beast::get_lowest_layer(ws_).expires_after(std::chrono::seconds(30));
+		beast::get_lowest_layer(ws_).async_connect(endpoints,
+			[self = shared_from_this()](beast::error_code ec, const tcp::endpoint&) {
+				self->OnConnect(ec);
+			});
+	}
+
+   private:
+	void OnConnect(beast::error_code ec) {
+		if(ec)
+			return Fail();
+
+		beast::get_lowest_layer(ws_).expires_never();
+		ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::client));
+		ws_.set_option(websocket::stream_base::decorator([this](websocket::request_type& request) {
+			request.set(http::field::sec_websocket_protocol, options_.binary ? "guacamole-binary" : "guacamole");
+		}));
+		ws_.read_message_max(64 * 1024 * 1024);
+		ws_.async_handshake(options_.host + ':' + options_.port, "/",
+			[self = shared_from_this()](beast::error_code ec) {
+				self->OnHandshake(ec);
+			});
+	}
+
+	void OnHandshake(beast::error_code ec) {
+		if(ec)
+			return Fail();
+
+		connected_ = true;
+		stats_.connected++;
+
+		// Let the server pick a username, then join the VM
+		Send("6.rename;");
+		std::string connect = "7.connect,";
+		AppendElement(connect, options_.vm);
+		connect += ';';
+		Send(std::move(connect));
+
+		if(chatter_)
+			ScheduleChat();
+		if(options_.turn_interval)
+			ScheduleTurn();
+		Read();
+	}
+
+	void Read() {
+		ws_.async_read(buffer_, [self = shared_from_this()](beast::error_code ec, size_t bytes) {
+			self->OnRead(ec, bytes);
+		});
+	}
+
+	void OnRead(beast::error_code ec, size_t bytes) {
+		if(ec)
+			return Fail();
+
+		stats_.bytes += bytes;
+		stats_.messages++;
+
+		// Images are in binary messages, which don't need to be parsed
+		if(ws_.got_text()) {
+			std::string_view message(static_cast<const char*>(buffer_.data().data()), buffer_.size());
+			ParseInstructions(message, [this](const std::vector<std::string_view>& elements) {
+				HandleInstruction(elements);
+			});
+		}
+		buffer_.consume(buffer_.size());
+
+		if(!slow_)
+			return Read();
+
+		// Wait as long as reading the message would take at the slow rate,
+		// which leaves the rest of the data in the socket's buffers
+		read_timer_.expires_after(std::chrono::microseconds(bytes * 1000000 / options_.slow_rate));
+		read_timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+			if(!ec)
+				self->Read();
+		});
+	}
+
+	void HandleInstruction(const std::vector<std::string_view>& elements) {
+		if(elements[0] == "nop") {
+			// The server disconnects viewers that don't respond
+			Send("3.nop;");
+		} else if(elements[0] == "chat" && elements.size() == 3) {
+			// Load test messages are "load" followed by when they were sent
+			std::string_view text = elements[2];
+			if(text.substr(0, 4) == "load") {
+				uint64_t sent = std::strtoull(std::string(text.substr(4)).c_str(), nullptr, 10);
+				uint64_t now = GetMicroseconds();
+				if(sent && now >= sent)
+					stats_.AddLatency(static_cast<uint32_t>(std::min<uint64_t>(now - sent, UINT32_MAX)));
+			}
+		}
+	}
+
+	void ScheduleChat() {
+		chat_timer_.expires_after(std::chrono::milliseconds(options_.chat_interval));
+		chat_timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+			if(ec || !self->connected_)
+				return;
+
+			self->SendChat();
+			self->ScheduleChat();
+		});
+	}
+
+	void SendChat() {
+		std::string chat = "4.chat,";
+		AppendElement(chat, "load" + std::to_string(GetMicroseconds()));
+		chat += ';';
+		Send(std::move(chat));
+	}
+
+	void ScheduleTurn() {
+		turn_timer_.expires_after(std::chrono::milliseconds(options_.turn_interval));
+		turn_timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+			if(ec || !self->connected_)
+				return;
+
+			self->Send("4.turn;");
+			self->ScheduleTurn();
+		});
+	}
+
+	/**
+	 * Queues an instruction to be sent, since only one write can be
+	 * in progress at a time.
+	 */
+	void Send(std::string instr) {
+		write_queue_.push_back(std::move(instr));
+		if(!writing_)
+			Write();
+	}
+
+	void Write() {
+		writing_ = true;
+		ws_.text(true);
+		ws_.async_write(net::buffer(write_queue_.front()), [self = shared_from_this()](beast::error_code ec, size_t) {
+			if(ec)
+				return self->Fail();
+
+			self->write_queue_.pop_front();
+			self->writing_ = false;
+			if(!self->write_queue_.empty())
+				self->Write();
+		});
+	}
+
+	void Fail() {
+		if(connected_) {
+			connected_ = false;
+			stats_.connected--;
+			stats_.closed++;
+		} else if(!failed_) {
+			stats_.failed++;
+		}
+		failed_ = true;
+		read_timer_.cancel();
+		chat_timer_.cancel();
+		turn_timer_.cancel();
+	}
+
+	const Options& options_;
+	Stats& stats_;
+	const bool slow_;
+	const bool chatter_;
+
+	websocket::stream<beast::tcp_stream> ws_;
+	beast::flat_buffer buffer_;
+	net::steady_timer read_timer_;
+	net::steady_timer chat_timer_;
+	net::steady_timer turn_timer_;
+
+	std::deque<std::string> write_queue_;
+	bool writing_;
+	bool connected_;
+	bool failed_ = false;
+};
+
+/**
+ * Finds the value of a sample in metrics in the Prometheus text format.
+ *
+ * @param sample The name and labels of the sample.
+ * @return The value, or -1 if the sample wasn't found.
+ */
+static double FindSample(const std::string& metrics, const std::string& sample) {
+	size_t pos = 0;
+	while((pos = metrics.find(sample + ' ', pos)) != std::string::npos) {
+		if(pos == 0 || metrics[pos - 1] == '\n')
+			return std::strtod(metrics.c_str() + pos + sample.length() + 1, nullptr);
+		pos += sample.length();
+	}
+	return -1;
+}
+
+/**
+ * Gets the server's metrics, or an empty string if they couldn't be read.
+ */
+static std::string FetchMetrics(const Options& options) {
+	try {
+		net::io_context io_context;
+		tcp::resolver resolver(io_context);
+		beast::tcp_stream stream(io_context);
+		stream.expires_after(std::chrono::seconds(5));
+		stream.connect(resolver.resolve(options.host, options.port));
+
+		http::request<http::empty_body> request(http::verb::get, "/metrics", 11);
+		request.set(http::field::host, options.host);
+		request.set(http::field::authorization, "Bearer " + options.metrics_token);
+		http::write(stream, request);
+
+		beast::flat_buffer buffer;
+		http::response<http::string_body> response;
+		http::read(stream, buffer, response);
+		beast::error_code ec;
+		stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+		return response.result() == http::status::ok ? response.body() : std::string();
+	} catch(const std::exception&) {
+		return std::string();
+	}
+}
+
+/**
+ * Finds the cumulative buckets of a histogram in metrics in the Prometheus
+ * text format, in order of their upper bounds.
+ */
+static std::vector<std::pair<double, double>> FindHistogram(const std::string& metrics, const std::string& name) {
+	std::vector<std::pair<double, double>> buckets;
+	const std::string prefix = name + "_bucket{le=\"";
+	size_t pos = 0;
+	while((pos = metrics.find(prefix, pos)) != std::string::npos) {
+		size_t start = pos;
+		pos += prefix.length();
+		if(start != 0 && metrics[start - 1] != '\n')
+			continue;
+
+		size_t quote = metrics.find('"', pos);
+		if(quote == std::string::npos || metrics.compare(quote, 3, "\"} ") != 0)
+			break;
+		std::string bound = metrics.substr(pos, quote - pos);
+		double le = bound == "+Inf" ? HUGE_VAL : std::strtod(bound.c_str(), nullptr);
+		buckets.emplace_back(le, std::strtod(metrics.c_str() + quote + 3, nullptr));
+	}
+	return buckets;
+}
+
+/**
+ * Estimates a percentile of the durations observed between two readings of
+ * a histogram, as the upper bound of the bucket it falls in.
+ *
+ * @return The duration in milliseconds, or 0 if nothing was observed.
+ */
+static double HistogramPercentile(const std::vector<std::pair<double, double>>& before,
+								  const std::vector<std::pair<double, double>>& after, double percentile) {
+	if(after.empty())
+		return 0;
+	auto count = [&](size_t i) {
+		return after[i].second - (i < before.size() ? before[i].second : 0);
+	};
+	double total = count(after.size() - 1);
+	if(total <= 0)
+		return 0;
+	for(size_t i = 0; i < after.size(); i++)
+		if(count(i) >= total * percentile)
+			return after[i].first * 1e3;
+	return HUGE_VAL;
+}
+
+static uint32_t Percentile(const std::vector<uint32_t>& sorted, double percentile) {
+	if(sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, static_cast<size_t>(sorted.size() * percentile))];
+}
+
+static void PrintUsage(const char* name) {
+	std::cerr << "Usage: " << name << " [options] <vm>\n"
+			  << "  --host HOST              The server's address (default 127.0.0.1)\n"
+			  << "  --port PORT              The server's port (default 6004)\n"
+			  << "  --clients N              How many viewers to connect (default 100)\n"
+			  << "  --connect-rate N         Viewers connected per second (default 100)\n"
+			  << "  --duration S             Seconds to run for after connecting (default 60)\n"
+			  << "  --threads N              Threads for the viewers (default: one per core)\n"
+			  << "  --binary                 Use the binary subprotocol\n"
+			  << "  --slow F                 The fraction of viewers that read slowly (default 0)\n"
+			  << "  --slow-rate B            Bytes per second each slow viewer reads (default 65536)\n"
+			  << "  --chat-clients N         How many viewers send chat messages (default 1)\n"
+			  << "  --chat-interval MS       Milliseconds between each one's messages (default 1000)\n"
+			  << "  --turn-interval MS       Milliseconds between each viewer's turn requests (default 0 = never)\n"
+			  << "  --action-rate N          Actions sent per second by the viewers in turn (default 0)\n"
+			  << "  --mix C,T,R              The weights of chats, turns and renames among them (default 70,20,10)\n"
+			  << "  --metrics-token TOKEN    The server's metrics token, to report its send queues\n";
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+	for(int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if(arg == "--host" && has_value)
+			options.host = argv[++i];
+		else if(arg == "--port" && has_value)
+			options.port = argv[++i];
+		else if(arg == "--clients" && has_value)
+			options.clients = std::strtoul(argv[++i], nullptr, 10);
+		else if(arg == "--connect-rate" && has_value)
+			options.connect_rate = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+		else if(arg == "--duration" && has_value)
+			options.duration = std::atoi(argv[++i]);
+		else if(arg == "--threads" && has_value)
+			options.threads = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+		else if(arg == "--binary")
+			options.binary = true;
+		else if(arg == "--slow" && has_value)
+			options.slow_fraction = std::atof(argv[++i]);
+		else if(arg == "--slow-rate" && has_value)
+			options.slow_rate = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+		else if(arg == "--chat-clients" && has_value)
+			options.chat_clients = std::strtoul(argv[++i], nullptr, 10);
+		else if(arg == "--chat-interval" && has_value)
+			options.chat_interval = std::max(1, std::atoi(argv[++i]));
+		else if(arg == "--turn-interval" && has_value)
+			options.turn_interval = std::max(0, std::atoi(argv[++i]));
+		else if(arg == "--action-rate" && has_value)
+			options.action_rate = std::strtoul(argv[++i], nullptr, 10);
+		else if(arg == "--mix" && has_value) {
+			char* weights = argv[++i];
+			for(double& weight : options.mix) {
+				weight = std::max(0.0, std::strtod(weights, &weights));
+				if(*weights == ',')
+					weights++;
+			}
+		} else if(arg == "--metrics-token" && has_value)
+			options.metrics_token = argv[++i];
+		else if(arg[0] != '-' && options.vm.empty())
+			options.vm = arg;
+		else {
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(options.vm.empty()) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+
+	net::io_context io_context;
+	tcp::resolver::results_type endpoints;
+	try {
+		endpoints = tcp::resolver(io_context).resolve(options.host, options.port);
+	} catch(const std::exception& e) {
+		std::cerr << "Failed to resolve " << options.host << ": " << e.what() << std::endl;
+		return 1;
+	}
+
+	Stats stats;
+	auto work = net::make_work_guard(io_context);
+	std::vector<std::thread> threads;
+	for(size_t i = 0; i < options.threads; i++)
+		threads.emplace_back([&io_context]() { io_context.run(); });
+
+	// Viewers are connected at a steady rate from their own thread, since
+	// connecting thousands at once would just test the listen backlog
+	std::vector<std::shared_ptr<LoadClient>> clients;
+	std::mutex clients_mutex;
+	std::atomic<bool> running(true);
+	std::thread connector([&]() {
+		size_t slow = static_cast<size_t>(options.clients * options.slow_fraction);
+		auto next = steady_clock::now();
+		for(size_t i = 0; i < options.clients; i++) {
+			// Slow viewers are the last ones, and chatters are never slow
+			bool is_slow = i >= options.clients - slow;
+			bool chatter = i < options.chat_clients && !is_slow;
+			auto client = std::make_shared<LoadClient>(io_context, options, stats, is_slow, chatter);
+			client->Start(endpoints);
+			{
+				std::lock_guard<std::mutex> lock(clients_mutex);
+				clients.push_back(std::move(client));
+			}
+			next += std::chrono::microseconds(1000000 / options.connect_rate);
+			std::this_thread::sleep_until(next);
+		}
+	});
+
+	// Actions are sent in small batches so the rate stays steady
+	std::thread actions([&]() {
+		double total_weight = options.mix[0] + options.mix[1] + options.mix[2];
+		if(!options.action_rate || total_weight <= 0)
+			return;
+
+		uint64_t sent = 0;
+		size_t next_client = 0;
+		uint32_t seed = 1;
+		auto start = steady_clock::now();
+		while(running) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			double elapsed = std::chrono::duration<double>(steady_clock::now() - start).count();
+			std::lock_guard<std::mutex> lock(clients_mutex);
+			for(; sent < elapsed * options.action_rate && !clients.empty(); sent++) {
+				seed = seed * 1103515245 + 12345;
+				double choice = (seed >> 8) % 10000 / 10000.0 * total_weight;
+				ActionKind kind = choice < options.mix[0]					? ActionKind::kChat
+								  : choice < options.mix[0] + options.mix[1] ? ActionKind::kTurn
+																			 : ActionKind::kRename;
+				clients[next_client++ % clients.size()]->PostAction(kind);
+			}
+		}
+	});
+
+	std::cout << "time  connected  failed  closed  recv-MB/s  msgs/s  chat-p50-ms  chat-p99-ms  chat-max-ms";
+	if(!options.metrics_token.empty())
+		std::cout << "  send-queue-MB  actions-queued  wait-p50-ms  wait-p99-ms  action-p99-ms";
+	std::cout << std::endl;
+
+	std::string first_metrics = options.metrics_token.empty() ? std::string() : FetchMetrics(options);
+	auto first_wait = FindHistogram(first_metrics, "collabvm_action_wait_seconds");
+	auto first_action = FindHistogram(first_metrics, "collabvm_action_seconds");
+	auto last_wait = first_wait, last_action = first_action;
+
+	int connect_seconds = (options.clients + options.connect_rate - 1) / options.connect_rate;
+	std::vector<uint32_t> all_latencies;
+	double peak_queue = 0;
+	for(int second = 1; second <= connect_seconds + options.duration; second++) {
+		std::this_thread::sleep_until(start_time + std::chrono::seconds(second));
+
+		std::vector<uint32_t> latencies;
+		{
+			std::lock_guard<std::mutex> lock(stats.mutex);
+			latencies.swap(stats.latencies);
+		}
+		std::sort(latencies.begin(), latencies.end());
+		all_latencies.insert(all_latencies.end(), latencies.begin(), latencies.end());
+
+		std::cout << std::setw(4) << second << std::setw(11) << stats.connected << std::setw(8) << stats.failed
+				  << std::setw(8) << stats.closed << std::fixed << std::setprecision(2) << std::setw(11)
+				  << stats.bytes.exchange(0) / 1e6 << std::setw(8) << stats.messages.exchange(0) << std::setw(13)
+				  << Percentile(latencies, 0.5) / 1e3 << std::setw(13) << Percentile(latencies, 0.99) / 1e3
+				  << std::setw(13) << (latencies.empty() ? 0 : latencies.back()) / 1e3;
+
+		if(!options.metrics_token.empty()) {
+			std::string metrics = FetchMetrics(options);
+			double queue = FindSample(metrics, "collabvm_memory_live_bytes{category=\"send_queue\"}");
+			double actions = FindSample(metrics, "collabvm_actions_queued");
+			peak_queue = std::max(peak_queue, queue);
+			std::cout << std::setw(15) << queue / 1e6 << std::setw(16) << actions;
+
+			// The percentiles are of the actions handled during the last second
+			auto wait = FindHistogram(metrics, "collabvm_action_wait_seconds");
+			auto action = FindHistogram(metrics, "collabvm_action_seconds");
+			if(!wait.empty() && !action.empty()) {
+				std::cout << std::setw(13) << HistogramPercentile(last_wait, wait, 0.5) << std::setw(13)
+						  << HistogramPercentile(last_wait, wait, 0.99) << std::setw(15)
+						  << HistogramPercentile(last_action, action, 0.99);
+				last_wait = std::move(wait);
+				last_action = std::move(action);
+			}
+		}
+		std::cout << std::endl;
+	}
+
+	std::sort(all_latencies.begin(), all_latencies.end());
+	std::cout << "\nChat deliveries: " << all_latencies.size() << ", p50 " << Percentile(all_latencies, 0.5) / 1e3
+			  << " ms, p99 " << Percentile(all_latencies, 0.99) / 1e3 << " ms, p99.9 "
+			  << Percentile(all_latencies, 0.999) / 1e3 << " ms" << std::endl;
+	if(!options.metrics_token.empty()) {
+		std::cout << "Peak send queue: " << peak_queue / 1e6 << " MB" << std::endl;
+		std::cout << "Action wait: p50 " << HistogramPercentile(first_wait, last_wait, 0.5) << " ms, p99 "
+				  << HistogramPercentile(first_wait, last_wait, 0.99) << " ms, p99.9 "
+				  << HistogramPercentile(first_wait, last_wait, 0.999) << " ms" << std::endl;
+		std::cout << "Action time: p50 " << HistogramPercentile(first_action, last_action, 0.5) << " ms, p99 "
+				  << HistogramPercentile(first_action, last_action, 0.99) << " ms, p99.9 "
+				  << HistogramPercentile(first_action, last_action, 0.999) << " ms" << std::endl;
+	}
+
+	// The viewers are abandoned rather than closed, like a crowd leaving at once
+	running = false;
+	actions.join();
+	connector.join();
+	io_context.stop();
+	for(std::thread& thread : threads)
+		thread.join();
+	return 0;
+}
@@ -0,0 +1,253 @@
+/**
+ * Replays a recording of a VM's display through the surfaces and encoders
+ * as fast as possible, to compare how changes to them perform on the same
+ * workload. Recordings are made from the admin panel with the "Start Display
+ * Recording" VM action, and saved to the recordings directory.
+ *
+ * Built with "make bench", and run as:
+ *   collab-vm-replay [options] <recording>
+ *
+ * The surfaces are given the recorded timestamps, so they decide when to
+ * use lossy images and refine them the same way on every run.
+ */
+#include "EncoderPool.h"
+#include "GuacSocket.h"
+#include "ImageEncoder.h"
+#include "RFBRecording.h"
+#include "guacamole/guac_surface.h"
+#include "guacamole/layer.h"
+#include "guacamole/protocol.h"
+#include "guacamole/timestamp.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <sys/resource.h>
+#include <time.h>
+
+/**
+ * A socket that counts the bytes of the instructions written to it, in
+ * both the text and binary protocols, and throws them away.
+ */
+class CountingSocket : public GuacSocket {
+   public:
+	CountingSocket() {
+		binary_enabled_ = true;
+	}
+
+	void InstructionBegin() override {
+		mutex_.lock();
+	}
+
+	void InstructionEnd() override {
+		text_bytes += buffer_.Size();
+		binary_bytes += binary_buffer_.Size();
+		ClearBuffers();
+		mutex_.unlock();
+	}
+
+	uint64_t text_bytes = 0;
+	uint64_t binary_bytes = 0;
+};
+
+/**
+ * Wraps the backends that encode each format, to add up the CPU time
+ * spent encoding on every thread.
+ */
+class TimingImageEncoder : public ImageEncoder {
+   public:
+	TimingImageEncoder() {
+		for(size_t i = 0; i < static_cast<size_t>(ImageFormat::kCount); i++)
+			encoders_[i] = &ImageEncoders::Get().For(static_cast<ImageFormat>(i));
+	}
+
+	const char* GetName() const override {
+		return "timing";
+	}
+
+	bool Probe() override {
+		return true;
+	}
+
+	bool Supports(ImageFormat format) const override {
+		return true;
+	}
+
+	int Encode(cairo_surface_t* surface, const ImageEncodeParams& params,
+			   std::vector<unsigned char>& buffer) override {
+		int64_t start = GetThreadTime();
+		int result = encoders_[static_cast<size_t>(params.format)]->Encode(surface, params, buffer);
+		cpu_time_ += GetThreadTime() - start;
+		images_++;
+		return result;
+	}
+
+	/**
+	 * The CPU time spent encoding, in nanoseconds.
+	 */
+	int64_t GetCPUTime() const {
+		return cpu_time_;
+	}
+
+	uint64_t GetImages() const {
+		return images_;
+	}
+
+   private:
+	static int64_t GetThreadTime() {
+		timespec time;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+		return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+	}
+
+	ImageEncoder* encoders_[static_cast<size_t>(ImageFormat::kCount)];
+	std::atomic<int64_t> cpu_time_ { 0 };
+	std::atomic<uint64_t> images_ { 0 };
+};
+
+static void PrintUsage(const char* name) {
+	std::cerr << "Usage: " << name << " [options] <recording>\n"
+			  << "  --threads N            Encode with N encoder threads (default 0)\n"
+			  << "  --jpeg-quality Q       The JPEG quality, or above 100 to only send PNG (default 75)\n"
+			  << "  --refine-delay MS      Resend lossy images as PNG after MS, or 0 to never (default 1000)\n"
+			  << "  --no-tile-diffing      Mark the bounding box of changes dirty instead of each tile\n"
+			  << "  --no-scroll-detection  Don't send scrolled content as copies\n";
+}
+
+static double GetProcessTime() {
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		   (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+	const char* path = nullptr;
+	size_t threads = 0;
+	for(int i = 1; i < argc; i++) {
+		bool has_value = i + 1 < argc;
+		if(!std::strcmp(argv[i], "--threads") && has_value) {
+			threads = std::strtoul(argv[++i], nullptr, 10);
+		} else if(!std::strcmp(argv[i], "--jpeg-quality") && has_value) {
+			SetJPEGQuality(std::min(std::atoi(argv[++i]), 255));
+		} else if(!std::strcmp(argv[i], "--refine-delay") && has_value) {
+			guac_common_surface_set_refine_delay(std::atoi(argv[++i]));
+		} else if(!std::strcmp(argv[i], "--no-tile-diffing")) {
+			guac_common_surface_set_tile_diffing(0);
+		} else if(!std::strcmp(argv[i], "--no-scroll-detection")) {
+			guac_common_surface_set_scroll_detection(0);
+		} else if(argv[i][0] != '-' && !path) {
+			path = argv[i];
+		} else {
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(!path) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+
+	RFBRecordingReader reader;
+	if(!reader.Open(path)) {
+		std::cerr << "Failed to open the recording " << path << std::endl;
+		return 1;
+	}
+
+	EncoderPool::Get().SetThreadCount(threads);
+	auto timing = std::make_unique<TimingImageEncoder>();
+	TimingImageEncoder& encoder = *timing;
+	ImageEncoders::Get().Add(std::move(timing));
+
+	guac_layer default_layer = { 0 };
+	CountingSocket socket;
+	guac_common_surface* surface = nullptr;
+
+	// The recorded delays are added to an arbitrary start time
+	guac_timestamp timestamp = 1000000;
+	uint64_t delay = 0;
+	uint64_t frames = 0;
+	uint64_t updates = 0;
+	bool corrupt = false;
+
+	double cpu_start = GetProcessTime();
+	auto start = std::chrono::steady_clock::now();
+
+	RFBRecord record;
+	for(;;) {
+		if(!reader.Next(record)) {
+			// Running out of records between them is the normal end
+			corrupt = !reader.AtEnd();
+			break;
+		}
+
+		delay += record.delay;
+		timestamp += delay / 1000;
+		delay %= 1000;
+		guac_timestamp_set_fixed(timestamp);
+
+		if(record.type == RFBRecordType::kSize) {
+			if(surface)
+				guac_common_surface_resize(surface, record.width, record.height);
+			else
+				surface = guac_common_surface_alloc(socket, &default_layer, record.width, record.height);
+			continue;
+		}
+
+		// Recordings always start with the size of the screen
+		if(!surface) {
+			corrupt = true;
+			break;
+		}
+
+		switch(record.type) {
+			case RFBRecordType::kUpdate:
+				guac_common_surface_draw_pixels(surface, record.x, record.y, record.width, record.height,
+												record.pixels.data(), record.width * 4, 4, NULL, NULL);
+				updates++;
+				break;
+
+			case RFBRecordType::kCopy:
+				guac_common_surface_copy(surface, record.x, record.y, record.width, record.height,
+										 surface, record.dest_x, record.dest_y);
+				updates++;
+				break;
+
+			case RFBRecordType::kFrame:
+				// Flushed like the VNC thread does at the end of each frame
+				if(surface->dirty || surface->queue_length)
+					guac_common_surface_flush(surface);
+				guac_common_surface_refine(surface);
+				frames++;
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double cpu_seconds = GetProcessTime() - cpu_start;
+	guac_timestamp_set_fixed(0);
+	if(surface)
+		guac_common_surface_free(surface);
+
+	if(corrupt)
+		std::cerr << "The recording is corrupt, only the records before the error were replayed" << std::endl;
+
+	std::cout << "Frames:           " << frames << " (" << updates << " updates)\n"
+			  << "Time:             " << seconds << " s, " << (seconds > 0 ? frames / seconds : 0) << " frames/s\n"
+			  << "Text bytes out:   " << socket.text_bytes << '\n'
+			  << "Binary bytes out: " << socket.binary_bytes << '\n'
+			  << "Images encoded:   " << encoder.GetImages() << '\n'
+			  << "Encode CPU:       " << encoder.GetCPUTime() / 1e9 << " s\n"
+			  << "Total CPU:        " << cpu_seconds << " s" << std::endl;
+	return corrupt ? 1 : 0;
+}
@@ -0,0 +1,532 @@
+#include "SyntheticVNCServer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const char* const kWorkloadNames[] = { "static", "scrolling", "window-drag", "video", "cursor", "resize" };
+
+/**
+ * The height of a line of text, and the width of a glyph.
+ */
+constexpr static int kLineHeight = 16;
+constexpr static int kGlyphWidth = 8;
+
+/**
+ * The size of the cursor's image.
+ */
+constexpr static int kCursorSize = 32;
+
+/**
+ * How many frames the resize workload shows each resolution for.
+ */
+constexpr static uint64_t kResizeInterval = 30;
+
+constexpr static int32_t kEncodingRaw = 0;
+constexpr static int32_t kEncodingCopyRect = 1;
+constexpr static int32_t kEncodingRichCursor = -239;
+constexpr static int32_t kEncodingDesktopSize = -223;
+
+static bool ReadAll(int socket, void* data, size_t size) {
+	char* bytes = static_cast<char*>(data);
+	while(size) {
+		ssize_t received = recv(socket, bytes, size, 0);
+		if(received <= 0) {
+			if(received == -1 && errno == EINTR)
+				continue;
+			return false;
+		}
+		bytes += received;
+		size -= received;
+	}
+	return true;
+}
+
+static bool WriteAll(int socket, const void* data, size_t size) {
+	const char* bytes = static_cast<const char*>(data);
+	while(size) {
+		ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+		if(sent <= 0) {
+			if(sent == -1 && errno == EINTR)
+				continue;
+			return false;
+		}
+		bytes += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+static void Write16(std::vector<uint8_t>& output, uint16_t value) {
+	output.push_back(value >> 8);
+	output.push_back(value);
+}
+
+static void Write32(std::vector<uint8_t>& output, uint32_t value) {
+	Write16(output, value >> 16);
+	Write16(output, value);
+}
+
+static uint16_t Read16(const uint8_t* data) {
+	return data[0] << 8 | data[1];
+}
+
+SyntheticVNCServer::Workload SyntheticVNCServer::ParseWorkload(const std::string& name) {
+	for(size_t i = 0; i < static_cast<size_t>(Workload::kCount); i++)
+		if(name == kWorkloadNames[i])
+			return static_cast<Workload>(i);
+	return Workload::kCount;
+}
+
+const char* SyntheticVNCServer::GetWorkloadName(Workload workload) {
+	return workload < Workload::kCount ? kWorkloadNames[static_cast<size_t>(workload)] : "unknown";
+}
+
+SyntheticVNCServer::SyntheticVNCServer(Workload workload, int width, int height)
+	: workload_(workload),
+	  base_width_(width),
+	  base_height_(height),
+	  listener_(-1),
+	  client_(-1),
+	  stopping_(false),
+	  frames_(0),
+	  width_(0),
+	  height_(0),
+	  frame_(0),
+	  seed_(0) {
+}
+
+SyntheticVNCServer::~SyntheticVNCServer() {
+	Stop();
+}
+
+uint16_t SyntheticVNCServer::Start() {
+	listener_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(listener_ == -1)
+		return 0;
+
+	sockaddr_in address {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t length = sizeof(address);
+	if(bind(listener_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 ||
+	   listen(listener_, 1) == -1 ||
+	   getsockname(listener_, reinterpret_cast<sockaddr*>(&address), &length) == -1) {
+		close(listener_);
+		listener_ = -1;
+		return 0;
+	}
+
+	stopping_ = false;
+	thread_ = std::thread(&SyntheticVNCServer::Serve, this);
+	return ntohs(address.sin_port);
+}
+
+void SyntheticVNCServer::Stop() {
+	if(listener_ == -1)
+		return;
+
+	// Shutting the sockets down wakes the thread up from accept() and recv()
+	stopping_ = true;
+	shutdown(listener_, SHUT_RDWR);
+	int client = client_;
+	if(client != -1)
+		shutdown(client, SHUT_RDWR);
+	thread_.join();
+	close(listener_);
+	listener_ = -1;
+}
+
+void SyntheticVNCServer::Serve() {
+	while(!stopping_) {
+		int client = accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+		if(client == -1) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		// Updates are sent as soon as they're drawn, like a VNC server on the same host
+		int no_delay = 1;
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+		client_ = client;
+		if(!stopping_ && Handshake(client))
+			HandleMessages(client);
+		client_ = -1;
+		close(client);
+	}
+}
+
+bool SyntheticVNCServer::Handshake(int client) {
+	char version[12];
+	if(!WriteAll(client, "RFB 003.008\n", 12) || !ReadAll(client, version, sizeof(version)) ||
+	   std::memcmp(version, "RFB 003.00", 10))
+		return false;
+
+	// The only security type is None
+	const uint8_t security_types[] = { 1, 1 };
+	uint8_t security_type;
+	if(!WriteAll(client, security_types, sizeof(security_types)) ||
+	   !ReadAll(client, &security_type, sizeof(security_type)) || security_type != 1)
+		return false;
+
+	const uint8_t security_result[] = { 0, 0, 0, 0 };
+	uint8_t shared;
+	if(!WriteAll(client, security_result, sizeof(security_result)) || !ReadAll(client, &shared, sizeof(shared)))
+		return false;
+
+	// Every connection starts the workload over, so every run sends the same frames
+	frame_ = 0;
+	seed_ = 12345;
+	bytes_per_pixel_ = 4;
+	big_endian_ = false;
+	red_max_ = green_max_ = blue_max_ = 255;
+	red_shift_ = 16;
+	green_shift_ = 8;
+	blue_shift_ = 0;
+	copy_rect_ = rich_cursor_ = desktop_size_ = false;
+	Resize(base_width_, base_height_);
+
+	std::string name = std::string("Synthetic ") + GetWorkloadName(workload_);
+	output_.clear();
+	Write16(output_, width_);
+	Write16(output_, height_);
+	const uint8_t format[] = { 32, 24, 0, 1, 0, 255, 0, 255, 0, 255, 16, 8, 0, 0, 0, 0 };
+	output_.insert(output_.end(), format, format + sizeof(format));
+	Write32(output_, name.length());
+	output_.insert(output_.end(), name.begin(), name.end());
+	return WriteAll(client, output_.data(), output_.size());
+}
+
+bool SyntheticVNCServer::HandleMessages(int client) {
+	std::vector<Update> updates;
+	for(;;) {
+		uint8_t type;
+		if(!ReadAll(client, &type, sizeof(type)))
+			return false;
+
+		switch(type) {
+			case 0: { // SetPixelFormat
+				uint8_t message[19];
+				if(!ReadAll(client, message, sizeof(message)))
+					return false;
+				const uint8_t* format = message + 3;
+				if(!format[3] || (format[0] != 8 && format[0] != 16 && format[0] != 32))
+					return false;
+				bytes_per_pixel_ = format[0] / 8;
+				big_endian_ = format[2];
+				red_max_ = Read16(format + 4);
+				green_max_ = Read16(format + 6);
+				blue_max_ = Read16(format + 8);
+				red_shift_ = format[10];
+				green_shift_ = format[11];
+				blue_shift_ = format[12];
+				break;
+			}
+
+			case 2: { // SetEncodings
+				uint8_t message[3];
+				if(!ReadAll(client, message, sizeof(message)))
+					return false;
+				std::vector<uint8_t> encodings(Read16(message + 1) * 4);
+				if(!ReadAll(client, encodings.data(), encodings.size()))
+					return false;
+				copy_rect_ = rich_cursor_ = desktop_size_ = false;
+				for(size_t i = 0; i < encodings.size(); i += 4) {
+					int32_t encoding = static_cast<int32_t>(static_cast<uint32_t>(Read16(&encodings[i])) << 16 | Read16(&encodings[i + 2]));
+					copy_rect_ |= encoding == kEncodingCopyRect;
+					rich_cursor_ |= encoding == kEncodingRichCursor;
+					desktop_size_ |= encoding == kEncodingDesktopSize;
+				}
+				break;
+			}
+
+			case 3: { // FramebufferUpdateRequest
+				uint8_t message[9];
+				if(!ReadAll(client, message, sizeof(message)))
+					return false;
+				updates.clear();
+				if(message[0]) {
+					DrawFrame(updates);
+					frames_++;
+				} else {
+					updates.push_back({ Update::Type::kRaw, 0, 0, width_, height_, 0, 0 });
+					updates.push_back({ Update::Type::kCursor, 0, 0, kCursorSize, kCursorSize, 0, 0 });
+				}
+				if(!SendUpdates(client, updates))
+					return false;
+				break;
+			}
+
+			case 4: { // KeyEvent
+				uint8_t message[7];
+				if(!ReadAll(client, message, sizeof(message)))
+					return false;
+				break;
+			}
+
+			case 5: { // PointerEvent
+				uint8_t message[5];
+				if(!ReadAll(client, message, sizeof(message)))
+					return false;
+				break;
+			}
+
+			case 6: { // ClientCutText
+				uint8_t message[7];
+				if(!ReadAll(client, message, sizeof(message)))
+					return false;
+				std::vector<uint8_t> text(static_cast<uint32_t>(Read16(message + 3)) << 16 | Read16(message + 5));
+				if(!ReadAll(client, text.data(), text.size()))
+					return false;
+				break;
+			}
+
+			default:
+				// The length of other messages isn't known, so nothing after them can be read
+				return false;
+		}
+	}
+}
+
+void SyntheticVNCServer::DrawFrame(std::vector<Update>& updates) {
+	frame_++;
+	switch(workload_) {
+		case Workload::kScrolling: {
+			// The terminal is the middle of the screen, a whole number of lines high
+			int x = width_ / 8;
+			int width = width_ - x * 2;
+			int height = (height_ * 3 / 4) / kLineHeight * kLineHeight;
+			int y = (height_ - height) / 2;
+			CopyRect(x, y + kLineHeight, width, height - kLineHeight, x, y);
+			updates.push_back({ Update::Type::kCopy, x, y, width, height - kLineHeight, x, y + kLineHeight });
+			FillRect(x, y + height - kLineHeight, width, kLineHeight, 0xF0F0F0);
+			DrawText(x, y + height - kLineHeight, width, kLineHeight);
+			updates.push_back({ Update::Type::kRaw, x, y + height - kLineHeight, width, kLineHeight, 0, 0 });
+			break;
+		}
+
+		case Workload::kWindowDrag: {
+			int width = width_ / 3;
+			int height = height_ / 3;
+			auto position = [&](uint64_t frame, int& x, int& y) {
+				x = static_cast<int>(frame * 8 % (width_ - width));
+				y = static_cast<int>(frame * 4 % (height_ - height));
+			};
+			int old_x, old_y, x, y;
+			position(frame_ - 1, old_x, old_y);
+			position(frame_, x, y);
+
+			if(x < old_x || y < old_y) {
+				// The window jumps back to the corner, so both places are redrawn
+				DrawDesktop();
+				updates.push_back({ Update::Type::kRaw, old_x, old_y, width, height, 0, 0 });
+				updates.push_back({ Update::Type::kRaw, x, y, width, height, 0, 0 });
+				break;
+			}
+
+			// The window is copied, and the desktop that it uncovered is drawn
+			CopyRect(old_x, old_y, width, height, x, y);
+			updates.push_back({ Update::Type::kCopy, x, y, width, height, old_x, old_y });
+			for(int row = old_y; row < old_y + height; row++)
+				for(int column = old_x; column < old_x + width; column++)
+					if(row < y || column < x)
+						framebuffer_[static_cast<size_t>(row) * width_ + column] = GetDesktopPixel(column, row);
+			if(x > old_x)
+				updates.push_back({ Update::Type::kRaw, old_x, old_y, x - old_x, height, 0, 0 });
+			if(y > old_y)
+				updates.push_back({ Update::Type::kRaw, old_x, old_y, width, y - old_y, 0, 0 });
+			break;
+		}
+
+		case Workload::kVideo:
+			for(uint32_t& pixel : framebuffer_) {
+				seed_ = seed_ * 1103515245 + 12345;
+				pixel = seed_ >> 8 & 0xFFFFFF;
+			}
+			updates.push_back({ Update::Type::kRaw, 0, 0, width_, height_, 0, 0 });
+			break;
+
+		case Workload::kCursor:
+			updates.push_back({ Update::Type::kCursor, 0, 0, kCursorSize, kCursorSize, 0, 0 });
+			break;
+
+		case Workload::kResize:
+			if(desktop_size_ && frame_ % kResizeInterval == 0) {
+				// The client asks for the whole screen once it has resized
+				bool base = width_ != base_width_;
+				Resize(base ? base_width_ : base_width_ * 3 / 4, base ? base_height_ : base_height_ * 3 / 4);
+				updates.push_back({ Update::Type::kSize, 0, 0, width_, height_, 0, 0 });
+				break;
+			}
+			// Between resizes, only the clock changes
+			// fall through
+
+		case Workload::kStatic:
+		default: {
+			int x = std::max(0, width_ - 72);
+			int y = std::max(0, height_ - 20);
+			int width = std::min(64, width_);
+			int height = std::min(kLineHeight, height_);
+			FillRect(x, y, width, height, 0x303030);
+			DrawText(x, y, width, height);
+			updates.push_back({ Update::Type::kRaw, x, y, width, height, 0, 0 });
+			break;
+		}
+	}
+}
+
+void SyntheticVNCServer::Resize(int width, int height) {
+	width_ = width;
+	height_ = height;
+	framebuffer_.assign(static_cast<size_t>(width) * height, 0);
+	DrawDesktop();
+}
+
+void SyntheticVNCServer::DrawDesktop() {
+	for(int y = 0; y < height_; y++)
+		for(int x = 0; x < width_; x++)
+			framebuffer_[static_cast<size_t>(y) * width_ + x] = GetDesktopPixel(x, y);
+
+	// A window with text that's in the same place every time
+	int window_x = workload_ == Workload::kWindowDrag ? static_cast<int>(frame_ * 8 % (width_ - width_ / 3)) : width_ / 8;
+	int window_y = workload_ == Workload::kWindowDrag ? static_cast<int>(frame_ * 4 % (height_ - height_ / 3)) : height_ / 8;
+	int window_width = workload_ == Workload::kWindowDrag ? width_ / 3 : width_ - width_ / 4;
+	int window_height = workload_ == Workload::kWindowDrag ? height_ / 3 : height_ - height_ / 4;
+	FillRect(window_x, window_y, window_width, kLineHeight, 0x2050A0);
+	FillRect(window_x, window_y + kLineHeight, window_width, window_height - kLineHeight, 0xF0F0F0);
+
+	// The text is the same however often the desktop is redrawn
+	uint32_t seed = seed_;
+	seed_ = 1;
+	DrawText(window_x, window_y + kLineHeight, window_width, window_height - kLineHeight);
+	seed_ = seed;
+}
+
+uint32_t SyntheticVNCServer::GetDesktopPixel(int x, int y) const {
+	// A gradient wallpaper above a taskbar
+	if(y >= height_ - 24)
+		return 0x303030;
+	return (x * 255 / width_) << 16 | (y * 255 / height_) << 8 | 0x80;
+}
+
+void SyntheticVNCServer::DrawText(int x, int y, int width, int height) {
+	for(int line = y; line + kLineHeight <= y + height; line += kLineHeight) {
+		for(int column = x; column + kGlyphWidth <= x + width; column += kGlyphWidth) {
+			// Each glyph is a 4x4 grid of bits that are 2x3 pixels each, and some are spaces
+			seed_ = seed_ * 1103515245 + 12345;
+			uint32_t glyph = seed_ >> 8;
+			if(glyph % 5 == 0)
+				continue;
+			for(int py = 0; py < 12; py++) {
+				uint32_t* row = &framebuffer_[static_cast<size_t>(line + 2 + py) * width_ + column];
+				for(int px = 0; px < kGlyphWidth; px++)
+					if(glyph >> (py / 3 * 4 + px / 2) & 1)
+						row[px] = 0x202020;
+			}
+		}
+	}
+}
+
+void SyntheticVNCServer::FillRect(int x, int y, int width, int height, uint32_t color) {
+	x = std::max(x, 0);
+	y = std::max(y, 0);
+	for(int row = y; row < std::min(y + height, height_); row++)
+		std::fill_n(&framebuffer_[static_cast<size_t>(row) * width_ + x], std::max(0, std::min(width, width_ - x)), color);
+}
+
+void SyntheticVNCServer::CopyRect(int src_x, int src_y, int width, int height, int dest_x, int dest_y) {
+	// The areas can overlap, so the source is copied out first
+	std::vector<uint32_t> copy(static_cast<size_t>(width) * height);
+	for(int row = 0; row < height; row++)
+		std::memcpy(&copy[static_cast<size_t>(row) * width], &framebuffer_[static_cast<size_t>(src_y + row) * width_ + src_x],
+					width * sizeof(uint32_t));
+	for(int row = 0; row < height; row++)
+		std::memcpy(&framebuffer_[static_cast<size_t>(dest_y + row) * width_ + dest_x], &copy[static_cast<size_t>(row) * width],
+					width * sizeof(uint32_t));
+}
+
+bool SyntheticVNCServer::SendUpdates(int client, const std::vector<Update>& updates) {
+	output_.clear();
+	output_.push_back(0);
+	output_.push_back(0);
+	size_t count_offset = output_.size();
+	Write16(output_, 0);
+
+	uint16_t count = 0;
+	for(const Update& update : updates) {
+		if(update.width <= 0 || update.height <= 0)
+			continue;
+		if((update.type == Update::Type::kCursor && !rich_cursor_) ||
+		   (update.type == Update::Type::kSize && !desktop_size_))
+			continue;
+
+		// Clients that can't copy are sent the copied pixels
+		Update::Type type = update.type == Update::Type::kCopy && !copy_rect_ ? Update::Type::kRaw : update.type;
+		int32_t encoding = type == Update::Type::kCopy	   ? kEncodingCopyRect
+						   : type == Update::Type::kCursor ? kEncodingRichCursor
+						   : type == Update::Type::kSize   ? kEncodingDesktopSize
+														   : kEncodingRaw;
+		Write16(output_, update.x);
+		Write16(output_, update.y);
+		Write16(output_, update.width);
+		Write16(output_, update.height);
+		Write32(output_, static_cast<uint32_t>(encoding));
+		count++;
+
+		switch(type) {
+			case Update::Type::kRaw:
+				for(int row = update.y; row < update.y + update.height; row++)
+					for(int column = update.x; column < update.x + update.width; column++)
+						WritePixel(framebuffer_[static_cast<size_t>(row) * width_ + column]);
+				break;
+
+			case Update::Type::kCopy:
+				Write16(output_, update.src_x);
+				Write16(output_, update.src_y);
+				break;
+
+			case Update::Type::kCursor: {
+				// An arrow that changes color and length every frame, with the hotspot at its tip
+				int length = kCursorSize / 2 + static_cast<int>(frame_ % (kCursorSize / 2));
+				uint32_t color = static_cast<uint32_t>(frame_ * 0x1F3D5B) & 0xFFFFFF;
+				std::vector<uint8_t> mask;
+				for(int row = 0; row < kCursorSize; row++) {
+					uint8_t bits = 0;
+					for(int column = 0; column < kCursorSize; column++) {
+						bool inside = row < length && column <= row / 2;
+						WritePixel(inside ? color : 0);
+						bits = bits << 1 | inside;
+						if(column % 8 == 7)
+							mask.push_back(bits);
+					}
+				}
+				output_.insert(output_.end(), mask.begin(), mask.end());
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+
+	output_[count_offset] = count >> 8;
+	output_[count_offset + 1] = count;
+	return WriteAll(client, output_.data(), output_.size());
+}
+
+void SyntheticVNCServer::WritePixel(uint32_t pixel) {
+	uint32_t value = ((pixel >> 16 & 0xFF) * red_max_ / 255) << red_shift_ |
+					 ((pixel >> 8 & 0xFF) * green_max_ / 255) << green_shift_ |
+					 ((pixel & 0xFF) * blue_max_ / 255) << blue_shift_;
+	for(int i = 0; i < bytes_per_pixel_; i++) {
+		int shift = big_endian_ ? (bytes_per_pixel_ - 1 - i) * 8 : i * 8;
+		output_.push_back(value >> shift);
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * A VNC server for the benchmarks that draws a scripted workload instead of
+ * a VM's display, so the display pipeline can be measured on the same
+ * updates every run without a QEMU guest. It speaks enough of RFB 3.8 for
+ * libvncclient, and GuacVNCClient::GetVNCClient(), to connect to it: no
+ * authentication, raw and CopyRect updates, the RichCursor and DesktopSize
+ * pseudo-encodings, and any true color pixel format.
+ *
+ * Each incremental update request is answered with the next frame of the
+ * workload, and a full request with the whole screen, so the frames only
+ * depend on how many were requested. Key, pointer and clipboard messages
+ * are ignored. One client is served at a time, on a thread of its own.
+ */
+class SyntheticVNCServer {
+   public:
+	enum class Workload {
+		kStatic,	 // A desktop where only a clock changes
+		kScrolling,	 // A terminal that scrolls up a line of text each frame
+		kWindowDrag, // A window that is dragged across the desktop
+		kVideo,		 // Noise that changes every pixel of a video in the middle
+		kCursor,	 // A desktop where only the cursor's shape changes
+		kResize,	 // A desktop that switches between two resolutions
+		kCount
+	};
+
+	/**
+	 * @return The workload with the name, or kCount if there's none.
+	 */
+	static Workload ParseWorkload(const std::string& name);
+	static const char* GetWorkloadName(Workload workload);
+
+	SyntheticVNCServer(Workload workload, int width, int height);
+	~SyntheticVNCServer();
+
+	SyntheticVNCServer(const SyntheticVNCServer&) = delete;
+	SyntheticVNCServer& operator=(const SyntheticVNCServer&) = delete;
+
+	/**
+	 * Listens on a port of the loopback address that the system chooses.
+	 *
+	 * @return The port, or 0 if listening failed.
+	 */
+	uint16_t Start();
+
+	/**
+	 * Disconnects the client and stops listening.
+	 */
+	void Stop();
+
+	/**
+	 * The number of frames of the workload that were sent.
+	 */
+	uint64_t GetFrames() const {
+		return frames_;
+	}
+
+   private:
+	/**
+	 * An update of a frame, in the order it's sent.
+	 */
+	struct Update {
+		enum class Type { kRaw, kCopy, kCursor, kSize } type;
+		int x, y, width, height;
+		int src_x, src_y;
+	};
+
+	void Serve();
+	bool Handshake(int client);
+	bool HandleMessages(int client);
+
+	/**
+	 * Draws the next frame of the workload into the framebuffer and adds
+	 * the updates that send it.
+	 */
+	void DrawFrame(std::vector<Update>& updates);
+
+	void Resize(int width, int height);
+	void DrawDesktop();
+	uint32_t GetDesktopPixel(int x, int y) const;
+	void DrawText(int x, int y, int width, int height);
+	void FillRect(int x, int y, int width, int height, uint32_t color);
+	void CopyRect(int src_x, int src_y, int width, int height, int dest_x, int dest_y);
+
+	bool SendUpdates(int client, const std::vector<Update>& updates);
+	void WritePixel(uint32_t pixel);
+
+	const Workload workload_;
+	const int base_width_;
+	const int base_height_;
+
+	int listener_;
+	std::atomic<int> client_;
+	std::thread thread_;
+	std::atomic<bool> stopping_;
+	std::atomic<uint64_t> frames_;
+
+	/**
+	 * The screen as 32-bit RGB, the same layout as surfaces.
+	 */
+	std::vector<uint32_t> framebuffer_;
+	int width_;
+	int height_;
+	uint64_t frame_;
+	uint32_t seed_;
+
+	/**
+	 * The pixel format and encodings the client asked for.
+	 */
+	int bytes_per_pixel_;
+	bool big_endian_;
+	uint16_t red_max_, green_max_, blue_max_;
+	uint8_t red_shift_, green_shift_, blue_shift_;
+	bool copy_rect_;
+	bool rich_cursor_;
+	bool desktop_size_;
+
+	std::vector<uint8_t> output_;
+};
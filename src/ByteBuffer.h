@@ -0,0 +1,129 @@
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+/**
+ * An append-only byte buffer used to build Guacamole instructions.
+ * Clearing the buffer keeps its capacity so it can be reused for the
+ * next instruction without reallocating.
+ */
+class ByteBuffer {
+   public:
+	ByteBuffer()
+		: high_water_(0),
+		  max_retained_(SIZE_MAX) {
+	}
+
+	/**
+	 * Limits the capacity that's kept after the buffer is cleared or
+	 * released, for buffers that are mostly idle.
+	 */
+	void SetMaxRetained(size_t bytes) {
+		max_retained_ = bytes;
+	}
+
+	void Append(const void* data, size_t count) {
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		buffer_.insert(buffer_.end(), bytes, bytes + count);
+	}
+
+	void Append(char c) {
+		buffer_.push_back(static_cast<uint8_t>(c));
+	}
+
+	void Append(std::string_view str) {
+		Append(str.data(), str.length());
+	}
+
+	void AppendInt(int64_t i) {
+		char str[20];
+		std::to_chars_result result = std::to_chars(str, str + sizeof(str), i);
+		Append(str, result.ptr - str);
+	}
+
+	/**
+	 * Grows the buffer by count bytes and returns a pointer to the
+	 * beginning of the new region so it can be written to directly.
+	 */
+	uint8_t* Extend(size_t count) {
+		size_t size = buffer_.size();
+		buffer_.resize(size + count);
+		return buffer_.data() + size;
+	}
+
+	/**
+	 * Removes the last count bytes from the buffer.
+	 */
+	void Shrink(size_t count) {
+		buffer_.resize(buffer_.size() - count);
+	}
+
+	void Clear() {
+		buffer_.clear();
+		if(buffer_.capacity() > max_retained_)
+			buffer_ = std::vector<uint8_t>();
+	}
+
+	bool Empty() const {
+		return buffer_.empty();
+	}
+
+	size_t Size() const {
+		return buffer_.size();
+	}
+
+	const uint8_t* Data() const {
+		return buffer_.data();
+	}
+
+	char Back() const {
+		return static_cast<char>(buffer_.back());
+	}
+
+	std::string_view View() const {
+		return std::string_view(reinterpret_cast<const char*>(buffer_.data()), buffer_.size());
+	}
+
+	/**
+	 * Moves the contents of the buffer out without copying them. The
+	 * buffer is left empty with capacity reserved for the largest of the
+	 * recent instructions, so the next frame doesn't grow it from nothing.
+	 * Contents that fill less than half of the capacity are copied out
+	 * instead, so that a small message doesn't carry a frame's worth of
+	 * memory into the send queues, and the buffer keeps its capacity.
+	 */
+	std::vector<uint8_t> Release() {
+		high_water_ = std::max(buffer_.size(), high_water_ - high_water_ / 16);
+
+		if(buffer_.size() < buffer_.capacity() / 2) {
+			std::vector<uint8_t> data(buffer_.begin(), buffer_.end());
+			Clear();
+			return data;
+		}
+
+		std::vector<uint8_t> data = std::move(buffer_);
+		buffer_ = std::vector<uint8_t>();
+		buffer_.reserve(std::min({ high_water_, max_retained_, kMaxReservedBytes }));
+		return data;
+	}
+
+   private:
+	/**
+	 * The most capacity that's reserved after the buffer is released, so
+	 * that one huge instruction doesn't keep that much memory allocated.
+	 */
+	constexpr static size_t kMaxReservedBytes = 1024 * 1024;
+
+	std::vector<uint8_t> buffer_;
+
+	/**
+	 * The largest size the buffer has recently been released at, which
+	 * falls by a sixteenth with each release of a smaller instruction.
+	 */
+	size_t high_water_;
+	size_t max_retained_;
+};
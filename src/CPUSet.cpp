@@ -0,0 +1,104 @@
+#include "CPUSet.h"
+#include <algorithm>
+#include <cstdio>
+#include <optional>
+
+#ifndef _WIN32
+	#include <unistd.h>
+#endif
+
+CPUSet::CPUSet()
+	: count_(0) {
+#ifdef __linux__
+	CPU_ZERO(&set_);
+#endif
+}
+
+bool CPUSet::Parse(const std::string& list, CPUSet& cpus) {
+	cpus = CPUSet();
+#ifdef __linux__
+	size_t start = 0;
+	while(start <= list.length()) {
+		size_t end = list.find(',', start);
+		if(end == std::string::npos)
+			end = list.length();
+
+		unsigned int first, last;
+		char extra;
+		std::string range = list.substr(start, end - start);
+		int count = std::sscanf(range.c_str(), "%u-%u%c", &first, &last, &extra);
+		if(count == 1 && range.find('-') == std::string::npos)
+			last = first;
+		else if(count != 2)
+			return false;
+		if(first > last || last >= CPU_SETSIZE)
+			return false;
+
+		for(unsigned int cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, &cpus.set_);
+		start = end + 1;
+	}
+	cpus.count_ = CPU_COUNT(&cpus.set_);
+	return true;
+#else
+	return false;
+#endif
+}
+
+CPUSet CPUSet::OfThreads(const int* tids, size_t count) {
+	CPUSet cpus;
+#ifdef __linux__
+	for(size_t i = 0; i < count; i++) {
+		cpu_set_t set;
+		if(sched_getaffinity(tids[i], sizeof(set), &set) == 0)
+			CPU_OR(&cpus.set_, &cpus.set_, &set);
+	}
+
+	// Threads that can run anywhere don't say where to place anything
+	cpus.count_ = CPU_COUNT(&cpus.set_);
+	if(cpus.count_ >= static_cast<size_t>(std::max(sysconf(_SC_NPROCESSORS_CONF), 1L)))
+		cpus = CPUSet();
+#endif
+	return cpus;
+}
+
+bool CPUSet::operator==(const CPUSet& other) const {
+#ifdef __linux__
+	return count_ == other.count_ && CPU_EQUAL(&set_, &other.set_);
+#else
+	return true;
+#endif
+}
+
+bool CPUSet::ApplyToProcess() const {
+#ifdef __linux__
+	return !Empty() && sched_setaffinity(0, sizeof(set_), &set_) == 0;
+#else
+	return false;
+#endif
+}
+
+void CPUSet::PinCurrentThread() const {
+#ifdef __linux__
+	// The set the thread is pinned to, and where it could run before
+	thread_local std::optional<CPUSet> pinned;
+	thread_local CPUSet original;
+	if(pinned ? *pinned == *this : Empty())
+		return;
+
+	if(!pinned) {
+		if(sched_getaffinity(0, sizeof(original.set_), &original.set_) != 0)
+			return;
+		original.count_ = CPU_COUNT(&original.set_);
+	}
+
+	const CPUSet& target = Empty() ? original : *this;
+	if(sched_setaffinity(0, sizeof(target.set_), &target.set_) != 0)
+		return;
+
+	if(Empty())
+		pinned.reset();
+	else
+		pinned = *this;
+#endif
+}
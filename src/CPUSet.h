@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+#ifdef __linux__
+	#include <sched.h>
+#endif
+
+/**
+ * A set of CPUs that threads can be restricted to, like the CPUs of a NUMA
+ * node. An empty set doesn't restrict anything. Affinity is only supported
+ * on Linux; elsewhere every set is empty.
+ */
+class CPUSet {
+   public:
+	CPUSet();
+
+	/**
+	 * Parses a list of CPUs and ranges of them, like "0-7,16-23".
+	 *
+	 * @return Whether the list was valid.
+	 */
+	static bool Parse(const std::string& list, CPUSet& cpus);
+
+	/**
+	 * Gets the CPUs that the given threads may run on, or an empty set
+	 * if they may run on every CPU of the host.
+	 */
+	static CPUSet OfThreads(const int* tids, size_t count);
+
+	inline bool Empty() const {
+		return count_ == 0;
+	}
+
+	bool operator==(const CPUSet& other) const;
+	inline bool operator!=(const CPUSet& other) const {
+		return !(*this == other);
+	}
+
+	/**
+	 * Restricts the whole process to the set. Threads that are started
+	 * afterwards, and the processes they spawn, inherit it.
+	 *
+	 * @return Whether the affinity was set.
+	 */
+	bool ApplyToProcess() const;
+
+	/**
+	 * Restricts the calling thread to the set, or lets it run where it
+	 * could before it was first pinned if the set is empty. The system call
+	 * is only made when the thread was pinned to a different set, so a pool
+	 * thread can call this before each job.
+	 */
+	void PinCurrentThread() const;
+
+   private:
+	size_t count_;
+#ifdef __linux__
+	cpu_set_t set_;
+#endif
+};
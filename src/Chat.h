@@ -11,7 +11,10 @@ struct ChatMessage {
 	//{
 	//}
 
-	std::shared_ptr<std::string> username;
-	std::string message;
+	/**
+	 * The sender's username and the message, encoded as the
+	 * arguments of a chat instruction.
+	 */
+	std::string encoded;
 	std::chrono::time_point<std::chrono::steady_clock, std::chrono::seconds> timestamp;
 };
@@ -0,0 +1,488 @@
+#include "ClusterDirectory.h"
+#include "Logger.h"
+#include "uriparser/Uri.h"
+
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <functional>
+
+/**
+ * How often the other servers are polled, how long a server is still
+ * considered live after it last answered, and how long a poll can take.
+ */
+static constexpr std::chrono::seconds kPollInterval(5);
+static constexpr std::chrono::seconds kMemberTimeout(20);
+static constexpr std::chrono::seconds kPollTimeout(5);
+
+/**
+ * How long a server has to start a VM that's migrated to it.
+ */
+static constexpr std::chrono::seconds kMigrateTimeout(10);
+
+/**
+ * Limits on what another server can send, so a misbehaving one
+ * can't take up much memory.
+ */
+static constexpr size_t kMaxStatusBytes = 1024 * 1024;
+static constexpr size_t kMaxPeers = 256;
+
+/**
+ * Splits a "host:port" address of another server, with the brackets
+ * taken off an IPv6 host.
+ */
+static bool SplitAddress(const std::string& address, std::string& host, std::string& port) {
+	size_t colon = address.rfind(':');
+	if(colon == std::string::npos || colon == 0)
+		return false;
+	host = address.substr(0, colon);
+	if(host.length() > 2 && host.front() == '[' && host.back() == ']')
+		host = host.substr(1, host.length() - 2);
+	port = address.substr(colon + 1);
+	return true;
+}
+
+/**
+ * An HTTP request to another server, for its status or to migrate a VM to it.
+ */
+class ClusterRequest : public std::enable_shared_from_this<ClusterRequest> {
+   public:
+	typedef std::function<void(bool ok, const std::string& body)> Handler;
+
+	explicit ClusterRequest(net::io_context& io_context)
+		: resolver_(io_context),
+		  stream_(io_context) {
+	}
+
+	void Start(const std::string& address, http::verb method, const std::string& target, const std::string& token,
+			   std::chrono::seconds timeout, Handler handler) {
+		handler_ = std::move(handler);
+
+		std::string host, port;
+		if(!SplitAddress(address, host, port))
+			return handler_(false, std::string());
+
+		request_.method(method);
+		request_.target(target);
+		request_.version(11);
+		request_.set(http::field::host, address);
+		request_.set(http::field::authorization, "Bearer " + token);
+		request_.prepare_payload();
+		parser_.body_limit(kMaxStatusBytes);
+
+		stream_.expires_after(timeout);
+		resolver_.async_resolve(host, port,
+			[self = shared_from_this()](beast::error_code ec, const tcp::resolver::results_type& endpoints) {
+				self->OnResolve(ec, endpoints);
+			});
+	}
+
+   private:
+	void OnResolve(beast::error_code ec, const tcp::resolver::results_type& endpoints) {
+		if(ec)
+			return handler_(false, std::string());
+
+		stream_.async_connect(endpoints, [self = shared_from_this()](beast::error_code ec, const tcp::endpoint&) {
+			if(ec)
+				return self->handler_(false, std::string());
+			http::async_write(self->stream_, self->request_, [self](beast::error_code ec, size_t) {
+				if(ec)
+					return self->handler_(false, std::string());
+				http::async_read(self->stream_, self->buffer_, self->parser_, [self](beast::error_code ec, size_t) {
+					self->OnRead(ec);
+				});
+			});
+		});
+	}
+
+	void OnRead(beast::error_code ec) {
+		beast::error_code shutdown_ec;
+		stream_.socket().shutdown(tcp::socket::shutdown_both, shutdown_ec);
+		if(ec || parser_.get().result() != http::status::ok)
+			return handler_(false, std::string());
+		handler_(true, parser_.get().body());
+	}
+
+	tcp::resolver resolver_;
+	beast::tcp_stream stream_;
+	beast::flat_buffer buffer_;
+	http::request<http::empty_body> request_;
+	http::response_parser<http::string_body> parser_;
+	Handler handler_;
+};
+
+/**
+ * Hashes the URL of a server and the name of a VM together. The hash has
+ * to be the same on every server, so std::hash can't be used: it's FNV-1a
+ * with the SplitMix64 finalizer, so similar names get unrelated hashes.
+ */
+static uint64_t HashPlacement(std::string_view url, std::string_view vm_name) {
+	uint64_t hash = 0xcbf29ce484222325;
+	auto append = [&hash](std::string_view str) {
+		for(char c : str) {
+			hash ^= static_cast<unsigned char>(c);
+			hash *= 0x100000001b3;
+		}
+	};
+	append(url);
+	append("/");
+	append(vm_name);
+
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111eb;
+	hash ^= hash >> 31;
+	return hash;
+}
+
+const ClusterDirectory::Node* ClusterDirectory::Snapshot::GetOwner(const std::string& vm_name) const {
+	// Each server that has the VM draws a score, weighted so the chance of
+	// drawing the highest is in proportion to the server's weight
+	const Node* owner = nullptr;
+	double owner_score = 0;
+	for(const Node& node : nodes) {
+		bool has_vm = false;
+		for(const VM& vm : node.vms) {
+			if(vm.name == vm_name) {
+				has_vm = true;
+				break;
+			}
+		}
+		if(!has_vm)
+			continue;
+
+		// A uniform number in (0, 1) from the top 53 bits of the hash
+		double uniform = (static_cast<double>(HashPlacement(node.url, vm_name) >> 11) + 0.5) / 9007199254740992.0;
+		double score = node.weight / -std::log(uniform);
+		if(!owner || score > owner_score || (score == owner_score && node.url < owner->url)) {
+			owner = &node;
+			owner_score = score;
+		}
+	}
+	return owner;
+}
+
+bool ClusterDirectory::Snapshot::IsLocal(const std::string& vm_name) const {
+	const Node* owner = GetOwner(vm_name);
+	return !owner || owner->url == self_url;
+}
+
+ClusterDirectory::ClusterDirectory(net::io_context& io_context)
+	: io_context_(io_context),
+	  timer_(io_context),
+	  weight_(0),
+	  load_(0),
+	  generation_(0),
+	  snapshot_(std::make_shared<Snapshot>()),
+	  version_(0) {
+}
+
+void ClusterDirectory::Configure(const std::string& url, const std::string& peers, uint16_t weight, const std::string& token) {
+	uint64_t generation;
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		bool was_enabled = IsEnabled();
+
+		// The URL is compared with the URLs other servers report, so it
+		// shouldn't end in a slash
+		url_ = url;
+		while(!url_.empty() && url_.back() == '/')
+			url_.pop_back();
+		token_ = token;
+		weight_ = weight;
+
+		peers_.clear();
+		members_.clear();
+		size_t start = 0;
+		while(start <= peers.length()) {
+			size_t end = std::min(peers.find(',', start), peers.length());
+			std::string address = peers.substr(start, end - start);
+			address.erase(0, address.find_first_not_of(' '));
+			address.erase(address.find_last_not_of(' ') + 1);
+			if(!address.empty())
+				peers_[address].seed = true;
+			start = end + 1;
+		}
+
+		generation = ++generation_;
+		sanctions_.SetSelf(IsEnabled() ? url_ : std::string());
+		Publish(true);
+		if(IsEnabled())
+			Logger::Info("Cluster") << "Joining as " << url_ << " with " << peers_.size() << " peers";
+		else if(was_enabled)
+			Logger::Info("Cluster") << "Left the cluster";
+	}
+	net::post(io_context_, [self = shared_from_this(), generation]() { self->Restart(generation); });
+}
+
+void ClusterDirectory::Stop() {
+	uint64_t generation;
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		token_.clear();
+		generation = ++generation_;
+		sanctions_.SetSelf(std::string());
+	}
+	net::post(io_context_, [self = shared_from_this(), generation]() { self->Restart(generation); });
+}
+
+void ClusterDirectory::Restart(uint64_t generation) {
+	timer_.cancel();
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		if(generation != generation_ || !IsEnabled())
+			return;
+	}
+	OnTimer(beast::error_code(), generation);
+}
+
+void ClusterDirectory::OnTimer(beast::error_code ec, uint64_t generation) {
+	if(ec)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		if(generation != generation_ || !IsEnabled())
+			return;
+
+		auto now = std::chrono::steady_clock::now();
+		bool changed = false;
+		for(auto it = members_.begin(); it != members_.end();) {
+			if(now - it->second.last_seen > kMemberTimeout) {
+				Logger::Warning("Cluster") << "Lost " << it->first;
+				sanctions_.Forget(it->first);
+				it = members_.erase(it);
+				changed = true;
+			} else {
+				it++;
+			}
+		}
+		for(auto it = peers_.begin(); it != peers_.end();) {
+			if(!it->second.seed && !it->second.self && now - it->second.last_answer > kMemberTimeout)
+				it = peers_.erase(it);
+			else
+				it++;
+		}
+		if(changed)
+			Publish(true);
+	}
+
+	Poll();
+	timer_.expires_after(kPollInterval);
+	timer_.async_wait([self = shared_from_this(), generation](beast::error_code ec) { self->OnTimer(ec, generation); });
+}
+
+void ClusterDirectory::Poll() {
+	std::vector<std::string> addresses;
+	std::string token;
+	uint64_t generation;
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		for(const auto& [address, peer] : peers_) {
+			if(!peer.self)
+				addresses.push_back(address);
+		}
+		token = token_;
+		generation = generation_;
+	}
+
+	for(const std::string& address : addresses) {
+		std::make_shared<ClusterRequest>(io_context_)->Start(address, http::verb::get, kPath, token, kPollTimeout,
+			[self = shared_from_this(), address, generation](bool ok, const std::string& body) {
+				self->OnAnswer(address, generation, ok, body);
+			});
+	}
+}
+
+void ClusterDirectory::OnAnswer(const std::string& address, uint64_t generation, bool ok, const std::string& body) {
+	if(!ok)
+		return;
+
+	rapidjson::Document d;
+	d.Parse(body.c_str());
+	if(d.HasParseError() || !d.IsObject())
+		return;
+	auto url = d.FindMember("url");
+	auto weight = d.FindMember("weight");
+	auto load = d.FindMember("load");
+	auto vms = d.FindMember("vms");
+	auto peers = d.FindMember("peers");
+	if(url == d.MemberEnd() || !url->value.IsString() || !url->value.GetStringLength() ||
+	   weight == d.MemberEnd() || !weight->value.IsUint() || weight->value.GetUint() > UINT16_MAX ||
+	   load == d.MemberEnd() || !load->value.IsUint() ||
+	   vms == d.MemberEnd() || !vms->value.IsArray() ||
+	   peers == d.MemberEnd() || !peers->value.IsArray())
+		return;
+
+	Node node;
+	node.url = std::string(url->value.GetString(), url->value.GetStringLength());
+	node.weight = weight->value.GetUint();
+	node.load = load->value.GetUint();
+	for(auto it = vms->value.Begin(); it != vms->value.End(); it++) {
+		const rapidjson::Value& value = *it;
+		if(!value.IsObject())
+			continue;
+		auto name = value.FindMember("name");
+		auto display_name = value.FindMember("display-name");
+		auto thumbnail = value.FindMember("thumbnail");
+		if(name == value.MemberEnd() || !name->value.IsString() ||
+		   display_name == value.MemberEnd() || !display_name->value.IsString() ||
+		   thumbnail == value.MemberEnd() || !thumbnail->value.IsUint64())
+			continue;
+		node.vms.push_back(VM { std::string(name->value.GetString(), name->value.GetStringLength()),
+								std::string(display_name->value.GetString(), display_name->value.GetStringLength()),
+								thumbnail->value.GetUint64() });
+	}
+
+	std::lock_guard<std::mutex> lock(lock_);
+	auto peer = peers_.find(address);
+	if(generation != generation_ || peer == peers_.end())
+		return;
+
+	// This server can learn its own address from another one
+	if(node.url == url_) {
+		peer->second.self = true;
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	peer->second.last_answer = now;
+	for(auto it = peers->value.Begin(); it != peers->value.End() && peers_.size() < kMaxPeers; it++) {
+		if(it->IsString() && it->GetStringLength()) {
+			auto [learned, inserted] = peers_.emplace(std::string(it->GetString(), it->GetStringLength()), Peer());
+			if(inserted)
+				learned->second.last_answer = now;
+		}
+	}
+
+	auto [member, added] = members_.emplace(node.url, Member());
+	if(added)
+		Logger::Info("Cluster") << "Found " << node.url << " at " << address;
+	bool changed = added || member->second.node.weight != node.weight || member->second.node.vms != node.vms;
+	member->second.node = std::move(node);
+	member->second.address = address;
+	member->second.last_seen = now;
+	Publish(changed);
+
+	// Servers from before sanctions were replicated don't send them
+	auto sanctions = d.FindMember("sanctions");
+	if(sanctions != d.MemberEnd())
+		sanctions_.Merge(member->first, sanctions->value, std::time(nullptr));
+}
+
+void ClusterDirectory::SetLocalVMs(std::vector<VM> vms) {
+	std::lock_guard<std::mutex> lock(lock_);
+	if(vms == local_vms_)
+		return;
+	local_vms_ = std::move(vms);
+	Publish(true);
+}
+
+void ClusterDirectory::SetLoad(uint32_t load) {
+	std::lock_guard<std::mutex> lock(lock_);
+	load_ = load;
+}
+
+bool ClusterDirectory::CheckToken(std::string_view token) const {
+	std::lock_guard<std::mutex> lock(lock_);
+	if(!IsEnabled() || token.length() != token_.length())
+		return false;
+
+	unsigned char difference = 0;
+	for(size_t i = 0; i < token.length(); i++)
+		difference |= token[i] ^ token_[i];
+	return difference == 0;
+}
+
+bool ClusterDirectory::RequestIncoming(const std::string& url, const std::string& vm_name, MigrateHandler handler) {
+	std::string address, token;
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		std::string member_url = url;
+		while(!member_url.empty() && member_url.back() == '/')
+			member_url.pop_back();
+		auto member = members_.find(member_url);
+		if(!IsEnabled() || member == members_.end())
+			return false;
+		address = member->second.address;
+		token = token_;
+	}
+
+	std::string host, port;
+	if(!SplitAddress(address, host, port))
+		return false;
+
+	std::string target(std::strlen(kMigratePath) + vm_name.length() * 3, '\0');
+	std::strcpy(&target[0], kMigratePath);
+	char* end = uriEscapeExA(vm_name.data(), vm_name.data() + vm_name.length(),
+							 &target[std::strlen(kMigratePath)], URI_FALSE, URI_FALSE);
+	target.resize(end - target.data());
+
+	net::post(io_context_, [self = shared_from_this(), address, host, target, token, handler = std::move(handler)]() {
+		std::make_shared<ClusterRequest>(self->io_context_)->Start(address, http::verb::post, target, token, kMigrateTimeout,
+			[host, handler](bool ok, const std::string& body) { handler(ok, host, body); });
+	});
+	return true;
+}
+
+std::string ClusterDirectory::GetStatus() const {
+	rapidjson::StringBuffer buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+	std::lock_guard<std::mutex> lock(lock_);
+	auto now = std::chrono::steady_clock::now();
+
+	writer.StartObject();
+	writer.String("url");
+	writer.String(url_.c_str(), url_.length());
+	writer.String("weight");
+	writer.Uint(weight_);
+	writer.String("load");
+	writer.Uint(load_);
+
+	writer.String("vms");
+	writer.StartArray();
+	for(const VM& vm : local_vms_) {
+		writer.StartObject();
+		writer.String("name");
+		writer.String(vm.name.c_str(), vm.name.length());
+		writer.String("display-name");
+		writer.String(vm.display_name.c_str(), vm.display_name.length());
+		writer.String("thumbnail");
+		writer.Uint64(vm.thumbnail_version);
+		writer.EndObject();
+	}
+	writer.EndArray();
+
+	// Only the addresses that are answering are passed on
+	writer.String("peers");
+	writer.StartArray();
+	for(const auto& [address, peer] : peers_) {
+		if(!peer.self && now - peer.last_answer <= kMemberTimeout)
+			writer.String(address.c_str(), address.length());
+	}
+	writer.EndArray();
+
+	writer.String("sanctions");
+	sanctions_.Write(writer, std::time(nullptr));
+	writer.EndObject();
+	return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+void ClusterDirectory::Publish(bool changed) {
+	auto snapshot = std::make_shared<Snapshot>();
+	if(IsEnabled()) {
+		snapshot->self_url = url_;
+		snapshot->nodes.reserve(members_.size() + 1);
+		snapshot->nodes.push_back(Node { url_, weight_, load_, local_vms_ });
+		for(const auto& [url, member] : members_)
+			snapshot->nodes.push_back(member.node);
+	}
+	std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>(std::move(snapshot)));
+	if(changed)
+		version_++;
+}
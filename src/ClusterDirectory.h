@@ -0,0 +1,215 @@
+#pragma once
+#include <websocketmm/beast/beast.h>
+#include <websocketmm/beast/net.h>
+
+#include "ClusterSanctions.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Keeps track of the servers in a cluster and the VMs each one runs, and
+ * decides which server the users of a VM are sent to.
+ *
+ * Every few seconds each server asks the servers it knows about for their
+ * URL, weight, load and VMs over HTTP, and learns about the servers they
+ * know about from their answers. A server that hasn't answered for a while
+ * is left out until it does again.
+ *
+ * Among the live servers that have a VM, the VM is given to one of them by
+ * weighted rendezvous hashing of the server's URL and the VM's name. Every
+ * server that knows the same servers picks the same one, a server gets a
+ * share of the VMs in proportion to its weight, and a server joining or
+ * leaving only moves the VMs it gains or loses.
+ *
+ * The answers also carry the bans, mutes and rate limit counters that are
+ * replicated between the servers, see ClusterSanctions.
+ *
+ * The polling runs on the io_context, everything else can be used from any thread.
+ */
+class ClusterDirectory : public std::enable_shared_from_this<ClusterDirectory> {
+   public:
+	struct VM {
+		std::string name;
+		std::string display_name;
+
+		/**
+		 * The version of the VM's thumbnail, or 0 if it doesn't have one.
+		 */
+		uint64_t thumbnail_version = 0;
+
+		bool operator==(const VM& vm) const {
+			return name == vm.name && display_name == vm.display_name && thumbnail_version == vm.thumbnail_version;
+		}
+	};
+
+	struct Node {
+		std::string url;
+		uint16_t weight = 0;
+
+		/**
+		 * The number of open connections.
+		 */
+		uint32_t load = 0;
+		std::vector<VM> vms;
+	};
+
+	/**
+	 * The live servers in the cluster, including this one, at one point in time.
+	 */
+	struct Snapshot {
+		std::string self_url;
+		std::vector<Node> nodes;
+
+		/**
+		 * Gets the server a VM is given to, or null if no server has it.
+		 */
+		const Node* GetOwner(const std::string& vm_name) const;
+
+		/**
+		 * Whether a VM is given to this server, or to no server in the
+		 * cluster. Always true when the server isn't part of a cluster.
+		 */
+		bool IsLocal(const std::string& vm_name) const;
+	};
+
+	/**
+	 * The path that servers are polled at.
+	 */
+	static constexpr const char* kPath = "/cluster";
+
+	/**
+	 * The path, followed by the escaped name of a VM, that a server is
+	 * asked to start a VM waiting to be migrated to it at.
+	 */
+	static constexpr const char* kMigratePath = "/cluster/migrate/";
+
+	/**
+	 * Called with whether the request succeeded, the host of the server
+	 * it was sent to and the body of the response.
+	 */
+	typedef std::function<void(bool ok, const std::string& host, const std::string& body)> MigrateHandler;
+
+	explicit ClusterDirectory(net::io_context& io_context);
+
+	/**
+	 * Changes the settings from the config, and starts or stops polling.
+	 * The server isn't part of a cluster while the token or URL is empty.
+	 */
+	void Configure(const std::string& url, const std::string& peers, uint16_t weight, const std::string& token);
+
+	void Stop();
+
+	/**
+	 * Sets the VMs this server runs.
+	 */
+	void SetLocalVMs(std::vector<VM> vms);
+
+	/**
+	 * Sets the number of open connections this server reports.
+	 */
+	void SetLoad(uint32_t load);
+
+	bool CheckToken(std::string_view token) const;
+
+	/**
+	 * Asks a live server in the cluster, by its URL, to start a VM that
+	 * waits for the VM to be migrated to it. Returns false without calling
+	 * the handler if the server isn't known. The handler is called on the
+	 * io_context.
+	 */
+	bool RequestIncoming(const std::string& url, const std::string& vm_name, MigrateHandler handler);
+
+	/**
+	 * Gets the JSON that other servers poll this one for.
+	 */
+	std::string GetStatus() const;
+
+	inline std::shared_ptr<const Snapshot> GetSnapshot() const {
+		return std::atomic_load(&snapshot_);
+	}
+
+	/**
+	 * Gets a number that changes whenever the snapshot does, except for
+	 * the load of the servers.
+	 */
+	inline uint64_t GetVersion() const {
+		return version_;
+	}
+
+	inline ClusterSanctions& GetSanctions() {
+		return sanctions_;
+	}
+
+   private:
+	struct Peer {
+		/**
+		 * Whether the address came from the config, rather than from
+		 * another server. Addresses from other servers are forgotten once
+		 * they stop answering.
+		 */
+		bool seed = false;
+
+		/**
+		 * Whether the address turned out to be this server's.
+		 */
+		bool self = false;
+		std::chrono::steady_clock::time_point last_answer;
+	};
+
+	struct Member {
+		Node node;
+
+		/**
+		 * The address the server answered at.
+		 */
+		std::string address;
+		std::chrono::steady_clock::time_point last_seen;
+	};
+
+	void Restart(uint64_t generation);
+	void Poll();
+	void OnTimer(beast::error_code ec, uint64_t generation);
+	void OnAnswer(const std::string& address, uint64_t generation, bool ok, const std::string& body);
+
+	inline bool IsEnabled() const {
+		return !url_.empty() && !token_.empty();
+	}
+
+	/**
+	 * Builds and publishes a new snapshot from the live members.
+	 * Must be called with the lock held.
+	 */
+	void Publish(bool changed);
+
+	net::io_context& io_context_;
+	net::steady_timer timer_;
+
+	mutable std::mutex lock_;
+	std::string url_;
+	std::string token_;
+	uint16_t weight_;
+	uint32_t load_;
+	std::vector<VM> local_vms_;
+	std::map<std::string, Peer> peers_;
+	std::map<std::string, Member> members_;
+
+	/**
+	 * Incremented by Configure() and Stop() so timers and answers to
+	 * polls from before are ignored.
+	 */
+	uint64_t generation_;
+
+	std::shared_ptr<const Snapshot> snapshot_;
+	std::atomic<uint64_t> version_;
+
+	ClusterSanctions sanctions_;
+};
@@ -0,0 +1,260 @@
+#include "ClusterSanctions.h"
+#include "IPBanTable.h"
+
+#include <algorithm>
+#include <chrono>
+
+/**
+ * How long removals are passed on for, which has to be longer than a change
+ * takes to reach every server.
+ */
+static constexpr int64_t kTombstoneLifetime = 10 * 60 * 1000;
+
+/**
+ * Limits on what another server can send, so a misbehaving one
+ * can't take up much memory.
+ */
+static constexpr size_t kMaxSanctions = 16384;
+static constexpr size_t kMaxCounts = 16384;
+static constexpr size_t kMaxReasonLength = 256;
+
+static int64_t GetTimeMillis() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Gets the end of the current window of a limit, which is the same on
+ * every server with the same settings.
+ */
+static int64_t GetWindowEnd(uint32_t window, int64_t now) {
+	return window ? (now / window + 1) * window : 0;
+}
+
+void ClusterSanctions::SetSelf(const std::string& url) {
+	std::lock_guard<std::mutex> lock(lock_);
+	if(url == self_)
+		return;
+	self_ = url;
+	sanctions_.clear();
+	changes_.clear();
+	counts_.clear();
+	remote_counts_.clear();
+}
+
+bool ClusterSanctions::IsNewer(const Sanction& sanction, const Sanction& current) {
+	return sanction.stamp > current.stamp || (sanction.stamp == current.stamp && sanction.origin > current.origin);
+}
+
+void ClusterSanctions::Record(const IPBan& ban, bool removed) {
+	std::lock_guard<std::mutex> lock(lock_);
+	if(self_.empty())
+		return;
+
+	// The change has to win over the one it replaces even if the clocks
+	// of the servers aren't quite in sync
+	Sanction& sanction = sanctions_[std::make_pair(ban.Prefix, ban.Type)];
+	sanction.stamp = std::max(GetTimeMillis(), sanction.stamp + 1);
+	sanction.ban = ban;
+	sanction.removed = removed;
+	sanction.origin = self_;
+	Expire(sanction.stamp / 1000);
+}
+
+std::vector<ClusterSanctions::Sanction> ClusterSanctions::TakeChanges() {
+	std::lock_guard<std::mutex> lock(lock_);
+	return std::move(changes_);
+}
+
+void ClusterSanctions::Increment(const std::string& ip, Counter counter, uint32_t window, int64_t now) {
+	std::lock_guard<std::mutex> lock(lock_);
+	if(self_.empty() || !window)
+		return;
+
+	int64_t window_end = GetWindowEnd(window, now);
+	auto [it, inserted] = counts_.try_emplace(Key(ip, static_cast<uint8_t>(counter)));
+	if(inserted && counts_.size() > kMaxCounts) {
+		Expire(now);
+		if(counts_.size() > kMaxCounts) {
+			counts_.erase(it);
+			return;
+		}
+	}
+
+	Count& count = it->second;
+	if(count.window_end != window_end) {
+		count.window_end = window_end;
+		count.count = 0;
+	}
+	if(count.count < UINT32_MAX)
+		count.count++;
+}
+
+uint32_t ClusterSanctions::GetRemoteCount(const std::string& ip, Counter counter, uint32_t window, int64_t now) const {
+	std::lock_guard<std::mutex> lock(lock_);
+	if(remote_counts_.empty() || !window)
+		return 0;
+
+	int64_t window_end = GetWindowEnd(window, now);
+	Key key(ip, static_cast<uint8_t>(counter));
+	uint64_t total = 0;
+	for(const auto& [url, counts] : remote_counts_) {
+		auto it = counts.find(key);
+		if(it != counts.end() && it->second.window_end == window_end)
+			total += it->second.count;
+	}
+	return static_cast<uint32_t>(std::min<uint64_t>(total, UINT32_MAX));
+}
+
+void ClusterSanctions::Write(rapidjson::Writer<rapidjson::StringBuffer>& writer, int64_t now) const {
+	std::lock_guard<std::mutex> lock(lock_);
+	int64_t now_ms = now * 1000;
+
+	writer.StartObject();
+	writer.String("bans");
+	writer.StartArray();
+	for(const auto& [key, sanction] : sanctions_) {
+		if(sanction.removed ? now_ms - sanction.stamp > kTombstoneLifetime : sanction.ban.Expires && sanction.ban.Expires <= now)
+			continue;
+		writer.StartObject();
+		writer.String("prefix");
+		writer.String(sanction.ban.Prefix.c_str(), sanction.ban.Prefix.length());
+		writer.String("type");
+		writer.Uint(sanction.ban.Type);
+		writer.String("expires");
+		writer.Int64(sanction.ban.Expires);
+		writer.String("reason");
+		writer.String(sanction.ban.Reason.c_str(), sanction.ban.Reason.length());
+		writer.String("removed");
+		writer.Bool(sanction.removed);
+		writer.String("stamp");
+		writer.Int64(sanction.stamp);
+		writer.String("origin");
+		writer.String(sanction.origin.c_str(), sanction.origin.length());
+		writer.EndObject();
+	}
+	writer.EndArray();
+
+	// Only this server's counters are sent, since each server polls every other one
+	writer.String("counts");
+	writer.StartArray();
+	for(const auto& [key, count] : counts_) {
+		if(count.window_end <= now)
+			continue;
+		writer.StartArray();
+		writer.String(key.first.c_str(), key.first.length());
+		writer.Uint(key.second);
+		writer.Int64(count.window_end);
+		writer.Uint(count.count);
+		writer.EndArray();
+	}
+	writer.EndArray();
+	writer.EndObject();
+}
+
+void ClusterSanctions::Merge(const std::string& url, const rapidjson::Value& value, int64_t now) {
+	if(!value.IsObject())
+		return;
+	auto bans = value.FindMember("bans");
+	auto counts = value.FindMember("counts");
+	if(bans == value.MemberEnd() || !bans->value.IsArray() || counts == value.MemberEnd() || !counts->value.IsArray())
+		return;
+
+	// Everything is checked before the lock is taken
+	std::vector<Sanction> sanctions;
+	for(auto it = bans->value.Begin(); it != bans->value.End() && sanctions.size() < kMaxSanctions; it++) {
+		const rapidjson::Value& ban = *it;
+		if(!ban.IsObject())
+			continue;
+		auto prefix = ban.FindMember("prefix");
+		auto type = ban.FindMember("type");
+		auto expires = ban.FindMember("expires");
+		auto reason = ban.FindMember("reason");
+		auto removed = ban.FindMember("removed");
+		auto stamp = ban.FindMember("stamp");
+		auto origin = ban.FindMember("origin");
+		if(prefix == ban.MemberEnd() || !prefix->value.IsString() ||
+		   type == ban.MemberEnd() || !type->value.IsUint() || type->value.GetUint() > IPBan::kMute ||
+		   expires == ban.MemberEnd() || !expires->value.IsInt64() ||
+		   reason == ban.MemberEnd() || !reason->value.IsString() ||
+		   removed == ban.MemberEnd() || !removed->value.IsBool() ||
+		   stamp == ban.MemberEnd() || !stamp->value.IsInt64() ||
+		   origin == ban.MemberEnd() || !origin->value.IsString() || !origin->value.GetStringLength())
+			continue;
+
+		Sanction& sanction = sanctions.emplace_back();
+		if(!IPBanTable::NormalizePrefix(std::string(prefix->value.GetString(), prefix->value.GetStringLength()),
+										sanction.ban.Prefix)) {
+			sanctions.pop_back();
+			continue;
+		}
+		sanction.ban.Type = type->value.GetUint();
+		sanction.ban.Expires = expires->value.GetInt64();
+		sanction.ban.Reason.assign(reason->value.GetString(), std::min<size_t>(reason->value.GetStringLength(), kMaxReasonLength));
+		sanction.removed = removed->value.GetBool();
+		sanction.stamp = stamp->value.GetInt64();
+		sanction.origin.assign(origin->value.GetString(), origin->value.GetStringLength());
+	}
+
+	Counts remote;
+	for(auto it = counts->value.Begin(); it != counts->value.End() && remote.size() < kMaxCounts; it++) {
+		const rapidjson::Value& count = *it;
+		if(!count.IsArray() || count.Size() != 4 || !count[0].IsString() || !count[1].IsUint() ||
+		   count[1].GetUint() >= static_cast<unsigned>(Counter::kCount) || !count[2].IsInt64() || !count[3].IsUint() ||
+		   count[2].GetInt64() <= now)
+			continue;
+		Count& entry = remote[Key(std::string(count[0].GetString(), count[0].GetStringLength()), count[1].GetUint())];
+		entry.window_end = count[2].GetInt64();
+		entry.count = count[3].GetUint();
+	}
+
+	std::lock_guard<std::mutex> lock(lock_);
+	if(self_.empty())
+		return;
+
+	for(Sanction& sanction : sanctions) {
+		auto key = std::make_pair(sanction.ban.Prefix, sanction.ban.Type);
+		auto current = sanctions_.find(key);
+		if(current != sanctions_.end() ? !IsNewer(sanction, current->second) : sanctions_.size() >= kMaxSanctions)
+			continue;
+		if(changes_.size() < kMaxSanctions)
+			changes_.push_back(sanction);
+		sanctions_[key] = std::move(sanction);
+	}
+
+	// Each server's counters only grow within a window, so the larger count is the later one
+	Counts& merged = remote_counts_[url];
+	for(auto& [key, count] : remote) {
+		Count& current = merged[key];
+		if(count.window_end > current.window_end || (count.window_end == current.window_end && count.count > current.count))
+			current = count;
+	}
+	Expire(now);
+}
+
+void ClusterSanctions::Forget(const std::string& url) {
+	std::lock_guard<std::mutex> lock(lock_);
+	remote_counts_.erase(url);
+}
+
+void ClusterSanctions::Expire(int64_t now) {
+	int64_t now_ms = now * 1000;
+	for(auto it = sanctions_.begin(); it != sanctions_.end();) {
+		const Sanction& sanction = it->second;
+		if(sanction.removed ? now_ms - sanction.stamp > kTombstoneLifetime : sanction.ban.Expires && sanction.ban.Expires <= now)
+			it = sanctions_.erase(it);
+		else
+			it++;
+	}
+
+	auto expire_counts = [now](Counts& counts) {
+		for(auto it = counts.begin(); it != counts.end();) {
+			if(it->second.window_end <= now)
+				it = counts.erase(it);
+			else
+				it++;
+		}
+	};
+	expire_counts(counts_);
+	for(auto& [url, counts] : remote_counts_)
+		expire_counts(counts);
+}
@@ -0,0 +1,141 @@
+#pragma once
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Database/IPBan.h"
+
+/**
+ * Replicates bans, mutes and rate limit counters between the servers of a
+ * cluster, so abusers can't get around them by spreading across servers.
+ * The state is sent along with each server's answers to the cluster's polls,
+ * and never asked for while a message is handled: checks only look at what
+ * was last received.
+ *
+ * Bans and mutes are a last-writer-wins map keyed by their prefix and type.
+ * Each change is stamped with the wall clock time it was made and the URL of
+ * the server that made it, and removals are kept as tombstones for a while so
+ * they win over older copies of what they removed. Every server passes on the
+ * whole map, so changes reach servers that can't poll each other directly.
+ *
+ * Rate limits are grow-only counters for each address and kind of limit, one
+ * per server, in fixed windows of the limit's length. A server only sends its
+ * own counters, and the others add them up.
+ *
+ * Can be used from any thread.
+ */
+class ClusterSanctions {
+   public:
+	enum class Counter : uint8_t {
+		kChat,
+		kTurn,
+		kName,
+		kCount
+	};
+
+	/**
+	 * A ban or mute as it was last changed by any server.
+	 */
+	struct Sanction {
+		IPBan ban;
+		bool removed = false;
+
+		/**
+		 * When it was changed, in milliseconds since the Unix epoch, and
+		 * the URL of the server that changed it, which breaks ties.
+		 */
+		int64_t stamp = 0;
+		std::string origin;
+	};
+
+	/**
+	 * Sets the URL changes made by this server are stamped with, or stops
+	 * recording them if it's empty. Forgets the state of other servers.
+	 */
+	void SetSelf(const std::string& url);
+
+	/**
+	 * Records a ban or mute that was added or removed on this server.
+	 */
+	void Record(const IPBan& ban, bool removed);
+
+	/**
+	 * Gets the bans and mutes other servers changed since the last call,
+	 * to be applied to this server's.
+	 */
+	std::vector<Sanction> TakeChanges();
+
+	/**
+	 * Counts an event of the kind for an address on this server.
+	 *
+	 * @param window The length of the limit's window in seconds.
+	 * @param now The current time in seconds since the Unix epoch.
+	 */
+	void Increment(const std::string& ip, Counter counter, uint32_t window, int64_t now);
+
+	/**
+	 * Gets the number of events of the kind the other servers have counted
+	 * for an address in the current window.
+	 */
+	uint32_t GetRemoteCount(const std::string& ip, Counter counter, uint32_t window, int64_t now) const;
+
+	/**
+	 * Writes the state that's sent to other servers as a JSON object.
+	 */
+	void Write(rapidjson::Writer<rapidjson::StringBuffer>& writer, int64_t now) const;
+
+	/**
+	 * Merges the state another server sent.
+	 */
+	void Merge(const std::string& url, const rapidjson::Value& value, int64_t now);
+
+	/**
+	 * Forgets the counters of a server that left the cluster.
+	 */
+	void Forget(const std::string& url);
+
+   private:
+	struct Count {
+		/**
+		 * When the window the count is for ends, in seconds since the Unix epoch.
+		 */
+		int64_t window_end = 0;
+		uint32_t count = 0;
+	};
+
+	typedef std::pair<std::string, uint8_t> Key;
+
+	struct KeyHash {
+		size_t operator()(const Key& key) const {
+			return std::hash<std::string>()(key.first) * 31 + key.second;
+		}
+	};
+
+	typedef std::unordered_map<Key, Count, KeyHash> Counts;
+
+	/**
+	 * Whether the change wins over the one it's compared to.
+	 */
+	static bool IsNewer(const Sanction& sanction, const Sanction& current);
+
+	/**
+	 * Drops counters whose window has ended and sanctions that no longer
+	 * need to be passed on. Must be called with the lock held.
+	 */
+	void Expire(int64_t now);
+
+	mutable std::mutex lock_;
+	std::string self_;
+	std::map<std::pair<std::string, uint8_t>, Sanction> sanctions_;
+	std::vector<Sanction> changes_;
+	Counts counts_;
+	std::map<std::string, Counts> remote_counts_;
+};
@@ -32,27 +32,50 @@ Please email rightowner@gmail.com for any assistance.
 */
 
 #include "CollabVM.h"
+#include "CPUSet.h"
+#include "EncoderPool.h"
+#include "FileIO.h"
+#include "FrameTrace.h"
+#include "GuacVNCClient.h"
+#include "HLSStream.h"
+#include "HTMLEncoder.h"
+#include "ImageCache.h"
+#include "ImageEncoder.h"
+#include "Logger.h"
+#include "MemoryAccounting.h"
 #include "GuacInstructionParser.h"
+#include "ByteBuffer.h"
+#include "ListenerHandoff.h"
+#include "Profiler.h"
+#include "SIMD.h"
+#include "Tracepoints.h"
 
 #include <boost/algorithm/string.hpp>
 
 #include <websocketmm/server.h>
 #include <websocketmm/websocket_user.h>
 
+#include <algorithm>
 #include <memory>
 #include <iostream>
 #include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #ifdef _WIN32
 	#include <sys/types.h>
 #endif
 
 #include <sys/stat.h>
+#ifndef _WIN32
+	#include <unistd.h>
+#endif
 
 #include "guacamole/user-handlers.h"
 #include "guacamole/unicode.h"
-#ifdef USE_JPEG
-	#include "guacamole/protocol.h"
-#endif
+#include "guacamole/protocol.h"
+#include "guacamole/guac_surface.h"
+#include "guacamole/screen_codec.h"
 
 //#include <ossp/uuid.h>
 #include <rapidjson/writer.h>
@@ -135,7 +158,16 @@ enum admin_opcodes_ {
 	kClearTurnQueue,  // End all turns
 	kRenameUser,	  // Rename a user
 	kUserIP,		  // Sends back a user's IP address
-	kForceTakeTurn	  // Skip the queue and forcefully take a turn (Turn-jacking)
+	kForceTakeTurn,	  // Skip the queue and forcefully take a turn (Turn-jacking)
+	kMemoryStats,	  // Get the memory used by the server, each VM and each connection
+	kStartRecording,  // Start recording the display of one or more VMs
+	kStopRecording,	  // Stop recording the display of one or more VMs
+	kGetIPBans,		  // Get the bans and mutes of IP addresses and subnets
+	kAddIPBan,		  // Ban or mute an IP address or subnet
+	kRemoveIPBan,	  // Remove the ban or mute of an IP address or subnet
+	kMigrateVM,		  // Migrate a VM to another server in the cluster
+	kSubscribeStats,  // Start or stop receiving the live stats each second
+	kProfile		  // Sample the stacks of the server's threads for some seconds
 };
 
 enum SERVER_SETTINGS {
@@ -148,7 +180,39 @@ enum SERVER_SETTINGS {
 	kJPEGQuality,
 	kModEnabled,
 	kModPerms,
-	kBlacklistedUsernames
+	kBlacklistedUsernames,
+	kDeflateEnabled,
+	kDeflateLevel,
+	kDeflateWindowBits,
+	kDeflateMemLevel,
+	kEncoderThreads,
+	kWebPMode,
+	kImageCacheSize,
+	kTileDiffing,
+	kSharedFramebuffer,
+	kMouseMoveRate,
+	kRefineDelay,
+	kScrollDetection,
+	kMaxTotalConnections,
+	kMaxPendingConnections,
+	kAcceptRate,
+	kMessageRate,
+	kReceiveRate,
+	kNetworkThreads,
+	kMetricsToken,
+	kRelayToken,
+	kClusterURL,
+	kClusterPeers,
+	kClusterWeight,
+	kClusterToken,
+	kTLSCertificate,
+	kTLSKey,
+	kLogLevel,
+	kLogJSON,
+	kAutoStartConcurrency,
+	kAutoStartMemory,
+	kEgressIPBudget,
+	kEgressHostBudget
 };
 
 const static std::string server_settings_[] = {
@@ -161,7 +225,39 @@ const static std::string server_settings_[] = {
 	"jpeg-quality",
 	"mod-enabled",
 	"mod-perms",
-	"blacklisted-usernames"
+	"blacklisted-usernames",
+	"deflate-enabled",
+	"deflate-level",
+	"deflate-window-bits",
+	"deflate-mem-level",
+	"encoder-threads",
+	"webp-mode",
+	"image-cache-size",
+	"tile-diffing",
+	"shared-framebuffer",
+	"mouse-move-rate",
+	"refine-delay",
+	"scroll-detection",
+	"max-total-cons",
+	"max-pending-cons",
+	"accept-rate",
+	"message-rate",
+	"receive-rate",
+	"network-threads",
+	"metrics-token",
+	"relay-token",
+	"cluster-url",
+	"cluster-peers",
+	"cluster-weight",
+	"cluster-token",
+	"tls-certificate",
+	"tls-key",
+	"log-level",
+	"log-json",
+	"autostart-concurrency",
+	"autostart-memory",
+	"egress-ip-budget",
+	"egress-host-budget"
 };
 
 enum VM_SETTINGS {
@@ -198,6 +294,36 @@ enum VM_SETTINGS {
 	kUploadCooldownTime,
 	kUploadMaxSize,
 	kUploadMaxFilename,
+	kCPULimit,
+	kCPUWeight,
+	kMemoryHigh,
+	kIOWeight,
+	kIdleCPULimit,
+	kIdlePolicy,
+	kIdleTimeout,
+	kVNCSocketType,
+	kAudioEnabled,
+	kOverlayRegions,
+	kPNGRealtimeLevel,
+	kPNGKeyframeLevel,
+	kPNGPalette,
+	kPNGFast,
+	kVMJPEGQuality,
+	kJPEGSubsampling,
+	kVideoEnabled,
+	kLatencyProbe,
+	kAutoStartPriority,
+	kBaseImage,
+	kVNCEncodings,
+	kVNCCompressLevel,
+	kVNCQualityLevel,
+	kCPUAffinity,
+	kJoinRate,
+	kQEMUDetached,
+	kSessionRecording,
+	kTargetBitrate,
+	kEncoderWeight,
+	kHLSEnabled,
 	kMOTD
 };
 
@@ -235,6 +361,36 @@ static const std::string vm_settings_[] = {
 	"upload-cooldown-time",
 	"upload-max-size",
 	"upload-max-filename",
+	"cpu-limit",
+	"cpu-weight",
+	"memory-high",
+	"io-weight",
+	"idle-cpu-limit",
+	"idle-policy",
+	"idle-timeout",
+	"vnc-socket-type",
+	"audio",
+	"overlay-regions",
+	"png-realtime-level",
+	"png-keyframe-level",
+	"png-palette",
+	"png-fast",
+	"jpeg-quality",
+	"jpeg-subsampling",
+	"video",
+	"latency-probe",
+	"auto-start-priority",
+	"base-image",
+	"vnc-encodings",
+	"vnc-compress-level",
+	"vnc-quality-level",
+	"cpu-affinity",
+	"join-rate",
+	"qemu-detached",
+	"session-recording",
+	"target-bitrate",
+	"encoder-weight",
+	"hls",
 	"motd"
 };
 
@@ -250,30 +406,77 @@ static const std::string snapshot_modes_[] {
 	"hd"
 };
 
+static const std::string idle_policies_[] {
+	"run",
+	"stop-updates",
+	"pause"
+};
+
+// In the order of guac_jpeg_subsampling
+static const std::string jpeg_subsamplings_[] {
+	"4:2:0",
+	"4:2:2",
+	"4:4:4"
+};
+
 void IgnorePipe();
 
 CollabVMServer::CollabVMServer(net::io_service& service)
 	: service_(service),
 	  server_(std::make_shared<CollabVMServer::Server>(service)),
 	  stopping_(false),
+	  presence_timer_running_(false),
 	  process_thread_running_(false),
+	  ip_data_(std::chrono::minutes(kIPDataTimerInterval), [this](IPData& ip_data) { return ShouldCleanUpIPData(ip_data); }),
 	  keep_alive_timer_(service),
+	  egress_timer_(service),
 	  vm_preview_timer_(service),
 	  ip_data_timer(service),
-	  ip_data_timer_running_(false),
+	  admin_stats_timer_(service),
+	  profile_timer_(service),
+	  presence_timer_(service),
+	  autostart_timer_(service),
+#ifndef _WIN32
+	  upgrade_acceptor_(service),
+	  upgrade_socket_(service),
+#endif
 	  guest_rng_(1000, 99999),
 	  rng_(std::chrono::steady_clock::now().time_since_epoch().count()),
-	  chat_history_(new ChatMessage[database_.Configuration.ChatMsgHistory]),
-	  chat_history_begin_(0),
-	  chat_history_end_(0),
-	  chat_history_count_(0),
-	  upload_count_(0) {
-	// Create VMControllers for all VMs that will be auto-started
+	  upload_count_(0),
+	  thumbnail_version_(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()),
+	  cluster_(std::make_shared<ClusterDirectory>(service)),
+	  list_cluster_version_(0) {
+	// Queue the VMs that will be auto-started, those with the highest
+	// priority first. Their controllers are created once they're started.
+	std::vector<std::shared_ptr<VMSettings>> autostart_vms;
 	for(auto [id, vm] : database_.VirtualMachines) {
-		if(vm->AutoStart) {
-			CreateVMController(vm);
-		}
+		if(vm->AutoStart)
+			autostart_vms.push_back(vm);
 	}
+	std::stable_sort(autostart_vms.begin(), autostart_vms.end(), [](const std::shared_ptr<VMSettings>& a, const std::shared_ptr<VMSettings>& b) {
+		return a->AutoStartPriority > b->AutoStartPriority;
+	});
+	for(const std::shared_ptr<VMSettings>& vm : autostart_vms)
+		autostart_queue_.push_back(vm->Name);
+
+	ip_bans_.Update(database_.IPBans);
+
+	Metrics& metrics = Metrics::Get();
+	metrics.Add("collabvm_connections", "Open WebSocket connections.", "", connections_metric_);
+	metrics.Add("collabvm_actions_queued", "Actions waiting for the processing thread.", "", queued_actions_metric_);
+	constexpr static const char* class_names[kActionClasses] = { "input", "vm-state", "chat", "bulk" };
+	for(size_t i = 0; i < kActionClasses; i++)
+		metrics.Add("collabvm_action_wait_seconds", "How long actions waited for the processing thread.",
+					Metrics::Label("class", class_names[i]), action_wait_metrics_[i]);
+	metrics.Add("collabvm_action_seconds", "How long the processing thread took to handle an action.", "", action_time_metric_);
+	metrics.Add("collabvm_upload_bytes_total", "Bytes of files received by uploads.", "", upload_bytes_metric_);
+	metrics.Add("collabvm_host_egress_bytes_total", "Bytes sent to all of the WebSocket connections.", "", egress_metric_);
+
+	// Settings are written to the database by its own thread, which
+	// reports back to the processing thread
+	database_.SetWriteCallback([this](bool success, const std::string& error) {
+		PostAction<DatabaseAction>(success, error);
+	});
 
 	// set up access channels to only log interesting things
 	//server_.clear_access_channels(websocketpp::log::alevel::all);
@@ -287,14 +490,24 @@ CollabVMServer::CollabVMServer(net::io_service& service)
 	}
 	catch (const websocketpp::exception& ex)
 	{
-		std::cout << "Failed to initialize ASIO" << std::endl;
+		Logger::Error() << "Failed to initialize ASIO";
 		throw ex;
 	}
 	 */
 }
 
 CollabVMServer::~CollabVMServer() {
-	delete[] chat_history_;
+	// The database writes what's left once it's destroyed, after the queue
+	database_.SetWriteCallback(nullptr);
+
+	Metrics& metrics = Metrics::Get();
+	metrics.Remove(&connections_metric_);
+	metrics.Remove(&queued_actions_metric_);
+	for(MetricHistogram& metric : action_wait_metrics_)
+		metrics.Remove(&metric);
+	metrics.Remove(&action_time_metric_);
+	metrics.Remove(&upload_bytes_metric_);
+	metrics.Remove(&egress_metric_);
 }
 
 std::shared_ptr<VMController> CollabVMServer::CreateVMController(const std::shared_ptr<VMSettings>& vm) {
@@ -309,10 +522,392 @@ std::shared_ptr<VMController> CollabVMServer::CreateVMController(const std::shar
 	}
 
 	vm_controllers_[vm->Name] = controller;
+
+	// The VM's last thumbnail is shown until it has a new one
+	if(std::shared_ptr<const VMThumbnail> thumbnail = thumbnail_store_.Load(vm->Name)) {
+		uint64_t version = ++thumbnail_version_;
+		controller->SetThumbnail(thumbnail, version);
+		PublishThumbnail(vm->Name, thumbnail, version);
+	}
+	InvalidateList();
 	return controller;
 }
 
-void CollabVMServer::Run(uint16_t port, std::string doc_root) {
+static void AppendArgument(ByteBuffer& buffer, std::string_view arg) {
+	buffer.Append(',');
+	buffer.AppendInt(arg.length());
+	buffer.Append('.');
+	buffer.Append(arg);
+}
+
+/**
+ * Gets the URL of a VM's thumbnail, which is served from path on the
+ * server at base. base is empty for this server.
+ */
+static std::string GetThumbnailURL(const std::string& base, const std::string& path, const std::string& vm_name) {
+	std::string url(base.length() + path.length() + vm_name.length() * 3, '\0');
+	base.copy(&url[0], base.length());
+	path.copy(&url[base.length()], path.length());
+	char* end = uriEscapeExA(vm_name.data(), vm_name.data() + vm_name.length(),
+							 &url[base.length() + path.length()], URI_FALSE, URI_FALSE);
+	url.resize(end - url.data());
+	return url;
+}
+
+/**
+ * Gets the metrics token sent with a request, either as a bearer token in the
+ * Authorization header or in the token parameter of the query string.
+ */
+/**
+ * Gets the value of a parameter in the query string of a request's target,
+ * or an empty string if it doesn't have one.
+ */
+static std::string_view GetQueryParameter(const websocketmm::http_request& request, std::string_view name) {
+	std::string_view target(request.target().data(), request.target().size());
+	size_t query = target.find('?');
+	while(query != std::string_view::npos) {
+		std::string_view param = target.substr(query + 1);
+		param = param.substr(0, param.find('&'));
+		if(param.size() > name.size() && param.compare(0, name.size(), name) == 0 && param[name.size()] == '=')
+			return param.substr(name.size() + 1);
+		query = target.find('&', query + 1);
+	}
+	return std::string_view();
+}
+
+static std::string GetMetricsToken(const websocketmm::http_request& request) {
+	static const std::string_view kBearer = "Bearer ";
+	auto authorization = request.find(http::field::authorization);
+	if(authorization != request.end()) {
+		std::string_view value(authorization->value().data(), authorization->value().size());
+		if(value.compare(0, kBearer.length(), kBearer) == 0)
+			return std::string(value.substr(kBearer.length()));
+	}
+	return std::string(GetQueryParameter(request, "token"));
+}
+
+/**
+ * Creates the response to an HTTP request for the metrics, or for the sampled
+ * frame traces if trace is true, or a 401 response if the request doesn't
+ * have the metrics token.
+ */
+static std::shared_ptr<websocketmm::http_response> CreateMetricsResponse(const websocketmm::http_request& request, bool trace) {
+	if(!Metrics::Get().CheckToken(GetMetricsToken(request))) {
+		auto response = std::make_shared<websocketmm::http_response>(http::status::unauthorized, request.version());
+		response->keep_alive(request.keep_alive());
+		response->set(http::field::www_authenticate, "Bearer");
+		response->prepare_payload();
+		return response;
+	}
+
+	auto response = std::make_shared<websocketmm::http_response>(http::status::ok, request.version());
+	response->keep_alive(request.keep_alive());
+	response->set(http::field::content_type, trace ? "application/json" : "text/plain; version=0.0.4");
+	response->set(http::field::cache_control, "no-store");
+
+	std::string metrics = trace ? FrameTracer::GetTraceEvents()
+								: Metrics::Get().Format() + MemoryAccounting::Get().GetMetrics();
+	if(request.method() == http::verb::head) {
+		response->content_length(metrics.length());
+	} else {
+		response->body().assign(metrics.begin(), metrics.end());
+		response->prepare_payload();
+	}
+	return response;
+}
+
+/**
+ * Creates the response to another server's poll for the VMs this server runs,
+ * or a 401 response if the request doesn't have the cluster token.
+ */
+static std::shared_ptr<websocketmm::http_response> CreateClusterResponse(const websocketmm::http_request& request,
+																		  const ClusterDirectory& cluster) {
+	auto response = std::make_shared<websocketmm::http_response>(http::status::ok, request.version());
+	response->keep_alive(request.keep_alive());
+	if(!cluster.CheckToken(GetMetricsToken(request))) {
+		response->result(http::status::unauthorized);
+		response->set(http::field::www_authenticate, "Bearer");
+		response->prepare_payload();
+		return response;
+	}
+
+	response->set(http::field::content_type, "application/json");
+	response->set(http::field::cache_control, "no-store");
+	std::string status = cluster.GetStatus();
+	if(request.method() == http::verb::head) {
+		response->content_length(status.length());
+	} else {
+		response->body().assign(status.begin(), status.end());
+		response->prepare_payload();
+	}
+	return response;
+}
+
+/**
+ * Creates the response to another server's request to migrate a VM here,
+ * once the processing thread has answered it. The requesting server has
+ * its own timeout, so this one only has to stop the network thread from
+ * waiting forever.
+ */
+static std::shared_ptr<websocketmm::http_response> CreateMigrateResponse(const websocketmm::http_request& request,
+																		  const ClusterDirectory& cluster,
+																		  const std::function<std::future<std::string>()>& start) {
+	auto response = std::make_shared<websocketmm::http_response>(http::status::ok, request.version());
+	response->keep_alive(request.keep_alive());
+	if(!cluster.CheckToken(GetMetricsToken(request))) {
+		response->result(http::status::unauthorized);
+		response->set(http::field::www_authenticate, "Bearer");
+		response->prepare_payload();
+		return response;
+	}
+
+	std::future<std::string> answer = start();
+	if(answer.wait_for(std::chrono::seconds(5)) != std::future_status::ready) {
+		response->result(http::status::service_unavailable);
+		response->prepare_payload();
+		return response;
+	}
+
+	std::string body = answer.get();
+	response->set(http::field::content_type, "application/json");
+	response->set(http::field::cache_control, "no-store");
+	response->body().assign(body.begin(), body.end());
+	response->prepare_payload();
+	return response;
+}
+
+/**
+ * Picks the image of a thumbnail for a request. The size is the smallest
+ * one at least as large as the size parameter of the query string, or the
+ * default without one, and the format is WebP or JPEG if the Accept header
+ * names them, in that order, or PNG otherwise. The default PNG image is
+ * the fallback when the thumbnail doesn't have the image that was picked.
+ */
+static void PickThumbnailImage(const websocketmm::http_request& request, const VMThumbnail& thumbnail,
+							   size_t& size, ImageFormat& format) {
+	size = VMThumbnail::kDefaultSize;
+	std::string_view size_param = GetQueryParameter(request, "size");
+	if(!size_param.empty()) {
+		int requested = std::atoi(std::string(size_param).c_str());
+		size = VMThumbnail::kSizeCount - 1;
+		while(size > 0 && VMThumbnail::kSizes[size - 1] >= requested)
+			size--;
+	}
+
+	format = ImageFormat::kPNG;
+	auto accept = request.find(http::field::accept);
+	if(accept != request.end()) {
+		if(accept->value().find("image/webp") != beast::string_view::npos &&
+		   !thumbnail.GetImage(size, ImageFormat::kWebP).empty())
+			format = ImageFormat::kWebP;
+		else if(accept->value().find("image/jpeg") != beast::string_view::npos &&
+				!thumbnail.GetImage(size, ImageFormat::kJPEG).empty())
+			format = ImageFormat::kJPEG;
+	}
+
+	if(thumbnail.GetImage(size, format).empty()) {
+		size = VMThumbnail::kDefaultSize;
+		format = ImageFormat::kPNG;
+	}
+}
+
+/**
+ * Creates the response to an HTTP request for a thumbnail, or a 404
+ * response if there is no thumbnail. Browsers revalidate the thumbnail with
+ * its ETag each time it's displayed, so an unchanged thumbnail is not sent again.
+ */
+static std::shared_ptr<websocketmm::http_response> CreateThumbnailResponse(const websocketmm::http_request& request,
+																			const std::shared_ptr<const VMThumbnail>& thumbnail,
+																			uint64_t version) {
+	static const char* const kContentTypes[] = { "image/png", "image/jpeg", "image/webp" };
+	static const char* const kExtensions[] = { "png", "jpeg", "webp" };
+
+	auto response = std::make_shared<websocketmm::http_response>(http::status::ok, request.version());
+	response->keep_alive(request.keep_alive());
+
+	if(!thumbnail) {
+		response->result(http::status::not_found);
+		response->prepare_payload();
+		return response;
+	}
+
+	size_t size;
+	ImageFormat format;
+	PickThumbnailImage(request, *thumbnail, size, format);
+	const std::vector<uint8_t>& image = thumbnail->GetImage(size, format);
+
+	// Each image has an ETag of its own, since caches store one per Accept header
+	std::string etag = '"' + std::to_string(version) + '-' + std::to_string(VMThumbnail::kSizes[size]) + '-' +
+					   kExtensions[static_cast<size_t>(format)] + '"';
+	response->set(http::field::etag, etag);
+	response->set(http::field::cache_control, "no-cache");
+	response->set(http::field::vary, "Accept");
+
+	auto if_none_match = request.find(http::field::if_none_match);
+	if(if_none_match != request.end() &&
+	   (if_none_match->value() == "*" || if_none_match->value().find(etag) != beast::string_view::npos)) {
+		response->result(http::status::not_modified);
+		return response;
+	}
+
+	response->set(http::field::content_type, kContentTypes[static_cast<size_t>(format)]);
+	if(request.method() == http::verb::head) {
+		response->content_length(image.size());
+	} else {
+		response->body() = image;
+		response->prepare_payload();
+	}
+	return response;
+}
+
+/**
+ * Creates the response to an HTTP request for the playlist or a segment of
+ * a VM's HLS stream, given the path after the HLS prefix in the form
+ * "<escaped VM name>/<file>", or a 404 response if either doesn't exist.
+ * Segments never change, so caches can keep them for as long as they like,
+ * while the playlist changes with each segment.
+ */
+static std::shared_ptr<websocketmm::http_response> CreateHLSResponse(const websocketmm::http_request& request,
+																	  beast::string_view path) {
+	auto response = std::make_shared<websocketmm::http_response>(http::status::ok, request.version());
+	response->keep_alive(request.keep_alive());
+	response->set(http::field::access_control_allow_origin, "*");
+
+	std::shared_ptr<HLSStream> stream;
+	const size_t slash = path.rfind('/');
+	if(slash != beast::string_view::npos) {
+		std::string vm_name(path.substr(0, slash));
+		vm_name.resize(uriUnescapeInPlaceA(&vm_name[0]) - vm_name.data());
+		stream = HLSStream::Find(vm_name);
+	}
+
+	std::vector<uint8_t> body;
+	if(stream) {
+		beast::string_view file = path.substr(slash + 1);
+		if(file == "index.m3u8") {
+			std::string playlist = stream->GetPlaylist();
+			body.assign(playlist.begin(), playlist.end());
+			response->set(http::field::content_type, "application/vnd.apple.mpegurl");
+			response->set(http::field::cache_control, "max-age=1");
+		} else if(auto segment = stream->GetSegment(std::string_view(file.data(), file.size()))) {
+			body = *segment;
+			response->set(http::field::content_type, "video/mp2t");
+			response->set(http::field::cache_control, "public, max-age=60");
+		}
+	}
+
+	if(body.empty()) {
+		response->result(http::status::not_found);
+		response->prepare_payload();
+		return response;
+	}
+
+	if(request.method() == http::verb::head) {
+		response->content_length(body.size());
+	} else {
+		response->body() = std::move(body);
+		response->prepare_payload();
+	}
+	return response;
+}
+
+/**
+ * Creates the response to an HTTP request for a screenshot, or a 404
+ * response if there is no copy of the display to take it from. The
+ * screenshot is the display the thumbnail was rendered from, so it's never
+ * older than the interval thumbnails are updated at, and each format is only
+ * encoded for the first request that asks for it. It's PNG unless the
+ * format parameter of the query string is jpeg.
+ */
+static std::shared_ptr<websocketmm::http_response> CreateScreenshotResponse(const websocketmm::http_request& request,
+																			 const std::shared_ptr<const VMThumbnail>& thumbnail,
+																			 uint64_t version, uint16_t max_age) {
+	constexpr static int kScreenshotQuality = 90;
+
+	auto response = std::make_shared<websocketmm::http_response>(http::status::ok, request.version());
+	response->keep_alive(request.keep_alive());
+
+	if(!thumbnail || !thumbnail->screen) {
+		response->result(http::status::not_found);
+		response->prepare_payload();
+		return response;
+	}
+
+	const bool jpeg = GetQueryParameter(request, "format") == "jpeg";
+	std::string etag = '"' + std::to_string(version) + (jpeg ? "-jpeg\"" : "-png\"");
+	response->set(http::field::etag, etag);
+	response->set(http::field::cache_control, "max-age=" + std::to_string(max_age));
+
+	auto if_none_match = request.find(http::field::if_none_match);
+	if(if_none_match != request.end() &&
+	   (if_none_match->value() == "*" || if_none_match->value().find(etag) != beast::string_view::npos)) {
+		response->result(http::status::not_modified);
+		return response;
+	}
+
+	ImageEncodeParams params;
+	params.format = jpeg ? ImageFormat::kJPEG : ImageFormat::kPNG;
+	params.png_profile = &GUAC_PNG_DEFAULT_PROFILE;
+	params.jpeg_quality = kScreenshotQuality;
+
+	// Requests for a screenshot that's being encoded wait for it instead of encoding it again
+	VMThumbnail::Screenshots& screenshots = *thumbnail->screenshots;
+	std::lock_guard<std::mutex> lock(screenshots.lock);
+	std::vector<uint8_t>& image = screenshots.images[static_cast<size_t>(params.format)];
+	if(image.empty()) {
+		// The screen is only read, cairo just doesn't have a const surface
+		cairo_surface_t* surface = cairo_image_surface_create_for_data(
+			const_cast<unsigned char*>(thumbnail->screen->data()), CAIRO_FORMAT_RGB24,
+			thumbnail->screen_width, thumbnail->screen_height, thumbnail->screen_stride);
+		int result = ImageEncoders::Get().Encode(surface, params, image);
+		cairo_surface_destroy(surface);
+		if(result) {
+			image.clear();
+			response->result(http::status::internal_server_error);
+			response->erase(http::field::etag);
+			response->prepare_payload();
+			return response;
+		}
+	}
+
+	response->set(http::field::content_type, jpeg ? "image/jpeg" : "image/png");
+	if(request.method() == http::verb::head) {
+		response->content_length(image.size());
+	} else {
+		response->body() = image;
+		response->prepare_payload();
+	}
+	return response;
+}
+
+bool CollabVMServer::TakeScreenshotToken(const boost::asio::ip::address& address) {
+	auto now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock(screenshot_tokens_lock_);
+
+	// Addresses whose buckets have filled up again are the same as new ones
+	if(screenshot_tokens_.size() >= kMaxScreenshotAddresses) {
+		for(auto it = screenshot_tokens_.begin(); it != screenshot_tokens_.end();) {
+			std::chrono::duration<double> elapsed = now - it->second.second;
+			if(it->second.first + elapsed.count() * kScreenshotRate >= kScreenshotBurst)
+				it = screenshot_tokens_.erase(it);
+			else
+				++it;
+		}
+		if(screenshot_tokens_.size() >= kMaxScreenshotAddresses)
+			return false;
+	}
+
+	auto bucket = screenshot_tokens_.try_emplace(address.to_string(), kScreenshotBurst, now).first;
+	std::chrono::duration<double> elapsed = now - bucket->second.second;
+	bucket->second.first = std::min(bucket->second.first + elapsed.count() * kScreenshotRate, kScreenshotBurst);
+	bucket->second.second = now;
+	if(bucket->second.first < 1)
+		return false;
+	bucket->second.first--;
+	return true;
+}
+
+void CollabVMServer::Run(uint16_t port, std::string doc_root, const std::vector<int>& listeners) {
 	using namespace std::placeholders;
 
 	// The path shouldn't end in a slash
@@ -321,31 +916,123 @@ void CollabVMServer::Run(uint16_t port, std::string doc_root) {
 		doc_root = doc_root.substr(0, doc_root.length() - 1);
 	doc_root_ = doc_root;
 
+	// Uploads are saved here until they've been sent to the agent
+	::mkdir(kFileUploadPath.c_str(), 0700);
+	::mkdir(kRecordingPath.c_str(), 0700);
+	::mkdir(kSessionRecordingPath.c_str(), 0700);
+
 	server_->set_verify_handler(std::bind(&CollabVMServer::OnValidate, this, _1));
 	server_->set_open_handler(std::bind(&CollabVMServer::OnOpen, this, _1));
 	server_->set_close_handler(std::bind(&CollabVMServer::OnClose, this, _1));
 	server_->set_message_handler(std::bind(&CollabVMServer::OnMessageFromWS, this, _1, _2));
+	server_->set_resync_handler(std::bind(&CollabVMServer::OnResync, this, _1));
+	server_->set_http_handler([this](const websocketmm::http_request& request,
+									 const boost::asio::ip::address& address) -> std::shared_ptr<websocketmm::http_response> {
+		// Other servers in the cluster ask for VMs to be migrated here
+		if(request.method() == http::verb::post) {
+			beast::string_view target = request.target();
+			const size_t prefix = std::strlen(ClusterDirectory::kMigratePath);
+			if(target.compare(0, prefix, ClusterDirectory::kMigratePath) != 0)
+				return nullptr;
+
+			std::string vm_name(target.substr(prefix, target.find('?') - prefix));
+			vm_name.resize(uriUnescapeInPlaceA(&vm_name[0]) - vm_name.data());
+			return CreateMigrateResponse(request, *cluster_, [this, &vm_name]() { return PostIncomingMigration(vm_name); });
+		}
+		if(request.method() != http::verb::get && request.method() != http::verb::head)
+			return nullptr;
+
+		// Everything other than thumbnails and metrics is served from the doc root
+		beast::string_view target = request.target();
+		beast::string_view path = target.substr(0, target.find('?'));
+		if(path == kMetricsPath || path == kTracePath)
+			return Metrics::Get().IsEnabled() ? CreateMetricsResponse(request, path == kTracePath) : nullptr;
+		if(path == ClusterDirectory::kPath)
+			return CreateClusterResponse(request, *cluster_);
+		if(path.compare(0, kHLSPath.length(), kHLSPath) == 0)
+			return CreateHLSResponse(request, path.substr(kHLSPath.length()));
+		const bool screenshot = target.compare(0, kScreenshotPath.length(), kScreenshotPath) == 0;
+		if(!screenshot && target.compare(0, kThumbnailPath.length(), kThumbnailPath) != 0)
+			return nullptr;
+
+		if(screenshot && !TakeScreenshotToken(address)) {
+			auto response = std::make_shared<websocketmm::http_response>(http::status::too_many_requests, request.version());
+			response->keep_alive(request.keep_alive());
+			response->set(http::field::retry_after, std::to_string(static_cast<int>(1 / kScreenshotRate)));
+			response->prepare_payload();
+			return response;
+		}
+
+		// Strip the query string and unescape the VM name
+		const size_t prefix = screenshot ? kScreenshotPath.length() : kThumbnailPath.length();
+		std::string vm_name(target.substr(prefix, target.find('?') - prefix));
+		vm_name.resize(uriUnescapeInPlaceA(&vm_name[0]) - vm_name.data());
 
-	// Split blacklisted usernames into array
+		std::shared_ptr<const VMThumbnail> thumbnail;
+		uint64_t version = 0;
+		{
+			std::lock_guard<std::mutex> lock(thumbnails_lock_);
+			auto it = thumbnails_.find(vm_name);
+			if(it != thumbnails_.end()) {
+				thumbnail = it->second.first;
+				version = it->second.second;
+			}
+		}
+		if(screenshot)
+			return CreateScreenshotResponse(request, thumbnail, version, kVMPreviewInterval);
+		return CreateThumbnailResponse(request, thumbnail, version);
+	});
+	server_->set_body_handler([this](const websocketmm::http_request_header& header) -> std::shared_ptr<websocketmm::http_body_sink> {
+		beast::string_view target = header.target();
+		if(header.method() != http::verb::post || target.compare(0, kUploadPath.length(), kUploadPath) != 0)
+			return nullptr;
+
+		// Chunked bodies don't have a length, and are checked as they're written
+		uint64_t content_length = std::strtoull(std::string(header[http::field::content_length]).c_str(), nullptr, 10);
+		return StartHttpUpload(std::string(target.substr(kUploadPath.length())), content_length);
+	});
+	server_->set_doc_root(doc_root_);
+	server_->set_send_budget(kMaxSendQueueBytes);
+	server_->set_idle_timeout(std::chrono::seconds(kKeepAliveTimeout));
+	SetDeflateOptions(database_.Configuration);
+	SetAdmissionLimits(database_.Configuration);
+	SetTLSFiles(database_.Configuration);
+	SetLogOptions(database_.Configuration);
+	EncoderPool::Get().SetThreadCount(database_.Configuration.EncoderThreads);
+	Metrics::Get().SetToken(database_.Configuration.MetricsToken);
+	SetRelayToken(database_.Configuration.RelayToken);
+	cluster_->Configure(database_.Configuration.ClusterURL, database_.Configuration.ClusterPeers,
+						database_.Configuration.ClusterWeight, database_.Configuration.ClusterToken);
+	ImageCache::Get().SetCapacity(static_cast<size_t>(database_.Configuration.ImageCacheSize) * 1024 * 1024);
+	Logger::Info() << "Image encoders: " << ImageEncoders::Get().Describe();
+	Logger::Info() << "Upload file I/O: " << FileIO::Get().GetBackendName();
+	Logger::Info() << "SIMD kernels: " << SIMD::Describe();
+	guac_common_surface_set_tile_diffing(database_.Configuration.TileDiffing);
+	guac_common_surface_set_refine_delay(database_.Configuration.RefineDelay);
+	guac_common_surface_set_scroll_detection(database_.Configuration.ScrollDetection);
+	GuacVNCClient::SetShareFramebuffer(database_.Configuration.SharedFramebuffer);
+	GuacVNCClient::SetMouseMoveRate(database_.Configuration.MouseMoveRate);
+
+	// Split blacklisted usernames into a set
 	boost::split(blacklisted_usernames_, database_.Configuration.BlacklistedNames, boost::is_any_of(";"));
 
 	// retains compatibility with previous server behaviour
-	server_->start("0.0.0.0", port);
+	server_->start("0.0.0.0", port, database_.Configuration.NetworkThreads, listeners);
+	ListenForUpgrade();
 
 	boost::system::error_code asio_ec;
 	vm_preview_timer_.expires_from_now(std::chrono::seconds(kVMPreviewInterval), asio_ec);
 	vm_preview_timer_.async_wait(std::bind(&CollabVMServer::VMPreviewTimerCallback, shared_from_this(), std::placeholders::_1));
 
-#ifdef USE_JPEG
-	// Set the JPEG quality
-	if(database_.Configuration.JPEGQuality <= 100)
-		SetJPEGQuality(database_.Configuration.JPEGQuality);
+	// Set the JPEG quality, 255 disables JPEG
+	SetJPEGQuality(database_.Configuration.JPEGQuality);
+#ifdef USE_WEBP
+	SetWebPMode(static_cast<guac_webp_mode>(database_.Configuration.WebPMode), database_.Configuration.JPEGQuality);
 #endif
 
-	// Start all of the VMs that should be auto-started
-	for(auto [id, vm] : vm_controllers_) {
-		vm->Start();
-	}
+	// The listener is already up, so the VMs that should be auto-started
+	// are started a few at a time instead of all thrashing the disk at once
+	StartQueuedVMs();
 
 	// Start message processing thread
 	process_thread_running_ = true;
@@ -356,72 +1043,45 @@ void CollabVMServer::Run(uint16_t port, std::string doc_root) {
 	// so we do not bother here.
 }
 
-bool CollabVMServer::FindIPv4Data(const boost::asio::ip::address_v4& addr, IPData*& ip_data) {
-	auto it = ipv4_data_.find(addr.to_ulong());
-	if(it == ipv4_data_.end())
-		return false;
-	ip_data = it->second;
-	return true;
-}
-
-bool CollabVMServer::FindIPData(const boost::asio::ip::address& addr, IPData*& ip_data) {
-	if(addr.is_v4()) {
-		return FindIPv4Data(addr.to_v4(), ip_data);
-	} else {
-		const boost::asio::ip::address_v6& addr_v6 = addr.to_v6();
-		if(addr_v6.is_v4_mapped()) {
-			return FindIPv4Data(addr_v6.to_v4(), ip_data);
-		} else {
-			typedef boost::asio::detail::array<unsigned char, 16> bytes_type;
-			auto it = ipv6_data_.find(addr_v6.to_bytes());
-			if(it == ipv6_data_.end())
-				return false;
-			ip_data = it->second;
-		}
-	}
-	return true;
-}
-
-IPData* CollabVMServer::CreateIPv4Data(const boost::asio::ip::address_v4& addr, bool one_connection) {
-	unsigned long ipv4 = addr.to_ulong();
-	IPData* ip_data = new IPv4Data(ipv4, one_connection);
-	ipv4_data_[ipv4] = ip_data;
-	return ip_data;
-}
+bool CollabVMServer::OnValidate(std::weak_ptr<websocketmm::websocket_user> handle) {
+	if(auto handle_sp = handle.lock()) {
+		// Relays send the relay token, and the address of the viewer when
+		// the connection is for one of their viewers. Their display
+		// connections aren't shown to anyone and only receive the display.
+		RelayRole relay_role = RelayRole::kNone;
+		if(auto& request = handle_sp->GetUpgradeRequest()) {
+			auto token = request->find("X-CollabVM-Relay");
+			if(token != request->end()) {
+				if(!CheckRelayToken(std::string_view(token->value().data(), token->value().size())))
+					return false;
 
-IPData* CollabVMServer::CreateIPData(const boost::asio::ip::address& addr, bool one_connection) {
-	if(addr.is_v4()) {
-		return CreateIPv4Data(addr.to_v4(), one_connection);
-	} else {
-		const boost::asio::ip::address_v6& addr_v6 = addr.to_v6();
-		if(addr_v6.is_v4_mapped()) {
-			return CreateIPv4Data(addr_v6.to_v4(), one_connection);
-		} else {
-			const std::array<unsigned char, 16>& ipv6 = addr_v6.to_bytes();
-			IPData* ip_data = new IPv6Data(ipv6, one_connection);
-			ipv6_data_[ipv6] = ip_data;
-			return ip_data;
+				auto viewer = request->find("X-CollabVM-Relay-For");
+				if(viewer != request->end()) {
+					boost::system::error_code ec;
+					boost::asio::ip::address viewer_address = boost::asio::ip::make_address(std::string(viewer->value()), ec);
+					if(ec)
+						return false;
+					handle_sp->SetProxyAddress(viewer_address);
+					relay_role = RelayRole::kViewer;
+				} else {
+					relay_role = RelayRole::kDisplay;
+				}
+			}
 		}
-	}
-}
 
-void CollabVMServer::DeleteIPData(IPData& ip_data) {
-	if(ip_data.type == IPData::IPType::kIPv4)
-		ipv4_data_.erase(static_cast<IPv4Data&>(ip_data).addr);
-	else
-		ipv6_data_.erase(static_cast<IPv6Data&>(ip_data).addr);
-
-	delete &ip_data;
-}
+		// Banned addresses are refused before anything is allocated for them
+		if(ip_bans_.Lookup(handle_sp->GetAddress(), std::time(nullptr)).banned)
+			return false;
 
-bool CollabVMServer::OnValidate(std::weak_ptr<websocketmm::websocket_user> handle) {
-	if(auto handle_sp = handle.lock()) {
+		beast::string_view selected_subprotocol;
 		auto do_subprotocol_check = [&](beast::string_view offered_tokens) -> bool {
 			// tokenize the Sec-Websocket-Protocol header offered by the client
 			http::token_list offered(offered_tokens);
 			// TODO
 
-			constexpr std::array<beast::string_view, 1> supported {
+			// The first supported subprotocol offered by the client is selected
+			constexpr std::array<beast::string_view, 2> supported {
+				GUAC_BINARY_SUBPROTOCOL,
 				"guacamole"
 			};
 
@@ -431,6 +1091,7 @@ bool CollabVMServer::OnValidate(std::weak_ptr<websocketmm::websocket_user> handl
 				if(iter != offered.end()) {
 					// Select compatible subprotocol
 					handle_sp->SelectSubprotocol((*iter).to_string());
+					selected_subprotocol = proto;
 					return true;
 				}
 			}
@@ -442,22 +1103,29 @@ bool CollabVMServer::OnValidate(std::weak_ptr<websocketmm::websocket_user> handl
 			// Create new IPData object
 			boost::asio::ip::address addr = handle_sp->GetAddress();
 
-			std::unique_lock<std::mutex> ip_lock(ip_lock_);
-			IPData* ip_data;
-
-			if(FindIPData(addr, ip_data)) {
-				if(ip_data->connections >= database_.Configuration.MaxConnections)
-					return false;
-				// Reuse existing IPData
-				ip_data->connections++;
-			} else {
-				// Create new IPData
-				ip_data = CreateIPData(addr, true);
-			}
-
-			ip_lock.unlock();
+			// A relay opens a display connection for each VM its viewers are
+			// watching, which shouldn't use up the connections of its address
+			uint8_t max_connections = relay_role == RelayRole::kDisplay ? UINT8_MAX : database_.Configuration.MaxConnections;
+			IPData* ip_data = ip_data_.AddConnection(addr, max_connections);
+			if(ip_data == nullptr)
+				return false;
 
 			handle_sp->GetUserData().user = std::make_shared<CollabVMUser>(handle, *ip_data);
+			handle_sp->GetMemoryAccount().Allocate(MemoryCategory::kConnections, sizeof(CollabVMUser));
+			handle_sp->GetUserData().user->binary_images = selected_subprotocol == GUAC_BINARY_SUBPROTOCOL;
+			handle_sp->GetUserData().user->relay_role = relay_role;
+
+			// Spectators name the VM in the path, since they never send anything
+			auto& request = handle_sp->GetUpgradeRequest();
+			if(relay_role == RelayRole::kNone && request) {
+				beast::string_view target = request->target();
+				if(target.compare(0, kSpectatePath.length(), kSpectatePath) == 0) {
+					CollabVMUser& user = *handle_sp->GetUserData().user;
+					user.spectate_vm = std::string(target.substr(kSpectatePath.length(), target.find('?') - kSpectatePath.length()));
+					user.spectate_vm.resize(uriUnescapeInPlaceA(&user.spectate_vm[0]) - user.spectate_vm.data());
+					user.spectator = GetQueryParameter(*request, "chat") == "1" ? Spectator::kChat : Spectator::kDisplay;
+				}
+			}
 			return true;
 		}
 	}
@@ -478,38 +1146,53 @@ void CollabVMServer::OnClose(std::weak_ptr<websocketmm::websocket_user> handle)
 	}
 }
 
-/*
-std::string CollabVMServer::GenerateUuid()
-{
-	char buffer[UUID_LEN_STR + 1];
-
-	uuid_t* uuid;
-
-    // Attempt to create UUID objec
-	if (uuid_create(&uuid) != UUID_RC_OK) {
-		throw std::string("Could not allocate memory for UUID");
-	}
-
-    // Generate random UUID
-	if (uuid_make(uuid, UUID_MAKE_V4) != UUID_RC_OK) {
-		uuid_destroy(uuid);
-		throw std::string("UUID generation failed");
+void CollabVMServer::OnResync(std::weak_ptr<websocketmm::websocket_user> handle) {
+	if(auto handle_sp = handle.lock()) {
+		PostAction<UserAction>(*handle_sp->GetUserData().user, ActionType::kResyncDisplay);
 	}
+}
 
-	char* identifier = buffer;
-	size_t identifier_length = sizeof(buffer);
+void CollabVMServer::PublishThumbnail(const std::string& vm_name, const std::shared_ptr<const VMThumbnail>& thumbnail, uint64_t version) {
+	std::lock_guard<std::mutex> lock(thumbnails_lock_);
+	if(thumbnail)
+		thumbnails_[vm_name] = std::make_pair(thumbnail, version);
+	else
+		thumbnails_.erase(vm_name);
+}
 
-    // Build connection ID from UUID
-	if (uuid_export(uuid, UUID_FMT_STR, &identifier, &identifier_length) != UUID_RC_OK) {
-		uuid_destroy(uuid);
-		throw std::string("Conversion of UUID to connection ID failed");
-	}
+void CollabVMServer::PushThumbnail(const std::string& vm_name, uint64_t version) {
+	// The thumbnails of VMs given to other servers in the cluster are
+	// only updated when the list is sent again
+	if(list_subscribers_.empty() || !cluster_->GetSnapshot()->IsLocal(vm_name))
+		return;
 
-	uuid_destroy(uuid);
+	// Every subscriber is sent the same instruction, so it's only serialized once
+	ByteBuffer instr;
+	instr.Append("9.thumbnail");
+	AppendArgument(instr, vm_name);
+	AppendArgument(instr, GetThumbnailURL(std::string(), kThumbnailPath, vm_name));
+	AppendArgument(instr, std::to_string(version));
+	instr.Append(';');
+	std::shared_ptr<const websocketmm::websocket_message> message =
+		websocketmm::BuildWebsocketMessage(websocketmm::websocket_message::type::text, instr.Release());
+	for(const auto& subscriber : list_subscribers_)
+		SendWSMessage(*subscriber, message);
+}
 
-	return std::string(buffer, identifier_length-1);
+std::string CollabVMServer::GenerateSecretId() {
+	// Anyone with the ID can write to the upload or take over the
+	// session, so it comes from the system's random source instead of rng_
+	static const char kHexDigits[] = "0123456789abcdef";
+	std::random_device random;
+	std::string id;
+	id.reserve(32);
+	for(int i = 0; i < 4; i++) {
+		uint32_t value = random();
+		for(int j = 0; j < 8; j++, value >>= 4)
+			id += kHexDigits[value & 0xF];
+	}
+	return id;
 }
-*/
 
 void CollabVMServer::OnMessageFromWS(std::weak_ptr<websocketmm::websocket_user> handle, std::shared_ptr<const websocketmm::websocket_message> msg) {
 	if(auto handle_sp = handle.lock()) {
@@ -517,7 +1200,33 @@ void CollabVMServer::OnMessageFromWS(std::weak_ptr<websocketmm::websocket_user>
 		if(msg->message_type != websocketmm::websocket_message::type::text)
 			return;
 
-		PostAction<MessageAction>(msg, *handle_sp->GetUserData().user, ActionType::kMessage);
+		// Spectators can't do anything, so their messages never reach the processing thread
+		const std::shared_ptr<CollabVMUser>& user = handle_sp->GetUserData().user;
+		if(user->spectator != Spectator::kNone)
+			return;
+
+		std::string_view instruction(reinterpret_cast<const char*>(msg->data.data()), msg->data.size());
+
+		// Connections are kept alive by WebSocket pings, so the nops
+		// clients send don't need to reach the processing thread
+		if(instruction == "3.nop;")
+			return;
+
+		if(GuacInstructionParser::IsInputInstruction(instruction)) {
+			// Input from the user with the turn is sent straight to the VM instead
+			// of waiting behind everything else in the processing queue. Messages
+			// from one connection are never handled concurrently, so checking
+			// queued_input is enough to keep their input in order.
+			std::shared_ptr<GuacClient> client = std::atomic_load(&user->input_client);
+			if(client && user->queued_input == 0) {
+				if(std::shared_ptr<GuacUser> guac_user = std::atomic_load(&user->guac_user))
+					GuacInstructionParser::ParseInput(*client, *guac_user, instruction);
+				return;
+			}
+			user->queued_input++;
+		}
+
+		PostAction<MessageAction>(msg, *user, ActionType::kMessage);
 	}
 }
 
@@ -530,6 +1239,31 @@ void CollabVMServer::SendWSMessage(CollabVMUser& user, const std::string& str) {
 	}
 }
 
+void CollabVMServer::SendWSMessage(CollabVMUser& user, const std::shared_ptr<const websocketmm::websocket_message>& message) {
+	if(!server_->send_message(user.handle, message)) {
+		if(user.connected) {
+			// Disconnect the client if an error occurs
+			PostAction<UserAction>(user, ActionType::kRemoveConnection);
+		}
+	}
+}
+
+void CollabVMServer::BroadcastWSMessage(UserList& users, const std::string& str, bool priority) {
+	FlushPresence();
+	std::shared_ptr<const websocketmm::websocket_message> message =
+		priority ? websocketmm::BuildPriorityMessage(str) : websocketmm::BuildWebsocketMessage(str);
+	users.ForEachUser([&](CollabVMUser& user) {
+		SendWSMessage(user, message);
+	});
+}
+
+void CollabVMServer::BroadcastWSMessage(const std::string& str) {
+	FlushPresence();
+	std::shared_ptr<const websocketmm::websocket_message> message = websocketmm::BuildWebsocketMessage(str);
+	for(const auto& user : connections_)
+		SendWSMessage(*user, message);
+}
+
 void CollabVMServer::TimerCallback(const boost::system::error_code& ec, ActionType action) {
 	if(ec)
 		return;
@@ -552,46 +1286,17 @@ void CollabVMServer::IPDataTimerCallback(const boost::system::error_code& ec) {
 	if(ec)
 		return;
 
-	std::lock_guard<std::mutex> lock(ip_lock_);
 	// The IP data clean up timer should continue to run if there
 	// are IPData objects without any connections
-	bool should_run = false;
-	IPData* ip_data;
-	auto ipv4_it = ipv4_data_.begin();
-	while(ipv4_it != ipv4_data_.end()) {
-		ip_data = ipv4_it->second;
-		if(!ip_data->connections) {
-			if(ShouldCleanUpIPData(*ip_data)) {
-				ipv4_it = ipv4_data_.erase(ipv4_it);
-				continue;
-			} else {
-				should_run = true;
-			}
-		}
-		ipv4_it++;
-	}
-
-	auto ipv6_it = ipv6_data_.begin();
-	while(ipv6_it != ipv6_data_.end()) {
-		ip_data = ipv6_it->second;
-		if(!ip_data->connections) {
-			if(ShouldCleanUpIPData(*ip_data)) {
-				ipv6_it = ipv6_data_.erase(ipv6_it);
-				continue;
-			} else {
-				should_run = true;
-			}
-		}
-		ipv6_it++;
-	}
-
-	ip_data_timer_running_ = should_run;
+	if(ip_data_.Expire())
+		StartIPDataTimer();
+}
 
-	if(should_run) {
-		boost::system::error_code ec;
-		ip_data_timer.expires_from_now(std::chrono::minutes(kIPDataTimerInterval), ec);
-		ip_data_timer.async_wait(std::bind(&CollabVMServer::IPDataTimerCallback, shared_from_this(), std::placeholders::_1));
-	}
+void CollabVMServer::StartIPDataTimer() {
+	std::lock_guard<std::mutex> lock(ip_data_timer_lock_);
+	boost::system::error_code ec;
+	ip_data_timer.expires_from_now(std::chrono::minutes(kIPDataTimerInterval), ec);
+	ip_data_timer.async_wait(std::bind(&CollabVMServer::IPDataTimerCallback, shared_from_this(), std::placeholders::_1));
 }
 
 bool CollabVMServer::ShouldCleanUpIPData(IPData& ip_data) const {
@@ -636,9 +1341,8 @@ bool CollabVMServer::ShouldCleanUpIPData(IPData& ip_data) const {
 		}
 	}
 
-	for(auto&& vote : ip_data.votes)
-		if(vote.second != IPData::VoteDecision::kNotVoted)
-			return false;
+	if(ip_data.ballots)
+		return false;
 
 	if(ip_data.upload_in_progress || (ip_data.next_upload_time - now).count() > 0)
 		return false;
@@ -648,63 +1352,122 @@ bool CollabVMServer::ShouldCleanUpIPData(IPData& ip_data) const {
 
 //TODO(qol): Some of this should be done in destruction.
 
-void CollabVMServer::RemoveConnection(std::shared_ptr<CollabVMUser>& user) {
-	//if (!user->connected)
-	//	return;
+void CollabVMServer::RemoveConnections(std::vector<std::shared_ptr<CollabVMUser>>& users) {
+	// A connection can be removed more than once, such as when it's kicked
+	// and then closes, so only the first removal is kept
+	size_t count = 0;
+	for(std::shared_ptr<CollabVMUser>& user : users) {
+		if(user->connected) {
+			user->connected = false;
+			users[count++] = std::move(user);
+		}
+	}
+	users.resize(count);
+	if(users.empty())
+		return;
+
+	std::unordered_map<VMController*, std::vector<std::shared_ptr<CollabVMUser>>> vm_users;
+	for(const std::shared_ptr<CollabVMUser>& user : users) {
+		connections_.erase(user);
+		AccountEgress(*user);
+
+		{
+			Logger::Line line = Logger::Info("WebSocket Disconnect");
+			line << "IP: " << user->ip_data.GetIP();
+			if(user->username)
+				line << " Username: \"" << *user->username << '"';
+			if(auto handle = user->handle.lock()) {
+				if(handle->GetDroppedMessages())
+					line << " Dropped: " << handle->GetDroppedMessages() << " messages (" << handle->GetDroppedBytes() << " bytes)";
+			}
+		}
+
+		if(user->admin_connected) {
+			admin_connections_.erase(user);
+			stats_subscribers_.erase(user);
+			user->admin_connected = false;
+		}
+		list_subscribers_.erase(user);
 
-	std::cout << "[WebSocket Disconnect] IP: " << user->ip_data.GetIP();
-	if(user->username)
-		std::cout << " Username: \"" << *user->username << '"';
-	std::cout << std::endl;
+		// CancelFileUpload should be called before setting vm_controller
+		// to a nullptr (which is done by VMController::RemoveUsers)
+		CancelFileUpload(*user);
 
-	if(user->admin_connected) {
-		admin_connections_.erase(user);
-		user->admin_connected = false;
+		if(user->vm_controller)
+			vm_users[user->vm_controller].push_back(user);
 	}
 
-	// CancelFileUpload should be called before setting vm_controller
-	// to a nullptr (which is done by VMController::RemoveUser)
-	CancelFileUpload(*user);
+	connections_metric_.Set(connections_.size());
+	cluster_->SetLoad(connections_.size());
 
-	if(user->vm_controller)
-		user->vm_controller->RemoveUser(user);
+	for(auto& [controller, leaving] : vm_users) {
+		// Kept before the users leave the VM, so their places in the turn queue are known
+		std::vector<size_t> positions = controller->GetTurnPositions(leaving);
+		for(size_t i = 0; i < leaving.size(); i++)
+			SuspendSession(*leaving[i], positions[i]);
 
-	delete user->guac_user;
+		controller->RemoveUsers(leaving);
+	}
 
-	if(user->username) {
-		// Remove the connection data from the map
-		usernames_.erase(*user->username);
-		// Send a remove user instruction to everyone
-		std::ostringstream ss("7.remuser,1.1,", std::ostringstream::in | std::ostringstream::out | std::ostringstream::ate);
-		ss << user->username->length() << '.' << *user->username << ';';
-		std::string instr = ss.str();
+	// Everyone is sent a single remove user instruction for all of them
+	std::vector<std::string> usernames;
+	bool ip_data_expiring = false;
+	for(const std::shared_ptr<CollabVMUser>& user : users) {
+		if(user->guac_user) {
+			if(auto handle = user->handle.lock())
+				handle->GetMemoryAccount().Free(MemoryCategory::kConnections, sizeof(GuacUser));
+			std::atomic_store(&user->guac_user, std::shared_ptr<GuacUser>());
+		}
 
-		for(const auto& user_ : connections_) {
-			//std::shared_ptr<CollabVMUser> user = *it;
-			SendWSMessage(*user_, instr);
+		if(user->username) {
+			// Remove the connection data from the map
+			usernames_.erase(*user->username);
+			usernames.push_back(std::move(*user->username));
+			user->username.reset();
 		}
 
-		user->username.reset();
+		if(ip_data_.RemoveConnection(user->ip_data))
+			ip_data_expiring = true;
 	}
 
-	std::unique_lock<std::mutex> ip_lock(ip_lock_);
-
-	if(!--user->ip_data.connections && ShouldCleanUpIPData(user->ip_data)) {
-		DeleteIPData(user->ip_data);
-	} else if(!ip_data_timer_running_) {
-		// Start the IP data clean up timer if it's not already running
-		ip_data_timer_running_ = true;
-		boost::system::error_code ec;
-		ip_data_timer.expires_from_now(std::chrono::minutes(kIPDataTimerInterval), ec);
-		ip_data_timer.async_wait(std::bind(&CollabVMServer::IPDataTimerCallback, shared_from_this(), std::placeholders::_1));
+	if(!usernames.empty()) {
+		RemoveOnlineUsers(usernames);
+		std::string count = std::to_string(usernames.size());
+		std::string instr = "7.remuser,";
+		instr += std::to_string(count.length());
+		instr += '.';
+		instr += count;
+		for(const std::string& username : usernames) {
+			instr += ',';
+			instr += std::to_string(username.length());
+			instr += '.';
+			instr += username;
+		}
+		instr += ';';
+		QueuePresence(instr);
 	}
 
-	ip_lock.unlock();
+	// Start the IP data clean up timer if it's not already running
+	if(ip_data_expiring)
+		StartIPDataTimer();
+}
 
-	user->connected = false;
+void CollabVMServer::RemovePendingConnections() {
+	if(pending_removals_.empty())
+		return;
+	RemoveConnections(pending_removals_);
+	pending_removals_.clear();
 }
 
 void CollabVMServer::UpdateVMStatus(const std::string& vm_name, VMController::ControllerState state) {
+	if(list_message_) {
+		auto it = std::lower_bound(list_index_.begin(), list_index_.end(), vm_name, [](const ListEntry& entry, const std::string& name) {
+			return entry.name < name;
+		});
+		if(it != list_index_.end() && it->name == vm_name)
+			it->state = state;
+	}
+
 	if(admin_connections_.empty())
 		return;
 
@@ -719,26 +1482,176 @@ void CollabVMServer::UpdateVMStatus(const std::string& vm_name, VMController::Co
 	}
 }
 
-void CollabVMServer::ProcessingThread() {
-	IgnorePipe();
-	while(true) {
-		std::unique_lock<std::mutex> lock(process_queue_lock_);
-		while(process_queue_.empty()) {
-			process_wait_.wait(lock);
-		}
-
-		Action* action = process_queue_.front();
-		process_queue_.pop();
+CollabVMUser* CollabVMServer::GetActionUser(Action& action) {
+	switch(action.action) {
+		case ActionType::kMessage:
+		case ActionType::kAddConnection:
+		case ActionType::kRemoveConnection:
+		case ActionType::kResyncDisplay:
+			return static_cast<UserAction&>(action).user.get();
+		default:
+			return nullptr;
+	}
+}
 
-		lock.unlock();
+ActionClass CollabVMServer::GetActionClass(Action& action) {
+	switch(action.action) {
+		case ActionType::kMessage: {
+			auto& message = static_cast<MessageAction&>(action).message;
+			if(!message)
+				return ActionClass::kChat;
+			std::string_view instruction(reinterpret_cast<const char*>(message->data.data()), message->data.size());
+			auto starts_with = [&](std::string_view prefix) {
+				return instruction.substr(0, prefix.size()) == prefix;
+			};
+			if(starts_with("5.mouse,") || starts_with("3.key,") || starts_with("4.turn") || starts_with("4.vote"))
+				return ActionClass::kInput;
+			if(starts_with("5.admin,") || starts_with("4.list") || starts_with("4.file,"))
+				return ActionClass::kBulk;
+			return ActionClass::kChat;
+		}
+		case ActionType::kTurnChange:
+		case ActionType::kVoteEnded:
+			return ActionClass::kInput;
+		case ActionType::kVMIdle:
+		case ActionType::kAgentConnect:
+		case ActionType::kAgentDisconnect:
+		case ActionType::kVMStateChange:
+		case ActionType::kVMCleanUp:
+		case ActionType::kVMMigrated:
+		case ActionType::kIncomingMigration:
+		case ActionType::kMigrationReady:
+		case ActionType::kResyncDisplay:
+		case ActionType::kKeepAlive:
+		case ActionType::kShutdown:
+			return ActionClass::kVMState;
+		case ActionType::kAddConnection:
+		case ActionType::kRemoveConnection:
+		case ActionType::kFlushPresence:
+			return ActionClass::kChat;
+		default:
+			return ActionClass::kBulk;
+	}
+}
 
+void CollabVMServer::ScheduleAction(Action* action) {
+	const VMController* vm = nullptr;
+	ActionClass action_class;
+	if(CollabVMUser* user = GetActionUser(*action)) {
+		if(user->lane_actions++ == 0) {
+			user->action_lane = user->vm_controller;
+			user->action_class = GetActionClass(*action);
+		}
+		vm = user->action_lane;
+		action_class = user->action_class;
+	} else {
+		action_class = GetActionClass(*action);
 		switch(action->action) {
-			case ActionType::kMessage: {
-				MessageAction* msg_action = static_cast<MessageAction*>(action);
-				if(msg_action->user->connected) {
-					if(msg_action->message) {
-						GuacInstructionParser::ParseInstruction(*this, msg_action->user, std::string((char*)msg_action->message->data.data(), msg_action->message->data.size()));
-					}
+			case ActionType::kTurnChange:
+			case ActionType::kVoteEnded:
+			case ActionType::kVMIdle:
+			case ActionType::kAgentConnect:
+			case ActionType::kAgentDisconnect:
+			case ActionType::kVMStateChange:
+			case ActionType::kVMCleanUp:
+			case ActionType::kVMThumbnail:
+			case ActionType::kVMMigrated:
+				vm = static_cast<VMAction*>(action)->controller.get();
+				break;
+			default:
+				break;
+		}
+	}
+
+	ActionLane& lane = action_lanes_[{ vm, action_class }];
+	action->next = nullptr;
+	if(lane.head == nullptr) {
+		lane.vm = vm;
+		lane.action_class = action_class;
+		lane.head = action;
+		ready_lanes_[static_cast<size_t>(action_class)].push_back(&lane);
+	} else {
+		lane.tail->next = action;
+	}
+	lane.tail = action;
+}
+
+bool CollabVMServer::HasReadyLanes() const {
+	for(const std::deque<ActionLane*>& lanes : ready_lanes_)
+		if(!lanes.empty())
+			return true;
+	return false;
+}
+
+CollabVMServer::Action* CollabVMServer::NextAction(ActionClass& action_class) {
+	// Take the most urgent class that has actions waiting and some of its
+	// share of the round left, and start a new round once none has
+	size_t i = 0;
+	while(ready_lanes_[i].empty() || action_credits_[i] == 0) {
+		if(++i == kActionClasses) {
+			std::copy(std::begin(kActionClassWeights), std::end(kActionClassWeights), action_credits_);
+			i = 0;
+		}
+	}
+	action_credits_[i]--;
+	action_class = static_cast<ActionClass>(i);
+
+	std::deque<ActionLane*>& lanes = ready_lanes_[i];
+	ActionLane* lane = lanes.front();
+	lanes.pop_front();
+
+	Action* action = lane->head;
+	lane->head = action->next;
+	if(lane->head != nullptr)
+		lanes.push_back(lane);
+	else
+		action_lanes_.erase({ lane->vm, lane->action_class });
+
+	if(CollabVMUser* user = GetActionUser(*action))
+		user->lane_actions--;
+	return action;
+}
+
+void CollabVMServer::ProcessingThread() {
+	IgnorePipe();
+	while(true) {
+		// Take every action that was posted while the last one was handled,
+		// and only wait for more once every lane is empty
+		Action* posted = process_queue_.PopAll();
+		if(posted == nullptr && !HasReadyLanes()) {
+			// The removals collected so far are applied before waiting
+			RemovePendingConnections();
+			posted = process_queue_.WaitAll();
+		}
+		while(posted != nullptr) {
+			Action* action = posted;
+			posted = action->next;
+			ScheduleAction(action);
+		}
+
+		ActionClass action_class;
+		Action* action = NextAction(action_class);
+		auto started = std::chrono::steady_clock::now();
+		queued_actions_metric_.Add(-1);
+		action_wait_metrics_[static_cast<size_t>(action_class)].Observe(started - action->posted);
+		COLLABVM_PROBE(action, static_cast<int>(action->action),
+					   std::chrono::duration_cast<std::chrono::microseconds>(started - action->posted).count());
+
+		// Every other action sees the connections that were closed before it removed
+		if(action->action != ActionType::kRemoveConnection)
+			RemovePendingConnections();
+
+		switch(action->action) {
+			case ActionType::kMessage: {
+				MessageAction* msg_action = static_cast<MessageAction*>(action);
+				if(msg_action->message) {
+					std::string_view instruction(reinterpret_cast<const char*>(msg_action->message->data.data()), msg_action->message->data.size());
+					if(msg_action->user->connected)
+						GuacInstructionParser::ParseInstruction(*this, msg_action->user, instruction);
+
+					// Let the user's input skip the queue again once it's empty
+					if(GuacInstructionParser::IsInputInstruction(instruction))
+						msg_action->user->queued_input--;
 				}
 				break;
 			}
@@ -747,34 +1660,44 @@ void CollabVMServer::ProcessingThread() {
 				assert(!user->connected);
 
 				connections_.insert(user);
+				connections_metric_.Set(connections_.size());
+				cluster_->SetLoad(connections_.size());
 
-				// Start the keep-alive timer after the first client connects
+				// Start the keep-alive and egress timers after the first client connects
 				if(connections_.size() == 1) {
 					boost::system::error_code ec;
-					keep_alive_timer_.expires_from_now(std::chrono::seconds(kKeepAliveInterval), ec);
+					keep_alive_timer_.expires_from_now(std::chrono::milliseconds(kKeepAliveInterval * 1000 / kKeepAliveTicks), ec);
 					keep_alive_timer_.async_wait(std::bind(&CollabVMServer::TimerCallback, shared_from_this(), std::placeholders::_1, ActionType::kKeepAlive));
+					egress_timer_.expires_from_now(std::chrono::seconds(kEgressInterval), ec);
+					egress_timer_.async_wait(std::bind(&CollabVMServer::TimerCallback, shared_from_this(), std::placeholders::_1, ActionType::kEgress));
 				}
 
 				user->connected = true;
 
-				std::cout << "[WebSocket Connect] IP: " << user->ip_data.GetIP() << std::endl;
-
-				break;
-			}
-			case ActionType::kRemoveConnection: {
-				std::shared_ptr<CollabVMUser>& connection = static_cast<UserAction*>(action)->user;
+				// Mutes outlive the IPData, so they're restored from the
+				// table when the first connection from the IP is added
+				if(user->ip_data.chat_muted == kUnmuted) {
+					if(auto handle = user->handle.lock()) {
+						int64_t now = std::time(nullptr);
+						IPBanTable::Match match = ip_bans_.Lookup(handle->GetAddress(), now);
+						if(match.muted) {
+							// A temporary mute runs out ChatMuteTime after last_chat_msg
+							user->ip_data.chat_muted = match.mute_expires ? kTempMute : kPermMute;
+							user->ip_data.last_chat_msg = std::chrono::time_point_cast<std::chrono::seconds>(std::chrono::steady_clock::now()) +
+														  std::chrono::seconds(match.mute_expires - now - database_.Configuration.ChatMuteTime);
+						}
+					}
+				}
 
-				//			if(!connection) {
-				//			    break;
-				//			}
+				Logger::Info("WebSocket Connect") << "IP: " << user->ip_data.GetIP();
+				if(user->spectator != Spectator::kNone)
+					AddSpectator(user);
 
-				if(connection->connected) {
-					connections_.erase(connection);
-					RemoveConnection(connection);
-					connection.reset();
-				}
 				break;
 			}
+			case ActionType::kRemoveConnection:
+				pending_removals_.push_back(std::move(static_cast<UserAction*>(action)->user));
+				break;
 			case ActionType::kTurnChange: {
 				const std::shared_ptr<VMController>& controller = static_cast<VMAction*>(action)->controller;
 				controller->NextTurn();
@@ -785,6 +1708,11 @@ void CollabVMServer::ProcessingThread() {
 				controller->EndVote();
 				break;
 			}
+			case ActionType::kVMIdle: {
+				const std::shared_ptr<VMController>& controller = static_cast<VMAction*>(action)->controller;
+				controller->EnterIdle();
+				break;
+			}
 			case ActionType::kAgentConnect: {
 				AgentConnectAction* agent_action = static_cast<AgentConnectAction*>(action);
 				const std::shared_ptr<VMController>& controller = agent_action->controller;
@@ -797,7 +1725,7 @@ void CollabVMServer::ProcessingThread() {
 														   agent_action->max_filename);
 				controller->agent_upload_in_progress_ = false;
 
-				std::cout << "Agent Connected, OS: \"" << agent_action->os_name << "\", SP: \"" << agent_action->service_pack << "\", PC: \"" << agent_action->pc_name << "\", Username: \"" << agent_action->username << "\"" << std::endl;
+				Logger::Info() << "Agent Connected, OS: \"" << agent_action->os_name << "\", SP: \"" << agent_action->service_pack << "\", PC: \"" << agent_action->pc_name << "\", Username: \"" << agent_action->username << "\"";
 
 				SendActionInstructions(*controller, controller->GetSettings());
 				break;
@@ -814,133 +1742,112 @@ void CollabVMServer::ProcessingThread() {
 				SendActionInstructions(*controller, controller->GetSettings());
 				break;
 			}
-			/*
-		case ActionType::kHttpUploadTimedout:
-		{
-			const std::shared_ptr<UploadInfo>& upload_info = static_cast<HttpAction*>(action)->upload_info;
-			if (upload_info->canceled)
+			case ActionType::kHttpUploadTimedout:
+			case ActionType::kHttpUploadFailed: {
+				const std::shared_ptr<UploadInfo>& upload_info = static_cast<HttpAction*>(action)->upload_info;
+				if(upload_info->canceled)
+					break;
+				upload_info->canceled = true;
+
+				if(action->action == ActionType::kHttpUploadTimedout) {
+					std::lock_guard<std::mutex> lock(upload_lock_);
+					if(upload_info->upload_it != upload_ids_.end())
+						upload_ids_.erase(upload_info->upload_it);
+				}
+
+				FileUploadResult result = action->action == ActionType::kHttpUploadTimedout ?
+										  FileUploadResult::kHttpUploadTimedOut :
+										  FileUploadResult::kHttpUploadFailed;
+				std::shared_ptr<CollabVMUser> user = upload_info->user.lock();
+				if(user && user->upload_info == upload_info)
+					user->upload_info.reset();
+				FileUploadEnded(upload_info, user ? &user : nullptr, result);
 				break;
-			upload_info->canceled = true;
-
-			unique_lock<std::mutex> lock(upload_lock_);
-			if (upload_info->upload_it != upload_ids_.end())
-			    upload_ids_.erase(upload_info->upload_it);
-			lock.unlock();
-			if (auto user = upload_info->user.lock())
-			{
-				user->upload_info.reset();
-				FileUploadEnded(upload_info, &user, FileUploadResult::kHttpUploadTimedOut);
-			}
-			else
-			{
-				FileUploadEnded(upload_info, nullptr, FileUploadResult::kHttpUploadTimedOut);
 			}
-			break;
-		}
-		case ActionType::kHttpUploadFinished:
-		{
-			const std::shared_ptr<UploadInfo>& upload_info = static_cast<HttpAction*>(action)->upload_info;
-			if (upload_info->canceled)
-				break;
-			upload_info->canceled = true;
+			case ActionType::kHttpUploadStarted:
+			case ActionType::kHttpUploadFinished: {
+				const std::shared_ptr<UploadInfo>& upload_info = static_cast<HttpAction*>(action)->upload_info;
+				if(upload_info->canceled)
+					break;
+				upload_info->canceled = true;
 
-			if (boost::asio::steady_timer* timer = upload_info->timeout_timer)
-			{
-				upload_info->timeout_timer = nullptr;
-				boost::system::error_code ec;
-				timer->cancel(ec);
-				delete timer;
-			}
+				if(boost::asio::steady_timer* timer = upload_info->timeout_timer) {
+					upload_info->timeout_timer = nullptr;
+					boost::system::error_code ec;
+					timer->cancel(ec);
+					delete timer;
+				}
 
-			VMController& vm_controller = *upload_info->vm_controller;
-			if (auto user = upload_info->user.lock())
-			{
-				user->upload_info.reset();
+				VMController& vm_controller = *upload_info->vm_controller;
+				std::shared_ptr<CollabVMUser> user = upload_info->user.lock();
+				if(user && user->upload_info == upload_info)
+					user->upload_info.reset();
 
-				// Cancel the upload if the user switched to another VM
-				if (user->vm_controller == &vm_controller)
-				{
-					if (vm_controller.agent_upload_in_progress_)
-					{
-						vm_controller.agent_upload_queue_.push_back(upload_info);
-					}
-					else
-					{
-						vm_controller.UploadFile(upload_info);
-						vm_controller.agent_upload_in_progress_ = true;
-					}
+				// Cancel the upload if the user disconnected or switched to another VM,
+				// or the agent that was held for a piped upload went away
+				if(!user || user->vm_controller != &vm_controller ||
+				   (upload_info->pipe && !vm_controller.agent_connected_)) {
+					FileUploadEnded(upload_info, user ? &user : nullptr, FileUploadResult::kHttpUploadFailed);
 					break;
 				}
-				FileUploadEnded(upload_info, &user, FileUploadResult::kHttpUploadFailed);
+
+				// The agent was held for a piped upload when it was started, and
+				// from now on the agent's result is what ends it
+				if(upload_info->pipe) {
+					upload_info->agent_started = true;
+					vm_controller.UploadFile(upload_info);
+				} else if(vm_controller.agent_upload_in_progress_) {
+					vm_controller.agent_upload_queue_.push_back(upload_info);
+				} else {
+					vm_controller.UploadFile(upload_info);
+					vm_controller.agent_upload_in_progress_ = true;
+				}
 				break;
 			}
-			FileUploadEnded(upload_info, nullptr, FileUploadResult::kHttpUploadFailed);
-			break;
-		}
-		case ActionType::kHttpUploadFailed:
-		{
-			const std::shared_ptr<UploadInfo>& upload_info = static_cast<HttpAction*>(action)->upload_info;
-			if (upload_info->canceled)
+			case ActionType::kUploadEnded: {
+				FileUploadAction& upload_action = *static_cast<FileUploadAction*>(action);
+				FileUploadResult result = upload_action.upload_result == FileUploadAction::UploadResult::kSuccess ||
+										  upload_action.upload_result == FileUploadAction::UploadResult::kSuccessNoExec ?
+										  FileUploadResult::kAgentUploadSucceeded :
+										  FileUploadResult::kAgentUploadFailed;
+				std::shared_ptr<CollabVMUser> user = upload_action.upload_info->user.lock();
+				FileUploadEnded(upload_action.upload_info, user ? &user : nullptr, result);
 				break;
-			upload_info->canceled = true;
-
-			if (auto user = upload_info->user.lock())
-			{
-				user->upload_info.reset();
-				FileUploadEnded(upload_info, &user, FileUploadResult::kHttpUploadFailed);
-			}
-			else
-			{
-				FileUploadEnded(upload_info, nullptr, FileUploadResult::kHttpUploadFailed);
 			}
-			break;
-		}
-		case ActionType::kUploadEnded:
-		{
-			FileUploadAction& upload_action = *static_cast<FileUploadAction*>(action);
-			FileUploadResult result = upload_action.upload_result == FileUploadAction::UploadResult::kSuccess ||
-										upload_action.upload_result == FileUploadAction::UploadResult::kSuccessNoExec ?
-										FileUploadResult::kAgentUploadSucceeded : FileUploadResult::kAgentUploadFailed;
-			if (auto user = upload_action.upload_info->user.lock())
-			{
-				user->upload_info.reset();
-				FileUploadEnded(upload_action.upload_info, &user, result);
+			case ActionType::kCommandFinished: {
+				CommandAction& command_action = *static_cast<CommandAction*>(action);
+				if(command_action.status)
+					Logger::Error() << "An error occurred while executing: " << command_action.command;
+				break;
 			}
-			else
-			{
-				FileUploadEnded(upload_action.upload_info, nullptr, result);
+			case ActionType::kDatabaseWritten: {
+				DatabaseAction& database_action = *static_cast<DatabaseAction*>(action);
+				if(!database_action.success)
+					Logger::Error() << "Failed to save the settings to the database: " << database_action.error;
+				break;
 			}
-			break;
-		}
-		 */
 			case ActionType::kKeepAlive:
 				if(!connections_.empty()) {
-					// Disconnect all clients that haven't responded within the timeout period
-					// and broadcast a nop instruction to all clients
-					using std::chrono::steady_clock;
-					using std::chrono::seconds;
-					using std::chrono::time_point;
-					time_point<steady_clock, seconds> now(std::chrono::time_point_cast<seconds>(steady_clock::now()));
-					for(auto it = connections_.begin(); it != connections_.end();) {
-						std::shared_ptr<CollabVMUser> user = *it;
-
-						if((now - user->last_nop_instr).count() > kKeepAliveTimeout) {
-							// Disconnect the websocket client
-							if(!user->handle.expired())
-								user->handle.lock()->close();
-
-							it = connections_.erase(it);
-							if(user->connected)
-								RemoveConnection(user);
-						} else {
-							SendWSMessage(*user, "3.nop;");
-							it++;
+					// Send a nop instruction to the next share of the clients, so the
+					// browser doesn't time out while nothing else is being sent. Clients
+					// that stopped answering are closed by the WebSocket idle timeout
+					static const std::shared_ptr<const websocketmm::websocket_message> nop_message = websocketmm::BuildPriorityMessage("3.nop;");
+					// Every client is sent a nop once per interval
+					size_t count = (connections_.size() + kKeepAliveTicks - 1) / kKeepAliveTicks;
+					auto now = std::chrono::steady_clock::now();
+					connections_.Rotate(count, [&](CollabVMUser& user) {
+						SendWSMessage(user, nop_message);
+						// Clients that have kept up for long enough go back to full quality
+						if(user.reduced_quality && now >= user.reduced_until) {
+							if(user.guac_user != nullptr && user.guac_user->client_)
+								user.guac_user->client_->SetReducedQuality(*user.guac_user, false);
+							user.reduced_quality = false;
 						}
-					}
-					// Schedule another keep-alive instruction
+					});
+					// Schedule another keep-alive tick
 					if(!connections_.empty()) {
 						boost::system::error_code ec;
-						keep_alive_timer_.expires_from_now(std::chrono::seconds(kKeepAliveInterval), ec);
+						keep_alive_timer_.expires_from_now(std::chrono::milliseconds(kKeepAliveInterval * 1000 / kKeepAliveTicks), ec);
 						keep_alive_timer_.async_wait(std::bind(&CollabVMServer::TimerCallback, shared_from_this(), std::placeholders::_1, ActionType::kKeepAlive));
 					}
 				}
@@ -949,10 +1856,48 @@ void CollabVMServer::ProcessingThread() {
 				for(auto& vm_controller : vm_controllers_) {
 					vm_controller.second->UpdateThumbnail();
 				}
+				// Other servers are polled at about the same interval
+				ApplyClusterSanctions();
+				break;
+			case ActionType::kAutoStart:
+				StartQueuedVMs();
+				break;
+			case ActionType::kEgress:
+				UpdateEgress();
+				break;
+			case ActionType::kAdminStats:
+				// The timer stops once the last admin has unsubscribed
+				if(!stats_subscribers_.empty()) {
+					SendAdminStats();
+					boost::system::error_code ec;
+					admin_stats_timer_.expires_from_now(std::chrono::seconds(kAdminStatsInterval), ec);
+					admin_stats_timer_.async_wait(std::bind(&CollabVMServer::TimerCallback, shared_from_this(), std::placeholders::_1, ActionType::kAdminStats));
+				}
 				break;
+			case ActionType::kFlushPresence:
+				presence_timer_running_ = false;
+				FlushPresence();
+				break;
+			case ActionType::kResyncDisplay: {
+				const std::shared_ptr<CollabVMUser>& user = static_cast<UserAction*>(action)->user;
+				if(user->connected && user->vm_controller && user->guac_user != nullptr && user->guac_user->client_) {
+					// The connection drains slower than the display changes, so it's
+					// sent lower quality images until it keeps up for a while
+					ReduceQuality(*user);
+					user->guac_user->client_->ResyncUser(*user->guac_user);
+				}
+				break;
+			}
 			case ActionType::kVMThumbnail: {
 				VMThumbnailUpdate* thumbnail = static_cast<VMThumbnailUpdate*>(action);
-				thumbnail->controller->SetThumbnail(thumbnail->thumbnail);
+				uint64_t version = ++thumbnail_version_;
+				thumbnail->controller->SetThumbnail(thumbnail->thumbnail, version);
+				PublishThumbnail(thumbnail->controller->GetSettings().Name, thumbnail->thumbnail, version);
+				if(thumbnail->thumbnail)
+					thumbnail_store_.Save(thumbnail->controller->GetSettings().Name, thumbnail->thumbnail);
+				InvalidateList();
+				if(thumbnail->thumbnail)
+					PushThumbnail(thumbnail->controller->GetSettings().Name, version);
 				break;
 			}
 			case ActionType::kVMStateChange: {
@@ -966,7 +1911,7 @@ void CollabVMServer::ProcessingThread() {
 						controller->Start();
 					} else {
 						if(reason == VMController::StopReason::kError) {
-							std::cout << "VM \"" << controller->GetSettings().Name << "\" was stopped. " << controller->GetErrorMessage() << std::endl;
+							Logger::Error() << "VM \"" << controller->GetSettings().Name << "\" was stopped. " << controller->GetErrorMessage();
 						}
 
 						UpdateVMStatus(controller->GetSettings().Name, VMController::ControllerState::kStopped);
@@ -974,6 +1919,9 @@ void CollabVMServer::ProcessingThread() {
 						auto vm_it = vm_controllers_.find(controller->GetSettings().Name);
 						if(vm_it != vm_controllers_.end())
 							vm_controllers_.erase(vm_it);
+						join_bundles_.erase(controller->GetSettings().Name);
+						InvalidateList();
+						PublishThumbnail(controller->GetSettings().Name, nullptr, 0);
 						controller.reset();
 
 						if(stopping_ && vm_controllers_.empty()) {
@@ -985,8 +1933,13 @@ void CollabVMServer::ProcessingThread() {
 						}
 					}
 				} else {
-					if(state_change->state == VMController::ControllerState::kStopping)
+					if(state_change->state == VMController::ControllerState::kStopping) {
 						controller->ClearTurnQueue();
+						PublishThumbnail(controller->GetSettings().Name, nullptr, 0);
+						InvalidateList();
+					} else if(state_change->state == VMController::ControllerState::kRunning) {
+						controller->ResetIdle();
+					}
 
 					UpdateVMStatus(controller->GetSettings().Name, static_cast<VMStateChange*>(action)->state);
 				}
@@ -997,7 +1950,19 @@ void CollabVMServer::ProcessingThread() {
 				controller->CleanUp();
 				break;
 			}
+			case ActionType::kVMMigrated:
+				InvalidateList();
+				break;
+			case ActionType::kIncomingMigration: {
+				IncomingMigrationAction* incoming = static_cast<IncomingMigrationAction*>(action);
+				incoming->result.set_value(StartIncomingMigration(incoming->vm_name));
+				break;
+			}
+			case ActionType::kMigrationReady:
+				OnMigrationReady(*static_cast<MigrationReadyAction*>(action));
+				break;
 			case ActionType::kShutdown:
+				autostart_queue_.clear();
 
 				// Disconnect all active clients
 				for(const auto& connection : connections_) {
@@ -1012,12 +1977,12 @@ void CollabVMServer::ProcessingThread() {
 					// Exit the processing loop
 					goto stop;
 				}
-				std::cout << "Stopping all VM Controllers..." << std::endl;
+				Logger::Info() << "Stopping all VM Controllers...";
 
 				// Stop all VM controllers
 				for(auto [id, vm] : vm_controllers_) {
 					if(vm->IsRunning()) {
-						vm->Stop(VMController::StopReason::kRemove);
+						vm->Stop(VMController::StopReason::kShutdown);
 						//vm->~VMController();
 					}
 				}
@@ -1025,9 +1990,21 @@ void CollabVMServer::ProcessingThread() {
 				// (we don't need to worry about erasing them, the CollabVMServer destructor will do that for us.)
 		}
 
+		action_time_metric_.Observe(std::chrono::steady_clock::now() - started);
 		delete action;
 	}
 stop:
+	// Discard the actions that were never handled
+	for(auto& [vm, lane] : action_lanes_) {
+		while(lane.head != nullptr) {
+			Action* action = lane.head;
+			lane.head = action->next;
+			delete action;
+		}
+	}
+	action_lanes_.clear();
+	for(std::deque<ActionLane*>& lanes : ready_lanes_)
+		lanes.clear();
 	process_thread_running_ = false;
 }
 
@@ -1039,16 +2016,66 @@ void CollabVMServer::OnVMControllerTurnChange(const std::shared_ptr<VMController
 	PostAction<VMAction>(controller, ActionType::kTurnChange);
 }
 
-void CollabVMServer::OnVMControllerThumbnailUpdate(const std::shared_ptr<VMController>& controller, std::string* str) {
-	PostAction<VMThumbnailUpdate>(controller, str);
+void CollabVMServer::OnVMControllerIdle(const std::shared_ptr<VMController>& controller) {
+	PostAction<VMAction>(controller, ActionType::kVMIdle);
 }
 
-void CollabVMServer::BroadcastTurnInfo(VMController& controller, UserList& users, const std::deque<std::shared_ptr<CollabVMUser>>& turn_queue, CollabVMUser* current_turn, uint32_t time_remaining) {
+void CollabVMServer::OnVMControllerThumbnailUpdate(const std::shared_ptr<VMController>& controller, const std::shared_ptr<const VMThumbnail>& thumbnail) {
+	PostAction<VMThumbnailUpdate>(controller, thumbnail);
+}
+
+void CollabVMServer::BroadcastTurnInfo(VMController& controller, UserList& users, const TurnQueue& turn_queue, CollabVMUser* current_turn, uint32_t time_remaining, const VMController::TurnUpdate& update) {
+	// The queue mentions users whose adduser may still be held back
+	FlushPresence();
+
+	// Clients that support turn updates are only sent the change to the queue,
+	// and work out how long they have to wait from their position in it:
+	//   turnupdate,0,<username>,<turn time>               The user joined the end of the queue
+	//   turnupdate,1,<username>                           The user left the queue
+	//   turnupdate,2,<time remaining>,<turn time>         The user at the front of the queue was given control
+	//   turnupdate,3,<username>,<time remaining>,<turn time>
+	//                                                     The user took control, leaving the queue if they were
+	//                                                     in it, and the previous controller went to the front
+	// They're sent the whole queue after any other change.
+	std::shared_ptr<const websocketmm::websocket_message> update_message;
+	if(update.type != VMController::TurnUpdate::Type::kReset) {
+		std::string turn_time = std::to_string(controller.GetSettings().TurnTime * 1000);
+		ByteBuffer instr;
+		instr.Append("10.turnupdate");
+		switch(update.type) {
+			case VMController::TurnUpdate::Type::kEnqueue:
+				AppendArgument(instr, "0");
+				AppendArgument(instr, *update.user->username);
+				AppendArgument(instr, turn_time);
+				break;
+			case VMController::TurnUpdate::Type::kRemove:
+				AppendArgument(instr, "1");
+				AppendArgument(instr, *update.user->username);
+				break;
+			case VMController::TurnUpdate::Type::kAdvance:
+				AppendArgument(instr, "2");
+				AppendArgument(instr, std::to_string(time_remaining));
+				AppendArgument(instr, turn_time);
+				break;
+			case VMController::TurnUpdate::Type::kTake:
+				AppendArgument(instr, "3");
+				AppendArgument(instr, *update.user->username);
+				AppendArgument(instr, std::to_string(time_remaining));
+				AppendArgument(instr, turn_time);
+				break;
+			default:
+				break;
+		}
+		instr.Append(';');
+		update_message = websocketmm::BuildPriorityMessage(instr.Release());
+	}
+
 	if(current_turn == nullptr) {
 		// The instruction is static if there is nobody controlling the VM
 		// and nobody is waiting in the queue
-		users.ForEachUser([this](CollabVMUser& user) {
-			SendWSMessage(user, "4.turn,1.0,1.0;");
+		static const std::shared_ptr<const websocketmm::websocket_message> no_turn = websocketmm::BuildPriorityMessage("4.turn,1.0,1.0;");
+		users.ForEachUser([&](CollabVMUser& user) {
+			SendWSMessage(user, update_message && user.turn_updates ? update_message : no_turn);
 		});
 	} else {
 		std::string users_list;
@@ -1091,7 +2118,10 @@ void CollabVMServer::BroadcastTurnInfo(VMController& controller, UserList& users
 
 		// Send the instruction to the user that has control first
 		current_turn->waiting_turn = false;
-		SendWSMessage(*current_turn, turn_instr);
+		if(update_message && current_turn->turn_updates)
+			SendWSMessage(*current_turn, update_message);
+		else
+			SendWSMessage(*current_turn, turn_instr);
 
 		if(!turn_queue.empty()) {
 			// Replace the semicolon at the end of the string with a comma
@@ -1105,6 +2135,11 @@ void CollabVMServer::BroadcastTurnInfo(VMController& controller, UserList& users
 			uint32_t user_wait_time = time_remaining;
 			for(auto it = turn_queue.begin(); it != turn_queue.end(); it++, user_wait_time += turn_time) {
 				std::shared_ptr<CollabVMUser> user = *it;
+				if(update_message && user->turn_updates) {
+					SendWSMessage(*user, update_message);
+					continue;
+				}
+
 				temp_str = std::to_string(user_wait_time);
 				turn_instr += std::to_string(temp_str.length());
 				turn_instr += '.';
@@ -1121,15 +2156,16 @@ void CollabVMServer::BroadcastTurnInfo(VMController& controller, UserList& users
 		}
 
 		// Tell all the spectators how many users are in the waiting queue
+		std::shared_ptr<const websocketmm::websocket_message> message = websocketmm::BuildPriorityMessage(turn_instr);
 		users.ForEachUser([&](CollabVMUser& user) {
 			if(user.waiting_turn || &user == current_turn)
 				return;
-			SendWSMessage(user, turn_instr);
+			SendWSMessage(user, update_message && user.turn_updates ? update_message : message);
 		});
 	}
 }
 
-void CollabVMServer::SendTurnInfo(CollabVMUser& user, uint32_t time_remaining, const std::string& current_turn, const std::deque<std::shared_ptr<CollabVMUser>>& turn_queue) {
+void CollabVMServer::SendTurnInfo(CollabVMUser& user, uint32_t time_remaining, const std::string& current_turn, const TurnQueue& turn_queue) {
 	std::string instr = "4.turn,";
 
 	// Remaining time for the current user's turn
@@ -1186,9 +2222,7 @@ void CollabVMServer::BroadcastVoteInfo(const VMController& vm, UserList& users,
 	instr += temp_str;
 
 	instr += ';';
-	users.ForEachUser([&](CollabVMUser& user) {
-		SendWSMessage(user, instr);
-	});
+	BroadcastWSMessage(users, instr, true);
 }
 
 void CollabVMServer::SendVoteInfo(const VMController& vm, CollabVMUser& user, uint32_t time_remaining, uint32_t yes_votes, uint32_t no_votes) {
@@ -1216,8 +2250,6 @@ void CollabVMServer::SendVoteInfo(const VMController& vm, CollabVMUser& user, ui
 }
 
 void CollabVMServer::UserStartedVote(const VMController& vm, UserList& users, CollabVMUser& user) {
-	user.ip_data.votes[&vm] = IPData::VoteDecision::kYes;
-
 #define MSG " started a vote to reset the VM."
 	std::string instr = "4.chat,0.,";
 	instr += std::to_string(user.username->length() + STR_LEN(MSG));
@@ -1225,19 +2257,13 @@ void CollabVMServer::UserStartedVote(const VMController& vm, UserList& users, Co
 	instr += *user.username;
 	instr += MSG ";";
 	user.voted_amount++;
-	users.ForEachUser([&](CollabVMUser& user) {
-		SendWSMessage(user, instr);
-	});
+	BroadcastWSMessage(users, instr, true);
 }
 
 void CollabVMServer::UserVoted(const VMController& vm, UserList& users, CollabVMUser& user, bool vote) {
-	if(user.voted_limit) {
-		// if you're a votebomber you shouldn't have a decision anyways
-		user.ip_data.votes[&vm] = IPData::VoteDecision::kNotVoted;
+	// if you're a votebomber you shouldn't have a decision anyways
+	if(user.voted_limit)
 		return;
-	} else {
-		user.ip_data.votes[&vm] = vote ? IPData::VoteDecision::kYes : IPData::VoteDecision::kNo;
-	}
 
 #define MSG_YES " voted yes."
 #define MSG_NO " voted no."
@@ -1248,17 +2274,17 @@ void CollabVMServer::UserVoted(const VMController& vm, UserList& users, CollabVM
 	instr += *user.username;
 	instr += vote ? MSG_YES ";" : MSG_NO ";";
 
-	users.ForEachUser([&](CollabVMUser& user) {
-		SendWSMessage(user, instr);
-	});
+	BroadcastWSMessage(users, instr, true);
 }
 
 void CollabVMServer::BroadcastVoteEnded(const VMController& vm, UserList& users, bool vote_succeeded) {
-	std::string instr = vote_succeeded ? "4.chat,0.,33.The vote to reset the VM has won.;" : "4.chat,0.,34.The vote to reset the VM has lost.;";
+	static const std::shared_ptr<const websocketmm::websocket_message> vote_ended = websocketmm::BuildPriorityMessage("4.vote,1.2;");
+	static const std::shared_ptr<const websocketmm::websocket_message> vote_won = websocketmm::BuildPriorityMessage("4.chat,0.,33.The vote to reset the VM has won.;");
+	static const std::shared_ptr<const websocketmm::websocket_message> vote_lost = websocketmm::BuildPriorityMessage("4.chat,0.,34.The vote to reset the VM has lost.;");
 
 	users.ForEachUser([&](CollabVMUser& user) {
-		SendWSMessage(user, "4.vote,1.2;");
-		SendWSMessage(user, instr);
+		SendWSMessage(user, vote_ended);
+		SendWSMessage(user, vote_succeeded ? vote_won : vote_lost);
 		// Reset the vote amount for all users.
 		// TODO: Make this only act on users who have voted at least once
 		if(user.voted_amount) {
@@ -1266,12 +2292,6 @@ void CollabVMServer::BroadcastVoteEnded(const VMController& vm, UserList& users,
 		}
 		user.voted_limit = false;
 	});
-
-	// Reset for next vote and allow IPData to be deleted
-	for(const auto& ip_data : ipv4_data_)
-		ip_data.second->votes[&vm] = IPData::VoteDecision::kNotVoted;
-	for(const auto& ip_data : ipv6_data_)
-		ip_data.second->votes[&vm] = IPData::VoteDecision::kNotVoted;
 }
 
 void CollabVMServer::VoteCoolingDown(CollabVMUser& user, uint32_t time_remaining) {
@@ -1293,6 +2313,14 @@ void CollabVMServer::Stop() {
 	//server_.set_error_channels(websocketpp::log::elevel::none);
 
 	server_->stop();
+#ifndef _WIN32
+	if(upgrade_acceptor_.is_open()) {
+		boost::system::error_code ec;
+		upgrade_acceptor_.close(ec);
+		upgrade_socket_.close(ec);
+		std::remove(kUpgradeSocketPath.c_str());
+	}
+#endif
 
 	//if (ws_ec)
 	//	std::cout << "stop_listening error: " << ws_ec.message() << std::endl;
@@ -1300,25 +2328,26 @@ void CollabVMServer::Stop() {
 	// Stop the timers
 	boost::system::error_code asio_ec;
 	keep_alive_timer_.cancel(asio_ec);
+	egress_timer_.cancel(asio_ec);
 	ip_data_timer.cancel(asio_ec);
 	vm_preview_timer_.cancel(asio_ec);
+	admin_stats_timer_.cancel(asio_ec);
+	profile_timer_.cancel(asio_ec);
+	presence_timer_.cancel(asio_ec);
+	autostart_timer_.cancel(asio_ec);
+	cluster_->Stop();
 
 	if(process_thread_running_) {
-		std::unique_lock<std::mutex> lock(process_queue_lock_);
 		// Delete all actions currently in the queue and add the
 		// shutdown action to signal the processing queue to disconnect
 		// all websocket clients and stop all VM controllers
-		while(!process_queue_.empty()) {
-			delete process_queue_.front();
-			process_queue_.pop();
+		Action* action = process_queue_.PopAll();
+		while(action != nullptr) {
+			Action* next = action->next;
+			delete action;
+			action = next;
 		}
 
-		lock.unlock();
-
-		// Clear processing queue by swapping it with an empty one
-		std::queue<Action*> emptyQueue;
-		process_queue_.swap(emptyQueue);
-
 		// Add the stop action to the processing queue
 		PostAction<Action>(ActionType::kShutdown);
 	}
@@ -1327,23 +2356,237 @@ void CollabVMServer::Stop() {
 	process_thread_.join();
 }
 
-void CollabVMServer::OnVMControllerStateChange(const std::shared_ptr<VMController>& controller, VMController::ControllerState state) {
-	std::cout << "VM controller ID: " << controller->GetSettings().Name;
-	switch(state) {
-		case VMController::ControllerState::kStopped:
-			std::cout << " is stopped";
-			break;
-		case VMController::ControllerState::kStarting:
-			std::cout << " is starting";
-			break;
-		case VMController::ControllerState::kRunning:
-			std::cout << " has been started";
-			break;
-		case VMController::ControllerState::kStopping:
-			std::cout << " is stopping";
+/**
+ * Gets the memory in MiB that the host can give to new processes without
+ * swapping, or UINT64_MAX if it's unknown.
+ */
+static uint64_t GetAvailableMemory() {
+	std::ifstream meminfo("/proc/meminfo");
+	std::string line;
+	while(std::getline(meminfo, line)) {
+		if(line.compare(0, 13, "MemAvailable:") == 0)
+			return std::strtoull(line.c_str() + 13, nullptr, 10) / 1024;
+	}
+	return UINT64_MAX;
+}
+
+void CollabVMServer::ListenForUpgrade() {
+#ifndef _WIN32
+	using boost::asio::local::stream_protocol;
+
+	// A socket left behind by a server that ran here before is replaced
+	std::remove(kUpgradeSocketPath.c_str());
+	boost::system::error_code ec;
+	upgrade_acceptor_.open(stream_protocol(), ec);
+	if(!ec)
+		upgrade_acceptor_.bind(stream_protocol::endpoint(kUpgradeSocketPath), ec);
+
+	// Only the user the server runs as can take its port
+	if(!ec && ::chmod(kUpgradeSocketPath.c_str(), 0600) != 0)
+		ec = boost::system::error_code(errno, boost::system::system_category());
+	if(!ec)
+		upgrade_acceptor_.listen(1, ec);
+	if(ec) {
+		Logger::Warning("Upgrade") << "Couldn't listen for a new build at " << kUpgradeSocketPath << ": " << ec.message();
+		upgrade_acceptor_.close(ec);
+		return;
+	}
+
+	AcceptUpgrade();
+#endif
+}
+
+void CollabVMServer::AcceptUpgrade() {
+#ifndef _WIN32
+	upgrade_acceptor_.async_accept(upgrade_socket_, std::bind(&CollabVMServer::OnUpgradeConnection, shared_from_this(),
+															  std::placeholders::_1));
+#endif
+}
+
+void CollabVMServer::OnUpgradeConnection(const boost::system::error_code& ec) {
+#ifndef _WIN32
+	if(ec || stopping_)
+		return;
+
+	std::vector<int> listeners = server_->duplicate_listeners();
+	bool sent = ListenerHandoff::Send(upgrade_socket_.native_handle(), listeners);
+	for(int listener : listeners)
+		::close(listener);
+	if(!sent) {
+		Logger::Error("Upgrade") << "Failed to hand the listening sockets over to the new build";
+		boost::system::error_code close_ec;
+		upgrade_socket_.close(close_ec);
+		AcceptUpgrade();
+		return;
+	}
+
+	// This server keeps accepting until the new build is accepting too,
+	// in case it fails to start
+	auto ack = std::make_shared<char>();
+	boost::asio::async_read(upgrade_socket_, boost::asio::buffer(ack.get(), sizeof(char)),
+							[this, self = shared_from_this(), ack](const boost::system::error_code& ec, size_t) {
+								boost::system::error_code close_ec;
+								upgrade_socket_.close(close_ec);
+								if(stopping_)
+									return;
+								if(ec) {
+									Logger::Warning("Upgrade") << "The new build didn't take over the port, so connections are still accepted here";
+									AcceptUpgrade();
+									return;
+								}
+
+								server_->close_listeners();
+								upgrade_acceptor_.close(close_ec);
+								Logger::Info("Upgrade") << "The new build took over the port. Connections that are already open stay on this server.";
+							});
+#endif
+}
+
+void CollabVMServer::StartQueuedVMs() {
+	if(stopping_)
+		return;
+
+	// A VM is ready once its first frame has been sent to the viewers
+	auto now = std::chrono::steady_clock::now();
+	for(auto it = booting_vms_.begin(); it != booting_vms_.end();) {
+		std::shared_ptr<VMController> controller = it->controller.lock();
+		if(controller && controller->IsRunning()) {
+			if(!controller->GetMetrics().frames.Get()) {
+				++it;
+				continue;
+			}
+			Logger::Info() << "VM \"" << controller->GetSettings().Name << "\" is ready "
+						   << std::chrono::duration_cast<std::chrono::seconds>(now - it->started).count() << " seconds after it was started";
+		}
+		it = booting_vms_.erase(it);
+	}
+
+	const Config& config = database_.Configuration;
+	while(!autostart_queue_.empty() && (!config.AutoStartConcurrency || booting_vms_.size() < config.AutoStartConcurrency)) {
+		if(config.AutoStartMemory && GetAvailableMemory() < config.AutoStartMemory) {
+			Logger::Warning() << "Waiting for " << config.AutoStartMemory << " MiB of memory to be available to start VM \"" << autostart_queue_.front() << '"';
 			break;
+		}
+
+		std::string name = std::move(autostart_queue_.front());
+		autostart_queue_.pop_front();
+
+		// While it waited the VM may have been deleted,
+		// started by an admin or had auto start turned off
+		auto vm_it = database_.VirtualMachines.find(name);
+		if(vm_it == database_.VirtualMachines.end() || !vm_it->second->AutoStart || vm_controllers_.count(name))
+			continue;
+
+		std::shared_ptr<VMController> controller = CreateVMController(vm_it->second);
+		controller->Start();
+		booting_vms_.push_back({ controller, now });
+	}
+
+	if(!autostart_queue_.empty() || !booting_vms_.empty()) {
+		boost::system::error_code ec;
+		autostart_timer_.expires_from_now(std::chrono::milliseconds(kAutoStartInterval), ec);
+		autostart_timer_.async_wait(std::bind(&CollabVMServer::TimerCallback, shared_from_this(), std::placeholders::_1, ActionType::kAutoStart));
+	}
+}
+
+void CollabVMServer::ReduceQuality(CollabVMUser& user) {
+	if(user.relay_role == RelayRole::kDisplay || user.guac_user == nullptr || !user.guac_user->client_)
+		return;
+
+	user.reduced_until = std::chrono::steady_clock::now() + std::chrono::seconds(kReducedQualityTime);
+	if(!user.reduced_quality) {
+		user.guac_user->client_->SetReducedQuality(*user.guac_user, true);
+		user.reduced_quality = true;
+	}
+}
+
+uint64_t CollabVMServer::AccountEgress(CollabVMUser& user) {
+	auto handle = user.handle.lock();
+	if(!handle)
+		return 0;
+
+	uint64_t sent = handle->GetSentBytes();
+	uint64_t bytes = sent - user.accounted_bytes;
+	user.accounted_bytes = sent;
+	user.ip_data.sent_bytes += bytes;
+	if(user.vm_controller)
+		user.vm_controller->GetMetrics().egress_bytes.Add(bytes);
+	egress_metric_.Add(bytes);
+	return bytes;
+}
+
+void CollabVMServer::UpdateEgress() {
+	if(connections_.empty())
+		return;
+
+	// The bytes each IP was sent during the interval
+	std::unordered_map<IPData*, uint64_t> ip_bytes;
+	uint64_t host_bytes = 0;
+	for(const std::shared_ptr<CollabVMUser>& user : connections_) {
+		uint64_t bytes = AccountEgress(*user);
+		ip_bytes[&user->ip_data] += bytes;
+		host_bytes += bytes;
+	}
+
+	// The budgets are in kbit/s and Mbit/s, the bytes are over kEgressInterval seconds
+	const Config& config = database_.Configuration;
+	std::unordered_set<IPData*> reduced_ips;
+	if(config.EgressIPBudget) {
+		uint64_t budget = static_cast<uint64_t>(config.EgressIPBudget) * 1000 / 8 * kEgressInterval;
+		for(const auto& [ip_data, bytes] : ip_bytes) {
+			if(bytes > budget)
+				reduced_ips.insert(ip_data);
+		}
+	}
+
+	if(config.EgressHostBudget) {
+		uint64_t budget = static_cast<uint64_t>(config.EgressHostBudget) * 1000 * 1000 / 8 * kEgressInterval;
+		if(host_bytes > budget) {
+			// The IPs that were sent the most are reduced until they
+			// account for the bytes that the host is over by
+			std::vector<std::pair<IPData*, uint64_t>> heaviest(ip_bytes.begin(), ip_bytes.end());
+			std::sort(heaviest.begin(), heaviest.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+			uint64_t excess = host_bytes - budget;
+			for(const auto& [ip_data, bytes] : heaviest) {
+				reduced_ips.insert(ip_data);
+				if(bytes >= excess)
+					break;
+				excess -= bytes;
+			}
+		}
+	}
+
+	if(!reduced_ips.empty()) {
+		for(const std::shared_ptr<CollabVMUser>& user : connections_) {
+			if(user->vm_controller && reduced_ips.count(&user->ip_data))
+				ReduceQuality(*user);
+		}
+	}
+
+	boost::system::error_code ec;
+	egress_timer_.expires_from_now(std::chrono::seconds(kEgressInterval), ec);
+	egress_timer_.async_wait(std::bind(&CollabVMServer::TimerCallback, shared_from_this(), std::placeholders::_1, ActionType::kEgress));
+}
+
+void CollabVMServer::OnVMControllerStateChange(const std::shared_ptr<VMController>& controller, VMController::ControllerState state) {
+	{
+		Logger::Line line = Logger::Info();
+		line << "VM controller ID: " << controller->GetSettings().Name;
+		switch(state) {
+			case VMController::ControllerState::kStopped:
+				line << " is stopped";
+				break;
+			case VMController::ControllerState::kStarting:
+				line << " is starting";
+				break;
+			case VMController::ControllerState::kRunning:
+				line << " has been started";
+				break;
+			case VMController::ControllerState::kStopping:
+				line << " is stopping";
+				break;
+		}
 	}
-	std::cout << std::endl;
 
 	PostAction<VMStateChange>(controller, state);
 }
@@ -1352,8 +2595,16 @@ void CollabVMServer::OnVMControllerCleanUp(const std::shared_ptr<VMController>&
 	PostAction<VMAction>(controller, ActionType::kVMCleanUp);
 }
 
+void CollabVMServer::OnVMControllerMigrated(const std::shared_ptr<VMController>& controller) {
+	PostAction<VMAction>(controller, ActionType::kVMMigrated);
+}
+
 void CollabVMServer::SendGuacMessage(std::weak_ptr<websocketmm::websocket_user> handle, const std::string& str) {
-	if(!server_->send_message(handle, websocketmm::BuildWebsocketMessage(str))) {
+	SendGuacMessage(handle, websocketmm::BuildWebsocketMessage(str));
+}
+
+void CollabVMServer::SendGuacMessage(std::weak_ptr<websocketmm::websocket_user> handle, const std::shared_ptr<const websocketmm::websocket_message>& message) {
+	if(!server_->send_message(handle, message)) {
 		if(auto handle_sp = handle.lock()) {
 			auto user = handle_sp->GetUserData().user;
 
@@ -1363,29 +2614,26 @@ void CollabVMServer::SendGuacMessage(std::weak_ptr<websocketmm::websocket_user>
 	}
 }
 
-void CollabVMServer::AppendChatMessage(std::ostringstream& ss, ChatMessage* chat_msg) {
-	ss << ',' << chat_msg->username->length() << '.' << *chat_msg->username << ',' << chat_msg->message.length() << '.' << chat_msg->message;
+void CollabVMServer::SendGuacMessage(const CollabVMUser& user, const std::shared_ptr<const websocketmm::websocket_message>& message) {
+	SendGuacMessage(user.handle, message);
 }
 
 void CollabVMServer::SendChatHistory(CollabVMUser& user) {
-	if(chat_history_count_) {
-		std::ostringstream ss("4.chat", std::ios_base::in | std::ios_base::out | std::ios_base::ate);
-		unsigned char len = database_.Configuration.ChatMsgHistory;
-
-		// Iterate through each of the messages in the circular buffer
-		if(chat_history_end_ > chat_history_begin_) {
-			for(unsigned char i = chat_history_begin_; i < chat_history_end_; i++)
-				AppendChatMessage(ss, &chat_history_[i]);
-		} else {
-			for(unsigned char i = chat_history_begin_; i < len; i++)
-				AppendChatMessage(ss, &chat_history_[i]);
+	if(const auto& message = GetChatHistoryMessage())
+		SendWSMessage(user, message);
+}
 
-			for(unsigned char i = 0; i < chat_history_end_; i++)
-				AppendChatMessage(ss, &chat_history_[i]);
-		}
-		ss << ';';
-		SendWSMessage(user, ss.str());
+const std::shared_ptr<const websocketmm::websocket_message>& CollabVMServer::GetChatHistoryMessage() {
+	// The history is only concatenated again after a new message is added
+	if(!chat_history_message_ && !chat_history_.empty()) {
+		ByteBuffer instr;
+		instr.Append("4.chat");
+		for(const ChatMessage& chat_message : chat_history_)
+			instr.Append(chat_message.encoded);
+		instr.Append(';');
+		chat_history_message_ = websocketmm::BuildWebsocketMessage(websocketmm::websocket_message::type::text, instr.Release());
 	}
+	return chat_history_message_;
 }
 
 bool CollabVMServer::ValidateUsername(const std::string& username) {
@@ -1432,18 +2680,124 @@ bool CollabVMServer::ValidateUsername(const std::string& username) {
 }
 
 void CollabVMServer::SendOnlineUsersList(CollabVMUser& user) {
-	std::ostringstream ss("7.adduser,", std::ios_base::in | std::ios_base::out | std::ios_base::ate);
-	std::string num = std::to_string(usernames_.size());
-	ss << num.size() << '.' << num;
+	SendWSMessage(user, GetOnlineUsersMessage());
+}
+
+const std::shared_ptr<const websocketmm::websocket_message>& CollabVMServer::GetOnlineUsersMessage() {
+	// The changes that are already in the list are sent to everyone else
+	// first, so the user isn't sent them again after it
+	FlushPresence();
+
+	// Every user that joins before the list changes again gets the same message
+	if(!online_users_message_) {
+		ByteBuffer instr;
+		instr.Append("7.adduser");
+		AppendArgument(instr, std::to_string(usernames_.size()));
+		instr.Append(online_users_);
+		instr.Append(';');
+		online_users_message_ = websocketmm::BuildWebsocketMessage(websocketmm::websocket_message::type::text, instr.Release());
+	}
+	return online_users_message_;
+}
+
+void CollabVMServer::QueuePresence(const std::string& instr) {
+	presence_delta_ += instr;
+	if(presence_timer_running_)
+		return;
+
+	auto now = std::chrono::steady_clock::now();
+	auto next = presence_flushed_ + std::chrono::milliseconds(kPresenceInterval);
+	if(now >= next) {
+		FlushPresence();
+		return;
+	}
+
+	presence_timer_running_ = true;
+	boost::system::error_code ec;
+	presence_timer_.expires_at(next, ec);
+	presence_timer_.async_wait(std::bind(&CollabVMServer::TimerCallback, shared_from_this(), std::placeholders::_1, ActionType::kFlushPresence));
+}
+
+void CollabVMServer::FlushPresence() {
+	if(presence_delta_.empty())
+		return;
+
+	std::shared_ptr<const websocketmm::websocket_message> message = websocketmm::BuildPriorityMessage(presence_delta_);
+	for(const auto& user : connections_) {
+		if(user->vm_controller && user->spectator == Spectator::kNone)
+			SendWSMessage(*user, message);
+	}
+	presence_delta_.clear();
+	presence_flushed_ = std::chrono::steady_clock::now();
+}
+
+void CollabVMServer::AddOnlineUser(const CollabVMUser& user) {
+	std::string rank = std::to_string(user.user_rank);
+	online_users_ += ',';
+	online_users_ += std::to_string(user.username->length());
+	online_users_ += '.';
+	online_users_ += *user.username;
+	online_users_ += ',';
+	online_users_ += std::to_string(rank.length());
+	online_users_ += '.';
+	online_users_ += rank;
+	online_users_message_.reset();
+}
+
+/**
+ * Reads the next element of the online users list, which is written as
+ * ",<length>.<value>", and moves past it.
+ */
+static std::string_view ReadOnlineUsersElement(const std::string& list, size_t& pos) {
+	size_t dot = list.find('.', pos);
+	size_t length = 0;
+	std::from_chars(list.data() + pos + 1, list.data() + dot, length);
+	pos = dot + 1 + length;
+	return std::string_view(list).substr(dot + 1, length);
+}
+
+void CollabVMServer::RemoveOnlineUser(const std::string& username) {
+	size_t pos = 0;
+	while(pos < online_users_.length()) {
+		size_t start = pos;
+		std::string_view name = ReadOnlineUsersElement(online_users_, pos);
+		ReadOnlineUsersElement(online_users_, pos); // The user's rank
+		if(name == username) {
+			online_users_.erase(start, pos - start);
+			online_users_message_.reset();
+			return;
+		}
+	}
+}
 
-	for(auto& username : usernames_) {
-		std::shared_ptr<CollabVMUser> data = username.second;
-		// Append the user to the online users list
-		num = std::to_string(data->user_rank);
-		ss << ',' << data->username->length() << '.' << *data->username << ',' << num.size() << '.' << num;
+void CollabVMServer::RemoveOnlineUsers(const std::vector<std::string>& usernames) {
+	if(usernames.size() == 1) {
+		RemoveOnlineUser(usernames.front());
+		return;
+	}
+
+	// The list is rebuilt in one pass without any of the users
+	std::unordered_set<std::string_view> removed(usernames.begin(), usernames.end());
+	std::string online_users;
+	online_users.reserve(online_users_.length());
+	size_t pos = 0;
+	while(pos < online_users_.length()) {
+		size_t start = pos;
+		std::string_view name = ReadOnlineUsersElement(online_users_, pos);
+		ReadOnlineUsersElement(online_users_, pos); // The user's rank
+		if(!removed.count(name))
+			online_users.append(online_users_, start, pos - start);
 	}
-	ss << ';';
-	SendWSMessage(user, ss.str());
+	online_users_ = std::move(online_users);
+	online_users_message_.reset();
+}
+
+void CollabVMServer::UpdateOnlineUser(const CollabVMUser& user) {
+	if(!user.username)
+		return;
+
+	RemoveOnlineUser(*user.username);
+	AddOnlineUser(user);
 }
 
 void CollabVMServer::ChangeUsername(const std::shared_ptr<CollabVMUser>& data, const std::string& new_username, UsernameChangeResult result, bool send_history) {
@@ -1456,11 +2810,13 @@ void CollabVMServer::ChangeUsername(const std::shared_ptr<CollabVMUser>& data, c
 			return;
 	}
 	if(database_.Configuration.NameRateCount && database_.Configuration.NameRateTime) {
+		uint32_t remote = CountClusterEvent(data->ip_data, ClusterSanctions::Counter::kName, database_.Configuration.NameRateTime);
+
 		// Calculate the time since the user's last name change
 		if((now - data->ip_data.last_name_chg).count() < database_.Configuration.NameRateTime) {
-			if(++data->ip_data.name_chg_count >= database_.Configuration.NameRateCount) {
+			if(++data->ip_data.name_chg_count + remote >= database_.Configuration.NameRateCount) {
 				std::string mute_time = std::to_string(database_.Configuration.NameMuteTime);
-				std::cout << "[Anti-Namefag] User prevented from changing usernames. It has been stopped for " << mute_time << " seconds. IP: " << data->ip_data.GetIP() << std::endl;
+				Logger::Info("Anti-Namefag") << "User prevented from changing usernames. It has been stopped for " << mute_time << " seconds. IP: " << data->ip_data.GetIP();
 				// Keep the user from changing their name for attempting to go over the
 				// name change limit
 				data->ip_data.last_name_chg = now;
@@ -1525,25 +2881,105 @@ void CollabVMServer::ChangeUsername(const std::shared_ptr<CollabVMUser>& data, c
 		instr += ';';
 
 		// Send instruction to all users viewing a VM
-		for(const auto& user : connections_) {
-			if(user->vm_controller)
-				SendWSMessage(*user, instr);
-		}
+		QueuePresence(instr);
 	}
 
 	// If the user had an old username delete it from the usernames_ map
 	if(data->username) {
-		std::cout << "[Username Changed] IP: " << data->ip_data.GetIP() << " Old: \"" << *data->username << "\" New: \"" << new_username << '"' << std::endl;
+		Logger::Info("Username Changed") << "IP: " << data->ip_data.GetIP() << " Old: \"" << *data->username << "\" New: \"" << new_username << '"';
 		usernames_.erase(*data->username);
+		RemoveOnlineUser(*data->username);
 		data->username->assign(new_username);
 	} else {
 		data->username = std::make_shared<std::string>(new_username);
-		std::cout << "[Username Assigned] IP: " << data->ip_data.GetIP() << " New username: \"" << new_username << '"' << std::endl;
+		Logger::Info("Username Assigned") << "IP: " << data->ip_data.GetIP() << " New username: \"" << new_username << '"';
 	}
 
 	data->ip_data.name_chg_count++;
 	data->ip_data.last_name_chg = now;
 	usernames_[new_username] = data;
+	AddOnlineUser(*data);
+
+	// Relays' viewers resume their sessions through the relay
+	if(data->session_token.empty() && data->relay_role == RelayRole::kNone)
+		IssueSessionToken(*data);
+}
+
+void CollabVMServer::IssueSessionToken(CollabVMUser& user) {
+	// session,<token>
+	user.session_token = GenerateSecretId();
+	std::string instr = "7.session,";
+	instr += std::to_string(user.session_token.length());
+	instr += '.';
+	instr += user.session_token;
+	instr += ';';
+	SendWSMessage(user, instr);
+}
+
+void CollabVMServer::SuspendSession(CollabVMUser& user, size_t turn_position) {
+	// Only users viewing a VM have a session worth resuming
+	if(user.session_token.empty() || !user.username || !user.vm_controller || user.relay_role != RelayRole::kNone)
+		return;
+
+	ExpireSessions();
+	VMController& controller = *user.vm_controller;
+	sessions_[user.session_token] = { *user.username, controller.GetSettings().Name, turn_position,
+									  std::chrono::steady_clock::now() + std::chrono::seconds(kSessionGracePeriod) };
+	session_expiry_.push_back(user.session_token);
+	session_usernames_[*user.username] = user.session_token;
+}
+
+bool CollabVMServer::ResumeSession(const std::shared_ptr<CollabVMUser>& user, const std::string& vm_name, const char* arg,
+								   size_t& turn_position, guac_timestamp& timestamp) {
+	const char* separator = std::strchr(arg, ':');
+	if(!separator)
+		return false;
+
+	ExpireSessions();
+	auto it = sessions_.find(std::string(arg, separator - arg));
+	if(it == sessions_.end() || it->second.vm_name != vm_name)
+		return false;
+
+	// The token is left in session_expiry_ until it reaches the front
+	SuspendedSession session = std::move(it->second);
+	sessions_.erase(it);
+	session_usernames_.erase(session.username);
+
+	// The IP may not be allowed to change its username right now
+	if(!user->username || *user->username != session.username)
+		ChangeUsername(user, session.username, UsernameChangeResult::kSuccess, false);
+	if(!user->username || *user->username != session.username)
+		return false;
+
+	char* end;
+	timestamp = std::strtoll(separator + 1, &end, 10);
+	if(*end || timestamp < 0)
+		timestamp = 0;
+	turn_position = session.turn_position;
+
+	Logger::Info("Session Resumed") << "IP: " << user->ip_data.GetIP() << " Username: \"" << session.username << '"';
+	return true;
+}
+
+void CollabVMServer::ExpireSessions() {
+	auto now = std::chrono::steady_clock::now();
+	while(!session_expiry_.empty()) {
+		auto it = sessions_.find(session_expiry_.front());
+		if(it != sessions_.end()) {
+			if(it->second.expiry > now)
+				break;
+			session_usernames_.erase(it->second.username);
+			sessions_.erase(it);
+		}
+		session_expiry_.pop_front();
+	}
+}
+
+bool CollabVMServer::IsUsernameTaken(const std::string& username) {
+	if(usernames_.find(username) != usernames_.end())
+		return true;
+	ExpireSessions();
+	return session_usernames_.find(username) != session_usernames_.end();
 }
 
 std::string CollabVMServer::GenerateUsername() {
@@ -1555,7 +2991,7 @@ std::string CollabVMServer::GenerateUsername() {
 	std::string username = username_base + std::to_string(num);
 
 	// Increment the number until a username is found that is not taken
-	while(usernames_.find(username) != usernames_.end()) {
+	while(IsUsernameTaken(username)) {
 		username = username_base + std::to_string(++num);
 	}
 
@@ -1563,66 +2999,37 @@ std::string CollabVMServer::GenerateUsername() {
 }
 
 std::string CollabVMServer::EncodeHTMLString(const char* str, size_t strLen) {
-	std::ostringstream ss;
-	for(size_t i = 0; i < strLen; i++) {
-		char c = str[i];
-		switch(c) {
-			case '&':
-				ss << "&amp;";
-				break;
-			case '<':
-				ss << "&lt;";
-				break;
-			case '>':
-				ss << "&gt;";
-				break;
-			case '"':
-				ss << "&quot;";
-				break;
-			case '\'':
-				ss << "&#x27;";
-				break;
-			case '/':
-				ss << "&#x2F;";
-				break;
-			case '\n':
-				ss << "&#13;&#10;";
-				break;
-			default:
-				// Only allow printable ASCII characters
-				if(c >= 32 && c <= 126)
-					ss << c;
-		}
-	}
-	return ss.str();
+	std::string encoded;
+	HTMLEncoder::Append(str, strLen, encoded);
+	return encoded;
 }
 
 void CollabVMServer::ExecuteCommandAsync(std::string command) {
-	// system() is used for simplicity but it is actually synchronous,
-	// so it is called in a new thread
-	std::string command_ = command;
-	std::thread([command_] {
-		if(std::system(command_.c_str())) {
-			std::cout << "An error occurred while executing: " << command_ << std::endl;
-		};
-	})
-	.detach();
+	if(!command_runner_.Run(command))
+		Logger::Warning() << "Too many commands are waiting to run, dropped: " << command;
 }
 
 void CollabVMServer::MuteUser(const std::shared_ptr<CollabVMUser>& user, bool permanent) {
 	auto now = std::chrono::time_point_cast<std::chrono::seconds>(std::chrono::steady_clock::now());
 
 	std::string mute_time = std::to_string(database_.Configuration.ChatMuteTime);
-	std::cout << "[Chat] User was muted ";
-	if(permanent)
-		std::cout << "indefinitely.";
-	else
-		std::cout << "for " << mute_time << " seconds.";
-	std::cout << " IP: " << user->ip_data.GetIP() << " Username: \"" << *user->username << '"' << std::endl;
+	Logger::Info("Chat") << "User was muted " << (permanent ? "indefinitely." : "for " + mute_time + " seconds.")
+						 << " IP: " << user->ip_data.GetIP() << " Username: \"" << *user->username << '"';
 	// Mute the user
 	user->ip_data.last_chat_msg = now;
 	user->ip_data.chat_muted = permanent ? kPermMute : kTempMute;
 
+	// Store the mute so that reconnecting after a restart doesn't lift it
+	IPBan mute;
+	if(IPBanTable::NormalizePrefix(user->ip_data.GetIP(), mute.Prefix)) {
+		mute.Type = IPBan::kMute;
+		mute.Expires = permanent ? 0 : std::time(nullptr) + database_.Configuration.ChatMuteTime;
+		mute.Reason = "Username: " + *user->username;
+		database_.AddIPBan(mute);
+		ip_bans_.Update(database_.IPBans);
+		cluster_->GetSanctions().Record(mute, false);
+	}
+
 #define part1 "You have been muted"
 #define part2 " for "
 #define part3 " seconds."
@@ -1646,9 +3053,13 @@ void CollabVMServer::MuteUser(const std::shared_ptr<CollabVMUser>& user, bool pe
 
 void CollabVMServer::UnmuteUser(const std::shared_ptr<CollabVMUser>& user) {
 	user->ip_data.chat_muted = kUnmuted;
-	std::cout << "[Chat] User was unmuted."
-				 " IP: "
-			  << user->ip_data.GetIP() << " Username: \"" << *user->username << '"' << std::endl;
+
+	std::string prefix;
+	if(IPBanTable::NormalizePrefix(user->ip_data.GetIP(), prefix))
+		RemoveIPBan(prefix, IPBan::kMute);
+	Logger::Info("Chat") << "User was unmuted."
+							" IP: "
+						 << user->ip_data.GetIP() << " Username: \"" << *user->username << '"';
 #define part1u "You have been unmuted."
 	std::string instr = "4.chat,0.,";
 	instr += std::to_string(sizeof(part1u) - 1);
@@ -1658,7 +3069,75 @@ void CollabVMServer::UnmuteUser(const std::shared_ptr<CollabVMUser>& user) {
 	//return;
 }
 
-void CollabVMServer::OnMouseInstruction(const std::shared_ptr<CollabVMUser>& user, std::vector<char*>& args) {
+void CollabVMServer::AddIPBan(const IPBan& ban) {
+	database_.AddIPBan(ban);
+	ip_bans_.Update(database_.IPBans);
+	cluster_->GetSanctions().Record(ban, false);
+	Logger::Info(ban.Type == IPBan::kMute ? "Mute" : "Ban") << ban.Prefix << " was added.";
+	EnforceIPBans(ban.Type == IPBan::kMute);
+}
+
+void CollabVMServer::RemoveIPBan(const std::string& prefix, uint8_t type) {
+	database_.RemoveIPBan(prefix, type);
+	ip_bans_.Update(database_.IPBans);
+
+	IPBan ban;
+	ban.Prefix = prefix;
+	ban.Type = type;
+	cluster_->GetSanctions().Record(ban, true);
+}
+
+void CollabVMServer::EnforceIPBans(bool update_mutes) {
+	int64_t now = std::time(nullptr);
+	for(const std::shared_ptr<CollabVMUser>& user : connections_) {
+		std::shared_ptr<websocketmm::websocket_user> handle = user->handle.lock();
+		if(!handle)
+			continue;
+
+		IPBanTable::Match match = ip_bans_.Lookup(handle->GetAddress(), now);
+		if(match.banned) {
+			PostAction<UserAction>(*user, ActionType::kRemoveConnection);
+		} else if(!update_mutes) {
+			continue;
+		} else if(match.muted && user->ip_data.chat_muted != kPermMute) {
+			user->ip_data.chat_muted = match.mute_expires ? kTempMute : kPermMute;
+			user->ip_data.last_chat_msg = std::chrono::time_point_cast<std::chrono::seconds>(std::chrono::steady_clock::now()) +
+										  std::chrono::seconds(match.mute_expires - now - database_.Configuration.ChatMuteTime);
+		} else if(!match.muted) {
+			user->ip_data.chat_muted = kUnmuted;
+		}
+	}
+}
+
+void CollabVMServer::ApplyClusterSanctions() {
+	std::vector<ClusterSanctions::Sanction> changes = cluster_->GetSanctions().TakeChanges();
+	if(changes.empty())
+		return;
+
+	// They're stored without being recorded again, so they aren't sent back with a new stamp
+	bool mutes_changed = false;
+	for(const ClusterSanctions::Sanction& sanction : changes) {
+		if(sanction.removed)
+			database_.RemoveIPBan(sanction.ban.Prefix, sanction.ban.Type);
+		else
+			database_.AddIPBan(sanction.ban);
+		mutes_changed |= sanction.ban.Type == IPBan::kMute;
+		Logger::Info(sanction.ban.Type == IPBan::kMute ? "Mute" : "Ban")
+			<< sanction.ban.Prefix << (sanction.removed ? " was removed by " : " was added by ") << sanction.origin;
+	}
+	ip_bans_.Update(database_.IPBans);
+	EnforceIPBans(mutes_changed);
+}
+
+uint32_t CollabVMServer::CountClusterEvent(const IPData& ip_data, ClusterSanctions::Counter counter, uint32_t window) {
+	ClusterSanctions& sanctions = cluster_->GetSanctions();
+	std::string ip = ip_data.GetIP();
+	int64_t now = std::time(nullptr);
+	sanctions.Increment(ip, counter, window, now);
+	return sanctions.GetRemoteCount(ip, counter, window, now);
+}
+
+void CollabVMServer::OnMouseInstruction(const std::shared_ptr<CollabVMUser>& user, int x, int y, int button_mask) {
 	// Only allow a user to send mouse instructions if it is their turn,
 	// they are an admin, or they are connected to the admin panel
 	if(user->vm_controller != nullptr &&
@@ -1666,11 +3145,11 @@ void CollabVMServer::OnMouseInstruction(const std::shared_ptr<CollabVMUser>& use
 		user->user_rank == UserRank::kAdmin ||
 		user->admin_connected) &&
 	   user->guac_user != nullptr && user->guac_user->client_) {
-		user->guac_user->client_->HandleMouse(*user->guac_user, args);
+		user->guac_user->client_->HandleMouse(*user->guac_user, x, y, button_mask);
 	}
 }
 
-void CollabVMServer::OnKeyInstruction(const std::shared_ptr<CollabVMUser>& user, std::vector<char*>& args) {
+void CollabVMServer::OnKeyInstruction(const std::shared_ptr<CollabVMUser>& user, int keysym, int pressed) {
 	// Only allow a user to send keyboard instructions if it is their turn,
 	// they are an admin, or they are connected to the admin panel
 	if(user->vm_controller != nullptr &&
@@ -1678,7 +3157,7 @@ void CollabVMServer::OnKeyInstruction(const std::shared_ptr<CollabVMUser>& user,
 		user->user_rank == UserRank::kAdmin ||
 		user->admin_connected) &&
 	   user->guac_user != nullptr && user->guac_user->client_) {
-		user->guac_user->client_->HandleKey(*user->guac_user, args);
+		user->guac_user->client_->HandleKey(*user->guac_user, keysym, pressed);
 	}
 }
 
@@ -1714,7 +3193,7 @@ void CollabVMServer::OnRenameInstruction(const std::shared_ptr<CollabVMUser>& us
 		} else {
 			result = UsernameChangeResult::kInvalid;
 		}
-	} else if(usernames_.find(username) != usernames_.end()) {
+	} else if(IsUsernameTaken(username)) {
 		// The requested username is already taken
 		if(!user->username) {
 			// Respond with successful result and generate a new
@@ -1726,7 +3205,7 @@ void CollabVMServer::OnRenameInstruction(const std::shared_ptr<CollabVMUser>& us
 		}
 	} else {
 		if(!gen_username) {
-			if(std::find(blacklisted_usernames_.begin(), blacklisted_usernames_.end(), username) != blacklisted_usernames_.end() && user->user_rank != UserRank::kModerator && user->user_rank != UserRank::kAdmin) {
+			if(blacklisted_usernames_.count(username) && user->user_rank != UserRank::kModerator && user->user_rank != UserRank::kAdmin) {
 				// The requested username is blacklisted
 				result = UsernameChangeResult::kBlacklisted;
 				std::string instr;
@@ -1783,9 +3262,7 @@ static void AppendVMActions(const VMController& controller, const VMSettings& se
 void CollabVMServer::SendActionInstructions(VMController& controller, const VMSettings& settings) {
 	std::string instr = "6.action,1.";
 	AppendVMActions(controller, settings, instr);
-	controller.GetUsersList().ForEachUser([this, &instr](CollabVMUser& user) {
-		SendWSMessage(user, instr);
-	});
+	BroadcastWSMessage(controller.GetUsersList(), instr);
 }
 
 void CollabVMServer::BroadcastMOTD(VMController& controller, const VMSettings& settings) {
@@ -1795,16 +3272,76 @@ void CollabVMServer::BroadcastMOTD(VMController& controller, const VMSettings& s
 	instr += settings.MOTD;
 	instr += ';';
 
-	controller.GetUsersList().ForEachUser([self = shared_from_this(), &instr](CollabVMUser& user) {
-		self->SendWSMessage(user, instr);
-	});
+	BroadcastWSMessage(controller.GetUsersList(), instr);
+}
+
+std::shared_ptr<const websocketmm::websocket_message> CollabVMServer::GetJoinBundle(const VMController& controller) {
+	const VMSettings& settings = controller.GetSettings();
+	std::string connect = "7.connect,1.1,1.";
+	AppendVMActions(controller, settings, connect);
+
+	const auto& online_users = GetOnlineUsersMessage();
+	const auto& chat_history = GetChatHistoryMessage();
+	JoinBundle& bundle = join_bundles_[settings.Name];
+	if(bundle.message && bundle.connect == connect && bundle.motd == settings.MOTD &&
+	   bundle.online_users == online_users && bundle.chat_history == chat_history)
+		return bundle.message;
+
+	ByteBuffer instr;
+	instr.Append(connect);
+	instr.Append(online_users->data.data(), online_users->data.size());
+	if(chat_history)
+		instr.Append(chat_history->data.data(), chat_history->data.size());
+	// The MOTD is sent if it's not empty
+	if(!settings.MOTD.empty()) {
+		instr.Append("4.chat,0.,");
+		instr.AppendInt(settings.MOTD.length());
+		instr.Append('.');
+		instr.Append(settings.MOTD);
+		instr.Append(';');
+	}
+
+	bundle.connect = std::move(connect);
+	bundle.motd = settings.MOTD;
+	bundle.online_users = online_users;
+	bundle.chat_history = chat_history;
+	bundle.message = websocketmm::BuildWebsocketMessage(websocketmm::websocket_message::type::text, instr.Release());
+	return bundle.message;
 }
 
 void CollabVMServer::OnConnectInstruction(const std::shared_ptr<CollabVMUser>& user, std::vector<char*>& args) {
-	if(args.size() != 1 || user->guac_user != nullptr || !user->username) {
+	// The VM name can be followed by the image mimetypes and
+	// protocol extensions the client supports. A relay's display
+	// connection joins without a username.
+	if(args.empty() || user->guac_user != nullptr)
 		return;
+
+	// A client that lost its connection can join with "resume:<token>:<timestamp>",
+	// the timestamp being the last sync it applied, without choosing a username
+	// first. It gets its username and place in the turn queue back, and is only
+	// sent the parts of the screen that changed since that frame.
+	bool resumed = false;
+	size_t turn_position = VMController::kNoTurn;
+	guac_timestamp resume_timestamp = 0;
+	if(user->relay_role == RelayRole::kNone) {
+		for(size_t i = 1; i < args.size(); i++) {
+			if(std::strncmp(args[i], "resume:", 7))
+				continue;
+			resumed = ResumeSession(user, args[0], args[i] + 7, turn_position, resume_timestamp);
+
+			// A session that expired joins like a new user
+			if(!resumed && !user->username)
+				ChangeUsername(user, GenerateUsername(), UsernameChangeResult::kSuccess, false);
+			break;
+		}
 	}
 
+	if(!user->username && user->relay_role != RelayRole::kDisplay)
+		return;
+
+	// The client leaves the VM list to view the VM
+	list_subscribers_.erase(user);
+
 	// Connect
 	std::string vm_name = args[0];
 	if(vm_name.empty()) {
@@ -1813,6 +3350,10 @@ void CollabVMServer::OnConnectInstruction(const std::shared_ptr<CollabVMUser>& u
 		return;
 	}
 
+	// Relays connect to the primary they were pointed at
+	if(user->relay_role == RelayRole::kNone && RedirectToOwner(*user, vm_name))
+		return;
+
 	auto it = vm_controllers_.find(vm_name);
 	if(it == vm_controllers_.end()) {
 		// VM not found
@@ -1834,24 +3375,89 @@ void CollabVMServer::OnConnectInstruction(const std::shared_ptr<CollabVMUser>& u
 	/*if (user->ip_data.turn_fixed)
 		return;*/
 
-	std::string instr = "7.connect,1.1,1.";
-	AppendVMActions(controller, controller.GetSettings(), instr);
-	SendWSMessage(*user, instr);
+	if(resumed) {
+		// The client still has the chat, it only needs the users that are online now
+		std::string connect = "7.connect,1.1,1.";
+		AppendVMActions(controller, controller.GetSettings(), connect);
+		SendWSMessage(*user, connect);
+		SendWSMessage(*user, GetOnlineUsersMessage());
+	} else {
+		SendWSMessage(*user, GetJoinBundle(controller));
+	}
+
+	std::atomic_store(&user->guac_user, std::make_shared<GuacUser>(this, *user, user->handle));
+	user->guac_user->resume_timestamp_ = resume_timestamp;
+	if(auto handle = user->handle.lock())
+		handle->GetMemoryAccount().Allocate(MemoryCategory::kConnections, sizeof(GuacUser));
+	user->guac_user->relay_role_ = user->relay_role;
+	user->turn_updates = false;
+	user->reduced_quality = false;
+	user->display_hidden = false;
+	user->tab_hidden = false;
+	user->viewport_empty = false;
+	user->guac_user->info.optimal_width = 0;
+	user->guac_user->info.optimal_height = 0;
+
+	// The formats a relay's viewer supports are left off, so they don't
+	// change how the display is encoded for the relay's own connection
+	bool relayed = user->relay_role == RelayRole::kViewer;
+	user->guac_user->socket_.SetBinary(user->binary_images && !relayed);
+	for(size_t i = 1; i < args.size(); i++) {
+		if(!std::strcmp(args[i], "image/webp"))
+			user->guac_user->socket_.SetWebP(!relayed);
+		else if(!std::strcmp(args[i], GUAC_SCREEN_CODEC_MIMETYPE)) {
+			// The codec's images are only sent as raw bytes
+			user->guac_user->socket_.SetScreenCodec(user->guac_user->socket_.IsBinary());
+		} else if(!std::strcmp(args[i], GUAC_SCREEN_CODEC_ZSTD_MIMETYPE))
+			user->guac_user->socket_.SetScreenCodecZstd(true);
+		else if(!std::strcmp(args[i], VideoStream::GetMimetype()))
+			user->guac_user->socket_.SetVideo(!relayed);
+		else if(!std::strcmp(args[i], "turnupdate"))
+			user->turn_updates = true;
+		else if(!std::strncmp(args[i], "size:", 5)) {
+			char* end;
+			long width = std::strtol(args[i] + 5, &end, 10);
+			long height = *end == 'x' ? std::strtol(end + 1, &end, 10) : 0;
+			if(!*end && width > 0 && width <= UINT16_MAX && height > 0 && height <= UINT16_MAX) {
+				user->guac_user->info.optimal_width = width;
+				user->guac_user->info.optimal_height = height;
+			}
+		}
+	}
+
+	// Clients with small screens are sent the scaled down display, so they
+	// don't download pixels they can't show
+	const guac_user_info& info = user->guac_user->info;
+	user->scaled_display = user->relay_role == RelayRole::kNone && info.optimal_width > 0 &&
+						   static_cast<uint64_t>(info.optimal_width) * info.optimal_height <= kScaledDisplayMaxArea;
+	user->guac_user->scaled_display_ = user->scaled_display.load();
+	controller.AddUser(user);
+	if(resumed)
+		controller.ResumeTurn(user, turn_position);
+}
 
-	SendOnlineUsersList(*user);
-	SendChatHistory(*user);
+void CollabVMServer::AddSpectator(const std::shared_ptr<CollabVMUser>& user) {
+	if(RedirectToOwner(*user, user->spectate_vm))
+		return;
 
-	// Send the MOTD if it's not empty.
-	if(!controller.GetSettings().MOTD.empty()) {
-		instr = "4.chat,0.,";
-		instr += std::to_string(controller.GetSettings().MOTD.length());
-		instr += '.';
-		instr += controller.GetSettings().MOTD;
-		instr += ';';
-		SendWSMessage(*user, instr);
+	auto it = vm_controllers_.find(user->spectate_vm);
+	if(it == vm_controllers_.end()) {
+		SendWSMessage(*user, "7.connect,1.0;");
+		return;
 	}
+	VMController& controller = *it->second;
 
-	user->guac_user = new GuacUser(this, user->handle);
+	// Spectators aren't online users, so they're only sent the chat if they asked for it
+	std::string connect = "7.connect,1.1,1.";
+	AppendVMActions(controller, controller.GetSettings(), connect);
+	SendWSMessage(*user, connect);
+	if(user->spectator == Spectator::kChat)
+		SendChatHistory(*user);
+
+	std::atomic_store(&user->guac_user, std::make_shared<GuacUser>(this, *user, user->handle));
+	if(auto handle = user->handle.lock())
+		handle->GetMemoryAccount().Allocate(MemoryCategory::kConnections, sizeof(GuacUser));
+	user->guac_user->socket_.SetBinary(user->binary_images);
 	controller.AddUser(user);
 }
 
@@ -1882,6 +3488,8 @@ void CollabVMServer::OnAdminInstruction(const std::shared_ptr<CollabVMUser>& use
 			// Logged out
 			SendWSMessage(*user, "5.admin,1.0,1.4;");
 			user->user_rank = UserRank::kUnregistered;
+			user->display_priority = user->vm_controller && user->vm_controller->CurrentTurn() == user;
+			UpdateOnlineUser(*user);
 			if(user->vm_controller != nullptr) {
 				// Send new rank to users
 				std::string adminUser = "7.adduser,1.1,";
@@ -1890,14 +3498,17 @@ void CollabVMServer::OnAdminInstruction(const std::shared_ptr<CollabVMUser>& use
 				adminUser += ".";
 				adminUser += adminStr;
 				adminUser += ",1.0;";
+				FlushPresence();
+				std::shared_ptr<const websocketmm::websocket_message> message = websocketmm::BuildWebsocketMessage(adminUser);
 				user->vm_controller->GetUsersList().ForEachUser([&](CollabVMUser& data) {
-					if(*data.username != *user->username)
-						SendWSMessage(data, adminUser);
+					if(&data != user.get())
+						SendWSMessage(data, message);
 				});
 				SendOnlineUsersList(*user); // send userlist
 			}
 			user->admin_connected = false;
 			admin_connections_.erase(user);
+			stats_subscribers_.erase(user);
 			break;
 		case kSeshID:
 			if(args.size() == 1) {
@@ -1908,6 +3519,8 @@ void CollabVMServer::OnAdminInstruction(const std::shared_ptr<CollabVMUser>& use
 				if(!admin_session_id_.empty() && args[1] == admin_session_id_) {
 					user->admin_connected = true;
 					user->user_rank = UserRank::kAdmin;
+					user->display_priority = true;
+					UpdateOnlineUser(*user);
 					admin_connections_.insert(user);
 
 					// Send login success response
@@ -1921,9 +3534,11 @@ void CollabVMServer::OnAdminInstruction(const std::shared_ptr<CollabVMUser>& use
 						adminUser += ".";
 						adminUser += adminStr;
 						adminUser += ",1.2;";
+						FlushPresence();
+						std::shared_ptr<const websocketmm::websocket_message> message = websocketmm::BuildWebsocketMessage(adminUser);
 						user->vm_controller->GetUsersList().ForEachUser([&](CollabVMUser& data) {
-							if(*data.username != *user->username)
-								SendWSMessage(data, adminUser);
+							if(&data != user.get())
+								SendWSMessage(data, message);
 						});
 						SendOnlineUsersList(*user); // send userlist
 					}
@@ -1937,6 +3552,8 @@ void CollabVMServer::OnAdminInstruction(const std::shared_ptr<CollabVMUser>& use
 			if(args.size() == 2 && args[1] == database_.Configuration.MasterPassword) {
 				user->admin_connected = true;
 				user->user_rank = UserRank::kAdmin;
+				user->display_priority = true;
+				UpdateOnlineUser(*user);
 				admin_connections_.insert(user);
 
 				// Send login success response
@@ -1950,14 +3567,17 @@ void CollabVMServer::OnAdminInstruction(const std::shared_ptr<CollabVMUser>& use
 					adminUser += ".";
 					adminUser += adminStr;
 					adminUser += ",1.2;";
+					FlushPresence();
+					std::shared_ptr<const websocketmm::websocket_message> message = websocketmm::BuildWebsocketMessage(adminUser);
 					user->vm_controller->GetUsersList().ForEachUser([&](CollabVMUser& data) {
-						if(*data.username != *user->username)
-							SendWSMessage(data, adminUser);
+						if(&data != user.get())
+							SendWSMessage(data, message);
 					});
 					SendOnlineUsersList(*user); // send userlist
 				}
 			} else if(args.size() == 2 && args[1] == database_.Configuration.ModPassword && database_.Configuration.ModEnabled) {
 				user->user_rank = UserRank::kModerator;
+				UpdateOnlineUser(*user);
 
 				// Send moderator login success response
 				std::string modLogin = "5.admin,1.0,1.3,";
@@ -1976,9 +3596,11 @@ void CollabVMServer::OnAdminInstruction(const std::shared_ptr<CollabVMUser>& use
 					adminUser += ".";
 					adminUser += adminStr;
 					adminUser += ",1.3;";
+					FlushPresence();
+					std::shared_ptr<const websocketmm::websocket_message> message = websocketmm::BuildWebsocketMessage(adminUser);
 					user->vm_controller->GetUsersList().ForEachUser([&](CollabVMUser& data) {
-						if(*data.username != *user->username)
-							SendWSMessage(data, adminUser);
+						if(&data != user.get())
+							SendWSMessage(data, message);
 					});
 					SendOnlineUsersList(*user); // send userlist
 				}
@@ -2048,6 +3670,8 @@ void CollabVMServer::OnAdminInstruction(const std::shared_ptr<CollabVMUser>& use
 		case kRebootVM:
 		case kResetVM:
 		case kRestartVM:
+		case kStartRecording:
+		case kStopRecording:
 			for(size_t i = 1; i < args.size(); i++) {
 				auto it = vm_controllers_.find(args[i]);
 				if(it == vm_controllers_.end()) {
@@ -2075,32 +3699,48 @@ void CollabVMServer::OnAdminInstruction(const std::shared_ptr<CollabVMUser>& use
 					case kRestartVM:
 						it->second->Stop(VMController::StopReason::kRestart);
 						break;
+					case kStartRecording:
+						it->second->GetGuacClient().SetRecording(
+							kRecordingPath + it->first + '-' + std::to_string(std::time(nullptr)) + ".cvmrec");
+						break;
+					case kStopRecording:
+						it->second->GetGuacClient().SetRecording("");
+						break;
 				}
 				// Send success response
 				SendWSMessage(*user, "5.admin,1.1,15.{\"result\":true};");
 			}
 			break;
 		case kBanUser:
-			if(args.size() == 2 && database_.Configuration.BanCommand != "") {
+			if(args.size() == 2) {
 				for(auto it = connections_.begin(); it != connections_.end(); it++) {
 					std::shared_ptr<CollabVMUser> banUser = *it;
 					if(!banUser->username)
 						continue;
 					if(*banUser->username == args[1]) {
-						// Replace $IP in ban command with user's IP
-						std::string banCmd = database_.Configuration.BanCommand;
+						if(database_.Configuration.BanCommand != "") {
+							// Replace $IP in ban command with user's IP
+							std::string banCmd = database_.Configuration.BanCommand;
 
-						for(size_t it = 0; banCmd.find("$IP", it) != std::string::npos; it = banCmd.find("$IP", it))
-							banCmd.replace(banCmd.find("$IP", it), 3, banUser->ip_data.GetIP());
+							for(size_t it = 0; banCmd.find("$IP", it) != std::string::npos; it = banCmd.find("$IP", it))
+								banCmd.replace(banCmd.find("$IP", it), 3, banUser->ip_data.GetIP());
 
-						for(size_t it = 0; banCmd.find("$NAME", it) != std::string::npos; it = banCmd.find("$NAME", it))
-							banCmd.replace(banCmd.find("$NAME", it), 5, *banUser->username);
+							for(size_t it = 0; banCmd.find("$NAME", it) != std::string::npos; it = banCmd.find("$NAME", it))
+								banCmd.replace(banCmd.find("$NAME", it), 5, *banUser->username);
 
-						// Block user's IP
-						ExecuteCommandAsync(banCmd);
+							// Block user's IP
+							ExecuteCommandAsync(banCmd);
+						}
 
-						// Disconnect user
-						PostAction<UserAction>(*banUser, ActionType::kRemoveConnection);
+						// The ban is also stored, which disconnects
+						// every user from the IP
+						IPBan ban;
+						if(IPBanTable::NormalizePrefix(banUser->ip_data.GetIP(), ban.Prefix)) {
+							ban.Reason = "Username: " + *banUser->username;
+							AddIPBan(ban);
+						} else {
+							PostAction<UserAction>(*banUser, ActionType::kRemoveConnection);
+						}
 						break;
 					}
 				}
@@ -2175,7 +3815,7 @@ void CollabVMServer::OnAdminInstruction(const std::shared_ptr<CollabVMUser>& use
 						if(args.size() == 2) {
 							ChangeUsername(changeNameUser, GenerateUsername(), cnResult, 0);
 						} else {
-							if(usernames_.find(args[2]) != usernames_.end())
+							if(IsUsernameTaken(args[2]))
 								cnResult = UsernameChangeResult::kUsernameTaken;
 							else if(ValidateUsername(args[2])) {
 								ChangeUsername(changeNameUser, args[2], cnResult, 0);
@@ -2219,39 +3859,299 @@ void CollabVMServer::OnAdminInstruction(const std::shared_ptr<CollabVMUser>& use
 				user->vm_controller->TurnRequest(user, 1, 1);
 			};
 			break;
+		case kMemoryStats: {
+			std::ostringstream ss("5.admin,2.20,", std::ostringstream::in | std::ostringstream::out | std::ostringstream::ate);
+			std::string resp = GetMemoryStats();
+			ss << resp.length() << '.' << resp << ';';
+			SendWSMessage(*user, ss.str());
+			break;
+		}
+		case kAddIPBan:
+		case kRemoveIPBan:
+		case kGetIPBans: {
+			if(opcode == kAddIPBan && args.size() >= 4) {
+				// The prefix, the type, the duration in seconds or 0 for
+				// a ban that doesn't run out, and an optional reason
+				IPBan ban;
+				char* end;
+				long duration = std::strtol(args[3], &end, 10);
+				if(!IPBanTable::NormalizePrefix(args[1], ban.Prefix) || (args[2][0] != '0' && args[2][0] != '1') || *end || duration < 0)
+					break;
+
+				ban.Type = args[2][0] == '1' ? IPBan::kMute : IPBan::kBan;
+				ban.Expires = duration ? std::time(nullptr) + duration : 0;
+				if(args.size() >= 5)
+					ban.Reason = args[4];
+				AddIPBan(ban);
+			} else if(opcode == kRemoveIPBan && args.size() == 3) {
+				std::string prefix;
+				if(!IPBanTable::NormalizePrefix(args[1], prefix) || (args[2][0] != '0' && args[2][0] != '1'))
+					break;
+
+				RemoveIPBan(prefix, args[2][0] == '1' ? IPBan::kMute : IPBan::kBan);
+			} else if(opcode != kGetIPBans) {
+				break;
+			}
+
+			// Changes are answered with the new list
+			std::ostringstream ss("5.admin,2.23,", std::ostringstream::in | std::ostringstream::out | std::ostringstream::ate);
+			std::string resp = GetIPBans();
+			ss << resp.length() << '.' << resp << ';';
+			SendWSMessage(*user, ss.str());
+			break;
+		}
+		case kMigrateVM: {
+			// The name of the VM and the URL of the server to migrate it to
+			if(args.size() != 3)
+				return;
+
+			auto it = vm_controllers_.find(args[1]);
+			if(it == vm_controllers_.end()) {
+				// VM not found
+				SendWSMessage(*user, "5.admin,1.0,1.2;");
+				break;
+			}
+
+			// The admin is answered once the other server has started the VM
+			std::string vm_name = args[1];
+			std::weak_ptr<CollabVMUser> admin = user;
+			if(it->second->GetMigrationState() != VMController::MigrationState::kNone) {
+				SendAdminResult(*user, "The VM is already being migrated");
+			} else if(it->second->GetSettings().QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots) {
+				SendAdminResult(*user, "VMs that use HD snapshots can't be migrated");
+			} else if(!cluster_->RequestIncoming(args[2], vm_name,
+					  [self = shared_from_this(), admin, vm_name](bool ok, const std::string& host, const std::string& body) {
+						  self->PostAction<MigrationReadyAction>(admin, vm_name, ok, host, body);
+					  })) {
+				SendAdminResult(*user, "The server isn't a live member of the cluster");
+			} else {
+				Logger::Info() << "Asked " << args[2] << " to start VM \"" << vm_name << "\" for migration";
+			}
+			break;
+		}
+		case kSubscribeStats: {
+			// 1 to subscribe, 0 to unsubscribe
+			if(args.size() != 2 || (args[1][0] != '0' && args[1][0] != '1'))
+				break;
+
+			if(args[1][0] == '0') {
+				stats_subscribers_.erase(user);
+				break;
+			}
+			if(stats_subscribers_.contains(*user))
+				break;
+
+			// The first subscriber starts the timer with a clean slate, so
+			// they're sent every stat. Those that join later are sent the
+			// stats as the others last saw them, and then the same changes.
+			std::string resp;
+			if(stats_subscribers_.empty()) {
+				admin_vm_stats_.clear();
+				admin_server_stats_.fill(-1);
+				admin_stats_time_ = std::chrono::steady_clock::now();
+				resp = GetAdminStats(false);
+
+				boost::system::error_code ec;
+				admin_stats_timer_.expires_from_now(std::chrono::seconds(kAdminStatsInterval), ec);
+				admin_stats_timer_.async_wait(std::bind(&CollabVMServer::TimerCallback, shared_from_this(), std::placeholders::_1, ActionType::kAdminStats));
+			} else {
+				resp = GetAdminStats(true);
+			}
+			stats_subscribers_.insert(user);
+
+			std::ostringstream ss("5.admin,2.28,", std::ostringstream::in | std::ostringstream::out | std::ostringstream::ate);
+			ss << resp.length() << '.' << resp << ';';
+			SendWSMessage(*user, ss.str());
+			break;
+		}
+		case kProfile: {
+			// The number of seconds to profile for. The collapsed stacks
+			// are sent back once it's done, or nothing if it couldn't start.
+			unsigned int seconds = args.size() == 2 ? std::strtoul(args[1], nullptr, 10) : 0;
+			if(!seconds || seconds > kMaxProfileTime || !Profiler::Get().Start(seconds)) {
+				SendWSMessage(*user, "5.admin,2.29,0.;");
+				break;
+			}
+			Logger::Info() << "Profiling the server for " << seconds << " seconds";
+
+			boost::system::error_code ec;
+			profile_timer_.expires_from_now(std::chrono::seconds(seconds), ec);
+			std::weak_ptr<CollabVMUser> weak_user = user;
+			profile_timer_.async_wait([this, self = shared_from_this(), weak_user](const boost::system::error_code& ec) {
+				// The profiler is stopped even if the server is
+				std::string stacks = Profiler::Get().Stop();
+				auto user = weak_user.lock();
+				if(ec || !user)
+					return;
+
+				std::ostringstream ss("5.admin,2.29,", std::ostringstream::in | std::ostringstream::out | std::ostringstream::ate);
+				ss << stacks.length() << '.' << stacks << ';';
+				server_->send_message(user->handle, websocketmm::BuildWebsocketMessage(ss.str()));
+			});
+			break;
+		}
+	}
+}
+
+void CollabVMServer::BuildList() {
+	list_cluster_version_ = cluster_->GetVersion();
+	std::shared_ptr<const ClusterDirectory::Snapshot> cluster = cluster_->GetSnapshot();
+	list_index_.clear();
+	for(const auto& [name, controller] : vm_controllers_) {
+		if(!cluster->IsLocal(name))
+			continue;
+		// The thumbnail is fetched over HTTP, and the version tells the
+		// client whether the one it already has is out of date
+		const VMSettings& vm_settings = controller->GetSettings();
+		ListEntry& entry = list_index_.emplace_back();
+		entry.name = name;
+		entry.display_name = vm_settings.DisplayName;
+		if(controller->GetThumbnail()) {
+			entry.thumbnail_url = GetThumbnailURL(std::string(), kThumbnailPath, name);
+			entry.thumbnail_version = controller->GetThumbnailVersion();
+		}
+		entry.state = controller->GetState();
+	}
+
+	// The VMs given to other servers have their thumbnails fetched from them
+	for(const ClusterDirectory::Node& node : cluster->nodes) {
+		if(node.url == cluster->self_url)
+			continue;
+		for(const ClusterDirectory::VM& vm : node.vms) {
+			if(cluster->GetOwner(vm.name) != &node)
+				continue;
+			ListEntry& entry = list_index_.emplace_back();
+			entry.name = vm.name;
+			entry.display_name = vm.display_name;
+			if(vm.thumbnail_version) {
+				entry.thumbnail_url = GetThumbnailURL(node.url, kThumbnailPath, vm.name);
+				entry.thumbnail_version = vm.thumbnail_version;
+			}
+			entry.state = VMController::ControllerState::kRunning;
+		}
+	}
+	std::sort(list_index_.begin(), list_index_.end(), [](const ListEntry& a, const ListEntry& b) {
+		return a.name < b.name;
+	});
+
+	ByteBuffer instr;
+	instr.Append("4.list");
+	for(const ListEntry& entry : list_index_)
+		AppendListEntry(instr, entry, true);
+	instr.Append(';');
+	list_message_ = websocketmm::BuildWebsocketMessage(websocketmm::websocket_message::type::text, instr.Release());
+}
+
+void CollabVMServer::AppendListEntry(ByteBuffer& instr, const ListEntry& entry, bool thumbnail) {
+	AppendArgument(instr, entry.name);
+	AppendArgument(instr, entry.display_name);
+	if(thumbnail && entry.thumbnail_version) {
+		AppendArgument(instr, entry.thumbnail_url);
+		AppendArgument(instr, std::to_string(entry.thumbnail_version));
+	} else {
+		instr.Append(",0.,1.0");
 	}
 }
 
 void CollabVMServer::OnListInstruction(const std::shared_ptr<CollabVMUser>& user, std::vector<char*>& args) {
-	std::string instr("4.list");
-	for(auto it = vm_controllers_.begin(); it != vm_controllers_.end(); it++) {
-		instr += ',';
-		const VMSettings& vm_settings = it->second->GetSettings();
-		instr += std::to_string(vm_settings.Name.length());
-		instr += '.';
-		instr += vm_settings.Name;
-		instr += ',';
-		instr += std::to_string(vm_settings.DisplayName.length());
-		instr += '.';
-		instr += vm_settings.DisplayName;
+	// The list is only rebuilt after it has been invalidated by a change
+	// to the VMs, here or elsewhere in the cluster, so every other request
+	// shares the same message
+	if(!list_message_ || cluster_->GetVersion() != list_cluster_version_)
+		BuildList();
+
+	// list,subscribe,start,count,state,thumbnails asks for a page of the
+	// VMs, sorted by name, optionally only those in a controller state
+	// and without their thumbnails. It's followed by the number of VMs
+	// that matched, so the client knows how many pages there are.
+	if(args.size() >= 3) {
+		size_t start = std::strtoul(args[1], nullptr, 10);
+		size_t count = std::min<size_t>(std::strtoul(args[2], nullptr, 10), kMaxListPage);
+		int state = args.size() >= 4 && args[3][0] ? std::atoi(args[3]) : -1;
+		bool thumbnails = args.size() < 5 || args[4][0] != '0';
+
+		ByteBuffer instr;
+		instr.Append("4.list");
+		size_t matched = 0;
+		for(const ListEntry& entry : list_index_) {
+			if(state != -1 && static_cast<int>(entry.state) != state)
+				continue;
+			if(matched >= start && matched - start < count)
+				AppendListEntry(instr, entry, thumbnails);
+			matched++;
+		}
+		instr.Append(";9.listtotal");
+		AppendArgument(instr, std::to_string(matched));
+		instr.Append(';');
+		SendWSMessage(*user, websocketmm::BuildWebsocketMessage(websocketmm::websocket_message::type::text, instr.Release()));
+	} else {
+		SendWSMessage(*user, list_message_);
+	}
 
-		instr += ',';
+	// list,1 subscribes to the thumbnails of the VMs as they change,
+	// instead of asking for the whole list again, and list,0 unsubscribes
+	if(!args.empty() && args[0][0] == '1')
+		list_subscribers_.insert(user);
+	else if(!args.empty() && args[0][0] == '0')
+		list_subscribers_.erase(user);
+}
 
-		std::string* png = it->second->GetThumbnail();
-		if(png && png->length()) {
-			instr += std::to_string(png->length());
-			instr += '.';
-			instr += *png;
-		} else {
-			instr += "0.";
+void CollabVMServer::OnKeyframeInstruction(const std::shared_ptr<CollabVMUser>& user, std::vector<char*>& args) {
+	// A relay asks for the display again once the updates it has kept
+	// for its joining viewers add up to more than a new copy would
+	if(user->relay_role == RelayRole::kDisplay && user->guac_user != nullptr && user->guac_user->client_)
+		user->guac_user->client_->ResyncUser(*user->guac_user);
+}
+
+void CollabVMServer::OnVisibilityInstruction(const std::shared_ptr<CollabVMUser>& user, std::vector<char*>& args) {
+	if(args.size() != 1 || user->guac_user == nullptr || !user->guac_user->client_)
+		return;
+
+	// A browser throttles a tab in the background, so the display updates
+	// would only pile up in its queue. Chat and turns are still sent, and
+	// the display is sent again, with the next batch of joins, when it's shown
+	user->tab_hidden = !std::strcmp(args[0], "0");
+	UpdateDisplayHidden(*user);
+}
+
+void CollabVMServer::OnViewportInstruction(const std::shared_ptr<CollabVMUser>& user, std::vector<char*>& args) {
+	if(args.size() != 3 || user->guac_user == nullptr || !user->guac_user->client_)
+		return;
+
+	// The visible width and height of the display the user is sent,
+	// in its pixels, and the percentage of its size it's drawn at
+	long values[3];
+	for(size_t i = 0; i < 3; i++) {
+		char* end;
+		values[i] = std::strtol(args[i], &end, 10);
+		if(*end || end == args[i] || values[i] < 0 || values[i] > UINT16_MAX)
+			return;
+	}
+
+	// A viewport zoomed out far enough can't show the full display's pixels,
+	// so it's sent the scaled down display until it's zoomed back in. Relays
+	// always get the full display for their viewers.
+	if(user->relay_role == RelayRole::kNone && values[2] > 0) {
+		long scale = user->scaled_display ? values[2] / GuacClient::kScaledDisplayDivisor : values[2];
+		bool scaled = user->scaled_display ? scale < kFullViewportPercent : scale <= kScaledViewportPercent;
+		if(scaled != user->scaled_display) {
+			user->scaled_display = scaled;
+			user->guac_user->client_->SetScaledDisplay(*user->guac_user, scaled);
 		}
 	}
-	instr += ';';
-	SendWSMessage(*user, instr);
+
+	// An embedded frame that's scrolled out of view shows none of it
+	user->viewport_empty = !values[0] || !values[1];
+	UpdateDisplayHidden(*user);
 }
 
-void CollabVMServer::OnNopInstruction(const std::shared_ptr<CollabVMUser>& user, std::vector<char*>& args) {
-	user->last_nop_instr = std::chrono::time_point_cast<std::chrono::seconds>(std::chrono::steady_clock::now());
+void CollabVMServer::UpdateDisplayHidden(CollabVMUser& user) {
+	bool hidden = user.tab_hidden || user.viewport_empty;
+	if(user.display_hidden == hidden)
+		return;
+	user.display_hidden = hidden;
+	if(!hidden)
+		user.guac_user->client_->ResyncUser(*user.guac_user);
 }
 
 void CollabVMServer::OnQEMUResponse(std::weak_ptr<CollabVMUser> data, rapidjson::Document& d) {
@@ -2287,9 +4187,12 @@ void CollabVMServer::OnChatInstruction(const std::shared_ptr<CollabVMUser>& user
 	}
 
 	if(database_.Configuration.ChatRateCount && database_.Configuration.ChatRateTime) {
+		// Messages sent through other servers of the cluster count as well
+		uint32_t remote = CountClusterEvent(user->ip_data, ClusterSanctions::Counter::kChat, database_.Configuration.ChatRateTime);
+
 		// Calculate the time since the user's last message
 		if((now - user->ip_data.last_chat_msg).count() < database_.Configuration.ChatRateTime) {
-			if(++user->ip_data.chat_msg_count >= database_.Configuration.ChatRateCount) {
+			if(++user->ip_data.chat_msg_count + remote >= database_.Configuration.ChatRateCount) {
 				if(user->user_rank == kUnregistered || (user->user_rank == kModerator && !(database_.Configuration.ModPerms & 16))) {
 					MuteUser(user, false);
 					return;
@@ -2305,48 +4208,51 @@ void CollabVMServer::OnChatInstruction(const std::shared_ptr<CollabVMUser>& user
 	if(!str_len || str_len > kMaxChatMsgLen)
 		return;
 
-	std::string msg = EncodeHTMLString(args[0], str_len);
-	if(msg.empty())
+	// The message is escaped into a buffer that's reused, since its length
+	// has to be known before it's copied after the username
+	thread_local std::string msg;
+	msg.clear();
+	if(!HTMLEncoder::Append(args[0], str_len, msg))
 		return;
 
+	// The username and message are encoded once, for both the chat
+	// history and the instruction that's broadcast to every user
+	ChatMessage chat_message;
+	chat_message.timestamp = now;
+	chat_message.encoded.reserve(user->username->length() + msg.length() + 16);
+	chat_message.encoded = ',';
+	chat_message.encoded += std::to_string(user->username->length());
+	chat_message.encoded += '.';
+	chat_message.encoded += *user->username;
+	chat_message.encoded += ',';
+	chat_message.encoded += std::to_string(msg.length());
+	chat_message.encoded += '.';
+	chat_message.encoded += msg;
+
+	ByteBuffer instr;
+	instr.Append("4.chat");
+	instr.Append(chat_message.encoded);
+	instr.Append(';');
+	std::shared_ptr<const websocketmm::websocket_message> message = websocketmm::BuildPriorityMessage(instr.Release());
+
 	if(database_.Configuration.ChatMsgHistory) {
-		// Add the message to the chat history
-		ChatMessage* chat_message = &chat_history_[chat_history_end_];
-		chat_message->timestamp = now;
-		chat_message->username = user->username;
-		chat_message->message = msg;
-
-		uint8_t last_index = database_.Configuration.ChatMsgHistory - 1;
-
-		if(chat_history_end_ == chat_history_begin_ && chat_history_count_) {
-			// Increment the begin index
-			if(chat_history_begin_ == last_index)
-				chat_history_begin_ = 0;
-			else
-				chat_history_begin_++;
-		} else {
-			chat_history_count_++;
+		// Add the message to the chat history, forgetting the oldest
+		// message once it's full
+		MemoryAccount& memory = MemoryAccounting::Get().GetServerAccount();
+		if(chat_history_.size() >= database_.Configuration.ChatMsgHistory) {
+			memory.Free(MemoryCategory::kChatHistory, chat_history_.front().encoded.size());
+			chat_history_.pop_front();
 		}
-
-		// Increment the end index
-		if(chat_history_end_ == last_index)
-			chat_history_end_ = 0;
-		else
-			chat_history_end_++;
+		memory.Allocate(MemoryCategory::kChatHistory, chat_message.encoded.size());
+		chat_history_.push_back(std::move(chat_message));
+		chat_history_message_.reset();
 	}
 
-	std::string instr = "4.chat,";
-	instr += std::to_string(user->username->length());
-	instr += '.';
-	instr += *user->username;
-	instr += ',';
-	instr += std::to_string(msg.length());
-	instr += '.';
-	instr += msg;
-	instr += ';';
-
-	for(const auto& connection : connections_)
-		SendWSMessage(*connection, instr);
+	FlushPresence();
+	for(const auto& connection : connections_) {
+		if(connection->spectator != Spectator::kDisplay)
+			SendWSMessage(*connection, message);
+	}
 }
 
 void CollabVMServer::OnTurnInstruction(const std::shared_ptr<CollabVMUser>& user, std::vector<char*>& args) {
@@ -2359,11 +4265,13 @@ void CollabVMServer::OnTurnInstruction(const std::shared_ptr<CollabVMUser>& user
 			return;
 	}
 
+	uint32_t remote = CountClusterEvent(user->ip_data, ClusterSanctions::Counter::kTurn, database_.Configuration.TurnRateTime);
+
 	// Calculate the time since the user's last turn instruction
 	if((now - user->ip_data.last_turn).count() < database_.Configuration.TurnRateTime) {
-		if(++user->ip_data.turn_count >= database_.Configuration.TurnRateCount) {
+		if(++user->ip_data.turn_count + remote >= database_.Configuration.TurnRateCount) {
 			std::string mute_time = std::to_string(database_.Configuration.TurnMuteTime);
-			std::cout << "[Anti-Turnfag] User prevented from taking turns. It has been stopped for " << mute_time << " seconds. IP: " << user->ip_data.GetIP() << std::endl;
+			Logger::Info("Anti-Turnfag") << "User prevented from taking turns. It has been stopped for " << mute_time << " seconds. IP: " << user->ip_data.GetIP();
 			user->ip_data.last_turn = now;
 			user->ip_data.turn_fixed = true;
 		}
@@ -2418,6 +4326,14 @@ void CollabVMServer::OnFileInstruction(const std::shared_ptr<CollabVMUser>& user
 					}
 					assert(found);
 
+					// Each VM's queue is bounded so one busy VM can't
+					// hold every user waiting to upload
+					bool can_start = CanStartUpload(*vm);
+					if(!can_start && vm->upload_queue_.size() >= kMaxQueuedUploads) {
+						SendWSMessage(*user, "4.file,1.5;");
+						break;
+					}
+
 					user->upload_info = std::make_shared<UploadInfo>(user, vm, filename, file_size, run_file,
 																	 user->vm_controller->GetSettings().UploadCooldownTime);
 
@@ -2429,11 +4345,15 @@ void CollabVMServer::OnFileInstruction(const std::shared_ptr<CollabVMUser>& user
 
 					user->ip_data.upload_in_progress = true;
 
-					if(upload_count_ != kMaxFileUploads) {
+					if(can_start) {
 						StartFileUpload(*user);
 					} else {
 						user->waiting_for_upload = true;
-						upload_queue_.push_back(user);
+						vm->upload_queue_.push_back(user);
+						if(!vm->upload_scheduled_) {
+							vm->upload_scheduled_ = true;
+							upload_vms_.push_back(vm);
+						}
 					}
 					break;
 				}
@@ -2482,52 +4402,46 @@ bool CollabVMServer::IsFilenameValid(const std::string& filename) {
 }
 
 void CollabVMServer::OnUploadTimeout(const boost::system::error_code ec, std::shared_ptr<UploadInfo> upload_info) {
-	/*
-	if (ec)
+	if(ec)
 		return;
 
-	UploadInfo::HttpUploadState prev_state =
-		upload_info->http_state.exchange(UploadInfo::HttpUploadState::kCancel);
-	if (prev_state == UploadInfo::HttpUploadState::kNotStarted)
-	{
-		std::unique_lock<std::mutex> lock(process_queue_lock_);
-		process_queue_.push(new HttpAction(ActionType::kHttpUploadTimedout, upload_info));
-		lock.unlock();
-		process_wait_.notify_one();
-	}
-	else if (prev_state == UploadInfo::HttpUploadState::kNotWriting)
-	{
-		std::unique_lock<std::mutex> lock(process_queue_lock_);
-		process_queue_.push(new HttpAction(ActionType::kHttpUploadFailed, upload_info));
-		lock.unlock();
-		process_wait_.notify_one();
-	}
-     */
+	// Once the POST request has started, HttpUploadSink enforces MaxUploadTime
+	UploadInfo::HttpUploadState expected = UploadInfo::HttpUploadState::kNotStarted;
+	if(upload_info->http_state.compare_exchange_strong(expected, UploadInfo::HttpUploadState::kCancel))
+		PostAction<HttpAction>(ActionType::kHttpUploadTimedout, upload_info);
 }
 
 void CollabVMServer::StartFileUpload(CollabVMUser& user) {
-	/*
 	assert(user.upload_info);
 	const std::shared_ptr<UploadInfo>& upload_info = user.upload_info;
-	std::string file_path = kFileUploadPath;
-	file_path += std::to_string(upload_count_ + 1);
 
-	upload_info->file_stream.open(file_path, std::fstream::in | std::fstream::out | std::fstream::trunc | std::fstream::binary);
-	if (upload_info->file_stream.is_open() && upload_info->file_stream.good())
-	{
-		upload_count_++;
-		upload_info->file_path = file_path;
+	// The slot is held until StartNextUpload() is called for the VM
+	upload_count_++;
+	upload_info->vm_controller->upload_count_++;
+
+	// The ID is random enough to be unique, so it doubles as the name of
+	// the file and uploads that are in progress never share one
+	std::string upload_id = GenerateSecretId();
+	std::string file_path = kFileUploadPath + upload_id;
+
+	// An idle agent is held for the upload so that the body can go straight
+	// to it. Other uploads are written to disk until the agent is free.
+	VMController& vm_controller = *upload_info->vm_controller;
+	if(vm_controller.agent_connected_ && !vm_controller.agent_upload_in_progress_) {
+		vm_controller.agent_upload_in_progress_ = true;
+		upload_info->pipe = std::make_shared<UploadPipe>(kUploadPipeSize);
+		vm_controller.GetMemoryAccount().Allocate(MemoryCategory::kUploads, kUploadPipeSize);
+	} else {
+		upload_info->file = AsyncFile::Open(file_path, O_RDWR | O_CREAT | O_TRUNC);
+	}
+
+	if(upload_info->pipe || upload_info->file) {
+		if(!upload_info->pipe)
+			upload_info->file_path = file_path;
 
 		boost::asio::steady_timer* timer = new boost::asio::steady_timer(service_);
-		std::string upload_id = GenerateUuid();
-		unique_lock<std::mutex> lock(upload_lock_);
-		auto result = upload_ids_.insert({ upload_id, upload_info });
-		while (!result.second)
-		{
-			upload_id = GenerateUuid();
-			result = upload_ids_.insert({ upload_id, upload_info });
-		}
-		upload_info->upload_it = result.first;
+		std::unique_lock<std::mutex> lock(upload_lock_);
+		upload_info->upload_it = upload_ids_.insert({ upload_id, upload_info }).first;
 		upload_info->timeout_timer = timer;
 		lock.unlock();
 
@@ -2542,24 +4456,360 @@ void CollabVMServer::StartFileUpload(CollabVMUser& user) {
 		timer->expires_from_now(std::chrono::seconds(kUploadStartTimeout), ec);
 		timer->async_wait(std::bind(&CollabVMServer::OnUploadTimeout, shared_from_this(),
 									std::placeholders::_1, upload_info));
-	}
-	else
-	{
+	} else {
+		// CancelFileUpload() gives up the slot
 		CancelFileUpload(user);
 		SendWSMessage(user, "4.file,1.5;");
 
-		std::cout << "Error: Failed to create file \"" << file_path << "\" for upload." << std::endl;
+		Logger::Error() << "Failed to create file \"" << file_path << "\" for upload.";
 	}
-     */
 }
 
-void CollabVMServer::SendUploadResultToIP(IPData& ip_data, const CollabVMUser& user, const std::string& instr) {
-	for(const std::shared_ptr<CollabVMUser>& connection : connections_)
-		if(&connection->ip_data == &ip_data && connection->vm_controller && connection.get() != &user)
-			SendWSMessage(*connection, instr);
-}
+class CollabVMServer::HttpUploadSink : public websocketmm::http_body_sink {
+   public:
+	HttpUploadSink(std::shared_ptr<CollabVMServer> server, std::shared_ptr<UploadInfo> upload_info, std::chrono::seconds max_time)
+		: server_(std::move(server)),
+		  upload_info_(std::move(upload_info)),
+		  deadline_(std::chrono::steady_clock::now() + max_time),
+		  io_(std::make_shared<IOState>()),
+		  candidate_(upload_info_->pipe ? nullptr : server_->upload_spool_->FindBySize(upload_info_->file_size)) {
+		if(candidate_) {
+			candidate_file_ = AsyncFile::Open(candidate_->path, O_RDONLY);
+			if(!candidate_file_)
+				candidate_.reset();
+		}
+	}
 
-static void AppendCooldownTime(std::string& instr, uint32_t cooldown_time) {
+	~HttpUploadSink() override {
+		compare_buffer_.reset();
+		AccountCompareBuffer();
+	}
+
+	bool write(const char* data, size_t size) override {
+		// Stop reading as soon as the body is larger than the size the user gave
+		received_ += size;
+		if(received_ > upload_info_->file_size || std::chrono::steady_clock::now() > deadline_)
+			return false;
+
+		// The processing thread leaves the file alone while it's being written to
+		State expected = State::kNotWriting;
+		if(!upload_info_->http_state.compare_exchange_strong(expected, State::kWriting))
+			return false;
+
+		server_->upload_bytes_metric_.Add(size);
+		bool written;
+		if(UploadPipe* pipe = upload_info_->pipe.get()) {
+			written = pipe->Write(data, size);
+		} else {
+			hasher_.Update(data, size);
+			if(candidate_ && !MatchesCandidate(data, size))
+				CopyCandidate(received_ - size);
+			if(!candidate_)
+				WriteChunk(received_ - size, data, size);
+			std::lock_guard<std::mutex> lock(io_->lock);
+			written = !io_->failed;
+		}
+
+		expected = State::kWriting;
+		if(!upload_info_->http_state.compare_exchange_strong(expected, State::kNotWriting)) {
+			// The upload was canceled during the write, so it has to be ended by this thread
+			canceled_while_writing_ = true;
+			return false;
+		}
+		return written;
+	}
+
+	bool ready(size_t size, std::function<void()> resume) override {
+		// The client is held back while the agent catches up with the pipe
+		if(upload_info_->pipe)
+			return !upload_info_->pipe->WaitWritable(size, std::move(resume));
+
+		// Or while too much of the body is waiting to be written, and
+		// before finishing until all of it has been
+		{
+			std::lock_guard<std::mutex> lock(io_->lock);
+			if(io_->pending > kMaxPendingBytes || (!size && io_->pending)) {
+				io_->resume = std::move(resume);
+				return false;
+			}
+		}
+
+		// The bytes of the candidate that the next chunk is compared with
+		// are read before the chunk is
+		if(candidate_ && size && !compare_buffer_) {
+			compare_buffer_ = FileIO::Get().AcquireBuffer(size);
+			AccountCompareBuffer();
+			candidate_file_->Read(received_, compare_buffer_, size, [io = io_, resume](int64_t result) {
+				{
+					std::lock_guard<std::mutex> lock(io->lock);
+					io->compare_size = result;
+				}
+				resume();
+			});
+			return false;
+		}
+		return true;
+	}
+
+	std::shared_ptr<websocketmm::http_response> finish() override {
+		auto response = std::make_shared<websocketmm::http_response>();
+		response->result(http::status::ok);
+		response->content_length(0);
+
+		bool failed;
+		{
+			std::lock_guard<std::mutex> lock(io_->lock);
+			failed = io_->failed;
+		}
+
+		if(!End()) {
+			response->result(http::status::gone);
+		} else if(received_ != upload_info_->file_size || failed) {
+			if(upload_info_->pipe)
+				upload_info_->pipe->Fail();
+			server_->PostAction<HttpAction>(ActionType::kHttpUploadFailed, upload_info_);
+			response->result(failed ? http::status::internal_server_error : http::status::bad_request);
+		} else {
+			if(upload_info_->pipe)
+				upload_info_->pipe->Finish();
+			else
+				Spool();
+			server_->PostAction<HttpAction>(ActionType::kHttpUploadFinished, upload_info_);
+		}
+		return response;
+	}
+
+	void fail() override {
+		// Once the agent has started a piped upload, the processing thread
+		// leaves it to the agent, which gives up when the pipe fails
+		if(upload_info_->pipe)
+			upload_info_->pipe->Fail();
+		if(End())
+			server_->PostAction<HttpAction>(ActionType::kHttpUploadFailed, upload_info_);
+	}
+
+   private:
+	using State = UploadInfo::HttpUploadState;
+
+	/**
+	 * The writes that are still in progress, and the bytes of the candidate
+	 * that were read. Shared with the handlers of the requests, which can
+	 * complete after the sink is gone.
+	 */
+	struct IOState {
+		std::mutex lock;
+		size_t pending = 0;
+		bool failed = false;
+		std::function<void()> resume;
+		int64_t compare_size = 0;
+	};
+
+	/**
+	 * Stops the processing thread from canceling the upload.
+	 *
+	 * @return false if the processing thread already ended it.
+	 */
+	bool End() {
+		return canceled_while_writing_ ||
+			   upload_info_->http_state.exchange(State::kCancel) == State::kNotWriting;
+	}
+
+	/**
+	 * Called when a write of some of the pending bytes completes, and
+	 * lets the client send more if it was held back.
+	 */
+	static void Completed(const std::shared_ptr<IOState>& io, size_t size, bool succeeded) {
+		std::function<void()> resume;
+		{
+			std::lock_guard<std::mutex> lock(io->lock);
+			io->pending -= size;
+			io->failed |= !succeeded;
+			resume.swap(io->resume);
+		}
+		if(resume)
+			resume();
+	}
+
+	/**
+	 * Writes a chunk of the body to the upload's file at its offset.
+	 */
+	void WriteChunk(uint64_t offset, const char* data, size_t size) {
+		{
+			std::lock_guard<std::mutex> lock(io_->lock);
+			io_->pending += size;
+		}
+		std::shared_ptr<FileIO::Buffer> buffer = FileIO::Get().AcquireBuffer(size);
+		std::memcpy(buffer->Data(), data, size);
+		upload_info_->file->Write(offset, std::move(buffer), size, [io = io_, size](int64_t result) {
+			Completed(io, size, result >= 0);
+		});
+	}
+
+	/**
+	 * Compares the next chunk of the body with the bytes of the candidate
+	 * that ready() read.
+	 */
+	bool MatchesCandidate(const char* data, size_t size) {
+		int64_t compare_size;
+		{
+			std::lock_guard<std::mutex> lock(io_->lock);
+			compare_size = io_->compare_size;
+		}
+		bool matches = compare_buffer_ && compare_size >= static_cast<int64_t>(size) &&
+					   std::memcmp(compare_buffer_->Data(), data, size) == 0;
+		compare_buffer_.reset();
+		AccountCompareBuffer();
+		return matches;
+	}
+
+	/**
+	 * Stops comparing the body with the candidate, and copies the part of
+	 * it that matched to the upload's file instead. The body after it is
+	 * written at its own offset meanwhile.
+	 *
+	 * @param matched The number of bytes that were the same.
+	 */
+	void CopyCandidate(uint64_t matched) {
+		{
+			std::lock_guard<std::mutex> lock(io_->lock);
+			io_->pending += matched;
+		}
+		CopyRange(io_, candidate_file_, upload_info_->file, 0, matched);
+		candidate_file_.reset();
+		candidate_.reset();
+	}
+
+	/**
+	 * Copies the bytes from offset to end of one file to the other,
+	 * a buffer at a time.
+	 */
+	static void CopyRange(std::shared_ptr<IOState> io, std::shared_ptr<AsyncFile> from, std::shared_ptr<AsyncFile> to,
+						  uint64_t offset, uint64_t end) {
+		if(offset == end)
+			return;
+
+		size_t size = static_cast<size_t>(std::min<uint64_t>(end - offset, FileIO::kBufferSize));
+		std::shared_ptr<FileIO::Buffer> buffer = FileIO::Get().AcquireBuffer(size);
+		from->Read(offset, buffer, size, [=](int64_t result) {
+			if(result != static_cast<int64_t>(size)) {
+				Completed(io, end - offset, false);
+				return;
+			}
+			to->Write(offset, buffer, size, [=](int64_t result) {
+				if(result < 0) {
+					Completed(io, end - offset, false);
+					return;
+				}
+				Completed(io, size, true);
+				CopyRange(io, from, to, offset + size, end);
+			});
+		});
+	}
+
+	/**
+	 * Charges the compare buffer to the VM that the file is uploaded to,
+	 * after it was acquired or released.
+	 */
+	void AccountCompareBuffer() {
+		size_t bytes = compare_buffer_ ? compare_buffer_->Size() : 0;
+		upload_info_->vm_controller->GetMemoryAccount().Resize(MemoryCategory::kUploads, compare_buffer_bytes_, bytes);
+		compare_buffer_bytes_ = bytes;
+	}
+
+	/**
+	 * Moves the completed upload into the spool, or uses the candidate
+	 * if every byte matched it, and opens the spooled file for the agent.
+	 */
+	void Spool() {
+		UploadInfo& info = *upload_info_;
+		info.file.reset();
+		std::shared_ptr<const UploadSpool::File> file;
+		if(candidate_) {
+			candidate_file_.reset();
+			std::remove(info.file_path.c_str());
+			file = std::move(candidate_);
+		} else {
+			file = server_->upload_spool_->Add(info.file_path, received_, hasher_.Finish());
+		}
+
+		// If the file couldn't be moved, the agent is sent the temporary file
+		if(file) {
+			info.file_path.clear();
+			info.spool_file = std::move(file);
+		}
+		info.file = AsyncFile::Open(info.spool_file ? info.spool_file->path : info.file_path, O_RDONLY);
+	}
+
+	/**
+	 * The most bytes of the body that can be waiting to be written
+	 * before the client is held back.
+	 */
+	constexpr static size_t kMaxPendingBytes = 4 * FileIO::kBufferSize;
+
+	const std::shared_ptr<CollabVMServer> server_;
+	const std::shared_ptr<UploadInfo> upload_info_;
+	const std::chrono::steady_clock::time_point deadline_;
+	uint64_t received_ = 0;
+	bool canceled_while_writing_ = false;
+
+	UploadSpool::Hasher hasher_;
+	const std::shared_ptr<IOState> io_;
+
+	/**
+	 * A spooled file with the same size as the upload. Until a byte of the
+	 * body differs from it, nothing is written to the upload's file.
+	 */
+	std::shared_ptr<const UploadSpool::File> candidate_;
+	std::shared_ptr<AsyncFile> candidate_file_;
+	std::shared_ptr<FileIO::Buffer> compare_buffer_;
+
+	/**
+	 * The size of compare_buffer_ that was last charged to the VM.
+	 */
+	size_t compare_buffer_bytes_ = 0;
+};
+
+std::shared_ptr<websocketmm::http_body_sink> CollabVMServer::StartHttpUpload(const std::string& upload_id, uint64_t content_length) {
+	std::shared_ptr<UploadInfo> upload_info;
+	{
+		std::lock_guard<std::mutex> lock(upload_lock_);
+		auto it = upload_ids_.find(upload_id);
+		if(it == upload_ids_.end())
+			return nullptr;
+
+		// Only the first request for an ID can write to the upload
+		UploadInfo::HttpUploadState expected = UploadInfo::HttpUploadState::kNotStarted;
+		if(!it->second->http_state.compare_exchange_strong(expected, UploadInfo::HttpUploadState::kNotWriting))
+			return nullptr;
+
+		upload_info = it->second;
+		upload_ids_.erase(it);
+		upload_info->upload_it = upload_ids_.end();
+	}
+
+	// Abort before reading any of a body that's too large
+	if(content_length > upload_info->file_size) {
+		upload_info->http_state = UploadInfo::HttpUploadState::kCancel;
+		PostAction<HttpAction>(ActionType::kHttpUploadFailed, upload_info);
+		return nullptr;
+	}
+
+	auto sink = std::make_shared<HttpUploadSink>(shared_from_this(), upload_info,
+												 std::chrono::seconds(database_.Configuration.MaxUploadTime));
+
+	// The agent starts reading the pipe while the body is still arriving
+	if(upload_info->pipe)
+		PostAction<HttpAction>(ActionType::kHttpUploadStarted, upload_info);
+	return sink;
+}
+
+void CollabVMServer::SendUploadResultToIP(IPData& ip_data, const CollabVMUser* user, const std::string& instr) {
+	for(const std::shared_ptr<CollabVMUser>& connection : connections_)
+		if(&connection->ip_data == &ip_data && connection->vm_controller && connection.get() != user)
+			SendWSMessage(*connection, instr);
+}
+
+static void AppendCooldownTime(std::string& instr, uint32_t cooldown_time) {
 	std::string temp = std::to_string(cooldown_time * 1000);
 	instr += std::to_string(temp.length());
 	instr += '.';
@@ -2569,111 +4819,133 @@ static void AppendCooldownTime(std::string& instr, uint32_t cooldown_time) {
 
 void CollabVMServer::FileUploadEnded(const std::shared_ptr<UploadInfo>& upload_info,
 									 const std::shared_ptr<CollabVMUser>* user, FileUploadResult result) {
-	/*
-	if (boost::asio::steady_timer* timer = upload_info->timeout_timer)
-	{
+	if(boost::asio::steady_timer* timer = upload_info->timeout_timer) {
 		upload_info->timeout_timer = nullptr;
 		boost::system::error_code ec;
 		timer->cancel(ec);
 		delete timer;
 	}
 
-	VMController& vm_controller = *upload_info->vm_controller;
-	if (user)
-	{
-		upload_info->file_stream.close();
+	upload_info->file.reset();
+	if(!upload_info->file_path.empty())
 		std::remove(upload_info->file_path.c_str());
+	upload_info->spool_file.reset();
+	if(upload_info->pipe)
+		ClosePipe(*upload_info);
 
-		uint32_t cooldown_time = vm_controller.GetSettings().UploadCooldownTime;
-		// The IPData has at least one client associated with it so
-		// locking isn't required
-		SetUploadCooldownTime(upload_info->ip_data, cooldown_time);
+	VMController& vm_controller = *upload_info->vm_controller;
+	uint32_t cooldown_time = vm_controller.GetSettings().UploadCooldownTime;
+	std::string other_instr = cooldown_time ? "4.file,1.4," : "4.file,1.4,1.0;";
+	if(cooldown_time)
+		AppendCooldownTime(other_instr, cooldown_time);
 
+	if(user) {
 		std::string uploader_instr;
-		std::string other_instr;
-		switch (result)
-		{
-		case FileUploadResult::kHttpUploadTimedOut:
-			uploader_instr = "4.file,1.7";
-			goto send_message;
-		case FileUploadResult::kHttpUploadFailed:
-			uploader_instr = "4.file,1.5";
-			goto send_message;
-		case FileUploadResult::kAgentUploadSucceeded:
-			uploader_instr = "4.file,1.2";
-		send_message:
-			if (cooldown_time)
-			{
-				std::string cooldown_str;
-				AppendCooldownTime(cooldown_str, cooldown_time);
-
-				uploader_instr += ',';
-				uploader_instr += cooldown_str;
-
-				other_instr = "4.file,1.4,";
-				other_instr += cooldown_str;
-			}
-			else
-			{
-				uploader_instr += ';';
-				other_instr = "4.file,1.4,1.0;";
-			}
-			SendWSMessage(**user, uploader_instr);
-			break;
+		switch(result) {
+			case FileUploadResult::kHttpUploadTimedOut:
+				uploader_instr = "4.file,1.7";
+				break;
+			case FileUploadResult::kAgentUploadSucceeded:
+				uploader_instr = "4.file,1.2";
+				break;
+			default:
+				uploader_instr = "4.file,1.5";
+				break;
 		}
 
-		if (upload_info->ip_data.connections > 1)
-			SendUploadResultToIP(upload_info->ip_data, *user->get(), other_instr);
-	}
-	else
-	{
-		// The IPData might not have any clients associated with it so
-		// locking is required
-		unique_lock<std::mutex> lock(ip_lock_);
-		uint32_t cooldown_time = vm_controller.GetSettings().UploadCooldownTime;
-		SetUploadCooldownTime(upload_info->ip_data, cooldown_time);
-		if (upload_info->ip_data.connections > 1)
-		{
-			std::string instr = cooldown_time ? "4.file,1.4," : "4.file,1.4,1.0;";
-			if (cooldown_time)
-				AppendCooldownTime(instr, cooldown_time);
-			SendUploadResultToIP(upload_info->ip_data, *user->get(), instr);
+		if(cooldown_time) {
+			uploader_instr += ',';
+			AppendCooldownTime(uploader_instr, cooldown_time);
+		} else {
+			uploader_instr += ';';
 		}
-		lock.unlock();
+		SendWSMessage(**user, uploader_instr);
+
+		if(upload_info->ip_data.connections > 1)
+			SendUploadResultToIP(upload_info->ip_data, user->get(), other_instr);
+
+		// The uploader's connection keeps the IPData from being deleted
+		SetUploadCooldownTime(upload_info->ip_data, cooldown_time);
+	} else {
+		SendUploadResultToIP(upload_info->ip_data, nullptr, other_instr);
+
+		// The IPData might not have any connections left, so its stripe is locked
+		// to keep it from expiring while it's changed. upload_in_progress kept it
+		// alive until now.
+		std::unique_lock<std::mutex> lock = ip_data_.Lock(upload_info->ip_data);
+		SetUploadCooldownTime(upload_info->ip_data, cooldown_time);
 	}
 
-	switch (result)
-	{
-	case FileUploadResult::kHttpUploadTimedOut:
-	case FileUploadResult::kHttpUploadFailed:
-		StartNextUpload();
-		break;
-	case FileUploadResult::kAgentUploadSucceeded:
-		BroadcastUploadedFileInfo(*upload_info, vm_controller);
-		// Fall through
-	case FileUploadResult::kAgentUploadFailed:
-		if (vm_controller.agent_upload_queue_.empty())
-		{
-			vm_controller.agent_upload_in_progress_ = false;
-			StartNextUpload();
-		}
-		else
-		{
-			vm_controller.UploadFile(vm_controller.agent_upload_queue_.front());
-			vm_controller.agent_upload_queue_.pop_front();
-		}
-		break;
+	switch(result) {
+		case FileUploadResult::kAgentUploadSucceeded:
+			BroadcastUploadedFileInfo(*upload_info, vm_controller);
+			// Fall through
+		case FileUploadResult::kAgentUploadFailed:
+			StartNextAgentUpload(vm_controller);
+			break;
+		default:
+			break;
+	}
+
+	StartNextUpload(vm_controller);
+}
+
+void CollabVMServer::StartNextAgentUpload(VMController& vm_controller) {
+	if(vm_controller.agent_upload_queue_.empty()) {
+		vm_controller.agent_upload_in_progress_ = false;
+	} else {
+		vm_controller.UploadFile(vm_controller.agent_upload_queue_.front());
+		vm_controller.agent_upload_queue_.pop_front();
 	}
-     */
 }
 
-void CollabVMServer::StartNextUpload() {
+void CollabVMServer::ClosePipe(UploadInfo& upload_info) {
+	upload_info.pipe->Fail();
+
+	// The ring is only freed with the UploadInfo, which the agent client may still hold
+	VMController& vm_controller = *upload_info.vm_controller;
+	vm_controller.GetMemoryAccount().Free(MemoryCategory::kUploads, upload_info.pipe->Capacity());
+	if(!upload_info.agent_started)
+		StartNextAgentUpload(vm_controller);
+}
+
+bool CollabVMServer::CanStartUpload(const VMController& vm_controller) const {
+	return upload_count_ < kMaxFileUploads && vm_controller.upload_count_ < kMaxVMUploads;
+}
+
+void CollabVMServer::StartNextUpload(VMController& vm_controller) {
+	assert(upload_count_ && vm_controller.upload_count_);
 	upload_count_--;
-	if(!upload_queue_.empty()) {
-		CollabVMUser& user = *upload_queue_.front();
-		upload_queue_.pop_front();
-		user.waiting_for_upload = false;
-		StartFileUpload(user);
+	vm_controller.upload_count_--;
+
+	// Take turns between the VMs with users waiting, so a VM with a long
+	// queue doesn't get every slot that opens up. VMs that already have
+	// kMaxVMUploads uploads are skipped until one of theirs ends.
+	size_t skipped = 0;
+	while(upload_count_ < kMaxFileUploads && skipped < upload_vms_.size()) {
+		std::shared_ptr<VMController> vm = std::move(upload_vms_.front());
+		upload_vms_.pop_front();
+		if(vm->upload_queue_.empty()) {
+			vm->upload_scheduled_ = false;
+			continue;
+		}
+
+		if(!CanStartUpload(*vm)) {
+			upload_vms_.push_back(std::move(vm));
+			skipped++;
+			continue;
+		}
+		skipped = 0;
+
+		std::shared_ptr<CollabVMUser> user = std::move(vm->upload_queue_.front());
+		vm->upload_queue_.pop_front();
+		user->waiting_for_upload = false;
+		if(vm->upload_queue_.empty())
+			vm->upload_scheduled_ = false;
+		else
+			upload_vms_.push_back(std::move(vm));
+
+		StartFileUpload(*user);
 	}
 }
 
@@ -2707,26 +4979,38 @@ void CollabVMServer::CancelFileUpload(CollabVMUser& user) {
 		std::string instr = cooldown_time ? "4.file,1.4," : "4.file,1.4,1.0;";
 		if(cooldown_time)
 			AppendCooldownTime(instr, cooldown_time);
-		SendUploadResultToIP(user.upload_info->ip_data, user, instr);
+		SendUploadResultToIP(user.upload_info->ip_data, &user, instr);
 	}
 
-	// Close the fstream first to allow a new one to be opened if there is a pending upload
-	user.upload_info->file_stream.close();
+	// Close the file first to allow a new one to be opened if there is a pending upload
+	user.upload_info->file.reset();
+	if(!user.upload_info->file_path.empty())
+		std::remove(user.upload_info->file_path.c_str());
+
+	// The kHttpUploadStarted action of a piped upload may still be queued
+	user.upload_info->canceled = true;
+	if(user.upload_info->pipe)
+		ClosePipe(*user.upload_info);
+
+	// The VM the upload was for, which may not be the user's VM anymore
+	std::shared_ptr<VMController> vm_controller = user.upload_info->vm_controller;
 	user.upload_info.reset();
 
 	if(user.waiting_for_upload) {
 		user.waiting_for_upload = false;
-		bool user_found = false;
-		for(auto it = upload_queue_.begin(); it != upload_queue_.end(); it++) {
-			if((*it).get() == &user) {
-				upload_queue_.erase(it);
-				user_found = true;
-				break;
-			}
+		std::deque<std::shared_ptr<CollabVMUser>>& queue = vm_controller->upload_queue_;
+		auto it = std::find_if(queue.begin(), queue.end(),
+							   [&user](const std::shared_ptr<CollabVMUser>& queued) { return queued.get() == &user; });
+		assert(it != queue.end());
+		queue.erase(it);
+
+		// Don't keep the VM alive in the rotation once nobody is waiting for it
+		if(queue.empty() && vm_controller->upload_scheduled_) {
+			vm_controller->upload_scheduled_ = false;
+			upload_vms_.erase(std::find(upload_vms_.begin(), upload_vms_.end(), vm_controller));
 		}
-		assert(user_found);
 	} else {
-		StartNextUpload();
+		StartNextUpload(*vm_controller);
 	}
 }
 
@@ -2776,9 +5060,7 @@ void CollabVMServer::BroadcastUploadedFileInfo(UploadInfo& upload_info, VMContro
 	instr += FILE_SIZE_SUFFIX;
 	instr += ';';
 
-	vm_controller.GetUsersList().ForEachUser([&](CollabVMUser& user) {
-		SendWSMessage(user, instr);
-	});
+	BroadcastWSMessage(vm_controller.GetUsersList(), instr);
 }
 
 void CollabVMServer::OnFileUploadFailed(const std::shared_ptr<VMController>& controller, const std::shared_ptr<UploadInfo>& info) {
@@ -3139,86 +5421,399 @@ bool CollabVMServer::ParseVMSettings(VMSettings& vm, rapidjson::Value& settings,
 							valid = false;
 						}
 						break;
-					case kMOTD:
-						if(value.IsString()) {
-							vm.MOTD = std::string(value.GetString(), value.GetStringLength());
+					case kCPULimit:
+						if(value.IsUint()) {
+							if(value.GetUint() <= kMaxCPULimit) {
+								vm.CPULimit = value.GetUint();
+							} else {
+								WriteJSONObject(writer, vm_settings_[kCPULimit], "CPU limit too large");
+								valid = false;
+							}
 						} else {
-							WriteJSONObject(writer, vm_settings_[kMOTD], invalid_object_);
+							WriteJSONObject(writer, vm_settings_[kCPULimit], invalid_object_);
 							valid = false;
 						}
 						break;
-				}
-				break;
-			}
-		}
-	}
-	if(valid) {
-		// Set the value of the "result" property to true to indicate success
-		writer.Bool(true);
-	}
-	return valid;
-}
-
-std::string CollabVMServer::PerformConfigFunction(const std::string& json) {
-	// Start the JSON response
-	rapidjson::StringBuffer str_buf;
-	rapidjson::Writer<rapidjson::StringBuffer> writer(str_buf);
-	// Start the root object
-	writer.StartObject();
-	writer.String("result");
-	if(json.empty()) {
-		writer.String("Request was empty");
-		writer.EndObject();
-		return std::string(str_buf.GetString(), str_buf.GetSize());
-	}
-	// Copy the data to a writable buffer
-	std::string buf(json);
-
-	// Parse the JSON
-	Document d;
-	d.ParseInsitu(buf.data());
-
-	if(!d.IsObject()) {
-		writer.String("Root value was not an object");
-		writer.EndObject();
-		return std::string(str_buf.GetString(), str_buf.GetSize());
-	}
-
-	for(auto it = d.MemberBegin(); it != d.MemberEnd(); it++) {
-		for(size_t i = 0; i < sizeof(config_functions_) / sizeof(std::string); i++) {
-			std::string key = std::string(it->name.GetString(), it->name.GetStringLength());
-			if(key == config_functions_[i]) {
-				rapidjson::Value& value = it->value;
-				switch(i) {
-					case kSettings:
-						ParseServerSettings(value, writer);
-						break;
-					case kPassword:
-						if(value.IsString()) {
-							database_.Configuration.MasterPassword = std::string(value.GetString(), value.GetStringLength());
-							database_.Save(database_.Configuration);
-							writer.Bool(true);
+					case kCPUWeight:
+						if(value.IsUint()) {
+							if(value.GetUint() <= kMaxCGroupWeight) {
+								vm.CPUWeight = value.GetUint();
+							} else {
+								WriteJSONObject(writer, vm_settings_[kCPUWeight], "CPU weight too large");
+								valid = false;
+							}
 						} else {
-							WriteJSONObject(writer, config_functions_[kPassword], invalid_object_);
+							WriteJSONObject(writer, vm_settings_[kCPUWeight], invalid_object_);
+							valid = false;
 						}
 						break;
-					case kModPassword:
-						if(value.IsString()) {
-							database_.Configuration.ModPassword = std::string(value.GetString(), value.GetStringLength());
-							database_.Save(database_.Configuration);
-							writer.Bool(true);
+					case kMemoryHigh:
+						if(value.IsUint()) {
+							vm.MemoryHigh = value.GetUint();
 						} else {
-							WriteJSONObject(writer, config_functions_[kModPassword], invalid_object_);
+							WriteJSONObject(writer, vm_settings_[kMemoryHigh], invalid_object_);
+							valid = false;
 						}
 						break;
-					case kAddVM: {
-						if(!value.IsObject()) {
-							WriteJSONObject(writer, config_functions_[kAddVM], invalid_object_);
-							break;
+					case kIOWeight:
+						if(value.IsUint()) {
+							if(value.GetUint() <= kMaxCGroupWeight) {
+								vm.IOWeight = value.GetUint();
+							} else {
+								WriteJSONObject(writer, vm_settings_[kIOWeight], "IO weight too large");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, vm_settings_[kIOWeight], invalid_object_);
+							valid = false;
 						}
-						// Get the name of the VM to update
-						auto name_it = value.FindMember("name");
-						if(name_it == value.MemberEnd()) {
+						break;
+					case kIdleCPULimit:
+						if(value.IsUint()) {
+							if(value.GetUint() <= kMaxCPULimit) {
+								vm.IdleCPULimit = value.GetUint();
+							} else {
+								WriteJSONObject(writer, vm_settings_[kIdleCPULimit], "Idle CPU limit too large");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, vm_settings_[kIdleCPULimit], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kIdlePolicy:
+						if(value.IsString()) {
+							std::string policy = std::string(value.GetString(), value.GetStringLength());
+							for(size_t x = 0; x < sizeof(idle_policies_) / sizeof(std::string); x++) {
+								if(policy == idle_policies_[x]) {
+									vm.IdlePolicy = (VMSettings::IdlePolicyEnum)x;
+									goto found_policy;
+								}
+							}
+							WriteJSONObject(writer, vm_settings_[kIdlePolicy], "Unknown idle policy");
+							valid = false;
+						found_policy:
+							break;
+						} else {
+							WriteJSONObject(writer, vm_settings_[kIdlePolicy], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kIdleTimeout:
+						if(value.IsUint()) {
+							if(value.GetUint() <= UINT16_MAX) {
+								vm.IdleTimeout = value.GetUint();
+							} else {
+								WriteJSONObject(writer, vm_settings_[kIdleTimeout], "Idle timeout too large");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, vm_settings_[kIdleTimeout], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kVNCSocketType:
+						if(value.IsString() && value.GetStringLength()) {
+							std::string str(value.GetString(), value.GetStringLength());
+							if(str == "tcp")
+								vm.VNCSocketType = VMSettings::SocketType::kTCP;
+							else if(str == "local")
+								vm.VNCSocketType = VMSettings::SocketType::kLocal;
+							else {
+								WriteJSONObject(writer, vm_settings_[kVNCSocketType], "Invalid socket type");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, vm_settings_[kVNCSocketType], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kAudioEnabled:
+						if(value.IsBool()) {
+							vm.AudioEnabled = value.GetBool();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kAudioEnabled], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kOverlayRegions: {
+						std::vector<guac_common_rect> rects;
+						if(value.IsString() &&
+						   GuacVNCClient::ParseOverlays(std::string(value.GetString(), value.GetStringLength()), rects)) {
+							vm.OverlayRegions = std::string(value.GetString(), value.GetStringLength());
+						} else {
+							WriteJSONObject(writer, vm_settings_[kOverlayRegions], invalid_object_);
+							valid = false;
+						}
+						break;
+					}
+					case kPNGRealtimeLevel:
+						if(value.IsUint() && value.GetUint() <= 9) {
+							vm.PNGRealtimeLevel = value.GetUint();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kPNGRealtimeLevel], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kPNGKeyframeLevel:
+						if(value.IsUint() && value.GetUint() <= 9) {
+							vm.PNGKeyframeLevel = value.GetUint();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kPNGKeyframeLevel], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kPNGPalette:
+						if(value.IsBool()) {
+							vm.PNGPalette = value.GetBool();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kPNGPalette], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kPNGFast:
+						if(value.IsBool()) {
+							vm.PNGFast = value.GetBool();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kPNGFast], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kVMJPEGQuality:
+						if(value.IsUint() && value.GetUint() <= 100) {
+							vm.JPEGQuality = value.GetUint();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kVMJPEGQuality], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kJPEGSubsampling:
+						if(value.IsString()) {
+							std::string subsampling = std::string(value.GetString(), value.GetStringLength());
+							for(size_t x = 0; x < sizeof(jpeg_subsamplings_) / sizeof(std::string); x++) {
+								if(subsampling == jpeg_subsamplings_[x]) {
+									vm.JPEGSubsampling = x;
+									goto found_subsampling;
+								}
+							}
+							WriteJSONObject(writer, vm_settings_[kJPEGSubsampling], "Unknown subsampling");
+							valid = false;
+						found_subsampling:
+							break;
+						} else {
+							WriteJSONObject(writer, vm_settings_[kJPEGSubsampling], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kVideoEnabled:
+						if(value.IsBool()) {
+							vm.VideoEnabled = value.GetBool();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kVideoEnabled], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kLatencyProbe: {
+						GuacVNCLatencyProbe probe;
+						if(value.IsString() &&
+						   GuacVNCClient::ParseLatencyProbe(std::string(value.GetString(), value.GetStringLength()), probe)) {
+							vm.LatencyProbe = std::string(value.GetString(), value.GetStringLength());
+						} else {
+							WriteJSONObject(writer, vm_settings_[kLatencyProbe], invalid_object_);
+							valid = false;
+						}
+						break;
+					}
+					case kAutoStartPriority:
+						if(value.IsUint()) {
+							if(value.GetUint() <= UINT8_MAX) {
+								vm.AutoStartPriority = value.GetUint();
+							} else {
+								WriteJSONObject(writer, vm_settings_[kAutoStartPriority], "Priority too large");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, vm_settings_[kAutoStartPriority], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kBaseImage:
+						if(value.IsString()) {
+							vm.BaseImage = std::string(value.GetString(), value.GetStringLength());
+						} else {
+							WriteJSONObject(writer, vm_settings_[kBaseImage], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kVNCEncodings:
+						if(value.IsString() &&
+						   GuacVNCClient::CheckEncodings(std::string(value.GetString(), value.GetStringLength()))) {
+							vm.VNCEncodings = std::string(value.GetString(), value.GetStringLength());
+						} else {
+							WriteJSONObject(writer, vm_settings_[kVNCEncodings], "Unknown encoding");
+							valid = false;
+						}
+						break;
+					case kVNCCompressLevel:
+						if(value.IsUint() && value.GetUint() <= 9) {
+							vm.VNCCompressLevel = value.GetUint();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kVNCCompressLevel], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kVNCQualityLevel:
+						if(value.IsUint() && value.GetUint() <= 9) {
+							vm.VNCQualityLevel = value.GetUint();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kVNCQualityLevel], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kCPUAffinity: {
+						CPUSet cpus;
+						std::string affinity = value.IsString() ? std::string(value.GetString(), value.GetStringLength()) : "";
+						if(value.IsString() && (affinity.empty() || affinity == "auto" || CPUSet::Parse(affinity, cpus))) {
+							vm.CPUAffinity = affinity;
+						} else {
+							WriteJSONObject(writer, vm_settings_[kCPUAffinity], invalid_object_);
+							valid = false;
+						}
+						break;
+					}
+					case kJoinRate:
+						if(value.IsUint() && value.GetUint() <= UINT16_MAX) {
+							vm.JoinRate = value.GetUint();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kJoinRate], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kQEMUDetached:
+						if(value.IsBool()) {
+							vm.QEMUDetached = value.GetBool();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kQEMUDetached], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kSessionRecording:
+						if(value.IsBool()) {
+							vm.SessionRecording = value.GetBool();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kSessionRecording], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kTargetBitrate:
+						if(value.IsUint()) {
+							vm.TargetBitrate = value.GetUint();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kTargetBitrate], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kEncoderWeight:
+						if(value.IsUint()) {
+							if(value.GetUint() <= kMaxCGroupWeight) {
+								vm.EncoderWeight = value.GetUint();
+							} else {
+								WriteJSONObject(writer, vm_settings_[kEncoderWeight], "Encoder weight too large");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, vm_settings_[kEncoderWeight], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kHLSEnabled:
+						if(value.IsBool()) {
+							vm.HLSEnabled = value.GetBool();
+						} else {
+							WriteJSONObject(writer, vm_settings_[kHLSEnabled], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kMOTD:
+						if(value.IsString()) {
+							vm.MOTD = std::string(value.GetString(), value.GetStringLength());
+						} else {
+							WriteJSONObject(writer, vm_settings_[kMOTD], invalid_object_);
+							valid = false;
+						}
+						break;
+				}
+				break;
+			}
+		}
+	}
+	if(valid) {
+		// Set the value of the "result" property to true to indicate success
+		writer.Bool(true);
+	}
+	return valid;
+}
+
+std::string CollabVMServer::PerformConfigFunction(const std::string& json) {
+	// Start the JSON response
+	rapidjson::StringBuffer str_buf;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(str_buf);
+	// Start the root object
+	writer.StartObject();
+	writer.String("result");
+	if(json.empty()) {
+		writer.String("Request was empty");
+		writer.EndObject();
+		return std::string(str_buf.GetString(), str_buf.GetSize());
+	}
+	// Copy the data to a writable buffer
+	std::string buf(json);
+
+	// Parse the JSON
+	Document d;
+	d.ParseInsitu(buf.data());
+
+	if(!d.IsObject()) {
+		writer.String("Root value was not an object");
+		writer.EndObject();
+		return std::string(str_buf.GetString(), str_buf.GetSize());
+	}
+
+	for(auto it = d.MemberBegin(); it != d.MemberEnd(); it++) {
+		for(size_t i = 0; i < sizeof(config_functions_) / sizeof(std::string); i++) {
+			std::string key = std::string(it->name.GetString(), it->name.GetStringLength());
+			if(key == config_functions_[i]) {
+				rapidjson::Value& value = it->value;
+				switch(i) {
+					case kSettings:
+						ParseServerSettings(value, writer);
+						break;
+					case kPassword:
+						if(value.IsString()) {
+							database_.Configuration.MasterPassword = std::string(value.GetString(), value.GetStringLength());
+							database_.Save(database_.Configuration);
+							writer.Bool(true);
+						} else {
+							WriteJSONObject(writer, config_functions_[kPassword], invalid_object_);
+						}
+						break;
+					case kModPassword:
+						if(value.IsString()) {
+							database_.Configuration.ModPassword = std::string(value.GetString(), value.GetStringLength());
+							database_.Save(database_.Configuration);
+							writer.Bool(true);
+						} else {
+							WriteJSONObject(writer, config_functions_[kModPassword], invalid_object_);
+						}
+						break;
+					case kAddVM: {
+						if(!value.IsObject()) {
+							WriteJSONObject(writer, config_functions_[kAddVM], invalid_object_);
+							break;
+						}
+						// Get the name of the VM to update
+						auto name_it = value.FindMember("name");
+						if(name_it == value.MemberEnd()) {
 							WriteJSONObject(writer, config_functions_[kUpdateVM], "No VM name");
 							break;
 						}
@@ -3282,8 +5877,11 @@ std::string CollabVMServer::PerformConfigFunction(const std::string& json) {
 							vm_it->second = vm;
 
 							auto vm_it = vm_controllers_.find(vm->Name);
-							if(vm_it != vm_controllers_.end())
+							if(vm_it != vm_controllers_.end()) {
+								if(vm->DisplayName != vm_it->second->GetSettings().DisplayName)
+									InvalidateList();
 								vm_it->second->ChangeSettings(vm);
+							}
 
 							WriteServerSettings(writer);
 						}
@@ -3308,6 +5906,7 @@ std::string CollabVMServer::PerformConfigFunction(const std::string& json) {
 							vm_ctrl_it->second->Stop(VMController::StopReason::kRemove);
 						}
 
+						thumbnail_store_.Save(vm_it->first, nullptr);
 						database_.RemoveVM(vm_it->first);
 
 						writer.Bool(true);
@@ -3338,6 +5937,462 @@ std::string CollabVMServer::GetServerSettings() {
 	return std::string(str_buf.GetString(), str_buf.GetSize());
 }
 
+/**
+ * Writes the live and peak bytes of each category of an account
+ * as members of the current object.
+ */
+static void WriteMemoryAccount(rapidjson::Writer<rapidjson::StringBuffer>& writer, const MemoryAccount& account) {
+	for(size_t i = 0; i < MemoryAccount::kCategories; i++) {
+		MemoryCategory category = static_cast<MemoryCategory>(i);
+		writer.String(MemoryAccount::GetName(category));
+		writer.StartObject();
+		writer.String("live");
+		writer.Uint64(account.GetLive(category));
+		writer.String("peak");
+		writer.Uint64(account.GetPeak(category));
+		writer.EndObject();
+	}
+}
+
+std::string CollabVMServer::GetIPBans() {
+	rapidjson::StringBuffer str_buf;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(str_buf);
+	writer.StartArray();
+	int64_t now = std::time(nullptr);
+	for(const auto& [key, ban] : database_.IPBans) {
+		// Bans that ran out are only removed from the database on startup
+		if(ban.Expires && ban.Expires <= now)
+			continue;
+
+		writer.StartObject();
+		writer.String("prefix");
+		writer.String(ban.Prefix.c_str(), ban.Prefix.length());
+		writer.String("type");
+		writer.Uint(ban.Type);
+		writer.String("expires");
+		writer.Int64(ban.Expires);
+		writer.String("reason");
+		writer.String(ban.Reason.c_str(), ban.Reason.length());
+		writer.EndObject();
+	}
+	writer.EndArray();
+	return std::string(str_buf.GetString(), str_buf.GetSize());
+}
+
+std::string CollabVMServer::GetMemoryStats() {
+	rapidjson::StringBuffer str_buf;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(str_buf);
+	writer.StartObject();
+
+	writer.String("server");
+	writer.StartObject();
+	WriteMemoryAccount(writer, MemoryAccounting::Get().GetServerAccount());
+	writer.EndObject();
+
+	writer.String("vms");
+	writer.StartObject();
+	for(auto& vm : vm_controllers_) {
+		writer.String(vm.first.c_str(), vm.first.length());
+		writer.StartObject();
+		WriteMemoryAccount(writer, vm.second->GetMemoryAccount());
+		writer.EndObject();
+	}
+	writer.EndObject();
+
+	writer.String("connections");
+	writer.StartArray();
+	for(const std::shared_ptr<CollabVMUser>& connection : connections_) {
+		std::shared_ptr<websocketmm::websocket_user> handle = connection->handle.lock();
+		if(!handle)
+			continue;
+
+		writer.StartObject();
+		std::string ip = connection->ip_data.GetIP();
+		writer.String("ip");
+		writer.String(ip.c_str(), ip.length());
+		if(connection->username) {
+			writer.String("username");
+			writer.String(connection->username->c_str(), connection->username->length());
+		}
+		if(connection->vm_controller) {
+			const std::string& vm_name = connection->vm_controller->GetSettings().Name;
+			writer.String("vm");
+			writer.String(vm_name.c_str(), vm_name.length());
+		}
+		WriteMemoryAccount(writer, handle->GetMemoryAccount());
+		writer.EndObject();
+	}
+	writer.EndArray();
+
+	writer.EndObject();
+	return std::string(str_buf.GetString(), str_buf.GetSize());
+}
+
+/**
+ * Writes the stats whose values differ from the ones that were last sent,
+ * or all of them when full is true, and remembers the new values as sent.
+ * begin is called before the first stat is written.
+ *
+ * @return Whether any stats were written.
+ */
+template<size_t N, typename F>
+static bool WriteStatsDiff(rapidjson::Writer<rapidjson::StringBuffer>& writer, const char* const (&names)[N], const int64_t (&values)[N], std::array<int64_t, N>& sent, bool full, F begin) {
+	bool written = false;
+	for(size_t i = 0; i < N; i++) {
+		if(!full && values[i] == sent[i])
+			continue;
+
+		if(!written) {
+			begin();
+			written = true;
+		}
+		sent[i] = values[i];
+		writer.String(names[i]);
+		writer.Int64(values[i]);
+	}
+	return written;
+}
+
+std::string CollabVMServer::GetAdminStats(bool full) {
+	static const char* const kServerStats[] = { "connections", "queued" };
+	// Frames per second, bytes per second and percent of one CPU core, then
+	// the guest's vCPU use in percent, disk operations per second and memory in MiB
+	static const char* const kVMStats[] = { "viewers", "fps", "bandwidth", "cpu", "vcpu", "iops", "balloon" };
+
+	auto now = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(now - admin_stats_time_).count();
+	if(!full)
+		admin_stats_time_ = now;
+
+	rapidjson::StringBuffer str_buf;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(str_buf);
+	writer.StartObject();
+
+	int64_t server_values[] = { static_cast<int64_t>(connections_.size()), queued_actions_metric_.Get() };
+	if(full)
+		std::copy(admin_server_stats_.begin(), admin_server_stats_.end(), server_values);
+	bool changed = WriteStatsDiff(writer, kServerStats, server_values, admin_server_stats_, full, [&]() {
+		writer.String("server");
+		writer.StartObject();
+	});
+	if(changed)
+		writer.EndObject();
+
+	bool vms_written = false;
+	for(const auto& [name, controller] : vm_controllers_) {
+		auto it = admin_vm_stats_.find(name);
+		int64_t values[7];
+		if(full) {
+			if(it == admin_vm_stats_.end())
+				continue;
+			std::copy(it->second.sent.begin(), it->second.sent.end(), values);
+		} else {
+			bool added = it == admin_vm_stats_.end();
+			if(added) {
+				it = admin_vm_stats_.emplace(name, AdminVMStats()).first;
+				it->second.sent.fill(-1);
+			}
+			AdminVMStats& stats = it->second;
+			VMMetrics& metrics = controller->GetMetrics();
+			uint64_t frames = metrics.frames.Get();
+			uint64_t sent_bytes = metrics.sent_bytes.Get();
+			std::chrono::microseconds cpu_time = controller->GetCPUTime();
+			uint64_t vcpu_time = metrics.guest_vcpu_time.Get();
+			uint64_t disk_ops = metrics.guest_disk_reads.Get() + metrics.guest_disk_writes.Get();
+
+			// The rates of a VM that was just added are counted from the next tick
+			values[0] = metrics.viewers.Get();
+			values[1] = values[2] = values[3] = values[4] = values[5] = 0;
+			values[6] = metrics.guest_balloon_bytes.Get() >> 20;
+			if(!added && seconds > 0) {
+				values[1] = std::lround((frames - stats.frames) / seconds);
+				values[2] = std::lround((sent_bytes - stats.sent_bytes) / seconds);
+				// The CPU time restarts from zero when the hypervisor does
+				if(cpu_time > stats.cpu_time)
+					values[3] = std::lround((cpu_time - stats.cpu_time).count() / 10000.0 / seconds);
+			}
+			stats.frames = frames;
+			stats.sent_bytes = sent_bytes;
+			stats.cpu_time = cpu_time;
+
+			// The guest's totals are only polled every few seconds, so their
+			// rates are over the time since they last changed, and the last
+			// rates are kept until they change again
+			double guest_seconds = std::chrono::duration<double>(now - stats.guest_time).count();
+			if(vcpu_time != stats.vcpu_time || disk_ops != stats.disk_ops) {
+				if(!added && guest_seconds > 0) {
+					values[4] = std::lround((vcpu_time - stats.vcpu_time) / 10000.0 / guest_seconds);
+					values[5] = std::lround((disk_ops - stats.disk_ops) / guest_seconds);
+				}
+				stats.vcpu_time = vcpu_time;
+				stats.disk_ops = disk_ops;
+				stats.guest_time = now;
+			} else if(!added && guest_seconds < kGuestStatsTimeout) {
+				values[4] = stats.sent[4];
+				values[5] = stats.sent[5];
+			}
+		}
+
+		if(WriteStatsDiff(writer, kVMStats, values, it->second.sent, full, [&]() {
+			   if(!vms_written) {
+				   writer.String("vms");
+				   writer.StartObject();
+				   vms_written = true;
+			   }
+			   writer.String(name.c_str(), name.length());
+			   writer.StartObject();
+		   })) {
+			writer.EndObject();
+		}
+	}
+	if(vms_written) {
+		writer.EndObject();
+		changed = true;
+	}
+
+	// VMs that were deleted are removed from the admins' stats
+	if(!full) {
+		bool removed = false;
+		for(auto it = admin_vm_stats_.begin(); it != admin_vm_stats_.end();) {
+			if(vm_controllers_.count(it->first)) {
+				++it;
+				continue;
+			}
+			if(!removed) {
+				writer.String("removed");
+				writer.StartArray();
+				removed = true;
+			}
+			writer.String(it->first.c_str(), it->first.length());
+			it = admin_vm_stats_.erase(it);
+		}
+		if(removed) {
+			writer.EndArray();
+			changed = true;
+		}
+	}
+
+	writer.EndObject();
+	if(!full && !changed)
+		return std::string();
+	return std::string(str_buf.GetString(), str_buf.GetSize());
+}
+
+void CollabVMServer::SendAdminStats() {
+	std::string resp = GetAdminStats(false);
+	if(resp.empty())
+		return;
+
+	// Every subscriber is sent the same diff, so it's only serialized once
+	std::ostringstream ss("5.admin,2.28,", std::ostringstream::in | std::ostringstream::out | std::ostringstream::ate);
+	ss << resp.length() << '.' << resp << ';';
+	std::shared_ptr<const websocketmm::websocket_message> message = websocketmm::BuildWebsocketMessage(ss.str());
+	for(const auto& subscriber : stats_subscribers_)
+		SendWSMessage(*subscriber, message);
+}
+
+void CollabVMServer::SetDeflateOptions(const Config& config) {
+	boost::beast::websocket::permessage_deflate deflate;
+	deflate.server_enable = config.DeflateEnabled;
+	deflate.compLevel = config.DeflateLevel;
+	deflate.server_max_window_bits = config.DeflateWindowBits;
+	deflate.memLevel = config.DeflateMemLevel;
+	server_->set_deflate_options(deflate);
+}
+
+void CollabVMServer::SetAdmissionLimits(const Config& config) {
+	server_->set_admission_limits(config.MaxTotalConnections, config.MaxPendingConnections, config.AcceptRate);
+	server_->set_receive_limits(config.MessageRate, static_cast<std::size_t>(config.ReceiveRate) * 1024);
+}
+
+void CollabVMServer::SetTLSFiles(const Config& config) {
+#ifdef USE_TLS
+	if(!server_->set_tls_files(config.TLSCertificate, config.TLSKey))
+		Logger::Error() << "Failed to load the TLS certificate \"" << config.TLSCertificate << "\" or key \"" << config.TLSKey << '"';
+#endif
+}
+
+void CollabVMServer::SetLogOptions(const Config& config) {
+	Logger::Get().SetLevel(static_cast<LogLevel>(std::min<uint8_t>(config.LogLevel, static_cast<uint8_t>(LogLevel::kError))));
+	Logger::Get().SetJSON(config.LogJSON);
+}
+
+void CollabVMServer::PublishClusterVMs() {
+	std::vector<ClusterDirectory::VM> vms;
+	vms.reserve(vm_controllers_.size());
+	for(const auto& [name, controller] : vm_controllers_) {
+		// The VM is only published by the server it's migrated to once it's running there
+		VMController::MigrationState migration = controller->GetMigrationState();
+		if(migration == VMController::MigrationState::kIncoming || migration == VMController::MigrationState::kMigrated)
+			continue;
+		const VMSettings& vm_settings = controller->GetSettings();
+		vms.push_back(ClusterDirectory::VM { vm_settings.Name, vm_settings.DisplayName,
+											 controller->GetThumbnail() ? controller->GetThumbnailVersion() : 0 });
+	}
+	cluster_->SetLocalVMs(std::move(vms));
+}
+
+bool CollabVMServer::RedirectToOwner(CollabVMUser& user, const std::string& vm_name) {
+	std::shared_ptr<const ClusterDirectory::Snapshot> cluster = cluster_->GetSnapshot();
+	const ClusterDirectory::Node* owner = cluster->GetOwner(vm_name);
+	if(!owner || owner->url == cluster->self_url)
+		return false;
+
+	std::string instr = "8.redirect,";
+	instr += std::to_string(owner->url.length());
+	instr += '.';
+	instr += owner->url;
+	instr += ',';
+	instr += std::to_string(vm_name.length());
+	instr += '.';
+	instr += vm_name;
+	instr += ';';
+	SendWSMessage(user, instr);
+	return true;
+}
+
+std::future<std::string> CollabVMServer::PostIncomingMigration(const std::string& vm_name) {
+	std::promise<std::string> promise;
+	std::future<std::string> future = promise.get_future();
+	PostAction<IncomingMigrationAction>(vm_name, std::move(promise));
+	return future;
+}
+
+std::string CollabVMServer::StartIncomingMigration(const std::string& vm_name) {
+	rapidjson::StringBuffer str_buf;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(str_buf);
+	writer.StartObject();
+	auto fail = [&](const char* error) {
+		Logger::Error() << "Can't migrate VM \"" << vm_name << "\" here: " << error;
+		writer.String("error");
+		writer.String(error);
+		writer.EndObject();
+		return std::string(str_buf.GetString(), str_buf.GetSize());
+	};
+
+	auto db_it = database_.VirtualMachines.find(vm_name);
+	if(stopping_ || db_it == database_.VirtualMachines.end())
+		return fail("The VM doesn't exist");
+	const VMSettings& vm_settings = *db_it->second;
+	if(vm_controllers_.find(vm_name) != vm_controllers_.end())
+		return fail("The VM is already running");
+	// The source server relays the display from the VNC server here
+	if(vm_settings.VNCSocketType != VMSettings::SocketType::kTCP)
+		return fail("The VM's VNC server doesn't use TCP");
+	if(vm_settings.QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots)
+		return fail("VMs that use HD snapshots can't be migrated");
+
+	// Let the OS pick a free port for QEMU to wait for the VM on
+	boost::system::error_code ec;
+	boost::asio::ip::tcp::acceptor acceptor(service_);
+	acceptor.open(boost::asio::ip::tcp::v4(), ec);
+	if(!ec)
+		acceptor.bind(boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), 0), ec);
+	uint16_t port = ec ? 0 : acceptor.local_endpoint(ec).port();
+	acceptor.close(ec);
+	if(!port)
+		return fail("No port is free");
+
+	std::shared_ptr<VMController> controller = CreateVMController(db_it->second);
+	if(!controller->StartIncoming(port)) {
+		vm_controllers_.erase(vm_name);
+		join_bundles_.erase(vm_name);
+		InvalidateList();
+		return fail("The VM can't be migrated");
+	}
+	Logger::Info() << "Waiting for VM \"" << vm_name << "\" to be migrated to port " << port;
+
+	// A VNC server listening on every address is reached at the address
+	// the other server knows this one by
+	writer.String("port");
+	writer.Uint(port);
+	writer.String("vnc-host");
+	if(vm_settings.VNCAddress == "0.0.0.0" || vm_settings.VNCAddress == "::")
+		writer.String("");
+	else
+		writer.String(vm_settings.VNCAddress.c_str(), vm_settings.VNCAddress.length());
+	writer.String("vnc-port");
+	writer.Uint(vm_settings.VNCPort);
+	writer.EndObject();
+	return std::string(str_buf.GetString(), str_buf.GetSize());
+}
+
+void CollabVMServer::OnMigrationReady(MigrationReadyAction& action) {
+	std::shared_ptr<CollabVMUser> admin = action.user.lock();
+	auto respond = [&](const char* error) {
+		if(error)
+			Logger::Error() << "Failed to migrate VM \"" << action.vm_name << "\": " << error;
+		if(admin)
+			SendAdminResult(*admin, error);
+	};
+
+	if(!action.success)
+		return respond("The server didn't answer");
+
+	rapidjson::Document d;
+	d.Parse(action.body.c_str());
+	if(d.HasParseError() || !d.IsObject())
+		return respond("The server sent an invalid answer");
+
+	auto error = d.FindMember("error");
+	if(error != d.MemberEnd() && error->value.IsString())
+		return respond(error->value.GetString());
+
+	auto port = d.FindMember("port");
+	auto vnc_host = d.FindMember("vnc-host");
+	auto vnc_port = d.FindMember("vnc-port");
+	if(port == d.MemberEnd() || !port->value.IsUint() || port->value.GetUint() > UINT16_MAX ||
+	   vnc_host == d.MemberEnd() || !vnc_host->value.IsString() ||
+	   vnc_port == d.MemberEnd() || !vnc_port->value.IsUint() || vnc_port->value.GetUint() > UINT16_MAX)
+		return respond("The server sent an invalid answer");
+
+	auto it = vm_controllers_.find(action.vm_name);
+	if(it == vm_controllers_.end())
+		return respond("The VM was stopped");
+
+	std::string display_host(vnc_host->value.GetString(), vnc_host->value.GetStringLength());
+	if(display_host.empty())
+		display_host = action.host;
+	if(!it->second->Migrate(action.host, port->value.GetUint(), display_host, vnc_port->value.GetUint()))
+		return respond("The VM isn't running, or is already being migrated");
+	respond(nullptr);
+}
+
+void CollabVMServer::SendAdminResult(CollabVMUser& user, const char* error) {
+	rapidjson::StringBuffer str_buf;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(str_buf);
+	writer.StartObject();
+	writer.String("result");
+	if(error)
+		writer.String(error);
+	else
+		writer.Bool(true);
+	writer.EndObject();
+
+	std::string instr = "5.admin,1.1,";
+	instr += std::to_string(str_buf.GetSize());
+	instr += '.';
+	instr.append(str_buf.GetString(), str_buf.GetSize());
+	instr += ';';
+	SendWSMessage(user, instr);
+}
+
+void CollabVMServer::SetRelayToken(const std::string& token) {
+	std::lock_guard<std::mutex> lock(relay_token_lock_);
+	relay_token_ = token;
+}
+
+bool CollabVMServer::CheckRelayToken(std::string_view token) {
+	std::lock_guard<std::mutex> lock(relay_token_lock_);
+	if(relay_token_.empty() || token.length() != relay_token_.length())
+		return false;
+
+	unsigned char difference = 0;
+	for(size_t i = 0; i < token.length(); i++)
+		difference |= token[i] ^ relay_token_[i];
+	return difference == 0;
+}
+
 void CollabVMServer::WriteServerSettings(rapidjson::Writer<rapidjson::StringBuffer>& writer) {
 	writer.String("settings");
 	writer.StartObject();
@@ -3360,14 +6415,124 @@ void CollabVMServer::WriteServerSettings(rapidjson::Writer<rapidjson::StringBuff
 	writer.String(server_settings_[kBanCommand].c_str());
 	writer.String(database_.Configuration.BanCommand.c_str());
 
-	writer.String(server_settings_[kJPEGQuality].c_str());
-	writer.Uint(database_.Configuration.JPEGQuality);
+	writer.String(server_settings_[kJPEGQuality].c_str());
+	writer.Uint(database_.Configuration.JPEGQuality);
+
+	writer.String(server_settings_[kModEnabled].c_str());
+	writer.Bool(database_.Configuration.ModEnabled);
+
+	writer.String(server_settings_[kModPerms].c_str());
+	writer.Uint(database_.Configuration.ModPerms);
+
+	writer.String(server_settings_[kDeflateEnabled].c_str());
+	writer.Bool(database_.Configuration.DeflateEnabled);
+
+	writer.String(server_settings_[kDeflateLevel].c_str());
+	writer.Uint(database_.Configuration.DeflateLevel);
+
+	writer.String(server_settings_[kDeflateWindowBits].c_str());
+	writer.Uint(database_.Configuration.DeflateWindowBits);
+
+	writer.String(server_settings_[kDeflateMemLevel].c_str());
+	writer.Uint(database_.Configuration.DeflateMemLevel);
+
+	writer.String(server_settings_[kEncoderThreads].c_str());
+	writer.Uint(database_.Configuration.EncoderThreads);
+
+	writer.String(server_settings_[kWebPMode].c_str());
+	writer.Uint(database_.Configuration.WebPMode);
+
+	writer.String(server_settings_[kImageCacheSize].c_str());
+	writer.Uint(database_.Configuration.ImageCacheSize);
+
+	writer.String(server_settings_[kTileDiffing].c_str());
+	writer.Bool(database_.Configuration.TileDiffing);
+
+	writer.String(server_settings_[kSharedFramebuffer].c_str());
+	writer.Bool(database_.Configuration.SharedFramebuffer);
+
+	writer.String(server_settings_[kMouseMoveRate].c_str());
+	writer.Uint(database_.Configuration.MouseMoveRate);
+
+	writer.String(server_settings_[kRefineDelay].c_str());
+	writer.Uint(database_.Configuration.RefineDelay);
+
+	writer.String(server_settings_[kScrollDetection].c_str());
+	writer.Bool(database_.Configuration.ScrollDetection);
+
+	writer.String(server_settings_[kMaxTotalConnections].c_str());
+	writer.Uint(database_.Configuration.MaxTotalConnections);
+
+	writer.String(server_settings_[kMaxPendingConnections].c_str());
+	writer.Uint(database_.Configuration.MaxPendingConnections);
+
+	writer.String(server_settings_[kAcceptRate].c_str());
+	writer.Uint(database_.Configuration.AcceptRate);
+
+	writer.String(server_settings_[kMessageRate].c_str());
+	writer.Uint(database_.Configuration.MessageRate);
+
+	writer.String(server_settings_[kReceiveRate].c_str());
+	writer.Uint(database_.Configuration.ReceiveRate);
+
+	writer.String(server_settings_[kNetworkThreads].c_str());
+	writer.Uint(database_.Configuration.NetworkThreads);
+
+	writer.String(server_settings_[kMetricsToken].c_str());
+	writer.String(database_.Configuration.MetricsToken.c_str());
+
+	writer.String(server_settings_[kRelayToken].c_str());
+	writer.String(database_.Configuration.RelayToken.c_str());
+
+	writer.String(server_settings_[kClusterURL].c_str());
+	writer.String(database_.Configuration.ClusterURL.c_str());
+
+	writer.String(server_settings_[kClusterPeers].c_str());
+	writer.String(database_.Configuration.ClusterPeers.c_str());
+
+	writer.String(server_settings_[kClusterWeight].c_str());
+	writer.Uint(database_.Configuration.ClusterWeight);
+
+	writer.String(server_settings_[kClusterToken].c_str());
+	writer.String(database_.Configuration.ClusterToken.c_str());
+
+	writer.String(server_settings_[kTLSCertificate].c_str());
+	writer.String(database_.Configuration.TLSCertificate.c_str());
+
+	writer.String(server_settings_[kTLSKey].c_str());
+	writer.String(database_.Configuration.TLSKey.c_str());
+
+	writer.String(server_settings_[kLogLevel].c_str());
+	writer.Uint(database_.Configuration.LogLevel);
+
+	writer.String(server_settings_[kLogJSON].c_str());
+	writer.Bool(database_.Configuration.LogJSON);
+
+	writer.String(server_settings_[kAutoStartConcurrency].c_str());
+	writer.Uint(database_.Configuration.AutoStartConcurrency);
+
+	writer.String(server_settings_[kAutoStartMemory].c_str());
+	writer.Uint(database_.Configuration.AutoStartMemory);
 
-	writer.String(server_settings_[kModEnabled].c_str());
-	writer.Bool(database_.Configuration.ModEnabled);
+	writer.String(server_settings_[kEgressIPBudget].c_str());
+	writer.Uint(database_.Configuration.EgressIPBudget);
 
-	writer.String(server_settings_[kModPerms].c_str());
-	writer.Uint(database_.Configuration.ModPerms);
+	writer.String(server_settings_[kEgressHostBudget].c_str());
+	writer.Uint(database_.Configuration.EgressHostBudget);
+
+	// Read-only counters from the listener
+	websocketmm::connection_stats stats = server_->get_connection_stats();
+	writer.String("connection-stats");
+	writer.StartObject();
+	writer.String("accepted");
+	writer.Uint64(stats.accepted);
+	writer.String("rejected");
+	writer.Uint64(stats.rejected);
+	writer.String("handshake-timeouts");
+	writer.Uint64(stats.handshake_timeouts);
+	writer.String("open");
+	writer.Uint64(stats.open);
+	writer.EndObject();
 
 	// "vm" is an array of objects containing the settings for each VM
 	writer.String("vm");
@@ -3507,6 +6672,126 @@ void CollabVMServer::WriteServerSettings(rapidjson::Writer<rapidjson::StringBuff
 					writer.String(vm_settings_[kUploadMaxFilename].c_str());
 					writer.Uint(vm->UploadMaxFilename);
 					break;
+				case kCPULimit:
+					writer.String(vm_settings_[kCPULimit].c_str());
+					writer.Uint(vm->CPULimit);
+					break;
+				case kCPUWeight:
+					writer.String(vm_settings_[kCPUWeight].c_str());
+					writer.Uint(vm->CPUWeight);
+					break;
+				case kMemoryHigh:
+					writer.String(vm_settings_[kMemoryHigh].c_str());
+					writer.Uint(vm->MemoryHigh);
+					break;
+				case kIOWeight:
+					writer.String(vm_settings_[kIOWeight].c_str());
+					writer.Uint(vm->IOWeight);
+					break;
+				case kIdleCPULimit:
+					writer.String(vm_settings_[kIdleCPULimit].c_str());
+					writer.Uint(vm->IdleCPULimit);
+					break;
+				case kIdlePolicy:
+					writer.String(vm_settings_[kIdlePolicy].c_str());
+					writer.String(idle_policies_[static_cast<size_t>(vm->IdlePolicy)].c_str());
+					break;
+				case kIdleTimeout:
+					writer.String(vm_settings_[kIdleTimeout].c_str());
+					writer.Uint(vm->IdleTimeout);
+					break;
+				case kVNCSocketType:
+					writer.String(vm_settings_[kVNCSocketType].c_str());
+					writer.String(vm->VNCSocketType == VMSettings::SocketType::kLocal ? "local" : "tcp");
+					break;
+				case kAudioEnabled:
+					writer.String(vm_settings_[kAudioEnabled].c_str());
+					writer.Bool(vm->AudioEnabled);
+					break;
+				case kOverlayRegions:
+					writer.String(vm_settings_[kOverlayRegions].c_str());
+					writer.String(vm->OverlayRegions.c_str());
+					break;
+				case kPNGRealtimeLevel:
+					writer.String(vm_settings_[kPNGRealtimeLevel].c_str());
+					writer.Uint(vm->PNGRealtimeLevel);
+					break;
+				case kPNGKeyframeLevel:
+					writer.String(vm_settings_[kPNGKeyframeLevel].c_str());
+					writer.Uint(vm->PNGKeyframeLevel);
+					break;
+				case kPNGPalette:
+					writer.String(vm_settings_[kPNGPalette].c_str());
+					writer.Bool(vm->PNGPalette);
+					break;
+				case kPNGFast:
+					writer.String(vm_settings_[kPNGFast].c_str());
+					writer.Bool(vm->PNGFast);
+					break;
+				case kVMJPEGQuality:
+					writer.String(vm_settings_[kVMJPEGQuality].c_str());
+					writer.Uint(vm->JPEGQuality);
+					break;
+				case kJPEGSubsampling:
+					writer.String(vm_settings_[kJPEGSubsampling].c_str());
+					writer.String(jpeg_subsamplings_[static_cast<size_t>(vm->JPEGSubsampling)].c_str());
+					break;
+				case kVideoEnabled:
+					writer.String(vm_settings_[kVideoEnabled].c_str());
+					writer.Bool(vm->VideoEnabled);
+					break;
+				case kLatencyProbe:
+					writer.String(vm_settings_[kLatencyProbe].c_str());
+					writer.String(vm->LatencyProbe.c_str());
+					break;
+				case kAutoStartPriority:
+					writer.String(vm_settings_[kAutoStartPriority].c_str());
+					writer.Uint(vm->AutoStartPriority);
+					break;
+				case kBaseImage:
+					writer.String(vm_settings_[kBaseImage].c_str());
+					writer.String(vm->BaseImage.c_str());
+					break;
+				case kVNCEncodings:
+					writer.String(vm_settings_[kVNCEncodings].c_str());
+					writer.String(vm->VNCEncodings.c_str());
+					break;
+				case kVNCCompressLevel:
+					writer.String(vm_settings_[kVNCCompressLevel].c_str());
+					writer.Uint(vm->VNCCompressLevel);
+					break;
+				case kVNCQualityLevel:
+					writer.String(vm_settings_[kVNCQualityLevel].c_str());
+					writer.Uint(vm->VNCQualityLevel);
+					break;
+				case kCPUAffinity:
+					writer.String(vm_settings_[kCPUAffinity].c_str());
+					writer.String(vm->CPUAffinity.c_str());
+					break;
+				case kJoinRate:
+					writer.String(vm_settings_[kJoinRate].c_str());
+					writer.Uint(vm->JoinRate);
+					break;
+				case kQEMUDetached:
+					writer.String(vm_settings_[kQEMUDetached].c_str());
+					writer.Bool(vm->QEMUDetached);
+					break;
+				case kSessionRecording:
+					writer.String(vm_settings_[kSessionRecording].c_str());
+					writer.Bool(vm->SessionRecording);
+					break;
+				case kTargetBitrate:
+					writer.String(vm_settings_[kTargetBitrate].c_str());
+					writer.Uint(vm->TargetBitrate);
+					break;
+				case kEncoderWeight:
+					writer.String(vm_settings_[kEncoderWeight].c_str());
+					writer.Uint(vm->EncoderWeight);
+					break;
+				case kHLSEnabled:
+					writer.String(vm_settings_[kHLSEnabled].c_str());
+					writer.Bool(vm->HLSEnabled);
+					break;
 				case kMOTD:
 					writer.String(vm_settings_[kMOTD].c_str());
 					writer.String(vm->MOTD.c_str());
@@ -3644,13 +6929,354 @@ void CollabVMServer::ParseServerSettings(rapidjson::Value& settings, rapidjson::
 							config.BlacklistedNames = std::string(value.GetString(), value.GetStringLength());
 
 							// Refresh list of blacklisted usernames
-							blacklisted_usernames_.clear();
 							boost::split(blacklisted_usernames_, database_.Configuration.BlacklistedNames, boost::is_any_of(";"));
 						} else {
 							WriteJSONObject(writer, server_settings_[kBlacklistedUsernames], invalid_object_);
 							valid = false;
 						}
 						break;
+					case kDeflateEnabled:
+						if(value.IsBool()) {
+							config.DeflateEnabled = value.GetBool();
+						} else {
+							WriteJSONObject(writer, server_settings_[kDeflateEnabled], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kDeflateLevel:
+						if(value.IsUint()) {
+							if(value.GetUint() <= 9) {
+								config.DeflateLevel = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kDeflateLevel], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kDeflateLevel], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kDeflateWindowBits:
+						if(value.IsUint()) {
+							// zlib doesn't work with a window size of 8 bits
+							if(value.GetUint() >= 9 && value.GetUint() <= 15) {
+								config.DeflateWindowBits = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kDeflateWindowBits], "Value must be between 9 and 15");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kDeflateWindowBits], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kDeflateMemLevel:
+						if(value.IsUint()) {
+							if(value.GetUint() >= 1 && value.GetUint() <= 9) {
+								config.DeflateMemLevel = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kDeflateMemLevel], "Value must be between 1 and 9");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kDeflateMemLevel], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kEncoderThreads:
+						if(value.IsUint()) {
+							if(value.GetUint() <= kMaxEncoderThreads) {
+								config.EncoderThreads = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kEncoderThreads], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kEncoderThreads], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kWebPMode:
+						if(value.IsUint()) {
+							if(value.GetUint() <= GUAC_WEBP_LOSSY) {
+								config.WebPMode = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kWebPMode], "Value must be between 0 and 2");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kWebPMode], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kImageCacheSize:
+						if(value.IsUint()) {
+							if(value.GetUint() <= kMaxImageCacheSize) {
+								config.ImageCacheSize = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kImageCacheSize], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kImageCacheSize], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kTileDiffing:
+						if(value.IsBool()) {
+							config.TileDiffing = value.GetBool();
+						} else {
+							WriteJSONObject(writer, server_settings_[kTileDiffing], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kSharedFramebuffer:
+						if(value.IsBool()) {
+							config.SharedFramebuffer = value.GetBool();
+						} else {
+							WriteJSONObject(writer, server_settings_[kSharedFramebuffer], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kMouseMoveRate:
+						if(value.IsUint()) {
+							if(value.GetUint() <= kMaxMouseMoveRate) {
+								config.MouseMoveRate = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kMouseMoveRate], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kMouseMoveRate], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kRefineDelay:
+						if(value.IsUint()) {
+							if(value.GetUint() <= kMaxRefineDelay) {
+								config.RefineDelay = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kRefineDelay], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kRefineDelay], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kScrollDetection:
+						if(value.IsBool()) {
+							config.ScrollDetection = value.GetBool();
+						} else {
+							WriteJSONObject(writer, server_settings_[kScrollDetection], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kMaxTotalConnections:
+						if(value.IsUint()) {
+							if(value.GetUint() <= std::numeric_limits<uint16_t>::max()) {
+								config.MaxTotalConnections = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kMaxTotalConnections], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kMaxTotalConnections], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kMaxPendingConnections:
+						if(value.IsUint()) {
+							if(value.GetUint() <= std::numeric_limits<uint8_t>::max()) {
+								config.MaxPendingConnections = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kMaxPendingConnections], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kMaxPendingConnections], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kAcceptRate:
+						if(value.IsUint()) {
+							if(value.GetUint() <= std::numeric_limits<uint16_t>::max()) {
+								config.AcceptRate = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kAcceptRate], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kAcceptRate], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kMessageRate:
+						if(value.IsUint()) {
+							if(value.GetUint() <= std::numeric_limits<uint16_t>::max()) {
+								config.MessageRate = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kMessageRate], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kMessageRate], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kReceiveRate:
+						if(value.IsUint()) {
+							if(value.GetUint() <= std::numeric_limits<uint16_t>::max()) {
+								config.ReceiveRate = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kReceiveRate], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kReceiveRate], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kNetworkThreads:
+						if(value.IsUint()) {
+							if(value.GetUint() <= kMaxNetworkThreads) {
+								config.NetworkThreads = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kNetworkThreads], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kNetworkThreads], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kMetricsToken:
+						if(value.IsString())
+							config.MetricsToken = std::string(value.GetString(), value.GetStringLength());
+						else {
+							WriteJSONObject(writer, server_settings_[kMetricsToken], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kRelayToken:
+						if(value.IsString())
+							config.RelayToken = std::string(value.GetString(), value.GetStringLength());
+						else {
+							WriteJSONObject(writer, server_settings_[kRelayToken], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kClusterURL:
+						if(value.IsString())
+							config.ClusterURL = std::string(value.GetString(), value.GetStringLength());
+						else {
+							WriteJSONObject(writer, server_settings_[kClusterURL], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kClusterPeers:
+						if(value.IsString())
+							config.ClusterPeers = std::string(value.GetString(), value.GetStringLength());
+						else {
+							WriteJSONObject(writer, server_settings_[kClusterPeers], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kClusterWeight:
+						if(value.IsUint()) {
+							if(value.GetUint() <= std::numeric_limits<uint16_t>::max()) {
+								config.ClusterWeight = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kClusterWeight], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kClusterWeight], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kClusterToken:
+						if(value.IsString())
+							config.ClusterToken = std::string(value.GetString(), value.GetStringLength());
+						else {
+							WriteJSONObject(writer, server_settings_[kClusterToken], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kTLSCertificate:
+						if(value.IsString())
+							config.TLSCertificate = std::string(value.GetString(), value.GetStringLength());
+						else {
+							WriteJSONObject(writer, server_settings_[kTLSCertificate], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kTLSKey:
+						if(value.IsString())
+							config.TLSKey = std::string(value.GetString(), value.GetStringLength());
+						else {
+							WriteJSONObject(writer, server_settings_[kTLSKey], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kLogLevel:
+						if(value.IsUint()) {
+							if(value.GetUint() <= static_cast<unsigned>(LogLevel::kError)) {
+								config.LogLevel = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kLogLevel], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kLogLevel], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kLogJSON:
+						if(value.IsBool()) {
+							config.LogJSON = value.GetBool();
+						} else {
+							WriteJSONObject(writer, server_settings_[kLogJSON], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kAutoStartConcurrency:
+						if(value.IsUint()) {
+							if(value.GetUint() <= UINT8_MAX) {
+								config.AutoStartConcurrency = value.GetUint();
+							} else {
+								WriteJSONObject(writer, server_settings_[kAutoStartConcurrency], "Value too big");
+								valid = false;
+							}
+						} else {
+							WriteJSONObject(writer, server_settings_[kAutoStartConcurrency], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kAutoStartMemory:
+						if(value.IsUint()) {
+							config.AutoStartMemory = value.GetUint();
+						} else {
+							WriteJSONObject(writer, server_settings_[kAutoStartMemory], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kEgressIPBudget:
+						if(value.IsUint()) {
+							config.EgressIPBudget = value.GetUint();
+						} else {
+							WriteJSONObject(writer, server_settings_[kEgressIPBudget], invalid_object_);
+							valid = false;
+						}
+						break;
+					case kEgressHostBudget:
+						if(value.IsUint()) {
+							config.EgressHostBudget = value.GetUint();
+						} else {
+							WriteJSONObject(writer, server_settings_[kEgressHostBudget], invalid_object_);
+							valid = false;
+						}
+						break;
 				}
 				break;
 			}
@@ -3659,19 +7285,36 @@ void CollabVMServer::ParseServerSettings(rapidjson::Value& settings, rapidjson::
 
 	// Only save the configuration if all settings valid
 	if(valid) {
-#ifdef USE_JPEG
-		if(config.JPEGQuality <= 100)
-			SetJPEGQuality(config.JPEGQuality);
+		SetJPEGQuality(config.JPEGQuality);
+#ifdef USE_WEBP
+		SetWebPMode(static_cast<guac_webp_mode>(config.WebPMode), config.JPEGQuality);
 #endif
 		database_.Save(config);
+		SetDeflateOptions(config);
+		SetAdmissionLimits(config);
+		SetTLSFiles(config);
+		SetLogOptions(config);
+		EncoderPool::Get().SetThreadCount(config.EncoderThreads);
+		Metrics::Get().SetToken(config.MetricsToken);
+		SetRelayToken(config.RelayToken);
+		cluster_->Configure(config.ClusterURL, config.ClusterPeers, config.ClusterWeight, config.ClusterToken);
+
+		// Cached images may have been encoded with the old quality settings
+		ImageCache::Get().Clear();
+		ImageCache::Get().SetCapacity(static_cast<size_t>(config.ImageCacheSize) * 1024 * 1024);
+		guac_common_surface_set_tile_diffing(config.TileDiffing);
+		guac_common_surface_set_refine_delay(config.RefineDelay);
+		guac_common_surface_set_scroll_detection(config.ScrollDetection);
+		GuacVNCClient::SetShareFramebuffer(config.SharedFramebuffer);
+		GuacVNCClient::SetMouseMoveRate(config.MouseMoveRate);
 
 		// Set the value of the "result" property to true to indicate success
 		writer.Bool(true);
 		// Append the updated settings to the JSON object
 		WriteServerSettings(writer);
 
-		std::cout << "Settings were updated" << std::endl;
+		Logger::Info() << "Settings were updated";
 	} else {
-		std::cout << "Failed to update settings" << std::endl;
+		Logger::Error() << "Failed to update settings";
 	}
 }
@@ -4,11 +4,15 @@
 #include "Database/Database.h"
 
 #include <string>
+#include <string_view>
+#include <cctype>
 #include <cstring>
 #include <memory>
 #include <chrono>
 #include <array>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 #include <atomic>
 #include <queue>
@@ -17,10 +21,14 @@
 #include <deque>
 #include <list>
 #include <random>
+#include <future>
 
 #include <websocketmm/fwd.h>
 
 #include <boost/asio/steady_timer.hpp>
+#ifndef _WIN32
+	#include <boost/asio/local/stream_protocol.hpp>
+#endif
 
 #include <rapidjson/writer.h>
 #include "uriparser/Uri.h"
@@ -30,9 +38,17 @@
 #include "Database/VMSettings.h"
 #include "GuacUser.h"
 #include "CollabVMUser.h"
+#include "ConnectionTable.h"
 #include "UploadInfo.h"
+#include "ThumbnailStore.h"
 
 #include "Chat.h"
+#include "ActionQueue.h"
+#include "IPDataTable.h"
+#include "IPBanTable.h"
+#include "ClusterDirectory.h"
+#include "CommandRunner.h"
+#include "Metrics.h"
 
 #ifdef _WIN32
 	#define strncasecmp _strnicmp
@@ -41,10 +57,11 @@
 	#include "StackTrace.hpp"
 #endif
 
+class ByteBuffer;
 class GuacClient;
 class GuacUser;
 
-class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
+class CollabVMServer : public std::enable_shared_from_this<CollabVMServer>, public GuacMessageSink {
    public:
 	explicit CollabVMServer(boost::asio::io_service& service);
 
@@ -54,8 +71,10 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 * Start the server.
 	 * @param port The WebSocket server port to listen on.
 	 * @param doc_root The path of the directory to expose via HTTP.
+	 * @param listeners The listening sockets of the server this one
+	 *                  replaces, which are accepted on instead of the port.
 	 */
-	void Run(uint16_t port, std::string doc_root);
+	void Run(uint16_t port, std::string doc_root, const std::vector<int>& listeners = {});
 
 	/**
 	 * Stop listening for new clients and disconnect all existing ones.
@@ -71,6 +90,12 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 */
 	void OnVMControllerCleanUp(const std::shared_ptr<VMController>& controller);
 
+	/**
+	 * Called when a VM has finished being migrated to or from this server,
+	 * so the VMs it runs are published to the cluster again.
+	 */
+	void OnVMControllerMigrated(const std::shared_ptr<VMController>& controller);
+
 	void OnVMControllerVoteEnded(const std::shared_ptr<VMController>& controller);
 
 	/**
@@ -79,6 +104,11 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 */
 	void OnVMControllerTurnChange(const std::shared_ptr<VMController>& controller);
 
+	/**
+	 * Called by the VMController when its idle timer expires.
+	 */
+	void OnVMControllerIdle(const std::shared_ptr<VMController>& controller);
+
 	void OnAgentConnect(const std::shared_ptr<VMController>& controller,
 						const std::string& os_name, const std::string& service_pack,
 						const std::string& pc_name, const std::string& username, uint32_t max_filename);
@@ -91,19 +121,21 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	/**
 	 * Updates the preview for the VM.
 	 */
-	void OnVMControllerThumbnailUpdate(const std::shared_ptr<VMController>& controller, std::string* str);
+	void OnVMControllerThumbnailUpdate(const std::shared_ptr<VMController>& controller, const std::shared_ptr<const VMThumbnail>& thumbnail);
 
 	/**
 	 * Sends turn information to all user viewing a VM.
 	 * @param current_user The user who has control of the VM (can be null).
 	 * @param time_remaining The time remaining for the current user's turn.
+	 * @param update The change that was made to the queue, which is sent
+	 *               instead of the whole queue to users that support it.
 	 */
-	void BroadcastTurnInfo(VMController& controller, UserList& users, const std::deque<std::shared_ptr<CollabVMUser>>& turn_queue, CollabVMUser* current_turn, uint32_t time_remaining);
+	void BroadcastTurnInfo(VMController& controller, UserList& users, const TurnQueue& turn_queue, CollabVMUser* current_turn, uint32_t time_remaining, const VMController::TurnUpdate& update);
 
 	/**
 	 * Send turn info to the specified user because they just connected a VM.
 	 */
-	void SendTurnInfo(CollabVMUser& user, uint32_t time_remaining, const std::string& current_turn, const std::deque<std::shared_ptr<CollabVMUser>>& turn_queue);
+	void SendTurnInfo(CollabVMUser& user, uint32_t time_remaining, const std::string& current_turn, const TurnQueue& turn_queue);
 
 	void BroadcastVoteInfo(const VMController& vm, UserList& users, bool vote_started, uint32_t time_remaining, uint32_t yes_votes, uint32_t no_votes);
 
@@ -126,30 +158,68 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 */
 	void SendGuacMessage(std::weak_ptr<websocketmm::websocket_user> ptr, const std::string& str);
 
+	/**
+	 * Sends an already built message from a Guacamole client to a WebSocket connection.
+	 * The same message can be shared between every recipient of a broadcast.
+	 */
+	void SendGuacMessage(std::weak_ptr<websocketmm::websocket_user> ptr, const std::shared_ptr<const websocketmm::websocket_message>& message);
+
+	/**
+	 * Sends a message broadcast by a GuacBroadcastSocket to the user's connection.
+	 */
+	void SendGuacMessage(const CollabVMUser& user, const std::shared_ptr<const websocketmm::websocket_message>& message) override;
+
+	/**
+	 * The io_service that runs the WebSocket server.
+	 */
+	inline boost::asio::io_service& GetService() {
+		return service_;
+	}
+
+	/**
+	 * The directory that the VMs' sessions are recorded to.
+	 */
+	inline const std::string& GetSessionRecordingPath() const {
+		return kSessionRecordingPath;
+	}
+
 	void ExecuteCommandAsync(std::string command);
 	void MuteUser(const std::shared_ptr<CollabVMUser>& user, bool permanent);
 	void UnmuteUser(const std::shared_ptr<CollabVMUser>& user);
 
+	/**
+	 * Stores a ban or mute and applies it to the users that are
+	 * already connected from the prefix. Both are passed on to the
+	 * other servers of the cluster.
+	 */
+	void AddIPBan(const IPBan& ban);
+	void RemoveIPBan(const std::string& prefix, uint8_t type);
+
 	// Shared definition of guacamole instruction garbage
 #define GuacamoleInstruction(name) \
 		void On##name##Instruction(const std::shared_ptr<CollabVMUser>& user, std::vector<char*>& args);
 
-	GuacamoleInstruction(Mouse)
-	GuacamoleInstruction(Key)
-
-
 	GuacamoleInstruction(Rename)
 	GuacamoleInstruction(Connect)
 	GuacamoleInstruction(Admin)
 	GuacamoleInstruction(List)
-	GuacamoleInstruction(Nop)
 	GuacamoleInstruction(Chat)
 	GuacamoleInstruction(Turn)
 	GuacamoleInstruction(Vote)
 	GuacamoleInstruction(File)
+	GuacamoleInstruction(Keyframe)
+	GuacamoleInstruction(Visibility)
+	GuacamoleInstruction(Viewport)
 
 #undef GuacamoleInstruction
 
+	/**
+	 * Input instructions are parsed by GuacInstructionParser without
+	 * marshaling their arguments, since they're sent the most often.
+	 */
+	void OnMouseInstruction(const std::shared_ptr<CollabVMUser>& user, int x, int y, int button_mask);
+	void OnKeyInstruction(const std::shared_ptr<CollabVMUser>& user, int keysym, int pressed);
+
 	/**
 	 * Function pointer to a Guacamole instruction handler.
 	 */
@@ -174,18 +244,30 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 		kRemoveConnection, // Remove connection from map
 		kTurnChange,	   // Next turn
 		kVoteEnded,		   // Vote ended
+		kVMIdle,		   // VM had no viewers for its idle timeout
 		kAgentConnect,	   // Agent connected
 		kAgentDisconnect,  // Agent disconnected
-		//kHttpUploadFinished,
-		//kHttpUploadFailed,
-		//kHttpUploadTimedout,
+		kHttpUploadStarted, // HTTP upload that is piped to the agent began
+		kHttpUploadFinished, // HTTP upload received the whole file
+		kHttpUploadFailed, // HTTP upload was aborted
+		kHttpUploadTimedout, // HTTP upload wasn't started in time
 		kUploadEnded, // Agent upload ended
+		kCommandFinished, // Ban command exited
+		kDatabaseWritten, // Changes were written to the database
 		//kHeartbeatTimedout,	// Heartbeat timed out
 		kKeepAlive,		   // Broadcast keep-alive message
 		kVMStateChange,	   // VM controller state changed
 		kVMCleanUp,		   // Free a VM controller's resources
 		kVMThumbnail,	   // Update a VM's thumbnail
 		kUpdateThumbnails, // Update all VM thumbnails
+		kAdminStats,	   // Send the live stats to the subscribed admins
+		kFlushPresence,	   // Send the presence changes that were held back
+		kAutoStart,		   // Start the next VMs waiting to be auto-started
+		kEgress,		   // Account the bytes sent to each connection
+		kResyncDisplay,	   // Resend the display to a client that dropped updates
+		kVMMigrated,	   // VM was migrated to or from this server
+		kIncomingMigration, // Another server is migrating a VM here
+		kMigrationReady,   // A server is waiting for a VM to be migrated to it
 		//kQEMU,			// kQEMU montior command result received
 		kShutdown // Stop processing thread
 	};
@@ -196,8 +278,30 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	struct Action {
 		ActionType action;
 
+		/**
+		 * The next action in the processing queue.
+		 */
+		Action* next;
+
+		/**
+		 * When the action was created, to measure how long it waited.
+		 */
+		std::chrono::steady_clock::time_point posted;
+
 		explicit Action(ActionType action)
-			: action(action) {
+			: action(action),
+			  next(nullptr),
+			  posted(std::chrono::steady_clock::now()) {
+		}
+
+		// An action is created for every message and event, so their
+		// memory is recycled instead of going through the global allocator
+		static void* operator new(size_t size) {
+			return ActionPool::Allocate(size);
+		}
+
+		static void operator delete(void* ptr, size_t size) {
+			ActionPool::Free(ptr, size);
 		}
 
 		// Define a default virtual destructor, otherwise when deleting we
@@ -250,8 +354,8 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	};
 
 	struct VMThumbnailUpdate : public VMAction {
-		std::string* thumbnail;
-		VMThumbnailUpdate(const std::shared_ptr<VMController>& controller, std::string* thumbnail)
+		std::shared_ptr<const VMThumbnail> thumbnail;
+		VMThumbnailUpdate(const std::shared_ptr<VMController>& controller, const std::shared_ptr<const VMThumbnail>& thumbnail)
 			: VMAction(controller, ActionType::kVMThumbnail),
 			  thumbnail(thumbnail) {
 		}
@@ -285,6 +389,28 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 		std::shared_ptr<UploadInfo> upload_info;
 	};
 
+	struct CommandAction : public Action {
+		CommandAction(const std::string& command, int status)
+			: Action(ActionType::kCommandFinished),
+			  command(command),
+			  status(status) {
+		}
+
+		std::string command;
+		int status;
+	};
+
+	struct DatabaseAction : public Action {
+		DatabaseAction(bool success, const std::string& error)
+			: Action(ActionType::kDatabaseWritten),
+			  success(success),
+			  error(error) {
+		}
+
+		bool success;
+		std::string error;
+	};
+
 	struct AgentConnectAction : public VMAction {
 		std::string os_name;
 		std::string service_pack;
@@ -303,6 +429,42 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 		}
 	};
 
+	/**
+	 * A request from another server in the cluster to start a VM that waits
+	 * for it to be migrated here. The JSON answer is set on the promise.
+	 */
+	struct IncomingMigrationAction : public Action {
+		IncomingMigrationAction(const std::string& vm_name, std::promise<std::string>&& result)
+			: Action(ActionType::kIncomingMigration),
+			  vm_name(vm_name),
+			  result(std::move(result)) {
+		}
+
+		std::string vm_name;
+		std::promise<std::string> result;
+	};
+
+	/**
+	 * The answer from the server that an admin asked to migrate a VM to.
+	 */
+	struct MigrationReadyAction : public Action {
+		MigrationReadyAction(const std::weak_ptr<CollabVMUser>& user, const std::string& vm_name,
+							 bool success, const std::string& host, const std::string& body)
+			: Action(ActionType::kMigrationReady),
+			  user(user),
+			  vm_name(vm_name),
+			  success(success),
+			  host(host),
+			  body(body) {
+		}
+
+		std::weak_ptr<CollabVMUser> user;
+		std::string vm_name;
+		bool success;
+		std::string host;
+		std::string body;
+	};
+
 	/**
 	 * Boilerplate-condensing function to post an action into the processing queue.
 	 * Arguments to this function are constructor arguments.
@@ -312,35 +474,260 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	template<class TAction, class ...Args>
 	inline void PostAction(Args&&... args) {
 		static_assert(std::is_base_of_v<Action, TAction> || std::is_same_v<TAction, Action>, "TAction needs to inherit from or be CollabVMServer::Action!");
-		std::unique_lock<std::mutex> lock(process_queue_lock_);
-
-		process_queue_.push(new TAction(std::forward<Args>(args)...));
-		lock.unlock();
-		process_wait_.notify_one();
+		process_queue_.Push(new TAction(std::forward<Args>(args)...));
+		queued_actions_metric_.Add(1);
 	}
 
+	/**
+	 * The actions of one class waiting to be handled for a single VM, or for
+	 * the server itself. The processing thread takes turns handling one
+	 * action from each lane of a class, so a flood of messages for one VM
+	 * doesn't hold up the timers and state changes of every other VM behind it.
+	 */
+	struct ActionLane {
+		const VMController* vm = nullptr;
+		ActionClass action_class = ActionClass::kChat;
+		Action* head = nullptr;
+		Action* tail = nullptr;
+	};
+
+	constexpr static size_t kActionClasses = static_cast<size_t>(ActionClass::kCount);
+
+	/**
+	 * How many actions of each class are handled in a round while every
+	 * class has actions waiting.
+	 */
+	constexpr static uint8_t kActionClassWeights[kActionClasses] = { 8, 4, 2, 1 };
+
+	/**
+	 * Gets the class that an action is scheduled in.
+	 */
+	static ActionClass GetActionClass(Action& action);
+
+	/**
+	 * Gets the user that an action was posted for, or null if it
+	 * isn't a UserAction.
+	 */
+	static CollabVMUser* GetActionUser(Action& action);
+
+	/**
+	 * Adds an action taken from process_queue_ to the end of its lane.
+	 */
+	void ScheduleAction(Action* action);
+
+	/**
+	 * Removes the action at the front of the next lane in ready_lanes_.
+	 * There must be at least one lane that is ready.
+	 * @param action_class Set to the class of the lane.
+	 */
+	Action* NextAction(ActionClass& action_class);
+
+	bool HasReadyLanes() const;
+
 	struct case_insensitive_cmp {
 		bool operator()(const std::string& str1, const std::string& str2) const {
 			return strcasecmp(str1.c_str(), str2.c_str()) < 0;
 		}
 	};
 
+	/**
+	 * Hashes the lowercase form of a string without copying it,
+	 * so names that only differ in case land in the same bucket.
+	 */
+	struct case_insensitive_hash {
+		size_t operator()(const std::string& str) const {
+			// FNV-1a
+			uint64_t hash = 0xcbf29ce484222325ULL;
+			for(char c : str) {
+				hash ^= static_cast<uint8_t>(std::tolower(static_cast<unsigned char>(c)));
+				hash *= 0x100000001b3ULL;
+			}
+			return static_cast<size_t>(hash);
+		}
+	};
+
+	struct case_insensitive_equal {
+		bool operator()(const std::string& str1, const std::string& str2) const {
+			return str1.length() == str2.length() && strcasecmp(str1.c_str(), str2.c_str()) == 0;
+		}
+	};
+
 	//bool ValidateSessionId(const std::string& cookies);
 
 	bool OnValidate(std::weak_ptr<websocketmm::websocket_user> handle);
 	void OnOpen(std::weak_ptr<websocketmm::websocket_user> handle);
 	void OnClose(std::weak_ptr<websocketmm::websocket_user> handle);
+	void OnResync(std::weak_ptr<websocketmm::websocket_user> handle);
+
+	/**
+	 * Changes the thumbnail served over HTTP for a VM, or stops
+	 * serving it when thumbnail is null.
+	 */
+	void PublishThumbnail(const std::string& vm_name, const std::shared_ptr<const VMThumbnail>& thumbnail, uint64_t version);
+
+	/**
+	 * Sends the new version of a VM's thumbnail to the list subscribers.
+	 */
+	void PushThumbnail(const std::string& vm_name, uint64_t version);
+
+	/**
+	 * A VM in the list, here or elsewhere in the cluster.
+	 */
+	struct ListEntry {
+		std::string name;
+		std::string display_name;
+		std::string thumbnail_url;
+		uint64_t thumbnail_version = 0; // 0 when the VM doesn't have a thumbnail
+		VMController::ControllerState state;
+	};
+
+	/**
+	 * Rebuilds list_index_ and list_message_ from the VMs and the cluster directory.
+	 */
+	void BuildList();
+
+	/**
+	 * Appends the arguments of a VM to a list instruction. Without the
+	 * thumbnail, its URL and version are sent as if it had none.
+	 */
+	static void AppendListEntry(ByteBuffer& instr, const ListEntry& entry, bool thumbnail);
+
+	/**
+	 * Discards the cached list instruction so it's rebuilt for the next
+	 * user that requests it. Must be called when a VM is added or removed,
+	 * or when anything the list contains changes.
+	 */
+	inline void InvalidateList() {
+		list_message_.reset();
+		PublishClusterVMs();
+	}
+
+	/**
+	 * Tells the cluster directory which VMs are running on this server.
+	 */
+	void PublishClusterVMs();
+
+	/**
+	 * Stores the bans and mutes that other servers of the cluster changed
+	 * since the last call, and applies them to the users that are connected.
+	 */
+	void ApplyClusterSanctions();
+
+	/**
+	 * Disconnects the users whose address is banned, and mutes or unmutes
+	 * them to match the mutes if update_mutes is set.
+	 */
+	void EnforceIPBans(bool update_mutes);
+
+	/**
+	 * Counts an event of a rate limit for the IP toward the cluster's
+	 * counters.
+	 *
+	 * @param window The length of the rate limit in seconds.
+	 * @return The number of events the other servers of the cluster
+	 *         counted for the IP in the current window.
+	 */
+	uint32_t CountClusterEvent(const IPData& ip_data, ClusterSanctions::Counter counter, uint32_t window);
+
+	/**
+	 * Sends the user to the server in the cluster that a VM is given to.
+	 * Returns false if the VM is given to this server, or to none.
+	 */
+	bool RedirectToOwner(CollabVMUser& user, const std::string& vm_name);
+
+	/**
+	 * Asks the processing thread to start a VM that another server is
+	 * migrating here. Called from the network threads.
+	 */
+	std::future<std::string> PostIncomingMigration(const std::string& vm_name);
+
+	/**
+	 * Starts a VM that waits for another server to migrate it here, and
+	 * creates the JSON with the ports it's migrated to and its display
+	 * is served from, or with the reason it couldn't be started.
+	 */
+	std::string StartIncomingMigration(const std::string& vm_name);
+
+	/**
+	 * Migrates a VM to the server that answered an admin's request.
+	 */
+	void OnMigrationReady(MigrationReadyAction& action);
+
+	/**
+	 * Sends the result of an admin command, which is shown as an
+	 * error unless error is null.
+	 */
+	void SendAdminResult(CollabVMUser& user, const char* error);
 
 	void TimerCallback(const boost::system::error_code& ec, ActionType action);
 	void VMPreviewTimerCallback(const boost::system::error_code ec);
 	void IPDataTimerCallback(const boost::system::error_code& ec);
 
+	/**
+	 * Schedules a call to IPDataTimerCallback().
+	 */
+	void StartIPDataTimer();
+
+	/**
+	 * Starts the VMs waiting to be auto-started, as long as fewer than
+	 * AutoStartConcurrency of the VMs that were started haven't sent their
+	 * first frame yet, and the host has at least AutoStartMemory free.
+	 * Schedules another call until every VM has been started and is ready.
+	 */
+	void StartQueuedVMs();
+
+	/**
+	 * Adds the bytes sent to a connection since it was last accounted to
+	 * its IP, its VM and the host.
+	 * @return The bytes that were added.
+	 */
+	uint64_t AccountEgress(CollabVMUser& user);
+
+	/**
+	 * Accounts the bytes sent to every connection, and moves the IPs that
+	 * are over their budget, or sent the most while the host is over its
+	 * budget, to the reduced quality tier. Schedules the next call while
+	 * there are connections.
+	 */
+	void UpdateEgress();
+
+	/**
+	 * Sends the user reduced quality images for a while, because their
+	 * connection fell behind or they're over a bandwidth budget. A relay's
+	 * display connection is left alone, as its viewers would all suffer.
+	 */
+	void ReduceQuality(CollabVMUser& user);
+
+	/**
+	 * Listens at kUpgradeSocketPath for a new build of the server that
+	 * takes over the listening sockets.
+	 */
+	void ListenForUpgrade();
+
+	/**
+	 * Hands the listening sockets over to the new build, and stops
+	 * accepting connections once it says it's accepting them.
+	 */
+	void AcceptUpgrade();
+	void OnUpgradeConnection(const boost::system::error_code& ec);
+
 	/**
 	 * Determines whether an IPData object should be deleted.
 	 */
 	bool ShouldCleanUpIPData(IPData& ip_data) const;
 
-	void RemoveConnection(std::shared_ptr<CollabVMUser>& user);
+	/**
+	 * Removes connections that were closed, in one pass for each VM. When a
+	 * network drops thousands of viewers at once, their removals are posted
+	 * one after another, and are collected in pending_removals_ until an
+	 * action of another kind comes up or the processing thread would wait.
+	 */
+	void RemoveConnections(std::vector<std::shared_ptr<CollabVMUser>>& users);
+
+	/**
+	 * Applies the removals collected in pending_removals_.
+	 */
+	void RemovePendingConnections();
 
 	void UpdateVMStatus(const std::string& vm_name, VMController::ControllerState state);
 
@@ -350,23 +737,91 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 */
 	void OnQEMUResponse(std::weak_ptr<CollabVMUser> data, rapidjson::Document& d);
 
-	//std::string GenerateUuid();
+	/**
+	 * Generate a random ID from the system's random source, for IDs that
+	 * give whoever has them access, like the URL a user's upload is POSTed
+	 * to and session tokens.
+	 */
+	static std::string GenerateSecretId();
+
+	/**
+	 * Gives the user a new session token and sends it to them, so they can
+	 * resume the session if their connection is lost.
+	 */
+	void IssueSessionToken(CollabVMUser& user);
+
+	/**
+	 * Keeps the session of a user that disconnected from a VM for
+	 * kSessionGracePeriod, with its username reserved.
+	 *
+	 * @param turn_position The user's place in the turn queue, from
+	 *                      VMController::GetTurnPosition().
+	 */
+	void SuspendSession(CollabVMUser& user, size_t turn_position);
+
+	/**
+	 * Gives a user the username of the session they're resuming, and
+	 * sends them a new token for it.
+	 *
+	 * @param arg The connect argument after "resume:", the session token
+	 *            and the timestamp of the last frame the client applied,
+	 *            separated by a colon.
+	 * @param turn_position Receives the user's place in the turn queue
+	 *                      when they disconnected.
+	 * @param timestamp Receives the timestamp of the last frame the client
+	 *                  applied, or zero if it's invalid.
+	 * @return Whether the session was resumed.
+	 */
+	bool ResumeSession(const std::shared_ptr<CollabVMUser>& user, const std::string& vm_name, const char* arg,
+					   size_t& turn_position, guac_timestamp& timestamp);
+
+	/**
+	 * Forgets the sessions whose grace period is over.
+	 */
+	void ExpireSessions();
+
+	/**
+	 * Whether a user has the username or it's reserved for a session that
+	 * may be resumed.
+	 */
+	bool IsUsernameTaken(const std::string& username);
+
+	/**
+	 * Joins a connection that was opened on the spectator path to the VM
+	 * it named, without a username, when it's added.
+	 */
+	void AddSpectator(const std::shared_ptr<CollabVMUser>& user);
 
 	void OnMessageFromWS(std::weak_ptr<websocketmm::websocket_user> handle, std::shared_ptr<const websocketmm::websocket_message> msg);
 	void SendWSMessage(CollabVMUser& user, const std::string& str);
+	void SendWSMessage(CollabVMUser& user, const std::shared_ptr<const websocketmm::websocket_message>& message);
+
+	/**
+	 * Sends an instruction to every user in a list, or to every connection,
+	 * sharing one websocket message between all of them instead of building
+	 * a copy for each user.
+	 * @param priority Whether the message may overtake display updates,
+	 *                 for chat, turns and votes.
+	 */
+	void BroadcastWSMessage(UserList& users, const std::string& str, bool priority = false);
+	void BroadcastWSMessage(const std::string& str);
 
 	/**
 	 * The main loop for the processing thread.
 	 */
 	void ProcessingThread();
 
-	void AppendChatMessage(std::ostringstream& ss, ChatMessage* chat_msg);
-
 	/**
 	 * Sends the remembered chat history to the specified user.
 	 */
 	void SendChatHistory(CollabVMUser& user);
 
+	/**
+	 * Gets the chat instruction with the chat history, which is built
+	 * again after a message has been added, or null if it's empty.
+	 */
+	const std::shared_ptr<const websocketmm::websocket_message>& GetChatHistoryMessage();
+
 	/**
 	 * Checks whether or not a username is valid.
 	 * For the username to be valid it must contain only numbers, letters,
@@ -402,6 +857,41 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 */
 	void SendOnlineUsersList(CollabVMUser& user);
 
+	/**
+	 * Gets the adduser instruction with every online user, which is built
+	 * again after the list has changed.
+	 */
+	const std::shared_ptr<const websocketmm::websocket_message>& GetOnlineUsersMessage();
+
+	/**
+	 * Queues an adduser, remuser or rename instruction for the users viewing
+	 * a VM. A change in a quiet room is sent right away, and the changes
+	 * after it are held back and sent together once the interval has passed.
+	 */
+	void QueuePresence(const std::string& instr);
+
+	/**
+	 * Sends the presence changes that were held back. Called before anything
+	 * that may mention a user is sent, so their order is kept.
+	 */
+	void FlushPresence();
+
+	/**
+	 * Gets the instructions that a user who joins the VM is sent before its
+	 * display, as a single message: the connect response with the VM's
+	 * actions, the online users, the chat history and the MOTD.
+	 */
+	std::shared_ptr<const websocketmm::websocket_message> GetJoinBundle(const VMController& controller);
+
+	/**
+	 * Keep online_users_ in sync with usernames_. UpdateOnlineUser() must
+	 * be called after a user's rank changes.
+	 */
+	void AddOnlineUser(const CollabVMUser& user);
+	void RemoveOnlineUser(const std::string& username);
+	void RemoveOnlineUsers(const std::vector<std::string>& usernames);
+	void UpdateOnlineUser(const CollabVMUser& user);
+
 	/**
 	 * Sends an action instruction to all users currently connected to the VMController.
 	 */
@@ -413,7 +903,22 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 
 	void OnUploadTimeout(const boost::system::error_code ec, std::shared_ptr<UploadInfo> upload_info);
 	void StartFileUpload(CollabVMUser& user);
-	void SendUploadResultToIP(IPData& ip_data, const CollabVMUser& user, const std::string& instr);
+
+	/**
+	 * Called from a network thread with the target of a POST request to
+	 * the upload path. Claims the upload the ID belongs to, so the request
+	 * body can be streamed to its file.
+	 *
+	 * @return The sink for the request body, or null if the ID isn't
+	 *         an upload that's waiting to start.
+	 */
+	std::shared_ptr<websocketmm::http_body_sink> StartHttpUpload(const std::string& upload_id, uint64_t content_length);
+
+	/**
+	 * Sends an instruction to the users on the same IP as an uploader,
+	 * other than the uploader, which may be null if they disconnected.
+	 */
+	void SendUploadResultToIP(IPData& ip_data, const CollabVMUser* user, const std::string& instr);
 
 	enum class FileUploadResult {
 		kUserDisconnected,
@@ -429,7 +934,28 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 */
 	void FileUploadEnded(const std::shared_ptr<UploadInfo>& upload_info, const std::shared_ptr<CollabVMUser>* user, FileUploadResult result);
 
-	void StartNextUpload();
+	/**
+	 * Sends the next upload waiting for the VM's agent to it, or marks the agent as idle.
+	 */
+	void StartNextAgentUpload(VMController& vm_controller);
+
+	/**
+	 * Stops both sides of an upload's pipe and frees it. The agent that was
+	 * held for the upload is given to the next one if it never started it.
+	 */
+	void ClosePipe(UploadInfo& upload_info);
+
+	/**
+	 * Whether another upload for the VM can hold a slot, without going
+	 * over kMaxFileUploads or kMaxVMUploads.
+	 */
+	bool CanStartUpload(const VMController& vm_controller) const;
+
+	/**
+	 * Gives up the upload slot held for the VM, and starts the uploads
+	 * of the users waiting for one.
+	 */
+	void StartNextUpload(VMController& vm_controller);
 
 	void CancelFileUpload(CollabVMUser& user);
 
@@ -437,6 +963,12 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 
 	bool SendUploadCooldownTime(CollabVMUser& user, const VMController& vm_controller);
 
+	/**
+	 * Updates whether the user is sent the display after one of the reasons
+	 * it's hidden changed, and sends it again once it's shown.
+	 */
+	void UpdateDisplayHidden(CollabVMUser& user);
+
 	void BroadcastUploadedFileInfo(UploadInfo& upload_info, VMController& vm_controller);
 
 	/**
@@ -460,12 +992,72 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 */
 	std::string GetServerSettings();
 
+	/**
+	 * Create a JSON string containing the live and peak bytes of memory
+	 * used by the server, each VM and each connection.
+	 */
+	std::string GetMemoryStats();
+
+	/**
+	 * Create a JSON string containing the bans and mutes that
+	 * haven't run out.
+	 */
+	std::string GetIPBans();
+
+	/**
+	 * Create a JSON string containing the live stats of the server and each
+	 * VM that changed since they were last sent to the subscribed admins,
+	 * or an empty string if none did. When full is true, every stat as it
+	 * was last sent is included instead, for an admin that just subscribed.
+	 */
+	std::string GetAdminStats(bool full);
+
+	/**
+	 * Send the stats that changed to the subscribed admins, as a single
+	 * message shared by all of them.
+	 */
+	void SendAdminStats();
+
 	/**
 	 * Append the server's current settings and each VM's settings
 	 * and to the JSON object.
 	 */
 	void WriteServerSettings(rapidjson::Writer<rapidjson::StringBuffer>& writer);
 
+	/**
+	 * Update the permessage-deflate options offered to new WebSocket connections.
+	 */
+	void SetDeflateOptions(const Config& config);
+
+	/**
+	 * Applies the connection admission limits and the rates that
+	 * connections can send messages at to the websocketmm server.
+	 */
+	void SetAdmissionLimits(const Config& config);
+
+	/**
+	 * Tells the websocketmm server which certificate to serve connections
+	 * over TLS with. Does nothing when the server was built without TLS.
+	 */
+	void SetTLSFiles(const Config& config);
+
+	/**
+	 * Applies the log level and format from the config to the logger.
+	 */
+	void SetLogOptions(const Config& config);
+
+	/**
+	 * Changes the token that relays have to send, which is checked
+	 * from the network threads.
+	 */
+	void SetRelayToken(const std::string& token);
+
+	/**
+	 * Whether a relay sent the relay token, comparing every byte
+	 * so the time taken doesn't reveal it.
+	 */
+	bool CheckRelayToken(std::string_view token);
+
 	/**
 	 * Parse server settings and update the database config.
 	 */
@@ -475,12 +1067,6 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 
 	std::shared_ptr<VMController> CreateVMController(const std::shared_ptr<VMSettings>& vm);
 
-	bool FindIPv4Data(const boost::asio::ip::address_v4& addr, IPData*& ip_data);
-	bool FindIPData(const boost::asio::ip::address& addr, IPData*& ip_data);
-	IPData* CreateIPv4Data(const boost::asio::ip::address_v4& addr, bool one_connection);
-	IPData* CreateIPData(const boost::asio::ip::address& addr, bool one_connection);
-	void DeleteIPData(IPData& ip_data);
-
 	boost::asio::io_service& service_;
 	std::shared_ptr<Server> server_;
 
@@ -495,38 +1081,120 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 * the processing thread. If the map needs to be accessed from another
 	 * thread then it must acquire the _connectionsLock mutex first.
 	 */
-	std::set<std::shared_ptr<CollabVMUser>, std::owner_less<std::shared_ptr<CollabVMUser>>> connections_;
+	ConnectionTable<&CollabVMUser::connection_index> connections_;
+
+	/**
+	 * Closed connections waiting for RemoveConnections().
+	 */
+	std::vector<std::shared_ptr<CollabVMUser>> pending_removals_;
 
 	/**
 	 * Maps usernames to CollabVMUser objects.
 	 * Modifying and accessing this map should treated the same as
 	 * as _connections map above.
 	 */
-	std::map<std::string, std::shared_ptr<CollabVMUser>, case_insensitive_cmp> usernames_;
+	std::unordered_map<std::string, std::shared_ptr<CollabVMUser>, case_insensitive_hash, case_insensitive_equal> usernames_;
+
+	/**
+	 * The username and rank of every user in usernames_, serialized as the
+	 * arguments of an adduser instruction. It's updated as users join,
+	 * leave, rename and change rank, instead of being rebuilt from
+	 * usernames_ for every user that joins a VM.
+	 */
+	std::string online_users_;
+
+	/**
+	 * The adduser instruction for online_users_. It's reset whenever the list
+	 * changes and built again by the next call to SendOnlineUsersList().
+	 */
+	std::shared_ptr<const websocketmm::websocket_message> online_users_message_;
+
+	/**
+	 * The presence instructions waiting to be sent, and when they were last sent.
+	 */
+	std::string presence_delta_;
+	std::chrono::steady_clock::time_point presence_flushed_;
+	bool presence_timer_running_;
 
 	/**
-	 * List of usernames that should not be allowed
+	 * Usernames that should not be allowed
 	 */
-	std::vector<std::string> blacklisted_usernames_;
+	std::unordered_set<std::string> blacklisted_usernames_;
 
-	std::set<std::shared_ptr<CollabVMUser>, std::owner_less<std::shared_ptr<CollabVMUser>>> admin_connections_;
+	ConnectionTable<&CollabVMUser::admin_index> admin_connections_;
 
-	std::map<uint32_t, IPData*> ipv4_data_;
-	std::map<std::array<uint8_t, 16>, IPData*> ipv6_data_;
-	std::mutex ip_lock_;
+	/**
+	 * Admin connections that are pushed the live stats that changed each second.
+	 */
+	ConnectionTable<&CollabVMUser::stats_index> stats_subscribers_;
+
+	/**
+	 * Users on the VM list that are pushed each VM's thumbnail when it changes.
+	 */
+	ConnectionTable<&CollabVMUser::list_index> list_subscribers_;
+
+	/**
+	 * The live stats of a VM as they were last sent to the subscribers,
+	 * and the counters their rates were computed from. A stat that
+	 * hasn't been sent yet is -1.
+	 */
+	struct AdminVMStats {
+		uint64_t frames = 0;
+		uint64_t sent_bytes = 0;
+		std::chrono::microseconds cpu_time = std::chrono::microseconds::zero();
+		uint64_t vcpu_time = 0;
+		uint64_t disk_ops = 0;
+		std::chrono::steady_clock::time_point guest_time;
+		std::array<int64_t, 7> sent;
+	};
+	std::map<std::string, AdminVMStats> admin_vm_stats_;
+	std::array<int64_t, 2> admin_server_stats_;
+	std::chrono::steady_clock::time_point admin_stats_time_;
+
+	IPDataTable ip_data_;
+
+	/**
+	 * The bans and mutes stored in the database, which are checked
+	 * before a connection is accepted.
+	 */
+	IPBanTable ip_bans_;
 
 	/**
 	 * A queue containing actions for the processing thread to perform.
 	 */
-	std::queue<Action*> process_queue_;
-	std::mutex process_queue_lock_;
-	std::condition_variable process_wait_;
+	ActionQueue<Action> process_queue_;
+
+	/**
+	 * The lanes that have actions waiting in them, mapped by VM and class.
+	 * Actions that aren't for a VM go in the lanes of a null VM. Lanes are
+	 * removed once they're empty. Only used by the processing thread.
+	 */
+	std::map<std::pair<const VMController*, ActionClass>, ActionLane> action_lanes_;
+
+	/**
+	 * The lanes of each class that have actions waiting, in the order
+	 * they'll be visited, and how many more actions of each class can be
+	 * handled before the round is over.
+	 */
+	std::deque<ActionLane*> ready_lanes_[kActionClasses];
+	uint8_t action_credits_[kActionClasses] = {};
 
 	/**
 	 * A timer that sends keep-alive instructions to all the websocket clients.
 	 */
 	boost::asio::steady_timer keep_alive_timer_;
 
+	/**
+	 * Accounts the bytes sent to the connections and enforces the budgets.
+	 */
+	boost::asio::steady_timer egress_timer_;
+
+	/**
+	 * How often the bytes sent to the connections are accounted, which is
+	 * the window the budgets are measured over. Measured in seconds.
+	 */
+	const uint8_t kEgressInterval = 1;
+
 	/**
 	 * Refreshes the thumbnails displayed for each running VM.
 	 */
@@ -542,7 +1210,81 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 */
 	boost::asio::steady_timer ip_data_timer;
 
-	bool ip_data_timer_running_;
+	/**
+	 * Sends the live stats to the subscribed admins, while there are any.
+	 */
+	boost::asio::steady_timer admin_stats_timer_;
+
+	/**
+	 * Stops the profiler and sends its samples to the admin that started it.
+	 */
+	boost::asio::steady_timer profile_timer_;
+
+	/**
+	 * Sends the presence changes that were held back.
+	 */
+	boost::asio::steady_timer presence_timer_;
+
+	/**
+	 * The least time in milliseconds between two presence messages, so a
+	 * wave of bots joining costs each viewer a few messages a second.
+	 */
+	const uint16_t kPresenceInterval = 150;
+
+	/**
+	 * The longest an admin can profile the server for, in seconds.
+	 */
+	const unsigned int kMaxProfileTime = 60;
+
+	/**
+	 * The frequency in seconds that the live stats are sent.
+	 */
+	const uint16_t kAdminStatsInterval = 1;
+
+	/**
+	 * The seconds after which the guest's rates in the admin stats are
+	 * shown as 0 if its totals haven't changed, which is longer than the
+	 * controllers take to poll them.
+	 */
+	const uint16_t kGuestStatsTimeout = 15;
+
+	/**
+	 * The names of the VMs waiting to be auto-started, in the order they'll
+	 * be started, and the VMs that were started but aren't ready yet.
+	 */
+	std::deque<std::string> autostart_queue_;
+	struct BootingVM {
+		std::weak_ptr<VMController> controller;
+		std::chrono::steady_clock::time_point started;
+	};
+	std::vector<BootingVM> booting_vms_;
+
+	/**
+	 * Checks whether more VMs can be auto-started, while any are waiting.
+	 */
+	boost::asio::steady_timer autostart_timer_;
+
+	/**
+	 * The frequency in milliseconds that the auto-start timer is called.
+	 */
+	const uint16_t kAutoStartInterval = 500;
+
+#ifndef _WIN32
+	/**
+	 * Where a new build is handed the listening sockets, relative to the
+	 * server's directory.
+	 */
+	const std::string kUpgradeSocketPath = "upgrade.sock";
+
+	boost::asio::local::stream_protocol::acceptor upgrade_acceptor_;
+	boost::asio::local::stream_protocol::socket upgrade_socket_;
+#endif
+
+	/**
+	 * Serializes starting the IP data timer, since it can be started by
+	 * the processing thread while its callback runs on an asio thread.
+	 */
+	std::mutex ip_data_timer_lock_;
 
 	/**
 	 * The frequency in minutes that the IP data timer will be called.
@@ -556,11 +1298,82 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	const uint8_t kKeepAliveInterval = 5;
 
 	/**
-	 * How long before a client is disconnected.
+	 * The keep-alive interval is split into this many ticks, and each tick
+	 * sends nop instructions to a share of the clients, so a server with
+	 * many idle clients doesn't send them all at once.
+	 */
+	const uint8_t kKeepAliveTicks = 20;
+
+	/**
+	 * How long before a client that hasn't sent anything, including the
+	 * pong to a WebSocket ping, is disconnected.
 	 * Measured in seconds.
 	 */
 	const uint8_t kKeepAliveTimeout = 15;
 
+	/**
+	 * The maximum number of bytes that can be queued for a client before
+	 * display updates are dropped and the display is resynced.
+	 */
+	const size_t kMaxSendQueueBytes = 4 * 1024 * 1024;
+
+	/**
+	 * How long a client stays in the reduced quality tier after its send
+	 * queue last overflowed. Measured in seconds.
+	 */
+	const uint8_t kReducedQualityTime = 30;
+
+	/**
+	 * The largest screen, in pixels, that a client can report while joining
+	 * a VM to be sent the scaled down display instead of the full one.
+	 */
+	const uint64_t kScaledDisplayMaxArea = 1024 * 600;
+
+	/**
+	 * The scale, as a percentage of the full display, at or below which a
+	 * client's viewport is sent the scaled down display, which is half the
+	 * size, and the scale it has to be zoomed in past to get the full one
+	 * back. The gap keeps a client zooming around the threshold from being
+	 * sent the display over and over.
+	 */
+	const uint16_t kScaledViewportPercent = 50;
+	const uint16_t kFullViewportPercent = 60;
+
+	/**
+	 * The maximum number of threads the shared image encoder pool can have.
+	 */
+	const uint8_t kMaxEncoderThreads = 64;
+
+	/**
+	 * The maximum number of threads that can handle network connections.
+	 */
+	const uint8_t kMaxNetworkThreads = 64;
+
+	/**
+	 * The largest CPU limit a VM can have, as a percent of a single CPU.
+	 */
+	const uint16_t kMaxCPULimit = 25600;
+
+	/**
+	 * The largest CPU or IO weight of a VM's cgroup.
+	 */
+	const uint16_t kMaxCGroupWeight = 10000;
+
+	/**
+	 * The maximum size of the shared image cache, in megabytes.
+	 */
+	const uint16_t kMaxImageCacheSize = 4096;
+
+	/**
+	 * The maximum number of pointer events per second a VM can be sent.
+	 */
+	const uint16_t kMaxMouseMoveRate = 1000;
+
+	/**
+	 * The longest delay before lossy updates are refined, in milliseconds.
+	 */
+	const uint16_t kMaxRefineDelay = 60000;
+
 	std::string doc_root_;
 
 	/**
@@ -587,24 +1400,64 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	std::default_random_engine rng_;
 
 	/**
-	 * Circular buffer used for storing chat history.
+	 * The most recent chat messages, oldest first.
+	 */
+	std::deque<ChatMessage> chat_history_;
+
+	/**
+	 * The chat instruction containing every message in chat_history_.
+	 * It's reset when a message is added and built again by the next
+	 * call to SendChatHistory().
+	 */
+	std::shared_ptr<const websocketmm::websocket_message> chat_history_message_;
+
+	/**
+	 * The message every user that joins a VM is sent, and what it was built
+	 * from. It's kept until one of the parts changes, so a crowd joining at
+	 * once shares one message. The cached parts are held on to so a newer
+	 * message can't be allocated at the same address as one of them.
 	 */
-	ChatMessage* chat_history_;
+	struct JoinBundle {
+		std::string connect;
+		std::string motd;
+		std::shared_ptr<const websocketmm::websocket_message> online_users;
+		std::shared_ptr<const websocketmm::websocket_message> chat_history;
+		std::shared_ptr<const websocketmm::websocket_message> message;
+	};
+
+	/**
+	 * The join bundle of each VM by name.
+	 */
+	std::unordered_map<std::string, JoinBundle> join_bundles_;
 
 	/**
-	 * Begin index for the circular chat history buffer.
+	 * A user's session on a VM after their connection was lost, which they
+	 * can resume within the grace period.
 	 */
-	uint8_t chat_history_begin_;
+	struct SuspendedSession {
+		std::string username;
+		std::string vm_name;
+
+		/**
+		 * The user's VMController::GetTurnPosition() when they disconnected.
+		 */
+		size_t turn_position;
+		std::chrono::steady_clock::time_point expiry;
+	};
 
 	/**
-	 * End index for the circular chat history buffer.
+	 * The suspended sessions by token, the tokens in the order they expire
+	 * in, and the token of each reserved username.
 	 */
-	uint8_t chat_history_end_;
+	std::unordered_map<std::string, SuspendedSession> sessions_;
+	std::deque<std::string> session_expiry_;
+	std::unordered_map<std::string, std::string, case_insensitive_hash, case_insensitive_equal> session_usernames_;
 
 	/**
-	 * The number of messages in the chat history buffer.
+	 * How long a user's username and turn are kept after their connection
+	 * is lost. Measured in seconds.
 	 */
-	uint8_t chat_history_count_;
+	const uint8_t kSessionGracePeriod = 30;
 
 	const size_t kMaxChatMsgLen = 100;
 
@@ -627,6 +1480,18 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 */
 	const size_t kMaxFileUploads = 10;
 
+	/**
+	 * The maximum number of those uploads that can be for the same VM.
+	 * A VM's agent receives one file at a time, so its uploads beyond
+	 * this would only be waiting for it.
+	 */
+	const size_t kMaxVMUploads = 3;
+
+	/**
+	 * The maximum number of users that can wait to upload to each VM.
+	 */
+	const size_t kMaxQueuedUploads = 10;
+
 	/**
 	 * The amount of time a user has to begin an upload in seconds.
 	 */
@@ -637,6 +1502,23 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	 */
 	size_t upload_count_;
 
+	/**
+	 * The path an upload's file is POSTed to, followed by its ID.
+	 */
+	const std::string kUploadPath = "/upload?";
+
+	/**
+	 * Writes the body of an upload's POST request to its file, or its pipe.
+	 */
+	class HttpUploadSink;
+
+	/**
+	 * The number of bytes of a piped upload that can be waiting for the
+	 * agent before the HTTP request stops being read. Holds two of the
+	 * agent client's upload buffers, so it always has a full one ready.
+	 */
+	const size_t kUploadPipeSize = 2 * AgentProtocol::kUploadBufferSize;
+
 	const size_t kMaxChunkSize = 4096;
 
 	/**
@@ -645,13 +1527,185 @@ class CollabVMServer : public std::enable_shared_from_this<CollabVMServer> {
 	const size_t kMaxBase64ChunkSize = ((kMaxChunkSize + 2) / 3) * 4;
 
 	/**
-	 * After the maximum number of simultaneous uploads has been reached
-	 * users will be added to this queue to wait until their file upload can begin.
+	 * The VMs that have users in their upload_queue_, in the order they
+	 * get the next upload slot. All of them are only used by the
+	 * processing thread.
 	 */
-	std::deque<std::shared_ptr<CollabVMUser>> upload_queue_;
+	std::deque<std::shared_ptr<VMController>> upload_vms_;
 
 	const std::string kFileUploadPath = "uploads/";
 
+	/**
+	 * Where recordings of the VMs' displays are saved, to be replayed
+	 * with collab-vm-replay.
+	 */
+	const std::string kRecordingPath = "recordings/";
+
+	/**
+	 * Where the instructions sent to the VMs' viewers are recorded.
+	 */
+	const std::string kSessionRecordingPath = "sessions/";
+
+	/**
+	 * The number of bytes of uploaded files that are kept after their
+	 * uploads have ended, so that uploading them again doesn't rewrite them.
+	 */
+	const uint64_t kUploadSpoolCapacity = 256 * 1024 * 1024;
+
+	/**
+	 * The files of completed uploads, by their contents.
+	 */
+	const std::shared_ptr<UploadSpool> upload_spool_ = std::make_shared<UploadSpool>(kFileUploadPath, kUploadSpoolCapacity);
+
 	std::mutex upload_lock_;
 	std::map<std::string, std::shared_ptr<UploadInfo>, case_insensitive_cmp> upload_ids_;
+
+	/**
+	 * The version given to the last thumbnail. It starts at the time the
+	 * server was started so that clients don't reuse a cached thumbnail
+	 * from a previous run. Only used by the processing thread.
+	 */
+	uint64_t thumbnail_version_;
+
+	/**
+	 * The current thumbnail of each VM and its version, served over HTTP
+	 * from the Asio threads. Guarded by thumbnails_lock_.
+	 */
+	std::map<std::string, std::pair<std::shared_ptr<const VMThumbnail>, uint64_t>> thumbnails_;
+	std::mutex thumbnails_lock_;
+
+	/**
+	 * Checks whether an address may be sent another screenshot, taking a
+	 * token from its bucket if it may. Called from the Asio threads.
+	 */
+	bool TakeScreenshotToken(const boost::asio::ip::address& address);
+
+	/**
+	 * The tokens left in each address's bucket for screenshots, and when
+	 * they were last refilled. Guarded by screenshot_tokens_lock_.
+	 */
+	std::unordered_map<std::string, std::pair<double, std::chrono::steady_clock::time_point>> screenshot_tokens_;
+	std::mutex screenshot_tokens_lock_;
+
+	/**
+	 * The screenshots each address can be sent per second, and how many
+	 * it can be sent at once after not asking for any.
+	 */
+	constexpr static double kScreenshotRate = 0.5;
+	constexpr static double kScreenshotBurst = 5;
+
+	/**
+	 * The number of addresses that are tracked before the full buckets of
+	 * addresses that haven't asked for a while are forgotten.
+	 */
+	constexpr static size_t kMaxScreenshotAddresses = 4096;
+
+	/**
+	 * The last thumbnail of each VM is kept here, so it can be shown
+	 * while the VM starts after the server restarts.
+	 */
+	const std::string kThumbnailStorePath = "thumbnails/";
+	ThumbnailStore thumbnail_store_ { kThumbnailStorePath };
+
+	/**
+	 * A copy of the relay token for the network threads, guarded by
+	 * relay_token_lock_. Relays are refused while it's empty.
+	 */
+	std::string relay_token_;
+	std::mutex relay_token_lock_;
+
+	/**
+	 * The path that VM thumbnails are served from. The escaped name of
+	 * the VM follows it.
+	 */
+	const std::string kThumbnailPath = "/thumbnail/";
+
+	/**
+	 * The path that full screenshots of VMs are served from, for bots and
+	 * embeds that don't need to connect to the VM. The escaped name of the
+	 * VM follows it.
+	 */
+	const std::string kScreenshotPath = "/screenshot/";
+
+	/**
+	 * The path that read-only spectators open their WebSocket on, followed
+	 * by the escaped name of the VM. Adding chat=1 to the query string
+	 * sends them the chat as well.
+	 */
+	const std::string kSpectatePath = "/spectate/";
+
+	/**
+	 * The path that the HLS streams of VMs are served from, followed by
+	 * the escaped name of the VM and index.m3u8 for its playlist.
+	 */
+	const std::string kHLSPath = "/hls/";
+
+	/**
+	 * The path that the metrics and memory accounting are served from in
+	 * the Prometheus text format, to requests with the metrics token.
+	 */
+	const std::string kMetricsPath = "/metrics";
+
+	/**
+	 * The path that the sampled frame traces are served from as Chrome
+	 * trace events, to requests with the metrics token.
+	 */
+	const std::string kTracePath = "/trace";
+
+	/**
+	 * The number of open connections, the actions waiting for the
+	 * processing thread, how long the actions of each class waited and how
+	 * long handling them took, and the bytes received by uploads.
+	 */
+	MetricGauge connections_metric_;
+	MetricGauge queued_actions_metric_;
+	MetricHistogram action_wait_metrics_[kActionClasses];
+	MetricHistogram action_time_metric_;
+	MetricCounter upload_bytes_metric_;
+
+	/**
+	 * The bytes sent to all of the connections.
+	 */
+	MetricCounter egress_metric_;
+
+	/**
+	 * The serialized list instruction, shared by every user that requests
+	 * it until InvalidateList() is called. Only used by the processing thread.
+	 */
+	std::shared_ptr<const websocketmm::websocket_message> list_message_;
+
+	/**
+	 * The VMs in list_message_ sorted by name, which pages of the list
+	 * are taken from. Built along with it, and the states are kept up to
+	 * date by UpdateVMStatus() in between.
+	 */
+	std::vector<ListEntry> list_index_;
+
+	/**
+	 * The most VMs that are sent in one page of the list.
+	 */
+	const size_t kMaxListPage = 200;
+
+	/**
+	 * The servers in the cluster and the VMs they run, which the list
+	 * instruction includes and the connect instruction redirects to.
+	 */
+	std::shared_ptr<ClusterDirectory> cluster_;
+
+	/**
+	 * The version of the cluster directory that list_message_ was built from.
+	 */
+	uint64_t list_cluster_version_;
+
+	/**
+	 * The maximum number of ban commands that can wait to be run.
+	 */
+	const size_t kMaxQueuedCommands = 256;
+
+	/**
+	 * Runs the ban commands, and reports their results to the processing thread.
+	 */
+	CommandRunner command_runner_ { kMaxQueuedCommands, [this](const std::string& command, int status) {
+									   PostAction<CommandAction>(command, status);
+								   } };
 };
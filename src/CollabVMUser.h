@@ -1,14 +1,19 @@
 #pragma once
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <list>
 #include <map>
 #include <fstream>
 #include <stdint.h>
+#include "ActionQueue.h"
 #include "GuacUser.h"
 
 #include <websocketmm/fwd.h>
 
 class VMController;
+class GuacClient;
 struct UploadInfo;
 
 enum UserRank : uint8_t {
@@ -76,7 +81,11 @@ struct IPData {
 		kNo
 	};
 
-	std::map<const VMController*, VoteDecision> votes;
+	/**
+	 * The number of votes in progress that the IP has a decision in.
+	 * The IPData can't be deleted until it's zero.
+	 */
+	std::atomic<uint32_t> ballots;
 
 	/*
 	 * The time point when the user will be allowed to upload another file.
@@ -90,6 +99,12 @@ struct IPData {
 	 */
 	uint8_t failed_logins;
 
+	/**
+	 * The bytes sent to the IP's connections, as of the last time they
+	 * were accounted. Only used by the processing thread.
+	 */
+	uint64_t sent_bytes;
+
 	/**
 	 * The time of the first failed login from the IP.
 	 */
@@ -100,6 +115,11 @@ struct IPData {
 	enum class IPType { kIPv4,
 						kIPv6 } type;
 
+	/**
+	 * Whether the IPData is waiting in the expiry queue of the IPDataTable.
+	 */
+	bool expiry_queued;
+
    protected:
 	IPData(IPType type, bool one_connection)
 		: type(type),
@@ -109,8 +129,11 @@ struct IPData {
 		  name_chg_count(0),
 		  chat_muted(kUnmuted),
 		  //has_voted(false),
+		  ballots(0),
 		  upload_in_progress(false),
-		  failed_logins(0) {
+		  failed_logins(0),
+		  sent_bytes(0),
+		  expiry_queued(false) {
 	}
 };
 
@@ -165,6 +188,11 @@ struct IPv6Data : IPData {
  */
 class CollabVMUser : public std::enable_shared_from_this<CollabVMUser> {
    public:
+	/**
+	 * The index of a user that isn't in a ConnectionTable.
+	 */
+	constexpr static size_t kNoIndex = SIZE_MAX;
+
 	CollabVMUser(std::weak_ptr<websocketmm::websocket_user> handle, IPData& ip_data)
 		: next_(nullptr),
 		  prev_(nullptr),
@@ -176,12 +204,30 @@ class CollabVMUser : public std::enable_shared_from_this<CollabVMUser> {
 		  //user_id(0),
 		  connected(false),
 		  admin_connected(false),
-		  last_nop_instr(std::chrono::time_point_cast<std::chrono::seconds>(std::chrono::steady_clock::now())),
+		  connection_index(kNoIndex),
+		  admin_index(kNoIndex),
+		  stats_index(kNoIndex),
+		  list_index(kNoIndex),
 		  ip_data(ip_data),
 		  upload_info(nullptr),
 		  waiting_for_upload(false),
 		  voted_amount(0),
-		  voted_limit(false) {
+		  voted_limit(false),
+		  binary_images(false),
+		  scaled_display(false),
+		  turn_updates(false),
+		  relay_role(RelayRole::kNone),
+		  spectator(Spectator::kNone),
+		  reduced_quality(false),
+		  display_hidden(false),
+		  tab_hidden(false),
+		  viewport_empty(false),
+		  display_priority(false),
+		  accounted_bytes(0),
+		  queued_input(0),
+		  action_lane(nullptr),
+		  action_class(ActionClass::kChat),
+		  lane_actions(0) {
 	}
 
 	// Intrusive list for all of the connections viewing a VM
@@ -202,14 +248,24 @@ class CollabVMUser : public std::enable_shared_from_this<CollabVMUser> {
 	/**
 	 * The Guacamole user associated with the VM that the client
 	 * is viewing. May be null if the user is not viewing a VM.
+	 * It's replaced with std::atomic_store() because the websocket
+	 * threads load it to send input straight to the VM, and the
+	 * reference they hold keeps it alive until the input is handled.
 	 */
-	GuacUser* guac_user;
+	std::shared_ptr<GuacUser> guac_user;
 
 	/**
 	 * Set to true when the user is waiting for a turn to control the VM.
 	 */
 	bool waiting_turn;
 
+	/**
+	 * The user's position in the turn queue of the VM they're viewing,
+	 * so they can leave it without it being searched. Only valid while
+	 * waiting_turn is true.
+	 */
+	std::list<std::shared_ptr<CollabVMUser>>::iterator turn_queue_it;
+
 	/**
 	 * The rank of the user.
 	 */
@@ -226,6 +282,12 @@ class CollabVMUser : public std::enable_shared_from_this<CollabVMUser> {
 	 */
 	std::shared_ptr<std::string> username;
 
+	/**
+	 * The token the client can resume its session with after losing its
+	 * connection. Empty until the user is given a username.
+	 */
+	std::string session_token;
+
 	/**
 	 * Whether the client is connected to the websocket server.
 	 */
@@ -238,16 +300,20 @@ class CollabVMUser : public std::enable_shared_from_this<CollabVMUser> {
 	bool admin_connected;
 
 	/**
-	 * The time that the last nop instruction was received.
+	 * The user's index in the server's tables of connections, admin
+	 * connections, stats subscribers and list subscribers.
 	 */
-	std::chrono::time_point<std::chrono::steady_clock, std::chrono::seconds> last_nop_instr;
+	size_t connection_index;
+	size_t admin_index;
+	size_t stats_index;
+	size_t list_index;
 
 	IPData& ip_data;
 
 	std::shared_ptr<UploadInfo> upload_info;
 
 	/**
-	 * True when the user is waiting in the upload_queue_.
+	 * True when the user is waiting in a VM's upload_queue_.
 	 */
 	bool waiting_for_upload;
 
@@ -257,4 +323,111 @@ class CollabVMUser : public std::enable_shared_from_this<CollabVMUser> {
 	 */
 	int voted_amount;
 	bool voted_limit;
+
+	/**
+	 * True when the client negotiated the binary subprotocol
+	 * and should be sent image data in binary messages.
+	 */
+	bool binary_images;
+
+	/**
+	 * True when the client reported a small screen while joining the VM,
+	 * or a viewport zoomed out to the scaled down display's size, and is
+	 * sent the scaled down display instead of the full one. Read by the
+	 * threads that broadcast the display.
+	 */
+	std::atomic<bool> scaled_display;
+
+	/**
+	 * True when the client supports turnupdate instructions, and should be
+	 * sent changes to the turn queue instead of the whole queue.
+	 */
+	bool turn_updates;
+
+	/**
+	 * Set when the connection was opened by a relay with the relay token.
+	 * A relay's display connection has no username and isn't shown to
+	 * anyone, and its viewers aren't sent the display by the server.
+	 */
+	RelayRole relay_role;
+
+	/**
+	 * Set when the connection was opened on the spectator path. It joins
+	 * spectate_vm as soon as it's added, without a username, and nothing
+	 * it sends is handled.
+	 */
+	Spectator spectator;
+	std::string spectate_vm;
+
+	/**
+	 * Whether the user is sent the reduced quality versions of the display
+	 * updates, because their connection couldn't keep up with the others.
+	 * Read by the threads that broadcast the display.
+	 */
+	std::atomic<bool> reduced_quality;
+
+	/**
+	 * Set while the client's tab is in the background, which it reports
+	 * with the visibility instruction, or its viewport shows none of the
+	 * display. The user isn't sent the display until it's visible again.
+	 * Read by the threads that broadcast the display.
+	 */
+	std::atomic<bool> display_hidden;
+
+	/**
+	 * The reasons display_hidden is set, from the visibility and viewport
+	 * instructions.
+	 */
+	bool tab_hidden;
+	bool viewport_empty;
+
+	/**
+	 * Set while the user has the turn or is an admin, so that they're sent
+	 * each frame before the other viewers. Read by the threads that
+	 * broadcast the display.
+	 */
+	std::atomic<bool> display_priority;
+
+	/**
+	 * When the user can be moved back to full quality, if their connection
+	 * hasn't fallen behind again. Only used by the processing thread.
+	 */
+	std::chrono::steady_clock::time_point reduced_until;
+
+	/**
+	 * The bytes the connection had been sent when they were last added
+	 * to its IP, VM and the host. Only used by the processing thread.
+	 */
+	uint64_t accounted_bytes;
+
+	/**
+	 * The Guacamole client that the user's mouse and key instructions are
+	 * sent straight to from the websocket threads, while the user has the turn.
+	 * Set by the VMController with std::atomic_store() and read with
+	 * std::atomic_load().
+	 */
+	std::shared_ptr<GuacClient> input_client;
+
+	/**
+	 * The number of input instructions from the user that are waiting in
+	 * the processing queue. New input has to be queued behind them instead
+	 * of being sent straight to input_client, so that it stays in order.
+	 */
+	std::atomic<uint32_t> queued_input;
+
+	/**
+	 * The VM and class of the lane in the processing thread that the user's
+	 * actions are scheduled in, and how many of them are still waiting there.
+	 * The lane only changes once they've all been handled, so the user's
+	 * actions stay in order when they switch VMs or send a different kind
+	 * of instruction. Only used by the processing thread.
+	 */
+	const VMController* action_lane;
+	ActionClass action_class;
+	uint32_t lane_actions;
 };
+
+/**
+ * The users waiting for a turn to control a VM, in the order they'll get it.
+ */
+typedef std::list<std::shared_ptr<CollabVMUser>> TurnQueue;
@@ -0,0 +1,89 @@
+#include "CommandRunner.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+	#include <spawn.h>
+	#include <sys/wait.h>
+
+extern char** environ;
+#endif
+
+CommandRunner::CommandRunner(size_t max_queued, FinishedCallback on_finished)
+	: max_queued_(max_queued),
+	  on_finished_(std::move(on_finished)),
+	  stopping_(false),
+	  thread_(&CommandRunner::RunnerThread, this) {
+}
+
+CommandRunner::~CommandRunner() {
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex_);
+		stopping_ = true;
+	}
+	queue_cv_.notify_one();
+	thread_.join();
+}
+
+bool CommandRunner::Run(const std::string& command) {
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex_);
+		if(std::find(queue_.begin(), queue_.end(), command) != queue_.end())
+			return true;
+		if(queue_.size() >= max_queued_)
+			return false;
+		queue_.push_back(command);
+	}
+	queue_cv_.notify_one();
+	return true;
+}
+
+void CommandRunner::RunnerThread() {
+	std::deque<std::string> batch;
+	std::unique_lock<std::mutex> lock(queue_mutex_);
+	while(true) {
+		queue_cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+		if(stopping_)
+			return;
+
+		// Take everything that has been queued, up to the batch size
+		size_t count = std::min(queue_.size(), kMaxBatchSize);
+		batch.assign(std::make_move_iterator(queue_.begin()), std::make_move_iterator(queue_.begin() + count));
+		queue_.erase(queue_.begin(), queue_.begin() + count);
+
+		lock.unlock();
+		RunBatch(batch);
+		batch.clear();
+		lock.lock();
+	}
+}
+
+void CommandRunner::RunBatch(std::deque<std::string>& batch) {
+#ifndef _WIN32
+	std::vector<pid_t> pids(batch.size(), -1);
+	for(size_t i = 0; i < batch.size(); i++) {
+		const char* argv[] = { "/bin/sh", "-c", batch[i].c_str(), nullptr };
+		if(posix_spawn(&pids[i], "/bin/sh", nullptr, nullptr, const_cast<char* const*>(argv), environ) != 0)
+			pids[i] = -1;
+	}
+
+	for(size_t i = 0; i < batch.size(); i++) {
+		int status = -1;
+		if(pids[i] != -1) {
+			int wait_status;
+			pid_t pid;
+			while((pid = waitpid(pids[i], &wait_status, 0)) == -1 && errno == EINTR)
+				;
+			if(pid == pids[i] && WIFEXITED(wait_status))
+				status = WEXITSTATUS(wait_status);
+		}
+		on_finished_(batch[i], status);
+	}
+#else
+	for(const std::string& command : batch)
+		on_finished_(command, std::system(command.c_str()));
+#endif
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Runs shell commands, such as the ban command, on a single thread so
+ * that running one never blocks the caller. Commands are started with
+ * posix_spawn() instead of system() from a new thread, which would fork
+ * the server's whole address space for every ban during a raid.
+ *
+ * Queued commands are started together as a batch and then waited for.
+ * A command that is already waiting in the queue isn't added again, so
+ * banning the same IP many times only runs its command once.
+ */
+class CommandRunner {
+   public:
+	/**
+	 * Called on the runner's thread when a command has finished.
+	 *
+	 * @param status The exit status of the command, or -1 if it couldn't
+	 *               be started or didn't exit normally.
+	 */
+	using FinishedCallback = std::function<void(const std::string& command, int status)>;
+
+	/**
+	 * @param max_queued The number of commands that can be waiting to be
+	 *                   started before new ones are dropped.
+	 */
+	CommandRunner(size_t max_queued, FinishedCallback on_finished);
+
+	/**
+	 * Waits for the commands that are running, and drops the ones
+	 * that haven't been started.
+	 */
+	~CommandRunner();
+
+	/**
+	 * Queues a command to be run by the shell.
+	 *
+	 * @return false if the queue is full and the command was dropped.
+	 */
+	bool Run(const std::string& command);
+
+   private:
+	void RunnerThread();
+
+	/**
+	 * Starts every command in a batch and waits for all of them to exit.
+	 */
+	void RunBatch(std::deque<std::string>& batch);
+
+	/**
+	 * The maximum number of commands that are running at the same time.
+	 */
+	constexpr static size_t kMaxBatchSize = 16;
+
+	const size_t max_queued_;
+	const FinishedCallback on_finished_;
+
+	std::deque<std::string> queue_;
+	std::mutex queue_mutex_;
+	std::condition_variable queue_cv_;
+	bool stopping_;
+
+	std::thread thread_;
+};
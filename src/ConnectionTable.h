@@ -0,0 +1,119 @@
+#pragma once
+#include "CollabVMUser.h"
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+ * A set of users kept contiguously in a vector. Each user stores its own
+ * index in the table in the member given by Index, so adding and removing
+ * a user is constant time, and iterating only scans the vector. A user can
+ * be in several tables as long as each uses its own index member.
+ *
+ * Removing a user moves another one into its slot, so the order isn't kept.
+ * Only used from the processing thread.
+ */
+template<size_t CollabVMUser::*Index>
+class ConnectionTable {
+   public:
+	constexpr static size_t kNone = CollabVMUser::kNoIndex;
+
+	typedef typename std::vector<std::shared_ptr<CollabVMUser>>::const_iterator const_iterator;
+
+	ConnectionTable()
+		: cursor_(0) {
+	}
+
+	/**
+	 * @return Whether the user was added, which it isn't if it's already in the table.
+	 */
+	bool insert(const std::shared_ptr<CollabVMUser>& user) {
+		if(user.get()->*Index != kNone)
+			return false;
+		user.get()->*Index = users_.size();
+		users_.push_back(user);
+		return true;
+	}
+
+	/**
+	 * @return Whether the user was in the table.
+	 */
+	bool erase(const std::shared_ptr<CollabVMUser>& user) {
+		size_t index = user.get()->*Index;
+		if(index == kNone)
+			return false;
+		user.get()->*Index = kNone;
+
+		// Users before the cursor have been visited by Rotate() this round.
+		// The slot is filled by the last visited user, whose slot is filled
+		// by the last user, so neither is visited twice or skipped
+		if(index < cursor_) {
+			cursor_--;
+			Move(cursor_, index);
+			index = cursor_;
+		}
+		Move(users_.size() - 1, index);
+		users_.pop_back();
+		if(cursor_ > users_.size())
+			cursor_ = 0;
+		return true;
+	}
+
+	void clear() {
+		for(const std::shared_ptr<CollabVMUser>& user : users_)
+			user.get()->*Index = kNone;
+		users_.clear();
+		cursor_ = 0;
+	}
+
+	inline bool contains(const CollabVMUser& user) const {
+		return user.*Index != kNone;
+	}
+
+	inline size_t size() const {
+		return users_.size();
+	}
+
+	inline bool empty() const {
+		return users_.empty();
+	}
+
+	inline const_iterator begin() const {
+		return users_.begin();
+	}
+
+	inline const_iterator end() const {
+		return users_.end();
+	}
+
+	/**
+	 * Calls func with the next count users in turn, starting from where
+	 * the last call left off, so every user is visited once per round.
+	 * func must not add or remove users.
+	 */
+	template<typename F>
+	void Rotate(size_t count, F func) {
+		for(size_t i = 0; i < count && !users_.empty(); i++) {
+			if(cursor_ >= users_.size())
+				cursor_ = 0;
+			func(*users_[cursor_++]);
+		}
+	}
+
+   private:
+	void Move(size_t from, size_t to) {
+		if(from == to)
+			return;
+		users_[to] = std::move(users_[from]);
+		users_[to].get()->*Index = to;
+	}
+
+	std::vector<std::shared_ptr<CollabVMUser>> users_;
+
+	/**
+	 * The index of the next user for Rotate().
+	 */
+	size_t cursor_;
+};
@@ -26,13 +26,45 @@ struct Config {
 		  ChatMsgHistory(10),
 		  MaxUploadTime(120),
 		  BanCommand(""),
-#ifdef USE_JPEG
 		  JPEGQuality(75),
+		  ModEnabled(false),
+		  ModPerms(0),
+		  DeflateEnabled(false),
+		  DeflateLevel(1),
+		  DeflateWindowBits(15),
+		  DeflateMemLevel(4),
+		  EncoderThreads(2),
+		  ImageCacheSize(32),
+		  TileDiffing(true),
+		  SharedFramebuffer(false),
+		  MouseMoveRate(60),
+		  RefineDelay(1000),
+		  ScrollDetection(true),
+		  MaxTotalConnections(0),
+		  MaxPendingConnections(8),
+		  AcceptRate(0),
+		  MessageRate(200),
+		  ReceiveRate(64),
+		  NetworkThreads(0),
+		  MetricsToken(""),
+		  RelayToken(""),
+		  ClusterURL(""),
+		  ClusterPeers(""),
+		  ClusterWeight(100),
+		  ClusterToken(""),
+		  TLSCertificate(""),
+		  TLSKey(""),
+		  LogLevel(1),
+		  LogJSON(false),
+		  AutoStartConcurrency(2),
+		  AutoStartMemory(0),
+		  EgressIPBudget(0),
+		  EgressHostBudget(0),
+#ifdef USE_WEBP
+		  WebPMode(1) {
 #else
-		  JPEGQuality(255),
+		  WebPMode(0) {
 #endif
-		  ModEnabled(false),
-		  ModPerms(0) {
 	}
 
 	uint8_t ID;
@@ -61,6 +93,11 @@ struct Config {
 
 	std::string BanCommand;
 
+	/**
+	 * Quality of JPEG updates, 0-100. Regions of the screen that look
+	 * photographic are sent as JPEG, everything else as PNG.
+	 * 255 disables JPEG.
+	 */
 	uint8_t JPEGQuality;
 
 	bool ModEnabled;
@@ -68,6 +105,196 @@ struct Config {
 	uint16_t ModPerms;
 
 	std::string BlacklistedNames;
+
+	/**
+	 * Whether the permessage-deflate WebSocket extension is offered to clients.
+	 */
+	bool DeflateEnabled;
+
+	/**
+	 * Deflate compression level, 0-9.
+	 */
+	uint8_t DeflateLevel;
+
+	/**
+	 * Maximum server window bits for deflate, 9-15.
+	 */
+	uint8_t DeflateWindowBits;
+
+	/**
+	 * Deflate memory level, 1-9.
+	 */
+	uint8_t DeflateMemLevel;
+
+	/**
+	 * The number of threads shared by all VMs for encoding display updates.
+	 * 0 encodes updates on each VM's own VNC thread.
+	 */
+	uint8_t EncoderThreads;
+
+	/**
+	 * The size of the cache of encoded images shared by all VMs, in
+	 * megabytes. 0 disables the cache.
+	 */
+	uint16_t ImageCacheSize;
+
+	/**
+	 * Whether display updates are compared with the previous frame in
+	 * tiles, so that only the parts that actually changed are sent.
+	 */
+	bool TileDiffing;
+
+	/**
+	 * Whether the VNC client decodes updates directly into the surface that
+	 * is sent to viewers, instead of keeping its own copy of the screen.
+	 * This saves memory and a copy of every update, but the updates can't
+	 * be compared with the previous frame. Takes effect when a VM reconnects.
+	 */
+	bool SharedFramebuffer;
+
+	/**
+	 * The number of pointer events sent to each VM per second while the
+	 * mouse buttons don't change. Moves in between are merged into the
+	 * latest position, and button changes are always sent right away.
+	 * 0 sends every move.
+	 */
+	uint16_t MouseMoveRate;
+
+	/**
+	 * How long parts of the screen that were sent as lossy JPEG or WebP
+	 * images must stay unchanged before they are sent again as PNG, in
+	 * milliseconds. 0 never sends them again.
+	 */
+	uint16_t RefineDelay;
+
+	/**
+	 * Whether the screen is checked for content that moved since the last
+	 * frame, like a scrolled window, so that it's sent as a copy instead of
+	 * as a new image.
+	 */
+	bool ScrollDetection;
+
+	/**
+	 * The maximum number of connections the server will have open at once,
+	 * including ones that haven't finished their handshake. 0 = unlimited.
+	 */
+	uint16_t MaxTotalConnections;
+
+	/**
+	 * The maximum number of connections from one IP that haven't sent
+	 * their handshake yet. 0 = unlimited.
+	 */
+	uint8_t MaxPendingConnections;
+
+	/**
+	 * The number of new connections accepted per second. 0 = unlimited.
+	 */
+	uint16_t AcceptRate;
+
+	/**
+	 * The number of WebSocket messages each connection can send per second,
+	 * and the number of kilobytes. The connections from one IP share a few
+	 * times as much. Connections over it aren't read from until it's caught
+	 * up with. 0 = unlimited.
+	 */
+	uint16_t MessageRate;
+	uint16_t ReceiveRate;
+
+	/**
+	 * The number of threads that handle WebSocket and HTTP connections,
+	 * each with its own acceptor. 0 handles them on the main thread along
+	 * with everything else. Takes effect when the server is restarted.
+	 */
+	uint8_t NetworkThreads;
+
+	/**
+	 * The token that requests for /metrics must send, as a bearer token or
+	 * in the token query parameter. The metrics aren't served when empty.
+	 */
+	std::string MetricsToken;
+
+	/**
+	 * The token that relays send in the X-CollabVM-Relay header, which lets
+	 * them connect for their viewers. Relays are refused when it's empty.
+	 */
+	std::string RelayToken;
+
+	/**
+	 * The URL that clients reach this server at, like https://host:port,
+	 * which identifies it to the rest of its cluster.
+	 */
+	std::string ClusterURL;
+
+	/**
+	 * The host:port addresses of other servers in the cluster, separated by
+	 * commas. The servers they know about are found through them.
+	 */
+	std::string ClusterPeers;
+
+	/**
+	 * The share of the cluster's VMs this server is given, relative to the
+	 * weights of the other servers.
+	 */
+	uint16_t ClusterWeight;
+
+	/**
+	 * The token that the servers in a cluster send each other as a bearer
+	 * token. The server isn't part of a cluster when it's empty.
+	 */
+	std::string ClusterToken;
+
+	/**
+	 * The paths of the PEM files with the certificate chain and the
+	 * private key that connections are served over TLS with. Connections
+	 * are plain HTTP when either is empty, or the server was built
+	 * without TLS. The files are loaded again when they change.
+	 */
+	std::string TLSCertificate;
+	std::string TLSKey;
+
+	/**
+	 * The lowest level of the messages that are logged:
+	 * 0 = debug, 1 = info, 2 = warning, 3 = error.
+	 */
+	uint8_t LogLevel;
+
+	/**
+	 * Whether the log is written as one JSON object per line
+	 * instead of plain text.
+	 */
+	bool LogJSON;
+
+	/**
+	 * The number of auto-started VMs that can be booting at the same
+	 * time. A VM has booted once it has sent its first frame. 0 starts
+	 * all of them at once.
+	 */
+	uint8_t AutoStartConcurrency;
+
+	/**
+	 * The memory in MiB the host must have available before another
+	 * VM is auto-started. 0 doesn't check the memory.
+	 */
+	uint32_t AutoStartMemory;
+
+	/**
+	 * The bitrate in kbit/s that the connections from one IP can be sent
+	 * before they're moved to the reduced quality tier. 0 for no limit.
+	 */
+	uint32_t EgressIPBudget;
+
+	/**
+	 * The bitrate in Mbit/s that all of the connections can be sent
+	 * before the IPs sent the most are moved to the reduced quality
+	 * tier, to keep traffic spikes from saturating the uplink. 0 for no limit.
+	 */
+	uint32_t EgressHostBudget;
+
+	/**
+	 * How images are encoded for viewers that support WebP:
+	 * 0 = disabled, 1 = lossless, 2 = lossy (using JPEGQuality).
+	 */
+	uint8_t WebPMode;
 };
 
 #endif
\ No newline at end of file
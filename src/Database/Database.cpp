@@ -1,7 +1,9 @@
-#include <iostream>
+#include <ctime>
+#include <stdexcept>
 #include <sqlite_orm/sqlite_orm.h>
 
 #include "Database.h"
+#include "Logger.h"
 
 namespace CollabVM {
 
@@ -34,7 +36,39 @@ namespace CollabVM {
 									   make_column("JPEGQuality", &Config::JPEGQuality),
 									   make_column("ModEnabled", &Config::ModEnabled),
 									   make_column("ModPerms", &Config::ModPerms),
-									   make_column("BlacklistedNames", &Config::BlacklistedNames)),
+									   make_column("BlacklistedNames", &Config::BlacklistedNames),
+									   make_column("DeflateEnabled", &Config::DeflateEnabled),
+									   make_column("DeflateLevel", &Config::DeflateLevel),
+									   make_column("DeflateWindowBits", &Config::DeflateWindowBits),
+									   make_column("DeflateMemLevel", &Config::DeflateMemLevel),
+									   make_column("EncoderThreads", &Config::EncoderThreads),
+									   make_column("WebPMode", &Config::WebPMode),
+									   make_column("ImageCacheSize", &Config::ImageCacheSize),
+									   make_column("TileDiffing", &Config::TileDiffing),
+									   make_column("SharedFramebuffer", &Config::SharedFramebuffer),
+									   make_column("MouseMoveRate", &Config::MouseMoveRate),
+									   make_column("RefineDelay", &Config::RefineDelay, default_value(1000)),
+									   make_column("ScrollDetection", &Config::ScrollDetection, default_value(true)),
+									   make_column("MaxTotalConnections", &Config::MaxTotalConnections),
+									   make_column("MaxPendingConnections", &Config::MaxPendingConnections),
+									   make_column("AcceptRate", &Config::AcceptRate),
+									   make_column("MessageRate", &Config::MessageRate, default_value(200)),
+									   make_column("ReceiveRate", &Config::ReceiveRate, default_value(64)),
+									   make_column("NetworkThreads", &Config::NetworkThreads),
+									   make_column("MetricsToken", &Config::MetricsToken, default_value("")),
+									   make_column("RelayToken", &Config::RelayToken, default_value("")),
+									   make_column("ClusterURL", &Config::ClusterURL, default_value("")),
+									   make_column("ClusterPeers", &Config::ClusterPeers, default_value("")),
+									   make_column("ClusterWeight", &Config::ClusterWeight, default_value(100)),
+									   make_column("ClusterToken", &Config::ClusterToken, default_value("")),
+									   make_column("TLSCertificate", &Config::TLSCertificate, default_value("")),
+									   make_column("TLSKey", &Config::TLSKey, default_value("")),
+									   make_column("LogLevel", &Config::LogLevel, default_value(1)),
+									   make_column("LogJSON", &Config::LogJSON, default_value(false)),
+									   make_column("AutoStartConcurrency", &Config::AutoStartConcurrency, default_value(2)),
+									   make_column("AutoStartMemory", &Config::AutoStartMemory, default_value(0)),
+									   make_column("EgressIPBudget", &Config::EgressIPBudget, default_value(0)),
+									   make_column("EgressHostBudget", &Config::EgressHostBudget, default_value(0))),
 							// VMSettings table
 							make_table("VMSettings",
 									   make_column("Name", &VMSettings::Name, primary_key()),
@@ -68,7 +102,44 @@ namespace CollabVM {
 									   make_column("QMPAddress", &VMSettings::QMPAddress),
 									   make_column("QMPPort", &VMSettings::QMPPort),
 									   make_column("QEMUCmd", &VMSettings::QEMUCmd),
-									   make_column("QEMUSnapshotMode", &VMSettings::QEMUSnapshotMode))
+									   make_column("QEMUSnapshotMode", &VMSettings::QEMUSnapshotMode),
+									   make_column("CPULimit", &VMSettings::CPULimit, default_value(0)),
+									   make_column("CPUWeight", &VMSettings::CPUWeight, default_value(0)),
+									   make_column("MemoryHigh", &VMSettings::MemoryHigh, default_value(0)),
+									   make_column("IOWeight", &VMSettings::IOWeight, default_value(0)),
+									   make_column("IdleCPULimit", &VMSettings::IdleCPULimit, default_value(0)),
+									   make_column("IdlePolicy", &VMSettings::IdlePolicy, default_value(0)),
+									   make_column("IdleTimeout", &VMSettings::IdleTimeout, default_value(60)),
+									   make_column("VNCSocketType", &VMSettings::VNCSocketType, default_value(0)),
+									   make_column("AudioEnabled", &VMSettings::AudioEnabled, default_value(false)),
+									   make_column("OverlayRegions", &VMSettings::OverlayRegions, default_value("")),
+									   make_column("PNGRealtimeLevel", &VMSettings::PNGRealtimeLevel, default_value(2)),
+									   make_column("PNGKeyframeLevel", &VMSettings::PNGKeyframeLevel, default_value(6)),
+									   make_column("PNGPalette", &VMSettings::PNGPalette, default_value(true)),
+									   make_column("PNGFast", &VMSettings::PNGFast, default_value(false)),
+									   make_column("JPEGQuality", &VMSettings::JPEGQuality, default_value(0)),
+									   make_column("JPEGSubsampling", &VMSettings::JPEGSubsampling, default_value(0)),
+									   make_column("VideoEnabled", &VMSettings::VideoEnabled, default_value(false)),
+									   make_column("LatencyProbe", &VMSettings::LatencyProbe, default_value("")),
+									   make_column("AutoStartPriority", &VMSettings::AutoStartPriority, default_value(0)),
+									   make_column("BaseImage", &VMSettings::BaseImage, default_value("")),
+									   make_column("VNCEncodings", &VMSettings::VNCEncodings, default_value("")),
+									   make_column("VNCCompressLevel", &VMSettings::VNCCompressLevel, default_value(3)),
+									   make_column("VNCQualityLevel", &VMSettings::VNCQualityLevel, default_value(5)),
+									   make_column("CPUAffinity", &VMSettings::CPUAffinity, default_value("")),
+									   make_column("JoinRate", &VMSettings::JoinRate, default_value(0)),
+									   make_column("QEMUDetached", &VMSettings::QEMUDetached, default_value(false)),
+									   make_column("SessionRecording", &VMSettings::SessionRecording, default_value(false)),
+									   make_column("TargetBitrate", &VMSettings::TargetBitrate, default_value(0)),
+									   make_column("EncoderWeight", &VMSettings::EncoderWeight, default_value(0)),
+									   make_column("HLSEnabled", &VMSettings::HLSEnabled, default_value(false))),
+							// IPBan table
+							make_table("IPBans",
+									   make_column("Prefix", &IPBan::Prefix),
+									   make_column("Type", &IPBan::Type),
+									   make_column("Expires", &IPBan::Expires),
+									   make_column("Reason", &IPBan::Reason),
+									   primary_key(&IPBan::Prefix, &IPBan::Type))
 							);
 	}
 
@@ -106,7 +177,7 @@ namespace CollabVM {
 
 			// An iconic message, that will ripple past and future generations
 			// together to remember our founding fathers
-			std::cout << "A new database has been created\n";
+			Logger::Info() << "A new database has been created";
 		}
 
 		// There should only be one Config in the database
@@ -122,39 +193,86 @@ namespace CollabVM {
 		} catch(...) {
 			// well you too then buddy
 		}
+
+		// Write-ahead logging lets a write be committed with a single fsync,
+		// and since every write comes from one thread the connection is kept
+		// open for it
+		try {
+			impl->storage.open_forever();
+			impl->storage.pragma.journal_mode(sqlite_orm::journal_mode::WAL);
+			impl->storage.pragma.synchronous(1);
+		} catch(const std::exception& e) {
+			Logger::Error() << "Failed to enable write-ahead logging for the database: " << e.what();
+		}
+
+		// Databases from before the resource limit, idle, VNC socket type, audio, overlay, PNG, JPEG and video columns were added can't be
+		// read until they have them, and they have defaults so they can be
+		// added without recreating the table
+		if(VirtualMachines.empty()) {
+			try {
+				impl->storage.sync_schema(true);
+				for(auto& vm : impl->storage.get_all<VMSettings>())
+					VirtualMachines[vm.Name] = std::make_shared<VMSettings>(vm);
+			} catch(...) {
+			}
+		}
+
+		// Databases from before bans were stored don't have the table,
+		// which can be added without touching the others
+		std::vector<IPBan> bans;
+		try {
+			bans = impl->storage.get_all<IPBan>();
+		} catch(...) {
+			try {
+				impl->storage.sync_schema(true);
+			} catch(...) {
+			}
+		}
+
+		// The bans that ran out while the server was stopped are removed
+		// by the first write
+		int64_t now = std::time(nullptr);
+		for(IPBan& ban : bans) {
+			auto key = std::make_pair(ban.Prefix, ban.Type);
+			if(ban.Expires == 0 || ban.Expires > now)
+				IPBans[key] = std::move(ban);
+			else
+				pending_bans[key] = nullptr;
+		}
+
+		write_thread = std::thread(&Database::WriteThread, this);
 	}
 
 	// TODO: some of this is a littttle bit wonky
 
 	void Database::Save(Config& config) {
-		impl->storage.transaction([&]() {
-			impl->storage.update(config);
-			Configuration = config;
-			return true;
-		});
+		Configuration = config;
+
+		std::lock_guard<std::mutex> lock(write_mutex);
+		pending_config = std::make_unique<Config>(config);
+		write_wait.notify_one();
 	}
 
 	void Database::AddVM(std::shared_ptr<VMSettings>& vm) {
 		if(!vm)
 			return;
 
-		impl->storage.transaction([&]() {
-			impl->storage.replace<VMSettings>(*vm);
+		// Add the VMSettings to the map.
+		VirtualMachines[vm->Name] = vm;
 
-			// Add the VMSettings to the map.
-			VirtualMachines[vm->Name] = vm;
-			return true;
-		});
+		// The settings are copied, since the caller may keep changing them
+		std::lock_guard<std::mutex> lock(write_mutex);
+		pending_vms[vm->Name] = std::make_shared<const VMSettings>(*vm);
+		write_wait.notify_one();
 	}
 
 	void Database::UpdateVM(std::shared_ptr<VMSettings>& vm) {
 		if(!vm)
 			return;
 
-		impl->storage.transaction([&]() {
-			impl->storage.update<VMSettings>(*vm);
-			return true;
-		});
+		std::lock_guard<std::mutex> lock(write_mutex);
+		pending_vms[vm->Name] = std::make_shared<const VMSettings>(*vm);
+		write_wait.notify_one();
 	}
 
 	void Database::RemoveVM(const std::string& name) {
@@ -162,16 +280,99 @@ namespace CollabVM {
 		if(it == VirtualMachines.end())
 			return;
 
-		impl->storage.transaction([&]() {
-			impl->storage.remove<VMSettings>(it->second->Name);
+		std::lock_guard<std::mutex> lock(write_mutex);
+		pending_vms[name] = nullptr;
+		write_wait.notify_one();
+
+		// Erase the map
+		VirtualMachines.erase(it);
+	}
+
+	void Database::AddIPBan(const IPBan& ban) {
+		auto key = std::make_pair(ban.Prefix, ban.Type);
+		IPBans[key] = ban;
 
-			// Erase the map
-			VirtualMachines.erase(it);
-			return true;
-		});
+		std::lock_guard<std::mutex> lock(write_mutex);
+		pending_bans[key] = std::make_unique<IPBan>(ban);
+		write_wait.notify_one();
 	}
 
-	// Implement the default destructor in this TU so that
+	void Database::RemoveIPBan(const std::string& prefix, uint8_t type) {
+		auto key = std::make_pair(prefix, type);
+		if(!IPBans.erase(key))
+			return;
+
+		std::lock_guard<std::mutex> lock(write_mutex);
+		pending_bans[key] = nullptr;
+		write_wait.notify_one();
+	}
+
+	void Database::SetWriteCallback(std::function<void(bool success, const std::string& error)> callback) {
+		std::lock_guard<std::mutex> lock(write_mutex);
+		write_callback = std::move(callback);
+	}
+
+	void Database::WriteThread() {
+		std::unique_lock<std::mutex> lock(write_mutex);
+		for(;;) {
+			write_wait.wait(lock, [this]() {
+				return stopping || pending_config || !pending_vms.empty() || !pending_bans.empty();
+			});
+			if(!pending_config && pending_vms.empty() && pending_bans.empty())
+				return;
+
+			// Give changes made together a chance to be written together
+			if(!stopping)
+				write_wait.wait_for(lock, kWriteDelay, [this]() { return stopping; });
+
+			std::unique_ptr<Config> config = std::move(pending_config);
+			std::map<std::string, std::shared_ptr<const VMSettings>> vms;
+			vms.swap(pending_vms);
+			std::map<std::pair<std::string, uint8_t>, std::unique_ptr<IPBan>> bans;
+			bans.swap(pending_bans);
+			lock.unlock();
+
+			bool success = true;
+			std::string error;
+			try {
+				impl->storage.transaction([&]() {
+					if(config)
+						impl->storage.update(*config);
+					for(const auto& [name, vm] : vms) {
+						if(vm)
+							impl->storage.replace<VMSettings>(*vm);
+						else
+							impl->storage.remove<VMSettings>(name);
+					}
+					for(const auto& [key, ban] : bans) {
+						if(ban)
+							impl->storage.replace(*ban);
+						else
+							impl->storage.remove<IPBan>(key.first, key.second);
+					}
+					return true;
+				});
+			} catch(const std::exception& e) {
+				success = false;
+				error = e.what();
+			}
+
+			lock.lock();
+			if(write_callback)
+				write_callback(success, error);
+			else if(!success)
+				Logger::Error() << "Failed to write to the database: " << error;
+		}
+	}
+
+	// Implement the destructor in this TU so that
 	// the unique_ptr<DbImpl> can actually function
-	Database::~Database() = default;
+	Database::~Database() {
+		{
+			std::lock_guard<std::mutex> lock(write_mutex);
+			stopping = true;
+		}
+		write_wait.notify_one();
+		write_thread.join();
+	}
 } // namespace CollabVM
\ No newline at end of file
@@ -1,20 +1,35 @@
 #ifndef COLLAB_VM_SERVER_DATABASE_H
 #define COLLAB_VM_SERVER_DATABASE_H
 
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 
 #include "Config.h"
+#include "IPBan.h"
 #include "VMSettings.h"
 
 namespace CollabVM {
 
 	/**
 	 * Abstraction structure over the database.
+	 *
+	 * Configuration and VirtualMachines are changed as soon as the functions
+	 * below are called, but the changes are written to the database by its
+	 * own thread, so that the caller doesn't wait for the disk. Changes made
+	 * to the same row before it was written are merged into a single write.
 	 */
 	struct Database {
 		Database();
+
+		/**
+		 * Writes the changes that are still pending and stops the thread.
+		 */
 		~Database();
 
 		/**
@@ -39,6 +54,24 @@ namespace CollabVM {
 		 */
 		void RemoveVM(const std::string& name);
 
+		/**
+		 * Add a ban or mute, replacing the one of the same type
+		 * for the prefix if there is one.
+		 */
+		void AddIPBan(const IPBan& ban);
+
+		/**
+		 * Remove a ban or mute from the DB and map.
+		 */
+		void RemoveIPBan(const std::string& prefix, uint8_t type);
+
+		/**
+		 * Sets the function called from the database's thread after each
+		 * batch of changes has been written, with whether writing them
+		 * succeeded and the error if it didn't.
+		 */
+		void SetWriteCallback(std::function<void(bool success, const std::string& error)> callback);
+
 		/**
 		 * Server Configuration
 		 */
@@ -49,6 +82,12 @@ namespace CollabVM {
 		 */
 		std::map<std::string, std::shared_ptr<VMSettings>> VirtualMachines;
 
+		/**
+		 * The bans and mutes that haven't run out. The ones that ran out
+		 * are removed when the server starts.
+		 */
+		IPBanMap IPBans;
+
 	   private:
 		/**
 		 * Database implementation class.
@@ -59,6 +98,30 @@ namespace CollabVM {
 		 * A unique_ptr<> to the underlying implementation of the database.
 		 */
 		std::unique_ptr<DbImpl> impl;
+
+		/**
+		 * Writes the pending changes until the database is destroyed.
+		 */
+		void WriteThread();
+
+		/**
+		 * How long the thread waits after a change before writing it, so
+		 * that changes made together are written in one transaction.
+		 */
+		constexpr static std::chrono::milliseconds kWriteDelay = std::chrono::milliseconds(50);
+
+		/**
+		 * The changes waiting to be written, which are guarded by write_mutex.
+		 * Each VM's or ban's latest version replaces its row, and null removes it.
+		 */
+		std::unique_ptr<Config> pending_config;
+		std::map<std::string, std::shared_ptr<const VMSettings>> pending_vms;
+		std::map<std::pair<std::string, uint8_t>, std::unique_ptr<IPBan>> pending_bans;
+		std::function<void(bool, const std::string&)> write_callback;
+		bool stopping = false;
+		std::mutex write_mutex;
+		std::condition_variable write_wait;
+		std::thread write_thread;
 	};
 
 } // namespace CollabVM
@@ -0,0 +1,46 @@
+#ifndef COLLAB_VM_SERVER_IPBAN_H
+#define COLLAB_VM_SERVER_IPBAN_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <stdint.h>
+
+/**
+ * A ban or mute of an IP address or subnet, kept in the database so that
+ * it still applies after the server restarts.
+ */
+struct IPBan {
+	enum TypeEnum {
+		kBan, // Connections from the prefix are refused
+		kMute // Users from the prefix can't chat
+	};
+
+	IPBan()
+		: Type(kBan),
+		  Expires(0) {
+	}
+
+	/**
+	 * The address or subnet in CIDR notation, like "192.0.2.0/24",
+	 * always with the host bits cleared and the prefix length.
+	 */
+	std::string Prefix;
+
+	uint8_t Type;
+
+	/**
+	 * When the ban runs out, in seconds since the Unix epoch.
+	 * 0 never runs out.
+	 */
+	int64_t Expires;
+
+	std::string Reason;
+};
+
+/**
+ * Bans and mutes keyed by their prefix and type.
+ */
+typedef std::map<std::pair<std::string, uint8_t>, IPBan> IPBanMap;
+
+#endif
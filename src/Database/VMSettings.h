@@ -26,11 +26,23 @@ struct VMSettings {
 		kLocal
 	};
 
+	enum IdlePolicyEnum {
+		kIdleRun,		  // Keep running normally
+		kIdleStopUpdates, // Stop reading display updates from the VNC server
+		kIdlePause		  // Pause the VM with the QMP stop command
+	};
+
 	std::string Name;
 
 	uint8_t Hypervisor { HypervisorEnum::kQEMU };
 
 	bool AutoStart = false;
+	// VMs with a higher priority are auto-started first
+	uint8_t AutoStartPriority = 0;
+
+	// A disk image shared with other VMs. The server gives the VM a qcow2
+	// overlay on top of it, which is added to QEMU's command as a drive.
+	std::string BaseImage;
 
 	std::string DisplayName;
 	std::string MOTD;
@@ -64,13 +76,108 @@ struct VMSettings {
 	uint8_t UploadMaxFilename {};
 
 	std::string Snapshot;
+	// A local VNC socket is a Unix domain socket at VNCAddress, or at a
+	// path made from the VM's name if VNCAddress is empty
+	uint8_t VNCSocketType { SocketType::kTCP };
 	std::string VNCAddress;
 	uint16_t VNCPort {};
+	// The RFB encodings to ask the VNC server for, separated by spaces in
+	// order of preference. Empty uses raw for a VNC server on the same host
+	// and libvncclient's preferences otherwise. The levels (0-9) are used
+	// by the encodings that compress
+	std::string VNCEncodings;
+	uint8_t VNCCompressLevel = 3;
+	uint8_t VNCQualityLevel = 5;
 	uint8_t QMPSocketType { SocketType::kLocal };
 	std::string QMPAddress;
 	uint16_t QMPPort {};
 	std::string QEMUCmd;
 	uint8_t QEMUSnapshotMode { SnapshotMode::kOff };
+
+	// Streams the VM's audio to viewers. QEMU is given an audiodev named
+	// collab-vm-audio for the VNC server, which the sound device in
+	// QEMUCmd has to use, e.g. -device hda-output,audiodev=collab-vm-audio
+	bool AudioEnabled = false;
+
+	// Leaves QEMU running when the server exits, and reattaches to it when
+	// the server starts again instead of booting the VM. QEMU is started in
+	// its own session with a pid file, so QEMUCmd shouldn't use the
+	// terminal, e.g. -nographic. Only supported on Unix
+	bool QEMUDetached = false;
+
+	// Areas of the screen drawn on their own layers so that frequent
+	// redraws, like a taskbar clock, don't cause the updates around them
+	// to be encoded again. "x,y,width,height" separated by semicolons
+	std::string OverlayRegions;
+
+	// Measures how long the guest takes to show input. Every few seconds
+	// the key is pressed, and a program in the guest has to change the area
+	// of the screen in response. "x,y,width,height,keysym", empty to disable
+	std::string LatencyProbe;
+
+	// Sends areas of the screen that keep changing, like a playing video,
+	// as a VP8 video stream to viewers that support it. Requires a build
+	// with libvpx
+	bool VideoEnabled = false;
+
+	// How PNG images of the screen are encoded. Updates use the realtime
+	// zlib level (0-9), which is low so they're sent quickly, while the
+	// screen sent to joining viewers and refinements use the keyframe level.
+	// With PNGPalette, images with at most 256 colors are written as 8-bit
+	// or smaller indexed images. With PNGFast, updates that can't use a
+	// palette skip zlib for a much faster encoder that only compresses
+	// runs, so they're a little larger
+	uint8_t PNGRealtimeLevel = 2;
+	uint8_t PNGKeyframeLevel = 6;
+	bool PNGPalette = true;
+	bool PNGFast = false;
+
+	// Overrides the server's JPEG quality for the VM's screen, 0 uses the
+	// server's. The chroma subsampling is a guac_jpeg_subsampling and can
+	// only be changed in builds with TurboJPEG
+	uint8_t JPEGQuality {};
+	uint8_t JPEGSubsampling {};
+
+	// Resource limits for the QEMU process, which are applied
+	// with cgroups on Linux. 0 means no limit or the default.
+	uint16_t CPULimit {};	  // Percent of a single CPU
+	uint16_t CPUWeight {};	  // 1-10000
+	uint32_t MemoryHigh {};	  // MiB
+	uint16_t IOWeight {};	  // 1-10000
+	uint16_t IdleCPULimit {}; // Percent of a single CPU while the VM is idle
+
+	// The CPUs that the VNC client of the VM reads and encodes its screen
+	// on, like "0-7,16-23" for the CPUs of a NUMA node, so the framebuffer
+	// doesn't cross to the other socket. "auto" uses the CPUs that QEMU's
+	// vCPU threads are pinned to, empty lets the threads run anywhere
+	std::string CPUAffinity;
+
+	// The most viewers per second that are sent the whole screen when they
+	// join, so a burst of joins, like everyone reconnecting after a restart,
+	// is spread out. Viewers that join together share one copy. 0 for no limit
+	uint16_t JoinRate {};
+
+	// The bitrate in kbit/s that each viewer of the full quality display is
+	// kept near by lowering the lossy quality, sending more of the screen
+	// lossy and lengthening frames. 0 turns rate control off
+	uint32_t TargetBitrate {};
+
+	// The VM's share of the encoder threads when VMs on the host compete
+	// for them, which grows with its number of viewers. 1-10000, 0 for 100
+	uint16_t EncoderWeight {};
+
+	// Encodes the VM's screen as an HLS stream at /hls/<name>/index.m3u8,
+	// for audiences too large for WebSockets. Needs a build with HLS=1
+	bool HLSEnabled = false;
+
+	// Records the instructions sent to the VM's viewers to files in the
+	// sessions directory, which can be played back with guacamole's tools
+	bool SessionRecording = false;
+
+	// A VM becomes idle once it has had no viewers for IdleTimeout
+	// seconds, and stops being idle as soon as someone joins it
+	uint8_t IdlePolicy { IdlePolicyEnum::kIdleRun };
+	uint16_t IdleTimeout = 60;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,222 @@
+#include "EncoderPool.h"
+#include "Metrics.h"
+#include <algorithm>
+
+/**
+ * What a job costs a client's turn, in the units of its weight.
+ */
+constexpr static unsigned kJobCost = 100;
+
+thread_local EncoderPool::Client* EncoderPool::current_client_ = nullptr;
+
+EncoderPool& EncoderPool::Get() {
+	static EncoderPool pool;
+	return pool;
+}
+
+EncoderPool::EncoderPool()
+	: thread_count_(0),
+	  stopping_(false) {
+}
+
+EncoderPool::~EncoderPool() {
+	SetThreadCount(0);
+}
+
+void EncoderPool::SetThreadCount(size_t count) {
+	std::lock_guard<std::mutex> threads_lock(threads_mutex_);
+	if(count == threads_.size())
+		return;
+
+	// Stop the old workers, any batches they didn't get to
+	// will be finished by the threads that submitted them
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex_);
+		stopping_ = true;
+	}
+	queue_cv_.notify_all();
+
+	for(std::thread& thread : threads_)
+		thread.join();
+	threads_.clear();
+	thread_count_ = count;
+
+	stopping_ = false;
+
+	// Nothing is left to run posted batches, so finish them here, along
+	// with whatever the submitters of the others haven't claimed yet
+	if(count == 0) {
+		std::unique_lock<std::mutex> lock(queue_mutex_);
+		while(!active_clients_.empty()) {
+			Batch& batch = *active_clients_.front()->batches_.front();
+			size_t index;
+			ClaimJob(batch, index);
+			lock.unlock();
+			RunJob(batch, index);
+			lock.lock();
+		}
+	}
+
+	threads_.reserve(count);
+	for(size_t i = 0; i < count; i++)
+		threads_.emplace_back(&EncoderPool::WorkerThread, this);
+}
+
+void EncoderPool::Run(size_t count, const std::function<void(size_t)>& job) {
+	if(count == 0)
+		return;
+
+	// Nothing to gain from handing off a single job
+	if(count == 1 || thread_count_ == 0) {
+		for(size_t i = 0; i < count; i++)
+			job(i);
+		return;
+	}
+
+	Client* client = current_client_ ? current_client_ : &default_client_;
+	Batch batch { &job, count, client, std::chrono::steady_clock::now(), 0, 0 };
+	batch.posted = false;
+	std::unique_lock<std::mutex> lock(queue_mutex_);
+	Enqueue(batch);
+	lock.unlock();
+	queue_cv_.notify_all();
+
+	// Help out until every job has been claimed
+	size_t index;
+	lock.lock();
+	while(ClaimJob(batch, index)) {
+		lock.unlock();
+		RunJob(batch, index);
+		lock.lock();
+	}
+	lock.unlock();
+
+	// Wait for the jobs still running on the workers
+	std::unique_lock<std::mutex> batch_lock(batch.mutex);
+	batch.finished.wait(batch_lock, [&batch] { return batch.done == batch.count; });
+}
+
+void EncoderPool::Post(std::function<void()> job) {
+	if(thread_count_ == 0) {
+		job();
+		return;
+	}
+
+	Batch* batch = new Batch { nullptr, 1, &default_client_, std::chrono::steady_clock::now(), 0, 0 };
+	batch->posted_job = [job = std::move(job)](size_t) { job(); };
+	batch->job = &batch->posted_job;
+	batch->posted = true;
+
+	std::unique_lock<std::mutex> lock(queue_mutex_);
+	Enqueue(*batch);
+	lock.unlock();
+	queue_cv_.notify_one();
+}
+
+void EncoderPool::RunAsync(size_t count, std::function<void(size_t)> job, std::function<void()> done) {
+	if(count == 0 || thread_count_ == 0) {
+		for(size_t i = 0; i < count; i++)
+			job(i);
+		done();
+		return;
+	}
+
+	Client* client = current_client_ ? current_client_ : &default_client_;
+	Batch* batch = new Batch { nullptr, count, client, std::chrono::steady_clock::now(), 0, 0 };
+	batch->posted_job = std::move(job);
+	batch->posted_done = std::move(done);
+	batch->job = &batch->posted_job;
+	batch->posted = true;
+
+	std::unique_lock<std::mutex> lock(queue_mutex_);
+	Enqueue(*batch);
+	lock.unlock();
+	queue_cv_.notify_all();
+}
+
+void EncoderPool::Enqueue(Batch& batch) {
+	Client& client = *batch.client;
+	if(client.batches_.empty()) {
+		client.deficit_ = client.weight_;
+		active_clients_.push_back(&client);
+	}
+	client.batches_.push_back(&batch);
+}
+
+bool EncoderPool::ClaimJob(Batch& batch, size_t& index) {
+	if(batch.next == batch.count)
+		return false;
+
+	index = batch.next++;
+	if(batch.next == batch.count) {
+		Client& client = *batch.client;
+		client.batches_.erase(std::find(client.batches_.begin(), client.batches_.end(), &batch));
+
+		// A client without jobs gives up the rest of its turn
+		if(client.batches_.empty()) {
+			client.deficit_ = 0;
+			active_clients_.erase(std::find(active_clients_.begin(), active_clients_.end(), &client));
+		}
+	}
+
+	return true;
+}
+
+EncoderPool::Batch& EncoderPool::NextBatch() {
+	// The front client's turn lasts until it can't afford another job,
+	// then it goes to the back and is given its share for the next turn
+	while(active_clients_.front()->deficit_ < kJobCost) {
+		Client* client = active_clients_.front();
+		active_clients_.pop_front();
+		active_clients_.push_back(client);
+		client->deficit_ += client->weight_;
+	}
+
+	// Within a client, jobs are taken from its oldest batch first
+	Client& client = *active_clients_.front();
+	client.deficit_ -= kJobCost;
+	return *client.batches_.front();
+}
+
+void EncoderPool::RunJob(Batch& batch, size_t index) {
+	(*batch.job)(index);
+
+	// Nobody waits for posted batches, the last of their jobs deletes them
+	if(batch.posted) {
+		std::unique_lock<std::mutex> lock(batch.mutex);
+		bool last = ++batch.done == batch.count;
+		lock.unlock();
+		if(last) {
+			if(batch.posted_done)
+				batch.posted_done();
+			delete &batch;
+		}
+		return;
+	}
+
+	// The batch can be destroyed as soon as the submitter sees the last job
+	// finish, so it must not be touched after the mutex is released
+	std::lock_guard<std::mutex> lock(batch.mutex);
+	if(++batch.done == batch.count)
+		batch.finished.notify_one();
+}
+
+void EncoderPool::WorkerThread() {
+	std::unique_lock<std::mutex> lock(queue_mutex_);
+	while(true) {
+		queue_cv_.wait(lock, [this] { return stopping_ || !active_clients_.empty(); });
+		if(stopping_)
+			return;
+
+		Batch& batch = NextBatch();
+		size_t index;
+		if(ClaimJob(batch, index)) {
+			lock.unlock();
+			// The batch can't finish before this job does
+			if(MetricHistogram* metric = batch.client->wait_metric_)
+				metric->Observe(std::chrono::steady_clock::now() - batch.queued);
+			RunJob(batch, index);
+			lock.lock();
+		}
+	}
+}
@@ -0,0 +1,231 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class MetricHistogram;
+
+/**
+ * A pool of threads that encode images for every GuacClient on the server.
+ * The pool is shared so that VMs running on the same host compete for a
+ * fixed number of encoder threads, instead of each VM using every core.
+ *
+ * The threads are shared between VMs by deficit round robin, so a VM that
+ * plays video can't keep them all busy while another VM's occasional update
+ * waits behind its queue. Each turn a VM with jobs waiting is given jobs in
+ * proportion to its weight, and a VM that used up its share waits for the
+ * others to have their turn.
+ */
+class EncoderPool {
+	struct Batch;
+
+   public:
+	/**
+	 * The weight of a client that hasn't been given one.
+	 */
+	constexpr static unsigned kDefaultWeight = 100;
+
+	/**
+	 * Something that submits jobs, like a VM, whose jobs are queued
+	 * separately from the others' and given a share of the threads.
+	 * Must outlive the jobs it submitted.
+	 */
+	class Client {
+	   public:
+		/**
+		 * @param wait_metric Observes how long each job waited for a thread,
+		 *                    or null.
+		 */
+		explicit Client(MetricHistogram* wait_metric = nullptr)
+			: weight_(kDefaultWeight),
+			  wait_metric_(wait_metric),
+			  deficit_(0) {
+		}
+
+		Client(const Client&) = delete;
+		Client& operator=(const Client&) = delete;
+
+		/**
+		 * Sets the number of jobs the client is given each turn, in
+		 * hundredths of a job. Takes effect from its next turn.
+		 */
+		void SetWeight(unsigned weight) {
+			weight_ = weight ? weight : 1;
+		}
+
+	   private:
+		friend EncoderPool;
+
+		std::atomic<unsigned> weight_;
+		MetricHistogram* const wait_metric_;
+
+		/**
+		 * The client's batches that still have jobs which haven't been
+		 * started, and the jobs it can still start this turn, in
+		 * hundredths of a job. Guarded by the pool's queue_mutex_.
+		 */
+		std::deque<Batch*> batches_;
+		unsigned deficit_;
+	};
+
+	/**
+	 * Makes the batches run by the current thread belong to a client,
+	 * until the scope ends. Lets code that only knows the pool, like the
+	 * surfaces, submit jobs on behalf of the VM whose frame it's encoding.
+	 */
+	class ClientScope {
+	   public:
+		explicit ClientScope(Client& client)
+			: previous_(current_client_) {
+			current_client_ = &client;
+		}
+
+		~ClientScope() {
+			current_client_ = previous_;
+		}
+
+		ClientScope(const ClientScope&) = delete;
+		ClientScope& operator=(const ClientScope&) = delete;
+
+	   private:
+		Client* const previous_;
+	};
+
+	/**
+	 * Get the pool shared by all of the clients.
+	 */
+	static EncoderPool& Get();
+
+	EncoderPool();
+	~EncoderPool();
+
+	/**
+	 * Stops the current worker threads and starts count new ones.
+	 * When count is 0, jobs are run on the thread that submits them.
+	 */
+	void SetThreadCount(size_t count);
+
+	inline size_t GetThreadCount() const {
+		return thread_count_;
+	}
+
+	/**
+	 * Calls job once for each index from 0 to count - 1, spreading the
+	 * calls across the worker threads. The calling thread runs jobs
+	 * from the batch as well, and returns once all of them have finished.
+	 * The batch belongs to the client of the current ClientScope.
+	 */
+	void Run(size_t count, const std::function<void(size_t)>& job);
+
+	/**
+	 * Like Run(), but returns without waiting for the jobs, and done is
+	 * called by the thread that finishes the last of them. The batch
+	 * belongs to the client of the current ClientScope. When the pool has
+	 * no threads, the jobs and done are run before returning.
+	 */
+	void RunAsync(size_t count, std::function<void(size_t)> job, std::function<void()> done);
+
+	/**
+	 * Queues a job to run on one of the worker threads without waiting
+	 * for it, for work that isn't needed to finish the current frame.
+	 * When the pool has no threads, the job is run before returning.
+	 * Posted jobs belong to the pool's own client.
+	 */
+	void Post(std::function<void()> job);
+
+   private:
+	/**
+	 * A set of jobs submitted by a single call to Run().
+	 */
+	struct Batch {
+		const std::function<void(size_t)>* job;
+		size_t count;
+		Client* client;
+
+		/**
+		 * When the batch was queued, for the client's wait metric.
+		 */
+		std::chrono::steady_clock::time_point queued;
+
+		/**
+		 * The index of the next job to start. Guarded by the pool's queue_mutex_.
+		 */
+		size_t next;
+
+		/**
+		 * The number of jobs that have finished. Guarded by mutex.
+		 */
+		size_t done;
+		std::mutex mutex;
+		std::condition_variable finished;
+
+		/**
+		 * The job of a batch created by Post() or RunAsync(), which owns
+		 * the batch and deletes it once its last job has run, after
+		 * calling posted_done.
+		 */
+		std::function<void(size_t)> posted_job;
+		std::function<void()> posted_done;
+		bool posted;
+	};
+
+	/**
+	 * Queues a batch behind the other batches of its client, and gives the
+	 * client a turn if it had nothing queued.
+	 * Must be called with queue_mutex_ locked.
+	 */
+	void Enqueue(Batch& batch);
+
+	/**
+	 * Claims the next job from a batch, and removes the batch from the
+	 * queue once all of its jobs have been claimed.
+	 * Must be called with queue_mutex_ locked.
+	 *
+	 * @return Whether a job was claimed.
+	 */
+	bool ClaimJob(Batch& batch, size_t& index);
+
+	/**
+	 * Picks the batch a worker should take a job from next, moving on to
+	 * the next client once the current one has used up its turn.
+	 * Must be called with queue_mutex_ locked and a client active.
+	 */
+	Batch& NextBatch();
+
+	/**
+	 * Runs a claimed job and signals the batch if it was the last one.
+	 */
+	static void RunJob(Batch& batch, size_t index);
+
+	void WorkerThread();
+
+	std::vector<std::thread> threads_;
+	std::atomic<size_t> thread_count_;
+
+	/**
+	 * The clients that have batches queued, in the order of their turns.
+	 * The front one is having its turn.
+	 */
+	std::deque<Client*> active_clients_;
+
+	/**
+	 * The client of posted jobs and of batches run outside of a ClientScope.
+	 */
+	Client default_client_;
+	static thread_local Client* current_client_;
+
+	std::mutex queue_mutex_;
+	std::condition_variable queue_cv_;
+	bool stopping_;
+
+	/**
+	 * Serializes calls to SetThreadCount().
+	 */
+	std::mutex threads_mutex_;
+};
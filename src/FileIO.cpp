@@ -0,0 +1,320 @@
+#include "FileIO.h"
+#include "Logger.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef USE_URING
+	#include <sys/eventfd.h>
+	#include <sys/uio.h>
+#endif
+
+/**
+ * The threads that make blocking calls when there's no io_uring. Uploads
+ * are the only heavy users, and they're limited by the network.
+ */
+constexpr static size_t kThreadCount = 2;
+
+#ifdef USE_URING
+constexpr static unsigned kRingEntries = 256;
+#endif
+
+FileIO& FileIO::Get() {
+	static FileIO file_io;
+	return file_io;
+}
+
+FileIO::FileIO()
+	: uring_(false),
+	  pool_(new char[kBufferSize * kBufferCount]),
+	  stopping_(false) {
+	free_buffers_.reserve(kBufferCount);
+	for(size_t i = kBufferCount; i > 0; i--)
+		free_buffers_.push_back(static_cast<int>(i - 1));
+
+#ifdef USE_URING
+	uring_ = InitRing();
+	if(uring_) {
+		threads_.emplace_back(&FileIO::RunRing, this);
+		return;
+	}
+	Logger::Warning("FileIO") << "Couldn't create an io_uring, files are read and written by threads instead";
+#endif
+	for(size_t i = 0; i < kThreadCount; i++)
+		threads_.emplace_back(&FileIO::RunThread, this);
+}
+
+FileIO::~FileIO() {
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		stopping_ = true;
+	}
+#ifdef USE_URING
+	if(uring_) {
+		uint64_t value = 1;
+		::write(event_fd_, &value, sizeof(value));
+	}
+#endif
+	wake_.notify_all();
+	for(std::thread& thread : threads_)
+		thread.join();
+
+#ifdef USE_URING
+	if(uring_) {
+		io_uring_queue_exit(&ring_);
+		::close(event_fd_);
+	}
+#endif
+}
+
+const char* FileIO::GetBackendName() const {
+	return uring_ ? "io_uring" : "threads";
+}
+
+std::shared_ptr<FileIO::Buffer> FileIO::AcquireBuffer(size_t size) {
+	auto buffer = std::make_unique<Buffer>();
+	buffer->size_ = size;
+	buffer->index_ = -1;
+	if(size <= kBufferSize) {
+		std::lock_guard<std::mutex> lock(pool_lock_);
+		if(!free_buffers_.empty()) {
+			buffer->index_ = free_buffers_.back();
+			free_buffers_.pop_back();
+		}
+	}
+
+	if(buffer->index_ == -1) {
+		buffer->allocation_.reset(new char[size]);
+		buffer->data_ = buffer->allocation_.get();
+		return std::shared_ptr<Buffer>(buffer.release());
+	}
+
+	buffer->data_ = &pool_[buffer->index_ * kBufferSize];
+	return std::shared_ptr<Buffer>(buffer.release(), [this](Buffer* buffer) {
+		ReleaseBuffer(buffer->index_);
+		delete buffer;
+	});
+}
+
+void FileIO::ReleaseBuffer(int index) {
+	std::lock_guard<std::mutex> lock(pool_lock_);
+	free_buffers_.push_back(index);
+}
+
+void FileIO::Read(std::shared_ptr<AsyncFile> file, uint64_t offset, std::shared_ptr<Buffer> buffer, size_t size,
+				  Handler handler) {
+	Submit(std::unique_ptr<Request>(
+		new Request { std::move(file), offset, std::move(buffer), size, 0, false, std::move(handler) }));
+}
+
+void FileIO::Write(std::shared_ptr<AsyncFile> file, uint64_t offset, std::shared_ptr<Buffer> buffer, size_t size,
+				   Handler handler) {
+	Submit(std::unique_ptr<Request>(
+		new Request { std::move(file), offset, std::move(buffer), size, 0, true, std::move(handler) }));
+}
+
+void FileIO::Submit(std::unique_ptr<Request> request) {
+	bool first;
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		first = pending_.empty();
+		pending_.push_back(std::move(request));
+	}
+
+#ifdef USE_URING
+	// The ring's thread takes every pending request when it wakes up,
+	// so it only has to be woken for the first of them
+	if(uring_) {
+		if(first) {
+			uint64_t value = 1;
+			::write(event_fd_, &value, sizeof(value));
+		}
+		return;
+	}
+#endif
+	wake_.notify_one();
+}
+
+void FileIO::RunThread() {
+	std::unique_lock<std::mutex> lock(lock_);
+	while(true) {
+		wake_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+		if(pending_.empty())
+			break;
+
+		std::unique_ptr<Request> request = std::move(pending_.front());
+		pending_.pop_front();
+		lock.unlock();
+
+		Execute(*request);
+		request.reset();
+		lock.lock();
+	}
+}
+
+void FileIO::Execute(Request& request) {
+	int descriptor = request.file->GetDescriptor();
+	char* data = request.buffer->Data();
+	ssize_t result;
+	if(!request.write) {
+		do {
+			result = ::pread(descriptor, data, request.size, request.offset);
+		} while(result == -1 && errno == EINTR);
+		request.handler(result == -1 ? -errno : result);
+		return;
+	}
+
+	while(request.done < request.size) {
+		result = ::pwrite(descriptor, data + request.done, request.size - request.done, request.offset + request.done);
+		if(result == -1 && errno == EINTR)
+			continue;
+		if(result <= 0) {
+			request.handler(result == -1 ? -errno : -EIO);
+			return;
+		}
+		request.done += result;
+	}
+	request.handler(request.done);
+}
+
+#ifdef USE_URING
+bool FileIO::InitRing() {
+	if(io_uring_queue_init(kRingEntries, &ring_, 0) < 0)
+		return false;
+
+	event_fd_ = ::eventfd(0, EFD_CLOEXEC);
+	if(event_fd_ == -1) {
+		io_uring_queue_exit(&ring_);
+		return false;
+	}
+
+	// Registering can fail under a low RLIMIT_MEMLOCK, then the
+	// buffers are used like any other memory
+	std::vector<iovec> buffers(kBufferCount);
+	for(size_t i = 0; i < kBufferCount; i++)
+		buffers[i] = { &pool_[i * kBufferSize], kBufferSize };
+	buffers_registered_ = io_uring_register_buffers(&ring_, buffers.data(), buffers.size()) == 0;
+	return true;
+}
+
+void FileIO::ArmWakeup() {
+	io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+	if(!sqe) {
+		io_uring_submit(&ring_);
+		sqe = io_uring_get_sqe(&ring_);
+	}
+	io_uring_prep_read(sqe, event_fd_, &event_value_, sizeof(event_value_), 0);
+	io_uring_sqe_set_data(sqe, nullptr);
+}
+
+void FileIO::Prepare(Request* request) {
+	io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+	if(!sqe) {
+		// The submission queue is full, so what's in it is sent first
+		io_uring_submit(&ring_);
+		sqe = io_uring_get_sqe(&ring_);
+	}
+
+	int descriptor = request->file->GetDescriptor();
+	char* data = request->buffer->Data() + request->done;
+	size_t size = request->size - request->done;
+	uint64_t offset = request->offset + request->done;
+	int index = buffers_registered_ ? request->buffer->index_ : -1;
+	if(request->write) {
+		if(index != -1)
+			io_uring_prep_write_fixed(sqe, descriptor, data, size, offset, index);
+		else
+			io_uring_prep_write(sqe, descriptor, data, size, offset);
+	} else {
+		if(index != -1)
+			io_uring_prep_read_fixed(sqe, descriptor, data, size, offset, index);
+		else
+			io_uring_prep_read(sqe, descriptor, data, size, offset);
+	}
+	io_uring_sqe_set_data(sqe, request);
+}
+
+void FileIO::RunRing() {
+	std::deque<std::unique_ptr<Request>> taken;
+	size_t in_flight = 0;
+	bool stopping = false;
+
+	ArmWakeup();
+	io_uring_submit(&ring_);
+	while(!stopping || in_flight) {
+		io_uring_cqe* cqe;
+		int result = io_uring_wait_cqe(&ring_, &cqe);
+		if(result == -EINTR)
+			continue;
+		if(result < 0) {
+			Logger::Error("FileIO") << "Waiting on the io_uring failed: " << result;
+			break;
+		}
+
+		bool woken = false;
+		unsigned head;
+		unsigned count = 0;
+		io_uring_for_each_cqe(&ring_, head, cqe) {
+			count++;
+			auto* request = static_cast<Request*>(io_uring_cqe_get_data(cqe));
+			if(!request) {
+				woken = true;
+				continue;
+			}
+
+			// Interrupted requests and the rest of short writes are sent again
+			int64_t transferred = cqe->res;
+			if(transferred == -EINTR || transferred == -EAGAIN ||
+			   (request->write && transferred > 0 && request->done + transferred < request->size)) {
+				if(transferred > 0)
+					request->done += transferred;
+				Prepare(request);
+				continue;
+			}
+			if(request->write && transferred == 0)
+				transferred = -EIO;
+
+			in_flight--;
+			std::unique_ptr<Request> owned(request);
+			owned->handler(transferred < 0 || !owned->write ? transferred : static_cast<int64_t>(owned->size));
+		}
+		io_uring_cq_advance(&ring_, count);
+
+		if(woken) {
+			{
+				std::lock_guard<std::mutex> lock(lock_);
+				taken.swap(pending_);
+				stopping = stopping_;
+			}
+			for(std::unique_ptr<Request>& request : taken) {
+				Prepare(request.release());
+				in_flight++;
+			}
+			taken.clear();
+			if(!stopping)
+				ArmWakeup();
+		}
+		io_uring_submit(&ring_);
+	}
+}
+#endif
+
+std::shared_ptr<AsyncFile> AsyncFile::Open(const std::string& path, int flags) {
+	int descriptor = ::open(path.c_str(), flags | O_CLOEXEC, 0600);
+	if(descriptor == -1)
+		return nullptr;
+	return std::shared_ptr<AsyncFile>(new AsyncFile(descriptor));
+}
+
+AsyncFile::~AsyncFile() {
+	::close(descriptor_);
+}
+
+int64_t AsyncFile::GetSize() const {
+	struct stat info;
+	if(::fstat(descriptor_, &info) == -1)
+		return -1;
+	return info.st_size;
+}
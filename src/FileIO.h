@@ -0,0 +1,191 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef USE_URING
+	#include <liburing.h>
+#endif
+
+class AsyncFile;
+
+/**
+ * Reads and writes files on threads of its own, so the threads that run the
+ * io_context never wait on the disk. Builds with URING=1 send the requests
+ * through an io_uring, where one thread submits everything that was asked
+ * for since it last woke up in a single call and reaps the results, and the
+ * pooled buffers are registered with the kernel. Without it, or if the
+ * kernel refuses to create the ring, a few threads make the calls instead.
+ *
+ * Handlers are called on those threads, so like the callbacks of UploadPipe
+ * they should only post work to their own thread. Can be used from any thread.
+ */
+class FileIO {
+   public:
+	/**
+	 * Memory that a request reads into or writes from. Buffers of up to
+	 * kBufferSize come from a pool, which is registered with the io_uring.
+	 */
+	class Buffer {
+	   public:
+		char* Data() {
+			return data_;
+		}
+
+		size_t Size() const {
+			return size_;
+		}
+
+	   private:
+		friend FileIO;
+
+		char* data_;
+		size_t size_;
+
+		/**
+		 * The buffer's index in the pool, or -1 if it was allocated for
+		 * a request that didn't fit or while the pool was empty.
+		 */
+		int index_;
+		std::unique_ptr<char[]> allocation_;
+	};
+
+	/**
+	 * Called with the number of bytes transferred, or a negative errno.
+	 * A write only completes once all of its bytes have been written,
+	 * while a read may come up short at the end of the file.
+	 */
+	using Handler = std::function<void(int64_t result)>;
+
+	constexpr static size_t kBufferSize = 64 * 1024;
+	constexpr static size_t kBufferCount = 64;
+
+	static FileIO& Get();
+
+	FileIO(const FileIO&) = delete;
+	FileIO& operator=(const FileIO&) = delete;
+
+	/**
+	 * @return A buffer of the size, which is returned to the pool once
+	 *         the last reference to it is gone.
+	 */
+	std::shared_ptr<Buffer> AcquireBuffer(size_t size);
+
+	void Read(std::shared_ptr<AsyncFile> file, uint64_t offset, std::shared_ptr<Buffer> buffer, size_t size,
+			  Handler handler);
+	void Write(std::shared_ptr<AsyncFile> file, uint64_t offset, std::shared_ptr<Buffer> buffer, size_t size,
+			   Handler handler);
+
+	/**
+	 * "io_uring" or "threads", for the log.
+	 */
+	const char* GetBackendName() const;
+
+   private:
+	FileIO();
+	~FileIO();
+
+	struct Request {
+		std::shared_ptr<AsyncFile> file;
+		uint64_t offset;
+		std::shared_ptr<Buffer> buffer;
+		size_t size;
+
+		/**
+		 * The bytes of a write that have been written so far.
+		 */
+		size_t done;
+		bool write;
+		Handler handler;
+	};
+
+	void Submit(std::unique_ptr<Request> request);
+	void ReleaseBuffer(int index);
+
+	/**
+	 * Runs requests with blocking calls, for the threads backend.
+	 */
+	void RunThread();
+	static void Execute(Request& request);
+
+#ifdef USE_URING
+	bool InitRing();
+	void RunRing();
+
+	/**
+	 * Queues the read of the eventfd that wakes the ring's thread up.
+	 */
+	void ArmWakeup();
+	void Prepare(Request* request);
+
+	io_uring ring_;
+	int event_fd_;
+	uint64_t event_value_;
+	bool buffers_registered_;
+#endif
+	bool uring_;
+
+	/**
+	 * The memory of the pooled buffers, and the indexes of those that are free.
+	 */
+	std::unique_ptr<char[]> pool_;
+	std::vector<int> free_buffers_;
+	std::mutex pool_lock_;
+
+	std::mutex lock_;
+	std::condition_variable wake_;
+	std::deque<std::unique_ptr<Request>> pending_;
+	bool stopping_;
+
+	std::vector<std::thread> threads_;
+};
+
+/**
+ * A file that's read and written through FileIO. The descriptor is closed
+ * once the last request that uses it has completed. Opening the file still
+ * happens on the caller's thread.
+ */
+class AsyncFile : public std::enable_shared_from_this<AsyncFile> {
+   public:
+	/**
+	 * @param flags The flags of open(2).
+	 * @return The file, or null if it couldn't be opened.
+	 */
+	static std::shared_ptr<AsyncFile> Open(const std::string& path, int flags);
+
+	~AsyncFile();
+
+	AsyncFile(const AsyncFile&) = delete;
+	AsyncFile& operator=(const AsyncFile&) = delete;
+
+	int GetDescriptor() const {
+		return descriptor_;
+	}
+
+	/**
+	 * @return The size of the file, or -1 if it couldn't be read.
+	 */
+	int64_t GetSize() const;
+
+	void Read(uint64_t offset, std::shared_ptr<FileIO::Buffer> buffer, size_t size, FileIO::Handler handler) {
+		FileIO::Get().Read(shared_from_this(), offset, std::move(buffer), size, std::move(handler));
+	}
+
+	void Write(uint64_t offset, std::shared_ptr<FileIO::Buffer> buffer, size_t size, FileIO::Handler handler) {
+		FileIO::Get().Write(shared_from_this(), offset, std::move(buffer), size, std::move(handler));
+	}
+
+   private:
+	explicit AsyncFile(int descriptor)
+		: descriptor_(descriptor) {
+	}
+
+	const int descriptor_;
+};
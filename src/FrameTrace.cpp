@@ -0,0 +1,166 @@
+#include "FrameTrace.h"
+#include <list>
+
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+
+static const char* const kStageNames[] = {
+	"receive",
+	"flush",
+	"fan-out",
+	"delivery"
+};
+
+/**
+ * Every tracer, so the samples of all the VMs can be formatted together.
+ */
+static std::list<FrameTracer*> tracers;
+static std::mutex tracers_mutex;
+
+FrameTrace::FrameTrace(std::shared_ptr<FrameTracer> tracer, bool sampled,
+					   clock::time_point received, clock::time_point flush_start)
+	: tracer_(std::move(tracer)),
+	  sampled_(sampled),
+	  received_(received),
+	  flush_start_(flush_start) {
+}
+
+FrameTrace::~FrameTrace() {
+	// Frames that didn't draw anything were never built
+	if(!sampled_ || built_ == clock::time_point())
+		return;
+
+	tracer_->AddSample({ received_, flush_start_, built_, posted_, std::move(delivered_) });
+}
+
+void FrameTrace::Built() {
+	built_ = clock::now();
+	tracer_->Observe(FrameTracer::Stage::kFlush, built_ - flush_start_);
+}
+
+void FrameTrace::Posted() {
+	clock::time_point now = clock::now();
+	tracer_->Observe(FrameTracer::Stage::kFanOut, now - built_);
+	if(sampled_) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		posted_ = now;
+	}
+}
+
+void FrameTrace::Delivered() {
+	// The delivery is measured from when the messages were built, since
+	// viewers can be written to before every one of them has been posted
+	clock::time_point now = clock::now();
+	tracer_->Observe(FrameTracer::Stage::kDelivery, now - built_);
+	if(sampled_) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(delivered_.size() < FrameTracer::kMaxSampledDeliveries)
+			delivered_.push_back(now);
+	}
+}
+
+FrameTracer::FrameTracer(const std::string& vm)
+	: vm_(vm),
+	  frames_(0) {
+	Metrics& metrics = Metrics::Get();
+	for(size_t i = 0; i < static_cast<size_t>(Stage::kCount); i++) {
+		metrics.Add("collabvm_frame_stage_seconds", "How long each stage of sending a frame to the viewers took.",
+					Metrics::Label("vm", vm) + ',' + Metrics::Label("stage", kStageNames[i]), stages_[i]);
+	}
+
+	std::lock_guard<std::mutex> lock(tracers_mutex);
+	tracers.push_back(this);
+}
+
+FrameTracer::~FrameTracer() {
+	{
+		std::lock_guard<std::mutex> lock(tracers_mutex);
+		tracers.remove(this);
+	}
+
+	Metrics& metrics = Metrics::Get();
+	for(const MetricHistogram& stage : stages_)
+		metrics.Remove(&stage);
+}
+
+std::shared_ptr<FrameTrace> FrameTracer::Begin(FrameTrace::clock::time_point received,
+											   FrameTrace::clock::time_point flush_start) {
+	Observe(Stage::kReceive, flush_start - received);
+	bool sampled = frames_++ % kSampleInterval == 0;
+	return std::make_shared<FrameTrace>(shared_from_this(), sampled, received, flush_start);
+}
+
+void FrameTracer::AddSample(Sample&& sample) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if(samples_.size() == kMaxSamples)
+		samples_.pop_front();
+	samples_.push_back(std::move(sample));
+}
+
+/**
+ * Writes a complete event, which is drawn as a bar from start to end.
+ */
+static void WriteEvent(rapidjson::Writer<rapidjson::StringBuffer>& writer, const char* name,
+					   int pid, int tid, FrameTrace::clock::time_point start, FrameTrace::clock::time_point end) {
+	using std::chrono::duration;
+	using std::chrono::microseconds;
+	writer.StartObject();
+	writer.String("name");
+	writer.String(name);
+	writer.String("ph");
+	writer.String("X");
+	writer.String("pid");
+	writer.Int(pid);
+	writer.String("tid");
+	writer.Int(tid);
+	writer.String("ts");
+	writer.Double(duration<double, microseconds::period>(start.time_since_epoch()).count());
+	writer.String("dur");
+	writer.Double(duration<double, microseconds::period>(end - start).count());
+	writer.EndObject();
+}
+
+std::string FrameTracer::GetTraceEvents() {
+	rapidjson::StringBuffer buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+	writer.StartObject();
+	writer.String("traceEvents");
+	writer.StartArray();
+
+	std::lock_guard<std::mutex> tracers_lock(tracers_mutex);
+	int pid = 0;
+	for(FrameTracer* tracer : tracers) {
+		// Each VM is shown as a process, with the pipeline as its first
+		// thread and the deliveries to the viewers as the others
+		pid++;
+		writer.StartObject();
+		writer.String("name");
+		writer.String("process_name");
+		writer.String("ph");
+		writer.String("M");
+		writer.String("pid");
+		writer.Int(pid);
+		writer.String("args");
+		writer.StartObject();
+		writer.String("name");
+		writer.String(tracer->vm_.c_str(), tracer->vm_.length());
+		writer.EndObject();
+		writer.EndObject();
+
+		std::lock_guard<std::mutex> lock(tracer->mutex_);
+		for(const Sample& sample : tracer->samples_) {
+			WriteEvent(writer, kStageNames[0], pid, 0, sample.received, sample.flush_start);
+			WriteEvent(writer, kStageNames[1], pid, 0, sample.flush_start, sample.built);
+			if(sample.posted != FrameTrace::clock::time_point())
+				WriteEvent(writer, kStageNames[2], pid, 0, sample.built, sample.posted);
+			for(size_t i = 0; i < sample.delivered.size(); i++)
+				WriteEvent(writer, kStageNames[3], pid, i + 1, sample.built, sample.delivered[i]);
+		}
+	}
+
+	writer.EndArray();
+	writer.String("displayTimeUnit");
+	writer.String("ms");
+	writer.EndObject();
+	return std::string(buffer.GetString(), buffer.GetSize());
+}
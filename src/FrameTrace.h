@@ -0,0 +1,150 @@
+#pragma once
+#include "Metrics.h"
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class FrameTracer;
+
+/**
+ * The times a frame of a VM's display reached each stage of the pipeline,
+ * from the first RFB message of the frame being received to its messages
+ * being written to the viewers' connections. It's shared by the messages of
+ * the frame, so it's finished once every viewer has been sent or has dropped
+ * them.
+ */
+class FrameTrace {
+   public:
+	using clock = std::chrono::steady_clock;
+
+	FrameTrace(std::shared_ptr<FrameTracer> tracer, bool sampled,
+			   clock::time_point received, clock::time_point flush_start);
+
+	/**
+	 * Adds the trace to the tracer's samples if it was sampled.
+	 */
+	~FrameTrace();
+
+	FrameTrace(const FrameTrace&) = delete;
+	FrameTrace& operator=(const FrameTrace&) = delete;
+
+	/**
+	 * Called once the messages of the frame have been built from the
+	 * instructions written while flushing the surfaces.
+	 */
+	void Built();
+
+	/**
+	 * Called once the messages have been handed to every viewer, or to the
+	 * strands of the broadcast socket.
+	 */
+	void Posted();
+
+	/**
+	 * Called from a viewer's strand when a message of the frame has been
+	 * written to their connection.
+	 */
+	void Delivered();
+
+   private:
+	friend FrameTracer;
+
+	const std::shared_ptr<FrameTracer> tracer_;
+	const bool sampled_;
+	const clock::time_point received_;
+	const clock::time_point flush_start_;
+	clock::time_point built_;
+	clock::time_point posted_;
+
+	/**
+	 * When the message was written to each viewer, only kept for sampled
+	 * traces. Guarded by mutex_, since viewers are written to from
+	 * different threads.
+	 */
+	std::vector<clock::time_point> delivered_;
+	std::mutex mutex_;
+};
+
+/**
+ * Traces the frames of a VM. How long each stage took is added to histograms
+ * labelled with the stage, and one in every kSampleInterval frames is kept
+ * so the most recent of them can be viewed as Chrome trace events, to tell
+ * whether lag comes from the VNC server, encoding, fan-out or the network.
+ */
+class FrameTracer : public std::enable_shared_from_this<FrameTracer> {
+   public:
+	enum class Stage {
+		kReceive,  // Handling RFB messages until the frame was flushed
+		kFlush,	   // Encoding the dirty rects and writing the instructions
+		kFanOut,   // Sending the messages or posting them to the strands
+		kDelivery, // Until a viewer's connection finished writing the message
+		kCount
+	};
+
+	explicit FrameTracer(const std::string& vm);
+	~FrameTracer();
+
+	FrameTracer(const FrameTracer&) = delete;
+	FrameTracer& operator=(const FrameTracer&) = delete;
+
+	/**
+	 * Starts the trace of a frame that was flushed. Only called from the
+	 * VM's display thread.
+	 *
+	 * @param received When the first RFB message of the frame was received.
+	 * @param flush_start When the surfaces started to be flushed.
+	 */
+	std::shared_ptr<FrameTrace> Begin(FrameTrace::clock::time_point received,
+									  FrameTrace::clock::time_point flush_start);
+
+	void Observe(Stage stage, FrameTrace::clock::duration duration) {
+		stages_[static_cast<size_t>(stage)].Observe(duration);
+	}
+
+	/**
+	 * Formats the sampled frames of every VM as a JSON object in the Chrome
+	 * trace event format, which can be opened by chrome://tracing or Perfetto.
+	 */
+	static std::string GetTraceEvents();
+
+   private:
+	friend FrameTrace;
+
+	/**
+	 * The times of a sampled frame, kept after the frame was finished.
+	 */
+	struct Sample {
+		FrameTrace::clock::time_point received;
+		FrameTrace::clock::time_point flush_start;
+		FrameTrace::clock::time_point built;
+		FrameTrace::clock::time_point posted;
+		std::vector<FrameTrace::clock::time_point> delivered;
+	};
+
+	void AddSample(Sample&& sample);
+
+	constexpr static uint32_t kSampleInterval = 100;
+	constexpr static size_t kMaxSamples = 16;
+
+	/**
+	 * The most viewers whose deliveries are kept in a sample.
+	 */
+	constexpr static size_t kMaxSampledDeliveries = 32;
+
+	const std::string vm_;
+	MetricHistogram stages_[static_cast<size_t>(Stage::kCount)];
+
+	/**
+	 * The number of frames that were traced, to pick which are sampled.
+	 */
+	uint32_t frames_;
+
+	/**
+	 * The most recent samples. Guarded by mutex_.
+	 */
+	std::deque<Sample> samples_;
+	std::mutex mutex_;
+};
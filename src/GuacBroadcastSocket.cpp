@@ -1,37 +1,277 @@
 #include "GuacBroadcastSocket.h"
-#include "CollabVM.h"
 #include "CollabVMUser.h"
+#include "SessionRecorder.h"
+#include "Tracepoints.h"
 #include <assert.h>
+#include <algorithm>
+#include <functional>
+#include <thread>
 
 #include <websocketmm/websocket_user.h>
 
-GuacBroadcastSocket::GuacBroadcastSocket(CollabVMServer& server, UserList& users)
-	: server_(server),
-	  users_(users) {
+/**
+ * The number of threads that run the shards, which is also the number of
+ * shards each socket has.
+ */
+static const size_t kShardCount = std::max(1u, std::thread::hardware_concurrency() / 2);
+
+net::io_context& GuacBroadcastSocket::GetShardService() {
+	static net::io_context* service = [] {
+		net::io_context* service = new net::io_context();
+		new net::io_context::work(*service);
+		for(size_t i = 0; i < kShardCount; i++)
+			std::thread([service] { service->run(); }).detach();
+		return service;
+	}();
+	return *service;
+}
+
+GuacBroadcastSocket::GuacBroadcastSocket(GuacMessageSink& sink, net::io_context& context, UserList& users,
+										 MetricCounter& sent_bytes, bool scaled)
+	: sink_(sink),
+	  users_(users),
+	  sent_bytes_(sent_bytes),
+	  scaled_(scaled),
+	  frame_mode_(false),
+	  superseding_(false),
+	  built_bytes_(0),
+	  binary_users_(0),
+	  webp_users_(0),
+	  screen_codec_users_(0),
+	  screen_codec_zstd_users_(0),
+	  video_users_(0),
+	  reduced_users_(0) {
+	// One shard for each thread running the io_context
+	shards_.reserve(kShardCount);
+	for(size_t i = 0; i < kShardCount; i++)
+		shards_.emplace_back(context);
 }
 
 void GuacBroadcastSocket::InstructionBegin() {
-	// Lock stringstream
+	// Lock buffer
 	mutex_.lock();
 
-	// Clear stringstream
-	ss_.str("");
+	// Clear buffer, unless the instruction is being appended to a frame
+	if(!frame_mode_) {
+		ClearBuffers();
+		binary_enabled_ = binary_users_ > 0;
+		reduced_enabled_ = reduced_users_ > 0;
+	}
 }
 
 void GuacBroadcastSocket::InstructionEnd() {
-	std::string str = ss_.str();
+	if(frame_mode_) {
+		// The instruction will be sent when the frame ends
+		mutex_.unlock();
+		return;
+	}
 
-	// Unlock stringstream
+	// Check that the message ends with a semicolon
+	assert(!buffer_.Empty() && buffer_.Back() == ';');
+
+	Messages messages;
+	BuildMessages(messages, nullptr, superseding_);
+
+	// Unlock buffer
 	mutex_.unlock();
 
-	// Check that the message ends with a semicolon
-	assert(str[str.length() - 1] == ';');
+	Broadcast(messages);
+}
+
+bool GuacBroadcastSocket::IsWebP() {
+	// The scaled down display is only sent as PNG and JPEG
+	if(scaled_)
+		return false;
+	size_t webp_users = webp_users_;
+	return webp_users > 0 && webp_users == users_.GetSnapshot()->size();
+}
+
+bool GuacBroadcastSocket::IsScreenCodec() {
+	if(scaled_)
+		return false;
+	size_t screen_codec_users = screen_codec_users_;
+	return screen_codec_users > 0 && screen_codec_users == users_.GetSnapshot()->size();
+}
+
+bool GuacBroadcastSocket::IsScreenCodecZstd() {
+	if(scaled_)
+		return false;
+	size_t zstd_users = screen_codec_zstd_users_;
+	return zstd_users > 0 && zstd_users == users_.GetSnapshot()->size();
+}
+
+bool GuacBroadcastSocket::IsVideo() {
+	if(scaled_)
+		return false;
+	size_t video_users = video_users_;
+	return video_users > 0 && video_users == users_.GetSnapshot()->size();
+}
+
+bool GuacBroadcastSocket::HasReducedTier() {
+	return reduced_users_ > 0;
+}
+
+void GuacBroadcastSocket::SetRecorder(std::shared_ptr<SessionRecorder> recorder) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	recorder_ = std::move(recorder);
+}
+
+void GuacBroadcastSocket::SetSuperseding(bool superseding) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	superseding_ = superseding;
+}
+
+uint64_t GuacBroadcastSocket::TakeBuiltBytes() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	uint64_t bytes = built_bytes_;
+	built_bytes_ = 0;
+	return bytes;
+}
+
+void GuacBroadcastSocket::BeginFrame() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	frame_mode_ = true;
+	ClearBuffers();
+	binary_enabled_ = binary_users_ > 0;
+	reduced_enabled_ = reduced_users_ > 0;
+}
 
-	users_.ForEachUserLock([&](CollabVMUser& user) {
-		//user.guac_user->socket_.websocket_handle_->send(websocketmm::BuildWebsocketMessage(str))
+void GuacBroadcastSocket::EndFrame(std::shared_ptr<FrameTrace> trace) {
+	std::unique_lock<std::mutex> lock(mutex_);
+	frame_mode_ = false;
+
+	// Nothing was drawn during the frame
+	if(buffer_.Empty())
+		return;
+
+	assert(buffer_.Back() == ';');
+
+	Messages messages;
+	BuildMessages(messages, trace);
+	lock.unlock();
+
+	if(trace)
+		trace->Built();
+	Broadcast(messages);
+	if(trace)
+		trace->Posted();
+}
+
+void GuacBroadcastSocket::BuildMessages(Messages& messages, const std::shared_ptr<FrameTrace>& trace, bool superseding) {
+	// Build the messages once, every user shares the same immutable buffer.
+	// Display updates can be dropped for users that fall behind, they are resynced later.
+	messages.text = websocketmm::BuildWebsocketMessage(websocketmm::websocket_message::type::text, buffer_.Release(), true, trace, superseding);
+	built_bytes_ += messages.text->data.size();
+
+	// The binary version is only different if image data was written
+	if(has_binary_data_)
+		messages.binary = websocketmm::BuildWebsocketMessage(websocketmm::websocket_message::type::binary, binary_buffer_.Release(), true, trace, superseding);
+
+	// The reduced versions are only different if a reduced image was written
+	if(has_reduced_data_) {
+		messages.reduced_text = websocketmm::BuildWebsocketMessage(websocketmm::websocket_message::type::text, reduced_buffer_.Release(), true, trace, superseding);
+		if(has_binary_data_)
+			messages.reduced_binary = websocketmm::BuildWebsocketMessage(websocketmm::websocket_message::type::binary, reduced_binary_buffer_.Release(), true, trace, superseding);
+	}
+
+	// The recording shares the text message instead of building its own
+	if(recorder_)
+		recorder_->Write(messages.text);
+
+	COLLABVM_PROBE(broadcast, messages.text->data.size(), messages.binary ? messages.binary->data.size() : 0, scaled_);
+	ClearBuffers();
+}
+
+void GuacBroadcastSocket::UpdateShards(const std::shared_ptr<const UserList::Snapshot>& snapshot) {
+	std::vector<std::shared_ptr<UserList::Snapshot>> partitions(shards_.size());
+	for(auto& partition : partitions)
+		partition = std::make_shared<UserList::Snapshot>();
+
+	for(const std::shared_ptr<CollabVMUser>& user : *snapshot)
+		partitions[GetShardIndex(*user)]->push_back(user);
+
+	for(size_t i = 0; i < shards_.size(); i++)
+		shards_[i].users = std::move(partitions[i]);
+
+	sharded_snapshot_ = snapshot;
+}
+
+const std::shared_ptr<const websocketmm::websocket_message>* GuacBroadcastSocket::SelectMessage(const Messages& messages, const CollabVMUser& user, bool scaled) {
+	if(user.relay_role == RelayRole::kViewer || user.scaled_display != scaled || user.display_hidden)
+		return nullptr;
+	if(messages.reduced_text && user.reduced_quality)
+		return messages.reduced_binary && user.binary_images ? &messages.reduced_binary : &messages.reduced_text;
+	return messages.binary && user.binary_images ? &messages.binary : &messages.text;
+}
+
+void GuacBroadcastSocket::Broadcast(const Messages& messages) {
+	// The snapshot may include a user that was just removed, whose guac_user
+	// could already be deleted, so only the handle and flags are used.
+	// The binary and scaled flags are fixed before the user joins the VM. Viewers
+	// of a relay are sent the display by the relay, from its own connection.
+	// The turn holder and admins are sent the frame before everyone else, the
+	// flag is only read once so a user whose turn just began isn't skipped
+	auto send = [&sink = sink_, messages, scaled = scaled_](const UserList::Snapshot& users) {
+		thread_local std::vector<const CollabVMUser*> deferred;
+		deferred.clear();
+		for(const std::shared_ptr<CollabVMUser>& user : users) {
+			if(!user->display_priority)
+				deferred.push_back(user.get());
+			else if(const auto* message = SelectMessage(messages, *user, scaled))
+				sink.SendGuacMessage(*user, *message);
+		}
+		for(const CollabVMUser* user : deferred) {
+			if(const auto* message = SelectMessage(messages, *user, scaled))
+				sink.SendGuacMessage(*user, *message);
+		}
+	};
+
+	std::shared_ptr<const UserList::Snapshot> snapshot = users_.GetSnapshot();
+
+	// The bytes are counted here because the shards could still be
+	// sending after the VM's controller, and its metrics, are gone
+	uint64_t bytes = 0;
+	for(const std::shared_ptr<CollabVMUser>& user : *snapshot) {
+		if(const auto* message = SelectMessage(messages, *user, scaled_))
+			bytes += (*message)->data.size();
+	}
+	sent_bytes_.Add(bytes);
+
+	std::lock_guard<std::mutex> lock(shards_mutex_);
+
+	// Small rooms are sent to directly. Once a room has been sharded it stays
+	// that way, so a direct broadcast can never overtake messages still queued
+	// on a shard. Messages written to a single user go through SendInOrder().
+	if(snapshot->size() < kMinShardedUsers && !sharded_snapshot_) {
+		send(*snapshot);
+		return;
+	}
+
+	if(snapshot != sharded_snapshot_)
+		UpdateShards(snapshot);
+
+	// Hand the messages to each shard, the users are sent to from the io_context.
+	// A user always stays in the same shard to keep their messages in order, so
+	// the shards with the turn holder or an admin are posted first instead
+	auto has_priority = [](const std::shared_ptr<CollabVMUser>& user) { return user->display_priority.load(); };
+	std::vector<Shard*> deferred;
+	for(Shard& shard : shards_) {
+		if(shard.users->empty())
+			continue;
+		if(std::any_of(shard.users->begin(), shard.users->end(), has_priority))
+			net::post(shard.strand, [send, users = shard.users]() { send(*users); });
+		else
+			deferred.push_back(&shard);
+	}
+	for(Shard* shard : deferred)
+		net::post(shard->strand, [send, users = shard->users]() { send(*users); });
+}
 
-		// This really shouldn't happen, but if it does, it does.
-		if(user.guac_user != nullptr)
-			server_.SendGuacMessage(user.guac_user->socket_.websocket_handle_, str);
-	});
+void GuacBroadcastSocket::SendInOrder(const CollabVMUser& user, std::function<void()> send) {
+	std::lock_guard<std::mutex> lock(shards_mutex_);
+	if(!sharded_snapshot_) {
+		send();
+		return;
+	}
+	net::post(shards_[GetShardIndex(user)].strand, std::move(send));
 }
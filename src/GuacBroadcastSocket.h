@@ -1,8 +1,32 @@
 #pragma once
+#include "FrameTrace.h"
 #include "GuacSocket.h"
+#include "Metrics.h"
 #include "UserList.h"
 
-class CollabVMServer;
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <websocketmm/fwd.h>
+#include <websocketmm/beast/net.h>
+
+class CollabVMUser;
+class SessionRecorder;
+
+/**
+ * Where a GuacBroadcastSocket delivers each user's messages. The server
+ * sends them over the users' websockets, the fan-out benchmark counts them.
+ * Must outlive the sockets that use it, since the shards can still be
+ * sending after a socket is gone.
+ */
+class GuacMessageSink {
+   public:
+	virtual ~GuacMessageSink() = default;
+
+	virtual void SendGuacMessage(const CollabVMUser& user, const std::shared_ptr<const websocketmm::websocket_message>& message) = 0;
+};
 
 /**
  * A socket used for broadcasting an instruction to all of the users
@@ -10,12 +34,283 @@ class CollabVMServer;
  */
 class GuacBroadcastSocket : public GuacSocket {
    public:
-	GuacBroadcastSocket(CollabVMServer& server, UserList& users);
+	/**
+	 * @param context Runs the sends of the shards, in rooms large enough
+	 *                to be sharded.
+	 * @param sent_bytes Counts the bytes of the messages sent to the users.
+	 * @param scaled Whether the socket broadcasts to the users of the scaled
+	 *               down display, instead of to everyone else.
+	 */
+	GuacBroadcastSocket(GuacMessageSink& sink, net::io_context& context, UserList& users, MetricCounter& sent_bytes,
+						bool scaled = false);
+
+	/**
+	 * Gets the io_context that the shards of every socket send from. Its
+	 * threads are started the first time it's used and run until the
+	 * server exits.
+	 */
+	static net::io_context& GetShardService();
 
 	void InstructionBegin() override;
 	void InstructionEnd() override;
 
+	/**
+	 * Starts a frame. Every instruction written until EndFrame() is called
+	 * is buffered and sent to the users as a single websocket message.
+	 */
+	void BeginFrame();
+
+	/**
+	 * Ends the current frame and broadcasts all of the instructions
+	 * that were written since BeginFrame() was called.
+	 *
+	 * @param trace The trace of the frame, which is attached to its
+	 *              messages, or null if it isn't traced.
+	 */
+	void EndFrame(std::shared_ptr<FrameTrace> trace = nullptr);
+
+	/**
+	 * Called when a user that accepts binary image data is added or removed.
+	 * The binary version of instructions is only built while there are such users.
+	 */
+	inline void AddBinaryUser() {
+		binary_users_++;
+	}
+
+	inline void RemoveBinaryUser() {
+		binary_users_--;
+	}
+
+	/**
+	 * Called when a user that supports WebP images is added or removed.
+	 */
+	inline void AddWebPUser() {
+		webp_users_++;
+	}
+
+	inline void RemoveWebPUser() {
+		webp_users_--;
+	}
+
+	/**
+	 * Images are only broadcast as WebP when all of the users support it,
+	 * since every user is sent the same instructions.
+	 */
+	bool IsWebP() override;
+
+	/**
+	 * Called when a user that supports the screen codec is added or removed,
+	 * and when one that can also decompress it with zstd is.
+	 */
+	inline void AddScreenCodecUser() {
+		screen_codec_users_++;
+	}
+
+	inline void RemoveScreenCodecUser() {
+		screen_codec_users_--;
+	}
+
+	inline void AddScreenCodecZstdUser() {
+		screen_codec_zstd_users_++;
+	}
+
+	inline void RemoveScreenCodecZstdUser() {
+		screen_codec_zstd_users_--;
+	}
+
+	/**
+	 * Like WebP, the screen codec and zstd are only used when all of the
+	 * users support them.
+	 */
+	bool IsScreenCodec() override;
+	bool IsScreenCodecZstd() override;
+
+	/**
+	 * Called when a user that supports video streams is added or removed.
+	 */
+	inline void AddVideoUser() {
+		video_users_++;
+	}
+
+	inline void RemoveVideoUser() {
+		video_users_--;
+	}
+
+	/**
+	 * Like WebP, video is only broadcast when all of the users support it.
+	 */
+	bool IsVideo() override;
+
+	/**
+	 * Called when a user is moved into or out of the reduced quality tier.
+	 */
+	inline void AddReducedUser() {
+		reduced_users_++;
+	}
+
+	inline void RemoveReducedUser() {
+		reduced_users_--;
+	}
+
+	bool HasReducedTier() override;
+
+	/**
+	 * Sets the recorder that the text version of every message is also
+	 * given to, or stops recording if it's null.
+	 */
+	void SetRecorder(std::shared_ptr<SessionRecorder> recorder);
+
+	/**
+	 * Sets whether the instructions written outside of a frame until it's
+	 * called again replace the ones that were, like the position of the
+	 * cursor, so a user that falls behind is only sent the latest.
+	 */
+	void SetSuperseding(bool superseding);
+
+	/**
+	 * Gets the number of bytes of full quality text messages that were
+	 * built since it was last called, which every viewer outside the
+	 * reduced tier is sent.
+	 */
+	uint64_t TakeBuiltBytes();
+
+	/**
+	 * Runs a function that sends one user messages of its own, such as its
+	 * copy of the display, once the broadcasts before it have been sent to
+	 * the user. In a sharded room it's posted to the user's shard, behind
+	 * the broadcasts still queued there, which would otherwise be applied
+	 * on top of its messages.
+	 */
+	void SendInOrder(const CollabVMUser& user, std::function<void()> send);
+
    private:
-	CollabVMServer& server_;
+	/**
+	 * The versions of a message for each kind of user. Each one is null
+	 * if it would be the same as the text message.
+	 */
+	struct Messages {
+		std::shared_ptr<const websocketmm::websocket_message> text;
+		std::shared_ptr<const websocketmm::websocket_message> binary;
+		std::shared_ptr<const websocketmm::websocket_message> reduced_text;
+		std::shared_ptr<const websocketmm::websocket_message> reduced_binary;
+	};
+
+	/**
+	 * Builds the text message, and the other versions that differ, from the buffers.
+	 * Must be called with mutex_ locked.
+	 */
+	void BuildMessages(Messages& messages, const std::shared_ptr<FrameTrace>& trace = nullptr, bool superseding = false);
+
+	/**
+	 * Sends a message containing instructions to all of the users. Users of the
+	 * binary subprotocol are sent the binary version instead, if there is one,
+	 * and users in the reduced quality tier the reduced versions.
+	 */
+	void Broadcast(const Messages& messages);
+
+	/**
+	 * Gets the version of the messages that a user is sent,
+	 * or null if they aren't sent the messages of this socket.
+	 */
+	static const std::shared_ptr<const websocketmm::websocket_message>* SelectMessage(const Messages& messages, const CollabVMUser& user, bool scaled);
+
+	/**
+	 * A group of viewers whose messages are sent from the io_context
+	 * instead of the thread that wrote the instructions. A user always
+	 * belongs to the same shard, and each shard runs on its own strand,
+	 * so the order of the messages each user receives is preserved.
+	 */
+	struct Shard {
+		explicit Shard(net::io_context& context)
+			: strand(net::make_strand(context)) {
+		}
+
+		net::strand<net::io_context::executor_type> strand;
+		std::shared_ptr<const UserList::Snapshot> users;
+	};
+
+	/**
+	 * Partitions the users in the snapshot between the shards.
+	 * Must be called with shards_mutex_ locked.
+	 */
+	void UpdateShards(const std::shared_ptr<const UserList::Snapshot>& snapshot);
+
+	/**
+	 * Gets the shard that a user belongs to. Hashing the user's address
+	 * keeps them in the same shard no matter who else joins or leaves.
+	 */
+	size_t GetShardIndex(const CollabVMUser& user) const {
+		return std::hash<const CollabVMUser*>()(&user) % shards_.size();
+	}
+
+	/**
+	 * Rooms with fewer users than this are sent to directly, since
+	 * posting to the shards would cost more than the sends themselves.
+	 */
+	constexpr static size_t kMinShardedUsers = 32;
+
+	GuacMessageSink& sink_;
 	UserList& users_;
-};
\ No newline at end of file
+	MetricCounter& sent_bytes_;
+	const bool scaled_;
+
+	std::vector<Shard> shards_;
+
+	/**
+	 * The snapshot that shards_ was last partitioned from.
+	 */
+	std::shared_ptr<const UserList::Snapshot> sharded_snapshot_;
+
+	/**
+	 * Guards shards_ and sharded_snapshot_.
+	 */
+	std::mutex shards_mutex_;
+
+	/**
+	 * Whether instructions are currently being buffered into a frame.
+	 * Guarded by mutex_.
+	 */
+	bool frame_mode_;
+
+	/**
+	 * Guarded by mutex_.
+	 */
+	bool superseding_;
+
+	/**
+	 * The bytes counted for TakeBuiltBytes(). Guarded by mutex_.
+	 */
+	uint64_t built_bytes_;
+
+	/**
+	 * The number of users that accept binary image data.
+	 */
+	std::atomic<int> binary_users_;
+
+	/**
+	 * The number of users that support WebP images.
+	 */
+	std::atomic<size_t> webp_users_;
+
+	/**
+	 * The number of users that support the screen codec, and the number of
+	 * those that can also decompress it with zstd.
+	 */
+	std::atomic<size_t> screen_codec_users_;
+	std::atomic<size_t> screen_codec_zstd_users_;
+
+	/**
+	 * The number of users that support video streams.
+	 */
+	std::atomic<size_t> video_users_;
+
+	/**
+	 * The number of users in the reduced quality tier.
+	 */
+	std::atomic<int> reduced_users_;
+
+	/**
+	 * Guarded by mutex_.
+	 */
+	std::shared_ptr<SessionRecorder> recorder_;
+};
@@ -1,9 +1,6 @@
 #include "GuacClient.h"
 #include "CollabVM.h"
 #include "VMControllers/VMController.h"
-#include "guacamole/vnc/settings.h"
-//#include "guacamole/vnc/user.h"
-//#include "guacamole/vnc/vnc.h"
 #include "guacamole/client-constants.h"
 #include "guacamole/user-constants.h"
 #include "guacamole/user-handlers.h"
@@ -20,13 +17,15 @@ GuacClient::GuacClient(CollabVMServer& server, VMController& controller, UserLis
 	: controller_(controller),
 	  users_(users),
 	  client_state_(ClientState::kStopped),
-	  broadcast_socket_(server, users),
+	  broadcast_socket_(server, GuacBroadcastSocket::GetShardService(), users, controller.GetMetrics().sent_bytes),
+	  scaled_socket_(server, GuacBroadcastSocket::GetShardService(), users, controller.GetMetrics().sent_bytes, true),
 	  hostname_(hostname),
 	  port_(port),
 	  frame_duration_(frame_duration),
 	  last_sent_timestamp(0),
 	  //users_(NULL),
 	  connected_users_(0),
+	  scaled_users_(0),
 	  __buffer_pool(NULL),
 	  __layer_pool(NULL),
 	  update_thumbnail_(true) {
@@ -75,7 +74,7 @@ void GuacClient::Connect() {
 		return;
 	client_state_ = ClientState::kConnecting;
 	lock.unlock();
-	state_wait_.notify_all();
+	OnStateChanged();
 }
 
 void GuacClient::Disconnect() {
@@ -84,11 +83,29 @@ void GuacClient::Disconnect() {
 		return;
 	client_state_ = ClientState::kDisconnecting;
 	lock.unlock();
-	state_wait_.notify_all();
+	OnStateChanged();
 }
 
 void GuacClient::AddUser(GuacUser& user) {
 	user.client_ = this;
+
+	// Users of the scaled display still count towards the formats of the
+	// full one, so that adding them doesn't change how it's encoded
+	if(user.scaled_display_) {
+		scaled_users_++;
+		if(user.socket_.IsBinary())
+			scaled_socket_.AddBinaryUser();
+	}
+	if(user.socket_.IsBinary())
+		broadcast_socket_.AddBinaryUser();
+	if(user.socket_.IsWebP())
+		broadcast_socket_.AddWebPUser();
+	if(user.socket_.IsScreenCodec())
+		broadcast_socket_.AddScreenCodecUser();
+	if(user.socket_.IsScreenCodecZstd())
+		broadcast_socket_.AddScreenCodecZstdUser();
+	if(user.socket_.IsVideo())
+		broadcast_socket_.AddVideoUser();
 	//user.active = true;
 
 	// Call the user join handler if the client is already connected
@@ -99,6 +116,62 @@ void GuacClient::AddUser(GuacUser& user) {
 
 void GuacClient::RemoveUser(GuacUser& user) {
 	OnUserLeave(user);
+
+	if(user.socket_.IsBinary())
+		broadcast_socket_.RemoveBinaryUser();
+	if(user.socket_.IsWebP())
+		broadcast_socket_.RemoveWebPUser();
+	if(user.socket_.IsScreenCodec())
+		broadcast_socket_.RemoveScreenCodecUser();
+	if(user.socket_.IsScreenCodecZstd())
+		broadcast_socket_.RemoveScreenCodecZstdUser();
+	if(user.socket_.IsVideo())
+		broadcast_socket_.RemoveVideoUser();
+	if(user.scaled_display_) {
+		scaled_users_--;
+		if(user.socket_.IsBinary())
+			scaled_socket_.RemoveBinaryUser();
+	}
+	SetReducedQuality(user, false);
+}
+
+void GuacClient::ResyncUser(GuacUser& user) {
+	lock_guard<mutex> state_lock(state_mutex_);
+	if(client_state_ == ClientState::kConnected)
+		OnUserJoin(user);
+}
+
+void GuacClient::SetReducedQuality(GuacUser& user, bool reduced) {
+	if(user.reduced_quality_ == reduced)
+		return;
+	user.reduced_quality_ = reduced;
+	GuacBroadcastSocket& socket = user.scaled_display_ ? scaled_socket_ : broadcast_socket_;
+	if(reduced)
+		socket.AddReducedUser();
+	else
+		socket.RemoveReducedUser();
+}
+
+void GuacClient::SetScaledDisplay(GuacUser& user, bool scaled) {
+	if(user.scaled_display_ == scaled)
+		return;
+
+	// The user's tier is counted by the socket it's sent
+	bool reduced = user.reduced_quality_;
+	SetReducedQuality(user, false);
+	if(scaled) {
+		scaled_users_++;
+		if(user.socket_.IsBinary())
+			scaled_socket_.AddBinaryUser();
+	} else {
+		scaled_users_--;
+		if(user.socket_.IsBinary())
+			scaled_socket_.RemoveBinaryUser();
+	}
+	user.scaled_display_ = scaled;
+	SetReducedQuality(user, reduced);
+
+	ResyncUser(user);
 }
 
 void GuacClient::OnConnect() {
@@ -126,7 +199,7 @@ guac_layer* GuacClient::AllocLayer() {
 
 void GuacClient::FreeLayer(guac_layer* layer) {
 	/* Release index to pool */
-	guac_pool_free_int(__layer_pool, layer->index);
+	guac_pool_free_int(__layer_pool, layer->index - 1);
 
 	/* Free layer */
 	free(layer);
@@ -251,19 +324,12 @@ void GuacClient::HandleSync(GuacUser& user, std::vector<char*>& args) {
 	//	user.sync_handler(user, timestamp);
 }
 
-void GuacClient::HandleMouse(GuacUser& user, std::vector<char*>& args) {
-	if(args.size() == 3)
-		MouseHandler(user,
-					 atoi(args[0]), /* x */
-					 atoi(args[1]), /* y */
-					 atoi(args[2]) /* mask */);
+void GuacClient::HandleMouse(GuacUser& user, int x, int y, int button_mask) {
+	MouseHandler(user, x, y, button_mask);
 }
 
-void GuacClient::HandleKey(GuacUser& user, std::vector<char*>& args) {
-	if(args.size() == 2)
-		KeyHandler(user,
-				   atoi(args[0]), /* keysym */
-				   atoi(args[1]) /* pressed */);
+void GuacClient::HandleKey(GuacUser& user, int keysym, int pressed) {
+	KeyHandler(user, keysym, pressed);
 }
 
 void GuacClient::HandleClipboard(GuacUser& user, std::vector<char*>& args) {
@@ -12,7 +12,6 @@
 #include <mutex>
 #include <thread>
 #include <vector>
-#include <condition_variable>
 #include <atomic>
 
 class CollabVMServer;
@@ -61,6 +60,26 @@ class GuacClient {
 
 	virtual void SetEndpoint(const std::string& hostname, uint16_t port);
 
+	/**
+	 * Starts recording the display to a file that can be replayed with
+	 * collab-vm-replay, or stops recording if the path is empty.
+	 *
+	 * @return Whether the client can record its display.
+	 */
+	virtual bool SetRecording(const std::string& path) {
+		return false;
+	}
+
+	/**
+	 * Starts recording the instructions sent to the viewers, to files
+	 * that start with the prefix, or stops recording if it's empty.
+	 *
+	 * @return Whether the client can record its sessions.
+	 */
+	virtual bool SetSessionRecording(const std::string& prefix) {
+		return false;
+	}
+
 	/**
 	* Disconnects all users and frees any resources used
 	* by the controller. This function is called from the processing thread to
@@ -88,6 +107,24 @@ class GuacClient {
 	 */
 	void RemoveUser(GuacUser& user);
 
+	/**
+	 * Send the entire display to a user again, after
+	 * display updates were dropped for them.
+	 */
+	void ResyncUser(GuacUser& user);
+
+	/**
+	 * Moves the user into or out of the reduced quality tier, whose users
+	 * are sent lossy images at a lower quality than everyone else.
+	 */
+	void SetReducedQuality(GuacUser& user, bool reduced);
+
+	/**
+	 * Moves the user to or from the scaled down display, and sends it the
+	 * display it's switched to. The user's CollabVMUser must be switched first.
+	 */
+	void SetScaledDisplay(GuacUser& user, bool scaled);
+
 	/**
 	 * Returns true if the client is connected.
 	 */
@@ -115,8 +152,8 @@ class GuacClient {
 	 * User instruction handlers
 	 */
 	void HandleSync(GuacUser& user, std::vector<char*>& args);
-	void HandleMouse(GuacUser& user, std::vector<char*>& args);
-	void HandleKey(GuacUser& user, std::vector<char*>& args);
+	void HandleMouse(GuacUser& user, int x, int y, int button_mask);
+	void HandleKey(GuacUser& user, int keysym, int pressed);
 	void HandleClipboard(GuacUser& user, std::vector<char*>& args);
 	//void HandleFile(GuacUser& user, std::vector<char*>& args);
 	//void HandlePipe(GuacUser& user, std::vector<char*>& args);
@@ -135,6 +172,25 @@ class GuacClient {
 
 	GuacBroadcastSocket broadcast_socket_;
 
+	/**
+	 * Broadcasts to the users of the scaled down display, which is the
+	 * screen at a fraction of its size for viewers with small screens.
+	 */
+	GuacBroadcastSocket scaled_socket_;
+
+	/**
+	 * The number the screen's size is divided by for the scaled down display.
+	 */
+	constexpr static int kScaledDisplayDivisor = 2;
+
+	inline bool HasScaledUsers() const {
+		return scaled_users_ > 0;
+	}
+
+	inline size_t GetScaledUserCount() const {
+		return scaled_users_;
+	}
+
 	/**
 	* The time (in milliseconds) that the last sync message was sent to the
 	* client.
@@ -171,6 +227,12 @@ class GuacClient {
 	 */
 	virtual void ClipboardHandler(GuacUser& user, guac_stream* stream, char* mimetype) = 0;
 
+	/**
+	* Called after Connect() or Disconnect() changes the state, so that
+	* derived classes can open or close their connection.
+	*/
+	virtual void OnStateChanged() = 0;
+
 	/**
 	* Called by derived classes when a connection is made to the server.
 	*/
@@ -189,7 +251,6 @@ class GuacClient {
 	*/
 	ClientState client_state_;
 	std::mutex state_mutex_;
-	std::condition_variable state_wait_;
 
 	/**
 	* The first user within the list of all connected users, or NULL if no
@@ -220,6 +281,12 @@ class GuacClient {
 	 */
 	int connected_users_;
 
+	/**
+	 * The number of users of the scaled down display, which is only
+	 * drawn while there are some.
+	 */
+	std::atomic<size_t> scaled_users_;
+
 	/**
 	 * Pool of buffer indices. Buffers are simply layers with negative indices.
 	 * Note that because guac_pool always gives non-negative indices starting
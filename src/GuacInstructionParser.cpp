@@ -1,5 +1,10 @@
 #include "GuacInstructionParser.h"
 #include "CollabVM.h"
+#include "GuacClient.h"
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <iterator>
 #include <vector>
 
 //#include <functional>
@@ -11,115 +16,191 @@ namespace GuacInstructionParser {
 		CollabVMServer::GuacamoleInstruction handler;
 	};
 
+	// The mouse and key instructions are handled separately by ParseInstruction
 	constexpr static Instruction instructions[] = {
-		// Guacamole instructions
-		{ "mouse", &CollabVMServer::OnMouseInstruction },
-		{ "key", &CollabVMServer::OnKeyInstruction },
-
 		// Custom instructions
 		{ "rename", &CollabVMServer::OnRenameInstruction },
 		{ "connect", &CollabVMServer::OnConnectInstruction },
 		{ "chat", &CollabVMServer::OnChatInstruction },
 		{ "turn", &CollabVMServer::OnTurnInstruction },
 		{ "admin", &CollabVMServer::OnAdminInstruction },
-		{ "nop", &CollabVMServer::OnNopInstruction },
 		{ "list", &CollabVMServer::OnListInstruction },
 		{ "vote", &CollabVMServer::OnVoteInstruction },
-		{ "file", &CollabVMServer::OnFileInstruction }
+		{ "file", &CollabVMServer::OnFileInstruction },
+		{ "keyframe", &CollabVMServer::OnKeyframeInstruction },
+		{ "visibility", &CollabVMServer::OnVisibilityInstruction },
+		{ "viewport", &CollabVMServer::OnViewportInstruction }
 	};
 
-	//constexpr size_t instruction_count = sizeof(instructions)/sizeof(Instruction);
+	constexpr size_t OPCODE_TABLE_SIZE = 32;
 
 	/**
-	 * Max element size of a Guacamole element.
+	 * Hashes an opcode using its length and first and last characters,
+	 * which is enough to tell all of the opcodes apart.
 	 */
-	constexpr std::uint64_t MAX_GUAC_ELEMENT_LENGTH = 3450;
+	constexpr size_t HashOpcode(std::string_view opcode) {
+		return (opcode.length() + static_cast<unsigned char>(opcode[0]) +
+				static_cast<unsigned char>(opcode.back())) % OPCODE_TABLE_SIZE;
+	}
 
 	/**
-	 * Max size of a Guacamole frame.
+	 * Builds a table that maps the hash of each opcode to its
+	 * index in instructions[] plus one, or 0 for unused hashes.
 	 */
-	constexpr std::uint64_t MAX_GUAC_FRAME_LENGTH = 6144;
+	constexpr std::array<std::uint8_t, OPCODE_TABLE_SIZE> BuildOpcodeTable() {
+		std::array<std::uint8_t, OPCODE_TABLE_SIZE> table {};
+		for(size_t i = 0; i < std::size(instructions); i++)
+			table[HashOpcode(instructions[i].opcode)] = static_cast<std::uint8_t>(i + 1);
+		return table;
+	}
 
-	/**
-	 * Decode an instruction from a string.
-	 * \param[in] input input guacamole string to decode
-	 */
-	static std::vector<std::string> DecodeInstruction(const std::string& input) {
-		std::vector<std::string> output;
-		if(input.back() != ';')
-			return output;
+	constexpr std::array<std::uint8_t, OPCODE_TABLE_SIZE> opcode_table = BuildOpcodeTable();
 
-		if(input.empty() || input.length() >= MAX_GUAC_FRAME_LENGTH)
-			return output;
+	constexpr bool IsPerfectHash() {
+		for(size_t i = 0; i < std::size(instructions); i++)
+			if(opcode_table[HashOpcode(instructions[i].opcode)] != i + 1)
+				return false;
+		return true;
+	}
 
-		std::istringstream iss { input };
+	static_assert(IsPerfectHash(), "Two opcodes have the same hash, HashOpcode() needs to be changed");
 
-		while(iss) {
-			unsigned long long length { 0 };
-			iss >> length;
+	/**
+	 * Max element size of a Guacamole element.
+	 */
+	constexpr std::uint64_t MAX_GUAC_ELEMENT_LENGTH = 3450;
 
-			if(!iss)
-				return std::vector<std::string>();
+	/**
+	 * Max size of a Guacamole frame.
+	 */
+	constexpr std::uint64_t MAX_GUAC_FRAME_LENGTH = 6144;
 
-			// Ignore weird elements that could be an attempt to crash the server
-			if(length >= MAX_GUAC_ELEMENT_LENGTH || length >= input.length())
-				return std::vector<std::string>();
+	size_t DecodeInstruction(std::string_view input, std::array<std::string_view, MAX_GUAC_ELEMENTS>& elements) {
+		if(input.empty() || input.length() >= MAX_GUAC_FRAME_LENGTH || input.back() != ';')
+			return 0;
+
+		size_t count = 0;
+		size_t pos = 0;
+		while(true) {
+			// Read the length of the element
+			std::uint64_t length { 0 };
+			size_t digits = pos;
+			while(pos < input.length() && input[pos] >= '0' && input[pos] <= '9') {
+				length = length * 10 + (input[pos++] - '0');
+
+				// Ignore weird elements that could be an attempt to crash the server
+				if(length >= MAX_GUAC_ELEMENT_LENGTH)
+					return 0;
+			}
 
 			// Ignore if there is no period separating data.
-			if(iss.peek() != '.')
-				return std::vector<std::string>();
+			if(pos == digits || pos == input.length() || input[pos] != '.')
+				return 0;
+			pos++;
 
-			iss.get(); // remove the period
+			// There has to be room for the content and a separator after it
+			if(length >= input.length() - pos || count == elements.size())
+				return 0;
 
-			// Read content
-			std::vector<char> content(length + 1, '\0'); // Is there a reason this can't be a string?
-			iss.read(content.data(), static_cast<std::streamsize>(length));
-			output.emplace_back(content.data(), length); // Safe code(TM)
+			elements[count++] = input.substr(pos, length);
+			pos += length;
 
-			const char& separator = iss.peek();
+			const char separator = input[pos++];
 			if(separator != ',') {
-				// If the instruction is ending return output
+				// If the instruction is ending return the elements
 				if(separator == ';')
-					return output;
+					return count;
 
-				// Otherwise, this is probably an fuzz attempt,
-				// so fuck you!
-				return std::vector<std::string>();
+				// Otherwise, this is probably an fuzz attempt
+				return 0;
 			}
-
-			// Eat the character we peeked.
-			// I don't see much of the point of this.
-			iss.get();
 		}
-		//
-		return std::vector<std::string>();
 	}
 
-	void ParseInstruction(CollabVMServer& server, const std::shared_ptr<CollabVMUser>& user, const std::string& instruction) {
-		std::vector<std::string> decoded = DecodeInstruction(instruction);
-		if(decoded.empty())
+	/**
+	 * Parses an integer argument the same way atoi() would,
+	 * where invalid arguments are 0.
+	 */
+	static int ParseInt(std::string_view arg) {
+		int value = 0;
+		std::from_chars(arg.data(), arg.data() + arg.length(), value);
+		return value;
+	}
+
+	bool IsInputInstruction(std::string_view instruction) {
+		return instruction.compare(0, 8, "5.mouse,") == 0 || instruction.compare(0, 6, "3.key,") == 0;
+	}
+
+	void ParseInput(GuacClient& client, GuacUser& user, std::string_view instruction) {
+		std::array<std::string_view, MAX_GUAC_ELEMENTS> decoded;
+		size_t count = DecodeInstruction(instruction, decoded);
+
+		if(count == 4 && decoded[0] == "mouse")
+			client.HandleMouse(user,
+							   ParseInt(decoded[1]), /* x */
+							   ParseInt(decoded[2]), /* y */
+							   ParseInt(decoded[3]) /* mask */);
+		else if(count == 3 && decoded[0] == "key")
+			client.HandleKey(user,
+							 ParseInt(decoded[1]), /* keysym */
+							 ParseInt(decoded[2]) /* pressed */);
+	}
+
+	void ParseInstruction(CollabVMServer& server, const std::shared_ptr<CollabVMUser>& user, std::string_view instruction) {
+		std::array<std::string_view, MAX_GUAC_ELEMENTS> decoded;
+		size_t count = DecodeInstruction(instruction, decoded);
+		if(count == 0)
 			return;
 
-		for(auto& inst : instructions) {
-			if(!std::strncmp(inst.opcode, decoded[0].data(), decoded[0].length())) {
-				auto argument_conv = std::vector<char*>();
-
-				// Only bother taking this branch if we need to.
-				if(decoded.size() > 1) {
-					auto argument_begin = &decoded[1]; // this is a bit crumby
-					argument_conv.resize(decoded.size() - 1);
-
-					// since the std::string lifetime is managed by us,
-					// simply just copy pointers. MAJOR code smell, these should
-					// just be taking vector<string_view> or something
-					for(size_t j = 0; j < decoded.size() - 1; ++j)
-						argument_conv[j] = argument_begin[j].data();
-				}
-
-				// Call the instruction handler
-				(server.*(inst.handler))(user, argument_conv);
-				argument_conv.clear();
-			}
+		std::string_view opcode = decoded[0];
+
+		// A relay's display connection has no username, so it can only
+		// join a VM and ask for the display again
+		if(user->relay_role == RelayRole::kDisplay && opcode != "connect" && opcode != "keyframe")
+			return;
+
+		// Mouse and key instructions are sent far more often than any other,
+		// so their arguments are parsed straight from the decoded elements
+		if(opcode == "mouse") {
+			if(count == 4)
+				server.OnMouseInstruction(user,
+										  ParseInt(decoded[1]), /* x */
+										  ParseInt(decoded[2]), /* y */
+										  ParseInt(decoded[3]) /* mask */);
+			return;
 		}
+
+		if(opcode == "key") {
+			if(count == 3)
+				server.OnKeyInstruction(user,
+										ParseInt(decoded[1]), /* keysym */
+										ParseInt(decoded[2]) /* pressed */);
+			return;
+		}
+
+		if(opcode.empty())
+			return;
+
+		std::uint8_t index = opcode_table[HashOpcode(opcode)];
+		if(index == 0 || opcode != instructions[index - 1].opcode)
+			return;
+
+		// The handlers expect NUL-terminated arguments, so the instruction is
+		// copied once into a buffer that's reused by every instruction, and the
+		// separator after each argument is replaced with a terminator.
+		// Instructions are only parsed on the processing thread.
+		static thread_local std::vector<char> buffer;
+		static thread_local std::vector<char*> arguments;
+
+		buffer.assign(instruction.begin(), instruction.end());
+		arguments.clear();
+		for(size_t i = 1; i < count; i++) {
+			size_t offset = decoded[i].data() - instruction.data();
+			buffer[offset + decoded[i].length()] = '\0';
+			arguments.push_back(buffer.data() + offset);
+		}
+
+		// Call the instruction handler
+		(server.*(instructions[index - 1].handler))(user, arguments);
 	}
 } // namespace GuacInstructionParser
@@ -1,8 +1,25 @@
 #pragma once
-#include <string>
+#include <array>
+#include <string_view>
 #include "CollabVMUser.h"
 
+class GuacClient;
+class GuacUser;
+
 namespace GuacInstructionParser {
+	/**
+	 * Max number of elements in a Guacamole instruction, including the opcode.
+	 */
+	constexpr size_t MAX_GUAC_ELEMENTS = 128;
+
+	/**
+	 * Decode an instruction into views of each of its elements, without copying them.
+	 * \param[in] input input guacamole string to decode
+	 * \param[out] elements receives the opcode followed by each argument
+	 * \return the number of elements decoded, or 0 if the instruction is invalid
+	 */
+	size_t DecodeInstruction(std::string_view input, std::array<std::string_view, MAX_GUAC_ELEMENTS>& elements);
+
 	/**
 	 * Parses the instruction from a Guacamole webclient and calls the
 	 * handler for it.
@@ -10,5 +27,19 @@ namespace GuacInstructionParser {
 	 * @param data The connection data belonging to the client that sent the instruction.
 	 * @param instruction The instruction to parse.
 	 */
-	void ParseInstruction(CollabVMServer& server, const std::shared_ptr<CollabVMUser>& user, const std::string& instruction);
+	void ParseInstruction(CollabVMServer& server, const std::shared_ptr<CollabVMUser>& user, std::string_view instruction);
+
+	/**
+	 * Whether the instruction is a mouse or key instruction, judging by its opcode.
+	 */
+	bool IsInputInstruction(std::string_view instruction);
+
+	/**
+	 * Parses a mouse or key instruction and sends it straight to a
+	 * Guacamole client, without checking whether the user may send input.
+	 * @param client The Guacamole client to send the input to.
+	 * @param user The Guacamole user that sent the instruction.
+	 * @param instruction The instruction to parse.
+	 */
+	void ParseInput(GuacClient& client, GuacUser& user, std::string_view instruction);
 } // namespace GuacInstructionParser
@@ -1,24 +1,111 @@
 #include "GuacSocket.h"
 
 GuacSocket::GuacSocket()
-	: base64_(ss_) {
+	: binary_enabled_(false),
+	  has_binary_data_(false),
+	  reduced_enabled_(false),
+	  has_reduced_data_(false),
+	  base64_(buffer_),
+	  reduced_base64_(reduced_buffer_) {
 }
 
 size_t GuacSocket::Write(const void* buf, size_t count) {
-	ss_.write((const char*)buf, count);
+	buffer_.Append(buf, count);
+	if(binary_enabled_)
+		binary_buffer_.Append(buf, count);
+	if(has_reduced_data_) {
+		reduced_buffer_.Append(buf, count);
+		if(binary_enabled_)
+			reduced_binary_buffer_.Append(buf, count);
+	}
 	return 0;
 }
 
 size_t GuacSocket::WriteInt(int64_t i) {
-	ss_ << i;
+	buffer_.AppendInt(i);
+	if(binary_enabled_)
+		binary_buffer_.AppendInt(i);
+	if(has_reduced_data_) {
+		reduced_buffer_.AppendInt(i);
+		if(binary_enabled_)
+			reduced_binary_buffer_.AppendInt(i);
+	}
 	return 0;
 }
 
 size_t GuacSocket::WriteString(const char* str) {
-	ss_ << str;
+	buffer_.Append(std::string_view(str));
+	if(binary_enabled_)
+		binary_buffer_.Append(std::string_view(str));
+	if(has_reduced_data_) {
+		reduced_buffer_.Append(std::string_view(str));
+		if(binary_enabled_)
+			reduced_binary_buffer_.Append(std::string_view(str));
+	}
 	return 0;
 }
 
+size_t GuacSocket::WriteImage(const void* buf, size_t count) {
+	return WriteImage(buf, count, buf, count);
+}
+
+size_t GuacSocket::WriteImage(const void* buf, size_t count, const void* reduced, size_t reduced_count) {
+	// The reduced buffers start as copies of the others, including
+	// the beginning of this instruction
+	if(reduced_enabled_ && !has_reduced_data_ && reduced != buf) {
+		reduced_buffer_.Append(buffer_.Data(), buffer_.Size());
+		if(binary_enabled_)
+			reduced_binary_buffer_.Append(binary_buffer_.Data(), binary_buffer_.Size());
+		has_reduced_data_ = true;
+	}
+
+	// Text version
+	buffer_.AppendInt((count + 2) / 3 * 4);
+	buffer_.Append('.');
+	base64_.WriteBase64(buf, count);
+	base64_.FlushBase64();
+
+	// Binary version
+	if(binary_enabled_) {
+		binary_buffer_.AppendInt(count);
+		binary_buffer_.Append('.');
+		binary_buffer_.Append(buf, count);
+		has_binary_data_ = true;
+	}
+
+	// Reduced versions
+	if(has_reduced_data_) {
+		reduced_buffer_.AppendInt((reduced_count + 2) / 3 * 4);
+		reduced_buffer_.Append('.');
+		reduced_base64_.WriteBase64(reduced, reduced_count);
+		reduced_base64_.FlushBase64();
+
+		if(binary_enabled_) {
+			reduced_binary_buffer_.AppendInt(reduced_count);
+			reduced_binary_buffer_.Append('.');
+			reduced_binary_buffer_.Append(reduced, reduced_count);
+		}
+	}
+
+	return 0;
+}
+
+void GuacSocket::ClearBuffers() {
+	buffer_.Clear();
+	binary_buffer_.Clear();
+	has_binary_data_ = false;
+	reduced_buffer_.Clear();
+	reduced_binary_buffer_.Clear();
+	has_reduced_data_ = false;
+}
+
+void GuacSocket::SetMaxRetained(size_t bytes) {
+	buffer_.SetMaxRetained(bytes);
+	binary_buffer_.SetMaxRetained(bytes);
+	reduced_buffer_.SetMaxRetained(bytes);
+	reduced_binary_buffer_.SetMaxRetained(bytes);
+}
+
 void GuacSocket::Flush() {
 	// Not used
 }
@@ -1,8 +1,18 @@
 #pragma once
-#include <sstream>
 #include <mutex>
+#include "ByteBuffer.h"
 #include "Base64.h"
 
+/**
+ * The WebSocket subprotocol for clients that accept image data in binary
+ * messages. Binary messages contain the same instructions as text messages,
+ * except that the image data of png instructions and of the blobs that follow
+ * img instructions is not base64 encoded, and its length prefix is the number
+ * of bytes rather than characters.
+ * Instructions without image data are still sent as text messages.
+ */
+#define GUAC_BINARY_SUBPROTOCOL "guacamole-binary"
+
 class GuacSocket {
    public:
 	virtual void InstructionBegin() = 0;
@@ -13,32 +23,151 @@ class GuacSocket {
 	size_t WriteString(const char* str);
 
 	inline size_t WriteBase64Byte(int buf) {
-		return base64_.WriteBase64Byte(buf);
+		size_t size = buffer_.Size();
+		size_t ret = base64_.WriteBase64Byte(buf);
+		MirrorBinary(size);
+		return ret;
 	}
 
 	inline size_t WriteBase64(const void* buf, size_t count) {
-		return base64_.WriteBase64(buf, count);
+		size_t size = buffer_.Size();
+		size_t ret = base64_.WriteBase64(buf, count);
+		MirrorBinary(size);
+		return ret;
 	}
 
 	inline size_t FlushBase64() {
-		return base64_.FlushBase64();
+		size_t size = buffer_.Size();
+		size_t ret = base64_.FlushBase64();
+		MirrorBinary(size);
+		return ret;
 	}
 
+	/**
+	 * Writes the length and data of an image argument. The data is base64
+	 * encoded in the text buffer and copied as it is to the binary buffer.
+	 */
+	size_t WriteImage(const void* buf, size_t count);
+
+	/**
+	 * Like WriteImage(), but the users in the reduced quality tier
+	 * are sent the reduced image instead.
+	 */
+	size_t WriteImage(const void* buf, size_t count, const void* reduced, size_t reduced_count);
+
 	void Flush();
 
 	/**
-	 * The stringstream buffer for instructions.
+	 * Whether every user receiving instructions from this socket
+	 * can decode WebP images.
 	 */
-	std::ostringstream ss_;
+	virtual bool IsWebP() {
+		return false;
+	}
+
+	/**
+	 * Whether every user receiving instructions from this socket can decode
+	 * images in the screen codec, and whether they can also decompress zstd.
+	 */
+	virtual bool IsScreenCodec() {
+		return false;
+	}
+
+	virtual bool IsScreenCodecZstd() {
+		return false;
+	}
 
 	/**
-	 * Mutex for stringstream.
+	 * Whether every user receiving instructions from this socket
+	 * can decode VP8 video streams.
+	 */
+	virtual bool IsVideo() {
+		return false;
+	}
+
+	/**
+	 * Whether some of the users receiving instructions from this socket
+	 * are in the reduced quality tier, so lossy images should also be
+	 * encoded at a lower quality for them.
+	 */
+	virtual bool HasReducedTier() {
+		return false;
+	}
+
+	/**
+	 * The buffer for instructions.
+	 */
+	ByteBuffer buffer_;
+
+	/**
+	 * Mutex for the instruction buffer.
 	 */
 	std::mutex mutex_;
 
    protected:
 	GuacSocket();
 
+	/**
+	 * Clears the text and binary buffers, and their reduced versions.
+	 */
+	void ClearBuffers();
+
+	/**
+	 * Limits the capacity each buffer keeps between instructions.
+	 */
+	void SetMaxRetained(size_t bytes);
+
+	/**
+	 * The buffer for the binary version of the instructions.
+	 * Only written to when binary_enabled_ is set.
+	 */
+	ByteBuffer binary_buffer_;
+
+	/**
+	 * Whether instructions should also be written to the binary buffer.
+	 */
+	bool binary_enabled_;
+
+	/**
+	 * Set when raw image data has been written to the binary buffer,
+	 * meaning it differs from the text buffer.
+	 */
+	bool has_binary_data_;
+
+	/**
+	 * The versions of the text and binary buffers for the reduced quality
+	 * tier. They're only written to once a reduced image has been, until
+	 * then they would be the same as the other buffers.
+	 */
+	ByteBuffer reduced_buffer_;
+	ByteBuffer reduced_binary_buffer_;
+
+	/**
+	 * Whether reduced images should be kept for the reduced quality tier.
+	 */
+	bool reduced_enabled_;
+
+	/**
+	 * Set when a reduced image has been written, meaning the reduced
+	 * buffers differ from the others.
+	 */
+	bool has_reduced_data_;
+
    private:
+	/**
+	 * Copies everything written to the text buffer after offset to the binary
+	 * buffer and the reduced buffers.
+	 */
+	inline void MirrorBinary(size_t offset) {
+		if(binary_enabled_)
+			binary_buffer_.Append(buffer_.Data() + offset, buffer_.Size() - offset);
+		if(has_reduced_data_) {
+			reduced_buffer_.Append(buffer_.Data() + offset, buffer_.Size() - offset);
+			if(binary_enabled_)
+				reduced_binary_buffer_.Append(buffer_.Data() + offset, buffer_.Size() - offset);
+		}
+	}
+
 	Base64 base64_;
-};
\ No newline at end of file
+	Base64 reduced_base64_;
+};
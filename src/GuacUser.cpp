@@ -2,10 +2,16 @@
 #include "GuacClient.h"
 #include "guacamole/user-constants.h"
 
-GuacUser::GuacUser(CollabVMServer* server, std::weak_ptr<websocketmm::websocket_user> handle)
+GuacUser::GuacUser(CollabVMServer* server, const CollabVMUser& owner, std::weak_ptr<websocketmm::websocket_user> handle)
 	: socket_(server, handle),
 	  client_(nullptr),
+	  owner_(owner),
+	  left_(false),
+	  relay_role_(RelayRole::kNone),
+	  scaled_display_(false),
+	  reduced_quality_(false),
 	  last_received_timestamp(guac_timestamp_current()),
+	  resume_timestamp_(0),
 	  last_frame_duration(0),
 	  processing_lag(0) {
 	//active(false)
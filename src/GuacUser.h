@@ -6,11 +6,31 @@
 #include "guacamole/pool-types.h"
 #include "guacamole/stream.h"
 #include "guacamole/client-types.h"
+#include <atomic>
 
 class CollabVMServer;
+class CollabVMUser;
 class GuacClient;
 class GuacWebSocket;
 
+/**
+ * How a connection that was opened by a relay gets the display.
+ */
+enum class RelayRole : uint8_t {
+	kNone,	  // Not opened by a relay
+	kDisplay, // The relay's connection for a VM's display, which it re-broadcasts to its viewers
+	kViewer	  // A viewer of the relay, which gets the display from the relay instead
+};
+
+/**
+ * What a read-only spectator connection is sent besides the display.
+ */
+enum class Spectator : uint8_t {
+	kNone,	  // Not a spectator
+	kDisplay, // Only the display and the VM's broadcasts
+	kChat	  // The chat as well
+};
+
 struct guac_user_info {
 	/**
 	 * The number of pixels the remote client requests for the display width.
@@ -59,7 +79,7 @@ class GuacUser {
 	friend class GuacVNCClient;
 
    public:
-	GuacUser(CollabVMServer* server, std::weak_ptr<websocketmm::websocket_user> handle);
+	GuacUser(CollabVMServer* server, const CollabVMUser& owner, std::weak_ptr<websocketmm::websocket_user> handle);
 
 	guac_stream* AllocStream();
 	void FreeStream(guac_stream* stream);
@@ -82,12 +102,50 @@ class GuacUser {
 	 */
 	GuacClient* client_;
 
+	/**
+	 * The connection the user belongs to, which picks the shard of the
+	 * broadcast sockets that the user is sent from.
+	 */
+	const CollabVMUser& owner_;
+
+	/**
+	 * Set when the user leaves its client, whose input handlers then ignore
+	 * the user's input that was already on its way from the websocket
+	 * threads. Guarded by the client's input mutex.
+	 */
+	bool left_;
+
+	/**
+	 * Whether the display is sent to this user by a relay, or this user is
+	 * a relay that needs to know where each full copy of the display starts.
+	 */
+	RelayRole relay_role_;
+
+	/**
+	 * Whether the user is sent the scaled down display, whose coordinates
+	 * are a fraction of the screen's. Can change while the user is
+	 * connected, when its viewport is zoomed out.
+	 */
+	std::atomic<bool> scaled_display_;
+
+	/**
+	 * Whether the user is in the reduced quality tier of its client.
+	 */
+	bool reduced_quality_;
+
 	/**
 	 * The time (in milliseconds) of receipt of the last sync message from
 	 * the user.
 	 */
 	guac_timestamp last_received_timestamp;
 
+	/**
+	 * The timestamp of the last frame the user applied before it resumed
+	 * its session on a new connection, so that it's only sent what changed
+	 * since then when it joins. Zero if the user didn't resume a session.
+	 */
+	guac_timestamp resume_timestamp_;
+
 	/**
 	 * The duration of the last frame rendered by the user, in milliseconds.
 	 * This duration will include network and processing lag, and thus should
@@ -2,7 +2,23 @@
 #include "VMControllers/VMController.h"
 #include "CollabVM.h"
 #include "guacamole/protocol.h"
+#include "EncoderPool.h"
+#include "Logger.h"
+#include "SIMD.h"
 #include <cairo/cairo.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#if defined(SIMD_X86)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #ifdef _WIN32
 	#define strdup _strdup
@@ -18,22 +34,440 @@ typedef std::chrono::time_point<steady_clock, milliseconds> time_point;
 
 void IgnorePipe();
 
+/**
+ * Gets the io_context that the connections of every client to their VNC
+ * servers are waited on and read from. Its threads are started the first
+ * time it's used and run until the server exits.
+ */
+static boost::asio::io_context& GetVNCService() {
+	static boost::asio::io_context* service = [] {
+		boost::asio::io_context* service = new boost::asio::io_context();
+		new boost::asio::io_context::work(*service);
+		size_t threads = std::max(2u, std::thread::hardware_concurrency());
+		for(size_t i = 0; i < threads; i++)
+			std::thread([service] {
+				IgnorePipe();
+				service->run();
+			}).detach();
+		return service;
+	}();
+	return *service;
+}
+
+std::atomic<bool> GuacVNCClient::share_framebuffer_(false);
+std::atomic<int> GuacVNCClient::mouse_interval_(0);
+
+void GuacVNCClient::SetShareFramebuffer(bool share) {
+	share_framebuffer_ = share;
+}
+
+void GuacVNCClient::SetMouseMoveRate(unsigned int rate) {
+	mouse_interval_ = rate ? 1000000 / rate : 0;
+}
+
+bool GuacVNCClient::ParseOverlays(const std::string& str, std::vector<guac_common_rect>& rects) {
+	rects.clear();
+	std::istringstream stream(str);
+	std::string area;
+	while(std::getline(stream, area, ';')) {
+		if(area.empty())
+			continue;
+
+		int x, y, w, h;
+		char extra;
+		if(std::sscanf(area.c_str(), "%d,%d,%d,%d%c", &x, &y, &w, &h, &extra) != 4 ||
+		   x < 0 || y < 0 || w <= 0 || h <= 0)
+			return false;
+
+		guac_common_rect rect;
+		guac_common_rect_init(&rect, x, y, w, h);
+		rects.push_back(rect);
+	}
+	return true;
+}
+
+bool GuacVNCClient::ParseLatencyProbe(const std::string& str, GuacVNCLatencyProbe& probe) {
+	probe = GuacVNCLatencyProbe();
+	if(str.empty())
+		return true;
+
+	int x, y, w, h, keysym;
+	char extra;
+	if(std::sscanf(str.c_str(), "%d,%d,%d,%d,%i%c", &x, &y, &w, &h, &keysym, &extra) != 5 ||
+	   x < 0 || y < 0 || w <= 0 || h <= 0 || keysym <= 0)
+		return false;
+
+	guac_common_rect_init(&probe.rect, x, y, w, h);
+	probe.keysym = keysym;
+	return true;
+}
+
+bool GuacVNCClient::CheckEncodings(const std::string& str) {
+	static const char* const names[] = { "copyrect", "tight", "zrle", "ultra", "hextile", "zlib",
+										 "corre",	 "rre",	  "raw",  "trle",  "zywrle" };
+	std::istringstream stream(str);
+	std::string encoding;
+	while(stream >> encoding) {
+		if(std::find(std::begin(names), std::end(names), encoding) == std::end(names))
+			return false;
+	}
+	return true;
+}
+
+void GuacVNCClient::SetEncodings(const std::string& encodings, int compress_level, int quality_level) {
+	lock_guard<mutex> lock(state_mutex_);
+	encodings_ = encodings;
+	compress_level_ = compress_level;
+	quality_level_ = quality_level;
+}
+
+void GuacVNCClient::SetCPUSet(const CPUSet& cpus) {
+	lock_guard<mutex> lock(state_mutex_);
+	cpus_ = cpus;
+}
+
+void GuacVNCClient::SetJoinRate(unsigned int rate) {
+	lock_guard<mutex> lock(join_mutex_);
+	join_rate_ = rate;
+}
+
+void GuacVNCClient::SetTargetBitrate(unsigned int kbps) {
+	lock_guard<mutex> lock(state_mutex_);
+	target_bitrate_ = kbps;
+}
+
+/**
+ * Whether the VNC server is on the same host, where updates are copied
+ * faster than they could be compressed.
+ */
+static bool IsLocalVNCServer(const std::string& hostname, uint16_t port) {
+	if(port == 0)
+		return true;
+
+	boost::system::error_code ec;
+	boost::asio::ip::address address = boost::asio::ip::make_address(hostname, ec);
+	if(ec)
+		return hostname == "localhost";
+	return address.is_loopback();
+}
+
+void GuacVNCClient::SetLatencyProbe(const GuacVNCLatencyProbe& probe) {
+	lock_guard<mutex> lock(state_mutex_);
+	latency_probe_ = probe;
+}
+
+void GuacVNCClient::SetOverlays(const std::vector<guac_common_rect>& rects) {
+	lock_guard<mutex> lock(state_mutex_);
+	overlay_rects_ = rects;
+	overlays_changed_ = true;
+}
+
+void GuacVNCClient::SetPNGProfile(const guac_png_profile& profile) {
+	lock_guard<mutex> lock(state_mutex_);
+	png_profile_ = profile;
+	profiles_changed_ = true;
+}
+
+void GuacVNCClient::SetJPEGProfile(const guac_jpeg_profile& profile) {
+	lock_guard<mutex> lock(state_mutex_);
+	jpeg_profile_ = profile;
+	profiles_changed_ = true;
+}
+
+bool GuacVNCClient::SetRecording(const std::string& path) {
+	lock_guard<mutex> lock(state_mutex_);
+	recording_path_ = path;
+	recording_changed_ = true;
+	return true;
+}
+
+bool GuacVNCClient::SetSessionRecording(const std::string& prefix) {
+	lock_guard<mutex> lock(state_mutex_);
+	session_prefix_ = prefix;
+	session_changed_ = true;
+	return true;
+}
+
+void GuacVNCClient::SetHLSStream(std::shared_ptr<HLSStream> stream) {
+	lock_guard<mutex> lock(state_mutex_);
+	hls_stream_ = std::move(stream);
+	hls_changed_ = true;
+}
+
+void GuacVNCClient::UpdateLatencyProbe() {
+	auto now = std::chrono::steady_clock::now();
+	if(probe_pending_) {
+		if(now - probe_sent_ < kLatencyProbeTimeout)
+			return;
+		probe_pending_ = false;
+		controller_.GetMetrics().input_probe_timeouts.Add();
+	}
+
+	if(now < next_probe_)
+		return;
+	next_probe_ = now + kLatencyProbeInterval;
+
+	{
+		lock_guard<mutex> lock(state_mutex_);
+		active_probe_ = latency_probe_;
+	}
+	if(!active_probe_.keysym)
+		return;
+
+	guac_common_rect screen;
+	guac_common_rect_init(&screen, 0, 0, default_surface_->width, default_surface_->height);
+	guac_common_rect_constrain(&active_probe_.rect, &screen);
+	if(active_probe_.rect.width <= 0 || active_probe_.rect.height <= 0)
+		return;
+
+	probe_hash_ = HashLatencyProbe();
+	{
+		lock_guard<mutex> input_lock(input_mutex_);
+		if(rfb_client_ == NULL)
+			return;
+		SendKeyEvent(rfb_client_, active_probe_.keysym, TRUE);
+		SendKeyEvent(rfb_client_, active_probe_.keysym, FALSE);
+	}
+	probe_sent_ = std::chrono::steady_clock::now();
+	probe_pending_ = true;
+}
+
+void GuacVNCClient::CheckLatencyProbe(int x, int y, int w, int h) {
+	const guac_common_rect& rect = active_probe_.rect;
+	if(x >= rect.x + rect.width || y >= rect.y + rect.height || x + w <= rect.x || y + h <= rect.y)
+		return;
+
+	if(HashLatencyProbe() == probe_hash_)
+		return;
+
+	controller_.GetMetrics().input_latency.Observe(std::chrono::steady_clock::now() - probe_sent_);
+	probe_pending_ = false;
+}
+
+uint32_t GuacVNCClient::HashLatencyProbe() const {
+	// FNV-1a, the area is small enough that hashing all of it is cheap
+	const guac_common_rect& rect = active_probe_.rect;
+	uint32_t hash = 2166136261;
+	for(int y = rect.y; y < rect.y + rect.height; y++) {
+		const unsigned char* row = default_surface_->buffer + y * default_surface_->stride + rect.x * 4;
+		for(int i = 0; i < rect.width * 4; i++)
+			hash = (hash ^ row[i]) * 16777619;
+	}
+	return hash;
+}
+
+void GuacVNCClient::UpdateRecording() {
+	std::string path;
+	std::string prefix;
+	bool changed;
+	bool session_changed;
+	// A stream that's replaced is stopped outside of the lock
+	std::shared_ptr<HLSStream> previous_hls;
+	{
+		lock_guard<mutex> lock(state_mutex_);
+		changed = recording_changed_;
+		session_changed = session_changed_;
+		recording_changed_ = false;
+		session_changed_ = false;
+		path = recording_path_;
+		prefix = session_prefix_;
+
+		if(hls_changed_) {
+			previous_hls = std::move(hls_);
+			hls_ = hls_stream_;
+			hls_changed_ = false;
+			// A new stream starts from the screen as it is now
+			hls_revision_ = default_surface_->revision - 1;
+		}
+	}
+
+	if(session_changed) {
+		// The old recorder finishes writing its queue before it's replaced
+		broadcast_socket_.SetRecorder(nullptr);
+		session_recorder_.reset();
+		if(!prefix.empty()) {
+			session_recorder_ = std::make_shared<SessionRecorder>(prefix, kSessionFileSize, kSessionQueueSize);
+			broadcast_socket_.SetRecorder(session_recorder_);
+		}
+	}
+	UpdateSessionRecording();
+
+	if(!changed)
+		return;
+
+	recorder_.Close();
+	if(path.empty())
+		return;
+
+	if(!recorder_.Open(path)) {
+		Logger::Error() << "Failed to create the recording \"" << path << '"';
+		return;
+	}
+
+	// Replays start from the screen as it is now
+	recorder_.WriteSize(default_surface_->width, default_surface_->height);
+	recorder_.WriteUpdate(0, 0, default_surface_->width, default_surface_->height,
+						  default_surface_->buffer, default_surface_->stride);
+	recorder_.WriteFrame();
+}
+
+/**
+ * Collects the instructions of a keyframe for a session recording.
+ */
+class KeyframeSocket : public GuacSocket {
+   public:
+	void InstructionBegin() override {
+		mutex_.lock();
+	}
+
+	void InstructionEnd() override {
+		mutex_.unlock();
+	}
+
+	std::vector<uint8_t> Release() {
+		return buffer_.Release();
+	}
+};
+
+void GuacVNCClient::UpdateSessionRecording() {
+	if(!session_recorder_ || !session_recorder_->NeedsKeyframe())
+		return;
+
+	// The keyframe already has the drawing of a frame that's still being
+	// encoded, so that frame is ended first, or its copies would be replayed
+	// on top of it. Nothing but audio, which doesn't depend on the display,
+	// is broadcast while it's copied
+	if(frame_pending_)
+		FinishFrame();
+	KeyframeSocket socket;
+	DupDisplay(socket);
+	session_recorder_->WriteKeyframe(socket.Release());
+}
+
+void GuacVNCClient::UpdateHLS() {
+	if(!hls_ || default_surface_->revision == hls_revision_)
+		return;
+
+	// The stream's thread repeats the last frame it was given in between
+	auto now = std::chrono::steady_clock::now();
+	if(!hls_->WantsFrame(now))
+		return;
+	hls_revision_ = default_surface_->revision;
+	hls_->Write(default_surface_->buffer, default_surface_->width, default_surface_->height,
+				default_surface_->stride, now);
+}
+
+void GuacVNCClient::UpdateSettings() {
+	bool overlays_changed;
+	bool profiles_changed;
+	guac_png_profile png_profile;
+	guac_jpeg_profile jpeg_profile;
+	{
+		lock_guard<mutex> lock(state_mutex_);
+		overlays_changed = overlays_changed_;
+		profiles_changed = profiles_changed_;
+		overlays_changed_ = profiles_changed_ = false;
+		png_profile = png_profile_;
+		jpeg_profile = jpeg_profile_;
+	}
+
+	if(profiles_changed) {
+		guac_common_surface_set_png_profile(default_surface_, png_profile);
+		guac_common_surface_set_png_profile(scaled_surface_, png_profile);
+		surface_jpeg_profile_ = jpeg_profile;
+		ApplyJPEGProfile();
+		for(GuacVNCOverlay& overlay : overlays_)
+			guac_common_surface_set_png_profile(overlay.surface, png_profile);
+	}
+
+	if(overlays_changed) {
+		// The default layer has to send the areas that were covered
+		for(const GuacVNCOverlay& overlay : overlays_)
+			guac_common_surface_invalidate(default_surface_, overlay.rect.x, overlay.rect.y,
+										   overlay.rect.width, overlay.rect.height);
+		FreeOverlays();
+		CreateOverlays();
+	}
+}
+
 GuacVNCClient::GuacVNCClient(CollabVMServer& server, VMController& controller, UserList& users, const std::string& hostname,
 							 uint16_t port /*, uint16_t frame_duration*/)
 	: GuacClient(server, controller, users, hostname, port, /*frame_duration*/ 200),
 	  server_(server),
+	  strand_(boost::asio::make_strand(GetVNCService())),
+#ifdef BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR
+	  rfb_socket_(strand_),
+#endif
+	  tick_timer_(strand_),
+	  open_(false),
+	  wait_id_(0),
 	  rfb_client_(NULL),
+	  mouse_timer_(server.GetService()),
+	  mouse_mask_(0),
+	  pending_mouse_user_(NULL),
+	  pending_mouse_x_(0),
+	  pending_mouse_y_(0),
+	  cursor_timer_(strand_),
+	  cursor_flush_pending_(false),
+	  join_rate_(0),
+	  join_timer_(strand_),
+	  join_scheduled_(false),
 	  rfb_MallocFrameBuffer_(NULL),
 	  copy_rect_used_(0),
 	  password_(NULL),
-	  encodings_(NULL),
+	  compress_level_(3),
+	  quality_level_(5),
 	  swap_red_blue_(false),
 	  color_depth_(0),
 	  read_only_(false),
 	  remote_cursor_(false),
 	  audio_enabled_(false),
+	  audio_(*this),
+	  video_enabled_(false),
+	  continuous_updates_(false),
+	  video_(broadcast_socket_),
+	  video_layer_(NULL),
+	  video_rect_(),
+	  video_candidate_(),
+	  video_candidate_since_(0),
+	  video_motion_(0),
+	  video_checked_(0),
+	  video_revision_(0),
 	  cursor_(guac_common_cursor_alloc(*this)),
-	  default_surface_(NULL) {
+	  default_surface_(NULL),
+	  scaled_surface_(NULL),
+	  scaled_stale_(true),
+	  resize_settling_(false),
+	  flush_time_(0),
+	  frame_skipped_(false),
+	  frame_pending_(false),
+	  frame_id_(0),
+	  frame_flushed_(false),
+	  png_profile_(GUAC_PNG_DEFAULT_PROFILE),
+	  jpeg_profile_(),
+	  target_bitrate_(0),
+	  surface_jpeg_profile_(),
+	  rate_bytes_(0),
+	  rate_quality_(0),
+	  rate_lossy_framerate_(0),
+	  rate_min_frame_duration_(0),
+	  overlays_changed_(false),
+	  profiles_changed_(false),
+	  recording_changed_(false),
+	  session_changed_(false),
+	  hls_changed_(false),
+	  hls_revision_(0),
+	  latency_probe_(),
+	  active_probe_(),
+	  probe_hash_(0),
+	  probe_pending_(false),
+	  converted_format_(),
+	  pixel_converter_(NULL),
+	  shared_framebuffer_(false),
+	  current_frame_duration_(frame_duration_),
+	  paused_(false),
+	  thumbnail_surface_(NULL),
+	  thumbnail_revision_(0) {
 	password_ = strdup(""); // NOTE: freed by libvncclient
 }
 
@@ -48,11 +482,19 @@ void GuacVNCClient::Start() {
 
 	if(client_state_ != ClientState::kStopped)
 		return;
-	// Change to state to starting to prevent more than one thread from
-	// being created if this function is called multiple times
+	// Change to state to starting so the started event is only
+	// called once if this function is called multiple times
 	client_state_ = ClientState::kStarting;
-	// Start guacamole VNC client thread
-	vnc_thread_ = std::thread(std::bind(&GuacVNCClient::VNCThread, this));
+	lock.unlock();
+
+	boost::asio::post(strand_, [this, controller = controller_.shared_from_this()] {
+		unique_lock<mutex> lock(state_mutex_);
+		if(client_state_ != ClientState::kStarting)
+			return;
+		client_state_ = ClientState::kIdle;
+		lock.unlock();
+		controller_.OnGuacStarted();
+	});
 }
 
 void GuacVNCClient::Stop() {
@@ -61,12 +503,29 @@ void GuacVNCClient::Stop() {
 		return;
 	client_state_ = ClientState::kStopped;
 	lock.unlock();
-	state_wait_.notify_all();
-	// Wait for VNC thread to stop
-	vnc_thread_.detach();
+	OnStateChanged();
+}
+
+void GuacVNCClient::SetPaused(bool paused) {
+	{
+		lock_guard<mutex> lock(state_mutex_);
+		paused_ = paused;
+	}
+
+	// Start reading again straight away instead of at the next tick
+	if(!paused)
+		boost::asio::post(strand_, [this, controller = controller_.shared_from_this()] {
+			if(open_)
+				RunFrame();
+		});
 }
 
 void GuacVNCClient::CleanUp() {
+	audio_.End();
+	if(video_.IsOpen())
+		StopVideo();
+	FreeOverlays();
+
 	// Call the leave handler for each user
 	// TODO: Is it required to lock the users list?
 	users_.ForEachUserLock([this](CollabVMUser& user) {
@@ -76,9 +535,15 @@ void GuacVNCClient::CleanUp() {
 		//user.user->active = false;
 	});
 
-	/* Free memory not free'd by libvncclient's rfbClientCleanup() */
-	if(rfb_client_->frameBuffer != NULL)
+	lock_guard<mutex> input_lock(input_mutex_);
+	pending_mouse_user_ = NULL;
+	mouse_mask_ = 0;
+
+	/* Free memory not free'd by libvncclient's rfbClientCleanup(),
+	 * a shared framebuffer belongs to the default surface */
+	if(rfb_client_->frameBuffer != NULL && !shared_framebuffer_)
 		free(rfb_client_->frameBuffer);
+	rfb_client_->frameBuffer = NULL;
 	if(rfb_client_->raw_buffer != NULL)
 		free(rfb_client_->raw_buffer);
 	if(rfb_client_->rcSource != NULL)
@@ -97,102 +562,420 @@ void GuacVNCClient::CleanUp() {
 	rfb_client_ = NULL;
 }
 
-void GuacVNCClient::guac_vnc_update(rfbClient* client, int x, int y, int w, int h) {
-	GuacVNCClient* vnc_client = (GuacVNCClient*)rfbClientGetClientData(client, GUAC_VNC_CLIENT_KEY);
+/**
+* Converts pixels of T bytes each using the lookup tables of a
+* GuacVNCPixelConversion, which avoids dividing each color component.
+*/
+template<typename T>
+static void ConvertPixels(const unsigned char* src, uint32_t* dst, int width, const void* data) {
+	const GuacVNCPixelConversion& conversion = *static_cast<const GuacVNCPixelConversion*>(data);
+
+	for(int i = 0; i < width; i++, src += sizeof(T)) {
+		T v;
+		std::memcpy(&v, src, sizeof(T));
+		dst[i] = conversion.red[(v >> conversion.red_shift) & conversion.red_max] |
+				 conversion.green[(v >> conversion.green_shift) & conversion.green_max] |
+				 conversion.blue[(v >> conversion.blue_shift) & conversion.blue_max];
+	}
+}
 
-	int dx, dy;
+/**
+* Converts 32-bit BGRX pixels to RGBX, or the reverse, by swapping the
+* first and third bytes of each pixel and clearing the fourth.
+*/
+static void SwapRedBlueScalar(const unsigned char* src, uint32_t* dst, int width) {
+	for(int i = 0; i < width; i++) {
+		uint32_t v;
+		std::memcpy(&v, src + i * 4, sizeof(v));
+		dst[i] = (v & 0x0000FF00) | ((v & 0xFF) << 16) | ((v >> 16) & 0xFF);
+	}
+}
 
-	/* Cairo image buffer */
-	int stride;
-	unsigned char* buffer;
-	unsigned char* buffer_row_current;
-	cairo_surface_t* surface;
+#if defined(SIMD_X86)
+SIMD_TARGET_SSE42
+static void SwapRedBlueSSE42(const unsigned char* src, uint32_t* dst, int width) {
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1);
+	int i = 0;
+	for(; i + 4 <= width; i += 4) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_shuffle_epi8(v, shuffle));
+	}
+	SwapRedBlueScalar(src + i * 4, dst + i, width - i);
+}
 
-	/* VNC framebuffer */
-	unsigned int bpp;
-	unsigned int fb_stride;
-	unsigned char* fb_row_current;
+SIMD_TARGET_AVX2
+static void SwapRedBlueAVX2(const unsigned char* src, uint32_t* dst, int width) {
+	const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1,
+											 2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1);
+	int i = 0;
+	for(; i + 8 <= width; i += 8) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_shuffle_epi8(v, shuffle));
+	}
+	SwapRedBlueScalar(src + i * 4, dst + i, width - i);
+}
+#endif
 
-	/* Ignore extra update if already handled by copyrect */
-	if(vnc_client->copy_rect_used_) {
-		vnc_client->copy_rect_used_ = 0;
-		return;
+#if defined(__ARM_NEON)
+static void SwapRedBlueNEON(const unsigned char* src, uint32_t* dst, int width) {
+	const uint32x4_t green = vdupq_n_u32(0x0000FF00);
+	const uint32x4_t low = vdupq_n_u32(0x000000FF);
+	int i = 0;
+	for(; i + 4 <= width; i += 4) {
+		uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8(src + i * 4));
+		uint32x4_t out = vorrq_u32(vandq_u32(v, green),
+								   vorrq_u32(vshlq_n_u32(vandq_u32(v, low), 16),
+											 vandq_u32(vshrq_n_u32(v, 16), low)));
+		vst1q_u32(dst + i, out);
 	}
+	SwapRedBlueScalar(src + i * 4, dst + i, width - i);
+}
+#endif
 
-	/* Init Cairo buffer */
-	stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, w);
-	buffer = (unsigned char*)malloc(h * stride);
-	buffer_row_current = buffer;
+using SwapRedBlueFunc = void(const unsigned char* src, uint32_t* dst, int width);
 
-	bpp = client->format.bitsPerPixel / 8;
-	fb_stride = bpp * client->width;
-	fb_row_current = client->frameBuffer + (y * fb_stride) + (x * bpp);
+static SwapRedBlueFunc* const swap_red_blue = SIMD::Select<SwapRedBlueFunc>("pixel_swap", {
+	SwapRedBlueScalar,
+#if defined(SIMD_X86)
+	SwapRedBlueSSE42,
+	SwapRedBlueAVX2,
+#else
+	nullptr,
+	nullptr,
+#endif
+	nullptr,
+#if defined(__ARM_NEON)
+	SwapRedBlueNEON
+#else
+	nullptr
+#endif
+});
 
-	/* Copy image data from VNC client to PNG */
-	for(dy = y; dy < y + h; dy++) {
-		unsigned int* buffer_current;
-		unsigned char* fb_current;
+static void SwapRedBlue(const unsigned char* src, uint32_t* dst, int width, const void* data) {
+	swap_red_blue(src, dst, width);
+}
 
-		/* Get current buffer row, advance to next */
-		buffer_current = (unsigned int*)buffer_row_current;
-		buffer_row_current += stride;
+/**
+* Builds a table translating each value of a color component with the given
+* maximum to 8 bits, shifted to the given position.
+*/
+static void BuildComponentTable(std::vector<uint32_t>& table, uint32_t max, int shift) {
+	table.resize(max + 1);
+	for(uint32_t i = 0; i <= max; i++)
+		table[i] = (i * 0x100 / (max + 1)) << shift;
+}
 
-		/* Get current framebuffer row, advance to next */
-		fb_current = fb_row_current;
-		fb_row_current += fb_stride;
+guac_common_surface_convert_func* GuacVNCClient::GetPixelConverter(rfbClient* client) {
+	const rfbPixelFormat& format = client->format;
+	if(format.bitsPerPixel == converted_format_.bitsPerPixel &&
+	   format.redShift == converted_format_.redShift &&
+	   format.greenShift == converted_format_.greenShift &&
+	   format.blueShift == converted_format_.blueShift &&
+	   format.redMax == converted_format_.redMax &&
+	   format.greenMax == converted_format_.greenMax &&
+	   format.blueMax == converted_format_.blueMax)
+		return pixel_converter_;
+
+	converted_format_ = format;
+	pixel_converter_ = CreatePixelConverter(format, swap_red_blue_, pixel_conversion_);
+	return pixel_converter_;
+}
 
-		for(dx = x; dx < x + w; dx++) {
-			unsigned char red, green, blue;
-			unsigned int v;
+guac_common_surface_convert_func* GuacVNCClient::CreatePixelConverter(const rfbPixelFormat& format, bool swap_red_blue,
+																	  GuacVNCPixelConversion& conversion) {
+	/* 32-bit pixels with 8-bit components only need their bytes moved */
+	unsigned int bpp = format.bitsPerPixel / 8;
+	if(bpp == 4 && format.redMax == 0xff && format.greenMax == 0xff && format.blueMax == 0xff &&
+	   format.greenShift == 8) {
+		bool rgb = format.redShift == 16 && format.blueShift == 0;
+		bool bgr = format.redShift == 0 && format.blueShift == 16;
+		if(rgb || bgr)
+			return rgb != swap_red_blue ? NULL : SwapRedBlue;
+	}
 
-			switch(bpp) {
-				case 4:
-					v = *((unsigned int*)fb_current);
-					break;
+	conversion.red_shift = format.redShift;
+	conversion.green_shift = format.greenShift;
+	conversion.blue_shift = format.blueShift;
+	conversion.red_max = format.redMax;
+	conversion.green_max = format.greenMax;
+	conversion.blue_max = format.blueMax;
+	BuildComponentTable(conversion.red, format.redMax, swap_red_blue ? 0 : 16);
+	BuildComponentTable(conversion.green, format.greenMax, 8);
+	BuildComponentTable(conversion.blue, format.blueMax, swap_red_blue ? 16 : 0);
 
-				case 2:
-					v = *((unsigned short*)fb_current);
-					break;
+	switch(bpp) {
+		case 4:
+			return ConvertPixels<uint32_t>;
 
-				default:
-					v = *((unsigned char*)fb_current);
-			}
+		case 2:
+			return ConvertPixels<uint16_t>;
 
-			/* Translate value to RGB */
-			red = (v >> client->format.redShift) * 0x100 / (client->format.redMax + 1);
-			green = (v >> client->format.greenShift) * 0x100 / (client->format.greenMax + 1);
-			blue = (v >> client->format.blueShift) * 0x100 / (client->format.blueMax + 1);
+		default:
+			return ConvertPixels<uint8_t>;
+	}
+}
 
-			/* Output RGB */
-			if(vnc_client->swap_red_blue_)
-				*(buffer_current++) = (blue << 16) | (green << 8) | red;
-			else
-				*(buffer_current++) = (red << 16) | (green << 8) | blue;
+void GuacVNCClient::guac_vnc_update(rfbClient* client, int x, int y, int w, int h) {
+	GuacVNCClient* vnc_client = (GuacVNCClient*)rfbClientGetClientData(client, GUAC_VNC_CLIENT_KEY);
 
-			fb_current += bpp;
-		}
+	/* Ignore extra update if already handled by copyrect */
+	if(vnc_client->copy_rect_used_) {
+		vnc_client->copy_rect_used_ = 0;
+		return;
+	}
+
+	/* The update was decoded straight into the surface */
+	if(vnc_client->shared_framebuffer_) {
+		guac_common_surface_invalidate(vnc_client->default_surface_, x, y, w, h);
+	} else {
+		unsigned int bpp = client->format.bitsPerPixel / 8;
+		unsigned int fb_stride = bpp * client->width;
+		unsigned char* fb_row = client->frameBuffer + (y * fb_stride) + (x * bpp);
+
+		/* Convert straight from the framebuffer into the default layer */
+		guac_common_surface_draw_pixels(vnc_client->default_surface_, x, y, w, h, fb_row, fb_stride, bpp,
+										vnc_client->GetPixelConverter(client), &vnc_client->pixel_conversion_);
 	}
 
-	/* For now, only use default layer */
-	surface = cairo_image_surface_create_for_data(buffer, CAIRO_FORMAT_RGB24, w, h, stride);
+	if(vnc_client->recorder_.IsOpen()) {
+		guac_common_surface* surface = vnc_client->default_surface_;
+		vnc_client->recorder_.WriteUpdate(x, y, w, h, surface->buffer, surface->stride);
+	}
 
-	guac_common_surface_draw(vnc_client->default_surface_, x, y, surface);
+	if(vnc_client->probe_pending_)
+		vnc_client->CheckLatencyProbe(x, y, w, h);
 
-	/* Free surface */
-	cairo_surface_destroy(surface);
-	free(buffer);
+	vnc_client->DrawOverlays(x, y, w, h);
+	vnc_client->MarkScaled(x, y, w, h);
 }
 
 void GuacVNCClient::guac_vnc_copyrect(rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y) {
 	GuacVNCClient* vnc_client = (GuacVNCClient*)rfbClientGetClientData(client, GUAC_VNC_CLIENT_KEY);
 
-	/* For now, only use default layer */
+	/* Overlays are updated from the default layer, which always has the whole screen */
 	guac_common_surface_copy(vnc_client->default_surface_, src_x, src_y, w, h,
 							 vnc_client->default_surface_, dest_x, dest_y);
+	if(vnc_client->recorder_.IsOpen())
+		vnc_client->recorder_.WriteCopy(src_x, src_y, w, h, dest_x, dest_y);
+	if(vnc_client->probe_pending_)
+		vnc_client->CheckLatencyProbe(dest_x, dest_y, w, h);
+	vnc_client->DrawOverlays(dest_x, dest_y, w, h);
+	vnc_client->MarkScaled(dest_x, dest_y, w, h);
 
 	vnc_client->copy_rect_used_ = 1;
 }
 
+void GuacVNCClient::CreateOverlays() {
+	std::vector<guac_common_rect> rects;
+	{
+		lock_guard<mutex> lock(state_mutex_);
+		rects = overlay_rects_;
+	}
+
+	guac_common_rect screen;
+	guac_common_rect_init(&screen, 0, 0, default_surface_->width, default_surface_->height);
+
+	for(guac_common_rect rect : rects) {
+		guac_common_rect_constrain(&rect, &screen);
+		if(rect.width <= 0 || rect.height <= 0)
+			continue;
+
+		GuacVNCOverlay overlay;
+		overlay.layer = AllocLayer();
+		overlay.surface = guac_common_surface_alloc(broadcast_socket_, overlay.layer, rect.width, rect.height);
+		guac_common_surface_set_png_profile(overlay.surface, default_surface_->png_profile);
+		guac_common_surface_set_memory_account(overlay.surface, &controller_.GetMemoryAccount());
+		overlay.rect = rect;
+		guac_protocol_send_move(broadcast_socket_, overlay.layer, GuacClient::GUAC_DEFAULT_LAYER, rect.x, rect.y, 1);
+		overlays_.push_back(overlay);
+	}
+
+	UpdateCovered();
+	if(!overlays_.empty())
+		DrawOverlays(0, 0, default_surface_->width, default_surface_->height);
+}
+
+void GuacVNCClient::FreeOverlays() {
+	for(GuacVNCOverlay& overlay : overlays_) {
+		guac_common_surface_free(overlay.surface);
+		FreeLayer(overlay.layer);
+	}
+	overlays_.clear();
+
+	if(default_surface_ != NULL)
+		UpdateCovered();
+}
+
+void GuacVNCClient::UpdateCovered() {
+	std::vector<guac_common_rect> covered;
+	for(const GuacVNCOverlay& overlay : overlays_)
+		covered.push_back(overlay.rect);
+	if(video_.IsOpen())
+		covered.push_back(video_rect_);
+
+	guac_common_surface_set_covered(default_surface_, covered);
+}
+
+/**
+ * The update rate, in updates per second, at which an area of the screen is
+ * considered to be changing continuously.
+ */
+#define GUAC_VNC_VIDEO_FRAMERATE 15
+
+/**
+ * The smallest number of heat map cells that have to be changing for the
+ * video to be used, so a blinking cursor or a clock isn't sent as video.
+ */
+#define GUAC_VNC_VIDEO_MIN_CELLS 4
+
+/**
+ * The percentage of the cells within the changing area that have to be
+ * changing themselves, so that scattered updates aren't sent as one video
+ * covering most of the screen.
+ */
+#define GUAC_VNC_VIDEO_MIN_DENSITY 50
+
+/**
+ * How often the heat map is checked, in milliseconds.
+ */
+#define GUAC_VNC_VIDEO_CHECK_INTERVAL 250
+
+/**
+ * How long an area has to keep changing before it is sent as video, and
+ * how long the video's area has to stay unchanged before it's sent as
+ * images again, in milliseconds.
+ */
+#define GUAC_VNC_VIDEO_START_DELAY 2000
+#define GUAC_VNC_VIDEO_STOP_DELAY 3000
+
+/**
+ * Returns whether two rectangles overlap.
+ */
+static bool guac_vnc_rects_overlap(const guac_common_rect& a, const guac_common_rect& b) {
+	guac_common_rect overlap = a;
+	guac_common_rect_constrain(&overlap, &b);
+	return overlap.width > 0 && overlap.height > 0;
+}
+
+bool GuacVNCClient::FindMotion(guac_common_rect& rect) {
+	std::vector<int> framerates;
+	int columns, rows;
+	guac_common_surface_get_heat_map(default_surface_, framerates, &columns, &rows);
+
+	int min_x = columns, min_y = rows, max_x = -1, max_y = -1;
+	int cells = 0;
+	for(int y = 0; y < rows; y++) {
+		for(int x = 0; x < columns; x++) {
+			if(framerates[y * columns + x] < GUAC_VNC_VIDEO_FRAMERATE)
+				continue;
+			min_x = std::min(min_x, x);
+			min_y = std::min(min_y, y);
+			max_x = std::max(max_x, x);
+			max_y = std::max(max_y, y);
+			cells++;
+		}
+	}
+
+	if(cells < GUAC_VNC_VIDEO_MIN_CELLS ||
+	   cells * 100 < (max_x - min_x + 1) * (max_y - min_y + 1) * GUAC_VNC_VIDEO_MIN_DENSITY)
+		return false;
+
+	guac_common_rect screen;
+	guac_common_rect_init(&screen, 0, 0, default_surface_->width, default_surface_->height);
+	guac_common_rect_init(&rect, min_x * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE, min_y * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE,
+						  (max_x - min_x + 1) * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE,
+						  (max_y - min_y + 1) * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE);
+	guac_common_rect_constrain(&rect, &screen);
+	return true;
+}
+
+void GuacVNCClient::UpdateVideo() {
+	// Every viewer is sent the same instructions, so video replaces images
+	// only while all of them can play it
+	if(!video_enabled_ || !VideoStream::IsSupported() || default_surface_->suspended ||
+	   !broadcast_socket_.IsVideo()) {
+		if(video_.IsOpen())
+			StopVideo();
+		video_candidate_since_ = 0;
+		return;
+	}
+
+	guac_timestamp now = guac_timestamp_current();
+	if(now - video_checked_ >= GUAC_VNC_VIDEO_CHECK_INTERVAL) {
+		video_checked_ = now;
+
+		guac_common_rect motion;
+		bool found = FindMotion(motion);
+		if(video_.IsOpen()) {
+			if(found && guac_vnc_rects_overlap(motion, video_rect_))
+				video_motion_ = now;
+			else if(now - video_motion_ >= GUAC_VNC_VIDEO_STOP_DELAY)
+				StopVideo();
+		} else if(!found) {
+			video_candidate_since_ = 0;
+		} else if(video_candidate_since_ == 0 || !guac_vnc_rects_overlap(motion, video_candidate_)) {
+			video_candidate_ = motion;
+			video_candidate_since_ = now;
+		} else {
+			guac_common_rect_extend(&video_candidate_, &motion);
+			if(now - video_candidate_since_ >= GUAC_VNC_VIDEO_START_DELAY)
+				StartVideo(video_candidate_);
+		}
+	}
+
+	// Send a frame whenever the screen changed
+	if(video_.IsOpen() && default_surface_->revision != video_revision_) {
+		video_revision_ = default_surface_->revision;
+		video_.Write(default_surface_->buffer + video_rect_.y * default_surface_->stride + video_rect_.x * 4,
+					 default_surface_->stride);
+	}
+}
+
+void GuacVNCClient::StartVideo(const guac_common_rect& rect) {
+	video_candidate_since_ = 0;
+
+	// Frames must have an even size
+	guac_common_rect_init(&video_rect_, rect.x, rect.y, rect.width & ~1, rect.height & ~1);
+	video_layer_ = AllocLayer();
+	if(!video_.Begin(video_layer_, video_rect_.x, video_rect_.y, video_rect_.width, video_rect_.height)) {
+		FreeLayer(video_layer_);
+		video_layer_ = NULL;
+		return;
+	}
+
+	video_motion_ = guac_timestamp_current();
+	video_revision_ = default_surface_->revision - 1;
+	UpdateCovered();
+}
+
+void GuacVNCClient::StopVideo() {
+	video_.End();
+	guac_protocol_send_dispose(broadcast_socket_, video_layer_);
+	FreeLayer(video_layer_);
+	video_layer_ = NULL;
+
+	// Viewers only have the video's last frame of the area, so send it again
+	UpdateCovered();
+	guac_common_surface_invalidate(default_surface_, video_rect_.x, video_rect_.y, video_rect_.width,
+								   video_rect_.height);
+}
+
+void GuacVNCClient::DrawOverlays(int x, int y, int w, int h) {
+	guac_common_rect rect;
+	guac_common_rect_init(&rect, x, y, w, h);
+
+	for(GuacVNCOverlay& overlay : overlays_) {
+		guac_common_rect overlap = overlay.rect;
+		guac_common_rect_constrain(&overlap, &rect);
+		if(overlap.width <= 0 || overlap.height <= 0)
+			continue;
+
+		unsigned char* row = default_surface_->buffer + overlap.y * default_surface_->stride + overlap.x * 4;
+		guac_common_surface_draw_pixels(overlay.surface, overlap.x - overlay.rect.x, overlap.y - overlay.rect.y,
+										overlap.width, overlap.height, row, default_surface_->stride, 4, NULL, NULL);
+	}
+}
+
 void GuacVNCClient::guac_vnc_set_pixel_format(rfbClient* client, int color_depth) {
 	switch(color_depth) {
 		case 8:
@@ -234,9 +1017,36 @@ void GuacVNCClient::guac_vnc_set_pixel_format(rfbClient* client, int color_depth
 rfbBool GuacVNCClient::guac_vnc_malloc_framebuffer(rfbClient* rfb_client) {
 	GuacVNCClient* client = (GuacVNCClient*)rfbClientGetClientData(rfb_client, GUAC_VNC_CLIENT_KEY);
 
-	/* Resize surface */
-	if(client->default_surface_ != NULL)
+	/* Resize surface, and recreate the overlays within the new bounds */
+	if(client->default_surface_ != NULL) {
+		if(client->video_.IsOpen())
+			client->StopVideo();
+		client->resized_ = std::chrono::steady_clock::now();
 		guac_common_surface_resize(client->default_surface_, rfb_client->width, rfb_client->height);
+		if(client->scaled_surface_ != NULL) {
+			guac_common_surface_resize(client->scaled_surface_,
+									   (rfb_client->width + kScaledDisplayDivisor - 1) / kScaledDisplayDivisor,
+									   (rfb_client->height + kScaledDisplayDivisor - 1) / kScaledDisplayDivisor);
+			client->scaled_stale_ = true;
+		}
+		if(client->recorder_.IsOpen())
+			client->recorder_.WriteSize(rfb_client->width, rfb_client->height);
+		if(client->continuous_updates_)
+			EnableContinuousUpdates(rfb_client);
+		if(!client->overlays_.empty()) {
+			client->FreeOverlays();
+			client->CreateOverlays();
+		}
+	}
+
+	/* Let libvncclient decode into the surface's buffer instead of its own */
+	if(client->shared_framebuffer_) {
+		if(client->default_surface_ == NULL)
+			client->default_surface_ = guac_common_surface_alloc(client->broadcast_socket_, GuacClient::GUAC_DEFAULT_LAYER,
+																 rfb_client->width, rfb_client->height);
+		rfb_client->frameBuffer = client->default_surface_->buffer;
+		return TRUE;
+	}
 
 	/* Use original, wrapped proc */
 	return client->rfb_MallocFrameBuffer_(rfb_client);
@@ -252,7 +1062,8 @@ void GuacVNCClient::guac_vnc_cursor(rfbClient* client, int x, int y, int w, int
 
 	/* Cairo image buffer */
 	int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, w);
-	unsigned char* buffer = (unsigned char*)malloc(h * stride);
+	vnc_client->cursor_pixels_.resize(static_cast<size_t>(h) * stride);
+	unsigned char* buffer = vnc_client->cursor_pixels_.data();
 	unsigned char* buffer_row_current = buffer;
 
 	/* VNC image buffer */
@@ -318,9 +1129,6 @@ void GuacVNCClient::guac_vnc_cursor(rfbClient* client, int x, int y, int w, int
 	/* Update stored cursor information */
 	guac_common_cursor_set_argb(vnc_client->cursor_, x, y, buffer, w, h, stride);
 
-	/* Free surface */
-	free(buffer);
-
 	/* libvncclient does not free rcMask as it does rcSource */
 	free(client->rcMask);
 }
@@ -331,6 +1139,28 @@ int GuacVNCClient::EndFrame() {
 	return guac_protocol_send_sync(broadcast_socket_, last_sent_timestamp);
 }
 
+void GuacVNCClient::FinishFrame() {
+	frame_pending_ = false;
+	guac_common_surface_finish_flush(default_surface_);
+
+	if(frame_flushed_) {
+		flushed_ = std::chrono::steady_clock::now();
+		flush_time_ = flushed_ - frame_flush_start_;
+	}
+
+	std::shared_ptr<FrameTrace> trace;
+	if(frame_flushed_ && !default_surface_->suspended) {
+		EndFrame();
+
+		VMMetrics& metrics = controller_.GetMetrics();
+		metrics.frames.Add();
+		trace = metrics.tracer->Begin(frame_received_, frame_flush_start_);
+	}
+
+	broadcast_socket_.EndFrame(std::move(trace));
+	UpdateRateControl();
+}
+
 int GuacVNCClient::GetProcessingLag() {
 	int processing_lag = 0;
 
@@ -343,8 +1173,287 @@ int GuacVNCClient::GetProcessingLag() {
 	return processing_lag;
 }
 
+milliseconds GuacVNCClient::UpdateFrameDuration() {
+	int lag = GetProcessingLag();
+	int duration = current_frame_duration_.count();
+
+	if(lag > duration) {
+		/* Viewers are falling behind, move halfway towards their pace */
+		duration += (lag - duration + 1) / 2;
+	} else if(lag < duration / 2) {
+		/* Everyone is keeping up, so gradually send updates more often */
+		duration -= std::max(duration / 8, 1);
+	}
+
+	int max_duration = frame_duration_.count();
+	int min_duration = std::min(std::max<int>(GUAC_VNC_MIN_FRAME_DURATION, rate_min_frame_duration_.count()), max_duration);
+	current_frame_duration_ = milliseconds(std::clamp(duration, min_duration, max_duration));
+	return current_frame_duration_;
+}
+
+/**
+ * How often the rate controller compares the bitrate with its target.
+ */
+constexpr static milliseconds kRateWindow(1000);
+
+/**
+ * The bitrate is left alone while it's between these fractions of the target.
+ */
+constexpr static double kRateLowFraction = 0.8;
+constexpr static double kRateHighFraction = 1.1;
+
+/**
+ * The lowest quality the rate controller goes down to, and the most it
+ * raises the quality by in a window.
+ */
+constexpr static int kMinRateQuality = 20;
+constexpr static int kRateQualityStep = 5;
+
+/**
+ * The update rate areas are sent lossy at, which is GUAC_SURFACE_JPEG_FRAMERATE
+ * unless the rate controller lowers it.
+ */
+constexpr static int kDefaultLossyFramerate = 3;
+
+void GuacVNCClient::UpdateRateControl() {
+	unsigned int target;
+	{
+		lock_guard<mutex> lock(state_mutex_);
+		target = target_bitrate_;
+	}
+
+	auto now = steady_clock::now();
+	rate_bytes_ += broadcast_socket_.TakeBuiltBytes();
+	if(now - rate_window_start_ < kRateWindow)
+		return;
+
+	double kbps = rate_bytes_ * 8 / 1000.0 / std::chrono::duration<double>(now - rate_window_start_).count();
+	rate_bytes_ = 0;
+	rate_window_start_ = now;
+
+	int max_quality = surface_jpeg_profile_.quality > 0 ? surface_jpeg_profile_.quality : guac_protocol_jpeg_quality();
+	max_quality = std::clamp(max_quality, kMinRateQuality, 100);
+	int quality = rate_quality_ ? rate_quality_ : max_quality;
+	int framerate = rate_lossy_framerate_ ? rate_lossy_framerate_ : kDefaultLossyFramerate;
+	milliseconds min_duration = rate_min_frame_duration_;
+
+	if(!target) {
+		quality = max_quality;
+		framerate = kDefaultLossyFramerate;
+		min_duration = milliseconds(0);
+	} else if(kbps > target * kRateHighFraction) {
+		if(quality > kMinRateQuality)
+			quality = std::max(kMinRateQuality, quality - std::max(kRateQualityStep, static_cast<int>(quality * (1 - target / kbps))));
+		else if(framerate > 1)
+			framerate--;
+		else
+			min_duration = std::min<milliseconds>(frame_duration_, std::max(milliseconds(GUAC_VNC_MIN_FRAME_DURATION), min_duration * 5 / 4));
+	} else if(kbps < target * kRateLowFraction) {
+		if(min_duration.count())
+			min_duration = min_duration * 4 / 5 > milliseconds(GUAC_VNC_MIN_FRAME_DURATION) ? min_duration * 4 / 5 : milliseconds(0);
+		else if(framerate < kDefaultLossyFramerate)
+			framerate++;
+		else
+			quality = std::min(max_quality, quality + kRateQualityStep);
+	}
+
+	rate_min_frame_duration_ = min_duration;
+	int rate_quality = quality < max_quality ? quality : 0;
+	int rate_lossy_framerate = framerate < kDefaultLossyFramerate ? framerate : 0;
+	if(rate_quality != rate_quality_ || rate_lossy_framerate != rate_lossy_framerate_) {
+		rate_quality_ = rate_quality;
+		rate_lossy_framerate_ = rate_lossy_framerate;
+		ApplyJPEGProfile();
+	}
+}
+
+void GuacVNCClient::ApplyJPEGProfile() {
+	guac_jpeg_profile profile = surface_jpeg_profile_;
+	if(rate_quality_) {
+		profile.quality = rate_quality_;
+		profile.webp_quality = rate_quality_;
+	}
+	if(rate_lossy_framerate_)
+		profile.lossy_framerate = rate_lossy_framerate_;
+	guac_common_surface_set_jpeg_profile(default_surface_, profile);
+	guac_common_surface_set_jpeg_profile(scaled_surface_, profile);
+}
+
 char* GuacVNCClient::GUAC_VNC_CLIENT_KEY = "GUAC_VNC";
 
+/**
+* QEMU's audio extension: a pseudo-encoding announcing support for it, and
+* the message type and submessage of its client and server messages.
+*/
+#define GUAC_VNC_ENCODING_AUDIO -259
+#define GUAC_VNC_MSG_QEMU 255
+#define GUAC_VNC_MSG_QEMU_AUDIO 1
+
+/**
+* Operations of audio client messages.
+*/
+#define GUAC_VNC_AUDIO_ENABLE 0
+#define GUAC_VNC_AUDIO_SET_FORMAT 2
+
+/**
+* Operations of audio server messages.
+*/
+#define GUAC_VNC_AUDIO_END 0
+#define GUAC_VNC_AUDIO_BEGIN 1
+#define GUAC_VNC_AUDIO_DATA 2
+
+/**
+* The sample format for signed 16-bit samples.
+*/
+#define GUAC_VNC_AUDIO_FORMAT_S16 3
+
+/**
+* The largest audio message that will be read, to stop a bad length from
+* allocating an arbitrary amount of memory.
+*/
+#define GUAC_VNC_AUDIO_MAX_DATA (1024 * 1024)
+
+static int guac_vnc_audio_encodings[] = { GUAC_VNC_ENCODING_AUDIO, 0 };
+
+rfbBool GuacVNCClient::guac_vnc_audio_encoding(rfbClient* client, rfbFramebufferUpdateRectHeader* rect) {
+	// The acknowledgement has no data
+	return rect->encoding == GUAC_VNC_ENCODING_AUDIO;
+}
+
+rfbBool GuacVNCClient::guac_vnc_audio_message(rfbClient* client, rfbServerToClientMsg* message) {
+	if(message->type != GUAC_VNC_MSG_QEMU)
+		return FALSE;
+
+	uint8_t header[3];
+	if(!ReadFromRFBServer(client, reinterpret_cast<char*>(header), sizeof(header)) ||
+	   header[0] != GUAC_VNC_MSG_QEMU_AUDIO)
+		return FALSE;
+
+	GuacVNCClient* vnc_client = static_cast<GuacVNCClient*>(rfbClientGetClientData(client, GUAC_VNC_CLIENT_KEY));
+	switch(header[1] << 8 | header[2]) {
+		case GUAC_VNC_AUDIO_END:
+			vnc_client->audio_.End();
+			return TRUE;
+		case GUAC_VNC_AUDIO_BEGIN:
+			vnc_client->audio_.Begin();
+			return TRUE;
+		case GUAC_VNC_AUDIO_DATA: {
+			uint8_t length_bytes[4];
+			if(!ReadFromRFBServer(client, reinterpret_cast<char*>(length_bytes), sizeof(length_bytes)))
+				return FALSE;
+
+			uint32_t length = length_bytes[0] << 24 | length_bytes[1] << 16 | length_bytes[2] << 8 | length_bytes[3];
+			if(length > GUAC_VNC_AUDIO_MAX_DATA)
+				return FALSE;
+
+			std::vector<unsigned char>& buffer = vnc_client->audio_buffer_;
+			buffer.resize(length);
+			if(!ReadFromRFBServer(client, reinterpret_cast<char*>(buffer.data()), length))
+				return FALSE;
+
+			// Nobody would hear the samples, so don't spend time encoding them
+			if(!vnc_client->users_.GetSnapshot()->empty())
+				vnc_client->audio_.Write(buffer.data(), length);
+			return TRUE;
+		}
+		default:
+			return FALSE;
+	}
+}
+
+void GuacVNCClient::EnableAudio(rfbClient* client) {
+	const uint32_t rate = AudioStream::kSampleRate;
+	uint8_t messages[] = {
+		GUAC_VNC_MSG_QEMU, GUAC_VNC_MSG_QEMU_AUDIO, 0, GUAC_VNC_AUDIO_SET_FORMAT,
+		GUAC_VNC_AUDIO_FORMAT_S16, AudioStream::kChannels,
+		uint8_t(rate >> 24), uint8_t(rate >> 16), uint8_t(rate >> 8), uint8_t(rate),
+		GUAC_VNC_MSG_QEMU, GUAC_VNC_MSG_QEMU_AUDIO, 0, GUAC_VNC_AUDIO_ENABLE
+	};
+	WriteToRFBServer(client, reinterpret_cast<char*>(messages), sizeof(messages));
+}
+
+/**
+* The ContinuousUpdates and Fence extensions from the RFB community
+* specification: their pseudo-encodings, and the message types that they
+* use in both directions.
+*/
+#define GUAC_VNC_ENCODING_CONTINUOUS_UPDATES -313
+#define GUAC_VNC_ENCODING_FENCE -312
+#define GUAC_VNC_MSG_CONTINUOUS_UPDATES 150
+#define GUAC_VNC_MSG_FENCE 248
+
+/**
+* The flag of a fence that has to be answered, and the flags that are
+* supported. Messages are handled one at a time, so the BlockBefore,
+* BlockAfter and SyncNext flags are met by answering as soon as the fence
+* is read.
+*/
+#define GUAC_VNC_FENCE_REQUEST 0x80000000u
+#define GUAC_VNC_FENCE_SUPPORTED 0x7u
+#define GUAC_VNC_FENCE_MAX_DATA 64
+
+static int guac_vnc_stream_encodings[] = { GUAC_VNC_ENCODING_CONTINUOUS_UPDATES, GUAC_VNC_ENCODING_FENCE, 0 };
+
+rfbBool GuacVNCClient::guac_vnc_stream_encoding(rfbClient* client, rfbFramebufferUpdateRectHeader* rect) {
+	// Neither pseudo-encoding is acknowledged with a rectangle
+	return FALSE;
+}
+
+rfbBool GuacVNCClient::guac_vnc_stream_message(rfbClient* client, rfbServerToClientMsg* message) {
+	GuacVNCClient* vnc_client = static_cast<GuacVNCClient*>(rfbClientGetClientData(client, GUAC_VNC_CLIENT_KEY));
+	switch(message->type) {
+		case GUAC_VNC_MSG_CONTINUOUS_UPDATES:
+			// The first one says that the server supports them, and any later
+			// one that it stopped sending them, after which libvncclient's
+			// update requests are answered again
+			vnc_client->continuous_updates_ = !vnc_client->continuous_updates_;
+			if(vnc_client->continuous_updates_)
+				EnableContinuousUpdates(client);
+			return TRUE;
+
+		case GUAC_VNC_MSG_FENCE: {
+			// Padding, flags and the length of the data
+			uint8_t header[8];
+			if(!ReadFromRFBServer(client, reinterpret_cast<char*>(header), sizeof(header)))
+				return FALSE;
+
+			uint32_t flags = header[3] << 24 | header[4] << 16 | header[5] << 8 | header[6];
+			uint8_t length = header[7];
+			if(length > GUAC_VNC_FENCE_MAX_DATA)
+				return FALSE;
+
+			uint8_t reply[9 + GUAC_VNC_FENCE_MAX_DATA] = { GUAC_VNC_MSG_FENCE };
+			if(!ReadFromRFBServer(client, reinterpret_cast<char*>(reply + 9), length))
+				return FALSE;
+
+			// Fences without the request flag answer our own, which are never sent
+			if(!(flags & GUAC_VNC_FENCE_REQUEST))
+				return TRUE;
+
+			flags &= GUAC_VNC_FENCE_SUPPORTED;
+			reply[4] = flags >> 24;
+			reply[5] = flags >> 16;
+			reply[6] = flags >> 8;
+			reply[7] = flags;
+			reply[8] = length;
+			return WriteToRFBServer(client, reinterpret_cast<char*>(reply), 9 + length);
+		}
+
+		default:
+			return FALSE;
+	}
+}
+
+void GuacVNCClient::EnableContinuousUpdates(rfbClient* client) {
+	uint16_t width = client->width;
+	uint16_t height = client->height;
+	uint8_t message[] = {
+		GUAC_VNC_MSG_CONTINUOUS_UPDATES, 1, 0, 0, 0, 0,
+		uint8_t(width >> 8), uint8_t(width), uint8_t(height >> 8), uint8_t(height)
+	};
+	WriteToRFBServer(client, reinterpret_cast<char*>(message), sizeof(message));
+}
+
 rfbClient* GuacVNCClient::GetVNCClient() {
 	rfbClient* rfb_client = rfbGetClient(8, 3, 4); /* 32-bpp client */
 
@@ -353,8 +1462,24 @@ rfbClient* GuacVNCClient::GetVNCClient() {
 
 	/* Framebuffer update handler */
 	rfb_client->GotFrameBufferUpdate = guac_vnc_update;
+
+	/* Extensions are global to libvncclient, and the audio pseudo-encoding
+	 * they add is harmless to VNC servers that don't stream audio */
+	if(audio_enabled_) {
+		static rfbClientProtocolExtension audio_extension = { guac_vnc_audio_encodings, guac_vnc_audio_encoding,
+															  guac_vnc_audio_message };
+		static std::once_flag audio_registered;
+		std::call_once(audio_registered, [] { rfbClientRegisterExtension(&audio_extension); });
+	}
 	rfb_client->GotCopyRect = guac_vnc_copyrect;
 
+	/* Let VNC servers that can send updates as they happen do so */
+	static rfbClientProtocolExtension stream_extension = { guac_vnc_stream_encodings, guac_vnc_stream_encoding,
+														   guac_vnc_stream_message };
+	static std::once_flag stream_registered;
+	std::call_once(stream_registered, [] { rfbClientRegisterExtension(&stream_extension); });
+	continuous_updates_ = false;
+
 	/* Do not handle clipboard and local cursor if read-only */
 	if(read_only_ == 0) {
 		/* Clipboard */
@@ -378,6 +1503,10 @@ rfbClient* GuacVNCClient::GetVNCClient() {
 	/* Depth */
 	guac_vnc_set_pixel_format(rfb_client, color_depth_);
 
+	/* The RGB24 layout used by surfaces is 32-bit with red in the third byte */
+	shared_framebuffer_ = share_framebuffer_ && rfb_client->format.bitsPerPixel == 32 &&
+						  rfb_client->format.redShift == 16 && !swap_red_blue_;
+
 	/* Hook into allocation so we can handle resize. */
 	rfb_MallocFrameBuffer_ = rfb_client->MallocFrameBuffer;
 	rfb_client->MallocFrameBuffer = guac_vnc_malloc_framebuffer;
@@ -408,8 +1537,19 @@ rfbClient* GuacVNCClient::GetVNCClient() {
 #endif
 
 	/* Set encodings if provided */
-	if(encodings_)
-		rfb_client->appData.encodingsString = strdup(encodings_);
+	{
+		lock_guard<mutex> lock(state_mutex_);
+		if(!encodings_.empty())
+			rfb_client->appData.encodingsString = strdup(encodings_.c_str());
+
+		/* A VNC server on the same host is as fast as copying memory, so
+		 * compressing updates would only cost QEMU and this thread time */
+		else if(IsLocalVNCServer(hostname_, port_))
+			rfb_client->appData.encodingsString = strdup("raw");
+
+		rfb_client->appData.compressLevel = compress_level_;
+		rfb_client->appData.qualityLevel = quality_level_;
+	}
 
 	/* Connect */
 	if(rfbInitClient(rfb_client, NULL, NULL))
@@ -429,212 +1569,511 @@ static void guac_vnc_msleep(int msec) {
 	std::this_thread::sleep_for(std::chrono::milliseconds(msec));
 }
 
-void GuacVNCClient::VNCThread() {
-	IgnorePipe();
+void GuacVNCClient::OnStateChanged() {
+	boost::asio::post(strand_, [this, controller = controller_.shared_from_this()] { UpdateState(); });
+}
 
-	// If the mutex is locked by the state_mutex_ object then it means
-	// that we do not want to connect to the VNC server yet
+void GuacVNCClient::UpdateState() {
 	unique_lock<mutex> lock(state_mutex_);
-	client_state_ = ClientState::kIdle;
+	ClientState state = client_state_;
 	lock.unlock();
-	controller_.OnGuacStarted();
-	lock.lock();
 
-	while(client_state_ != ClientState::kStopped) {
-		// Wait for the state to be set to connecting
-		while(client_state_ != ClientState::kConnecting) {
-			state_wait_.wait(lock);
+	if(open_) {
+		if(state != ClientState::kConnected)
+			CloseConnection();
+	}
+	else if(state == ClientState::kConnecting)
+		OpenConnection();
+}
 
-			if(client_state_ == ClientState::kStopped)
-				return;
-		}
+bool GuacVNCClient::OpenConnection() {
+	// The surfaces are allocated while connecting, and their pages are
+	// placed on the NUMA node of the CPU that first touches them
+	{
+		lock_guard<mutex> lock(state_mutex_);
+		cpus_.PinCurrentThread();
+	}
+	rfbClient* rfb_client = GetVNCClient();
+
+	/* If the connect attempt fails, try again */
+	if(!rfb_client) {
+		unique_lock<mutex> lock(state_mutex_);
+		if(client_state_ != ClientState::kStopped)
+			client_state_ = ClientState::kIdle;
 		lock.unlock();
 
-		rfbClient* rfb_client = GetVNCClient();
+		disconnect_reason_ = DisconnectReason::kFailed;
+		controller_.OnGuacDisconnect(false);
+		return false;
+	}
 
-		/* If the connect attempt fails, try again */
-		if(!rfb_client) {
-			lock.lock();
-			//if (client_state_ == ClientState::kConnected)
-			//client_state_ = ClientState::kDisconnecting;
-			client_state_ = ClientState::kIdle;
-			lock.unlock();
+	/* Ask QEMU to stream the VM's audio */
+	if(audio_enabled_)
+		EnableAudio(rfb_client);
 
-			disconnect_reason_ = DisconnectReason::kFailed;
-			controller_.OnGuacDisconnect(false);
+	/* Set remaining client data */
+	{
+		lock_guard<mutex> input_lock(input_mutex_);
+		rfb_client_ = rfb_client;
+	}
 
-			//guac_client_abort(client, GUAC_PROTOCOL_STATUS_UPSTREAM_ERROR, "Unable to connect to VNC server.");
-			//std::cout << "Could not to connect to VNC server. Retrying in one second..." << std::endl;
-			//std::this_thread::sleep_for(std::chrono::seconds(1));
-			lock.lock();
-			continue;
-		}
+	/* If not read-only, set an appropriate cursor */
+	if(read_only_ == 0) {
+		if(remote_cursor_)
+			guac_common_cursor_set_dot(cursor_);
+		else
+			guac_common_cursor_set_pointer(cursor_);
+	}
 
-#ifdef ENABLE_PULSE
-		/* If an encoding is available, load an audio stream */
-		if(guac_client_data->audio_enabled) {
-			guac_client_data->audio = guac_audio_stream_alloc(client, NULL);
+	/* Send name */
+	guac_protocol_send_name(broadcast_socket_, rfb_client->desktopName);
 
-			/* Load servername if specified */
-			if(argv[IDX_AUDIO_SERVERNAME][0] != '\0')
-				guac_client_data->pa_servername =
-				strdup(argv[IDX_AUDIO_SERVERNAME]);
-			else
-				guac_client_data->pa_servername = NULL;
+	/* Create default surface, unless it was created for the shared framebuffer */
+	if(!shared_framebuffer_)
+		default_surface_ = guac_common_surface_alloc(broadcast_socket_, GuacClient::GUAC_DEFAULT_LAYER,
+													 rfb_client->width, rfb_client->height);
 
-			/* If successful, init audio system */
-			if(guac_client_data->audio != NULL) {
-				guac_client_log(client, GUAC_LOG_INFO,
-								"Audio will be encoded as %s",
-								guac_client_data->audio->encoder->mimetype);
+	guac_common_surface_set_memory_account(default_surface_, &controller_.GetMemoryAccount());
 
-				/* Require threadsafe sockets if audio enabled */
-				guac_socket_require_threadsafe(broadcast_socket_);
+	/* The scaled surface is redrawn from all of the screen before it's next flushed */
+	int scaled_width = (rfb_client->width + kScaledDisplayDivisor - 1) / kScaledDisplayDivisor;
+	int scaled_height = (rfb_client->height + kScaledDisplayDivisor - 1) / kScaledDisplayDivisor;
+	if(scaled_surface_ == NULL) {
+		scaled_surface_ = guac_common_surface_alloc(scaled_socket_, GuacClient::GUAC_DEFAULT_LAYER,
+													scaled_width, scaled_height);
+		guac_common_surface_set_memory_account(scaled_surface_, &controller_.GetMemoryAccount());
+	}
+	else
+		guac_common_surface_resize(scaled_surface_, scaled_width, scaled_height);
+	scaled_dirty_.clear();
+	scaled_stale_ = true;
+
+	{
+		lock_guard<mutex> lock(state_mutex_);
+		guac_common_surface_set_png_profile(default_surface_, png_profile_);
+		guac_common_surface_set_png_profile(scaled_surface_, png_profile_);
+		surface_jpeg_profile_ = jpeg_profile_;
+		overlays_changed_ = profiles_changed_ = false;
+	}
+	ApplyJPEGProfile();
+	CreateOverlays();
 
-				/* Start audio stream */
-				guac_pa_start_stream(client);
+	broadcast_socket_.Flush();
 
-			}
+	// Call join handler for each user if there are already
+	// users in the list
+	users_.ForEachUserLock([this](CollabVMUser& user) {
+		user.guac_user->client_ = this;
+		OnUserJoin(*user.guac_user);
+	});
 
-			/* Otherwise, audio loading failed */
-			else
-				guac_client_log(client, GUAC_LOG_INFO,
-								"No available audio encoding. Sound disabled.");
+	// Callback on connected
+	OnConnect();
+
+	disconnect_reason_ = DisconnectReason::kClient;
+	current_frame_duration_ = frame_duration_;
+	open_ = true;
+
+#ifdef BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR
+	// Wait on a duplicate of the socket, so closing the descriptor
+	// doesn't close the socket libvncclient is still using
+	boost::system::error_code ec;
+	rfb_socket_.assign(::dup(rfb_client->sock), ec);
+	if(ec) {
+		Logger::Error() << "Failed to wait on the VNC socket: " << ec.message();
+		disconnect_reason_ = DisconnectReason::kFailed;
+		unique_lock<mutex> lock(state_mutex_);
+		if(client_state_ == ClientState::kConnected)
+			client_state_ = ClientState::kDisconnecting;
+	}
+#endif
+
+	RunFrame();
+	return true;
+}
 
-		} /* end if audio enabled */
+void GuacVNCClient::RunFrame() {
+	// Whichever of the socket and the timer didn't start this frame is ignored
+	wait_id_++;
+	boost::system::error_code ec;
+	tick_timer_.cancel(ec);
+#ifdef BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR
+	rfb_socket_.cancel(ec);
 #endif
 
-		/* Set remaining client data */
-		rfb_client_ = rfb_client;
+	if(client_state_ != ClientState::kConnected) {
+		CloseConnection();
+		return;
+	}
 
-		/* If not read-only, set an appropriate cursor */
-		if(read_only_ == 0) {
-			if(remote_cursor_)
-				guac_common_cursor_set_dot(cursor_);
-			else
-				guac_common_cursor_set_pointer(cursor_);
+	// The threads of the VNC service are shared by every VM, so the one
+	// running this frame is moved to the VM's CPUs if it isn't already
+	{
+		lock_guard<mutex> lock(state_mutex_);
+		cpus_.PinCurrentThread();
+	}
+
+	if(paused_) {
+		// Leave the VNC server's messages unread until the client is
+		// unpaused, waking up once a second to make thumbnails
+		if(update_thumbnail_) {
+			GenerateThumbnail();
+			update_thumbnail_ = false;
 		}
+		WaitForFrame();
+		return;
+	}
 
-		/* Send name */
-		guac_protocol_send_name(broadcast_socket_, rfb_client->desktopName);
+	UpdateSettings();
+	UpdateRecording();
+	UpdateLatencyProbe();
+
+	// The surfaces' encode jobs are scheduled as the VM's
+	EncoderPool::ClientScope encoder_scope(controller_.GetEncoderClient());
+
+	// The socket is readable, or the VNC server has been silent for a second
+	int wait_result = WaitForMessage(rfb_client_, 0);
+	auto received = std::chrono::steady_clock::now();
+
+	// Group every instruction produced by this frame into a single message.
+	// While the last frame's updates are being encoded, what's read now
+	// goes out with that frame
+	if(!frame_pending_)
+		broadcast_socket_.BeginFrame();
+
+	if(wait_result > 0) {
+		milliseconds frame_duration = UpdateFrameDuration();
+
+		/* Read server messages until frame is built */
+		time_point frame_start = std::chrono::time_point_cast<milliseconds>(steady_clock::now());
+		do {
+			/* Handle any message received */
+			if(!HandleRFBServerMessage(rfb_client_)) {
+				disconnect_reason_ = DisconnectReason::kProtocolError;
+				unique_lock<mutex> lock(state_mutex_);
+				if(client_state_ == ClientState::kConnected)
+					client_state_ = ClientState::kDisconnecting;
+				break;
+			}
 
-		/* Create default surface */
-		default_surface_ = guac_common_surface_alloc(broadcast_socket_, GuacClient::GUAC_DEFAULT_LAYER,
-													 rfb_client->width, rfb_client->height);
+			/* Calculate time remaining in frame */
+			time_point frame_end = std::chrono::time_point_cast<milliseconds>(steady_clock::now());
+			milliseconds frame_remaining = frame_start + frame_duration - frame_end;
 
-		broadcast_socket_.Flush();
+			/* Wait again if frame remaining */
+			if(frame_remaining.count() > 0)
+				wait_result = WaitForMessage(rfb_client_, GUAC_VNC_FRAME_TIMEOUT * 1000);
+			else
+				break;
 
-		// Call join handler for each user if there are already
-		// users in the list
-		users_.ForEachUserLock([this](CollabVMUser& user) {
-			user.guac_user->client_ = this;
-			OnUserJoin(*user.guac_user);
-		});
+		} while(wait_result > 0);
+	}
 
-		// Callback on connected
-		OnConnect();
-
-		disconnect_reason_ = DisconnectReason::kClient;
-		//guac_timestamp last_frame_end = guac_timestamp_current();
-
-		/* Handle messages from VNC server while client is running */
-		while(client_state_ == ClientState::kConnected) {
-			// Wait a maximum of one second for an RFB message to be
-			// received from the VNC server
-			int wait_result = WaitForMessage(rfb_client, 1000000);
-			if(wait_result > 0) {
-				//guac_timestamp frame_start = guac_timestamp_current();
-
-				///* Calculate time since last frame */
-				//int time_elapsed = frame_start - last_frame_end;
-				//int processing_lag = GetProcessingLag();
-
-				///* Force roughly-equal length of server and client frames */
-				//if (time_elapsed < processing_lag)
-				//	guac_vnc_msleep(processing_lag - time_elapsed);
-
-				/* Read server messages until frame is built */
-				time_point frame_start = std::chrono::time_point_cast<milliseconds>(steady_clock::now());
-				do {
-					/* Handle any message received */
-					if(!HandleRFBServerMessage(rfb_client)) {
-						disconnect_reason_ = DisconnectReason::kProtocolError;
-						//guac_client_abort(client,
-						//        GUAC_PROTOCOL_STATUS_UPSTREAM_ERROR,
-						//        "Error handling message from VNC server.");
-						lock.lock();
-						if(client_state_ == ClientState::kConnected)
-							client_state_ = ClientState::kDisconnecting;
-						lock.unlock();
-						break;
-					}
-
-					/* Calculate time remaining in frame */
-					time_point frame_end = std::chrono::time_point_cast<milliseconds>(steady_clock::now());
-					milliseconds frame_remaining = frame_start + frame_duration_ - frame_end;
-
-					/* Wait again if frame remaining */
-					if(frame_remaining.count() > 0)
-						wait_result = WaitForMessage(rfb_client, GUAC_VNC_FRAME_TIMEOUT * 1000);
-					else
-						break;
-
-				} while(wait_result > 0);
-
-				/* Record end of frame */
-				//last_frame_end = guac_timestamp_current();
-			}
+	/* If an error occurs, log it and fail */
+	if(wait_result < 0) {
+		disconnect_reason_ = DisconnectReason::kServer;
+		unique_lock<mutex> lock(state_mutex_);
+		if(client_state_ == ClientState::kConnected)
+			client_state_ = ClientState::kDisconnecting;
+	}
 
-			/* If an error occurs, log it and fail */
-			if(wait_result < 0) {
-				disconnect_reason_ = DisconnectReason::kServer;
-				//guac_client_abort(client, GUAC_PROTOCOL_STATUS_UPSTREAM_ERROR, "Connection closed.");
-				lock.lock();
-				if(client_state_ == ClientState::kConnected)
-					client_state_ = ClientState::kDisconnecting;
-				lock.unlock();
-			}
+	// The last frame's updates have to be sent before this frame's
+	if(frame_pending_) {
+		FinishFrame();
+		broadcast_socket_.BeginFrame();
+	}
 
-			// If there were any updates to the surface, flush them to the clients
-			// and send a sync message to them
-			if(default_surface_->dirty || default_surface_->png_queue_length) {
-				guac_common_surface_flush(default_surface_);
-				EndFrame();
-				broadcast_socket_.Flush();
+	// Without viewers the surface is suspended, so flushing it doesn't
+	// encode anything and the next viewer to join is sent all of it.
+	// Users of the scaled down display don't count
+	default_surface_->suspended = users_.GetSnapshot()->size() <= GetScaledUserCount();
+
+	// Send the area of the screen that keeps changing as video
+	UpdateVideo();
+
+	// The updates stay dirty while the screen is still being resized
+	auto flush_start = std::chrono::steady_clock::now();
+	resize_settling_ = flush_start - resized_ < kResizeSettleTime;
+
+	// While the encoder can't keep up, intermediate states of the screen are skipped
+	bool overloaded = flush_time_ > current_frame_duration_ && flush_start - flushed_ < flush_time_;
+	frame_skipped_ = overloaded && !resize_settling_ &&
+					 (default_surface_->dirty || default_surface_->queue_length);
+	if(frame_skipped_)
+		controller_.GetMetrics().skipped_frames.Add();
+
+	// Overlays are sent in the same frame as the default layer
+	bool flushed = false;
+	bool encoding = false;
+	if(!resize_settling_ && !overloaded) {
+		for(GuacVNCOverlay& overlay : overlays_) {
+			overlay.surface->suspended = default_surface_->suspended;
+			if(overlay.surface->dirty || overlay.surface->queue_length) {
+				guac_common_surface_flush(overlay.surface);
+				flushed = true;
 			}
+		}
 
-			if(update_thumbnail_) {
-				GenerateThumbnail();
-				update_thumbnail_ = false;
-			}
+		// Resend lossy parts of the screen that have settled as PNG. They
+		// haven't changed for a while, so they aren't part of the updates
+		if(guac_common_surface_refine(default_surface_))
+			flushed = true;
+
+		// If there were any updates to the surface, they're encoded while
+		// the next frame's messages are read, and the frame ends with a
+		// sync message once they've been sent
+		if(default_surface_->dirty || default_surface_->queue_length) {
+			uint64_t frame_id = ++frame_id_;
+			encoding = guac_common_surface_flush_async(default_surface_,
+				[this, controller = controller_.shared_from_this(), frame_id] {
+					boost::asio::post(strand_, [this, controller, frame_id] {
+						if(frame_pending_ && frame_id == frame_id_)
+							FinishFrame();
+					});
+				});
+			flushed = true;
 		}
+	}
+
+	// The cursor's latest position goes out with the frame
+	FlushCursor();
+
+	frame_flushed_ = flushed;
+	frame_received_ = received;
+	frame_flush_start_ = flush_start;
+	if(encoding)
+		frame_pending_ = true;
+	else
+		FinishFrame();
+
+	// The scaled down display is only drawn while anyone is watching it
+	if(HasScaledUsers()) {
+		if(!resize_settling_)
+			UpdateScaledSurface();
+	} else {
+		scaled_dirty_.clear();
+		scaled_stale_ = true;
+	}
 
-		//guac_client_log(client, GUAC_LOG_INFO, "Internal VNC client disconnected");
-		std::cout << "Disconnected from VNC server" << std::endl;
+	if(recorder_.IsOpen())
+		recorder_.WriteFrame();
 
-		// Call the disconnect handler so CleanUp() will be called
-		controller_.OnGuacDisconnect(true);
-		lock.lock();
+	UpdateHLS();
 
-		// Reset the state to idle
-		if(client_state_ != ClientState::kStopped)
-			client_state_ = ClientState::kIdle;
+	if(update_thumbnail_ && !resize_settling_) {
+		GenerateThumbnail();
+		update_thumbnail_ = false;
+	}
+
+	if(client_state_ != ClientState::kConnected)
+		CloseConnection();
+	else
+		WaitForFrame();
+}
+
+void GuacVNCClient::WaitForFrame() {
+	uint64_t wait_id = ++wait_id_;
+	auto handler = [this, controller = controller_.shared_from_this(), wait_id](const boost::system::error_code& ec) {
+		if(ec == boost::asio::error::operation_aborted || wait_id != wait_id_)
+			return;
+		RunFrame();
+	};
+
+	boost::system::error_code ec;
+#ifdef BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR
+	// While paused, the messages are left unread and only the timer runs frames
+	if(!paused_)
+		rfb_socket_.async_wait(boost::asio::posix::descriptor_base::wait_read, handler);
+	// Held back updates are sent as soon as the screen has settled
+	if(resize_settling_)
+		tick_timer_.expires_from_now(kResizeSettleTime, ec);
+	else if(frame_skipped_)
+		tick_timer_.expires_at(flushed_ + flush_time_, ec);
+	else
+		tick_timer_.expires_from_now(std::chrono::seconds(1), ec);
+#else
+	// Without readiness notifications the socket is polled instead
+	tick_timer_.expires_from_now(milliseconds(paused_ ? 1000 : GUAC_VNC_POLL_INTERVAL), ec);
+#endif
+	tick_timer_.async_wait(handler);
+}
+
+void GuacVNCClient::CloseConnection() {
+	// The viewers are still sent the last frame
+	if(frame_pending_)
+		FinishFrame();
+
+	open_ = false;
+	wait_id_++;
+	boost::system::error_code ec;
+	tick_timer_.cancel(ec);
+#ifdef BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR
+	rfb_socket_.close(ec);
+#endif
+
+	//guac_client_log(client, GUAC_LOG_INFO, "Internal VNC client disconnected");
+	Logger::Info() << "Disconnected from VNC server";
+
+	// A new connection may have a different screen, so it isn't recorded
+	// unless recording is started again. Session recordings carry on
+	// in a new file, starting from the screen of the new connection.
+	recorder_.Close();
+	broadcast_socket_.SetRecorder(nullptr);
+	session_recorder_.reset();
+	{
+		lock_guard<mutex> lock(state_mutex_);
+		session_changed_ = !session_prefix_.empty();
 	}
+	probe_pending_ = false;
+
+	// Call the disconnect handler so CleanUp() will be called
+	controller_.OnGuacDisconnect(true);
+
+	// Reset the state to idle
+	unique_lock<mutex> lock(state_mutex_);
+	bool stopped = client_state_ == ClientState::kStopped;
+	if(!stopped)
+		client_state_ = ClientState::kIdle;
+	lock.unlock();
 
-	controller_.OnGuacStopped();
+	if(stopped)
+		controller_.OnGuacStopped();
 }
 
 void GuacVNCClient::OnUserJoin(GuacUser& user) {
-	/* If not owner, synchronize with current display */
-	guac_common_surface_dup(default_surface_, user.socket_);
-	guac_common_cursor_dup(cursor_, user.socket_);
+	{
+		lock_guard<mutex> input_lock(input_mutex_);
+		user.left_ = false;
+	}
+
+	// Viewers of a relay get the display from the relay
+	if(user.relay_role_ == RelayRole::kViewer)
+		return;
+
+	// The display is sent from the strand, between frames, to everyone that
+	// joined since the last batch, so that they're all sent the same keyframe
+	// instead of the screen being encoded again for each of them
+	lock_guard<mutex> lock(join_mutex_);
+	if(std::find(pending_joins_.begin(), pending_joins_.end(), &user) != pending_joins_.end())
+		return;
+	pending_joins_.push_back(&user);
+	if(!join_scheduled_)
+		ScheduleJoins();
+}
+
+void GuacVNCClient::ScheduleJoins() {
+	join_scheduled_ = true;
+	boost::system::error_code ec;
+	join_timer_.expires_at(next_join_, ec);
+	join_timer_.async_wait([this, controller = controller_.shared_from_this()](const boost::system::error_code& ec) {
+		if(ec != boost::asio::error::operation_aborted)
+			AdmitJoins();
+	});
+}
+
+void GuacVNCClient::AdmitJoins() {
+	lock_guard<mutex> lock(join_mutex_);
+	join_scheduled_ = false;
+
+	// Users that joined while the connection was closing are sent the
+	// display by OpenConnection() once it's open again
+	if(!open_) {
+		pending_joins_.clear();
+		return;
+	}
+
+	// With a rate, a batch is sent about five times a second
+	size_t count = pending_joins_.size();
+	steady_clock::duration interval(0);
+	if(join_rate_) {
+		count = std::min<size_t>(count, (join_rate_ + 4) / 5);
+		interval = steady_clock::duration(std::chrono::seconds(1)) * count / join_rate_;
+	}
 
-	user.socket_.Flush();
+	// Like a session recording's keyframe, the display already has the
+	// drawing of a frame that's still being encoded, so it's ended first
+	if(count && frame_pending_)
+		FinishFrame();
+	// The display is sent behind the broadcasts that are still queued for
+	// each user, which would otherwise be drawn on top of it
+	for(size_t i = 0; i < count; i++) {
+		GuacUser& user = *pending_joins_[i];
+		user.socket_.Hold();
+		SendDisplay(user);
+		GuacBroadcastSocket& socket = user.scaled_display_ ? scaled_socket_ : broadcast_socket_;
+		socket.SendInOrder(user.owner_, user.socket_.ReleaseHeld());
+	}
+	pending_joins_.erase(pending_joins_.begin(), pending_joins_.begin() + count);
 
-	guac_protocol_send_sync(user.socket_, guac_timestamp_current());
+	next_join_ = steady_clock::now() + interval;
+	if(!pending_joins_.empty())
+		ScheduleJoins();
+}
+
+void GuacVNCClient::SendDisplay(GuacUser& user) {
+	// Tells a relay that a full copy of the display follows, which it
+	// keeps along with the updates after it for its viewers that join
+	if(user.relay_role_ == RelayRole::kDisplay) {
+		user.socket_.InstructionBegin();
+		user.socket_.WriteString("8.keyframe;");
+		user.socket_.InstructionEnd();
+	}
+
+	// Users of the scaled down display get its surface instead of the
+	// screen's, and none of the other layers but the cursor
+	if(user.scaled_display_) {
+		if(scaled_surface_ != NULL)
+			guac_common_surface_dup(scaled_surface_, user.socket_);
+		guac_common_cursor_dup(cursor_, user.socket_, kScaledDisplayDivisor);
+		audio_.Dup(user.socket_);
+
+		user.socket_.Flush();
+
+		guac_protocol_send_sync(user.socket_, guac_timestamp_current());
+		return;
+	}
+
+	// A resumed session that still has the screen from before it was
+	// disconnected is only sent what changed, unless it's most of the
+	// screen and the shared keyframe is cheaper
+	guac_timestamp since = user.resume_timestamp_;
+	user.resume_timestamp_ = 0;
+	if(user.relay_role_ != RelayRole::kNone || since > last_sent_timestamp)
+		since = 0;
+	DupDisplay(user.socket_, since);
+}
+
+void GuacVNCClient::DupDisplay(GuacSocket& socket, guac_timestamp since) {
+	int64_t max_area = static_cast<int64_t>(default_surface_->width) * default_surface_->height / 2;
+	if(!since || !guac_common_surface_dup_since(default_surface_, socket, since, max_area))
+		guac_common_surface_dup(default_surface_, socket);
+	for(GuacVNCOverlay& overlay : overlays_) {
+		guac_protocol_send_move(socket, overlay.layer, GuacClient::GUAC_DEFAULT_LAYER, overlay.rect.x,
+								overlay.rect.y, 1);
+		guac_common_surface_dup(overlay.surface, socket);
+	}
+	guac_common_cursor_dup(cursor_, socket);
+	audio_.Dup(socket);
+	video_.Dup(socket);
+
+	socket.Flush();
+
+	guac_protocol_send_sync(socket, guac_timestamp_current());
 }
 
 void GuacVNCClient::OnUserLeave(GuacUser& user) {
+	{
+		lock_guard<mutex> lock(join_mutex_);
+		pending_joins_.erase(std::remove(pending_joins_.begin(), pending_joins_.end(), &user), pending_joins_.end());
+	}
+
+	lock_guard<mutex> input_lock(input_mutex_);
+	user.left_ = true;
+
+	// Drop the user's move that hasn't been sent, since the user is about to be freed
+	if(pending_mouse_user_ == &user)
+		pending_mouse_user_ = NULL;
+
 	guac_common_cursor_remove_user(cursor_, user);
 }
 
@@ -642,17 +2081,90 @@ void GuacVNCClient::MouseHandler(GuacUser& user, int x, int y, int button_mask)
 #ifdef _DEBUG
 	//std::cout << "Mouse " << x << 'x' << y << " flags " << button_mask << '\n';
 #endif
+	lock_guard<mutex> input_lock(input_mutex_);
+	if(rfb_client_ == NULL || user.left_)
+		return;
+
+	// The scaled down display's coordinates are a fraction of the screen's
+	if(user.scaled_display_) {
+		x *= kScaledDisplayDivisor;
+		y *= kScaledDisplayDivisor;
+	}
+
+	// Moves that arrive too soon after the last event without changing
+	// the buttons are held back, and only the latest one is sent
+	steady_clock::time_point due = last_mouse_event_ + std::chrono::microseconds(mouse_interval_.load());
+	if(button_mask == mouse_mask_ && steady_clock::now() < due) {
+		if(pending_mouse_user_ == NULL) {
+			boost::system::error_code ec;
+			mouse_timer_.expires_at(due, ec);
+			mouse_timer_.async_wait([this, controller = controller_.shared_from_this()](const boost::system::error_code& ec) {
+				FlushMouse(ec);
+			});
+		}
+
+		pending_mouse_user_ = &user;
+		pending_mouse_x_ = x;
+		pending_mouse_y_ = y;
+		return;
+	}
+
+	SendMouse(user, x, y, button_mask);
+}
+
+void GuacVNCClient::SendMouse(GuacUser& user, int x, int y, int button_mask) {
 	/* Store current mouse location */
 	guac_common_cursor_move(cursor_, user, x, y);
 
+	// The other users are sent the position with the next frame, so a
+	// fast mouse doesn't broadcast a message for every move
+	if(!cursor_flush_pending_) {
+		cursor_flush_pending_ = true;
+		boost::system::error_code ec;
+		cursor_timer_.expires_at(cursor_flushed_ + milliseconds(GUAC_VNC_MIN_FRAME_DURATION), ec);
+		cursor_timer_.async_wait([this, controller = controller_.shared_from_this()](const boost::system::error_code& ec) {
+			if(ec != boost::asio::error::operation_aborted)
+				FlushCursor();
+		});
+	}
+
 	SendPointerEvent(rfb_client_, x, y, button_mask);
+
+	last_mouse_event_ = steady_clock::now();
+	mouse_mask_ = button_mask;
+	pending_mouse_user_ = NULL;
+}
+
+void GuacVNCClient::FlushMouse(const boost::system::error_code& ec) {
+	if(ec)
+		return;
+
+	lock_guard<mutex> input_lock(input_mutex_);
+	if(pending_mouse_user_ != NULL && rfb_client_ != NULL)
+		SendMouse(*pending_mouse_user_, pending_mouse_x_, pending_mouse_y_, mouse_mask_);
+}
+
+void GuacVNCClient::FlushCursor() {
+	lock_guard<mutex> input_lock(input_mutex_);
+	cursor_flush_pending_ = false;
+
+	// Only the latest position is worth sending to a user that fell behind.
+	// During a frame the move is sent with the rest of the frame instead.
+	broadcast_socket_.SetSuperseding(true);
+	scaled_socket_.SetSuperseding(true);
+	if(guac_common_cursor_flush(cursor_))
+		cursor_flushed_ = steady_clock::now();
+	broadcast_socket_.SetSuperseding(false);
+	scaled_socket_.SetSuperseding(false);
 }
 
 void GuacVNCClient::KeyHandler(GuacUser& user, int keysym, int pressed) {
 #ifdef _DEBUG
 	//std::cout << "Key " << keysym << " isPressed " << pressed << '\n';
 #endif
-	SendKeyEvent(rfb_client_, keysym, pressed);
+	lock_guard<mutex> input_lock(input_mutex_);
+	if(rfb_client_ != NULL && !user.left_)
+		SendKeyEvent(rfb_client_, keysym, pressed);
 }
 
 void GuacVNCClient::ClipboardHandler(GuacUser& user, guac_stream* stream, char* mimetype) {
@@ -660,51 +2172,191 @@ void GuacVNCClient::ClipboardHandler(GuacUser& user, guac_stream* stream, char*
 						   "Clipboard unsupported", GUAC_PROTOCOL_STATUS_UNSUPPORTED);
 }
 
-static cairo_status_t WriteThumbnail(void* closure, const unsigned char* data, unsigned int length) {
-	Base64* base64 = static_cast<Base64*>(closure);
-	base64->WriteBase64(data, length);
-	return CAIRO_STATUS_SUCCESS;
+/**
+ * The quality of the lossy images of thumbnails, which are small enough
+ * that artifacts aren't noticeable.
+ */
+constexpr static int kThumbnailQuality = 75;
+
+/**
+* Scales a snapshot of a surface's buffer down to each size of a thumbnail
+* and encodes them. The thumbnail keeps the snapshot for screenshots.
+*/
+static std::shared_ptr<const VMThumbnail> RenderThumbnail(const std::shared_ptr<std::vector<unsigned char>>& snapshot,
+														  int surface_width, int surface_height, int stride) {
+	cairo_surface_t* rect = cairo_image_surface_create_for_data(
+	snapshot->data(), CAIRO_FORMAT_RGB24,
+	surface_width, surface_height, stride);
+
+	// The layer only decides that WebP images are lossy, like the screen's
+	static guac_layer default_layer = { 0 };
+	ImageEncodeParams params;
+	params.layer = &default_layer;
+	params.png_profile = &GUAC_PNG_DEFAULT_PROFILE;
+	params.jpeg_quality = kThumbnailQuality;
+	params.webp_quality = kThumbnailQuality;
+
+	std::shared_ptr<VMThumbnail> thumbnail = std::make_shared<VMThumbnail>();
+	thumbnail->screen = snapshot;
+	thumbnail->screen_width = surface_width;
+	thumbnail->screen_height = surface_height;
+	thumbnail->screen_stride = stride;
+	const int longest_side = std::max(surface_width, surface_height);
+	for(size_t size = 0; size < VMThumbnail::kSizeCount; size++) {
+		// Displays smaller than a size aren't scaled up
+		float scale_xy = std::min(1.0f, static_cast<float>(VMThumbnail::kSizes[size]) / longest_side);
+		int width = std::max(1, static_cast<int>(scale_xy * surface_width));
+		int height = std::max(1, static_cast<int>(scale_xy * surface_height));
+
+		cairo_surface_t* target = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+		cairo_t* cr = cairo_create(target);
+		cairo_scale(cr, scale_xy, scale_xy);
+
+		cairo_set_source_surface(cr, rect, 0, 0);
+		cairo_paint(cr);
+		cairo_destroy(cr);
+
+		for(size_t format = 0; format < static_cast<size_t>(ImageFormat::kCount); format++) {
+			params.format = static_cast<ImageFormat>(format);
+
+			// Only viewers of the display can decode the screen codec
+			if(params.format == ImageFormat::kScreen || !ImageEncoders::Get().Supports(params.format))
+				continue;
+			std::vector<uint8_t>& image = thumbnail->GetImage(size, params.format);
+			if(ImageEncoders::Get().Encode(target, params, image))
+				image.clear();
+		}
+		cairo_surface_destroy(target);
+	}
+	cairo_surface_destroy(rect);
+
+	// The default image is the one every thumbnail must have
+	if(thumbnail->GetDefaultImage().empty())
+		return nullptr;
+	return thumbnail;
 }
 
-void GuacVNCClient::GenerateThumbnail() {
-	guac_common_surface* surface = default_surface_;
+void GuacVNCClient::MarkScaled(int x, int y, int w, int h) {
+	if(scaled_stale_)
+		return;
 
-	int width;
-	int height;
-	float scale_xy;
-	if(surface->width > surface->height) {
-		width = 400;
-		scale_xy = 400.0 / surface->width;
-		height = scale_xy * surface->height;
-	} else {
-		height = 400;
-		scale_xy = 400.0 / surface->height;
-		width = scale_xy * surface->width;
+	if(scaled_dirty_.size() >= kMaxScaledRects) {
+		scaled_dirty_.clear();
+		scaled_stale_ = true;
+		return;
 	}
 
-	cairo_surface_t* target = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	guac_common_rect rect;
+	guac_common_rect_init(&rect, x, y, w, h);
+	scaled_dirty_.push_back(rect);
+}
 
-	cairo_surface_t* rect = cairo_image_surface_create_for_data(
-	surface->buffer, CAIRO_FORMAT_RGB24,
-	surface->width, surface->height, surface->stride);
+void GuacVNCClient::UpdateScaledSurface() {
+	if(scaled_surface_ == NULL)
+		return;
+
+	if(scaled_stale_) {
+		guac_common_rect screen;
+		guac_common_rect_init(&screen, 0, 0, default_surface_->width, default_surface_->height);
+		ScaleDown(screen);
+		scaled_stale_ = false;
+	}
+	else {
+		for(const guac_common_rect& rect : scaled_dirty_)
+			ScaleDown(rect);
+	}
+	scaled_dirty_.clear();
 
-	cairo_t* cr = cairo_create(target);
-	//cairo_translate(cr, 0, 0);
-	cairo_scale(cr, scale_xy, scale_xy);
+	scaled_socket_.BeginFrame();
 
-	cairo_set_source_surface(cr, rect, 0, 0);
-	cairo_paint(cr);
+	bool flushed = false;
+	if(scaled_surface_->dirty || scaled_surface_->queue_length) {
+		guac_common_surface_flush(scaled_surface_);
+		flushed = true;
+	}
+	if(guac_common_surface_refine(scaled_surface_))
+		flushed = true;
 
-	std::ostringstream ss;
-	Base64 base64(ss);
+	if(flushed) {
+		last_sent_timestamp = guac_timestamp_current();
+		guac_protocol_send_sync(scaled_socket_, last_sent_timestamp);
+	}
 
-	cairo_surface_write_to_png_stream(target, WriteThumbnail, &base64);
+	scaled_socket_.EndFrame();
+}
 
-	cairo_destroy(cr);
-	cairo_surface_destroy(rect);
-	cairo_surface_destroy(target);
+void GuacVNCClient::ScaleDown(const guac_common_rect& rect) {
+	const int divisor = kScaledDisplayDivisor;
 
-	controller_.NewThumbnail(new std::string(ss.str()));
+	/* The squares of pixels that the area touches */
+	int x = rect.x / divisor;
+	int y = rect.y / divisor;
+	int w = std::min((rect.x + rect.width + divisor - 1) / divisor, scaled_surface_->width) - x;
+	int h = std::min((rect.y + rect.height + divisor - 1) / divisor, scaled_surface_->height) - y;
+	if(w <= 0 || h <= 0)
+		return;
+
+	scaled_pixels_.resize(static_cast<size_t>(w) * h * 4);
+
+	for(int row = 0; row < h; row++) {
+		int src_y = (y + row) * divisor;
+		int rows = std::min(divisor, default_surface_->height - src_y);
+		uint32_t* dst = reinterpret_cast<uint32_t*>(scaled_pixels_.data()) + static_cast<size_t>(row) * w;
+
+		for(int col = 0; col < w; col++) {
+			int src_x = (x + col) * divisor;
+			int cols = std::min(divisor, default_surface_->width - src_x);
+
+			/* Average each channel of the pixels in the square */
+			uint32_t sums[4] = {0, 0, 0, 0};
+			for(int i = 0; i < rows; i++) {
+				const uint32_t* src = reinterpret_cast<const uint32_t*>(
+					default_surface_->buffer + static_cast<size_t>(src_y + i) * default_surface_->stride) + src_x;
+				for(int j = 0; j < cols; j++) {
+					uint32_t pixel = src[j];
+					sums[0] += pixel & 0xFF;
+					sums[1] += (pixel >> 8) & 0xFF;
+					sums[2] += (pixel >> 16) & 0xFF;
+					sums[3] += pixel >> 24;
+				}
+			}
+
+			uint32_t count = rows * cols;
+			dst[col] = ((sums[0] + count / 2) / count) | (((sums[1] + count / 2) / count) << 8) |
+					   (((sums[2] + count / 2) / count) << 16) | (((sums[3] + count / 2) / count) << 24);
+		}
+	}
+
+	/* Only the pixels that changed are sent */
+	guac_common_surface_draw_pixels(scaled_surface_, x, y, w, h, scaled_pixels_.data(), w * 4, 4, NULL, NULL);
+}
+
+void GuacVNCClient::GenerateThumbnail() {
+	guac_common_surface* surface = default_surface_;
+
+	/* The last thumbnail is still current if nothing was drawn since */
+	if(surface == thumbnail_surface_ && surface->revision == thumbnail_revision_)
+		return;
+
+	thumbnail_surface_ = surface;
+	thumbnail_revision_ = surface->revision;
+
+	/* Reuse the snapshot buffer unless the last thumbnail is still being rendered from it or kept for screenshots */
+	size_t size = static_cast<size_t>(surface->stride) * surface->height;
+	if(!thumbnail_snapshot_ || thumbnail_snapshot_.use_count() > 1)
+		thumbnail_snapshot_ = std::make_shared<std::vector<unsigned char>>();
+	thumbnail_snapshot_->assign(surface->buffer, surface->buffer + size);
+
+	/* Scale and encode the snapshot in the background so the VNC thread can keep going */
+	std::shared_ptr<VMController> controller = controller_.shared_from_this();
+	std::shared_ptr<std::vector<unsigned char>> snapshot = thumbnail_snapshot_;
+	int width = surface->width;
+	int height = surface->height;
+	int stride = surface->stride;
+	EncoderPool::Get().Post([controller, snapshot, width, height, stride]() {
+		if(std::shared_ptr<const VMThumbnail> thumbnail = RenderThumbnail(snapshot, width, height, stride))
+			controller->NewThumbnail(thumbnail);
+	});
 }
 
 GuacVNCClient::~GuacVNCClient() {
@@ -3,18 +3,37 @@
 #include "GuacUser.h"
 #include <rfb/rfbclient.h>
 #include <rfb/rfbproto.h>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
 // Prevent libvncserver from redefining max macro
 #undef max
 #include "guacamole/guac_surface.h"
 #include "guacamole/guac_cursor.h"
+#include "AudioStream.h"
+#include "VideoStream.h"
+#include "RFBRecording.h"
+#include "SessionRecorder.h"
+#include "HLSStream.h"
+#include "CPUSet.h"
+#include <atomic>
 #include <chrono>
+#include <mutex>
 #include <sstream>
+#include <vector>
 
 /**
 * The maximum duration of a frame in milliseconds.
 */
 #define GUAC_VNC_FRAME_DURATION 40
 
+/**
+* The shortest frames will be made when every viewer keeps up, in
+* milliseconds. The longest is the frame duration set on the client.
+*/
+#define GUAC_VNC_MIN_FRAME_DURATION 40
+
 /**
 * The amount of time to allow per message read within a frame, in
 * milliseconds. If the server is silent for at least this amount of time, the
@@ -22,6 +41,64 @@
 */
 #define GUAC_VNC_FRAME_TIMEOUT 0
 
+/**
+* How often the VNC server's socket is checked for messages, in milliseconds,
+* on platforms where asio can't wait for it to become readable.
+*/
+#define GUAC_VNC_POLL_INTERVAL 10
+
+/**
+* Lookup tables for converting pixels from the VNC server's pixel format to
+* the 32-bit RGB format used by surfaces.
+*/
+struct GuacVNCPixelConversion {
+	int red_shift;
+	int green_shift;
+	int blue_shift;
+
+	uint32_t red_max;
+	uint32_t green_max;
+	uint32_t blue_max;
+
+	/**
+	* The value of each color component, already shifted to its position
+	* in the converted pixel.
+	*/
+	std::vector<uint32_t> red;
+	std::vector<uint32_t> green;
+	std::vector<uint32_t> blue;
+};
+
+/**
+* An area of the screen drawn on its own layer above the default layer, so
+* that frequent redraws within it don't cause the larger updates around it to
+* be encoded again.
+*/
+struct GuacVNCOverlay {
+	guac_layer* layer;
+	guac_common_surface* surface;
+
+	/**
+	* The area of the screen the layer covers.
+	*/
+	guac_common_rect rect;
+};
+
+/**
+* A probe of how long the guest takes to show input on its screen. A program
+* in the guest changes the probe's area whenever the probe's key is pressed,
+* so the time from sending the key until an update changes the area is the
+* input latency of the guest and the VNC server.
+*/
+struct GuacVNCLatencyProbe {
+	guac_common_rect rect;
+
+	/**
+	* The key that is pressed, or 0 if the probe is disabled.
+	*/
+	int keysym;
+};
+
 class CollabVMServer;
 class VMController;
 class GuacBroadcastSocket;
@@ -35,12 +112,202 @@ class GuacVNCClient : public GuacClient {
 	void CleanUp() override;
 	~GuacVNCClient() override;
 
+	/**
+	* Sets whether new VNC connections should decode directly into the
+	* buffer of their default surface, instead of keeping a separate
+	* framebuffer that is converted to the surface. This is only possible
+	* when the pixel format is 32-bit RGB with red and blue unswapped.
+	*/
+	static void SetShareFramebuffer(bool share);
+
+	/**
+	* Sets the number of pointer events per second sent to the VNC server
+	* while the mouse buttons don't change. Moves that arrive faster are
+	* merged into the latest position. A rate of 0 sends every move.
+	*/
+	static void SetMouseMoveRate(unsigned int rate);
+
+	/**
+	* Sets whether messages from the VNC server should stop being read.
+	* libvncclient only requests the next update after handling the last
+	* one, so while paused the VNC server stops sending updates and no time
+	* is spent decoding or encoding them. Reading resumes immediately when
+	* the client is unpaused, and the VNC server then sends everything that
+	* changed in the meantime.
+	*/
+	void SetPaused(bool paused);
+
+	/**
+	* Sets whether new VNC connections should ask QEMU to stream the VM's
+	* audio, which is then encoded once and broadcast to every viewer.
+	*/
+	inline void SetAudioEnabled(bool enabled) {
+		audio_enabled_ = enabled;
+	}
+
+	/**
+	* Sets whether areas of the screen that change continuously, like a
+	* playing video, are sent as a video stream to viewers that can play it.
+	*/
+	inline void SetVideoEnabled(bool enabled) {
+		video_enabled_ = enabled;
+	}
+
+	/**
+	* Sets the areas of the screen to draw on overlay layers, such as a
+	* taskbar clock. They are recreated before the next frame.
+	*/
+	void SetOverlays(const std::vector<guac_common_rect>& rects);
+
+	/**
+	* Sets how PNG images of the screen are encoded. The profile is used
+	* from the next frame.
+	*/
+	void SetPNGProfile(const guac_png_profile& profile);
+
+	/**
+	* Sets how JPEG images of the screen are encoded. The profile is used
+	* from the next frame.
+	*/
+	void SetJPEGProfile(const guac_jpeg_profile& profile);
+
+	/**
+	* Starts or stops recording the default layer. The recording is opened
+	* by the VNC thread at the start of its next frame, beginning with a
+	* copy of the whole screen.
+	*/
+	bool SetRecording(const std::string& path) override;
+
+	/**
+	* Starts or stops recording the broadcast. Like SetRecording(), the
+	* recorder is created by the VNC thread at the start of its next frame.
+	*/
+	bool SetSessionRecording(const std::string& prefix) override;
+
+	/**
+	* Sets the HLS stream that the display is encoded to, or null to stop
+	* encoding it. The stream gets its first frame from the VNC thread's
+	* next one.
+	*/
+	void SetHLSStream(std::shared_ptr<HLSStream> stream);
+
+	/**
+	* Parses a list of overlay areas in the form "x,y,width,height",
+	* separated by semicolons.
+	*
+	* @return Whether the list was valid.
+	*/
+	static bool ParseOverlays(const std::string& str, std::vector<guac_common_rect>& rects);
+
+	/**
+	* Sets the latency probe, which is sent every kLatencyProbeInterval.
+	*/
+	void SetLatencyProbe(const GuacVNCLatencyProbe& probe);
+
+	/**
+	* Parses a latency probe in the form "x,y,width,height,keysym", where the
+	* keysym can be decimal or hexadecimal. An empty string disables the probe.
+	*
+	* @return Whether the probe was valid.
+	*/
+	static bool ParseLatencyProbe(const std::string& str, GuacVNCLatencyProbe& probe);
+
+	/**
+	* Sets the RFB encodings that new VNC connections ask for, and the
+	* compress and quality levels (0-9) of the encodings that use them.
+	* The encodings are libvncclient's names separated by spaces, in order
+	* of preference. An empty list chooses by where the VNC server is: raw
+	* for a Unix domain socket or a loopback address, where compressing
+	* updates only costs both sides CPU time, and libvncclient's own
+	* preferences otherwise.
+	*/
+	void SetEncodings(const std::string& encodings, int compress_level, int quality_level);
+
+	/**
+	* Checks that a list of RFB encodings only has names that libvncclient
+	* knows.
+	*/
+	static bool CheckEncodings(const std::string& str);
+
+	/**
+	* Sets the CPUs that the VNC thread reads and encodes the screen on while
+	* it runs this client's frames, and allocates the surfaces from, so their
+	* memory is on the same NUMA node. An empty set doesn't restrict them.
+	*/
+	void SetCPUSet(const CPUSet& cpus);
+
+	/**
+	* Sets the most users per second that are sent the display when they
+	* join, or 0 for no limit. The rest wait their turn.
+	*/
+	void SetJoinRate(unsigned int rate);
+
+	/**
+	* Sets the bitrate, in kbit/s, that each viewer of the full quality
+	* display should be sent, or 0 to turn rate control off. The lossy
+	* quality, how much of the screen is sent lossy and the frame duration
+	* are adjusted to stay near it, within the VM's own settings.
+	*/
+	void SetTargetBitrate(unsigned int kbps);
+
+	/**
+	* Gets the function for converting pixels of the given format to the
+	* 32-bit RGB format of surfaces, building the lookup tables it uses.
+	* Returns NULL if the pixels can be copied to the surface as they are.
+	*/
+	static guac_common_surface_convert_func* CreatePixelConverter(const rfbPixelFormat& format, bool swap_red_blue,
+																  GuacVNCPixelConversion& conversion);
+
    private:
 	void OnUserJoin(GuacUser& user) override;
 	void OnUserLeave(GuacUser& user) override;
+
+	/**
+	* Sends the whole display to a user that joined or asked for it again.
+	*/
+	void SendDisplay(GuacUser& user);
+
+	/**
+	* Writes the whole display at its full size, as it's sent to users.
+	*
+	* @param since The timestamp of the last frame the socket's user has
+	*              applied, to only send the parts of the screen that changed
+	*              since then if they're known, or zero to send all of it.
+	*/
+	void DupDisplay(GuacSocket& socket, guac_timestamp since = 0);
+
+	/**
+	* Sends the display to the next batch of the users waiting for it.
+	* Runs on the strand.
+	*/
+	void AdmitJoins();
+
+	/**
+	* Starts join_timer_ for the next batch, with join_mutex_ locked.
+	*/
+	void ScheduleJoins();
 	void MouseHandler(GuacUser& user, int x, int y, int button_mask) override;
 	void KeyHandler(GuacUser& user, int keysym, int pressed) override;
+
+	/**
+	* Moves the cursor and sends a pointer event to the VNC server,
+	* replacing any move that is waiting to be sent.
+	* Must be called with input_mutex_ locked.
+	*/
+	void SendMouse(GuacUser& user, int x, int y, int button_mask);
+
+	/**
+	* Sends the move that was held back by MouseHandler(), if there is one.
+	*/
+	void FlushMouse(const boost::system::error_code& ec);
+
+	/**
+	* Sends the other users the cursor's position if it has moved since it
+	* was last sent.
+	*/
+	void FlushCursor();
 	void ClipboardHandler(GuacUser& user, guac_stream* stream, char* mimetype) override;
+	void OnStateChanged() override;
 
 	static void guac_vnc_update(rfbClient* client, int x, int y, int w, int h);
 	static void guac_vnc_copyrect(rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y);
@@ -48,13 +315,225 @@ class GuacVNCClient : public GuacClient {
 	static rfbBool guac_vnc_malloc_framebuffer(rfbClient* rfb_client);
 	static char* guac_vnc_get_password(rfbClient* rfb_client);
 	static void guac_vnc_cursor(rfbClient* client, int x, int y, int w, int h, int bpp);
+
+	/**
+	* Handlers for QEMU's audio extension to RFB. QEMU acknowledges the
+	* audio pseudo-encoding with an empty rectangle, and sends PCM samples
+	* in its own server message once the client enables audio.
+	*/
+	static rfbBool guac_vnc_audio_encoding(rfbClient* client, rfbFramebufferUpdateRectHeader* rect);
+	static rfbBool guac_vnc_audio_message(rfbClient* client, rfbServerToClientMsg* message);
+
+	/**
+	* Sets the audio format and asks QEMU to start streaming audio.
+	*/
+	void EnableAudio(rfbClient* client);
+
+	/**
+	* Handler for the ContinuousUpdates and Fence extensions to RFB. A VNC
+	* server that supports continuous updates answers their pseudo-encoding
+	* with an EndOfContinuousUpdates message, and from then on sends updates
+	* as the screen changes instead of waiting for each update request.
+	*/
+	static rfbBool guac_vnc_stream_encoding(rfbClient* client, rfbFramebufferUpdateRectHeader* rect);
+	static rfbBool guac_vnc_stream_message(rfbClient* client, rfbServerToClientMsg* message);
+
+	/**
+	* Asks the VNC server to send updates of the whole screen continuously.
+	*/
+	static void EnableContinuousUpdates(rfbClient* client);
+
+	/**
+	* Creates a layer for each overlay area within the screen, and hides
+	* those areas of the default layer.
+	*/
+	void CreateOverlays();
+	void FreeOverlays();
+
+	/**
+	* Copies the part of the screen within the given rectangle to the
+	* overlays it intersects.
+	*/
+	void DrawOverlays(int x, int y, int w, int h);
+
+	/**
+	* Hides the areas of the default layer that are drawn on other layers,
+	* which are the overlays and the video.
+	*/
+	void UpdateCovered();
+
+	/**
+	* Starts the video stream once an area of the screen has kept changing
+	* for long enough, stops it once the area settles or a viewer that can't
+	* play it joins, and sends a frame if the screen changed.
+	*/
+	void UpdateVideo();
+
+	/**
+	* Opens or closes the recording if SetRecording() was called, and the
+	* session recording if SetSessionRecording() was.
+	*/
+	void UpdateRecording();
+
+	/**
+	* Gives the session recorder a copy of the display if it needs one.
+	*/
+	void UpdateSessionRecording();
+
+	/**
+	* Gives the HLS stream a copy of the display if it changed and a frame
+	* is due.
+	*/
+	void UpdateHLS();
+
+	/**
+	* Applies the overlays and image profiles that were set since the
+	* VNC thread last read them, so they don't wait for a reconnect.
+	*/
+	void UpdateSettings();
+
+	/**
+	* Presses the key of the latency probe if it's time to, and gives up on
+	* a probe that the screen hasn't responded to.
+	*/
+	void UpdateLatencyProbe();
+
+	/**
+	* Checks if an update that was drawn to the default layer changed the
+	* area of the pending latency probe, and records the latency if it did.
+	*/
+	void CheckLatencyProbe(int x, int y, int w, int h);
+
+	/**
+	* Hashes the pixels of the probe's area in the default layer.
+	*/
+	uint32_t HashLatencyProbe() const;
+
+	/**
+	* Finds the area of the screen that is changing continuously, from the
+	* heat map of the default surface.
+	*
+	* @return Whether such an area was found.
+	*/
+	bool FindMotion(guac_common_rect& rect);
+
+	void StartVideo(const guac_common_rect& rect);
+	void StopVideo();
+
+	/**
+	* Gets the function for converting pixels from the current pixel format
+	* of the VNC client, rebuilding the lookup tables if the format changed.
+	* Returns NULL if the framebuffer can be copied to the surface as is.
+	*/
+	guac_common_surface_convert_func* GetPixelConverter(rfbClient* client);
 	int EndFrame();
+
+	/**
+	* Sends the screen's updates of the frame, waiting for them if they're
+	* still being encoded, then sends the frame to the viewers.
+	*/
+	void FinishFrame();
 	int GetProcessingLag();
+
+	/**
+	* Adjusts the duration of the next frame to how far behind the slowest
+	* viewer is. Frames are lengthened when viewers take longer to render
+	* them than they last, so fewer, larger updates are sent, and shortened
+	* again while every viewer keeps up.
+	*/
+	std::chrono::milliseconds UpdateFrameDuration();
+
+	/**
+	* Measures the bytes sent to viewers after each frame, and once a
+	* window has passed, moves the rate controller's settings a step
+	* towards the target bitrate. Over the target the quality is lowered
+	* first, then more of the screen is sent lossy, then frames are made
+	* longer; under it they're given back in the opposite order.
+	*/
+	void UpdateRateControl();
+
+	/**
+	* Gives the surfaces the JPEG profile from the settings, with the
+	* rate controller's changes.
+	*/
+	void ApplyJPEGProfile();
 	rfbClient* GetVNCClient();
-	void VNCThread();
+
+	/**
+	* Opens or closes the connection to the VNC server to match the
+	* state of the client. Runs on the strand.
+	*/
+	void UpdateState();
+
+	/**
+	* Connects to the VNC server and starts reading from it.
+	* Returns false if the connection couldn't be made.
+	*/
+	bool OpenConnection();
+
+	/**
+	* Handles the messages the VNC server has sent and flushes a frame
+	* to the viewers, then waits for the next message or tick.
+	*/
+	void RunFrame();
+
+	/**
+	* Waits for the RFB socket to become readable, or for the tick timer
+	* to fire, before running the next frame.
+	*/
+	void WaitForFrame();
+	void CloseConnection();
 	void GenerateThumbnail();
 
-	std::thread vnc_thread_;
+	/**
+	* Remembers that an area of the screen changed, so it's scaled down
+	* into the scaled surface before the next flush.
+	*/
+	void MarkScaled(int x, int y, int w, int h);
+
+	/**
+	* Scales the changed areas of the screen into the scaled surface, and
+	* broadcasts its updates to the users of the scaled down display.
+	*/
+	void UpdateScaledSurface();
+
+	/**
+	* Scales an area of the screen into the scaled surface, averaging each
+	* square of kScaledDisplayDivisor by kScaledDisplayDivisor pixels.
+	*/
+	void ScaleDown(const guac_common_rect& rect);
+
+	/**
+	* Serializes the handlers of the VNC connection, which run on the
+	* threads shared by the VNC connections of every client.
+	*/
+	boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+
+	/**
+	* A duplicate of libvncclient's socket, which is only waited on for
+	* readiness. The messages are still read by libvncclient.
+	*/
+#ifdef BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR
+	boost::asio::posix::stream_descriptor rfb_socket_;
+#endif
+
+	/**
+	* Runs a frame once a second while the VNC server is silent, so
+	* settings, lossy refinements and thumbnails are still handled.
+	*/
+	boost::asio::steady_timer tick_timer_;
+
+	/**
+	* Whether a connection has been opened and not closed yet.
+	* Only used on the strand.
+	*/
+	bool open_;
+
+	/**
+	* Incremented whenever a frame runs, so that the wait that didn't
+	* start the frame is ignored when it completes. Only used on the strand.
+	*/
+	uint64_t wait_id_;
 
 	/**
 	 * Pointer to the RFB client which is used by the mouse and
@@ -62,6 +541,59 @@ class GuacVNCClient : public GuacClient {
 	 */
 	rfbClient* rfb_client_;
 
+	/**
+	 * Serializes input sent from the processing thread and from the
+	 * websocket threads, and keeps rfb_client_ from being cleaned up
+	 * while input is being sent with it.
+	 */
+	std::mutex input_mutex_;
+
+	/**
+	* Fires when the move held back by MouseHandler() is due to be sent.
+	* The timer and the mouse state below are guarded by input_mutex_.
+	*/
+	boost::asio::steady_timer mouse_timer_;
+
+	/**
+	* The time and button mask of the last pointer event that was sent.
+	*/
+	std::chrono::steady_clock::time_point last_mouse_event_;
+	int mouse_mask_;
+
+	/**
+	* The user and position of the latest move that hasn't been sent
+	* yet, or NULL if there isn't one.
+	*/
+	GuacUser* pending_mouse_user_;
+	int pending_mouse_x_;
+	int pending_mouse_y_;
+
+	/**
+	* Sends the cursor's position to the other users when no frame is run
+	* soon after it moves, at most once every GUAC_VNC_MIN_FRAME_DURATION. The timer,
+	* whether it's waiting and when the position was last sent are
+	* guarded by input_mutex_.
+	*/
+	boost::asio::steady_timer cursor_timer_;
+	bool cursor_flush_pending_;
+	std::chrono::steady_clock::time_point cursor_flushed_;
+
+	/**
+	* The users waiting to be sent the display, in the order they joined,
+	* and the most that are sent it per second. Guarded by join_mutex_.
+	*/
+	std::vector<GuacUser*> pending_joins_;
+	unsigned int join_rate_;
+	std::mutex join_mutex_;
+
+	/**
+	* Fires on the strand when the next batch of pending_joins_ is due, which
+	* is next_join_. Guarded by join_mutex_, as is whether it's been started.
+	*/
+	boost::asio::steady_timer join_timer_;
+	std::chrono::steady_clock::time_point next_join_;
+	bool join_scheduled_;
+
 	/**
 	* The original framebuffer malloc procedure provided by the initialized
 	* rfbClient.
@@ -83,9 +615,17 @@ class GuacVNCClient : public GuacClient {
 	char* password_;
 
 	/**
-	* Space-separated list of encodings to use within the VNC session.
+	* Space-separated list of encodings to use within the VNC session, and
+	* the levels given to libvncclient. Changed with state_mutex_ locked.
+	*/
+	std::string encodings_;
+	int compress_level_;
+	int quality_level_;
+
+	/**
+	* The CPUs to run frames on. Changed with state_mutex_ locked.
 	*/
-	char* encodings_;
+	CPUSet cpus_;
 
 	/**
 	* Whether the red and blue components of each color should be swapped.
@@ -113,7 +653,55 @@ class GuacVNCClient : public GuacClient {
 	/**
 	* Whether audio is enabled.
 	*/
-	bool audio_enabled_;
+	std::atomic<bool> audio_enabled_;
+
+	/**
+	* The stream the VM's audio is broadcast on.
+	*/
+	AudioStream audio_;
+
+	/**
+	* Buffer that audio messages are read into.
+	*/
+	std::vector<unsigned char> audio_buffer_;
+
+	/**
+	* Whether the VNC server is sending continuous updates on the current
+	* connection.
+	*/
+	bool continuous_updates_;
+
+	/**
+	* Whether video is enabled.
+	*/
+	std::atomic<bool> video_enabled_;
+
+	/**
+	* The stream that the changing area of the screen is sent on, and the
+	* layer and area it's played on.
+	*/
+	VideoStream video_;
+	guac_layer* video_layer_;
+	guac_common_rect video_rect_;
+
+	/**
+	* The area that has been changing since video_candidate_since_, which
+	* is 0 if no area is changing.
+	*/
+	guac_common_rect video_candidate_;
+	guac_timestamp video_candidate_since_;
+
+	/**
+	* When the video's area was last found changing, and when the heat map
+	* was last checked.
+	*/
+	guac_timestamp video_motion_;
+	guac_timestamp video_checked_;
+
+	/**
+	* The revision of the default surface the last video frame was made from.
+	*/
+	unsigned int video_revision_;
 
 	/**
 	* Mouse cursor.
@@ -125,6 +713,242 @@ class GuacVNCClient : public GuacClient {
 	*/
 	guac_common_surface* default_surface_;
 
+	/**
+	* The screen at a fraction of its size, for the users of the scaled
+	* down display. It's only drawn while there are some, from the areas of
+	* the screen in scaled_dirty_, or from all of it if scaled_stale_ is set.
+	* Only used by the VNC thread.
+	*/
+	guac_common_surface* scaled_surface_;
+	std::vector<guac_common_rect> scaled_dirty_;
+	bool scaled_stale_;
+
+	/**
+	* The pixels being scaled down, before they're drawn to the scaled surface.
+	*/
+	std::vector<unsigned char> scaled_pixels_;
+
+	/**
+	* The cursor image being converted to ARGB. It's kept between cursor
+	* updates so they don't allocate.
+	*/
+	std::vector<unsigned char> cursor_pixels_;
+
+	/**
+	* The most areas kept in scaled_dirty_, after which all of the screen
+	* is scaled down instead.
+	*/
+	constexpr static size_t kMaxScaledRects = 64;
+
+	/**
+	* When the screen was last resized. Guests often change their resolution
+	* several times in a row while booting, so the screen is only sent once it
+	* has kept its size for kResizeSettleTime, and the sizes it passed through
+	* are never encoded. resize_settling_ is set while frames are held back.
+	*/
+	std::chrono::steady_clock::time_point resized_;
+	bool resize_settling_;
+	constexpr static std::chrono::milliseconds kResizeSettleTime = std::chrono::milliseconds(250);
+
+	/**
+	* How long encoding the last flushed frame took, and when it finished.
+	* When encoding takes longer than a frame, the next frames are skipped
+	* until the VNC thread has spent as long reading messages as it spent
+	* encoding, and the updates keep merging in the surfaces meanwhile.
+	* frame_skipped_ is set while a frame is being held back.
+	*/
+	std::chrono::steady_clock::duration flush_time_;
+	std::chrono::steady_clock::time_point flushed_;
+	bool frame_skipped_;
+
+	/**
+	* Whether the screen's updates of the last frame are still being
+	* encoded from the surface's snapshot, while the next frame's messages
+	* are read. The frame is ended by FinishFrame() once they're encoded,
+	* or before the next frame is flushed or the display is copied for a
+	* keyframe, and instructions written meanwhile go out with it. frame_id_ tells the encoders' completion
+	* which frame it's for, and the rest is what's needed to end the frame.
+	* Only used on the strand.
+	*/
+	bool frame_pending_;
+	uint64_t frame_id_;
+	bool frame_flushed_;
+	std::chrono::steady_clock::time_point frame_received_;
+	std::chrono::steady_clock::time_point frame_flush_start_;
+
+	/**
+	* The layers of the overlays for the current connection, and the areas
+	* set with SetOverlays(), which are guarded by state_mutex_.
+	*/
+	std::vector<GuacVNCOverlay> overlays_;
+	std::vector<guac_common_rect> overlay_rects_;
+
+	/**
+	* The profiles set with SetPNGProfile() and SetJPEGProfile(), guarded
+	* by state_mutex_.
+	*/
+	guac_png_profile png_profile_;
+	guac_jpeg_profile jpeg_profile_;
+
+	/**
+	* The bitrate set with SetTargetBitrate(), guarded by state_mutex_.
+	*/
+	unsigned int target_bitrate_;
+
+	/**
+	* The JPEG profile the surfaces were last given from the settings.
+	* Only used by the VNC thread.
+	*/
+	guac_jpeg_profile surface_jpeg_profile_;
+
+	/**
+	* The bytes sent to each viewer since the rate controller's window
+	* started, and the lossy quality and the update rate areas are sent
+	* lossy at that it chose, which are 0 while they aren't limited, and
+	* the shortest frame duration. Only used by the VNC thread.
+	*/
+	uint64_t rate_bytes_;
+	std::chrono::steady_clock::time_point rate_window_start_;
+	int rate_quality_;
+	int rate_lossy_framerate_;
+	std::chrono::milliseconds rate_min_frame_duration_;
+
+	/**
+	* Whether the overlays or profiles were set since the VNC thread last
+	* read them, guarded by state_mutex_.
+	*/
+	bool overlays_changed_;
+	bool profiles_changed_;
+
+	/**
+	* The path set with SetRecording(), guarded by state_mutex_, and whether
+	* it has changed since the VNC thread last opened or closed recorder_.
+	*/
+	std::string recording_path_;
+	bool recording_changed_;
+
+	/**
+	* Writes the updates of the default layer while recording. Only used
+	* by the VNC thread.
+	*/
+	RFBRecorder recorder_;
+
+	/**
+	* The prefix set with SetSessionRecording(), guarded by state_mutex_,
+	* and whether it has changed since the VNC thread last read it.
+	*/
+	std::string session_prefix_;
+	bool session_changed_;
+
+	/**
+	* Records the broadcast socket while recording sessions. Only used
+	* by the VNC thread.
+	*/
+	std::shared_ptr<SessionRecorder> session_recorder_;
+
+	/**
+	* The stream set with SetHLSStream(), guarded by state_mutex_, and
+	* whether it has changed since the VNC thread last read it.
+	*/
+	std::shared_ptr<HLSStream> hls_stream_;
+	bool hls_changed_;
+
+	/**
+	* The HLS stream the VNC thread writes to, and the revision of the
+	* default surface it was last given.
+	*/
+	std::shared_ptr<HLSStream> hls_;
+	unsigned int hls_revision_;
+
+	/**
+	* A new session recording file is started after this many bytes.
+	*/
+	constexpr static uint64_t kSessionFileSize = 64 * 1024 * 1024;
+
+	/**
+	* The bytes of messages that can wait to be written to a session
+	* recording before the oldest are dropped.
+	*/
+	constexpr static size_t kSessionQueueSize = 16 * 1024 * 1024;
+
+	/**
+	* The probe set with SetLatencyProbe(), guarded by state_mutex_, and the
+	* copy the VNC thread is using, whose area fits within the screen.
+	*/
+	GuacVNCLatencyProbe latency_probe_;
+	GuacVNCLatencyProbe active_probe_;
+
+	/**
+	* When the key of the pending probe was pressed, and the hash of the
+	* probe's area before that, while probe_pending_ is set.
+	*/
+	std::chrono::steady_clock::time_point probe_sent_;
+	uint32_t probe_hash_;
+	bool probe_pending_;
+
+	/**
+	* When the next probe should be sent.
+	*/
+	std::chrono::steady_clock::time_point next_probe_;
+
+	constexpr static std::chrono::seconds kLatencyProbeInterval = std::chrono::seconds(5);
+
+	/**
+	* How long the screen has to respond to a probe before it's counted as
+	* timed out, which happens if the guest's program isn't running.
+	*/
+	constexpr static std::chrono::seconds kLatencyProbeTimeout = std::chrono::seconds(2);
+
+	/**
+	* The pixel format the conversion tables were built for.
+	*/
+	rfbPixelFormat converted_format_;
+
+	GuacVNCPixelConversion pixel_conversion_;
+
+	/**
+	* The function converting pixels of converted_format_.
+	*/
+	guac_common_surface_convert_func* pixel_converter_;
+
+	/**
+	* Whether libvncclient's frameBuffer is the buffer of default_surface_
+	* for the current connection.
+	*/
+	bool shared_framebuffer_;
+
+	/**
+	* The duration of the current frame, chosen by UpdateFrameDuration().
+	*/
+	std::chrono::milliseconds current_frame_duration_;
+
+	/**
+	* Whether the VNC thread should stop reading from the VNC server.
+	* Changed with state_mutex_ locked, so that the thread can wait for it.
+	*/
+	std::atomic<bool> paused_;
+
+	/**
+	* The surface and revision the last thumbnail was made from, to avoid
+	* making an identical thumbnail when nothing has been drawn since.
+	*/
+	const guac_common_surface* thumbnail_surface_;
+	unsigned int thumbnail_revision_;
+
+	/**
+	* The copy of the surface that the last thumbnail was rendered from,
+	* reused for the next one once the worker has released it.
+	*/
+	std::shared_ptr<std::vector<unsigned char>> thumbnail_snapshot_;
+
+	static std::atomic<bool> share_framebuffer_;
+
+	/**
+	* The minimum time between pointer events with the same button mask,
+	* in microseconds.
+	*/
+	static std::atomic<int> mouse_interval_;
+
 	char* vnc_settings_[9];
 
 	static char* GUAC_VNC_CLIENT_KEY;
@@ -6,26 +6,65 @@
 
 GuacWebSocket::GuacWebSocket(CollabVMServer* server, std::weak_ptr<websocketmm::websocket_user> handle)
 	: server_(server),
-	  websocket_handle_(handle) {
+	  websocket_handle_(handle),
+	  webp_enabled_(false),
+	  screen_codec_enabled_(false),
+	  screen_codec_zstd_enabled_(false),
+	  video_enabled_(false),
+	  holding_(false) {
+	// A user is only sent instructions of its own when it joins and for its
+	// cursor, so keeping the capacity of the whole display between them
+	// would waste memory on every idle viewer
+	SetMaxRetained(kMaxRetainedBytes);
 }
 
 void GuacWebSocket::InstructionBegin() {
-	// Lock stringstream
+	// Lock buffer
 	mutex_.lock();
 }
 
 void GuacWebSocket::InstructionEnd() {
-	std::string str = ss_.str();
+	// Send the binary version of the instruction if it contains image data
+	ByteBuffer& buffer = has_binary_data_ ? binary_buffer_ : buffer_;
+	auto type = has_binary_data_ ? websocketmm::websocket_message::type::binary : websocketmm::websocket_message::type::text;
 
-	// Clear stringstream
-	ss_.str("");
+	// Check that the message ends with a semicolon
+	//assert(buffer.Back() == ';');
+	if(buffer.Empty() || buffer.Back() != ';') {
+		// Clear buffer
+		ClearBuffers();
+		mutex_.unlock();
+		return;
+	}
 
-	// Unlock stringstream
-	mutex_.unlock();
+	// Move the instruction into the message without copying it
+	auto message = websocketmm::BuildWebsocketMessage(type, buffer.Release());
+	ClearBuffers();
 
-	// Check that the message ends with a semicolon
-	//assert(str[str.length() - 1] == ';');
-	if(str.length() && str[str.length() - 1] == ';') {
-		server_->SendGuacMessage(websocket_handle_, str);
+	if(holding_) {
+		held_.push_back(std::move(message));
+		mutex_.unlock();
+		return;
 	}
+
+	// Unlock buffer
+	mutex_.unlock();
+
+	server_->SendGuacMessage(websocket_handle_, message);
+}
+
+void GuacWebSocket::Hold() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	holding_ = true;
+}
+
+std::function<void()> GuacWebSocket::ReleaseHeld() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	holding_ = false;
+	std::vector<std::shared_ptr<const websocketmm::websocket_message>> messages;
+	messages.swap(held_);
+	return [server = server_, handle = websocket_handle_, messages = std::move(messages)]() {
+		for(const auto& message : messages)
+			server->SendGuacMessage(handle, message);
+	};
 }
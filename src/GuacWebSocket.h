@@ -1,6 +1,8 @@
 #pragma once
 #include "GuacSocket.h"
+#include <functional>
 #include <memory>
+#include <vector>
 
 #include <websocketmm/fwd.h>
 
@@ -20,6 +22,94 @@ class GuacWebSocket : public GuacSocket {
 	void InstructionBegin() override;
 	void InstructionEnd() override;
 
+	/**
+	 * Enables sending image data in binary messages, for clients that
+	 * negotiated the binary subprotocol.
+	 */
+	inline void SetBinary(bool binary) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		binary_enabled_ = binary;
+	}
+
+	inline bool IsBinary() const {
+		return binary_enabled_;
+	}
+
+	/**
+	 * Enables sending WebP images, for clients that listed image/webp
+	 * as a supported mimetype when connecting to a VM.
+	 */
+	inline void SetWebP(bool webp) {
+		webp_enabled_ = webp;
+	}
+
+	bool IsWebP() override {
+		return webp_enabled_;
+	}
+
+	/**
+	 * Enables sending images in the screen codec, for clients that listed
+	 * its mimetype when connecting to a VM, and compressing them with zstd
+	 * for clients that also listed the mimetype of that.
+	 */
+	inline void SetScreenCodec(bool screen_codec) {
+		screen_codec_enabled_ = screen_codec;
+	}
+
+	inline void SetScreenCodecZstd(bool zstd) {
+		screen_codec_zstd_enabled_ = zstd;
+	}
+
+	bool IsScreenCodec() override {
+		return screen_codec_enabled_;
+	}
+
+	bool IsScreenCodecZstd() override {
+		return screen_codec_enabled_ && screen_codec_zstd_enabled_;
+	}
+
+	/**
+	 * Enables sending video streams, for clients that listed video/vp8
+	 * as a supported mimetype when connecting to a VM.
+	 */
+	inline void SetVideo(bool video) {
+		video_enabled_ = video;
+	}
+
+	bool IsVideo() override {
+		return video_enabled_;
+	}
+
+	/**
+	 * Keeps the messages of the instructions written from now on instead
+	 * of sending them, until ReleaseHeld() is called.
+	 */
+	void Hold();
+
+	/**
+	 * Stops holding the messages of instructions, and returns a function
+	 * that sends the ones that were held, so they can be sent from elsewhere.
+	 */
+	std::function<void()> ReleaseHeld();
+
 	CollabVMServer* server_;
 	std::weak_ptr<websocketmm::websocket_user> websocket_handle_;
+
+   private:
+	/**
+	 * The capacity each buffer keeps after an instruction is sent.
+	 */
+	constexpr static size_t kMaxRetainedBytes = 512;
+
+	bool webp_enabled_;
+	bool screen_codec_enabled_;
+	bool screen_codec_zstd_enabled_;
+	bool video_enabled_;
+
+	/**
+	 * Whether messages are being held, and the messages that were.
+	 * Guarded by mutex_.
+	 */
+	bool holding_;
+	std::vector<std::shared_ptr<const websocketmm::websocket_message>> held_;
 };
@@ -0,0 +1,451 @@
+#include "HLSStream.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+/**
+ * The PIDs of the transport stream's tables and its one video stream.
+ */
+constexpr static uint16_t kPATPID = 0x0000;
+constexpr static uint16_t kPMTPID = 0x1000;
+constexpr static uint16_t kVideoPID = 0x0100;
+
+constexpr static size_t kPacketSize = 188;
+
+/**
+ * How far the timestamps of the first frame are from zero, in 90 kHz
+ * units, so the clock reference before them is never negative.
+ */
+constexpr static int64_t kPTSOffset = 90000 / 10;
+
+/**
+ * How long before a frame's presentation time its clock reference is.
+ */
+constexpr static int64_t kPCRDelay = 90000 / 100;
+
+/**
+ * The streams of each VM, for the HTTP server.
+ */
+static std::mutex registry_lock;
+static std::unordered_map<std::string, std::weak_ptr<HLSStream>> registry;
+
+/**
+ * The CRC-32 of the MPEG-2 sections, which isn't reflected like zlib's.
+ */
+static uint32_t SectionCRC(const uint8_t* data, size_t size) {
+	uint32_t crc = 0xFFFFFFFF;
+	for(size_t i = 0; i < size; i++) {
+		crc ^= static_cast<uint32_t>(data[i]) << 24;
+		for(int bit = 0; bit < 8; bit++)
+			crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+	}
+	return crc;
+}
+
+std::shared_ptr<HLSStream> HLSStream::Create(const std::string& name) {
+	std::shared_ptr<HLSStream> stream(new HLSStream(name));
+	std::lock_guard<std::mutex> lock(registry_lock);
+	registry[name] = stream;
+	return stream;
+}
+
+std::shared_ptr<HLSStream> HLSStream::Find(const std::string& name) {
+	std::lock_guard<std::mutex> lock(registry_lock);
+	auto it = registry.find(name);
+	return it != registry.end() ? it->second.lock() : nullptr;
+}
+
+static std::string GetStreamPrefix() {
+	char prefix[17];
+	std::snprintf(prefix, sizeof(prefix), "%llx",
+				  static_cast<unsigned long long>(std::chrono::system_clock::now().time_since_epoch().count()));
+	return prefix;
+}
+
+HLSStream::HLSStream(const std::string& name)
+	:
+#ifdef USE_HLS
+	  encoder_(nullptr),
+#endif
+	  name_(name),
+	  prefix_(GetStreamPrefix()),
+	  pending_width_(0),
+	  pending_height_(0),
+	  pending_stride_(0),
+	  pending_changed_(false),
+	  stopping_(false),
+	  discontinuity_sequence_(0),
+	  width_(0),
+	  height_(0),
+	  frame_(0),
+	  segment_frames_(0),
+	  sequence_(0),
+	  discontinuity_(false),
+	  counters_ { 0, 0, 0 } {
+	thread_ = std::thread(&HLSStream::Run, this);
+}
+
+HLSStream::~HLSStream() {
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		stopping_ = true;
+	}
+	wake_.notify_one();
+	thread_.join();
+#ifdef USE_HLS
+	CloseEncoder();
+#endif
+
+	// A stream created for the VM since then stays
+	std::lock_guard<std::mutex> lock(registry_lock);
+	auto it = registry.find(name_);
+	if(it != registry.end() && it->second.expired())
+		registry.erase(it);
+}
+
+void HLSStream::Write(const unsigned char* pixels, int width, int height, int stride,
+					  std::chrono::steady_clock::time_point now) {
+	next_write_ = now + std::chrono::milliseconds(1000 / kFrameRate);
+	std::lock_guard<std::mutex> lock(lock_);
+	pending_.assign(pixels, pixels + static_cast<size_t>(stride) * height);
+	pending_width_ = width;
+	pending_height_ = height;
+	pending_stride_ = stride;
+	pending_changed_ = true;
+}
+
+void HLSStream::Run() {
+	std::vector<unsigned char> frame;
+	int width = 0;
+	int height = 0;
+	int stride = 0;
+	const auto interval = std::chrono::milliseconds(1000 / kFrameRate);
+	auto next = std::chrono::steady_clock::now();
+
+	std::unique_lock<std::mutex> lock(lock_);
+	while(!wake_.wait_until(lock, next, [this] { return stopping_; })) {
+		// Frames that were missed while encoding are skipped instead of bunched up
+		auto now = std::chrono::steady_clock::now();
+		next += interval;
+		if(next < now)
+			next = now + interval;
+
+		// The last frame is encoded again while the display doesn't change
+		if(pending_changed_) {
+			frame.swap(pending_);
+			width = pending_width_;
+			height = pending_height_;
+			stride = pending_stride_;
+			pending_changed_ = false;
+		}
+
+		lock.unlock();
+		if(!frame.empty())
+			Encode(frame, width, height, stride);
+		lock.lock();
+	}
+}
+
+#ifdef USE_HLS
+bool HLSStream::OpenEncoder(int width, int height) {
+	width_ = width;
+	height_ = height;
+
+	x264_param_t param;
+	if(x264_param_default_preset(&param, "veryfast", "zerolatency") < 0)
+		return false;
+	param.i_width = width;
+	param.i_height = height;
+	param.i_csp = X264_CSP_I420;
+	param.i_fps_num = kFrameRate;
+	param.i_fps_den = 1;
+	param.i_timebase_num = 1;
+	param.i_timebase_den = kFrameRate;
+	param.b_vfr_input = 0;
+	param.i_threads = 2;
+	param.i_log_level = X264_LOG_NONE;
+
+	// Keyframes only come at the start of each segment
+	param.i_keyint_max = kSegmentFrames;
+	param.i_scenecut_threshold = 0;
+
+	param.rc.i_rc_method = X264_RC_ABR;
+	param.rc.i_bitrate = kBitrate;
+	param.rc.i_vbv_max_bitrate = kBitrate;
+	param.rc.i_vbv_buffer_size = kBitrate;
+
+	// Every segment can be decoded on its own
+	param.b_repeat_headers = 1;
+	param.b_annexb = 1;
+	param.b_aud = 1;
+	if(x264_param_apply_profile(&param, "main") < 0)
+		return false;
+
+	encoder_ = x264_encoder_open(&param);
+	if(!encoder_) {
+		Logger::Warning("HLS") << "Couldn't create an encoder for the " << width << 'x' << height
+							   << " display of VM \"" << name_ << '"';
+		return false;
+	}
+	if(x264_picture_alloc(&picture_, X264_CSP_I420, width, height) < 0) {
+		x264_encoder_close(encoder_);
+		encoder_ = nullptr;
+		return false;
+	}
+	return true;
+}
+
+void HLSStream::CloseEncoder() {
+	if(!encoder_)
+		return;
+	x264_picture_clean(&picture_);
+	x264_encoder_close(encoder_);
+	encoder_ = nullptr;
+}
+#endif
+
+void HLSStream::Encode(const std::vector<unsigned char>& pixels, int width, int height, int stride) {
+#ifdef USE_HLS
+	// I420 has a chroma sample for every two by two pixels
+	width &= ~1;
+	height &= ~1;
+	if(width <= 0 || height <= 0)
+		return;
+
+	if(width != width_ || height != height_) {
+		if(encoder_) {
+			CutSegment();
+			discontinuity_ = true;
+			CloseEncoder();
+		}
+		OpenEncoder(width, height);
+	}
+
+	// An encoder that couldn't be created isn't tried again until the resolution changes
+	if(!encoder_)
+		return;
+
+	// BT.601 with limited range, from the surfaces' BGRX bytes
+	const x264_image_t& image = picture_.img;
+	for(int y = 0; y < height; y += 2) {
+		const uint8_t* row = pixels.data() + static_cast<size_t>(y) * stride;
+		uint8_t* luma = image.plane[0] + static_cast<size_t>(y) * image.i_stride[0];
+		uint8_t* u = image.plane[1] + static_cast<size_t>(y / 2) * image.i_stride[1];
+		uint8_t* v = image.plane[2] + static_cast<size_t>(y / 2) * image.i_stride[2];
+		for(int x = 0; x < width; x += 2) {
+			int r = 0;
+			int g = 0;
+			int b = 0;
+			for(int dy = 0; dy < 2; dy++) {
+				for(int dx = 0; dx < 2; dx++) {
+					const uint8_t* pixel = row + dy * stride + (x + dx) * 4;
+					luma[dy * image.i_stride[0] + x + dx] =
+						((66 * pixel[2] + 129 * pixel[1] + 25 * pixel[0] + 128) >> 8) + 16;
+					r += pixel[2];
+					g += pixel[1];
+					b += pixel[0];
+				}
+			}
+			r >>= 2;
+			g >>= 2;
+			b >>= 2;
+			u[x / 2] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+			v[x / 2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+		}
+	}
+
+	picture_.i_pts = frame_;
+	picture_.i_type = frame_ % kSegmentFrames == 0 ? X264_TYPE_IDR : X264_TYPE_AUTO;
+	frame_++;
+
+	x264_nal_t* nals;
+	int nal_count;
+	x264_picture_t output;
+	int size = x264_encoder_encode(encoder_, &nals, &nal_count, &picture_, &output);
+	if(size <= 0)
+		return;
+
+	if(output.b_keyframe && segment_frames_ >= kSegmentFrames)
+		CutSegment();
+
+	// The payloads of the NAL units are contiguous
+	WriteFrame(nals[0].p_payload, size, output.i_pts * 90000 / kFrameRate + kPTSOffset, output.b_keyframe);
+#else
+	(void)pixels;
+	(void)width;
+	(void)height;
+	(void)stride;
+#endif
+}
+
+void HLSStream::CutSegment() {
+	if(segment_.empty())
+		return;
+
+	Segment segment;
+	segment.sequence = sequence_++;
+	segment.frames = segment_frames_;
+	segment.discontinuity = discontinuity_;
+	segment.data = std::make_shared<const std::vector<uint8_t>>(std::move(segment_));
+	segment_.clear();
+	segment_frames_ = 0;
+	discontinuity_ = false;
+
+	std::lock_guard<std::mutex> lock(segments_lock_);
+	segments_.push_back(std::move(segment));
+	while(segments_.size() > kKeptSegments)
+		segments_.pop_front();
+
+	// Players count the discontinuities that have left the playlist
+	size_t first = segments_.size() > kPlaylistSegments ? segments_.size() - kPlaylistSegments : 0;
+	if(first > 0 && segments_[first - 1].discontinuity)
+		discontinuity_sequence_++;
+
+	int max_frames = kSegmentFrames;
+	for(size_t i = first; i < segments_.size(); i++)
+		max_frames = std::max(max_frames, segments_[i].frames);
+
+	playlist_ = "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:";
+	playlist_ += std::to_string((max_frames + kFrameRate - 1) / kFrameRate);
+	playlist_ += "\n#EXT-X-MEDIA-SEQUENCE:";
+	playlist_ += std::to_string(segments_[first].sequence);
+	playlist_ += "\n#EXT-X-DISCONTINUITY-SEQUENCE:";
+	playlist_ += std::to_string(discontinuity_sequence_);
+	playlist_ += '\n';
+	for(size_t i = first; i < segments_.size(); i++) {
+		if(segments_[i].discontinuity && i != first)
+			playlist_ += "#EXT-X-DISCONTINUITY\n";
+		char duration[32];
+		std::snprintf(duration, sizeof(duration), "#EXTINF:%.3f,\n", static_cast<double>(segments_[i].frames) / kFrameRate);
+		playlist_ += duration;
+		playlist_ += prefix_;
+		playlist_ += '-';
+		playlist_ += std::to_string(segments_[i].sequence);
+		playlist_ += ".ts\n";
+	}
+}
+
+std::string HLSStream::GetPlaylist() {
+	std::lock_guard<std::mutex> lock(segments_lock_);
+	return playlist_;
+}
+
+std::shared_ptr<const std::vector<uint8_t>> HLSStream::GetSegment(std::string_view name) {
+	constexpr std::string_view kExtension = ".ts";
+	if(name.size() <= prefix_.size() + 1 + kExtension.size() || name.compare(0, prefix_.size(), prefix_) != 0 ||
+	   name[prefix_.size()] != '-' || name.substr(name.size() - kExtension.size()) != kExtension)
+		return nullptr;
+
+	uint64_t sequence = 0;
+	for(char c : name.substr(prefix_.size() + 1, name.size() - prefix_.size() - 1 - kExtension.size())) {
+		if(c < '0' || c > '9')
+			return nullptr;
+		sequence = sequence * 10 + (c - '0');
+	}
+
+	std::lock_guard<std::mutex> lock(segments_lock_);
+	if(segments_.empty() || sequence < segments_.front().sequence || sequence > segments_.back().sequence)
+		return nullptr;
+	return segments_[sequence - segments_.front().sequence].data;
+}
+
+void HLSStream::WritePacket(uint16_t pid, bool start, const uint8_t*& data, size_t& size, int64_t pcr,
+							bool random_access) {
+	uint8_t& counter = counters_[pid == kPATPID ? 0 : pid == kPMTPID ? 1 : 2];
+
+	// The adaptation field carries the clock reference, and pads out the last packet
+	size_t needed = pcr >= 0 ? 8 : random_access ? 2 : 0;
+	size_t payload = std::min(size, kPacketSize - 4 - needed);
+	size_t adaptation = kPacketSize - 4 - payload;
+
+	size_t offset = segment_.size();
+	segment_.resize(offset + kPacketSize);
+	uint8_t* packet = segment_.data() + offset;
+	packet[0] = 0x47;
+	packet[1] = (start ? 0x40 : 0) | (pid >> 8 & 0x1F);
+	packet[2] = pid & 0xFF;
+	packet[3] = (adaptation ? 0x30 : 0x10) | (counter++ & 0x0F);
+
+	uint8_t* p = packet + 4;
+	if(adaptation) {
+		p[0] = adaptation - 1;
+		if(adaptation > 1) {
+			p[1] = (random_access ? 0x40 : 0) | (pcr >= 0 ? 0x10 : 0);
+			size_t used = 2;
+			if(pcr >= 0) {
+				p[2] = pcr >> 25;
+				p[3] = pcr >> 17;
+				p[4] = pcr >> 9;
+				p[5] = pcr >> 1;
+				p[6] = (pcr & 1) << 7 | 0x7E;
+				p[7] = 0;
+				used = 8;
+			}
+			std::memset(p + used, 0xFF, adaptation - used);
+		}
+		p += adaptation;
+	}
+
+	std::memcpy(p, data, payload);
+	data += payload;
+	size -= payload;
+}
+
+void HLSStream::WriteTables() {
+	// The PAT lists the one program, and the PMT its H.264 stream, which carries the clock
+	uint8_t pat[] = { 0x00, 0x00, 0xB0, 0x0D, 0x00, 0x01, 0xC1, 0x00, 0x00,
+					  0x00, 0x01, static_cast<uint8_t>(0xE0 | kPMTPID >> 8), kPMTPID & 0xFF, 0, 0, 0, 0 };
+	uint8_t pmt[] = { 0x00, 0x02, 0xB0, 0x12, 0x00, 0x01, 0xC1, 0x00, 0x00,
+					  static_cast<uint8_t>(0xE0 | kVideoPID >> 8), kVideoPID & 0xFF, 0xF0, 0x00,
+					  0x1B, static_cast<uint8_t>(0xE0 | kVideoPID >> 8), kVideoPID & 0xFF, 0xF0, 0x00, 0, 0, 0, 0 };
+	for(auto table : { std::make_pair(pat, sizeof(pat)), std::make_pair(pmt, sizeof(pmt)) }) {
+		// The CRC covers the section, after the pointer field
+		uint32_t crc = SectionCRC(table.first + 1, table.second - 5);
+		uint8_t* end = table.first + table.second;
+		end[-4] = crc >> 24;
+		end[-3] = crc >> 16;
+		end[-2] = crc >> 8;
+		end[-1] = crc;
+
+		// The rest of the packet is filled with 0xFF after the section
+		uint8_t payload[kPacketSize - 4];
+		std::memset(payload, 0xFF, sizeof(payload));
+		std::memcpy(payload, table.first, table.second);
+		const uint8_t* data = payload;
+		size_t size = sizeof(payload);
+		WritePacket(table.first == pat ? kPATPID : kPMTPID, true, data, size, -1, false);
+	}
+}
+
+void HLSStream::WriteFrame(const uint8_t* data, size_t size, int64_t pts, bool keyframe) {
+	if(segment_.empty())
+		WriteTables();
+
+	// Video PES packets can leave their length out
+	std::vector<uint8_t> pes(14 + size);
+	pes[0] = 0x00;
+	pes[1] = 0x00;
+	pes[2] = 0x01;
+	pes[3] = 0xE0;
+	pes[4] = 0x00;
+	pes[5] = 0x00;
+	pes[6] = 0x80;
+	pes[7] = 0x80;
+	pes[8] = 5;
+	pes[9] = 0x21 | (pts >> 29 & 0x0E);
+	pes[10] = pts >> 22;
+	pes[11] = (pts >> 14 & 0xFE) | 1;
+	pes[12] = pts >> 7;
+	pes[13] = (pts << 1 & 0xFE) | 1;
+	std::memcpy(pes.data() + 14, data, size);
+
+	const uint8_t* payload = pes.data();
+	size_t remaining = pes.size();
+	WritePacket(kVideoPID, true, payload, remaining, pts - kPCRDelay, keyframe);
+	while(remaining)
+		WritePacket(kVideoPID, false, payload, remaining, -1, false);
+	segment_frames_++;
+}
@@ -0,0 +1,206 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef USE_HLS
+extern "C" {
+	#include <x264.h>
+}
+#endif
+
+/**
+ * Encodes a VM's screen as H.264 and cuts it into the MPEG-TS segments of
+ * an HLS stream, which are served over HTTP with a playlist of the latest
+ * ones. Players fetch the same files no matter how many are watching, so a
+ * CDN in front of the server can serve audiences of any size.
+ *
+ * The VNC thread hands it a copy of the display whenever it changes, at most
+ * at the frame rate, and a thread of its own encodes the latest copy at a
+ * fixed rate, so the stream keeps going while the screen is still. Each
+ * segment starts with a keyframe, and a change of resolution starts a new
+ * one after a discontinuity.
+ *
+ * Only available in builds with HLS=1, which needs libx264. Can be used from
+ * any thread.
+ */
+class HLSStream {
+   public:
+	constexpr static int kFrameRate = 10;
+
+	/**
+	 * The length of each segment in frames, one second.
+	 */
+	constexpr static int kSegmentFrames = kFrameRate;
+
+	/**
+	 * The number of segments in the playlist. Older ones can still be
+	 * fetched until kKeptSegments have been cut after them.
+	 */
+	constexpr static size_t kPlaylistSegments = 6;
+	constexpr static size_t kKeptSegments = kPlaylistSegments * 2;
+
+	/**
+	 * The average bitrate of the video in kbit/s.
+	 */
+	constexpr static int kBitrate = 1500;
+
+	/**
+	 * Creates the stream of a VM and starts its thread. The HTTP server
+	 * finds it by the VM's name until it's destroyed.
+	 */
+	static std::shared_ptr<HLSStream> Create(const std::string& name);
+
+	/**
+	 * Finds the stream of a VM.
+	 *
+	 * @return The stream, or null if the VM doesn't have one.
+	 */
+	static std::shared_ptr<HLSStream> Find(const std::string& name);
+
+	/**
+	 * Whether the server was built with HLS support.
+	 */
+	static bool IsSupported() {
+#ifdef USE_HLS
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/**
+	 * Stops the thread. Segments that were already fetched stay valid.
+	 */
+	~HLSStream();
+
+	HLSStream(const HLSStream&) = delete;
+	HLSStream& operator=(const HLSStream&) = delete;
+
+	/**
+	 * Whether a frame is due, so the display should be copied with Write().
+	 */
+	bool WantsFrame(std::chrono::steady_clock::time_point now) const {
+		return now >= next_write_;
+	}
+
+	/**
+	 * Copies the display as the frame the next ones are encoded from until
+	 * it's written again.
+	 *
+	 * @param pixels 32-bit RGB pixels, like the surfaces'.
+	 */
+	void Write(const unsigned char* pixels, int width, int height, int stride,
+			   std::chrono::steady_clock::time_point now);
+
+	/**
+	 * Gets the media playlist of the latest segments, or an empty string
+	 * before the first one has been cut.
+	 */
+	std::string GetPlaylist();
+
+	/**
+	 * Gets a segment by the name the playlist gives it.
+	 *
+	 * @return The segment, or null if it's unknown or too old.
+	 */
+	std::shared_ptr<const std::vector<uint8_t>> GetSegment(std::string_view name);
+
+   private:
+	explicit HLSStream(const std::string& name);
+
+	struct Segment {
+		uint64_t sequence;
+		int frames;
+
+		/**
+		 * Whether the resolution changed since the segment before it.
+		 */
+		bool discontinuity;
+		std::shared_ptr<const std::vector<uint8_t>> data;
+	};
+
+	void Run();
+
+	/**
+	 * Converts a frame to I420 and encodes it, cutting the segment first
+	 * if the frame is a keyframe that ends it.
+	 */
+	void Encode(const std::vector<unsigned char>& pixels, int width, int height, int stride);
+
+	/**
+	 * Adds the segment being written to the playlist.
+	 */
+	void CutSegment();
+
+	/**
+	 * Appends an encoded frame to the segment as a PES packet.
+	 */
+	void WriteFrame(const uint8_t* data, size_t size, int64_t pts, bool keyframe);
+	void WriteTables();
+	void WritePacket(uint16_t pid, bool start, const uint8_t*& data, size_t& size, int64_t pcr, bool random_access);
+
+#ifdef USE_HLS
+	bool OpenEncoder(int width, int height);
+	void CloseEncoder();
+
+	x264_t* encoder_;
+	x264_picture_t picture_;
+#endif
+
+	const std::string name_;
+
+	/**
+	 * Makes the segment names unique across restarts of the stream, so
+	 * caches never mix segments of different runs.
+	 */
+	const std::string prefix_;
+
+	/**
+	 * The display handed over by Write(), guarded by lock_.
+	 */
+	std::mutex lock_;
+	std::condition_variable wake_;
+	std::vector<unsigned char> pending_;
+	int pending_width_;
+	int pending_height_;
+	int pending_stride_;
+	bool pending_changed_;
+	bool stopping_;
+
+	std::chrono::steady_clock::time_point next_write_;
+
+	/**
+	 * The segments that can be fetched, oldest first, and the playlist of
+	 * the latest ones. Guarded by segments_lock_.
+	 */
+	std::mutex segments_lock_;
+	std::deque<Segment> segments_;
+	std::string playlist_;
+	uint64_t discontinuity_sequence_;
+
+	/**
+	 * The state of the encoder and the segment being written, only used
+	 * by the stream's thread.
+	 */
+	int width_;
+	int height_;
+	int64_t frame_;
+	std::vector<uint8_t> segment_;
+	int segment_frames_;
+	uint64_t sequence_;
+	bool discontinuity_;
+	/**
+	 * The continuity counters of the PAT, the PMT and the video.
+	 */
+	uint8_t counters_[3];
+
+	std::thread thread_;
+};
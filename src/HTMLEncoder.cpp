@@ -0,0 +1,149 @@
+#include "HTMLEncoder.h"
+#include "SIMD.h"
+
+#if defined(SIMD_X86)
+	#include <immintrin.h>
+#elif defined(__ARM_NEON)
+	#include <arm_neon.h>
+#endif
+
+static bool IsPlain(char c) {
+	return c >= 32 && c <= 126 && c != '&' && c != '<' && c != '>' && c != '"' && c != '\'' && c != '/';
+}
+
+static size_t CountPlainScalar(const char* str, size_t length) {
+	size_t i = 0;
+	while(i < length && IsPlain(str[i]))
+		i++;
+	return i;
+}
+
+#if defined(SIMD_X86)
+SIMD_TARGET_SSE42
+static size_t CountPlainSSE42(const char* str, size_t length) {
+	/* The ranges of plain characters, which skip " & ' / < and > */
+	const __m128i ranges = _mm_setr_epi8(0x20, 0x21, 0x23, 0x25, 0x28, 0x2E, 0x30, 0x3B,
+										 0x3D, 0x3D, 0x3F, 0x7E, 0, 0, 0, 0);
+	size_t i = 0;
+	while(length - i >= 16) {
+		const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i));
+		const int index = _mm_cmpestri(ranges, 12, chars, 16,
+									   _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY |
+									   _SIDD_LEAST_SIGNIFICANT);
+		if(index != 16)
+			return i + index;
+		i += 16;
+	}
+	return i + CountPlainScalar(str + i, length - i);
+}
+
+SIMD_TARGET_AVX2
+static size_t CountPlainAVX2(const char* str, size_t length) {
+	size_t i = 0;
+	while(length - i >= 32) {
+		const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(str + i));
+
+		/* Bytes of 0x80 and up are negative, so they fail the first comparison */
+		__m256i plain = _mm256_and_si256(_mm256_cmpgt_epi8(chars, _mm256_set1_epi8(31)),
+										 _mm256_cmpgt_epi8(_mm256_set1_epi8(127), chars));
+		__m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('&')),
+										  _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('<')));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('>')));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('"')));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\'')));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('/')));
+		plain = _mm256_andnot_si256(special, plain);
+
+		const uint32_t escaped = ~static_cast<uint32_t>(_mm256_movemask_epi8(plain));
+		if(escaped)
+			return i + __builtin_ctz(escaped);
+		i += 32;
+	}
+	return i + CountPlainScalar(str + i, length - i);
+}
+#elif defined(__ARM_NEON)
+static size_t CountPlainNEON(const char* str, size_t length) {
+	size_t i = 0;
+	while(length - i >= 16) {
+		const uint8x16_t chars = vld1q_u8(reinterpret_cast<const uint8_t*>(str + i));
+		uint8x16_t plain = vandq_u8(vcgeq_u8(chars, vdupq_n_u8(32)), vcleq_u8(chars, vdupq_n_u8(126)));
+		uint8x16_t special = vorrq_u8(vceqq_u8(chars, vdupq_n_u8('&')), vceqq_u8(chars, vdupq_n_u8('<')));
+		special = vorrq_u8(special, vceqq_u8(chars, vdupq_n_u8('>')));
+		special = vorrq_u8(special, vceqq_u8(chars, vdupq_n_u8('"')));
+		special = vorrq_u8(special, vceqq_u8(chars, vdupq_n_u8('\'')));
+		special = vorrq_u8(special, vceqq_u8(chars, vdupq_n_u8('/')));
+		plain = vbicq_u8(plain, special);
+
+		/* Narrow the mask to a nibble for each byte */
+		const uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(plain), 4);
+		const uint64_t escaped = ~vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+		if(escaped)
+			return i + __builtin_ctzll(escaped) / 4;
+		i += 16;
+	}
+	return i + CountPlainScalar(str + i, length - i);
+}
+#endif
+
+using CountPlainFunc = size_t(const char* str, size_t length);
+
+size_t (*const HTMLEncoder::CountPlain)(const char* str, size_t length) =
+	SIMD::Select<CountPlainFunc>("html", {
+		CountPlainScalar,
+#if defined(SIMD_X86)
+		CountPlainSSE42,
+		CountPlainAVX2,
+		nullptr,
+		nullptr
+#elif defined(__ARM_NEON)
+		nullptr,
+		nullptr,
+		nullptr,
+		CountPlainNEON
+#else
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr
+#endif
+	});
+
+size_t HTMLEncoder::Append(const char* str, size_t length, std::string& out) {
+	const size_t start = out.size();
+
+	// Most text has nothing to escape, so it only needs its own length
+	out.reserve(start + length);
+	size_t i = 0;
+	while(true) {
+		size_t plain = CountPlain(str + i, length - i);
+		out.append(str + i, plain);
+		i += plain;
+		if(i == length)
+			break;
+
+		switch(str[i++]) {
+			case '&':
+				out += "&amp;";
+				break;
+			case '<':
+				out += "&lt;";
+				break;
+			case '>':
+				out += "&gt;";
+				break;
+			case '"':
+				out += "&quot;";
+				break;
+			case '\'':
+				out += "&#x27;";
+				break;
+			case '/':
+				out += "&#x2F;";
+				break;
+			case '\n':
+				out += "&#13;&#10;";
+				break;
+		}
+	}
+	return out.size() - start;
+}
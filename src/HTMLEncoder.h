@@ -0,0 +1,27 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+/**
+ * Escapes text from users that's shown to others as HTML, like chat
+ * messages and the names of uploaded files.
+ */
+class HTMLEncoder {
+   public:
+	/**
+	 * Appends a string with the characters that are special in HTML
+	 * escaped and newlines made into entities. Every other character that
+	 * isn't printable ASCII is dropped, so what's appended is ASCII and its
+	 * length in bytes is also its length in the Guacamole protocol.
+	 *
+	 * @return The number of characters appended.
+	 */
+	static size_t Append(const char* str, size_t length, std::string& out);
+
+   private:
+	/**
+	 * Gets the length of the run of printable ASCII characters that don't
+	 * need to be escaped at the start of a string, which is copied as it is.
+	 */
+	static size_t (*const CountPlain)(const char* str, size_t length);
+};
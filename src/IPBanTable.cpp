@@ -0,0 +1,140 @@
+#include "IPBanTable.h"
+
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+unsigned IPBanTable::GetBytes(const boost::asio::ip::address& addr, uint8_t* bytes) {
+	if(addr.is_v4() || addr.to_v6().is_v4_mapped()) {
+		auto ipv4 = (addr.is_v4() ? addr.to_v4() : addr.to_v6().to_v4()).to_bytes();
+		std::memcpy(bytes, ipv4.data(), ipv4.size());
+		return 32;
+	}
+
+	auto ipv6 = addr.to_v6().to_bytes();
+	std::memcpy(bytes, ipv6.data(), ipv6.size());
+	return 128;
+}
+
+bool IPBanTable::NormalizePrefix(const std::string& text, std::string& prefix) {
+	size_t slash = text.find('/');
+	boost::system::error_code ec;
+	boost::asio::ip::address addr = boost::asio::ip::make_address(text.substr(0, slash), ec);
+	if(ec)
+		return false;
+
+	uint8_t bytes[16];
+	unsigned bits = GetBytes(addr, bytes);
+	unsigned length = bits;
+	if(slash != std::string::npos) {
+		const char* start = text.c_str() + slash + 1;
+		char* end;
+		if(!std::isdigit(static_cast<unsigned char>(*start)))
+			return false;
+
+		// The length of a mapped IPv4 address counts the bits before it
+		unsigned long value = std::strtoul(start, &end, 10);
+		unsigned mapped_bits = (addr.is_v6() ? 128 : 32) - bits;
+		if(*end || value < mapped_bits || value > bits + mapped_bits)
+			return false;
+		length = value - mapped_bits;
+	}
+
+	for(unsigned i = 0; i < bits / 8; i++) {
+		if(i * 8 >= length)
+			bytes[i] = 0;
+		else if(i * 8 + 8 > length)
+			bytes[i] &= 0xFF << (i * 8 + 8 - length);
+	}
+
+	if(bits == 32) {
+		boost::asio::ip::address_v4::bytes_type ipv4;
+		std::memcpy(ipv4.data(), bytes, ipv4.size());
+		prefix = boost::asio::ip::address_v4(ipv4).to_string();
+	} else {
+		boost::asio::ip::address_v6::bytes_type ipv6;
+		std::memcpy(ipv6.data(), bytes, ipv6.size());
+		prefix = boost::asio::ip::address_v6(ipv6).to_string();
+	}
+	prefix += '/';
+	prefix += std::to_string(length);
+	return true;
+}
+
+void IPBanTable::Insert(std::vector<Node>& nodes, const uint8_t* bytes, unsigned length, const IPBan& ban) {
+	uint32_t index = 0;
+	for(unsigned i = 0; i < length; i++) {
+		int bit = (bytes[i / 8] >> (7 - i % 8)) & 1;
+		if(!nodes[index].children[bit]) {
+			nodes[index].children[bit] = nodes.size();
+			nodes.emplace_back();
+		}
+		index = nodes[index].children[bit];
+	}
+
+	// The same prefix can only be stored once per type, but a mapped IPv4
+	// address and the IPv4 address itself end up in the same node
+	int64_t& expires = nodes[index].expires[ban.Type];
+	if(expires == -1 || (expires != 0 && (ban.Expires == 0 || ban.Expires > expires)))
+		expires = ban.Expires;
+}
+
+void IPBanTable::Update(const IPBanMap& bans) {
+	std::shared_ptr<Tree> tree;
+	for(const auto& [key, ban] : bans) {
+		size_t slash = ban.Prefix.find('/');
+		boost::system::error_code ec;
+		boost::asio::ip::address addr = boost::asio::ip::make_address(ban.Prefix.substr(0, slash), ec);
+		if(ec || slash == std::string::npos || ban.Type > IPBan::kMute)
+			continue;
+
+		uint8_t bytes[16];
+		unsigned bits = GetBytes(addr, bytes);
+		unsigned length = std::strtoul(ban.Prefix.c_str() + slash + 1, nullptr, 10);
+		if(length > bits)
+			continue;
+
+		if(!tree)
+			tree = std::make_shared<Tree>();
+		Insert(bits == 32 ? tree->ipv4 : tree->ipv6, bytes, length, ban);
+	}
+	std::atomic_store(&tree_, std::shared_ptr<const Tree>(std::move(tree)));
+}
+
+void IPBanTable::Lookup(const std::vector<Node>& nodes, const uint8_t* bytes, unsigned bits, int64_t now, Match& match) {
+	// Every prefix of the address is on the path from the root,
+	// and the path ends where no longer prefix could match
+	const Node* node = &nodes[0];
+	for(unsigned i = 0;; i++) {
+		int64_t expires = node->expires[IPBan::kBan];
+		if(expires == 0 || expires > now)
+			match.banned = true;
+
+		expires = node->expires[IPBan::kMute];
+		if(expires == 0 || expires > now) {
+			if(!match.muted || (match.mute_expires != 0 && (expires == 0 || expires > match.mute_expires)))
+				match.mute_expires = expires;
+			match.muted = true;
+		}
+
+		if(i == bits)
+			break;
+		uint32_t child = node->children[(bytes[i / 8] >> (7 - i % 8)) & 1];
+		if(!child)
+			break;
+		node = &nodes[child];
+	}
+}
+
+IPBanTable::Match IPBanTable::Lookup(const boost::asio::ip::address& addr, int64_t now) const {
+	Match match;
+	std::shared_ptr<const Tree> tree = std::atomic_load(&tree_);
+	if(!tree)
+		return match;
+
+	uint8_t bytes[16];
+	unsigned bits = GetBytes(addr, bytes);
+	Lookup(bits == 32 ? tree->ipv4 : tree->ipv6, bytes, bits, now, match);
+	return match;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <boost/asio/ip/address.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Database/IPBan.h"
+
+/**
+ * Finds the bans and mutes that apply to an address. The prefixes are kept
+ * in a binary radix tree for each address family, so a lookup only follows
+ * the bits of the address for as long as there are prefixes that could
+ * still match it, however many bans there are. The trees are rebuilt when
+ * the bans change and swapped in atomically, so lookups from the network
+ * threads never wait for a lock while a flood of connections is checked.
+ */
+class IPBanTable {
+   public:
+	struct Match {
+		bool banned = false;
+		bool muted = false;
+
+		/**
+		 * When the longest of the mutes runs out, in seconds since the
+		 * Unix epoch, or 0 if one of them never does.
+		 */
+		int64_t mute_expires = 0;
+	};
+
+	/**
+	 * Replaces the prefixes in the table. Only one thread may call this
+	 * at a time, but lookups can happen while it does.
+	 */
+	void Update(const IPBanMap& bans);
+
+	/**
+	 * Finds the bans and mutes of an address that haven't run out.
+	 *
+	 * @param now The current time in seconds since the Unix epoch.
+	 */
+	Match Lookup(const boost::asio::ip::address& addr, int64_t now) const;
+
+	/**
+	 * Parses an address or a subnet in CIDR notation and formats it the
+	 * way IPBan::Prefix is stored, with the host bits cleared. IPv4
+	 * addresses mapped to IPv6 are formatted as IPv4.
+	 *
+	 * @return Whether it's a valid address or subnet.
+	 */
+	static bool NormalizePrefix(const std::string& text, std::string& prefix);
+
+   private:
+	struct Node {
+		/**
+		 * The indices of the nodes for the next bit being 0 or 1. The root
+		 * is never a child, so 0 means there isn't one.
+		 */
+		uint32_t children[2] = { 0, 0 };
+
+		/**
+		 * When the ban and the mute of the prefix run out, indexed by
+		 * IPBan::TypeEnum. 0 never runs out, and -1 means there isn't one.
+		 */
+		int64_t expires[2] = { -1, -1 };
+	};
+
+	struct Tree {
+		std::vector<Node> ipv4 = std::vector<Node>(1);
+		std::vector<Node> ipv6 = std::vector<Node>(1);
+	};
+
+	/**
+	 * Converts an address to the bytes that are looked up in its tree.
+	 *
+	 * @return The number of bits in the address.
+	 */
+	static unsigned GetBytes(const boost::asio::ip::address& addr, uint8_t* bytes);
+
+	static void Insert(std::vector<Node>& nodes, const uint8_t* bytes, unsigned length, const IPBan& ban);
+	static void Lookup(const std::vector<Node>& nodes, const uint8_t* bytes, unsigned bits, int64_t now, Match& match);
+
+	/**
+	 * Accessed with std::atomic_load() and std::atomic_store(), and
+	 * null when there aren't any bans.
+	 */
+	std::shared_ptr<const Tree> tree_;
+};
@@ -0,0 +1,140 @@
+#include "IPDataTable.h"
+
+#include <cstring>
+#include <vector>
+
+IPDataTable::IPDataTable(std::chrono::steady_clock::duration expiry_delay, std::function<bool(IPData&)> can_delete)
+	: expiry_delay_(expiry_delay),
+	  can_delete_(std::move(can_delete)) {
+}
+
+size_t IPDataTable::Hash(uint64_t key) {
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return static_cast<size_t>(key);
+}
+
+size_t IPDataTable::IPv6Hash::operator()(const std::array<uint8_t, 16>& addr) const {
+	uint64_t high, low;
+	std::memcpy(&high, addr.data(), sizeof(high));
+	std::memcpy(&low, addr.data() + sizeof(high), sizeof(low));
+	return Hash(high ^ Hash(low));
+}
+
+IPDataTable::Stripe& IPDataTable::GetStripe(uint32_t ipv4) {
+	return stripes_[Hash(ipv4) % kStripeCount];
+}
+
+IPDataTable::Stripe& IPDataTable::GetStripe(const std::array<uint8_t, 16>& ipv6) {
+	return stripes_[IPv6Hash()(ipv6) % kStripeCount];
+}
+
+IPDataTable::Stripe& IPDataTable::GetStripe(const IPData& ip_data) {
+	if(ip_data.type == IPData::IPType::kIPv4)
+		return GetStripe(static_cast<const IPv4Data&>(ip_data).addr);
+	else
+		return GetStripe(static_cast<const IPv6Data&>(ip_data).addr);
+}
+
+IPData* IPDataTable::AddConnection(const boost::asio::ip::address& addr, uint8_t max_connections) {
+	IPData** ip_data;
+	bool created = false;
+	std::unique_lock<std::mutex> lock;
+	if(addr.is_v4() || addr.to_v6().is_v4_mapped()) {
+		uint32_t ipv4 = (addr.is_v4() ? addr.to_v4() : addr.to_v6().to_v4()).to_ulong();
+		Stripe& stripe = GetStripe(ipv4);
+		lock = std::unique_lock<std::mutex>(stripe.mutex);
+		ip_data = &stripe.ipv4_data[ipv4];
+		if(*ip_data == nullptr) {
+			*ip_data = new IPv4Data(ipv4, false);
+			created = true;
+		}
+	} else {
+		const std::array<uint8_t, 16>& ipv6 = addr.to_v6().to_bytes();
+		Stripe& stripe = GetStripe(ipv6);
+		lock = std::unique_lock<std::mutex>(stripe.mutex);
+		ip_data = &stripe.ipv6_data[ipv6];
+		if(*ip_data == nullptr) {
+			*ip_data = new IPv6Data(ipv6, false);
+			created = true;
+		}
+	}
+
+	if(!created && (*ip_data)->connections >= max_connections)
+		return nullptr;
+
+	(*ip_data)->connections++;
+	return *ip_data;
+}
+
+bool IPDataTable::RemoveConnection(IPData& ip_data) {
+	Stripe& stripe = GetStripe(ip_data);
+	std::lock_guard<std::mutex> lock(stripe.mutex);
+	if(--ip_data.connections)
+		return false;
+
+	// IPData that's already queued is deleted by Expire()
+	if(ip_data.expiry_queued)
+		return false;
+
+	if(can_delete_(ip_data)) {
+		Delete(stripe, ip_data);
+		return false;
+	}
+
+	return QueueExpiry(ip_data);
+}
+
+bool IPDataTable::Expire() {
+	std::vector<IPData*> expired;
+	auto now = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lock(expiry_mutex_);
+		while(!expiry_queue_.empty() && expiry_queue_.front().first <= now) {
+			expired.push_back(expiry_queue_.front().second);
+			expiry_queue_.pop_front();
+		}
+	}
+
+	for(IPData* ip_data : expired) {
+		Stripe& stripe = GetStripe(*ip_data);
+		std::lock_guard<std::mutex> lock(stripe.mutex);
+		ip_data->expiry_queued = false;
+
+		// The IP connected again, so RemoveConnection() will queue it
+		// once its connections have all closed
+		if(ip_data->connections)
+			continue;
+
+		if(can_delete_(*ip_data))
+			Delete(stripe, *ip_data);
+		else
+			QueueExpiry(*ip_data);
+	}
+
+	std::lock_guard<std::mutex> lock(expiry_mutex_);
+	return !expiry_queue_.empty();
+}
+
+std::unique_lock<std::mutex> IPDataTable::Lock(const IPData& ip_data) {
+	return std::unique_lock<std::mutex>(GetStripe(ip_data).mutex);
+}
+
+void IPDataTable::Delete(Stripe& stripe, IPData& ip_data) {
+	if(ip_data.type == IPData::IPType::kIPv4)
+		stripe.ipv4_data.erase(static_cast<IPv4Data&>(ip_data).addr);
+	else
+		stripe.ipv6_data.erase(static_cast<IPv6Data&>(ip_data).addr);
+
+	delete &ip_data;
+}
+
+bool IPDataTable::QueueExpiry(IPData& ip_data) {
+	ip_data.expiry_queued = true;
+
+	std::lock_guard<std::mutex> lock(expiry_mutex_);
+	bool was_empty = expiry_queue_.empty();
+	expiry_queue_.emplace_back(std::chrono::steady_clock::now() + expiry_delay_, &ip_data);
+	return was_empty;
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <boost/asio/ip/address.hpp>
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "CollabVMUser.h"
+
+/**
+ * The IPData for every address that is connected, or that disconnected
+ * recently enough that its rate limits still apply. The table is split into
+ * stripes that each have their own lock, so connections from different
+ * addresses can be accepted at the same time. IPData without any connections
+ * is queued for expiry, and only the entries that are due are checked when
+ * Expire() is called, instead of every address in the table.
+ */
+class IPDataTable {
+   public:
+	/**
+	 * @param expiry_delay How long to wait after an IP's last connection
+	 *                     closes before checking whether it can be deleted.
+	 * @param can_delete Returns whether the rate limits of an IP have run
+	 *                   out so it can be deleted. Called with the IP's
+	 *                   stripe locked.
+	 */
+	IPDataTable(std::chrono::steady_clock::duration expiry_delay, std::function<bool(IPData&)> can_delete);
+
+	/**
+	 * Adds a connection to the IPData for an address, creating it if
+	 * the address isn't in the table.
+	 *
+	 * @return The IPData, or null if the address already has
+	 *         max_connections connections.
+	 */
+	IPData* AddConnection(const boost::asio::ip::address& addr, uint8_t max_connections);
+
+	/**
+	 * Removes a connection from an IP. When it was the last one, the IPData
+	 * is deleted if its rate limits have run out, otherwise it's queued to
+	 * be checked again after the expiry delay.
+	 *
+	 * @return Whether the expiry queue was empty, meaning Expire() has
+	 *         to be scheduled.
+	 */
+	bool RemoveConnection(IPData& ip_data);
+
+	/**
+	 * Deletes the IPData that has been queued for longer than the expiry
+	 * delay and can be deleted, and queues the rest of it again.
+	 *
+	 * @return Whether there is still IPData waiting to expire.
+	 */
+	bool Expire();
+
+	/**
+	 * Locks the stripe of an IP, so that its IPData can be changed
+	 * without a connection keeping it from being deleted.
+	 */
+	std::unique_lock<std::mutex> Lock(const IPData& ip_data);
+
+   private:
+	struct IPv6Hash {
+		size_t operator()(const std::array<uint8_t, 16>& addr) const;
+	};
+
+	struct Stripe {
+		std::mutex mutex;
+		std::unordered_map<uint32_t, IPData*> ipv4_data;
+		std::unordered_map<std::array<uint8_t, 16>, IPData*, IPv6Hash> ipv6_data;
+	};
+
+	/**
+	 * Mixes the bits of a key so that addresses from the same subnet
+	 * are spread across the stripes.
+	 */
+	static size_t Hash(uint64_t key);
+
+	Stripe& GetStripe(uint32_t ipv4);
+	Stripe& GetStripe(const std::array<uint8_t, 16>& ipv6);
+	Stripe& GetStripe(const IPData& ip_data);
+
+	/**
+	 * Removes IPData from its stripe and deletes it.
+	 * Must be called with the stripe locked.
+	 */
+	static void Delete(Stripe& stripe, IPData& ip_data);
+
+	/**
+	 * Adds IPData to the end of the expiry queue.
+	 * Must be called with its stripe locked.
+	 *
+	 * @return Whether the queue was empty.
+	 */
+	bool QueueExpiry(IPData& ip_data);
+
+	static constexpr size_t kStripeCount = 16;
+
+	std::array<Stripe, kStripeCount> stripes_;
+
+	const std::chrono::steady_clock::duration expiry_delay_;
+	const std::function<bool(IPData&)> can_delete_;
+
+	/**
+	 * IPData without any connections, along with the time it should be
+	 * checked. Every entry waits for the same delay, so the queue is
+	 * ordered by time.
+	 */
+	std::deque<std::pair<std::chrono::steady_clock::time_point, IPData*>> expiry_queue_;
+	std::mutex expiry_mutex_;
+};
@@ -0,0 +1,149 @@
+#include "ImageCache.h"
+#include <guacamole/hash.h>
+
+#include <algorithm>
+
+ImageCache& ImageCache::Get() {
+	static ImageCache cache;
+	return cache;
+}
+
+ImageCache::ImageCache()
+	: capacity_(0) {
+}
+
+void ImageCache::SetCapacity(size_t capacity) {
+	capacity_ = capacity;
+	for(Shard& shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		Trim(shard);
+	}
+}
+
+void ImageCache::Clear() {
+	for(Shard& shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		shard.entries.clear();
+		shard.index.clear();
+		shard.size = 0;
+	}
+}
+
+ImageCache::EntryList::iterator ImageCache::FindEntry(Shard& shard, cairo_surface_t* surface, uint64_t hash,
+													  int format) {
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+
+	auto range = shard.index.equal_range(hash);
+	for(auto it = range.first; it != range.second; it++) {
+		Entry& entry = *it->second;
+		if(entry.format != format || entry.width != width || entry.height != height)
+			continue;
+
+		// Compare the pixels in case the hashes collided
+		if(guac_tile_equal(cairo_image_surface_get_data(surface), cairo_image_surface_get_stride(surface),
+						   entry.pixels.data(), width * 4, width, height))
+			return it->second;
+	}
+
+	return shard.entries.end();
+}
+
+bool ImageCache::Find(cairo_surface_t* surface, uint64_t hash, int format, std::vector<unsigned char>& image) {
+	if(capacity_ == 0)
+		return false;
+
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	auto claimed = [&](const Claim& claim) {
+		return claim.hash == hash && claim.format == format && claim.width == width && claim.height == height;
+	};
+
+	Shard& shard = GetShard(hash);
+	std::unique_lock<std::mutex> lock(shard.mutex);
+	shard.claim_released.wait(lock, [&] {
+		return std::none_of(shard.claims.begin(), shard.claims.end(), claimed);
+	});
+
+	EntryList::iterator it = FindEntry(shard, surface, hash, format);
+	if(it == shard.entries.end()) {
+		shard.claims.push_back({ hash, format, width, height });
+		return false;
+	}
+
+	// Move the entry to the front of the list without invalidating iterators
+	shard.entries.splice(shard.entries.begin(), shard.entries, it);
+	image = it->image;
+	return true;
+}
+
+void ImageCache::Release(Shard& shard, cairo_surface_t* surface, uint64_t hash, int format) {
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	for(auto it = shard.claims.begin(); it != shard.claims.end(); it++) {
+		if(it->hash == hash && it->format == format && it->width == width && it->height == height) {
+			shard.claims.erase(it);
+			shard.claim_released.notify_all();
+			return;
+		}
+	}
+}
+
+void ImageCache::Abandon(cairo_surface_t* surface, uint64_t hash, int format) {
+	Shard& shard = GetShard(hash);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	Release(shard, surface, hash, format);
+}
+
+void ImageCache::Insert(cairo_surface_t* surface, uint64_t hash, int format, const std::vector<unsigned char>& image) {
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	size_t size = sizeof(Entry) + static_cast<size_t>(width) * height * 4 + image.size();
+
+	Shard& shard = GetShard(hash);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	Release(shard, surface, hash, format);
+	if(size > GetShardCapacity())
+		return;
+
+	// The cache may have been enabled while the image was being encoded
+	if(FindEntry(shard, surface, hash, format) != shard.entries.end())
+		return;
+
+	shard.entries.emplace_front();
+	Entry& entry = shard.entries.front();
+	entry.hash = hash;
+	entry.format = format;
+	entry.width = width;
+	entry.height = height;
+	entry.image = image;
+
+	// Copy the pixels without the padding at the end of each row
+	entry.pixels.resize(static_cast<size_t>(width) * height * 4);
+	const unsigned char* src = cairo_image_surface_get_data(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+	for(int y = 0; y < height; y++)
+		std::copy(src + y * stride, src + y * stride + width * 4, entry.pixels.data() + y * width * 4);
+
+	shard.index.emplace(hash, shard.entries.begin());
+	shard.size += entry.Size();
+	Trim(shard);
+}
+
+void ImageCache::Trim(Shard& shard) {
+	size_t capacity = GetShardCapacity();
+	while(shard.size > capacity && !shard.entries.empty()) {
+		Entry& entry = shard.entries.back();
+
+		auto range = shard.index.equal_range(entry.hash);
+		for(auto it = range.first; it != range.second; it++) {
+			if(&*it->second == &entry) {
+				shard.index.erase(it);
+				break;
+			}
+		}
+
+		shard.size -= entry.Size();
+		shard.entries.pop_back();
+	}
+}
@@ -0,0 +1,158 @@
+#pragma once
+#include <cairo/cairo.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * An LRU cache of encoded images, shared by every GuacClient on the server.
+ * Entries are looked up by a hash of their pixels and then compared pixel for
+ * pixel, so content that was already encoded once (blinking cursors, tray
+ * icons, windows being switched back to, or the same boot screen shown by
+ * several VMs) doesn't have to be compressed again.
+ *
+ * The cache is split into shards by hash, each with its own lock, so the
+ * encoder threads of different VMs rarely wait on each other. When several
+ * threads look for the same image that isn't cached yet, the first one
+ * claims it and the others wait for it to be encoded instead of repeating
+ * the work.
+ */
+class ImageCache {
+   public:
+	/**
+	 * Get the cache shared by all of the clients.
+	 */
+	static ImageCache& Get();
+
+	ImageCache();
+
+	/**
+	 * Sets the number of bytes the cache may use for pixel data and
+	 * encoded images, evicting the least recently used entries if it's
+	 * now over capacity. A capacity of 0 disables the cache.
+	 */
+	void SetCapacity(size_t capacity);
+
+	inline size_t GetCapacity() const {
+		return capacity_;
+	}
+
+	/**
+	 * Removes every entry from the cache. This should be called whenever
+	 * the settings used by the encoders change.
+	 */
+	void Clear();
+
+	/**
+	 * Looks for an image with the same pixels as the surface that was
+	 * encoded with the same format. If another thread is encoding an image
+	 * of the same size and hash, this waits for it to finish first.
+	 * Otherwise a missing image is claimed by the caller, who must then
+	 * call Insert() or Abandon() with the same arguments.
+	 *
+	 * @param surface The image to look up. Must be in a 32-bit format.
+	 * @param hash The hash of the surface, from guac_hash_tile().
+	 * @param format An identifier for how the image was encoded, where
+	 *               different encoders or qualities use different values.
+	 * @param image Receives a copy of the encoded image if it was found.
+	 * @return Whether the image was found.
+	 */
+	bool Find(cairo_surface_t* surface, uint64_t hash, int format, std::vector<unsigned char>& image);
+
+	/**
+	 * Adds an encoded image to the cache, evicting the least recently
+	 * used entries to make room for it, and releases the claim on it.
+	 * Images larger than the capacity of a shard are not added.
+	 */
+	void Insert(cairo_surface_t* surface, uint64_t hash, int format, const std::vector<unsigned char>& image);
+
+	/**
+	 * Releases the claim on an image that couldn't be encoded.
+	 */
+	void Abandon(cairo_surface_t* surface, uint64_t hash, int format);
+
+   private:
+	constexpr static size_t kShardCount = 8;
+
+	struct Entry {
+		uint64_t hash;
+		int format;
+		int width;
+		int height;
+
+		/**
+		 * The pixels of the image without any padding between rows.
+		 */
+		std::vector<uint8_t> pixels;
+		std::vector<unsigned char> image;
+
+		inline size_t Size() const {
+			return sizeof(Entry) + pixels.size() + image.size();
+		}
+	};
+
+	/**
+	 * An image that a thread is encoding.
+	 */
+	struct Claim {
+		uint64_t hash;
+		int format;
+		int width;
+		int height;
+	};
+
+	typedef std::list<Entry> EntryList;
+
+	struct Shard {
+		/**
+		 * The entries in order of use, with the most recently used first.
+		 */
+		EntryList entries;
+
+		/**
+		 * Maps image hashes to every entry with that hash.
+		 */
+		std::unordered_multimap<uint64_t, EntryList::iterator> index;
+
+		std::vector<Claim> claims;
+		std::condition_variable claim_released;
+
+		size_t size = 0;
+		std::mutex mutex;
+	};
+
+	inline Shard& GetShard(uint64_t hash) {
+		return shards_[hash % kShardCount];
+	}
+
+	inline size_t GetShardCapacity() const {
+		return capacity_ / kShardCount;
+	}
+
+	/**
+	 * Finds the entry for the given image, or entries.end() if it isn't
+	 * in the shard. Must be called with the shard's mutex locked.
+	 */
+	static EntryList::iterator FindEntry(Shard& shard, cairo_surface_t* surface, uint64_t hash, int format);
+
+	/**
+	 * Removes the claim on an image and wakes the threads waiting for it.
+	 * Must be called with the shard's mutex locked.
+	 */
+	static void Release(Shard& shard, cairo_surface_t* surface, uint64_t hash, int format);
+
+	/**
+	 * Evicts the least recently used entries until the shard is within
+	 * its capacity. Must be called with the shard's mutex locked.
+	 */
+	void Trim(Shard& shard);
+
+	Shard shards_[kShardCount];
+	std::atomic<size_t> capacity_;
+};
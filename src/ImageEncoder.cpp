@@ -0,0 +1,101 @@
+#include "ImageEncoder.h"
+#include "Tracepoints.h"
+#include <chrono>
+
+static const char* const kFormatNames[] = { "png", "jpeg", "webp", "screen" };
+
+bool CPUImageEncoder::Supports(ImageFormat format) const {
+#ifndef USE_WEBP
+	if(format == ImageFormat::kWebP)
+		return false;
+#endif
+	return format != ImageFormat::kCount;
+}
+
+int CPUImageEncoder::Encode(cairo_surface_t* surface, const ImageEncodeParams& params,
+							std::vector<unsigned char>& buffer) {
+	switch(params.format) {
+		case ImageFormat::kJPEG:
+			return guac_protocol_encode_jpeg(surface, buffer, params.jpeg_quality, params.jpeg_subsampling);
+		case ImageFormat::kWebP:
+			return guac_protocol_encode_webp(params.layer, surface, buffer, params.webp_quality);
+		case ImageFormat::kScreen:
+			return guac_protocol_encode_screen(surface, buffer, params.screen_zstd);
+		default:
+			return guac_protocol_encode_png(surface, buffer, params.png_profile, params.keyframe);
+	}
+}
+
+ImageEncoders& ImageEncoders::Get() {
+	static ImageEncoders encoders;
+	return encoders;
+}
+
+ImageEncoders::ImageEncoders() {
+	for(ImageEncoder*& encoder : formats_)
+		encoder = nullptr;
+	Add(std::unique_ptr<ImageEncoder>(new CPUImageEncoder()));
+}
+
+ImageEncoders::~ImageEncoders() {
+	for(size_t i = 0; i < static_cast<size_t>(ImageFormat::kCount); i++) {
+		Metrics::Get().Remove(&encoded_bytes_[i]);
+		Metrics::Get().Remove(&encode_time_[i]);
+	}
+}
+
+bool ImageEncoders::Add(std::unique_ptr<ImageEncoder> encoder) {
+	if(!encoder->Probe())
+		return false;
+
+	Metrics& metrics = Metrics::Get();
+	for(size_t i = 0; i < static_cast<size_t>(ImageFormat::kCount); i++) {
+		if(!encoder->Supports(static_cast<ImageFormat>(i)))
+			continue;
+		formats_[i] = encoder.get();
+
+		// The metrics of the format are labelled with the backend now used for it
+		std::string labels = Metrics::Label("format", kFormatNames[i]) + ',' + Metrics::Label("encoder", encoder->GetName());
+		metrics.Remove(&encoded_bytes_[i]);
+		metrics.Remove(&encode_time_[i]);
+		metrics.Add("collabvm_encoded_bytes_total", "Bytes of images encoded.", labels, encoded_bytes_[i]);
+		metrics.Add("collabvm_encode_seconds", "How long encoding an image took.", labels, encode_time_[i]);
+	}
+	encoders_.push_back(std::move(encoder));
+	return true;
+}
+
+ImageEncoder& ImageEncoders::For(ImageFormat format) {
+	ImageEncoder* encoder = formats_[static_cast<size_t>(format)];
+
+	// The CPU backend is the fallback for formats that nothing supports
+	return encoder != nullptr ? *encoder : *encoders_.front();
+}
+
+int ImageEncoders::Encode(cairo_surface_t* surface, const ImageEncodeParams& params,
+						  std::vector<unsigned char>& buffer) {
+	size_t i = static_cast<size_t>(params.format);
+	auto start = std::chrono::steady_clock::now();
+	int result = For(params.format).Encode(surface, params, buffer);
+	auto duration = std::chrono::steady_clock::now() - start;
+	encode_time_[i].Observe(duration);
+	COLLABVM_PROBE(encode, kFormatNames[i], std::chrono::duration_cast<std::chrono::microseconds>(duration).count(),
+				   result == 0 ? buffer.size() : 0);
+	if(result == 0)
+		encoded_bytes_[i].Add(buffer.size());
+	return result;
+}
+
+std::string ImageEncoders::Describe() {
+	std::string description;
+	for(size_t i = 0; i < static_cast<size_t>(ImageFormat::kCount); i++) {
+		if(formats_[i] == nullptr)
+			continue;
+		if(!description.empty())
+			description += ", ";
+		description += kFormatNames[i];
+		description += ": ";
+		description += formats_[i]->GetName();
+	}
+	return description;
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include "Metrics.h"
+#include <guacamole/layer.h>
+#include <guacamole/protocol.h>
+#include <cairo/cairo.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * The formats that images of the screen are encoded in.
+ */
+enum class ImageFormat {
+	kPNG,
+	kJPEG,
+	kWebP,
+	kScreen,
+	kCount
+};
+
+/**
+ * How a single image is encoded. Only the fields for its format are used.
+ */
+struct ImageEncodeParams {
+	ImageFormat format = ImageFormat::kPNG;
+
+	/**
+	 * The layer the image is drawn to, which decides if WebP is lossy.
+	 */
+	const guac_layer* layer = nullptr;
+
+	const guac_png_profile* png_profile = nullptr;
+	bool keyframe = false;
+
+	int jpeg_quality = 0;
+	guac_jpeg_subsampling jpeg_subsampling = GUAC_JPEG_SUBSAMPLING_420;
+
+	/**
+	 * The quality of lossy WebP images, 0 for the server's.
+	 */
+	int webp_quality = 0;
+
+	/**
+	 * Whether images in the screen codec may be compressed with zstd.
+	 */
+	bool screen_zstd = false;
+};
+
+/**
+ * A backend that encodes images, such as the CPU or a GPU's encoder.
+ * Backends are probed once when the server starts, and each format is
+ * encoded by the first backend that supports it, so a GPU can take work
+ * off the encoder threads of every VM on the host.
+ */
+class ImageEncoder {
+   public:
+	virtual ~ImageEncoder() = default;
+
+	/**
+	 * Gets the name of the backend, for logging.
+	 */
+	virtual const char* GetName() const = 0;
+
+	/**
+	 * Checks if the backend can be used on this host, such as whether its
+	 * device is present. Called once before the backend is used.
+	 *
+	 * @return Whether the backend can be used.
+	 */
+	virtual bool Probe() = 0;
+
+	/**
+	 * Whether the backend can encode images in the given format,
+	 * after it was probed successfully.
+	 */
+	virtual bool Supports(ImageFormat format) const = 0;
+
+	/**
+	 * Encodes an image. May be called from several threads at once.
+	 *
+	 * @return Zero on success, non-zero on error, with guac_error set.
+	 */
+	virtual int Encode(cairo_surface_t* surface, const ImageEncodeParams& params,
+					   std::vector<unsigned char>& buffer) = 0;
+};
+
+/**
+ * Encodes images with the libraries the server was built with.
+ * It supports every format, so it's the fallback for every other backend.
+ */
+class CPUImageEncoder : public ImageEncoder {
+   public:
+	const char* GetName() const override {
+		return "cpu";
+	}
+
+	bool Probe() override {
+		return true;
+	}
+
+	bool Supports(ImageFormat format) const override;
+	int Encode(cairo_surface_t* surface, const ImageEncodeParams& params,
+			   std::vector<unsigned char>& buffer) override;
+};
+
+/**
+ * The encoding backends available on the host, shared by every GuacClient.
+ */
+class ImageEncoders {
+   public:
+	/**
+	 * Get the backends shared by all of the clients.
+	 */
+	static ImageEncoders& Get();
+
+	/**
+	 * Creates the registry with the CPU backend, which is always available.
+	 */
+	ImageEncoders();
+	~ImageEncoders();
+
+	/**
+	 * Probes a backend and, if it can be used, prefers it over the backends
+	 * added before it for the formats it supports. Backends must be added
+	 * when the server starts, before any images are encoded.
+	 *
+	 * @return Whether the backend was added.
+	 */
+	bool Add(std::unique_ptr<ImageEncoder> encoder);
+
+	/**
+	 * Gets the backend that encodes images in the given format.
+	 */
+	ImageEncoder& For(ImageFormat format);
+
+	/**
+	 * Whether any backend encodes images in the given format.
+	 */
+	bool Supports(ImageFormat format) const {
+		return formats_[static_cast<size_t>(format)] != nullptr;
+	}
+
+	/**
+	 * Describes which backend encodes each format, like "png: cpu, ...".
+	 */
+	std::string Describe();
+
+	/**
+	 * Encodes an image with the backend for its format,
+	 * counting the bytes and time it took in the metrics.
+	 */
+	int Encode(cairo_surface_t* surface, const ImageEncodeParams& params,
+			   std::vector<unsigned char>& buffer);
+
+   private:
+	/**
+	 * Every backend that was added, which are never removed.
+	 */
+	std::vector<std::unique_ptr<ImageEncoder>> encoders_;
+
+	/**
+	 * The backend used for each format.
+	 */
+	ImageEncoder* formats_[static_cast<size_t>(ImageFormat::kCount)];
+
+	/**
+	 * The bytes of images encoded in each format and how long encoding
+	 * them took, labelled with the format and the backend used for it.
+	 */
+	MetricCounter encoded_bytes_[static_cast<size_t>(ImageFormat::kCount)];
+	MetricHistogram encode_time_[static_cast<size_t>(ImageFormat::kCount)];
+};
@@ -0,0 +1,109 @@
+#include "ListenerHandoff.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#ifndef _WIN32
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+/**
+ * Space for the control message that carries the most handles.
+ */
+union HandleMessage {
+	struct cmsghdr header;
+	char buffer[CMSG_SPACE(sizeof(int) * ListenerHandoff::kMaxHandles)];
+};
+#endif
+
+bool ListenerHandoff::Send(int socket, const std::vector<int>& handles) {
+#ifndef _WIN32
+	if(handles.empty() || handles.size() > kMaxHandles)
+		return false;
+
+	// At least one byte has to be sent with the handles
+	char count = static_cast<char>(handles.size());
+	iovec data = { &count, sizeof(count) };
+	HandleMessage control;
+	std::memset(&control, 0, sizeof(control));
+
+	msghdr message {};
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = CMSG_SPACE(sizeof(int) * handles.size());
+
+	cmsghdr* header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(int) * handles.size());
+	std::memcpy(CMSG_DATA(header), handles.data(), sizeof(int) * handles.size());
+
+	return sendmsg(socket, &message, MSG_NOSIGNAL) == sizeof(count);
+#else
+	return false;
+#endif
+}
+
+std::vector<int> ListenerHandoff::Receive(const std::string& path, int& connection) {
+	std::vector<int> handles;
+	connection = -1;
+#ifndef _WIN32
+	sockaddr_un address {};
+	if(path.length() >= sizeof(address.sun_path))
+		return handles;
+	address.sun_family = AF_UNIX;
+	std::memcpy(address.sun_path, path.c_str(), path.length());
+
+	int socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if(socket == -1)
+		return handles;
+	if(connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+		close(socket);
+		return handles;
+	}
+
+	char count;
+	iovec data = { &count, sizeof(count) };
+	HandleMessage control;
+	msghdr message {};
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = sizeof(control.buffer);
+
+	ssize_t received;
+	do {
+		received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+	} while(received == -1 && errno == EINTR);
+
+	cmsghdr* header = received == sizeof(count) ? CMSG_FIRSTHDR(&message) : nullptr;
+	if(header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+		size_t size = std::min<size_t>((header->cmsg_len - CMSG_LEN(0)) / sizeof(int), kMaxHandles);
+		handles.resize(size);
+		std::memcpy(handles.data(), CMSG_DATA(header), sizeof(int) * size);
+	}
+
+	if(handles.empty() || (message.msg_flags & MSG_CTRUNC)) {
+		for(int handle : handles)
+			close(handle);
+		handles.clear();
+		close(socket);
+		return handles;
+	}
+	connection = socket;
+#endif
+	return handles;
+}
+
+void ListenerHandoff::Acknowledge(int connection) {
+#ifndef _WIN32
+	// If it doesn't arrive, the old server keeps accepting too, which is harmless
+	char ack = 1;
+	send(connection, &ack, sizeof(ack), MSG_NOSIGNAL);
+	close(connection);
+#endif
+}
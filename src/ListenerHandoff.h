@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <vector>
+
+/**
+ * Passes the listening sockets of a running server to the build that
+ * replaces it, over a Unix socket, so the port is never closed during an
+ * upgrade. The new server acknowledges them once it's accepting on them,
+ * and only then does the old one stop accepting. Only supported on Unix;
+ * elsewhere nothing is ever handed over.
+ */
+class ListenerHandoff {
+   public:
+	/**
+	 * The most sockets that are handed over, one for each network thread.
+	 */
+	constexpr static size_t kMaxHandles = 64;
+
+	/**
+	 * Sends the sockets over a connected Unix socket.
+	 *
+	 * @return Whether they were sent.
+	 */
+	static bool Send(int socket, const std::vector<int>& handles);
+
+	/**
+	 * Connects to the Unix socket of the server that is being replaced
+	 * and receives its listening sockets.
+	 *
+	 * @param connection Set to the connection the handover is acknowledged on.
+	 * @return The sockets, or none if they couldn't be received.
+	 */
+	static std::vector<int> Receive(const std::string& path, int& connection);
+
+	/**
+	 * Tells the old server that the sockets are being accepted on, and
+	 * closes the connection.
+	 */
+	static void Acknowledge(int connection);
+};
@@ -0,0 +1,256 @@
+#include "Logger.h"
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+/**
+ * The number of messages the queue holds. Must be a power of two.
+ */
+constexpr static size_t kQueueSize = 4096;
+
+/**
+ * How long the writer sleeps when the queue is empty. Producers wake it
+ * up sooner, unless the wakeup is missed while it's going to sleep.
+ */
+constexpr static std::chrono::milliseconds kWakeInterval(100);
+
+/**
+ * How often the number of repeats of a message that keeps being logged is written.
+ */
+constexpr static std::chrono::seconds kRepeatInterval(5);
+
+/**
+ * The number of bytes that are collected before they're written to stdout.
+ */
+constexpr static size_t kWriteSize = 64 * 1024;
+
+constexpr static const char* kLevelNames[] = { "debug", "info", "warning", "error" };
+
+static bool SameCategory(const char* a, const char* b) {
+	return a == b || (a && b && std::strcmp(a, b) == 0);
+}
+
+Logger::Line::Line(LogLevel level, const char* category)
+	: level_(level),
+	  category_(category) {
+	if(Logger::Get().IsEnabled(level))
+		stream_.emplace();
+}
+
+Logger::Line::~Line() {
+	if(stream_)
+		Logger::Get().Write(level_, category_, stream_->str());
+}
+
+Logger& Logger::Get() {
+	// Never destroyed, so threads that are still running
+	// when the server exits can keep logging
+	static Logger* logger = new Logger();
+	return *logger;
+}
+
+Logger::Logger()
+	: cells_(new Cell[kQueueSize]),
+	  mask_(kQueueSize - 1),
+	  enqueue_pos_(0),
+	  dequeue_pos_(0),
+	  level_(LogLevel::kInfo),
+	  json_(false),
+	  dropped_(0),
+	  reported_dropped_(0),
+	  repeats_(0),
+	  stopped_(false) {
+	for(size_t i = 0; i < kQueueSize; i++)
+		cells_[i].sequence.store(i, std::memory_order_relaxed);
+	thread_ = std::thread(&Logger::Run, this);
+}
+
+bool Logger::Write(LogLevel level, const char* category, std::string message) {
+	Entry entry;
+	entry.level = level;
+	entry.category = category;
+	entry.time = std::chrono::system_clock::now();
+	entry.message = std::move(message);
+
+	if(stopped_.load(std::memory_order_acquire)) {
+		std::string out;
+		Format(entry, 0, out);
+		std::lock_guard<std::mutex> lock(stopped_lock_);
+		std::cout.write(out.data(), out.size());
+		std::cout.flush();
+		return true;
+	}
+
+	if(!Push(entry)) {
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	wait_.notify_one();
+	return true;
+}
+
+void Logger::Stop() {
+	if(stopped_.exchange(true, std::memory_order_acq_rel))
+		return;
+
+	wait_.notify_one();
+	thread_.join();
+}
+
+bool Logger::Push(Entry& entry) {
+	size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+	Cell* cell;
+	for(;;) {
+		cell = &cells_[pos & mask_];
+		size_t sequence = cell->sequence.load(std::memory_order_acquire);
+		intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+		if(difference == 0) {
+			// The cell is free, claim it
+			if(enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if(difference < 0) {
+			// The writer hasn't taken the entry that was
+			// put in the cell a lap ago, so the queue is full
+			return false;
+		} else {
+			pos = enqueue_pos_.load(std::memory_order_relaxed);
+		}
+	}
+
+	cell->entry = std::move(entry);
+	cell->sequence.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+bool Logger::Pop(Entry& entry) {
+	Cell& cell = cells_[dequeue_pos_ & mask_];
+	if(cell.sequence.load(std::memory_order_acquire) != dequeue_pos_ + 1)
+		return false;
+
+	entry = std::move(cell.entry);
+	cell.entry.message = std::string();
+	cell.sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+	dequeue_pos_++;
+	return true;
+}
+
+void Logger::Run() {
+	std::string out;
+	Entry entry;
+	for(;;) {
+		// Everything that was queued before Stop() is written
+		bool stopping = stopped_.load(std::memory_order_acquire);
+		while(Pop(entry)) {
+			Append(entry, out);
+			if(out.size() >= kWriteSize) {
+				std::cout.write(out.data(), out.size());
+				out.clear();
+			}
+		}
+
+		auto now = std::chrono::system_clock::now();
+		if(repeats_ && (stopping || now - last_.time >= kRepeatInterval))
+			AppendRepeats(out);
+
+		uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+		if(dropped != reported_dropped_ && (stopping || now - reported_time_ >= kRepeatInterval)) {
+			Entry report;
+			report.level = LogLevel::kWarning;
+			report.category = "Log";
+			report.time = now;
+			report.message = std::to_string(dropped - reported_dropped_) + " messages were dropped because the log couldn't keep up";
+			Format(report, 0, out);
+			reported_dropped_ = dropped;
+			reported_time_ = now;
+		}
+
+		if(!out.empty()) {
+			std::cout.write(out.data(), out.size());
+			std::cout.flush();
+			out.clear();
+		}
+
+		if(stopping)
+			return;
+
+		std::unique_lock<std::mutex> lock(wait_lock_);
+		wait_.wait_for(lock, kWakeInterval);
+	}
+}
+
+void Logger::Append(Entry& entry, std::string& out) {
+	if(entry.level == last_.level && SameCategory(entry.category, last_.category) && entry.message == last_.message) {
+		repeats_++;
+		return;
+	}
+
+	AppendRepeats(out);
+	Format(entry, 0, out);
+	last_ = std::move(entry);
+}
+
+void Logger::AppendRepeats(std::string& out) {
+	if(!repeats_)
+		return;
+
+	Format(last_, repeats_, out);
+	repeats_ = 0;
+	last_.time = std::chrono::system_clock::now();
+}
+
+void Logger::Format(const Entry& entry, uint32_t repeats, std::string& out) const {
+	if(!json_.load(std::memory_order_relaxed)) {
+		if(entry.category) {
+			out += '[';
+			out += entry.category;
+			out += "] ";
+		}
+		out += entry.message;
+		if(repeats) {
+			out += " (repeated ";
+			out += std::to_string(repeats);
+			out += " times)";
+		}
+		out += '\n';
+		return;
+	}
+
+	std::time_t time = std::chrono::system_clock::to_time_t(entry.time);
+	std::tm tm;
+#ifdef _WIN32
+	gmtime_s(&tm, &time);
+#else
+	gmtime_r(&time, &tm);
+#endif
+	auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(entry.time.time_since_epoch()).count() % 1000;
+	char timestamp[32];
+	size_t length = std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+	length += std::snprintf(timestamp + length, sizeof(timestamp) - length, ".%03dZ", static_cast<int>(milliseconds));
+
+	rapidjson::StringBuffer buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+	writer.StartObject();
+	writer.String("time");
+	writer.String(timestamp, length);
+	writer.String("level");
+	writer.String(kLevelNames[static_cast<size_t>(entry.level)]);
+	if(entry.category) {
+		writer.String("category");
+		writer.String(entry.category);
+	}
+	writer.String("message");
+	writer.String(entry.message.c_str(), entry.message.length());
+	if(repeats) {
+		writer.String("repeated");
+		writer.Uint(repeats);
+	}
+	writer.EndObject();
+
+	out.append(buffer.GetString(), buffer.GetSize());
+	out += '\n';
+}
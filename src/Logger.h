@@ -0,0 +1,192 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+
+enum class LogLevel : uint8_t {
+	kDebug,
+	kInfo,
+	kWarning,
+	kError
+};
+
+/**
+ * Writes the server's log from a thread of its own, so that a thread that
+ * logs never waits for stdout. Messages are put in a fixed size lock-free
+ * queue, and dropped when the writer can't keep up instead of blocking the
+ * thread that logs them. A message that's logged again and again is only
+ * written once, followed by how many times it was repeated.
+ *
+ * Messages are logged through a Line, which is queued once it goes out of scope:
+ *
+ *     Logger::Info("Chat") << "User was muted. IP: " << ip;
+ */
+class Logger {
+   public:
+	/**
+	 * A message that's being built. It does nothing when its
+	 * level is below the logger's.
+	 */
+	class Line {
+	   public:
+		Line(LogLevel level, const char* category);
+		~Line();
+
+		Line(const Line&) = delete;
+		Line& operator=(const Line&) = delete;
+
+		template<typename T>
+		Line& operator<<(const T& value) {
+			if(stream_)
+				*stream_ << value;
+			return *this;
+		}
+
+	   private:
+		LogLevel level_;
+		const char* category_;
+		std::optional<std::ostringstream> stream_;
+	};
+
+	/**
+	 * Get the logger shared by the whole server.
+	 */
+	static Logger& Get();
+
+	/**
+	 * Start a message. The category is written in brackets before the
+	 * message, and has to be a string literal, because only the pointer
+	 * to it is queued.
+	 */
+	static inline Line Debug(const char* category = nullptr) {
+		return Line(LogLevel::kDebug, category);
+	}
+
+	static inline Line Info(const char* category = nullptr) {
+		return Line(LogLevel::kInfo, category);
+	}
+
+	static inline Line Warning(const char* category = nullptr) {
+		return Line(LogLevel::kWarning, category);
+	}
+
+	static inline Line Error(const char* category = nullptr) {
+		return Line(LogLevel::kError, category);
+	}
+
+	/**
+	 * Set the lowest level of the messages that are logged.
+	 */
+	inline void SetLevel(LogLevel level) {
+		level_.store(level, std::memory_order_relaxed);
+	}
+
+	inline bool IsEnabled(LogLevel level) const {
+		return level >= level_.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Write each message as a JSON object on its own line, with the
+	 * time, level and category as fields, instead of as plain text.
+	 */
+	inline void SetJSON(bool json) {
+		json_.store(json, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Queue a message to be written. Returns false if it was dropped
+	 * because the queue is full.
+	 */
+	bool Write(LogLevel level, const char* category, std::string message);
+
+	/**
+	 * Write the messages that are still queued and stop the writer thread.
+	 * Messages that are logged afterwards are written by the thread that
+	 * logs them.
+	 */
+	void Stop();
+
+	/**
+	 * Get the number of messages that were dropped because the queue was full.
+	 */
+	inline uint64_t GetDropped() const {
+		return dropped_.load(std::memory_order_relaxed);
+	}
+
+   private:
+	Logger();
+
+	struct Entry {
+		LogLevel level = LogLevel::kInfo;
+		const char* category = nullptr;
+		std::chrono::system_clock::time_point time;
+		std::string message;
+	};
+
+	/**
+	 * A slot in the queue. Its sequence tells producers and the writer
+	 * whose turn it is to use the slot, like in Dmitry Vyukov's bounded queue.
+	 */
+	struct Cell {
+		std::atomic<size_t> sequence;
+		Entry entry;
+	};
+
+	bool Push(Entry& entry);
+	bool Pop(Entry& entry);
+
+	void Run();
+
+	/**
+	 * Write an entry, or count it if it repeats the last one.
+	 */
+	void Append(Entry& entry, std::string& out);
+
+	/**
+	 * Write how many times the last entry was repeated, if it was.
+	 */
+	void AppendRepeats(std::string& out);
+
+	void Format(const Entry& entry, uint32_t repeats, std::string& out) const;
+
+	std::unique_ptr<Cell[]> cells_;
+	size_t mask_;
+	alignas(64) std::atomic<size_t> enqueue_pos_;
+	alignas(64) size_t dequeue_pos_;
+
+	std::atomic<LogLevel> level_;
+	std::atomic<bool> json_;
+	std::atomic<uint64_t> dropped_;
+
+	/**
+	 * The number of dropped messages that the writer has reported,
+	 * and when it last reported them.
+	 */
+	uint64_t reported_dropped_;
+	std::chrono::system_clock::time_point reported_time_;
+
+	/**
+	 * The last entry that was written, and the number of times it has
+	 * been repeated since.
+	 */
+	Entry last_;
+	uint32_t repeats_;
+
+	std::mutex wait_lock_;
+	std::condition_variable wait_;
+	std::atomic<bool> stopped_;
+	std::thread thread_;
+
+	/**
+	 * Serializes writes by threads that log after Stop().
+	 */
+	std::mutex stopped_lock_;
+};
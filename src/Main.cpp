@@ -1,5 +1,11 @@
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
 #include "CollabVM.h"
+#include "CPUSet.h"
+#include "ListenerHandoff.h"
+#include "Logger.h"
+#include "Relay.h"
 
 #if !defined(_WIN32)
 	#ifndef __CYGWIN__
@@ -9,10 +15,6 @@
 //#include <windows.h>
 #endif
 
-// Enable this to allow Asio multi threading
-// Currently a bit buggy and unneeded with beast..
-//#define ENABLE_ASIO_MULTITHREADING
-
 void IgnorePipe() {
 	// Ignores SIGPIPE to prevent LibVNCClient from crashing on Linux
 #ifndef _WIN32
@@ -28,8 +30,49 @@ void IgnorePipe() {
 #ifndef UNIT_TEST
 int main(int argc, char* argv[]) {
 	try {
+		// Several servers on one host can each be given their own CPUs,
+		// like the CPUs of a NUMA node
+		if(argc > 2 && !std::strcmp(argv[1], "--cpus")) {
+			CPUSet cpus;
+			if(!CPUSet::Parse(argv[2], cpus) || !cpus.ApplyToProcess()) {
+				std::cout << "The CPUs should be given as a list like 0-7,16-23." << std::endl;
+				return -1;
+			}
+			argv += 2;
+			argc -= 2;
+		}
+
+		// A relay serves viewers for a primary server, which is
+		// given before the usual arguments
+		std::string relay_host, relay_port;
+		if(argc > 2 && !std::strcmp(argv[1], "--relay")) {
+			std::string upstream(argv[2]);
+			size_t colon = upstream.rfind(':');
+			if(colon == std::string::npos || colon == 0) {
+				std::cout << "The primary server should be given as host:port." << std::endl;
+				return -1;
+			}
+			relay_host = upstream.substr(0, colon);
+			relay_port = upstream.substr(colon + 1);
+			argv += 2;
+			argc -= 2;
+		}
+
+		// A new build takes over the port of the server it replaces
+		std::string takeover_path;
+		if(argc > 2 && !std::strcmp(argv[1], "--takeover")) {
+			takeover_path = argv[2];
+			argv += 2;
+			argc -= 2;
+		}
+
 		if(argc < 2 || argc > 3) {
-			std::cout << "Usage: [Port] [HTTP dir]\n";
+			std::cout << "Usage: [--cpus List] [--relay Host:Port] [--takeover Path] [Port] [HTTP dir]\n";
+			std::cout << "--cpus (optional) - only run the server and its VMs on the CPUs in List, like 0-7,16-23\n";
+			std::cout << "--relay (optional) - relay the VMs of the server at Host:Port to viewers that connect"
+						 " to this one, with the relay token from the COLLAB_VM_RELAY_TOKEN environment variable\n";
+			std::cout << "--takeover (optional) - accept connections on the listening socket of the server"
+						 " whose upgrade.sock is at Path, which keeps serving the connections it already has\n";
 			std::cout << "Port - the port to listen on for websocket and http requests\n";
 			std::cout << "HTTP dir (optional) - the directory to serve HTTP files from. defaults to \"http\""
 						 " in the current directory\n";
@@ -49,15 +92,40 @@ int main(int argc, char* argv[]) {
 			return -1;
 		}
 
-		std::cout << "Collab VM Server started" << std::endl;
-
 		boost::asio::io_service service_;
+
+		if(!relay_host.empty()) {
+			const char* token = std::getenv("COLLAB_VM_RELAY_TOKEN");
+			if(!token || !*token) {
+				std::cout << "The relay token has to be set in COLLAB_VM_RELAY_TOKEN." << std::endl;
+				return -1;
+			}
+
+			Logger::Info() << "Collab VM Relay started";
+			auto relay = std::make_shared<Relay>(service_, relay_host, relay_port, token);
+
+			boost::asio::signal_set interruptSignal(service_, SIGINT, SIGTERM);
+			interruptSignal.async_wait([&](boost::system::error_code ec, int sig) {
+				Logger::Info() << "Shutting down...";
+				relay->Stop();
+				service_.stop();
+			});
+
+			IgnorePipe();
+			relay->Run(port, argc > 2 ? argv[2] : "http");
+			service_.run();
+			Logger::Get().Stop();
+			return 0;
+		}
+
+		Logger::Info() << "Collab VM Server started";
+
 		std::shared_ptr<CollabVMServer> server_;
 
 		// Set up Ctrl+C handler
 		boost::asio::signal_set interruptSignal(service_, SIGINT, SIGTERM);
 		interruptSignal.async_wait([&](boost::system::error_code ec, int sig) {
-			std::cout << "\nShutting down..." << std::endl;
+			Logger::Info() << "Shutting down...";
 			//work.reset();
 			server_->Stop();
 			service_.stop();
@@ -65,36 +133,30 @@ int main(int argc, char* argv[]) {
 
 		IgnorePipe();
 
-		server_ = std::make_shared<CollabVMServer>(service_);
-		server_->Run(port, argc > 2 ? argv[2] : "http");
-
-		// If the server has multithreading enabled, then
-		// spawn the threads now.
-	#ifdef ENABLE_ASIO_MULTITHREADING
-		std::vector<std::thread> threads;
-
-		const auto N = (std::thread::hardware_concurrency() / 2) - 1;
-		threads.reserve(N);
+		int takeover_connection = -1;
+		std::vector<int> listeners;
+		if(!takeover_path.empty()) {
+			listeners = ListenerHandoff::Receive(takeover_path, takeover_connection);
+			if(listeners.empty()) {
+				std::cout << "Couldn't take over the port of the server at " << takeover_path << "." << std::endl;
+				return -1;
+			}
+		}
 
-		// Notify user how many threads the server will spawn to run completion handlers
-		std::cout << "Running server ASIO completion handlers on " << N << " worker threads\n";
-		std::cout << "Your system will actually run " << N + 1 << " worker threads including main thread\n";
+		server_ = std::make_shared<CollabVMServer>(service_);
+		server_->Run(port, argc > 2 ? argv[2] : "http", listeners);
+		if(takeover_connection != -1)
+			ListenerHandoff::Acknowledge(takeover_connection);
 
-		for(int j = 0; j < N; ++j) {
-			threads.emplace_back([&service_]() {
-				service_.run();
-			});
-		}
-	#endif
-		// Run the io_service on the main thread.
+		// Run the io_service on the main thread. The VM controllers and
+		// timers aren't thread safe, so it must only be run by one thread.
+		// Connections can be spread across more threads with the
+		// NetworkThreads setting, which gives them their own io_contexts.
 		service_.run();
-
-	#ifdef ENABLE_ASIO_MULTITHREADING
-		// Join ASIO completion handler threads when the server is stopping.
-		for(auto& thread : threads)
-			thread.join();
-	#endif
+		Logger::Get().Stop();
 	} catch(const std::exception& e) {
+		// Written after what's still in the log
+		Logger::Get().Stop();
 		std::cout << "An exception was thrown:" << std::endl;
 		std::cout << e.what() << std::endl;
 	#if !defined(_WIN32) && !defined(__CYGWIN__)
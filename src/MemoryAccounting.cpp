@@ -0,0 +1,125 @@
+#include "MemoryAccounting.h"
+#include "Metrics.h"
+#include <algorithm>
+
+static const char* const kCategoryNames[MemoryAccount::kCategories] = {
+	"send-queue",
+	"surfaces",
+	"thumbnails",
+	"chat-history",
+	"uploads",
+	"connections"
+};
+
+MemoryAccount::MemoryAccount()
+	: MemoryAccount(&MemoryAccounting::Get().GetServerAccount()) {
+}
+
+MemoryAccount::MemoryAccount(MemoryAccount* parent)
+	: parent_(parent) {
+	for(size_t i = 0; i < kCategories; i++) {
+		live_[i] = 0;
+		peak_[i] = 0;
+	}
+}
+
+MemoryAccount::~MemoryAccount() {
+	if(!parent_)
+		return;
+
+	for(size_t i = 0; i < kCategories; i++)
+		parent_->Free(static_cast<MemoryCategory>(i), live_[i]);
+}
+
+void MemoryAccount::Allocate(MemoryCategory category, size_t bytes) {
+	if(!bytes)
+		return;
+
+	size_t i = static_cast<size_t>(category);
+	uint64_t live = live_[i].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	uint64_t peak = peak_[i].load(std::memory_order_relaxed);
+	while(live > peak && !peak_[i].compare_exchange_weak(peak, live, std::memory_order_relaxed))
+		;
+
+	if(parent_)
+		parent_->Allocate(category, bytes);
+}
+
+void MemoryAccount::Free(MemoryCategory category, size_t bytes) {
+	if(!bytes)
+		return;
+
+	live_[static_cast<size_t>(category)].fetch_sub(bytes, std::memory_order_relaxed);
+	if(parent_)
+		parent_->Free(category, bytes);
+}
+
+void MemoryAccount::Resize(MemoryCategory category, size_t old_size, size_t new_size) {
+	if(new_size > old_size)
+		Allocate(category, new_size - old_size);
+	else
+		Free(category, old_size - new_size);
+}
+
+const char* MemoryAccount::GetName(MemoryCategory category) {
+	return kCategoryNames[static_cast<size_t>(category)];
+}
+
+MemoryAccounting& MemoryAccounting::Get() {
+	static MemoryAccounting accounting;
+	return accounting;
+}
+
+void MemoryAccounting::AddVM(const std::string& name, const MemoryAccount& account) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	vms_.emplace_back(name, &account);
+}
+
+void MemoryAccounting::RemoveVM(const MemoryAccount& account) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	vms_.remove_if([&account](const std::pair<std::string, const MemoryAccount*>& vm) {
+		return vm.second == &account;
+	});
+}
+
+static void AppendSamples(std::string& metrics, const char* metric, const std::string& vm,
+						  const MemoryAccount& account, bool peak) {
+	for(size_t i = 0; i < MemoryAccount::kCategories; i++) {
+		MemoryCategory category = static_cast<MemoryCategory>(i);
+		std::string name = MemoryAccount::GetName(category);
+		std::replace(name.begin(), name.end(), '-', '_');
+		metrics += metric;
+		metrics += "{category=\"";
+		metrics += name;
+		if(!vm.empty()) {
+			metrics += "\",";
+			metrics += Metrics::Label("vm", vm);
+		} else {
+			metrics += '"';
+		}
+		metrics += "} ";
+		metrics += std::to_string(peak ? account.GetPeak(category) : account.GetLive(category));
+		metrics += '\n';
+	}
+}
+
+std::string MemoryAccounting::GetMetrics() {
+	std::string metrics;
+	std::lock_guard<std::mutex> lock(mutex_);
+	for(bool peak : { false, true }) {
+		const char* metric = peak ? "collabvm_memory_peak_bytes" : "collabvm_memory_live_bytes";
+		metrics += "# HELP ";
+		metrics += metric;
+		metrics += peak ? " The most bytes of memory that were ever used.\n"
+						: " The bytes of memory currently used.\n";
+		metrics += "# TYPE ";
+		metrics += metric;
+		metrics += " gauge\n";
+
+		// Samples without a vm label are the totals for the server
+		AppendSamples(metrics, metric, std::string(), server_, peak);
+		for(const auto& vm : vms_)
+			AppendSamples(metrics, metric, vm.first, *vm.second, peak);
+	}
+	return metrics;
+}
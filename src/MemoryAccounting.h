@@ -0,0 +1,119 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+
+/**
+ * The kinds of memory that are accounted.
+ */
+enum class MemoryCategory {
+	kSendQueue,	  // Messages waiting to be written to WebSocket connections
+	kSurfaces,	  // Pixel buffers of the surfaces of VM displays
+	kThumbnails,  // The PNG thumbnails of VMs
+	kChatHistory, // Messages kept in the chat history
+	kUploads,	  // Buffers used while receiving uploaded files
+	kConnections, // The objects, queues and buffers kept for each WebSocket connection
+	kCount
+};
+
+/**
+ * The live and peak number of bytes in each category of memory used by a VM
+ * or a connection. Every change is also made to the parent account, so the
+ * server's account holds the totals. Can be used from any thread.
+ */
+class MemoryAccount {
+   public:
+	constexpr static size_t kCategories = static_cast<size_t>(MemoryCategory::kCount);
+
+	/**
+	 * Creates an account whose changes are also made to the server's account.
+	 */
+	MemoryAccount();
+
+	/**
+	 * @param parent The account that changes are also made to, or null.
+	 */
+	explicit MemoryAccount(MemoryAccount* parent);
+
+	/**
+	 * Frees whatever is still accounted from the parent.
+	 */
+	~MemoryAccount();
+
+	MemoryAccount(const MemoryAccount&) = delete;
+	MemoryAccount& operator=(const MemoryAccount&) = delete;
+
+	void Allocate(MemoryCategory category, size_t bytes);
+	void Free(MemoryCategory category, size_t bytes);
+
+	/**
+	 * Accounts for a buffer changing size from old_size to new_size bytes.
+	 */
+	void Resize(MemoryCategory category, size_t old_size, size_t new_size);
+
+	uint64_t GetLive(MemoryCategory category) const {
+		return live_[static_cast<size_t>(category)].load(std::memory_order_relaxed);
+	}
+
+	uint64_t GetPeak(MemoryCategory category) const {
+		return peak_[static_cast<size_t>(category)].load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Gets the name of a category, as used by the admin panel and metrics.
+	 */
+	static const char* GetName(MemoryCategory category);
+
+   private:
+	MemoryAccount* const parent_;
+	std::atomic<uint64_t> live_[kCategories];
+	std::atomic<uint64_t> peak_[kCategories];
+};
+
+/**
+ * The server's memory account and the accounts of the VMs, which are
+ * served as Prometheus metrics from the Asio threads.
+ */
+class MemoryAccounting {
+   public:
+	/**
+	 * Get the accounting shared by the whole server.
+	 */
+	static MemoryAccounting& Get();
+
+	/**
+	 * Gets the account that every other account adds to.
+	 */
+	MemoryAccount& GetServerAccount() {
+		return server_;
+	}
+
+	/**
+	 * Adds the account of a VM to the metrics.
+	 * It must be removed before it's destroyed.
+	 */
+	void AddVM(const std::string& name, const MemoryAccount& account);
+	void RemoveVM(const MemoryAccount& account);
+
+	/**
+	 * Formats the live and peak bytes of the server and each VM
+	 * in the Prometheus text format.
+	 */
+	std::string GetMetrics();
+
+   private:
+	MemoryAccounting()
+		: server_(nullptr) {
+	}
+
+	MemoryAccount server_;
+
+	/**
+	 * The accounts of the VMs and their names. Guarded by mutex_.
+	 */
+	std::list<std::pair<std::string, const MemoryAccount*>> vms_;
+	std::mutex mutex_;
+};
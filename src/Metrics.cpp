@@ -0,0 +1,159 @@
+#include "Metrics.h"
+#include <algorithm>
+
+const double MetricHistogram::kBounds[kBuckets] = {
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+	0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+MetricHistogram::MetricHistogram()
+	: sum_(0) {
+	for(std::atomic<uint64_t>& count : counts_)
+		count = 0;
+}
+
+void MetricHistogram::Observe(double seconds) {
+	size_t bucket = std::lower_bound(kBounds, kBounds + kBuckets, seconds) - kBounds;
+	counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+	if(seconds > 0)
+		sum_.fetch_add(static_cast<uint64_t>(seconds * 1000000), std::memory_order_relaxed);
+}
+
+static void AppendSample(std::string& out, const std::string& name, const char* suffix,
+						 const std::string& labels, const std::string& value) {
+	out += name;
+	out += suffix;
+	if(!labels.empty()) {
+		out += '{';
+		out += labels;
+		out += '}';
+	}
+	out += ' ';
+	out += value;
+	out += '\n';
+}
+
+void MetricHistogram::Write(std::string& out, const std::string& name, const std::string& labels) const {
+	std::string bucket_labels = labels.empty() ? labels : labels + ',';
+	uint64_t count = 0;
+	for(size_t i = 0; i <= kBuckets; i++) {
+		count += counts_[i].load(std::memory_order_relaxed);
+		std::string le = i < kBuckets ? std::to_string(kBounds[i]) : "+Inf";
+		if(i < kBuckets) {
+			// Trim the zeros that std::to_string pads with
+			le.erase(le.find_last_not_of('0') + 1);
+			if(le.back() == '.')
+				le.pop_back();
+		}
+		AppendSample(out, name, "_bucket", bucket_labels + "le=\"" + le + '"', std::to_string(count));
+	}
+	AppendSample(out, name, "_sum", labels, std::to_string(sum_.load(std::memory_order_relaxed) / 1000000.0));
+	AppendSample(out, name, "_count", labels, std::to_string(count));
+}
+
+Metrics& Metrics::Get() {
+	static Metrics metrics;
+	return metrics;
+}
+
+void Metrics::Add(const std::string& name, const char* help, const std::string& labels, const MetricCounter& metric) {
+	Add(name, help, Type::kCounter, labels, &metric);
+}
+
+void Metrics::Add(const std::string& name, const char* help, const std::string& labels, const MetricGauge& metric) {
+	Add(name, help, Type::kGauge, labels, &metric);
+}
+
+void Metrics::Add(const std::string& name, const char* help, const std::string& labels, const MetricHistogram& metric) {
+	Add(name, help, Type::kHistogram, labels, &metric);
+}
+
+void Metrics::Add(const std::string& name, const char* help, Type type, const std::string& labels, const void* metric) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	Family& family = families_.emplace(name, Family { help, type, {} }).first->second;
+	family.metrics.emplace_back(labels, metric);
+}
+
+void Metrics::Remove(const void* metric) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	for(auto it = families_.begin(); it != families_.end();) {
+		it->second.metrics.remove_if([metric](const std::pair<std::string, const void*>& entry) {
+			return entry.second == metric;
+		});
+		if(it->second.metrics.empty())
+			it = families_.erase(it);
+		else
+			++it;
+	}
+}
+
+std::string Metrics::Format() {
+	static const char* const kTypeNames[] = { "counter", "gauge", "histogram" };
+
+	std::string out;
+	std::lock_guard<std::mutex> lock(mutex_);
+	for(const auto& [name, family] : families_) {
+		out += "# HELP ";
+		out += name;
+		out += ' ';
+		out += family.help;
+		out += "\n# TYPE ";
+		out += name;
+		out += ' ';
+		out += kTypeNames[static_cast<size_t>(family.type)];
+		out += '\n';
+
+		for(const auto& [labels, metric] : family.metrics) {
+			switch(family.type) {
+				case Type::kCounter:
+					AppendSample(out, name, "", labels, std::to_string(static_cast<const MetricCounter*>(metric)->Get()));
+					break;
+				case Type::kGauge:
+					AppendSample(out, name, "", labels, std::to_string(static_cast<const MetricGauge*>(metric)->Get()));
+					break;
+				case Type::kHistogram:
+					static_cast<const MetricHistogram*>(metric)->Write(out, name, labels);
+					break;
+			}
+		}
+	}
+	return out;
+}
+
+void Metrics::SetToken(const std::string& token) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	token_ = token;
+}
+
+bool Metrics::IsEnabled() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return !token_.empty();
+}
+
+bool Metrics::CheckToken(const std::string& token) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if(token_.empty() || token.length() != token_.length())
+		return false;
+
+	// Compare every byte so the time taken doesn't reveal the token
+	unsigned char difference = 0;
+	for(size_t i = 0; i < token.length(); i++)
+		difference |= token[i] ^ token_[i];
+	return difference == 0;
+}
+
+std::string Metrics::Label(const char* name, const std::string& value) {
+	std::string label = name;
+	label += "=\"";
+	for(char c : value) {
+		if(c == '\n') {
+			label += "\\n";
+			continue;
+		}
+		if(c == '\\' || c == '"')
+			label += '\\';
+		label += c;
+	}
+	label += '"';
+	return label;
+}
@@ -0,0 +1,170 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+
+/**
+ * A number that only goes up, like the bytes received by uploads.
+ * Rates are computed from it by whatever scrapes the metrics.
+ */
+class MetricCounter {
+   public:
+	void Add(uint64_t value = 1) {
+		value_.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	uint64_t Get() const {
+		return value_.load(std::memory_order_relaxed);
+	}
+
+   private:
+	std::atomic<uint64_t> value_ { 0 };
+};
+
+/**
+ * A number that goes up and down, like the number of viewers of a VM.
+ */
+class MetricGauge {
+   public:
+	void Set(int64_t value) {
+		value_.store(value, std::memory_order_relaxed);
+	}
+
+	void Add(int64_t value) {
+		value_.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	int64_t Get() const {
+		return value_.load(std::memory_order_relaxed);
+	}
+
+   private:
+	std::atomic<int64_t> value_ { 0 };
+};
+
+/**
+ * Counts how long something took in buckets with fixed upper bounds, from
+ * 100 microseconds to 10 seconds, along with the sum of every duration.
+ */
+class MetricHistogram {
+   public:
+	constexpr static size_t kBuckets = 16;
+
+	/**
+	 * The upper bound of each bucket in seconds. Longer durations
+	 * are only counted in the implicit +Inf bucket.
+	 */
+	static const double kBounds[kBuckets];
+
+	MetricHistogram();
+
+	void Observe(double seconds);
+
+	template<class Rep, class Period>
+	void Observe(std::chrono::duration<Rep, Period> duration) {
+		Observe(std::chrono::duration<double>(duration).count());
+	}
+
+	/**
+	 * Appends the cumulative buckets, sum and count of the histogram
+	 * in the Prometheus text format.
+	 */
+	void Write(std::string& out, const std::string& name, const std::string& labels) const;
+
+   private:
+	/**
+	 * The number of observations in each bucket, which aren't cumulative
+	 * so that only one is incremented. The last is the +Inf bucket.
+	 */
+	std::atomic<uint64_t> counts_[kBuckets + 1];
+
+	/**
+	 * The sum of the observations in microseconds.
+	 */
+	std::atomic<uint64_t> sum_;
+};
+
+/**
+ * The metrics of the server, served in the Prometheus text format to
+ * whoever has the metrics token. Metrics are owned by the subsystems that
+ * update them and are added here with their labels, so updating a metric
+ * is only an atomic operation and never looks anything up.
+ */
+class Metrics {
+   public:
+	/**
+	 * Get the metrics shared by the whole server.
+	 */
+	static Metrics& Get();
+
+	/**
+	 * Adds a metric to the family with the given name, creating the family
+	 * with the help text if it doesn't exist yet. The metric must be
+	 * removed before it's destroyed.
+	 *
+	 * @param labels The labels of the metric without braces, like
+	 *               vm="win7", or empty.
+	 */
+	void Add(const std::string& name, const char* help, const std::string& labels, const MetricCounter& metric);
+	void Add(const std::string& name, const char* help, const std::string& labels, const MetricGauge& metric);
+	void Add(const std::string& name, const char* help, const std::string& labels, const MetricHistogram& metric);
+
+	/**
+	 * Removes a metric that was added. Nothing happens if it wasn't.
+	 */
+	void Remove(const void* metric);
+
+	/**
+	 * Formats every metric in the Prometheus text format.
+	 */
+	std::string Format();
+
+	/**
+	 * Sets the token that requests for the metrics must have.
+	 * An empty token disables the metrics endpoint.
+	 */
+	void SetToken(const std::string& token);
+
+	/**
+	 * Whether a token was set, so the metrics are served.
+	 */
+	bool IsEnabled();
+
+	/**
+	 * Checks a token sent with a request for the metrics.
+	 */
+	bool CheckToken(const std::string& token);
+
+	/**
+	 * Formats a label for the labels of a metric, escaping its value.
+	 */
+	static std::string Label(const char* name, const std::string& value);
+
+   private:
+	enum class Type {
+		kCounter,
+		kGauge,
+		kHistogram
+	};
+
+	struct Family {
+		const char* help;
+		Type type;
+		std::list<std::pair<std::string, const void*>> metrics;
+	};
+
+	void Add(const std::string& name, const char* help, Type type, const std::string& labels, const void* metric);
+
+	/**
+	 * The families by name, which are kept in order so the output is
+	 * stable. Guarded by mutex_, along with token_.
+	 */
+	std::map<std::string, Family> families_;
+	std::string token_;
+	std::mutex mutex_;
+};
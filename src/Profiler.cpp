@@ -0,0 +1,184 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+	#include <csignal>
+	#include <cxxabi.h>
+	#include <dlfcn.h>
+	#include <execinfo.h>
+	#include <sys/syscall.h>
+	#include <sys/time.h>
+	#include <unistd.h>
+#endif
+
+/**
+ * The frames at the top of each stack that belong to the signal handler:
+ * OnSignal() and the kernel's signal trampoline.
+ */
+constexpr static int kHandlerFrames = 2;
+
+Profiler& Profiler::Get() {
+	static Profiler profiler;
+	return profiler;
+}
+
+#ifdef __linux__
+void Profiler::OnSignal(int signal) {
+	int saved_errno = errno;
+	Profiler& profiler = Get();
+	profiler.writers_.fetch_add(1, std::memory_order_acquire);
+	size_t sample = profiler.next_sample_.fetch_add(1, std::memory_order_relaxed);
+	if(sample < profiler.capacity_) {
+		profiler.depths_[sample] = backtrace(&profiler.frames_[sample * kMaxDepth], kMaxDepth);
+		profiler.threads_[sample] = static_cast<pid_t>(syscall(SYS_gettid));
+	}
+	profiler.writers_.fetch_sub(1, std::memory_order_release);
+	errno = saved_errno;
+}
+
+/**
+ * Names a code address after its function, or its file and offset when
+ * the binary has no symbol for it.
+ */
+static std::string NameFrame(void* address) {
+	Dl_info info;
+	if(!dladdr(address, &info) || !info.dli_fname) {
+		char hex[32];
+		std::snprintf(hex, sizeof(hex), "%p", address);
+		return hex;
+	}
+
+	if(info.dli_sname) {
+		int status;
+		char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+		std::string name = status == 0 && demangled ? demangled : info.dli_sname;
+		std::free(demangled);
+		return name;
+	}
+
+	const char* file = std::strrchr(info.dli_fname, '/');
+	char offset[32];
+	std::snprintf(offset, sizeof(offset), "+0x%zx",
+				  static_cast<size_t>(static_cast<char*>(address) - static_cast<char*>(info.dli_fbase)));
+	return std::string(file ? file + 1 : info.dli_fname) + offset;
+}
+
+/**
+ * Gets a thread's name, or its ID if it has exited since it was sampled.
+ */
+static std::string NameThread(pid_t thread) {
+	char path[64];
+	std::snprintf(path, sizeof(path), "/proc/self/task/%d/comm", static_cast<int>(thread));
+	FILE* file = std::fopen(path, "r");
+	char name[32] = {};
+	if(file) {
+		std::fgets(name, sizeof(name), file);
+		std::fclose(file);
+		name[std::strcspn(name, "\n")] = '\0';
+	}
+	return name[0] ? name : "thread-" + std::to_string(thread);
+}
+#endif
+
+bool Profiler::Start(unsigned int seconds) {
+#ifdef __linux__
+	std::lock_guard<std::mutex> lock(lock_);
+	if(running_)
+		return false;
+
+	capacity_ = std::min<size_t>(static_cast<size_t>(kSampleRate) * seconds * std::max(1u, std::thread::hardware_concurrency()),
+								 kMaxSamples);
+	frames_.reset(new void*[capacity_ * kMaxDepth]);
+	depths_.reset(new int[capacity_]);
+	threads_.reset(new pid_t[capacity_]);
+	next_sample_ = 0;
+
+	// The first backtrace() loads the unwinder, which can't be done in a signal handler
+	void* warm_up[1];
+	backtrace(warm_up, 1);
+
+	struct sigaction action = {};
+	action.sa_handler = &Profiler::OnSignal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if(sigaction(SIGPROF, &action, nullptr) != 0)
+		return false;
+
+	itimerval timer = {};
+	timer.it_interval.tv_usec = 1000000 / kSampleRate;
+	timer.it_value = timer.it_interval;
+	if(setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+		signal(SIGPROF, SIG_IGN);
+		return false;
+	}
+	running_ = true;
+	return true;
+#else
+	return false;
+#endif
+}
+
+std::string Profiler::Stop() {
+	std::string collapsed;
+#ifdef __linux__
+	std::lock_guard<std::mutex> lock(lock_);
+	if(!running_)
+		return collapsed;
+	running_ = false;
+
+	itimerval timer = {};
+	setitimer(ITIMER_PROF, &timer, nullptr);
+	// A signal that was already sent may still arrive, so it's ignored
+	// rather than left to its default action, which ends the process
+	signal(SIGPROF, SIG_IGN);
+	// A handler that had just been entered gets a moment to be counted
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	while(writers_.load(std::memory_order_acquire))
+		std::this_thread::yield();
+
+	size_t samples = std::min(next_sample_.load(), capacity_);
+	std::unordered_map<void*, std::string> frame_names;
+	std::unordered_map<pid_t, std::string> thread_names;
+	std::map<std::string, size_t> stacks;
+	for(size_t sample = 0; sample < samples; sample++) {
+		pid_t thread = threads_[sample];
+		auto thread_it = thread_names.find(thread);
+		if(thread_it == thread_names.end())
+			thread_it = thread_names.emplace(thread, NameThread(thread)).first;
+		std::string stack = thread_it->second;
+
+		// The outermost frame comes first
+		void** frames = &frames_[sample * kMaxDepth];
+		for(int i = depths_[sample] - 1; i >= kHandlerFrames; i--) {
+			auto frame_it = frame_names.find(frames[i]);
+			if(frame_it == frame_names.end())
+				frame_it = frame_names.emplace(frames[i], NameFrame(frames[i])).first;
+			stack += ';';
+			stack += frame_it->second;
+		}
+		stacks[stack]++;
+	}
+
+	for(const auto& [stack, count] : stacks) {
+		collapsed += stack;
+		collapsed += ' ';
+		collapsed += std::to_string(count);
+		collapsed += '\n';
+	}
+	frames_.reset();
+	depths_.reset();
+	threads_.reset();
+	capacity_ = 0;
+#endif
+	return collapsed;
+}
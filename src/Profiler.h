@@ -0,0 +1,82 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+
+/**
+ * Samples the stacks of every thread in the server while it's running,
+ * for finding what a lagging server spends its time on without attaching
+ * a profiler from outside. The process is sent SIGPROF for every 1/99th
+ * of a second of CPU time any of its threads use, and the thread that
+ * receives it records its own stack, so threads are sampled in proportion
+ * to the CPU they use and idle threads don't show up. Nothing is done
+ * while it isn't running. Only supported on Linux.
+ */
+class Profiler {
+   public:
+	/**
+	 * The profiler shared by the whole process, since there's only one SIGPROF.
+	 */
+	static Profiler& Get();
+
+	/**
+	 * The number of samples taken for each second of CPU time.
+	 */
+	constexpr static int kSampleRate = 99;
+
+	/**
+	 * The most frames recorded from the top of each stack.
+	 */
+	constexpr static size_t kMaxDepth = 48;
+
+	/**
+	 * The most samples kept, after which the rest are dropped.
+	 */
+	constexpr static size_t kMaxSamples = 64 * 1024;
+
+	/**
+	 * Starts sampling.
+	 *
+	 * @param seconds How long it's going to run for, which sizes the buffer.
+	 * @return false if it's already running or isn't supported.
+	 */
+	bool Start(unsigned int seconds);
+
+	/**
+	 * Stops sampling and symbolizes the stacks.
+	 *
+	 * @return The samples in the collapsed format of flamegraph.pl: one
+	 *         line for each distinct stack, starting with the thread's
+	 *         name, frames separated by semicolons, followed by the number
+	 *         of samples. Functions that can't be named are given as the
+	 *         file and offset, for addr2line.
+	 */
+	std::string Stop();
+
+   private:
+	Profiler() = default;
+
+	static void OnSignal(int signal);
+
+	std::mutex lock_;
+	bool running_ = false;
+
+	/**
+	 * Each sample's frames take kMaxDepth slots, followed by its depth
+	 * and thread ID in their own arrays.
+	 */
+	std::unique_ptr<void*[]> frames_;
+	std::unique_ptr<int[]> depths_;
+	std::unique_ptr<pid_t[]> threads_;
+	size_t capacity_ = 0;
+
+	/**
+	 * The next sample to be written, which can go past the capacity, and
+	 * the number of signal handlers that are writing one.
+	 */
+	std::atomic<size_t> next_sample_ { 0 };
+	std::atomic<int> writers_ { 0 };
+};
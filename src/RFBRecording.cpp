@@ -0,0 +1,170 @@
+#include "RFBRecording.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <zlib.h>
+
+/**
+ * The largest screen a record can describe, so a corrupt recording can't
+ * make the reader allocate an enormous buffer.
+ */
+constexpr int kMaxRecordedSize = 8192;
+
+bool RFBRecorder::Open(const std::string& path) {
+	file_.open(path, std::ios::binary | std::ios::trunc);
+	if(!file_)
+		return false;
+
+	file_.write(kRFBRecordingMagic, sizeof(kRFBRecordingMagic));
+	last_ = std::chrono::steady_clock::now();
+	dirty_ = false;
+	return true;
+}
+
+void RFBRecorder::Close() {
+	if(!file_.is_open())
+		return;
+
+	WriteFrame();
+	file_.close();
+	pixels_ = std::vector<unsigned char>();
+	compressed_ = std::vector<unsigned char>();
+}
+
+void RFBRecorder::WriteInt(uint32_t value, int bytes) {
+	for(int i = 0; i < bytes; i++)
+		file_.put(static_cast<char>(value >> (i * 8)));
+}
+
+void RFBRecorder::WriteHeader(RFBRecordType type) {
+	auto now = std::chrono::steady_clock::now();
+	auto delay = std::chrono::duration_cast<std::chrono::microseconds>(now - last_).count();
+	last_ = now;
+
+	file_.put(static_cast<char>(type));
+	WriteInt(static_cast<uint32_t>(std::min<int64_t>(delay, std::numeric_limits<uint32_t>::max())), 4);
+	dirty_ = type != RFBRecordType::kFrame;
+}
+
+void RFBRecorder::WriteSize(int width, int height) {
+	WriteHeader(RFBRecordType::kSize);
+	WriteInt(width, 2);
+	WriteInt(height, 2);
+}
+
+void RFBRecorder::WriteUpdate(int x, int y, int width, int height, const unsigned char* buffer, int stride) {
+	if(width <= 0 || height <= 0)
+		return;
+
+	// Copy the rows out of the surface so they're compressed as one block
+	size_t row = static_cast<size_t>(width) * 4;
+	pixels_.resize(row * height);
+	for(int i = 0; i < height; i++)
+		std::memcpy(&pixels_[i * row], buffer + (y + i) * stride + x * 4, row);
+
+	// Recordings are for profiling the rest of the pipeline, so the
+	// fastest compression keeps recording from slowing the VNC thread
+	uLongf length = compressBound(pixels_.size());
+	compressed_.resize(length);
+	if(compress2(compressed_.data(), &length, pixels_.data(), pixels_.size(), 1) != Z_OK)
+		return;
+
+	WriteHeader(RFBRecordType::kUpdate);
+	WriteInt(x, 2);
+	WriteInt(y, 2);
+	WriteInt(width, 2);
+	WriteInt(height, 2);
+	WriteInt(length, 4);
+	file_.write(reinterpret_cast<const char*>(compressed_.data()), length);
+}
+
+void RFBRecorder::WriteCopy(int src_x, int src_y, int width, int height, int dest_x, int dest_y) {
+	WriteHeader(RFBRecordType::kCopy);
+	WriteInt(src_x, 2);
+	WriteInt(src_y, 2);
+	WriteInt(width, 2);
+	WriteInt(height, 2);
+	WriteInt(dest_x, 2);
+	WriteInt(dest_y, 2);
+}
+
+void RFBRecorder::WriteFrame() {
+	if(dirty_)
+		WriteHeader(RFBRecordType::kFrame);
+}
+
+bool RFBRecordingReader::Open(const std::string& path) {
+	file_.open(path, std::ios::binary);
+	char magic[sizeof(kRFBRecordingMagic)];
+	return file_.read(magic, sizeof(magic)) && std::memcmp(magic, kRFBRecordingMagic, sizeof(magic)) == 0;
+}
+
+bool RFBRecordingReader::ReadInt(uint32_t& value, int bytes) {
+	unsigned char buffer[4];
+	if(!file_.read(reinterpret_cast<char*>(buffer), bytes))
+		return false;
+
+	value = 0;
+	for(int i = 0; i < bytes; i++)
+		value |= static_cast<uint32_t>(buffer[i]) << (i * 8);
+	return true;
+}
+
+bool RFBRecordingReader::Next(RFBRecord& record) {
+	int type = file_.get();
+	if(type == std::char_traits<char>::eof()) {
+		end_ = true;
+		return false;
+	}
+
+	if(!ReadInt(record.delay, 4))
+		return false;
+
+	uint32_t values[6] = {};
+	record.type = static_cast<RFBRecordType>(type);
+	switch(record.type) {
+		case RFBRecordType::kSize:
+			if(!ReadInt(values[2], 2) || !ReadInt(values[3], 2))
+				return false;
+			break;
+
+		case RFBRecordType::kUpdate:
+		case RFBRecordType::kCopy:
+			for(int i = 0; i < (record.type == RFBRecordType::kCopy ? 6 : 4); i++)
+				if(!ReadInt(values[i], 2))
+					return false;
+			break;
+
+		case RFBRecordType::kFrame:
+			break;
+
+		default:
+			return false;
+	}
+
+	record.x = values[0];
+	record.y = values[1];
+	record.width = values[2];
+	record.height = values[3];
+	record.dest_x = values[4];
+	record.dest_y = values[5];
+	if(record.width > kMaxRecordedSize || record.height > kMaxRecordedSize)
+		return false;
+
+	if(record.type == RFBRecordType::kUpdate) {
+		uint32_t length;
+		if(!ReadInt(length, 4) || length > compressBound(kMaxRecordedSize * kMaxRecordedSize * 4))
+			return false;
+
+		compressed_.resize(length);
+		if(!file_.read(reinterpret_cast<char*>(compressed_.data()), length))
+			return false;
+
+		uLongf size = static_cast<uLongf>(record.width) * record.height * 4;
+		record.pixels.resize(size);
+		if(uncompress(record.pixels.data(), &size, compressed_.data(), length) != Z_OK ||
+		   size != record.pixels.size())
+			return false;
+	}
+	return true;
+}
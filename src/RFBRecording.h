@@ -0,0 +1,130 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * Recordings of a VM's display, made of the updates from the VNC server after
+ * they were decoded into the default surface. They can be replayed through the
+ * surfaces and encoders by collab-vm-replay without a VM, so changes to them
+ * can be compared on the same workload.
+ *
+ * A recording starts with kRFBRecordingMagic, followed by records that each
+ * start with their type and the microseconds since the previous record.
+ * Integers are little-endian, and the pixels of updates are compressed with zlib.
+ */
+constexpr char kRFBRecordingMagic[8] = { 'C', 'V', 'M', 'R', 'E', 'C', '1', '\n' };
+
+enum class RFBRecordType : uint8_t {
+	kSize,	 // The screen was resized to width by height
+	kUpdate, // The rect was drawn with the 32-bit RGB pixels
+	kCopy,	 // The rect was copied to dest_x and dest_y
+	kFrame	 // The surfaces were flushed to the viewers
+};
+
+struct RFBRecord {
+	RFBRecordType type;
+
+	/**
+	 * The microseconds since the previous record.
+	 */
+	uint32_t delay;
+
+	int x;
+	int y;
+	int width;
+	int height;
+	int dest_x;
+	int dest_y;
+
+	/**
+	 * The pixels of an update, in rows of width * 4 bytes.
+	 */
+	std::vector<unsigned char> pixels;
+};
+
+/**
+ * Writes a recording. Only used from the thread of the VNC client.
+ */
+class RFBRecorder {
+   public:
+	/**
+	 * Creates the file and writes the header of the recording.
+	 *
+	 * @return Whether the file could be created.
+	 */
+	bool Open(const std::string& path);
+	void Close();
+
+	bool IsOpen() const {
+		return file_.is_open();
+	}
+
+	void WriteSize(int width, int height);
+
+	/**
+	 * Writes an update with the pixels of a rect of a 32-bit RGB buffer.
+	 */
+	void WriteUpdate(int x, int y, int width, int height, const unsigned char* buffer, int stride);
+
+	void WriteCopy(int src_x, int src_y, int width, int height, int dest_x, int dest_y);
+
+	/**
+	 * Writes the end of a frame, if anything was written since the last one.
+	 */
+	void WriteFrame();
+
+   private:
+	void WriteHeader(RFBRecordType type);
+	void WriteInt(uint32_t value, int bytes);
+
+	std::ofstream file_;
+
+	/**
+	 * When the last record was written.
+	 */
+	std::chrono::steady_clock::time_point last_;
+
+	/**
+	 * Whether a record was written since the last frame.
+	 */
+	bool dirty_ = false;
+
+	std::vector<unsigned char> pixels_;
+	std::vector<unsigned char> compressed_;
+};
+
+/**
+ * Reads the records of a recording in order.
+ */
+class RFBRecordingReader {
+   public:
+	/**
+	 * @return Whether the file could be opened and is a recording.
+	 */
+	bool Open(const std::string& path);
+
+	/**
+	 * Reads the next record.
+	 *
+	 * @return false at the end of the recording, or if it's corrupt.
+	 */
+	bool Next(RFBRecord& record);
+
+	/**
+	 * Whether every record was read, rather than Next() stopping at a
+	 * corrupt one.
+	 */
+	bool AtEnd() const {
+		return end_;
+	}
+
+   private:
+	bool ReadInt(uint32_t& value, int bytes);
+
+	std::ifstream file_;
+	bool end_ = false;
+	std::vector<unsigned char> compressed_;
+};
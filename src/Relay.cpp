@@ -0,0 +1,436 @@
+#include "Relay.h"
+#include "GuacInstructionParser.h"
+#include "GuacSocket.h"
+#include "Logger.h"
+
+#include <websocketmm/server.h>
+#include <websocketmm/websocket_user.h>
+
+#include <algorithm>
+#include <array>
+#include <string_view>
+
+/**
+ * Updates to the keyframe of a display that are kept before the primary is
+ * asked for a new one. The send budget of each viewer is larger, so that
+ * replaying the keyframe to a viewer can't overrun it by itself.
+ */
+static constexpr size_t kMaxKeyframeBytes = 4 * 1024 * 1024;
+static constexpr size_t kRelaySendBudget = 4 * kMaxKeyframeBytes;
+
+/**
+ * How long a viewer can go without sending anything, including the pong to
+ * a ping, before it's disconnected.
+ */
+static constexpr std::chrono::seconds kRelayIdleTimeout(15);
+
+/**
+ * The instructions that make up the display, which are re-broadcast from a
+ * display connection. Everything else the primary sends to it is meant for
+ * a user, and each viewer gets its own copy through its own connection.
+ */
+static constexpr std::array<std::string_view, 21> kDisplayOpcodes = {
+	"arc", "audio", "blob", "cfill", "copy", "cursor", "dispose", "end", "img", "move", "png",
+	"pop", "push", "rect", "reset", "shade", "size", "sync", "transfer", "transform", "video"
+};
+
+/**
+ * Gets the opcode of the first instruction in a message.
+ */
+static std::string_view GetOpcode(const websocketmm::websocket_message& message) {
+	std::string_view data(reinterpret_cast<const char*>(message.data.data()), message.data.size());
+	size_t dot = data.find('.');
+	if(dot == std::string_view::npos || dot == 0 || dot > 2)
+		return std::string_view();
+
+	size_t length = 0;
+	for(size_t i = 0; i < dot; i++) {
+		if(data[i] < '0' || data[i] > '9')
+			return std::string_view();
+		length = length * 10 + (data[i] - '0');
+	}
+	return data.substr(dot + 1, std::min(length, data.length() - dot - 1));
+}
+
+/**
+ * Appends an element of an instruction, with its length in bytes
+ * like GuacInstructionParser reads it.
+ */
+static void AppendElement(std::string& instr, std::string_view element) {
+	instr += std::to_string(element.length());
+	instr += '.';
+	instr += element;
+}
+
+RelayConnection::RelayConnection(net::io_context& io_context, const std::string& subprotocol, const std::string& relay_for)
+	: ws_(io_context),
+	  subprotocol_(subprotocol),
+	  relay_for_(relay_for),
+	  connected_(false),
+	  writing_(false),
+	  closed_(false) {
+}
+
+void RelayConnection::Start(const tcp::resolver::results_type& endpoints, const std::string& host, const std::string& token,
+							MessageHandler message_handler, std::function<void()> close_handler) {
+	host_ = host;
+	token_ = token;
+	message_handler_ = std::move(message_handler);
+	close_handler_ = std::move(close_handler);
+
+	beast::get_lowest_layer(ws_).expires_after(std::chrono::seconds(30));
+	beast::get_lowest_layer(ws_).async_connect(endpoints,
+		[self = shared_from_this()](beast::error_code ec, const tcp::endpoint&) {
+			self->OnConnect(ec);
+		});
+}
+
+void RelayConnection::OnConnect(beast::error_code ec) {
+	if(ec)
+		return Fail();
+
+	beast::get_lowest_layer(ws_).expires_never();
+	ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::client));
+	ws_.set_option(websocket::stream_base::decorator([this](websocket::request_type& request) {
+		request.set(http::field::sec_websocket_protocol, subprotocol_);
+		request.set("X-CollabVM-Relay", token_);
+		if(!relay_for_.empty())
+			request.set("X-CollabVM-Relay-For", relay_for_);
+	}));
+	ws_.read_message_max(64 * 1024 * 1024);
+	ws_.async_handshake(host_, "/", [self = shared_from_this()](beast::error_code ec) {
+		self->OnHandshake(ec);
+	});
+}
+
+void RelayConnection::OnHandshake(beast::error_code ec) {
+	if(ec)
+		return Fail();
+
+	connected_ = true;
+	if(!write_queue_.empty())
+		Write();
+	Read();
+}
+
+void RelayConnection::Read() {
+	ws_.async_read(buffer_, [self = shared_from_this()](beast::error_code ec, size_t bytes) {
+		self->OnRead(ec, bytes);
+	});
+}
+
+void RelayConnection::OnRead(beast::error_code ec, size_t bytes) {
+	if(ec)
+		return Fail();
+
+	// The display is droppable for the viewers it's re-broadcast to,
+	// like it is when the primary sends it to them
+	auto type = ws_.got_text() ? websocketmm::websocket_message::type::text : websocketmm::websocket_message::type::binary;
+	const uint8_t* data = static_cast<const uint8_t*>(buffer_.data().data());
+	auto message = websocketmm::BuildWebsocketMessage(type, std::vector<uint8_t>(data, data + buffer_.size()), relay_for_.empty());
+	buffer_.consume(buffer_.size());
+
+	if(closed_)
+		return;
+	message_handler_(std::move(message));
+	if(!closed_)
+		Read();
+}
+
+void RelayConnection::Send(std::string instr) {
+	if(closed_)
+		return;
+
+	write_queue_.push_back(std::move(instr));
+	if(connected_ && !writing_)
+		Write();
+}
+
+void RelayConnection::Write() {
+	writing_ = true;
+	ws_.text(true);
+	ws_.async_write(net::buffer(write_queue_.front()), [self = shared_from_this()](beast::error_code ec, size_t) {
+		if(ec)
+			return self->Fail();
+
+		self->write_queue_.pop_front();
+		self->writing_ = false;
+		if(!self->write_queue_.empty() && !self->closed_)
+			self->Write();
+	});
+}
+
+void RelayConnection::Close() {
+	if(closed_)
+		return;
+
+	closed_ = true;
+	write_queue_.clear();
+	message_handler_ = nullptr;
+	close_handler_ = nullptr;
+	beast::error_code ec;
+	beast::get_lowest_layer(ws_).socket().close(ec);
+}
+
+void RelayConnection::Fail() {
+	if(closed_)
+		return;
+
+	std::function<void()> close_handler = std::move(close_handler_);
+	Close();
+	if(close_handler)
+		close_handler();
+}
+
+Relay::Relay(net::io_context& io_context, const std::string& host, const std::string& port, const std::string& token)
+	: io_context_(io_context),
+	  server_(std::make_shared<websocketmm::server>(io_context)),
+	  host_(host),
+	  port_(port),
+	  token_(token) {
+}
+
+void Relay::Run(uint16_t port, const std::string& doc_root) {
+	using namespace std::placeholders;
+
+	endpoints_ = tcp::resolver(io_context_).resolve(host_, port_);
+
+	server_->set_verify_handler(std::bind(&Relay::OnValidate, this, _1));
+	server_->set_open_handler(std::bind(&Relay::OnOpen, this, _1));
+	server_->set_close_handler(std::bind(&Relay::OnClose, this, _1));
+	server_->set_message_handler(std::bind(&Relay::OnMessage, this, _1, _2));
+	server_->set_resync_handler(std::bind(&Relay::OnResync, this, _1));
+
+	// The path shouldn't end in a slash
+	std::string root = doc_root;
+	if(!root.empty() && (root.back() == '/' || root.back() == '\\'))
+		root.pop_back();
+	server_->set_doc_root(root);
+	server_->set_send_budget(kRelaySendBudget);
+	server_->set_idle_timeout(kRelayIdleTimeout);
+	server_->start("0.0.0.0", port);
+
+	Logger::Info() << "Relaying " << host_ << ':' << port_ << " on port " << port;
+}
+
+void Relay::Stop() {
+	server_->stop();
+
+	for(auto& [key, feed] : feeds_)
+		feed->connection->Close();
+	feeds_.clear();
+
+	for(auto& [handle, viewer] : viewers_) {
+		viewer->control->Close();
+		viewer->feed.reset();
+	}
+	viewers_.clear();
+}
+
+bool Relay::OnValidate(std::weak_ptr<websocketmm::websocket_user> handle) {
+	auto handle_sp = handle.lock();
+	if(!handle_sp)
+		return false;
+
+	// Connections that failed their handshake never open
+	for(auto it = pending_.begin(); it != pending_.end();) {
+		if(it->first.expired())
+			it = pending_.erase(it);
+		else
+			++it;
+	}
+
+	// The viewer gets the same subprotocol from the primary
+	http::token_list offered(handle_sp->GetSubprotocols());
+	for(const char* subprotocol : { GUAC_BINARY_SUBPROTOCOL, "guacamole" }) {
+		if(std::find(offered.begin(), offered.end(), subprotocol) != offered.end()) {
+			handle_sp->SelectSubprotocol(subprotocol);
+			pending_[handle] = std::make_pair(handle_sp->GetAddress().to_string(), subprotocol == std::string_view(GUAC_BINARY_SUBPROTOCOL));
+			return true;
+		}
+	}
+	return false;
+}
+
+void Relay::OnOpen(std::weak_ptr<websocketmm::websocket_user> handle) {
+	auto it = pending_.find(handle);
+	if(it == pending_.end())
+		return;
+
+	auto viewer = std::make_unique<Viewer>();
+	viewer->handle = handle;
+	viewer->binary = it->second.second;
+	viewer->control = Connect(viewer->binary ? GUAC_BINARY_SUBPROTOCOL : "guacamole", it->second.first);
+	pending_.erase(it);
+
+	Viewer* ptr = viewer.get();
+	viewer->control->Start(endpoints_, host_ + ':' + port_, token_,
+		[this, ptr](std::shared_ptr<const websocketmm::websocket_message> message) {
+			OnControlMessage(*ptr, std::move(message));
+		},
+		[this, ptr]() {
+			CloseViewer(*ptr);
+		});
+	viewers_[handle] = std::move(viewer);
+}
+
+void Relay::OnMessage(std::weak_ptr<websocketmm::websocket_user> handle, std::shared_ptr<const websocketmm::websocket_message> message) {
+	auto it = viewers_.find(handle);
+	if(it == viewers_.end() || message->message_type != websocketmm::websocket_message::type::text)
+		return;
+
+	Viewer& viewer = *it->second;
+	std::string_view instruction(reinterpret_cast<const char*>(message->data.data()), message->data.size());
+
+	// Remember which display the viewer wants, the primary decides whether it can join
+	if(!viewer.feed && GetOpcode(*message) == "connect") {
+		std::array<std::string_view, GuacInstructionParser::MAX_GUAC_ELEMENTS> elements;
+		size_t count = GuacInstructionParser::DecodeInstruction(instruction, elements);
+		if(count >= 2) {
+			// The turn updates are sent through the viewer's own connection
+			std::string connect = "7.connect";
+			for(size_t i = 1; i < count; i++) {
+				if(elements[i] == "turnupdate")
+					continue;
+				connect += ',';
+				AppendElement(connect, elements[i]);
+			}
+			connect += ';';
+			viewer.feed_key = (viewer.binary ? "binary:" : "text:") + connect;
+			viewer.feed_connect = std::move(connect);
+		}
+	}
+
+	viewer.control->Send(std::string(instruction));
+}
+
+void Relay::OnClose(std::weak_ptr<websocketmm::websocket_user> handle) {
+	auto it = viewers_.find(handle);
+	if(it == viewers_.end())
+		return;
+
+	DetachViewer(*it->second);
+	it->second->control->Close();
+	viewers_.erase(it);
+}
+
+void Relay::OnResync(std::weak_ptr<websocketmm::websocket_user> handle) {
+	auto it = viewers_.find(handle);
+	if(it != viewers_.end() && it->second->feed)
+		SendKeyframe(*it->second, *it->second->feed);
+}
+
+void Relay::OnControlMessage(Viewer& viewer, std::shared_ptr<const websocketmm::websocket_message> message) {
+	server_->send_message(viewer.handle, message);
+
+	if(viewer.feed || viewer.feed_key.empty() || GetOpcode(*message) != "connect")
+		return;
+
+	// The viewer is sent the display once it has joined the VM
+	static constexpr std::string_view kJoined = "7.connect,1.1,";
+	if(message->data.size() >= kJoined.length() && std::equal(kJoined.begin(), kJoined.end(), message->data.begin()))
+		AttachViewer(viewer);
+	else
+		viewer.feed_key.clear();
+}
+
+void Relay::OnFeedMessage(Feed& feed, std::shared_ptr<const websocketmm::websocket_message> message) {
+	if(message->message_type == websocketmm::websocket_message::type::text) {
+		std::string_view opcode = GetOpcode(*message);
+		// The primary pings its connections itself, so its nops only keep
+		// browsers from timing out and aren't needed here
+		if(opcode == "nop")
+			return;
+
+		if(opcode == "keyframe") {
+			feed.keyframe.clear();
+			feed.keyframe_bytes = 0;
+			feed.has_keyframe = true;
+			feed.keyframe_requested = false;
+			return;
+		}
+
+		if(std::find(kDisplayOpcodes.begin(), kDisplayOpcodes.end(), opcode) == kDisplayOpcodes.end())
+			return;
+	}
+
+	if(feed.has_keyframe) {
+		feed.keyframe.push_back(message);
+		feed.keyframe_bytes += message->data.size();
+		if(feed.keyframe_bytes > kMaxKeyframeBytes && !feed.keyframe_requested) {
+			feed.connection->Send("8.keyframe;");
+			feed.keyframe_requested = true;
+		}
+	}
+
+	for(Viewer* viewer : feed.viewers)
+		server_->send_message(viewer->handle, message);
+}
+
+void Relay::OnFeedClosed(Feed& feed) {
+	// The viewers can't be sent the display anymore, so they're
+	// disconnected and can reconnect like the primary had restarted
+	auto it = feeds_.find(feed.key);
+	if(it == feeds_.end())
+		return;
+
+	std::shared_ptr<Feed> ptr = std::move(it->second);
+	feeds_.erase(it);
+	for(Viewer* viewer : ptr->viewers) {
+		viewer->feed.reset();
+		CloseViewer(*viewer);
+	}
+}
+
+void Relay::AttachViewer(Viewer& viewer) {
+	std::shared_ptr<Feed>& feed = feeds_[viewer.feed_key];
+	if(!feed) {
+		feed = std::make_shared<Feed>();
+		feed->key = viewer.feed_key;
+		feed->connection = Connect(viewer.binary ? GUAC_BINARY_SUBPROTOCOL : "guacamole", std::string());
+
+		Feed* ptr = feed.get();
+		feed->connection->Start(endpoints_, host_ + ':' + port_, token_,
+			[this, ptr](std::shared_ptr<const websocketmm::websocket_message> message) {
+				OnFeedMessage(*ptr, std::move(message));
+			},
+			[this, ptr]() {
+				OnFeedClosed(*ptr);
+			});
+		feed->connection->Send(viewer.feed_connect);
+	} else {
+		SendKeyframe(viewer, *feed);
+	}
+
+	feed->viewers.insert(&viewer);
+	viewer.feed = feed;
+}
+
+void Relay::DetachViewer(Viewer& viewer) {
+	if(!viewer.feed)
+		return;
+
+	std::shared_ptr<Feed> feed = std::move(viewer.feed);
+	feed->viewers.erase(&viewer);
+
+	// The display connection is closed along with its last viewer
+	if(feed->viewers.empty()) {
+		feed->connection->Close();
+		feeds_.erase(feed->key);
+	}
+}
+
+void Relay::SendKeyframe(Viewer& viewer, const Feed& feed) {
+	for(const auto& message : feed.keyframe)
+		server_->send_message(viewer.handle, message);
+}
+
+void Relay::CloseViewer(Viewer& viewer) {
+	// The close handler removes the viewer once the connection has closed
+	if(auto handle = viewer.handle.lock())
+		handle->close();
+}
+
+std::shared_ptr<RelayConnection> Relay::Connect(const std::string& subprotocol, const std::string& relay_for) {
+	return std::make_shared<RelayConnection>(io_context_, subprotocol, relay_for);
+}
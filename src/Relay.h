@@ -0,0 +1,178 @@
+#pragma once
+#include <websocketmm/beast/beast.h>
+#include <websocketmm/beast/net.h>
+#include <websocketmm/fwd.h>
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * A WebSocket connection from a relay to the primary server.
+ * Instructions can be sent before the handshake has finished,
+ * they're queued until it has.
+ */
+class RelayConnection : public std::enable_shared_from_this<RelayConnection> {
+   public:
+	typedef std::function<void(std::shared_ptr<const websocketmm::websocket_message>)> MessageHandler;
+
+	/**
+	 * @param relay_for The address of the viewer the connection is for,
+	 * or empty for a display connection.
+	 */
+	RelayConnection(net::io_context& io_context, const std::string& subprotocol, const std::string& relay_for);
+
+	/**
+	 * Connects to the primary. The close handler is called once, when the
+	 * connection fails or is closed by either side, but not after Close().
+	 */
+	void Start(const tcp::resolver::results_type& endpoints, const std::string& host, const std::string& token,
+			   MessageHandler message_handler, std::function<void()> close_handler);
+
+	void Send(std::string instr);
+
+	void Close();
+
+   private:
+	void OnConnect(beast::error_code ec);
+	void OnHandshake(beast::error_code ec);
+	void Read();
+	void OnRead(beast::error_code ec, size_t bytes);
+	void Write();
+	void Fail();
+
+	websocket::stream<beast::tcp_stream> ws_;
+	beast::flat_buffer buffer_;
+
+	const std::string subprotocol_;
+	const std::string relay_for_;
+	std::string host_;
+	std::string token_;
+
+	MessageHandler message_handler_;
+	std::function<void()> close_handler_;
+
+	std::deque<std::string> write_queue_;
+	bool connected_;
+	bool writing_;
+	bool closed_;
+};
+
+/**
+ * Serves viewers from its own address while a primary server runs the VMs.
+ * The relay opens one display connection to the primary for each VM its
+ * viewers are watching, with each combination of image formats they
+ * support, and re-broadcasts it to them. Everything else a viewer sends and
+ * receives, like chat, turns and input, goes through a connection that the
+ * relay opens for it, which the primary treats as coming from the viewer's
+ * address but doesn't send the display to.
+ *
+ * The primary starts every full copy of the display it sends to a display
+ * connection with a keyframe instruction. The relay keeps the copy and the
+ * updates after it for viewers that join or fall behind, and asks for a new
+ * copy once the updates get too big. Everything runs on one io_context.
+ */
+class Relay : public std::enable_shared_from_this<Relay> {
+   public:
+	/**
+	 * @param token The primary's relay token.
+	 */
+	Relay(net::io_context& io_context, const std::string& host, const std::string& port, const std::string& token);
+
+	/**
+	 * Resolves the primary and starts accepting viewers.
+	 */
+	void Run(uint16_t port, const std::string& doc_root);
+
+	void Stop();
+
+   private:
+	struct Feed;
+
+	struct Viewer {
+		std::weak_ptr<websocketmm::websocket_user> handle;
+		bool binary = false;
+
+		/**
+		 * The connection to the primary that the viewer's instructions
+		 * are forwarded through.
+		 */
+		std::shared_ptr<RelayConnection> control;
+
+		/**
+		 * The display the viewer asked for, which it's sent once
+		 * the primary lets it join the VM.
+		 */
+		std::string feed_key;
+		std::string feed_connect;
+
+		std::shared_ptr<Feed> feed;
+	};
+
+	struct Feed {
+		std::string key;
+		std::shared_ptr<RelayConnection> connection;
+		std::set<Viewer*> viewers;
+
+		/**
+		 * The messages since the last keyframe instruction, which
+		 * recreate the display for a viewer that joins.
+		 */
+		std::vector<std::shared_ptr<const websocketmm::websocket_message>> keyframe;
+		size_t keyframe_bytes = 0;
+		bool has_keyframe = false;
+		bool keyframe_requested = false;
+	};
+
+	bool OnValidate(std::weak_ptr<websocketmm::websocket_user> handle);
+	void OnOpen(std::weak_ptr<websocketmm::websocket_user> handle);
+	void OnMessage(std::weak_ptr<websocketmm::websocket_user> handle, std::shared_ptr<const websocketmm::websocket_message> message);
+	void OnClose(std::weak_ptr<websocketmm::websocket_user> handle);
+	void OnResync(std::weak_ptr<websocketmm::websocket_user> handle);
+
+	/**
+	 * Handles a message from the primary on a viewer's own connection.
+	 */
+	void OnControlMessage(Viewer& viewer, std::shared_ptr<const websocketmm::websocket_message> message);
+	void OnFeedMessage(Feed& feed, std::shared_ptr<const websocketmm::websocket_message> message);
+	void OnFeedClosed(Feed& feed);
+
+	void AttachViewer(Viewer& viewer);
+	void DetachViewer(Viewer& viewer);
+
+	/**
+	 * Sends the messages since the last keyframe to a viewer.
+	 */
+	void SendKeyframe(Viewer& viewer, const Feed& feed);
+
+	void CloseViewer(Viewer& viewer);
+
+	std::shared_ptr<RelayConnection> Connect(const std::string& subprotocol, const std::string& relay_for);
+
+	net::io_context& io_context_;
+	std::shared_ptr<websocketmm::server> server_;
+
+	const std::string host_;
+	const std::string port_;
+	const std::string token_;
+	tcp::resolver::results_type endpoints_;
+
+	/**
+	 * The addresses and subprotocols of viewers that have been verified
+	 * but not opened yet.
+	 */
+	std::map<std::weak_ptr<websocketmm::websocket_user>, std::pair<std::string, bool>,
+			 std::owner_less<std::weak_ptr<websocketmm::websocket_user>>>
+		pending_;
+
+	std::map<std::weak_ptr<websocketmm::websocket_user>, std::unique_ptr<Viewer>,
+			 std::owner_less<std::weak_ptr<websocketmm::websocket_user>>>
+		viewers_;
+
+	std::map<std::string, std::shared_ptr<Feed>> feeds_;
+};
@@ -0,0 +1,99 @@
+#include "SIMD.h"
+#include "Metrics.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+
+namespace SIMD {
+static const char* const kLevelNames[] = { "scalar", "sse4.2", "avx2", "avx512", "neon" };
+
+/**
+ * Detects the best level the CPU supports, limited by COLLABVM_SIMD.
+ */
+static Level DetectLevel() {
+	Level level = Level::kScalar;
+#if defined(SIMD_X86)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("ssse3")) {
+		level = Level::kSSE42;
+		if(__builtin_cpu_supports("avx2")) {
+			level = Level::kAVX2;
+			if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+				level = Level::kAVX512;
+		}
+	}
+#elif defined(__ARM_NEON)
+	level = Level::kNEON;
+#endif
+
+	if(const char* limit = std::getenv("COLLABVM_SIMD")) {
+		for(size_t i = 0; i < sizeof(kLevelNames) / sizeof(*kLevelNames); i++) {
+			if(!std::strcmp(limit, kLevelNames[i])) {
+				Level limited = static_cast<Level>(i);
+				if(limited == Level::kScalar || (level != Level::kNEON && limited < level))
+					level = limited;
+				break;
+			}
+		}
+	}
+	return level;
+}
+
+bool Supports(Level level) {
+	static const Level supported = DetectLevel();
+	if(level == Level::kScalar)
+		return true;
+	if(level == Level::kNEON || supported == Level::kNEON)
+		return level == supported;
+	return level <= supported;
+}
+
+const char* GetLevelName(Level level) {
+	return kLevelNames[static_cast<size_t>(level)];
+}
+
+struct Selection {
+	const char* kernel;
+	Level level;
+	MetricGauge metric;
+};
+
+/**
+ * The kernels that were picked, which are only added to before main().
+ */
+static std::list<Selection>& GetSelections() {
+	static std::list<Selection> selections;
+	return selections;
+}
+
+static std::mutex& GetLock() {
+	static std::mutex lock;
+	return lock;
+}
+
+void Record(const char* kernel, Level level) {
+	std::lock_guard<std::mutex> lock(GetLock());
+	Selection& selection = GetSelections().emplace_back();
+	selection.kernel = kernel;
+	selection.level = level;
+	selection.metric.Set(1);
+	Metrics::Get().Add("collabvm_simd_kernel", "The variant of each SIMD kernel picked for the CPU, always 1.",
+					   Metrics::Label("kernel", kernel) + ',' + Metrics::Label("isa", GetLevelName(level)),
+					   selection.metric);
+}
+
+std::string Describe() {
+	std::lock_guard<std::mutex> lock(GetLock());
+	std::string description;
+	for(const Selection& selection : GetSelections()) {
+		if(!description.empty())
+			description += ", ";
+		description += selection.kernel;
+		description += ": ";
+		description += GetLevelName(selection.level);
+	}
+	return description;
+}
+} // namespace SIMD
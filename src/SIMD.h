@@ -0,0 +1,96 @@
+#pragma once
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define SIMD_X86 1
+
+	/**
+	 * Compiles a function for an instruction set that the rest of the
+	 * binary may not be built for, so it can be picked at runtime.
+	 */
+	#define SIMD_TARGET(isa) __attribute__((target(isa)))
+	#define SIMD_TARGET_SSE42 SIMD_TARGET("ssse3,sse4.1,sse4.2")
+	#define SIMD_TARGET_AVX2 SIMD_TARGET("avx,avx2")
+	#define SIMD_TARGET_AVX512 SIMD_TARGET("avx,avx2,avx512f,avx512bw")
+#endif
+
+/**
+ * Picks the variant of each SIMD kernel that the CPU the server runs on
+ * supports, so one binary runs well on hosts with and without AVX2 or
+ * AVX-512. Variants for x86 are compiled for their instruction set with
+ * SIMD_TARGET whatever the binary is built for, while NEON is only used
+ * when the binary is built for it, since it's part of every ARM64 CPU.
+ *
+ * Kernels keep the pointer Select() returns in a static, so they're picked
+ * once before main(). Setting COLLABVM_SIMD to scalar, sse4.2, avx2 or
+ * avx512 limits the variants to those the named one implies, to compare
+ * them on the same host.
+ */
+namespace SIMD {
+enum class Level {
+	kScalar,
+	kSSE42,
+	kAVX2,
+	kAVX512,
+	kNEON
+};
+
+/**
+ * The variants of a kernel. Those that don't exist are null, and the
+ * scalar one always has to.
+ */
+template<typename Function>
+struct Variants {
+	Function* scalar;
+	Function* sse42;
+	Function* avx2;
+	Function* avx512;
+	Function* neon;
+};
+
+/**
+ * Whether the CPU supports the instructions of the level, and they're
+ * allowed by COLLABVM_SIMD.
+ */
+bool Supports(Level level);
+
+const char* GetLevelName(Level level);
+
+/**
+ * Records the variant picked for a kernel, for Describe() and the
+ * collabvm_simd_kernel metric.
+ */
+void Record(const char* kernel, Level level);
+
+/**
+ * Picks the best variant of the kernel the CPU supports.
+ *
+ * @param kernel The name of the kernel, for the log and the metrics.
+ */
+template<typename Function>
+Function* Select(const char* kernel, const Variants<Function>& variants) {
+	Level level = Level::kScalar;
+	Function* function = variants.scalar;
+	if(variants.neon && Supports(Level::kNEON)) {
+		level = Level::kNEON;
+		function = variants.neon;
+	} else if(variants.avx512 && Supports(Level::kAVX512)) {
+		level = Level::kAVX512;
+		function = variants.avx512;
+	} else if(variants.avx2 && Supports(Level::kAVX2)) {
+		level = Level::kAVX2;
+		function = variants.avx2;
+	} else if(variants.sse42 && Supports(Level::kSSE42)) {
+		level = Level::kSSE42;
+		function = variants.sse42;
+	}
+	Record(kernel, level);
+	return function;
+}
+
+/**
+ * Lists the variant picked for each kernel, like "base64: sse4.2, hash: avx2",
+ * for the log.
+ */
+std::string Describe();
+} // namespace SIMD
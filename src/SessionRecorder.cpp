@@ -0,0 +1,186 @@
+#include "SessionRecorder.h"
+#include "Logger.h"
+
+#include <utility>
+#include <websocketmm/websocket_user.h>
+
+#ifdef USE_ZSTD
+	#include <zstd.h>
+#endif
+
+/**
+ * How long to wait before trying another file after one couldn't be written,
+ * since each try costs a keyframe.
+ */
+constexpr static std::chrono::seconds kRetryDelay(60);
+
+#ifdef USE_ZSTD
+/**
+ * A fast level, the instructions are mostly base64 that compresses about
+ * as well at any level.
+ */
+constexpr static int kCompressionLevel = 3;
+#endif
+
+SessionRecorder::SessionRecorder(std::string prefix, uint64_t max_file_size, size_t max_queued)
+	: prefix_(std::move(prefix)),
+	  max_file_size_(max_file_size),
+	  max_queued_(max_queued),
+	  queued_bytes_(0),
+	  discarding_(true),
+	  stopping_(false),
+	  keyframe_needed_(true),
+	  file_(nullptr),
+	  file_size_(0) {
+#ifdef USE_ZSTD
+	zstd_ = ZSTD_createCCtx();
+	ZSTD_CCtx_setParameter(zstd_, ZSTD_c_compressionLevel, kCompressionLevel);
+	compressed_.resize(ZSTD_CStreamOutSize());
+#endif
+	thread_ = std::thread(&SessionRecorder::Run, this);
+}
+
+SessionRecorder::~SessionRecorder() {
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		stopping_ = true;
+	}
+	wake_.notify_one();
+	thread_.join();
+#ifdef USE_ZSTD
+	ZSTD_freeCCtx(zstd_);
+#endif
+}
+
+void SessionRecorder::Write(std::shared_ptr<const websocketmm::websocket_message> message) {
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		if(discarding_)
+			return;
+		Push({ std::move(message), false });
+	}
+	wake_.notify_one();
+}
+
+void SessionRecorder::WriteKeyframe(std::vector<uint8_t> instructions) {
+	auto message = websocketmm::BuildWebsocketMessage(websocketmm::websocket_message::type::text, std::move(instructions));
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		discarding_ = false;
+		keyframe_needed_ = false;
+		Push({ std::move(message), true });
+	}
+	wake_.notify_one();
+}
+
+void SessionRecorder::Push(Entry entry) {
+	queued_bytes_ += entry.message->data.size();
+	queue_.push_back(std::move(entry));
+	if(queued_bytes_ <= max_queued_)
+		return;
+
+	// Drop the oldest messages, and the ones after them up to the next
+	// keyframe, since they only draw over what was dropped
+	size_t dropped = 0;
+	while(!queue_.empty() && (queued_bytes_ > max_queued_ || !queue_.front().keyframe)) {
+		queued_bytes_ -= queue_.front().message->data.size();
+		queue_.pop_front();
+		dropped++;
+	}
+
+	if(queue_.empty()) {
+		discarding_ = true;
+		keyframe_needed_ = true;
+	}
+	Logger::Warning("SessionRecorder") << "Dropped " << dropped << " messages from \"" << prefix_
+									   << "\", the disk isn't keeping up";
+}
+
+void SessionRecorder::Run() {
+	std::unique_lock<std::mutex> lock(lock_);
+	while(true) {
+		wake_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+		if(queue_.empty())
+			break;
+
+		Entry entry = std::move(queue_.front());
+		queue_.pop_front();
+		queued_bytes_ -= entry.message->data.size();
+		lock.unlock();
+
+		if(entry.keyframe)
+			Open();
+		if(file_ && !Append(entry.message->data.data(), entry.message->data.size()))
+			Fail();
+
+		// The current file is kept until the keyframe arrives
+		if(file_ ? file_size_ >= max_file_size_ : std::chrono::steady_clock::now() >= retry_at_)
+			keyframe_needed_ = true;
+
+		lock.lock();
+	}
+	Close();
+}
+
+void SessionRecorder::Open() {
+	Close();
+
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+	std::string path = prefix_ + std::to_string(now.count()) + ".guac";
+#ifdef USE_ZSTD
+	path += ".zst";
+	ZSTD_CCtx_reset(zstd_, ZSTD_reset_session_only);
+#endif
+	file_ = std::fopen(path.c_str(), "wb");
+	file_size_ = 0;
+	if(!file_) {
+		Logger::Error("SessionRecorder") << "Failed to create the recording \"" << path << '"';
+		Fail();
+	}
+}
+
+void SessionRecorder::Close() {
+	if(!file_)
+		return;
+
+#ifdef USE_ZSTD
+	// Finish the frame so the file can be decompressed
+	ZSTD_inBuffer input = { nullptr, 0, 0 };
+	size_t remaining;
+	do {
+		ZSTD_outBuffer output = { compressed_.data(), compressed_.size(), 0 };
+		remaining = ZSTD_compressStream2(zstd_, &output, &input, ZSTD_e_end);
+		if(ZSTD_isError(remaining) ||
+		   std::fwrite(compressed_.data(), 1, output.pos, file_) != output.pos)
+			break;
+	} while(remaining != 0);
+#endif
+	std::fclose(file_);
+	file_ = nullptr;
+}
+
+bool SessionRecorder::Append(const uint8_t* data, size_t size) {
+#ifdef USE_ZSTD
+	ZSTD_inBuffer input = { data, size, 0 };
+	while(input.pos < input.size) {
+		ZSTD_outBuffer output = { compressed_.data(), compressed_.size(), 0 };
+		if(ZSTD_isError(ZSTD_compressStream2(zstd_, &output, &input, ZSTD_e_continue)) ||
+		   std::fwrite(compressed_.data(), 1, output.pos, file_) != output.pos)
+			return false;
+		file_size_ += output.pos;
+	}
+	return true;
+#else
+	file_size_ += size;
+	return std::fwrite(data, 1, size, file_) == size;
+#endif
+}
+
+void SessionRecorder::Fail() {
+	if(file_) {
+		Logger::Error("SessionRecorder") << "Failed to write to the recording \"" << prefix_ << "\"";
+		std::fclose(file_);
+		file_ = nullptr;
+	}
+	retry_at_ = std::chrono::steady_clock::now() + kRetryDelay;
+}
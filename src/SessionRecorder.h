@@ -0,0 +1,128 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <websocketmm/fwd.h>
+
+/**
+ * Records the Guacamole instructions that are broadcast to a VM's viewers,
+ * for moderation. The text messages the viewers are sent are queued with
+ * their buffers shared, so nothing is encoded again, and a thread of its own
+ * appends them to the recording. The files can be played back by guacenc or
+ * the player of guacamole-common-js, after being decompressed with zstd when
+ * the server was built with ZSTD=1.
+ *
+ * Every file starts with a keyframe, a copy of the whole display, so it can
+ * be played on its own. Once a file is larger than its limit, the next
+ * keyframe starts a new one. When the disk can't keep up, the oldest
+ * messages are dropped, along with the rest that depend on them, and the
+ * recording carries on in a new file from the next keyframe.
+ *
+ * Can be used from any thread.
+ */
+class SessionRecorder {
+   public:
+	/**
+	 * @param prefix The path of the files, which is followed by the time
+	 *               each one was started.
+	 * @param max_file_size The number of bytes after which a new file is started.
+	 * @param max_queued The number of bytes of messages waiting to be written
+	 *                   before the oldest are dropped.
+	 */
+	SessionRecorder(std::string prefix, uint64_t max_file_size, size_t max_queued);
+
+	/**
+	 * Writes the messages that are still waiting and closes the file.
+	 */
+	~SessionRecorder();
+
+	SessionRecorder(const SessionRecorder&) = delete;
+	SessionRecorder& operator=(const SessionRecorder&) = delete;
+
+	/**
+	 * Queues a message that was broadcast to the viewers. Messages are
+	 * ignored while a keyframe is needed because of a gap.
+	 */
+	void Write(std::shared_ptr<const websocketmm::websocket_message> message);
+
+	/**
+	 * Queues a copy of the whole display, which starts a new file.
+	 */
+	void WriteKeyframe(std::vector<uint8_t> instructions);
+
+	/**
+	 * Whether a keyframe should be written before the next frame, because
+	 * the recording just started, messages were dropped or the file is full.
+	 */
+	bool NeedsKeyframe() const {
+		return keyframe_needed_;
+	}
+
+   private:
+	struct Entry {
+		std::shared_ptr<const websocketmm::websocket_message> message;
+		bool keyframe;
+	};
+
+	/**
+	 * Queues an entry and drops the oldest ones if the queue is full.
+	 * Must be called with lock_ locked.
+	 */
+	void Push(Entry entry);
+
+	void Run();
+
+	/**
+	 * Closes the current file and starts a new one.
+	 */
+	void Open();
+	void Close();
+	bool Append(const uint8_t* data, size_t size);
+
+	/**
+	 * Closes the file after it couldn't be written, and waits a while
+	 * before asking for a keyframe to try a new one.
+	 */
+	void Fail();
+
+	const std::string prefix_;
+	const uint64_t max_file_size_;
+	const size_t max_queued_;
+
+	std::mutex lock_;
+	std::condition_variable wake_;
+	std::deque<Entry> queue_;
+	size_t queued_bytes_;
+
+	/**
+	 * Set when messages have been dropped, until the next keyframe.
+	 * Guarded by lock_.
+	 */
+	bool discarding_;
+	bool stopping_;
+
+	std::atomic<bool> keyframe_needed_;
+
+	/**
+	 * The file being written and its size. Only used by the writer thread.
+	 */
+	FILE* file_;
+	uint64_t file_size_;
+	std::chrono::steady_clock::time_point retry_at_;
+
+#ifdef USE_ZSTD
+	struct ZSTD_CCtx_s* zstd_;
+	std::vector<uint8_t> compressed_;
+#endif
+
+	std::thread thread_;
+};
@@ -1,13 +1,49 @@
 #include "AgentClient.h"
+#include "FileIO.h"
+#include "Logger.h"
 #include <boost/asio.hpp>
 #include <boost/system/error_code.hpp>
+#include <algorithm>
 #include <chrono>
+#include <cstddef>
 #include <functional>
 #include <limits>
 #include <streambuf>
 #include <locale>
 #include <codecvt>
 
+/**
+ * The smallest compressed part. zlib can repeat the marker of a flush
+ * forever when it has less room than this for it.
+ */
+constexpr static size_t kMinDeflatePart = 7;
+
+/**
+ * The bytes of a spooled upload that are read ahead of the agent.
+ */
+constexpr static size_t kReadAheadSize = 4 * FileIO::kBufferSize;
+
+/**
+ * Reads a spooled upload into a ring ahead of the agent, one buffer at a
+ * time, so the agent's thread never waits on the disk. Stops once the ring
+ * is closed.
+ */
+static void ReadAhead(std::shared_ptr<AsyncFile> file, std::shared_ptr<UploadPipe> pipe, uint64_t offset) {
+	if(pipe->GetState() != UploadPipe::State::kOpen ||
+	   pipe->WaitWritable(FileIO::kBufferSize, [file, pipe, offset]() { ReadAhead(file, pipe, offset); }))
+		return;
+
+	std::shared_ptr<FileIO::Buffer> buffer = FileIO::Get().AcquireBuffer(FileIO::kBufferSize);
+	file->Read(offset, buffer, buffer->Size(), [file, pipe, offset, buffer](int64_t result) {
+		if(result < 0)
+			pipe->Fail();
+		else if(result == 0)
+			pipe->Finish();
+		else if(pipe->Write(buffer->Data(), result))
+			ReadAhead(file, pipe, offset + result);
+	});
+}
+
 AgentClient::AgentClient(boost::asio::io_service& service)
 	: state_(ConnectionState::kNotConnected),
 	  timer_(service) {
@@ -18,9 +54,9 @@ void AgentClient::UploadFile(const std::shared_ptr<UploadInfo>& info) {
 	GetService().dispatch([this, self, info]() {
 		if(file_upload_state_ == UploadState::kNotUploading &&
 		   (state_ == ConnectionState::kBody || state_ == ConnectionState::kHeader) &&
-		   info->file_stream) {
-			info->file_stream.seekg(0, std::fstream::end);
-			auto upload_size = info->file_stream.tellg();
+		   (info->pipe || info->file)) {
+			// The size of a piped upload was checked against the body before it ended
+			int64_t upload_size = info->pipe ? static_cast<int64_t>(info->file_size) : info->file->GetSize();
 			if(upload_size > 0 && upload_size < std::numeric_limits<uint32_t>::max()) {
 				try {
 					std::wstring_convert<std::codecvt_utf8_utf16<utf16_t>, utf16_t> cv;
@@ -54,7 +90,7 @@ void AgentClient::UploadFile(const std::shared_ptr<UploadInfo>& info) {
 		}
 
 		if(auto ptr = controller_.lock())
-			ptr->OnFileUploadFailed(file_upload_info_);
+			ptr->OnFileUploadFailed(info);
 	});
 }
 
@@ -146,6 +182,8 @@ bool AgentClient::IsFilenameValid(uint32_t max_len, const std::string& filename)
 //}
 
 AgentClient::~AgentClient() {
+	if(deflate_init_)
+		deflateEnd(&deflate_stream_);
 }
 
 void AgentClient::OnConnect(std::shared_ptr<SocketCtx>& ctx) {
@@ -162,6 +200,11 @@ void AgentClient::OnConnect(std::shared_ptr<SocketCtx>& ctx) {
 void AgentClient::OnDisconnect() {
 	ConnectionState prev_state = state_;
 	state_ = ConnectionState::kNotConnected;
+
+	// Stops reading the file ahead, the ring of a piped upload is closed by the server
+	if(upload_pipe_ && (!file_upload_info_ || upload_pipe_ != file_upload_info_->pipe))
+		upload_pipe_->Fail();
+	upload_pipe_.reset();
 	if(auto ptr = controller_.lock()) {
 		if(file_upload_state_ != UploadState::kNotUploading)
 			ptr->OnFileUploadFailed(file_upload_info_);
@@ -197,7 +240,7 @@ void AgentClient::OnReadUploadReq(const boost::system::error_code& ec, size_t si
 				// TODO: Disconnect if client sends data during upload
 			}
 		} else {
-			std::cout << "Error: Could not open file \"" << agent_path_ << "\" for CollabVM Agent" << std::endl;
+			Logger::Error() << "Could not open file \"" << agent_path_ << "\" for CollabVM Agent";
 		}
 	}
 }
@@ -336,6 +379,19 @@ void AgentClient::OnReadBody(const boost::system::error_code& ec, size_t size, s
 			return;
 		}
 
+		// Newer agents can receive larger file parts, and say how large,
+		// followed by the capabilities of even newer ones
+		max_part_size_ = AgentProtocol::kBodySize;
+		agent_inflates_ = false;
+		if(read_buf_ + packet_size_ - p >= static_cast<ptrdiff_t>(sizeof(uint16_t))) {
+			uint16_t max_part_size = AgentProtocol::ReadUint16(&p);
+			if(max_part_size)
+				max_part_size_ = max_part_size;
+
+			if(read_buf_ + packet_size_ - p >= static_cast<ptrdiff_t>(sizeof(uint8_t)))
+				agent_inflates_ = AgentProtocol::ReadUint8(&p) & AgentProtocol::kCapDeflate;
+		}
+
 		// There should not be any data left over
 		if(p != read_buf_ + packet_size_) {
 			DisconnectSocket();
@@ -418,20 +474,131 @@ void AgentClient::OnWriteAgentUpload(const boost::system::error_code& ec, size_t
 }
 
 void AgentClient::WriteFileBytes(std::shared_ptr<SocketCtx>& ctx) {
-	// Write opcode
-	uint8_t* write = write_buf_ + sizeof(uint16_t);
-	AgentProtocol::WriteUint8(AgentProtocol::ServerOpcode::kFileDlPart, &write);
-	// Write file bytes
-	std::fstream& stream = file_upload_info_->file_stream;
-	stream.seekg(0);
-	stream.read(reinterpret_cast<char*>(write), AgentProtocol::kBufferSize - (write - write_buf_));
-	uint16_t read = stream.gcount();
-	// Write packet size
-	AgentProtocol::WriteUint16(read, write_buf_);
-
-	DoWrite(write_buf_, AgentProtocol::kHeaderSize + read,
-			std::bind(&AgentClient::OnWriteFileUpload, shared_from_this(),
-					  std::placeholders::_1, std::placeholders::_2, ctx));
+	if(!upload_buffer_)
+		upload_buffer_.reset(new uint8_t[AgentProtocol::kUploadBufferSize]);
+
+	// Every file starts a new deflate stream, which is kept until the sample is judged
+	deflating_ = false;
+	deflate_flush_pending_ = false;
+	if(agent_inflates_ && max_part_size_ >= kMinDeflatePart) {
+		if(!deflate_init_) {
+			deflate_stream_ = {};
+			deflate_init_ = deflateInit2(&deflate_stream_, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+			deflate_input_.reset(new uint8_t[AgentProtocol::kDeflateInputSize]);
+		} else {
+			deflateReset(&deflate_stream_);
+		}
+		deflating_ = deflate_init_;
+	}
+
+	// A spooled file is read into a ring of its own, so it's sent the same way
+	upload_pipe_ = file_upload_info_->pipe;
+	if(!upload_pipe_) {
+		upload_pipe_ = std::make_shared<UploadPipe>(kReadAheadSize);
+		ReadAhead(file_upload_info_->file, upload_pipe_, 0);
+	}
+	WritePipeBytes(ctx);
+}
+
+void AgentClient::WritePipeBytes(std::shared_ptr<SocketCtx>& ctx) {
+	UploadPipe& pipe = *upload_pipe_;
+	for(;;) {
+		size_t size = FillUploadBuffer(upload_buffer_.get());
+		if(size) {
+			DoWrite(upload_buffer_.get(), size,
+					std::bind(&AgentClient::OnWriteFileUpload, shared_from_this(),
+							  std::placeholders::_1, std::placeholders::_2, ctx));
+			return;
+		}
+
+		switch(pipe.GetState()) {
+			case UploadPipe::State::kFinished:
+				EndFileUpload(ctx);
+				return;
+			case UploadPipe::State::kFailed:
+				// The agent can't be told to abandon the file it has started
+				DisconnectSocket();
+				return;
+			default:
+				break;
+		}
+
+		// Bytes may have arrived since the ring was found empty, in which case it's read again
+		auto self = shared_from_this();
+		auto resume = [this, self, ctx]() {
+			GetService().post([this, self, ctx]() mutable {
+				if(!ctx->IsStopped())
+					WritePipeBytes(ctx);
+			});
+		};
+		if(pipe.WaitReadable(std::move(resume)))
+			return;
+	}
+}
+
+size_t AgentClient::FillUploadBuffer(uint8_t* buffer) {
+	if(deflating_)
+		return FillDeflateBuffer(buffer);
+
+	uint8_t* p = buffer;
+	uint8_t* end = buffer + AgentProtocol::kUploadBufferSize;
+	while(end - p > AgentProtocol::kHeaderSize) {
+		size_t part_size = std::min<size_t>(max_part_size_, end - p - AgentProtocol::kHeaderSize);
+		uint16_t read = ReadUploadBytes(reinterpret_cast<char*>(p + AgentProtocol::kHeaderSize), part_size);
+		if(!read)
+			break;
+
+		// Write packet size and opcode
+		AgentProtocol::WriteUint16(read, &p);
+		AgentProtocol::WriteUint8(AgentProtocol::ServerOpcode::kFileDlPart, &p);
+		p += read;
+	}
+	return p - buffer;
+}
+
+size_t AgentClient::FillDeflateBuffer(uint8_t* buffer) {
+	z_stream& stream = deflate_stream_;
+	uint8_t* p = buffer;
+	uint8_t* end = buffer + AgentProtocol::kUploadBufferSize;
+	while(end - p >= static_cast<ptrdiff_t>(AgentProtocol::kHeaderSize + kMinDeflatePart)) {
+		if(!deflate_flush_pending_) {
+			// The agent has inflated everything sent so far, so the rest of
+			// a file that didn't compress well can be sent as it is
+			if(stream.total_in >= AgentProtocol::kDeflateSampleSize) {
+				if(stream.total_out > stream.total_in - stream.total_in / 8) {
+					deflating_ = false;
+					break;
+				}
+			}
+
+			size_t read = ReadUploadBytes(reinterpret_cast<char*>(deflate_input_.get()), AgentProtocol::kDeflateInputSize);
+			if(!read)
+				break;
+			stream.next_in = deflate_input_.get();
+			stream.avail_in = read;
+			deflate_flush_pending_ = true;
+		}
+
+		// Each read is flushed, so the agent never waits on bytes that are held back
+		size_t part_size = std::min<size_t>(max_part_size_, end - p - AgentProtocol::kHeaderSize);
+		stream.next_out = p + AgentProtocol::kHeaderSize;
+		stream.avail_out = part_size;
+		deflate(&stream, Z_SYNC_FLUSH);
+		uint16_t written = part_size - stream.avail_out;
+		if(stream.avail_out && !stream.avail_in)
+			deflate_flush_pending_ = false;
+		if(!written)
+			continue;
+
+		AgentProtocol::WriteUint16(written, &p);
+		AgentProtocol::WriteUint8(AgentProtocol::ServerOpcode::kFileDlPartDeflate, &p);
+		p += written;
+	}
+	return p - buffer;
+}
+
+size_t AgentClient::ReadUploadBytes(char* data, size_t size) {
+	return upload_pipe_->Read(data, size);
 }
 
 void AgentClient::OnWriteFileUpload(const boost::system::error_code& ec, size_t size, std::shared_ptr<SocketCtx> ctx) {
@@ -443,27 +610,13 @@ void AgentClient::OnWriteFileUpload(const boost::system::error_code& ec, size_t
 		return;
 	}
 
-	std::fstream& stream = file_upload_info_->file_stream;
-	if(stream) {
-		// Write opcode
-		uint8_t* p = write_buf_ + sizeof(uint16_t);
-		AgentProtocol::WriteUint8(AgentProtocol::ServerOpcode::kFileDlPart, &p);
-		// Write file bytes
-		stream.read(reinterpret_cast<char*>(p), AgentProtocol::kBufferSize - (p - write_buf_));
-		uint16_t read = stream.gcount();
-
-		if(read) {
-			// Write packet size
-			AgentProtocol::WriteUint16(read, write_buf_);
-
-			DoWrite(write_buf_, AgentProtocol::kHeaderSize + read,
-					std::bind(&AgentClient::OnWriteFileUpload, shared_from_this(),
-							  std::placeholders::_1, std::placeholders::_2, ctx));
-			return;
-		}
-	}
+	// Only one buffer is needed, since reading the ring doesn't block
+	WritePipeBytes(ctx);
+}
 
-	stream.close();
+void AgentClient::EndFileUpload(std::shared_ptr<SocketCtx>& ctx) {
+	file_upload_info_->file.reset();
+	upload_pipe_.reset();
 
 	if(file_upload_info_->run_file) {
 		file_upload_state_ = UploadState::kExecFile;
@@ -6,6 +6,7 @@
 #include <boost/asio.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/system/error_code.hpp>
+#include <zlib.h>
 
 #include "Sockets/TCPSocketClient.h"
 #include "Sockets/LocalSocketClient.h"
@@ -114,6 +115,40 @@ class AgentClient : public std::enable_shared_from_this<AgentClient> {
 	void OnHeartbeatTimeout(const boost::system::error_code& ec);
 
 	void WriteFileBytes(std::shared_ptr<SocketCtx>& ctx);
+
+	/**
+	 * Sends what has been put in upload_pipe_, or waits for more. Each
+	 * write is followed by another call.
+	 */
+	void WritePipeBytes(std::shared_ptr<SocketCtx>& ctx);
+
+	/**
+	 * Tells the agent that the whole file was sent, and to run it if the user asked to.
+	 */
+	void EndFileUpload(std::shared_ptr<SocketCtx>& ctx);
+
+	/**
+	 * Reads the next part of the file being uploaded straight into one of
+	 * the upload buffers, as kFileDlPart packets of up to max_part_size_.
+	 *
+	 * @return The number of bytes in the buffer, which is 0 after the
+	 *         end of the file.
+	 */
+	size_t FillUploadBuffer(uint8_t* buffer);
+
+	/**
+	 * Fills an upload buffer with kFileDlPartDeflate packets instead, and
+	 * stops compressing the file if the sample didn't shrink enough.
+	 */
+	size_t FillDeflateBuffer(uint8_t* buffer);
+
+	/**
+	 * Reads the next bytes of the file being uploaded from upload_pipe_.
+	 *
+	 * @return The number of bytes read, which is 0 at the end of the file
+	 *         or when the pipe is empty.
+	 */
+	size_t ReadUploadBytes(char* data, size_t size);
 	std::string ReadStringU16(uint8_t** p, uint8_t* end, bool& valid);
 
 	//void UploadFile(const std::string& filename, bool exec, const std::string& args, bool hide_window);
@@ -138,6 +173,44 @@ class AgentClient : public std::enable_shared_from_this<AgentClient> {
 	bool connect_received_;
 	uint32_t max_path_component_;
 
+	/**
+	 * The largest kFileDlPart packet body the agent can receive. Agents
+	 * that don't send it in their connect packet get kBodySize.
+	 */
+	uint16_t max_part_size_ = AgentProtocol::kBodySize;
+
+	/**
+	 * Whether the agent sent AgentProtocol::kCapDeflate.
+	 */
+	bool agent_inflates_ = false;
+
+	/**
+	 * Compresses the current upload while deflating_ is set. It's created
+	 * for the first file that's compressed and reset for each one after.
+	 */
+	z_stream deflate_stream_;
+	bool deflate_init_ = false;
+	bool deflating_ = false;
+
+	/**
+	 * Set while the input in deflate_input_ hasn't been fully flushed to packets.
+	 */
+	bool deflate_flush_pending_ = false;
+	std::unique_ptr<uint8_t[]> deflate_input_;
+
+	/**
+	 * The packets being written to the agent. It's allocated when the
+	 * first file is uploaded.
+	 */
+	std::unique_ptr<uint8_t[]> upload_buffer_;
+
+	/**
+	 * The ring the current upload is read from. It's the HTTP request's
+	 * for a piped upload, while a spooled file is read into one ahead of
+	 * the agent by FileIO.
+	 */
+	std::shared_ptr<UploadPipe> upload_pipe_;
+
 	//struct FileUploadInfo
 	//{
 	//	enum class UploadState
@@ -1,4 +1,6 @@
 #include "QMPClient.h"
+#include "Logger.h"
+#include "Tracepoints.h"
 
 #include <iostream>
 #include <boost/asio.hpp>
@@ -39,6 +41,10 @@ void QMPClient::OnDisconnect() {
 		boost::system::error_code error;
 		timer_.cancel(error);
 
+		// Responses to the commands that were sent will never arrive
+		write_queue_.clear();
+		result_callbacks_.clear();
+
 		if(auto ptr = controller_.lock())
 			ptr->OnQMPStateChange(QMPState::kDisconnected);
 	}
@@ -69,72 +75,89 @@ void QMPClient::RegisterEventCallback(Events event, EventCallback callback) {
 	});
 }
 
-void QMPClient::SendString(const std::string& str) {
+void QMPClient::Execute(Command command) {
+	std::vector<Command> commands;
+	commands.push_back(std::move(command));
+	ExecuteBatch(std::move(commands));
+}
+
+void QMPClient::ExecuteBatch(std::vector<Command> commands) {
 	auto self = shared_from_this();
-	GetService().dispatch([this, self, str]() {
+	GetService().dispatch([this, self, commands = std::move(commands)]() mutable {
 		if(state_ != ConnectionState::kConnected)
 			return;
+		// Use macro to provide the string length to
+		// the function so it doesn't need to use strlen
+#define STRING(str) writer.String(str, sizeof(str) - 1)
 
-		DoWriteData(str.c_str(), str.length(), GetSocketContext());
+		StringBuffer s;
+		for(Command& command : commands) {
+			Writer<StringBuffer> writer(s);
+			writer.StartObject();
+			STRING("execute");
+			writer.String_bs(command.name);
+			if(command.arguments) {
+				STRING("arguments");
+				writer.StartObject();
+				command.arguments(writer);
+				writer.EndObject();
+			}
+			// If a callback was provided, assign an ID to the command
+			if(command.result_cb) {
+				STRING("id");
+				writer.Uint(result_id_);
+
+				result_callbacks_[result_id_] = { std::move(command.result_cb), time_clock::now() };
+				// Increment the ID and allow it to overflow
+				// Overflowing should be fine as long as there are
+				// no more than 2^16 callbacks already in the map
+				result_id_++;
+			}
+			writer.EndObject();
+			s.Put('\r');
+			s.Put('\n');
+		}
+#undef STRING
+
+		QueueWrite(std::string(s.GetString(), s.GetSize()));
 	});
 }
 
+QMPClient::Command QMPClient::MonitorCommand(const std::string& cmd, ResultCallback result_cb) {
+	return { "human-monitor-command", std::move(result_cb), [cmd](ArgumentWriter& writer) {
+				writer.String("command-line", sizeof("command-line") - 1);
+				writer.String_bs(cmd);
+			} };
+}
+
+void QMPClient::QueueWrite(std::string data) {
+	write_queue_.push_back(std::move(data));
+	if(write_queue_.size() == 1)
+		DoWriteData(write_queue_.front().data(), write_queue_.front().size(), GetSocketContext());
+}
+
 void QMPClient::SystemPowerDown() {
-	SendString("{\"execute\":\"system_powerdown\"}\r\n");
+	Execute({ "system_powerdown" });
 }
 
 void QMPClient::SystemReset() {
-	SendString("{\"execute\":\"system_reset\"}\r\n");
+	Execute({ "system_reset" });
 }
 
 void QMPClient::SystemStop() {
-	SendString("{\"execute\":\"stop\"}\r\n");
+	Execute({ "stop" });
 }
 
 void QMPClient::SystemResume() {
-	SendString("{\"execute\":\"cont\"}\r\n");
+	Execute({ "cont" });
 }
 
 void QMPClient::QEMUQuit() {
-	SendString("{\"execute\":\"quit\"}\r\n");
+	Execute({ "quit" });
 }
 
 void QMPClient::SendMonitorCommand(const std::string& cmd, ResultCallback result_cb) {
-	auto self = shared_from_this();
-	GetService().dispatch([this, self, cmd, result_cb]() {
-		if(state_ != ConnectionState::kConnected)
-			return;
-			// Use macro to provide the string length to
-			// the function so it doesn't need to use strlen
-#define STRING(str) writer.String(str, sizeof(str) - 1)
-
-		StringBuffer s;
-		Writer<StringBuffer> writer(s);
-		writer.StartObject();
-		STRING("execute");
-		STRING("human-monitor-command");
-		STRING("arguments");
-		writer.StartObject();
-		STRING("command-line");
-		writer.String_bs(cmd);
-		writer.EndObject();
-		// If a callback was provided, assign an ID to the command
-		if(result_cb) {
-			STRING("id");
-			writer.Uint(result_id_);
-			writer.EndObject();
-
-			result_callbacks_[result_id_] = result_cb;
-			// Increment the ID and allow it to overflow
-			// Overflowing should be fine as long as there are
-			// no more than 2^16 callbacks already in the map
-			result_id_++;
-		} else {
-			writer.EndObject();
-		}
-
-		DoWriteData(s.GetString(), s.GetSize(), GetSocketContext());
-	});
+	Execute(MonitorCommand(cmd, std::move(result_cb)));
 }
 
 void QMPClient::LoadSnapshot(const std::string& snapshot, ResultCallback result_cb) {
@@ -145,8 +168,9 @@ void QMPClient::OnReadLine(const boost::system::error_code& ec, size_t size, std
 	if(ctx->IsStopped())
 		return;
 
+	COLLABVM_PROBE(qmp_read, size);
 	if(ec) {
-		std::cout << "QMP read error: " << ec.message() << std::endl;
+		Logger::Error() << "QMP read error: " << ec.message();
 		DisconnectSocket();
 		return;
 	}
@@ -154,14 +178,14 @@ void QMPClient::OnReadLine(const boost::system::error_code& ec, size_t size, std
 	// Copy the data from the streambuf into a string
 	if(size > 2) {
 		// Copy the data to a writable buffer
-		char* buf = new char[size - 1];
 		// Subtract two from the length to exclude the "\r\n"
-		std::memcpy(buf, boost::asio::buffer_cast<const char*>(buf_.data()), size - 2);
+		const char* data = boost::asio::buffer_cast<const char*>(buf_.data());
+		line_.assign(data, data + size - 2);
 		// Null terminate the buffer
-		buf[size - 2] = '\0';
-		// Parse it as JSON
-		Document d;
-		d.ParseInsitu(buf);
+		line_.push_back('\0');
+		// Parse it as JSON, with the values allocated from parse_buffer_
+		Document d(&parse_allocator_);
+		d.ParseInsitu(line_.data());
 		Value::MemberIterator e;
 		switch(state_) {
 			case ConnectionState::kCapabilities: {
@@ -194,7 +218,7 @@ void QMPClient::OnReadLine(const boost::system::error_code& ec, size_t size, std
 					DoWriteData(cmd, sizeof(cmd) - 1, ctx);
 				} else {
 					// Unexpected first command
-					std::cout << "QMP invalid capabilities command: " << std::string(boost::asio::buffer_cast<const char*>(buf_.data()), size - 2) << std::endl;
+					Logger::Error() << "QMP invalid capabilities command: " << std::string(boost::asio::buffer_cast<const char*>(buf_.data()), size - 2);
 					DisconnectSocket();
 				}
 				break;
@@ -208,7 +232,7 @@ void QMPClient::OnReadLine(const boost::system::error_code& ec, size_t size, std
 				e = d.FindMember("return");
 				if(e != d.MemberEnd() && e->value.IsObject()) {
 					state_ = ConnectionState::kConnected;
-					std::cout << "Connected to QEMU" << std::endl;
+					Logger::Info() << "Connected to QEMU";
 
 					if(auto ptr = controller_.lock())
 						ptr->OnQMPStateChange(QMPState::kConnected);
@@ -217,7 +241,7 @@ void QMPClient::OnReadLine(const boost::system::error_code& ec, size_t size, std
 					DoReadLine(ctx);
 				} else {
 					// Unexpected response
-					std::cout << "QMP invalid handshake response: " << std::string(boost::asio::buffer_cast<const char*>(buf_.data()), size - 2) << std::endl;
+					Logger::Error() << "QMP invalid handshake response: " << std::string(boost::asio::buffer_cast<const char*>(buf_.data()), size - 2);
 					DisconnectSocket();
 				}
 				break;
@@ -233,13 +257,17 @@ void QMPClient::OnReadLine(const boost::system::error_code& ec, size_t size, std
 							break;
 						}
 					}
-				} else if((e = d.FindMember("return")) != d.MemberEnd()) {
+				} else if(d.HasMember("return") || d.HasMember("error")) {
 					Value::MemberIterator v = d.FindMember("id");
 					if(v != d.MemberEnd() && v->value.IsUint()) {
 						auto it = result_callbacks_.find(v->value.GetUint());
 						if(it != result_callbacks_.end()) {
-							it->second(d);
+							// The callback could send another command or disconnect
+							ResultCallback result_cb = std::move(it->second.callback);
+							if(round_trip_metric_)
+								round_trip_metric_->Observe(time_clock::now() - it->second.sent);
 							result_callbacks_.erase(it);
+							result_cb(d);
 						}
 					}
 				}
@@ -247,7 +275,7 @@ void QMPClient::OnReadLine(const boost::system::error_code& ec, size_t size, std
 				DoReadLine(ctx);
 				break;
 		}
-		delete[] buf;
+		parse_allocator_.Clear();
 	}
 }
 
@@ -256,9 +284,13 @@ void QMPClient::OnWrite(const boost::system::error_code& ec, size_t size, std::s
 		return;
 
 	if(ec) {
-		std::cout << "QMP write error: " << ec.message() << std::endl;
+		Logger::Error() << "QMP write error: " << ec.message();
 		DisconnectSocket();
 	} else if(state_ == ConnectionState::kResponse) {
 		DoReadLine(ctx);
+	} else if(state_ == ConnectionState::kConnected && !write_queue_.empty()) {
+		write_queue_.pop_front();
+		if(!write_queue_.empty())
+			DoWriteData(write_queue_.front().data(), write_queue_.front().size(), ctx);
 	}
 }
@@ -2,15 +2,21 @@
 #include <stdint.h>
 #include <string>
 #include <functional>
+#include <memory>
 #include <map>
 #include <chrono>
+#include <deque>
+#include <vector>
 
+#include "Metrics.h"
 #include "Sockets/TCPSocketClient.h"
 #include "Sockets/LocalSocketClient.h"
 #include <boost/asio.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/system/error_code.hpp>
 #include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
 
 class QMPCallback;
 /**
@@ -21,11 +27,14 @@ class QMPClient : public std::enable_shared_from_this<QMPClient> {
    public:
 	QMPClient(boost::asio::io_service& service)
 		: timer_(service),
-		  state_(ConnectionState::kDisconnected) {
+		  state_(ConnectionState::kDisconnected),
+		  result_id_(0),
+		  parse_allocator_(parse_buffer_, sizeof(parse_buffer_)) {
 	}
 
 	enum class Events {
 		BLOCK_IO_ERROR,
+		MIGRATION, // Emitted when the status of a migration changes
 		RESET,	// Emitted when the VM is reset
 		RESUME, // Emitted when the VM resumes execution
 		RTC_CHANGE,
@@ -47,6 +56,30 @@ class QMPClient : public std::enable_shared_from_this<QMPClient> {
 	typedef std::function<void(rapidjson::Document&)> EventCallback;
 	typedef std::function<void(bool connected)> ConnectionStateCallback;
 	typedef std::function<void(rapidjson::Document&)> ResultCallback;
+	typedef rapidjson::Writer<rapidjson::StringBuffer> ArgumentWriter;
+
+	/**
+	 * A QMP command to execute.
+	 */
+	struct Command {
+		/**
+		 * The name of the command, such as "query-status".
+		 */
+		std::string name;
+
+		/**
+		 * Called with the response to the command, which has either a
+		 * "return" or an "error" member. No ID is sent with commands
+		 * that don't have a callback, so their responses are ignored.
+		 */
+		ResultCallback result_cb;
+
+		/**
+		 * Writes the members of the command's arguments object,
+		 * or null if it doesn't have any arguments.
+		 */
+		std::function<void(ArgumentWriter&)> arguments;
+	};
 
 	/**
 	 * Attempts to connect to QEMU.
@@ -94,9 +127,36 @@ class QMPClient : public std::enable_shared_from_this<QMPClient> {
 	 */
 	void QEMUQuit();
 
+	/**
+	 * Sends a command to QEMU without waiting for the responses to
+	 * the commands that were sent before it.
+	 */
+	void Execute(Command command);
+
+	/**
+	 * Sends several commands in a single write. QEMU runs them in order,
+	 * so a command that depends on the ones before it doesn't have to wait
+	 * for their responses, and a set of query-* commands takes one round trip.
+	 */
+	void ExecuteBatch(std::vector<Command> commands);
+
+	/**
+	 * Gets the command that runs a human monitor command line.
+	 * Its result is a string, which is empty unless there was an error.
+	 */
+	static Command MonitorCommand(const std::string& cmd, ResultCallback result_cb);
+
 	void LoadSnapshot(const std::string& snapshot, ResultCallback result_cb);
 	void SendMonitorCommand(const std::string& cmd, ResultCallback result_cb);
 
+	/**
+	 * Sets the histogram that the time between sending a command with a
+	 * callback and receiving its response is counted in, or null.
+	 */
+	void SetRoundTripMetric(std::shared_ptr<MetricHistogram> metric) {
+		round_trip_metric_ = std::move(metric);
+	}
+
 	/**
 	 * Whether the client is connected and the handshake is complete.
 	 */
@@ -136,7 +196,11 @@ class QMPClient : public std::enable_shared_from_this<QMPClient> {
 	typedef std::chrono::steady_clock time_clock;
 #endif
 
-	void SendString(const std::string& str);
+	/**
+	 * Writes data once the writes before it have completed, so that
+	 * the buffers of each write stay alive until it's finished.
+	 */
+	void QueueWrite(std::string data);
 	void OnReadLine(const boost::system::error_code& ec, size_t size, std::shared_ptr<SocketCtx>& ctx);
 	void OnWrite(const boost::system::error_code& ec, size_t size, std::shared_ptr<SocketCtx> ctx);
 	void StartTimeoutTimer();
@@ -155,8 +219,9 @@ class QMPClient : public std::enable_shared_from_this<QMPClient> {
 
 	ConnectionState state_;
 
-	const std::string events_[10] = {
+	const std::string events_[11] = {
 		"BLOCK_IO_ERROR",
+		"MIGRATION",
 		"RESET",
 		"RESUME",
 		"RTC_CHANGE",
@@ -168,10 +233,33 @@ class QMPClient : public std::enable_shared_from_this<QMPClient> {
 		"WATCHDOG"
 	};
 
-	EventCallback event_callbacks_[10];
+	EventCallback event_callbacks_[11];
+
+	/**
+	 * A command that is waiting for its response.
+	 */
+	struct PendingResult {
+		ResultCallback callback;
+		time_clock::time_point sent;
+	};
 
-	std::map<uint16_t, ResultCallback> result_callbacks_;
+	std::map<uint16_t, PendingResult> result_callbacks_;
 	uint16_t result_id_;
+	std::shared_ptr<MetricHistogram> round_trip_metric_;
+
+	/**
+	 * Commands that are waiting to be written, the first of which is
+	 * being written.
+	 */
+	std::deque<std::string> write_queue_;
+
+	/**
+	 * The line being parsed. It's reused for every line so that
+	 * parsing a response doesn't need any allocations.
+	 */
+	std::vector<char> line_;
+	char parse_buffer_[4096];
+	rapidjson::MemoryPoolAllocator<> parse_allocator_;
 
 	const std::chrono::seconds kReadTimeout = std::chrono::seconds(3);
 };
@@ -1,7 +1,7 @@
 #pragma once
 #include "Sockets/SocketClient.h"
+#include "Logger.h"
 #include <functional>
-#include <iostream>
 #include <boost/asio.hpp>
 #include <boost/asio/steady_timer.hpp>
 
@@ -52,7 +52,7 @@ class TCPSocketClient : public SocketClient<Base, boost::asio::ip::tcp::socket>
 		if(!ec) {
 			StartConnection(iterator, ctx);
 		} else {
-			std::cout << "TCPSocketClient OnResolve error: " << ec.message() << std::endl;
+			Logger::Error() << "TCPSocketClient OnResolve error: " << ec.message();
 			SC::DisconnectSocket();
 		}
 	}
@@ -62,7 +62,7 @@ class TCPSocketClient : public SocketClient<Base, boost::asio::ip::tcp::socket>
 			return;
 
 		if(endpoint_iter != boost::asio::ip::tcp::resolver::iterator()) {
-			std::cout << "Trying " << endpoint_iter->endpoint() << "...\n";
+			Logger::Info() << "Trying " << endpoint_iter->endpoint() << "...";
 
 			if(timeout_) {
 				boost::system::error_code ec;
@@ -88,10 +88,10 @@ class TCPSocketClient : public SocketClient<Base, boost::asio::ip::tcp::socket>
 		// If the socket is closed it means that the connection timed-out
 		// and the callback for the timer closed it
 		if(!SC::GetSocket().is_open()) {
-			std::cout << "QMP connection timed out" << std::endl;
+			Logger::Warning() << "QMP connection timed out";
 			StartConnection(++iterator, ctx);
 		} else if(ec) {
-			std::cout << "QMP connection failed: " << ec.message() << std::endl;
+			Logger::Error() << "QMP connection failed: " << ec.message();
 			boost::system::error_code ec;
 			SC::GetSocket().close(ec);
 			StartConnection(++iterator, ctx);
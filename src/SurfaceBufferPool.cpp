@@ -0,0 +1,98 @@
+#include "SurfaceBufferPool.h"
+#include <cstring>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+#endif
+
+/**
+ * The size of a page, and of a transparent huge page on x86-64. Buffers at
+ * least as large as a huge page are rounded up to a multiple of it, so the
+ * kernel can back all of them with huge pages.
+ */
+#define GUAC_SURFACE_PAGE_SIZE 4096
+#define GUAC_SURFACE_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+SurfaceBufferPool& SurfaceBufferPool::Get() {
+	static SurfaceBufferPool pool;
+	return pool;
+}
+
+SurfaceBufferPool::SurfaceBufferPool()
+	: free_bytes_(0) {
+}
+
+SurfaceBufferPool::~SurfaceBufferPool() {
+	for(auto& entry : free_)
+		Unmap(entry.second, entry.first);
+}
+
+size_t SurfaceBufferPool::GetSizeClass(size_t size) {
+	size_t granularity = size >= GUAC_SURFACE_HUGE_PAGE_SIZE ? GUAC_SURFACE_HUGE_PAGE_SIZE : GUAC_SURFACE_PAGE_SIZE;
+	return (size + granularity - 1) / granularity * granularity;
+}
+
+unsigned char* SurfaceBufferPool::Map(size_t size) {
+#ifdef _WIN32
+	return (unsigned char*)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	void* buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(buffer == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	if(size >= GUAC_SURFACE_HUGE_PAGE_SIZE)
+		madvise(buffer, size, MADV_HUGEPAGE);
+#endif
+	return (unsigned char*)buffer;
+#endif
+}
+
+void SurfaceBufferPool::Unmap(unsigned char* buffer, size_t size) {
+#ifdef _WIN32
+	VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+	munmap(buffer, size);
+#endif
+}
+
+unsigned char* SurfaceBufferPool::Allocate(size_t size, bool clear) {
+	size = GetSizeClass(size);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	auto it = free_.find(size);
+	if(it == free_.end()) {
+		lock.unlock();
+
+		// Freshly mapped memory is already zeroed
+		return Map(size);
+	}
+
+	unsigned char* buffer = it->second;
+	free_.erase(it);
+	free_bytes_ -= size;
+	lock.unlock();
+
+	if(clear)
+		memset(buffer, 0, size);
+	return buffer;
+}
+
+void SurfaceBufferPool::Free(unsigned char* buffer, size_t size) {
+	if(buffer == NULL)
+		return;
+
+	size = GetSizeClass(size);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	if(free_bytes_ + size <= kMaxFreeBytes) {
+		free_.emplace(size, buffer);
+		free_bytes_ += size;
+		return;
+	}
+	lock.unlock();
+
+	Unmap(buffer, size);
+}
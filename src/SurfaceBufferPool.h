@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <map>
+#include <mutex>
+
+/**
+ * A pool of page-aligned pixel buffers for surfaces, shared by every
+ * GuacClient on the server. Buffers are rounded up to size classes and kept
+ * when freed, so that reconnecting to a VM or changing its resolution reuses
+ * memory instead of allocating another framebuffer-sized block, which would
+ * fragment the heap over a long uptime.
+ *
+ * Buffers are mapped directly from the OS rather than the heap, and large
+ * ones are backed by transparent huge pages where they're available.
+ */
+class SurfaceBufferPool {
+   public:
+	/**
+	 * Get the pool shared by all of the clients.
+	 */
+	static SurfaceBufferPool& Get();
+
+	SurfaceBufferPool();
+	~SurfaceBufferPool();
+
+	/**
+	 * Gets a buffer of at least size bytes, which is zeroed if clear is true.
+	 * Returns NULL if the memory couldn't be mapped.
+	 */
+	unsigned char* Allocate(size_t size, bool clear = true);
+
+	/**
+	 * Returns a buffer from Allocate() to the pool, with the size it was
+	 * allocated with. It's unmapped if the pool is full. NULL is ignored.
+	 */
+	void Free(unsigned char* buffer, size_t size);
+
+   private:
+	/**
+	 * Rounds a size up to its size class, which is a multiple of the page
+	 * size, or of the huge page size for large buffers.
+	 */
+	static size_t GetSizeClass(size_t size);
+
+	static unsigned char* Map(size_t size);
+	static void Unmap(unsigned char* buffer, size_t size);
+
+	/**
+	 * The most bytes of free buffers kept for reuse.
+	 */
+	constexpr static size_t kMaxFreeBytes = 128 * 1024 * 1024;
+
+	/**
+	 * Free buffers by size class. Guarded by mutex_, along with free_bytes_.
+	 */
+	std::multimap<size_t, unsigned char*> free_;
+	size_t free_bytes_;
+	std::mutex mutex_;
+};
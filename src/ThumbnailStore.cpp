@@ -0,0 +1,104 @@
+#include "ThumbnailStore.h"
+#include "VMControllers/VMController.h"
+
+#include <cstdio>
+#include <utility>
+
+#ifndef _WIN32
+	#include <sys/stat.h>
+#endif
+
+/**
+ * Thumbnails are a few kilobytes, so anything bigger isn't one.
+ */
+constexpr static long kMaxThumbnailSize = 4 * 1024 * 1024;
+
+ThumbnailStore::ThumbnailStore(std::string directory)
+	: directory_(std::move(directory)),
+	  stopping_(false) {
+#ifndef _WIN32
+	::mkdir(directory_.c_str(), 0755);
+#endif
+	thread_ = std::thread(&ThumbnailStore::Run, this);
+}
+
+ThumbnailStore::~ThumbnailStore() {
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		stopping_ = true;
+	}
+	wake_.notify_one();
+	thread_.join();
+}
+
+std::string ThumbnailStore::GetPath(const std::string& vm_name) const {
+	return directory_ + vm_name + ".png";
+}
+
+std::shared_ptr<const VMThumbnail> ThumbnailStore::Load(const std::string& vm_name) {
+	// A thumbnail that hasn't been written yet is newer than the file
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		auto it = pending_.find(vm_name);
+		if(it != pending_.end())
+			return it->second;
+	}
+
+	FILE* file = std::fopen(GetPath(vm_name).c_str(), "rb");
+	if(!file)
+		return nullptr;
+
+	std::shared_ptr<VMThumbnail> thumbnail;
+	long size;
+	if(std::fseek(file, 0, SEEK_END) == 0 && (size = std::ftell(file)) > 0 && size <= kMaxThumbnailSize &&
+	   std::fseek(file, 0, SEEK_SET) == 0) {
+		thumbnail = std::make_shared<VMThumbnail>();
+		std::vector<uint8_t>& png = thumbnail->GetImage(VMThumbnail::kDefaultSize, ImageFormat::kPNG);
+		png.resize(size);
+		if(std::fread(png.data(), 1, size, file) != static_cast<size_t>(size))
+			thumbnail = nullptr;
+	}
+	std::fclose(file);
+	return thumbnail;
+}
+
+void ThumbnailStore::Save(const std::string& vm_name, std::shared_ptr<const VMThumbnail> thumbnail) {
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		pending_[vm_name] = std::move(thumbnail);
+	}
+	wake_.notify_one();
+}
+
+void ThumbnailStore::Run() {
+	std::unique_lock<std::mutex> lock(lock_);
+	while(true) {
+		wake_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+		if(pending_.empty())
+			break;
+
+		auto node = pending_.extract(pending_.begin());
+		lock.unlock();
+		Write(node.key(), node.mapped());
+		lock.lock();
+	}
+}
+
+void ThumbnailStore::Write(const std::string& vm_name, const std::shared_ptr<const VMThumbnail>& thumbnail) {
+	std::string path = GetPath(vm_name);
+	if(!thumbnail) {
+		std::remove(path.c_str());
+		return;
+	}
+
+	// The file is replaced in one step, so a crash never leaves half of one
+	std::string temp_path = path + ".tmp";
+	FILE* file = std::fopen(temp_path.c_str(), "wb");
+	if(!file)
+		return;
+	// Only the default image is kept, the others are rendered again once the VM is running
+	const std::vector<uint8_t>& png = thumbnail->GetDefaultImage();
+	bool written = std::fwrite(png.data(), 1, png.size(), file) == png.size();
+	if(std::fclose(file) != 0 || !written || std::rename(temp_path.c_str(), path.c_str()) != 0)
+		std::remove(temp_path.c_str());
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct VMThumbnail;
+
+/**
+ * Keeps the last thumbnail of each VM on disk, so that the VM list has
+ * something to show for a VM as soon as its controller is created after
+ * a restart, instead of waiting for it to boot. Thumbnails are written by
+ * a thread of its own, and only the newest one of a VM that's waiting to
+ * be written is kept, so a slow disk never holds up the processing thread.
+ *
+ * Can be used from any thread.
+ */
+class ThumbnailStore {
+   public:
+	/**
+	 * @param directory The directory the thumbnails are stored in, ending in a slash.
+	 */
+	explicit ThumbnailStore(std::string directory);
+
+	/**
+	 * Writes the thumbnails that are still waiting and stops the writer thread.
+	 */
+	~ThumbnailStore();
+
+	ThumbnailStore(const ThumbnailStore&) = delete;
+	ThumbnailStore& operator=(const ThumbnailStore&) = delete;
+
+	/**
+	 * Reads the stored thumbnail of a VM.
+	 *
+	 * @return The thumbnail, or null if there isn't one.
+	 */
+	std::shared_ptr<const VMThumbnail> Load(const std::string& vm_name);
+
+	/**
+	 * Queues a VM's thumbnail to be written, replacing the one that's
+	 * stored. A null thumbnail deletes it instead.
+	 */
+	void Save(const std::string& vm_name, std::shared_ptr<const VMThumbnail> thumbnail);
+
+   private:
+	void Run();
+
+	void Write(const std::string& vm_name, const std::shared_ptr<const VMThumbnail>& thumbnail);
+
+	std::string GetPath(const std::string& vm_name) const;
+
+	const std::string directory_;
+
+	std::mutex lock_;
+	std::condition_variable wake_;
+
+	/**
+	 * The thumbnails that haven't been written yet, by VM name.
+	 */
+	std::map<std::string, std::shared_ptr<const VMThumbnail>> pending_;
+	bool stopping_;
+
+	std::thread thread_;
+};
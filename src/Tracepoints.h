@@ -0,0 +1,20 @@
+#pragma once
+
+/**
+ * Static tracepoints on the hot paths of the server, which eBPF tools such
+ * as bpftrace and perf can attach to while it's running. They're only
+ * compiled in when building with SDT=1, and then cost a single nop each
+ * until something attaches to them. The arguments are evaluated even when
+ * nothing is attached, so they should be values that are already at hand.
+ *
+ * The probes are in the collabvm provider, so they're named like
+ * usdt:./collab-vm-server:collabvm:encode.
+ */
+#ifdef USE_SDT
+	#include <sys/sdt.h>
+	#define COLLABVM_PROBE(name, ...) STAP_PROBEV(collabvm, name, ##__VA_ARGS__)
+#else
+	#define COLLABVM_PROBE(name, ...) \
+		do {                          \
+		} while(0)
+#endif
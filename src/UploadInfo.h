@@ -1,5 +1,8 @@
 #pragma once
 #include "CollabVMUser.h"
+#include "FileIO.h"
+#include "UploadPipe.h"
+#include "UploadSpool.h"
 #include <boost/asio.hpp>
 #include <boost/asio/steady_timer.hpp>
 
@@ -21,6 +24,7 @@ struct UploadInfo {
 		  ip_data(user->ip_data),
 		  http_state(HttpUploadState::kNotStarted),
 		  canceled(false),
+		  agent_started(false),
 		  timeout_timer(nullptr) {
 	}
 
@@ -37,6 +41,7 @@ struct UploadInfo {
 		  ip_data(ip_data),
 		  http_state(HttpUploadState::kNotStarted),
 		  canceled(false),
+		  agent_started(false),
 		  timeout_timer(nullptr) {
 	}
 #endif
@@ -46,14 +51,26 @@ struct UploadInfo {
 	bool run_file;
 	/**
 	* The path on the host to the temporary file where the upload is
-	* saved to. It is used to open the file_stream.
+	* saved to. It is used to open the file.
 	*/
 	std::string file_path;
 	/**
-	* A file stream used to write the file chunks received from the client
-	* to a temporary file and then read the file to send it to the agent.
+	* The temporary file that the chunks received from the client are
+	* written to, and then the file that's read to send it to the agent.
 	*/
-	std::fstream file_stream;
+	std::shared_ptr<AsyncFile> file;
+	/**
+	* The spooled file the upload was saved as once it was received, which
+	* file is reopened on. The temporary file is gone by then, so
+	* file_path is empty.
+	*/
+	std::shared_ptr<const UploadSpool::File> spool_file;
+	/**
+	* Set instead of file_path when the agent was idle as the upload
+	* started. The body goes straight through it to the agent, and
+	* file is never opened.
+	*/
+	std::shared_ptr<UploadPipe> pipe;
 	/**
 	* The username of the user who uploaded the file. This is stored
 	* here in case the user disconects before the file is executed by the agent.
@@ -86,5 +103,11 @@ struct UploadInfo {
 	 */
 	bool canceled;
 
+	/**
+	 * Set by the processing thread once the agent was told to start a
+	 * piped upload. From then on, the upload is ended by the agent's result.
+	 */
+	bool agent_started;
+
 	boost::asio::steady_timer* timeout_timer;
 };
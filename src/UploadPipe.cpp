@@ -0,0 +1,104 @@
+#include "UploadPipe.h"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+UploadPipe::UploadPipe(size_t capacity)
+	: capacity_(capacity),
+	  buffer_(new char[capacity]),
+	  state_(State::kOpen),
+	  start_(0),
+	  size_(0),
+	  write_wanted_(0) {
+}
+
+UploadPipe::State UploadPipe::GetState() {
+	std::lock_guard<std::mutex> lock(lock_);
+	return state_;
+}
+
+bool UploadPipe::Write(const char* data, size_t size) {
+	std::function<void()> resume;
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		if(state_ != State::kOpen || size > capacity_ - size_)
+			return false;
+
+		// The free space may wrap around the end of the ring
+		size_t end = (start_ + size_) % capacity_;
+		size_t first = std::min(size, capacity_ - end);
+		std::memcpy(buffer_.get() + end, data, first);
+		std::memcpy(buffer_.get(), data + first, size - first);
+		size_ += size;
+		resume = std::move(read_resume_);
+		read_resume_ = nullptr;
+	}
+	if(resume)
+		resume();
+	return true;
+}
+
+size_t UploadPipe::Read(char* data, size_t size) {
+	std::function<void()> resume;
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		size = std::min(size, size_);
+		size_t first = std::min(size, capacity_ - start_);
+		std::memcpy(data, buffer_.get() + start_, first);
+		std::memcpy(data + first, buffer_.get(), size - first);
+		start_ = (start_ + size) % capacity_;
+		size_ -= size;
+		if(write_resume_ && capacity_ - size_ >= write_wanted_) {
+			resume = std::move(write_resume_);
+			write_resume_ = nullptr;
+		}
+	}
+	if(resume)
+		resume();
+	return size;
+}
+
+bool UploadPipe::WaitWritable(size_t size, std::function<void()> resume) {
+	std::lock_guard<std::mutex> lock(lock_);
+	if(state_ != State::kOpen || capacity_ - size_ >= size)
+		return false;
+	write_wanted_ = std::min(size, capacity_);
+	write_resume_ = std::move(resume);
+	return true;
+}
+
+bool UploadPipe::WaitReadable(std::function<void()> resume) {
+	std::lock_guard<std::mutex> lock(lock_);
+	if(state_ != State::kOpen || size_)
+		return false;
+	read_resume_ = std::move(resume);
+	return true;
+}
+
+void UploadPipe::Finish() {
+	Close(State::kFinished);
+}
+
+void UploadPipe::Fail() {
+	Close(State::kFailed);
+}
+
+void UploadPipe::Close(State state) {
+	std::function<void()> write_resume, read_resume;
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		if(state_ != State::kOpen)
+			return;
+		state_ = state;
+		if(state == State::kFailed)
+			size_ = 0;
+		write_resume = std::move(write_resume_);
+		read_resume = std::move(read_resume_);
+		write_resume_ = nullptr;
+		read_resume_ = nullptr;
+	}
+	if(write_resume)
+		write_resume();
+	if(read_resume)
+		read_resume();
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+/**
+ * A bounded ring of bytes that an upload's HTTP body is written to while
+ * the agent client reads it, so an upload to an idle agent never touches
+ * the disk. Neither side blocks: a side that can't make progress leaves a
+ * callback that the other side calls once it can. Callbacks are called
+ * without the lock held, on whichever thread made room or added bytes, so
+ * they should only post work to their own thread.
+ *
+ * Can be used from any thread.
+ */
+class UploadPipe {
+   public:
+	enum class State {
+		kOpen,
+		kFinished, // The whole body was written
+		kFailed	   // Either side gave up
+	};
+
+	explicit UploadPipe(size_t capacity);
+
+	UploadPipe(const UploadPipe&) = delete;
+	UploadPipe& operator=(const UploadPipe&) = delete;
+
+	inline size_t Capacity() const {
+		return capacity_;
+	}
+
+	State GetState();
+
+	/**
+	 * Appends bytes to the ring. The writer has to wait until WaitWritable()
+	 * says there's room for them first.
+	 *
+	 * @return false if the pipe has failed or there wasn't room.
+	 */
+	bool Write(const char* data, size_t size);
+
+	/**
+	 * Takes up to size bytes from the ring.
+	 *
+	 * @return The number of bytes taken, which is 0 when the ring is empty.
+	 */
+	size_t Read(char* data, size_t size);
+
+	/**
+	 * @return true if the writer has to wait for room for size bytes, in
+	 *         which case resume is called once there is. false if they
+	 *         can be written now, or the pipe isn't open anymore.
+	 */
+	bool WaitWritable(size_t size, std::function<void()> resume);
+
+	/**
+	 * @return true if the reader has to wait for bytes, in which case
+	 *         resume is called once there are some or the pipe is closed.
+	 */
+	bool WaitReadable(std::function<void()> resume);
+
+	/**
+	 * Called by the writer after the last byte of the body.
+	 */
+	void Finish();
+
+	/**
+	 * Stops both sides. Bytes that are still in the ring are discarded.
+	 */
+	void Fail();
+
+   private:
+	void Close(State state);
+
+	const size_t capacity_;
+	const std::unique_ptr<char[]> buffer_;
+
+	std::mutex lock_;
+	State state_;
+
+	/**
+	 * The offset of the first byte in the ring, and the number of bytes.
+	 */
+	size_t start_;
+	size_t size_;
+
+	/**
+	 * The room the waiting writer needs, and the callbacks of the sides that are waiting.
+	 */
+	size_t write_wanted_;
+	std::function<void()> write_resume_;
+	std::function<void()> read_resume_;
+};
@@ -0,0 +1,104 @@
+#include "UploadSpool.h"
+
+#include <cstdio>
+#include <utility>
+
+UploadSpool::Hasher::Hasher() {
+	boost::beast::detail::init(context_);
+}
+
+void UploadSpool::Hasher::Update(const void* data, size_t size) {
+	boost::beast::detail::update(context_, data, size);
+}
+
+UploadSpool::Digest UploadSpool::Hasher::Finish() {
+	Digest digest;
+	boost::beast::detail::finish(context_, digest.data());
+	return digest;
+}
+
+UploadSpool::UploadSpool(std::string directory, uint64_t capacity)
+	: directory_(std::move(directory)),
+	  capacity_(capacity) {
+}
+
+std::shared_ptr<const UploadSpool::File> UploadSpool::FindBySize(uint64_t size) {
+	std::lock_guard<std::mutex> lock(lock_);
+
+	// Files that are in use were uploaded the most recently
+	for(auto& [hash, entry] : entries_)
+		if(entry.file.size == size && entry.references)
+			return Acquire(entry);
+
+	for(Entry* entry : unused_)
+		if(entry->file.size == size)
+			return Acquire(*entry);
+
+	return nullptr;
+}
+
+std::shared_ptr<const UploadSpool::File> UploadSpool::Add(const std::string& path, uint64_t size, const Digest& hash) {
+	std::lock_guard<std::mutex> lock(lock_);
+	auto it = entries_.find(hash);
+	if(it != entries_.end()) {
+		std::remove(path.c_str());
+		return Acquire(it->second);
+	}
+
+	std::string spool_path = directory_ + ToHex(hash);
+	if(std::rename(path.c_str(), spool_path.c_str()) != 0)
+		return nullptr;
+
+	Entry& entry = entries_[hash];
+	entry.file.path = std::move(spool_path);
+	entry.file.size = size;
+	entry.file.hash = hash;
+	return Acquire(entry);
+}
+
+std::shared_ptr<const UploadSpool::File> UploadSpool::Acquire(Entry& entry) {
+	if(entry.references++ == 0 && entry.unused) {
+		unused_.erase(entry.unused_it);
+		entry.unused = false;
+		unused_bytes_ -= entry.file.size;
+	}
+
+	// The spool is kept alive until every reference is released
+	std::shared_ptr<UploadSpool> self = shared_from_this();
+	return std::shared_ptr<const File>(&entry.file, [self, &entry](const File*) {
+		self->Release(entry);
+	});
+}
+
+void UploadSpool::Release(Entry& entry) {
+	std::lock_guard<std::mutex> lock(lock_);
+	if(--entry.references)
+		return;
+
+	unused_.push_front(&entry);
+	entry.unused_it = unused_.begin();
+	entry.unused = true;
+	unused_bytes_ += entry.file.size;
+	Evict();
+}
+
+void UploadSpool::Evict() {
+	while(unused_bytes_ > capacity_) {
+		Entry* entry = unused_.back();
+		unused_.pop_back();
+		unused_bytes_ -= entry->file.size;
+		std::remove(entry->file.path.c_str());
+		entries_.erase(entry->file.hash);
+	}
+}
+
+std::string UploadSpool::ToHex(const Digest& hash) {
+	static const char kHexDigits[] = "0123456789abcdef";
+	std::string hex;
+	hex.reserve(hash.size() * 2);
+	for(uint8_t byte : hash) {
+		hex += kHexDigits[byte >> 4];
+		hex += kHexDigits[byte & 0xF];
+	}
+	return hex;
+}
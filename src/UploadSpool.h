@@ -0,0 +1,112 @@
+#pragma once
+#include <boost/beast/core/detail/sha1.hpp>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/**
+ * Uploaded files, stored once for each distinct content under the SHA-1 of
+ * their bytes. The same installer uploaded to several VMs is only kept on
+ * disk once, and an upload that matches a spooled file byte for byte is
+ * never written at all.
+ *
+ * Each UploadInfo that uses a file holds a reference to it. Files without
+ * any references are kept so that later uploads can still match them,
+ * until they're evicted to keep the size of those files under the
+ * capacity, least recently used first.
+ */
+class UploadSpool : public std::enable_shared_from_this<UploadSpool> {
+   public:
+	using Digest = std::array<uint8_t, boost::beast::detail::sha1_context::digest_size>;
+
+	struct File {
+		std::string path;
+		uint64_t size;
+		Digest hash;
+	};
+
+	/**
+	 * Computes the hash of an upload as its chunks arrive.
+	 */
+	class Hasher {
+	   public:
+		Hasher();
+		void Update(const void* data, size_t size);
+		Digest Finish();
+
+	   private:
+		boost::beast::detail::sha1_context context_;
+	};
+
+	/**
+	 * @param directory The directory the files are stored in, ending in a slash.
+	 * @param capacity The number of bytes of files without any references
+	 *                 that are kept.
+	 */
+	UploadSpool(std::string directory, uint64_t capacity);
+
+	/**
+	 * Finds the most recently used file of a size, which is the one an
+	 * upload of that size is most likely to be a copy of.
+	 *
+	 * @return A reference to the file, or null if there isn't one.
+	 */
+	std::shared_ptr<const File> FindBySize(uint64_t size);
+
+	/**
+	 * Adds a file that was uploaded to the spool. If a file with the same
+	 * hash is already spooled, the new one is deleted instead.
+	 *
+	 * @param path The file, which is moved into the spool directory.
+	 * @return A reference to the spooled file, or null if it couldn't
+	 *         be moved.
+	 */
+	std::shared_ptr<const File> Add(const std::string& path, uint64_t size, const Digest& hash);
+
+   private:
+	struct Entry {
+		File file;
+		size_t references = 0;
+
+		/**
+		 * Whether the entry is in unused_, and its position there.
+		 */
+		bool unused = false;
+		std::list<Entry*>::iterator unused_it;
+	};
+
+	/**
+	 * Adds a reference to an entry.
+	 * Must be called with lock_ locked.
+	 */
+	std::shared_ptr<const File> Acquire(Entry& entry);
+
+	void Release(Entry& entry);
+
+	/**
+	 * Deletes the least recently used files without any references
+	 * until they fit in the capacity.
+	 * Must be called with lock_ locked.
+	 */
+	void Evict();
+
+	static std::string ToHex(const Digest& hash);
+
+	const std::string directory_;
+	const uint64_t capacity_;
+
+	std::mutex lock_;
+	std::map<Digest, Entry> entries_;
+
+	/**
+	 * The entries without any references, most recently used first.
+	 */
+	std::list<Entry*> unused_;
+	uint64_t unused_bytes_ = 0;
+};
@@ -1,12 +1,22 @@
 #pragma once
 #include <string>
+#include <memory>
 #include <mutex>
+#include <unordered_set>
+#include <vector>
 #include "CollabVMUser.h"
 
 class UserList {
    public:
+	/**
+	 * An immutable copy of the list which can be iterated without
+	 * holding the users lock.
+	 */
+	typedef std::vector<std::shared_ptr<CollabVMUser>> Snapshot;
+
 	UserList()
 		: users_(nullptr),
+		  snapshot_(std::make_shared<const Snapshot>()),
 		  connected_users_(0) {
 	}
 
@@ -24,6 +34,10 @@ class UserList {
 		users_ = &user;
 		connected_users_++;
 
+		std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>(*std::atomic_load(&snapshot_));
+		snapshot->push_back(user.shared_from_this());
+		std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>(std::move(snapshot)));
+
 		func(user);
 	}
 
@@ -31,21 +45,45 @@ class UserList {
 	void RemoveUser(CollabVMUser& user, F func) {
 		std::lock_guard<std::mutex> lock(users_lock_);
 
-		/* Update prev / head */
-		if(user.prev_ != nullptr)
-			user.prev_->next_ = user.next_;
-		else
-			users_ = user.next_;
+		Unlink(user);
 
-		/* Update next */
-		if(user.next_ != nullptr)
-			user.next_->prev_ = user.prev_;
-
-		connected_users_--;
+		std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+		snapshot->reserve(connected_users_);
+		for(const std::shared_ptr<CollabVMUser>& ptr : *std::atomic_load(&snapshot_)) {
+			if(ptr.get() != &user)
+				snapshot->push_back(ptr);
+		}
+		std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>(std::move(snapshot)));
 
 		func(user);
 	}
 
+	/**
+	 * Removes several users at once, rebuilding the snapshot only once.
+	 */
+	template<typename F>
+	void RemoveUsers(const std::vector<std::shared_ptr<CollabVMUser>>& users, F func) {
+		std::lock_guard<std::mutex> lock(users_lock_);
+
+		std::unordered_set<const CollabVMUser*> removed;
+		removed.reserve(users.size());
+		for(const std::shared_ptr<CollabVMUser>& user : users) {
+			Unlink(*user);
+			removed.insert(user.get());
+		}
+
+		std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+		snapshot->reserve(connected_users_);
+		for(const std::shared_ptr<CollabVMUser>& ptr : *std::atomic_load(&snapshot_)) {
+			if(!removed.count(ptr.get()))
+				snapshot->push_back(ptr);
+		}
+		std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>(std::move(snapshot)));
+
+		for(const std::shared_ptr<CollabVMUser>& user : users)
+			func(*user);
+	}
+
 	/**
 	 * Iterate over each user in the list.
 	 */
@@ -67,7 +105,52 @@ class UserList {
 		ForEachUser(func);
 	}
 
+	/**
+	 * Iterate over a snapshot of the list without taking the users lock.
+	 * Users removed after the snapshot was taken may still be visited,
+	 * so the callback should only rely on state owned by CollabVMUser
+	 * itself (e.g. the websocket handle) and not on guac_user.
+	 */
+	template<typename F>
+	inline void ForEachUserSnapshot(F func) const {
+		std::shared_ptr<const Snapshot> snapshot = GetSnapshot();
+		for(const std::shared_ptr<CollabVMUser>& user : *snapshot)
+			func(*user);
+	}
+
+	/**
+	 * The number of users in the list.
+	 */
+	inline size_t GetCount() const {
+		return connected_users_;
+	}
+
+	/**
+	 * Get the current snapshot of the list. The same pointer is returned
+	 * until a user is added or removed.
+	 */
+	inline std::shared_ptr<const Snapshot> GetSnapshot() const {
+		return std::atomic_load(&snapshot_);
+	}
+
    private:
+	/**
+	 * Takes a user out of the linked list.
+	 */
+	void Unlink(CollabVMUser& user) {
+		/* Update prev / head */
+		if(user.prev_ != nullptr)
+			user.prev_->next_ = user.next_;
+		else
+			users_ = user.next_;
+
+		/* Update next */
+		if(user.next_ != nullptr)
+			user.next_->prev_ = user.prev_;
+
+		connected_users_--;
+	}
+
 	/**
 	* The first user within the list of all connected users, or NULL if no
 	* users are currently connected.
@@ -79,5 +162,11 @@ class UserList {
 	*/
 	std::mutex users_lock_;
 
+	/**
+	 * Copy-on-write snapshot of the users, rebuilt whenever a user is added
+	 * or removed and swapped atomically so readers never block.
+	 */
+	std::shared_ptr<const Snapshot> snapshot_;
+
 	size_t connected_users_;
 };
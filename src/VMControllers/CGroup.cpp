@@ -0,0 +1,110 @@
+#include "VMControllers/CGroup.h"
+#include "Logger.h"
+#ifdef __linux__
+	#include <sys/stat.h>
+	#include <unistd.h>
+
+	#include <cerrno>
+	#include <fstream>
+	
+static bool WriteFile(const std::string& path, const std::string& value) {
+	std::ofstream file(path);
+	file << value;
+	file.flush();
+	return file.good();
+}
+
+CGroup::CGroup(const std::string& name) {
+	const std::string& root = GetRoot();
+	if(root.empty())
+		return;
+
+	std::string path = root + '/';
+	for(char c : name) {
+		if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-')
+			path += c;
+		else
+			path += '_';
+	}
+
+	if(::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+		Logger::Error("cgroup") << "Failed to create " << path << ", resource limits are disabled for it";
+		return;
+	}
+	path_ = std::move(path);
+}
+
+CGroup::~CGroup() {
+	if(IsValid())
+		::rmdir(path_.c_str());
+}
+
+bool CGroup::AddProcess(pid_t pid) {
+	return IsValid() && Write("cgroup.procs", std::to_string(pid));
+}
+
+void CGroup::SetCPUMax(uint32_t percent) {
+	// The quota is the number of microseconds the group can run for in each period
+	constexpr uint32_t kPeriod = 100000;
+	Write("cpu.max", percent ? std::to_string(percent * (kPeriod / 100)) + ' ' + std::to_string(kPeriod) : "max");
+}
+
+void CGroup::SetCPUWeight(uint16_t weight) {
+	Write("cpu.weight", std::to_string(weight ? weight : 100));
+}
+
+void CGroup::SetMemoryHigh(uint32_t mebibytes) {
+	Write("memory.high", mebibytes ? std::to_string(static_cast<uint64_t>(mebibytes) * 1024 * 1024) : "max");
+}
+
+void CGroup::SetIOWeight(uint16_t weight) {
+	Write("io.weight", "default " + std::to_string(weight ? weight : 100));
+}
+
+bool CGroup::Write(const char* file, const std::string& value) {
+	if(!IsValid())
+		return false;
+
+	if(!WriteFile(path_ + '/' + file, value)) {
+		Logger::Error("cgroup") << "Failed to write \"" << value << "\" to " << path_ << '/' << file;
+		return false;
+	}
+	return true;
+}
+
+const std::string& CGroup::GetRoot() {
+	static const std::string root = [] {
+		// The line for cgroup v2 is "0::/path"
+		std::ifstream proc("/proc/self/cgroup");
+		std::string line;
+		std::string root;
+		while(std::getline(proc, line)) {
+			if(line.compare(0, 3, "0::") == 0) {
+				root = "/sys/fs/cgroup" + line.substr(3);
+				break;
+			}
+		}
+		if(root.empty()) {
+			Logger::Warning("cgroup") << "cgroup v2 isn't available, VM resource limits are disabled";
+			return root;
+		}
+		if(root.back() == '/')
+			root.pop_back();
+
+		std::string server = root + "/collab-vm-server";
+		if((::mkdir(server.c_str(), 0755) != 0 && errno != EEXIST) ||
+		   !WriteFile(server + "/cgroup.procs", std::to_string(::getpid()))) {
+			Logger::Warning("cgroup") << root << " isn't delegated to the server, VM resource limits are disabled";
+			return std::string();
+		}
+
+		// Each controller is enabled separately, so that a missing one
+		// doesn't stop the others from being used
+		for(const char* controller : { "+cpu", "+memory", "+io" })
+			if(!WriteFile(root + "/cgroup.subtree_control", controller))
+				Logger::Error("cgroup") << "Failed to enable the " << controller + 1 << " controller";
+		return root;
+	}();
+	return root;
+}
+#endif
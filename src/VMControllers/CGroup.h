@@ -0,0 +1,79 @@
+#pragma once
+#ifdef __linux__
+	#include <sys/types.h>
+
+	#include <cstdint>
+	#include <string>
+
+/**
+ * A cgroup v2 group that a VM's QEMU process runs in, so that the CPU,
+ * memory and IO it can use are limited by the kernel instead of only
+ * lowering its nice level. The groups are created inside the cgroup the
+ * server was started in, which must be delegated to the server's user,
+ * for example with Delegate=yes in its systemd unit. When that isn't
+ * possible, the group is invalid and setting limits does nothing.
+ */
+class CGroup {
+   public:
+	/**
+	 * Creates the group's directory.
+	 *
+	 * @param name The name of the group, which is made safe to use as a path.
+	 */
+	explicit CGroup(const std::string& name);
+
+	/**
+	 * Removes the group's directory, which only succeeds once
+	 * the processes in it have exited.
+	 */
+	~CGroup();
+
+	inline bool IsValid() const {
+		return !path_.empty();
+	}
+
+	/**
+	 * Moves a process and all of its threads into the group.
+	 */
+	bool AddProcess(pid_t pid);
+
+	/**
+	 * @param percent The share of a single CPU the group can use,
+	 *                or 0 for no limit.
+	 */
+	void SetCPUMax(uint32_t percent);
+
+	/**
+	 * @param weight The group's share of the CPU relative to the other
+	 *               groups, from 1 to 10000, or 0 for the default of 100.
+	 */
+	void SetCPUWeight(uint16_t weight);
+
+	/**
+	 * @param mebibytes The memory usage above which the group's processes
+	 *                  are throttled and reclaimed from, or 0 for no limit.
+	 */
+	void SetMemoryHigh(uint32_t mebibytes);
+
+	/**
+	 * @param weight The group's share of disk IO, from 1 to 10000,
+	 *               or 0 for the default of 100.
+	 */
+	void SetIOWeight(uint16_t weight);
+
+   private:
+	/**
+	 * Gets the directory that the groups are created in. The first time
+	 * it's called, the server moves itself into a leaf group of its own,
+	 * since the controllers can only be enabled for a group's children
+	 * when it doesn't have any processes of its own.
+	 *
+	 * @return The directory, or an empty string if cgroups can't be used.
+	 */
+	static const std::string& GetRoot();
+
+	bool Write(const char* file, const std::string& value);
+
+	std::string path_;
+};
+#endif
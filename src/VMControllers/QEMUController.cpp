@@ -1,5 +1,6 @@
 #include "VMControllers/QEMUController.h"
 #include "CollabVM.h"
+#include "Logger.h"
 #ifdef _WIN32
 	#include <Windows.h>
 	#include <shellapi.h>
@@ -13,27 +14,88 @@
 	#include <signal.h>
 
 	#include <dirent.h>
+	#include <fcntl.h>
+	#include <spawn.h>
 	#include <sys/resource.h>
+	#include <sys/stat.h>
+	#include <climits>
+	#include <cstdlib>
 
 	// This will probably hamper compatibility on non-Linux for a bit
 	// but whatever
 	#include <sys/prctl.h>
+	#include <sys/syscall.h>
 #endif
 #include <boost/asio.hpp>
 #include <boost/system/error_code.hpp>
+#include <algorithm>
 #include <cstdio>
 #include <string>
-#include <iostream>
 #include <functional>
 #include <memory>
 #include <sstream>
 
+/**
+ * The name of the internal snapshot that VMs using HD snapshots are reset to.
+ */
+static const char kBootSnapshot[] = "collab-vm-boot";
+
+/**
+ * The id of the audio backend that QEMU's VNC server streams to the
+ * server, which the VM's sound device has to be connected to.
+ */
+#define QEMU_AUDIODEV_ID "collab-vm-audio"
+
+/**
+ * Checks the result of a human monitor command, which is empty
+ * unless there was an error.
+ */
+static bool MonitorCommandSucceeded(const rapidjson::Document& d) {
+	auto it = d.FindMember("return");
+	return it != d.MemberEnd() && it->value.IsString() && it->value.GetStringLength() == 0;
+}
+
+/**
+ * How long QEMU gets to open its QMP and VNC servers before failures
+ * to connect to them count as attempts, and how often connecting is
+ * retried during that time. Most restarts are connected well within it,
+ * instead of waiting a second before each of the clients connects.
+ * QMP and VNC are connected at the same time, each with its own count.
+ */
+constexpr static std::chrono::seconds kFastRetryPeriod(2);
+constexpr static std::chrono::milliseconds kFastRetryDelay(100);
+constexpr static std::chrono::seconds kRetryDelay(1);
+
+/**
+ * How often the guest's resource use is polled over QMP.
+ */
+constexpr static std::chrono::seconds kTelemetryInterval(5);
+
+/**
+ * The number of times the migrate command is sent before a migration
+ * fails, one retry delay apart. The first attempts can fail while QEMU
+ * is still starting on the destination.
+ */
+constexpr static unsigned kMaxMigrationAttempts = 10;
+
 static const std::string kErrorMessages[] = {
 	"Failed to start QEMU",
 	"Failed to connect to QMP",
-	"Failed to connect to VNC"
+	"Failed to connect to VNC",
+	"Failed to create the overlay of the base image"
 };
 
+/**
+ * The directory the overlays of VMs that use a base image are kept in.
+ */
+static const char kOverlayPath[] = "overlays/";
+
+/**
+ * The directory the process IDs of QEMU instances that are left running
+ * when the server exits are kept in.
+ */
+static const char kPidPath[] = "run/";
+
 /**
  * A single thread is created for all QMPClient and AgentClient instances
  * to use.
@@ -51,7 +113,7 @@ static boost::asio::io_service* qmp_service_;
 std::vector<pid_t> GetProcessTasks(pid_t process) {
 	DIR* tasks = nullptr;
 	char buf[40];
-	snprintf(&buf[0], sizeof(buf), "/proc/%d/tasks", process);
+	snprintf(&buf[0], sizeof(buf), "/proc/%d/task", process);
 	tasks = opendir(&buf[0]);
 
 	if(tasks) {
@@ -82,15 +144,139 @@ std::vector<pid_t> GetProcessTasks(pid_t process) {
 	}
 }
 
+/**
+ * Gets the user and system CPU time from a stat file in the Linux /proc filesystem
+ */
+static std::chrono::microseconds ReadCPUTime(const char* path) {
+	char buf[512];
+	FILE* file = fopen(path, "r");
+	if(!file)
+		return std::chrono::microseconds::zero();
+
+	size_t length = fread(&buf[0], 1, sizeof(buf) - 1, file);
+	fclose(file);
+	buf[length] = '\0';
+
+	// The name of the process is in parentheses and may contain spaces,
+	// so the fields are counted from the last parenthesis. utime and
+	// stime are the 14th and 15th fields, the state is the 3rd.
+	char* fields = strrchr(&buf[0], ')');
+	unsigned long long utime, stime;
+	if(!fields || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+		return std::chrono::microseconds::zero();
+
+	static const long ticks = sysconf(_SC_CLK_TCK);
+	return std::chrono::microseconds((utime + stime) * 1000000 / ticks);
+}
+
+/**
+ * Gets the user and system CPU time a process has used
+ */
+std::chrono::microseconds GetProcessCPUTime(pid_t process) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", process);
+	return ReadCPUTime(path);
+}
+
+/**
+ * Gets the user and system CPU time one of the threads of a process has used
+ */
+static std::chrono::microseconds GetThreadCPUTime(pid_t process, pid_t thread) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", process, thread);
+	return ReadCPUTime(path);
+}
+
+/**
+ * Checks whether an image is qcow2 by its magic number, or else assumes it's raw.
+ */
+static const char* GetImageFormat(const std::string& path) {
+	char magic[4] = {};
+	FILE* file = fopen(path.c_str(), "rb");
+	if(file) {
+		fread(magic, 1, sizeof(magic), file);
+		fclose(file);
+	}
+	return memcmp(magic, "QFI\xfb", sizeof(magic)) == 0 ? "qcow2" : "raw";
+}
+
+/**
+ * Suggests turning on KSM the first time a VM uses a base image, since the
+ * guests that boot from the same image only share their memory through it.
+ */
+static void CheckKSM() {
+	#ifdef __linux__
+	static bool checked = false;
+	if(checked)
+		return;
+	checked = true;
+
+	FILE* file = fopen("/sys/kernel/mm/ksm/run", "r");
+	if(!file)
+		return;
+	int run = fgetc(file);
+	fclose(file);
+	if(run == '0')
+		Logger::Info("QEMU") << "KSM is off, so VMs that use the same base image won't share memory. "
+								"It can be turned on with: echo 1 > /sys/kernel/mm/ksm/run";
+	#endif
+}
+
+/**
+ * Gets the threads of a QEMU process that run the guest's vCPUs, which
+ * QEMU names "CPU n/KVM" or "CPU n/TCG".
+ */
+static std::vector<pid_t> GetVCPUThreads(pid_t process) {
+	std::vector<pid_t> threads;
+	for(pid_t tid : GetProcessTasks(process)) {
+		char path[64];
+		snprintf(path, sizeof(path), "/proc/%d/task/%d/comm", process, tid);
+		FILE* file = fopen(path, "r");
+		if(!file)
+			continue;
+		char name[16] = {};
+		fread(name, 1, sizeof(name) - 1, file);
+		fclose(file);
+		if(strncmp(name, "CPU ", 4) == 0)
+			threads.push_back(tid);
+	}
+	return threads;
+}
+
+/**
+ * Gets the command line arguments of a process, using Linux /proc filesystem.
+ * Empty if the process doesn't exist.
+ */
+static std::vector<std::string> GetProcessArguments(pid_t process) {
+	std::vector<std::string> args;
+	char path[40];
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", process);
+	FILE* file = fopen(path, "r");
+	if(!file)
+		return args;
+
+	std::string arg;
+	int c;
+	while((c = fgetc(file)) != EOF) {
+		if(c == '\0') {
+			args.push_back(std::move(arg));
+			arg.clear();
+		} else
+			arg += static_cast<char>(c);
+	}
+	fclose(file);
+	return args;
+}
+
 /**
  * Renice a task.
  */
 void ReniceTask(pid_t pid, int nice) {
 	// only set the nice level if we *need* to
 	if(getpriority(PRIO_PROCESS, pid) != nice) {
-		std::cout << "[QEMU] Setting task " << pid << " nice level to " << nice << "\n";
+		Logger::Info("QEMU") << "Setting task " << pid << " nice level to " << nice;
 		if(setpriority(PRIO_PROCESS, pid, nice) == -1) {
-			std::cout << "[QEMU] setpriority(PRIO_PROCESS, " << pid << ", " << nice << ") returned -1..?\n";
+			Logger::Warning("QEMU") << "setpriority(PRIO_PROCESS, " << pid << ", " << nice << ") returned -1..?";
 		}
 	}
 }
@@ -110,10 +296,34 @@ QEMUController::QEMUController(CollabVMServer& server, boost::asio::io_service&
 	  internal_state_(InternalState::kInactive),
 	  qemu_running_(false),
 	  timer_(service),
-	  retry_count_(0)
+	  retry_count_(0),
+	  vnc_retry_count_(0),
+	  vnc_timer_(service),
+	  telemetry_timer_(service),
+	  telemetry_pending_(false),
+	  last_vcpu_time_(0),
+	  last_disk_reads_(0),
+	  last_disk_writes_(0),
+	  boot_snapshot_pending_(false),
+	  boot_snapshot_saved_(false),
+	  loading_boot_snapshot_(false),
+	  idle_paused_(false),
+	  incoming_port_(0),
+	  migration_state_(MigrationState::kNone),
+	  migrated_here_(false),
+	  migrated_vnc_port_(0),
+	  migration_attempts_(0),
+	  migration_timer_(service)
 #ifndef _WIN32
 	  ,
-	  signal_(service, SIGCHLD)
+	  signal_(service, SIGCHLD),
+	  qemu_child_(true),
+	  qemu_detached_(false)
+#endif
+#ifdef __linux__
+	  ,
+	  socket_watch_(service),
+	  qemu_exit_watch_(service)
 #endif
 {
 	SetCommand(settings->QEMUCmd);
@@ -131,42 +341,91 @@ QEMUController::QEMUController(CollabVMServer& server, boost::asio::io_service&
 	}
 
 	InitQMP();
+	InitVNC();
 
 	InitAgent(*settings, *qmp_service_);
+
+#ifdef __linux__
+	UpdateResourceLimits();
+#endif
 }
 
 void QEMUController::ChangeSettings(const std::shared_ptr<VMSettings>& settings) {
-	bool restart = false;
-	if(settings->QEMUCmd != settings_->QEMUCmd) {
-		SetCommand(settings_->QEMUCmd);
-		restart = true;
-	}
-	if(settings->VNCAddress != settings_->VNCAddress || settings->VNCPort != settings_->VNCPort) {
-		guac_client_.SetEndpoint(settings_->VNCAddress, settings_->VNCPort);
-		restart = true;
-	}
-	if(settings->QMPAddress != settings_->QMPAddress || settings->QMPPort != settings_->QMPPort) {
-		//qmp_->SetEndpoint(settings_->QMPAddress, settings_->QMPPort);
-		restart = true;
-	}
-	if(settings->QMPSocketType != settings_->QMPSocketType) {
-		// TODO:
-		// InitQMP();
-		restart = true;
-	}
-	if(settings->AgentEnabled) {
-		if(!settings_->AgentEnabled) {
-			InitAgent(*settings, *qmp_service_);
-		}
-	} else {
-		if(settings_->AgentEnabled) {
-			InitAgent(*settings, *qmp_service_);
-		}
-	}
+	// The controller may have the only reference to the old settings
+	std::shared_ptr<VMSettings> old_settings = settings_;
+	const VMSettings& current = *old_settings;
+
+	// Settings that are part of QEMU's command line only take effect when
+	// it's restarted, which reconnects every viewer, so everything else is
+	// applied to the running VM instead
+	bool vnc_changed = settings->VNCSocketType != current.VNCSocketType ||
+					   settings->VNCAddress != current.VNCAddress || settings->VNCPort != current.VNCPort ||
+					   settings->AudioEnabled != current.AudioEnabled;
+	bool agent_changed = settings->AgentEnabled != current.AgentEnabled ||
+						 (settings->AgentEnabled &&
+						  (settings->AgentUseVirtio != current.AgentUseVirtio ||
+						   settings->AgentSocketType != current.AgentSocketType ||
+						   settings->AgentAddress != current.AgentAddress || settings->AgentPort != current.AgentPort));
+	bool restart = vnc_changed || settings->QEMUCmd != current.QEMUCmd || settings->BaseImage != current.BaseImage ||
+				   settings->QMPSocketType != current.QMPSocketType ||
+				   settings->QMPAddress != current.QMPAddress || settings->QMPPort != current.QMPPort ||
+				   (agent_changed && settings->AgentEnabled);
+	bool overlays_changed = settings->OverlayRegions != current.OverlayRegions;
+	bool probe_changed = settings->LatencyProbe != current.LatencyProbe;
+	bool images_changed = settings->PNGRealtimeLevel != current.PNGRealtimeLevel ||
+						  settings->PNGKeyframeLevel != current.PNGKeyframeLevel ||
+						  settings->PNGPalette != current.PNGPalette ||
+						  settings->PNGFast != current.PNGFast ||
+						  settings->JPEGQuality != current.JPEGQuality ||
+						  settings->JPEGSubsampling != current.JPEGSubsampling;
+
+	if(settings->QEMUCmd != current.QEMUCmd)
+		SetCommand(settings->QEMUCmd);
 	VMController::ChangeSettings(settings);
 	settings_ = settings;
-	if(restart)
+
+	if(agent_changed)
+		InitAgent(*settings_, *qmp_service_);
+	if(vnc_changed) {
+		InitVNC();
+	} else {
+		if(overlays_changed)
+			SetOverlays();
+		if(images_changed)
+			SetImageProfiles();
+		if(probe_changed)
+			SetLatencyProbe();
+		if(settings_->CPUAffinity != current.CPUAffinity)
+			SetCPUAffinity();
+		if(settings_->JoinRate != current.JoinRate)
+			guac_client_.SetJoinRate(settings_->JoinRate);
+		if(settings_->TargetBitrate != current.TargetBitrate)
+			guac_client_.SetTargetBitrate(settings_->TargetBitrate);
+		if(settings_->SessionRecording != current.SessionRecording)
+			SetSessionRecording();
+		if(settings_->HLSEnabled != current.HLSEnabled)
+			SetHLSStream();
+		// Used from the next time the VNC client connects
+		if(settings_->VNCEncodings != current.VNCEncodings ||
+		   settings_->VNCCompressLevel != current.VNCCompressLevel ||
+		   settings_->VNCQualityLevel != current.VNCQualityLevel)
+			guac_client_.SetEncodings(settings_->VNCEncodings, settings_->VNCCompressLevel,
+									  settings_->VNCQualityLevel);
+		if(settings_->VideoEnabled != current.VideoEnabled)
+			guac_client_.SetVideoEnabled(settings_->VideoEnabled);
+	}
+#ifdef __linux__
+	if(settings_->CPULimit != current.CPULimit || settings_->CPUWeight != current.CPUWeight ||
+	   settings_->MemoryHigh != current.MemoryHigh || settings_->IOWeight != current.IOWeight ||
+	   settings_->IdleCPULimit != current.IdleCPULimit)
+		UpdateResourceLimits();
+#endif
+	if(IsIdle() && settings_->IdlePolicy != current.IdlePolicy)
+		OnIdleChanged();
+	if(restart && internal_state_ != InternalState::kInactive) {
+		Logger::Info("QEMU") << "Restarting VM \"" << settings_->Name << "\" to apply its new settings";
 		Stop(StopReason::kRestart);
+	}
 }
 
 QEMUController::~QEMUController() {
@@ -181,39 +440,12 @@ void QEMUController::HandleChildSignal(const boost::system::error_code& ec, int
 		return;
 	int status = 0;
 	pid_t pid;
-	while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	// Only QEMU is reaped, other children such as ban commands are waited for by whoever started them
+	while(qemu_running_ && qemu_child_ && (pid = waitpid(qemu_pid_, &status, WNOHANG)) > 0) {
 		// Check if the process exited
 		if(WIFEXITED(status)) {
-			qemu_running_ = false;
-			std::cout << "QEMU child process with PID: " << pid << " has terminated with status: " << WEXITSTATUS(status) << std::endl;
-
-			// Stop the timer
-			boost::system::error_code ec;
-			timer_.cancel(ec);
-
-			// If we were expecting QEMU to stop
-			if(internal_state_ == InternalState::kStopping) {
-				IsStopped();
-			} else if(internal_state_ != InternalState::kInactive) {
-				// If QEMU's exit code is not zero and
-				// QMP is not currently connected it probably means
-				// that is was never able to connect because QEMU was
-				// started with invalid arguments
-				if(WEXITSTATUS(status) != 0 /* && !qmp.IsConnected()*/) {
-					internal_state_ = InternalState::kStopping;
-					error_code_ = ErrorCode::kQEMUError;
-					Stop(StopReason::kError);
-
-					IsStopped();
-
-					std::cout << "QEMU terminated with a non-zero status code which indicates an error. "
-								 "Check the command for any invalid arguments."
-							  << std::endl;
-				} else {
-					// Restart QEMU
-					StartQEMU();
-				}
-			}
+			Logger::Info() << "QEMU child process with PID: " << pid << " has terminated with status: " << WEXITSTATUS(status);
+			OnQEMUExit(WEXITSTATUS(status));
 		}
 	}
 	if(qemu_running_ && internal_state_ != InternalState::kStopping && internal_state_ != InternalState::kInactive)
@@ -221,19 +453,39 @@ void QEMUController::HandleChildSignal(const boost::system::error_code& ec, int
 									 std::static_pointer_cast<QEMUController>(shared_from_this()), std::placeholders::_1, std::placeholders::_2));
 }
 
-static int redirect_fd(int fd, int flags) {
-	/* Attempt to open bit bucket */
-	int new_fd = open("/dev/null", flags);
-	if(new_fd < 0)
-		return 1;
+void QEMUController::OnQEMUExit(int exit_status) {
+	qemu_running_ = false;
+	unlink(GetPidPath().c_str());
 
-	/* If descriptor is different, redirect old to new and close new */
-	if(new_fd != fd) {
-		dup2(new_fd, fd);
-		close(new_fd);
-	}
+	// Stop the timers
+	boost::system::error_code ec;
+	timer_.cancel(ec);
+	vnc_timer_.cancel(ec);
 
-	return 0;
+	// If we were expecting QEMU to stop
+	if(internal_state_ == InternalState::kStopping) {
+		IsStopped();
+	} else if(migration_state_ == MigrationState::kMigrated) {
+		// QEMU quit after the VM was migrated to another host
+	} else if(internal_state_ != InternalState::kInactive) {
+		// If QEMU's exit code is not zero and
+		// QMP is not currently connected it probably means
+		// that is was never able to connect because QEMU was
+		// started with invalid arguments
+		if(exit_status != 0 /* && !qmp.IsConnected()*/) {
+			internal_state_ = InternalState::kStopping;
+			error_code_ = ErrorCode::kQEMUError;
+			Stop(StopReason::kError);
+
+			IsStopped();
+
+			Logger::Error("QEMU") << "QEMU terminated with a non-zero status code which indicates an error. "
+									 "Check the command for any invalid arguments.";
+		} else {
+			// Restart QEMU
+			StartQEMU();
+		}
+	}
 }
 #endif
 
@@ -252,20 +504,27 @@ void QEMUController::Start() {
 									if(!ptr)
 										return;
 
-									std::cout << "[QEMU] Stop event occurred" << std::endl;
+									Logger::Info("QEMU") << "Stop event occurred";
+
+									// loadvm stops the VM while the snapshot is loaded,
+									// and idle VMs are stopped until someone joins
+									if(ptr->loading_boot_snapshot_ || ptr->idle_paused_)
+										return;
 
 									if(ptr->internal_state_ != InternalState::kStopping) {
 										if(ptr->settings_->RestoreOnShutdown &&
 										   ptr->settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots /* ||
 				(ptr->settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kVMSnapshots && ptr->RestartForSnapshot)*/
 										) {
-											// Restart QEMU to restore the snapshot
-											std::cout << "[QEMU] Restarting QEMU..." << std::endl;
+											if(!ptr->LoadBootSnapshot()) {
+												// Restart QEMU to restore the snapshot
+												Logger::Info("QEMU") << "Restarting QEMU...";
 
-											ptr->StopQEMU();
+												ptr->StopQEMU();
+											}
 										} else {
 											// Reset QEMU to reboot the VM
-											std::cout << "[QEMU] Resetting QEMU..." << std::endl;
+											Logger::Info("QEMU") << "Resetting QEMU...";
 
 											// If the reset event doesn't occur within five seconds, kill the process
 											// This is a workaround for when communication with QMP has been
@@ -280,9 +539,38 @@ void QEMUController::Start() {
 									}
 								});
 
+	qmp_->RegisterEventCallback(QMPClient::Events::RESUME,
+								[con](rapidjson::Document& d) {
+									auto ptr = con.lock();
+									if(!ptr)
+										return;
+
+									ptr->idle_paused_ = false;
+
+									// QEMU runs the VM once it has been migrated here
+									if(ptr->migration_state_ == MigrationState::kIncoming) {
+										Logger::Info("QEMU") << "VM \"" << ptr->settings_->Name << "\" was migrated here";
+										ptr->incoming_port_ = 0;
+										ptr->migration_state_ = MigrationState::kNone;
+										ptr->server_.OnVMControllerMigrated(ptr);
+									}
+								});
+
+	qmp_->RegisterEventCallback(QMPClient::Events::MIGRATION,
+								[con](rapidjson::Document& d) {
+									auto ptr = con.lock();
+									auto data = d.FindMember("data");
+									if(!ptr || data == d.MemberEnd() || !data->value.IsObject())
+										return;
+
+									auto status = data->value.FindMember("status");
+									if(status != data->value.MemberEnd() && status->value.IsString())
+										ptr->OnMigrationStatus(std::string(status->value.GetString(), status->value.GetStringLength()));
+								});
+
 	qmp_->RegisterEventCallback(QMPClient::Events::RESET,
 								[con](rapidjson::Document& d) {
-									std::cout << "[QEMU] Reset event occurred" << std::endl;
+									Logger::Info("QEMU") << "Reset event occurred";
 
 									auto ptr = con.lock();
 									if(!ptr)
@@ -299,19 +587,19 @@ void QEMUController::Start() {
 											// This shouldn't happen
 											// The QEMU process must be restarted
 											// Restart QEMU to restore the snapshot
-											std::cout << "[QEMU] Restarting QEMU..." << std::endl;
+											Logger::Info("QEMU") << "Restarting QEMU...";
 
 											ptr->StopQEMU();
 										} else {
-											// Send the loadvm command to the monitor to restore the snapshot
-											ptr->qmp_->SendMonitorCommand("loadvm " + ptr->snapshot_,
-																		  [con](rapidjson::Document&) {
-																			  if(auto ptr = con.lock()) {
-																				  std::cout << "Received result for loadvm command" << std::endl;
-																				  // Send the continue command to resume execution
-																				  ptr->qmp_->SystemResume();
-																			  }
-																		  });
+											// Send the loadvm command to the monitor to restore the snapshot,
+											// followed by the continue command to resume execution
+											std::vector<QMPClient::Command> commands;
+											commands.push_back(QMPClient::MonitorCommand("loadvm " + ptr->snapshot_,
+																						 [](rapidjson::Document&) {
+																							 Logger::Info() << "Received result for loadvm command";
+																						 }));
+											commands.push_back({ "cont" });
+											ptr->qmp_->ExecuteBatch(std::move(commands));
 										}
 									} else if(ptr->settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots)
 										ptr->qmp_->SystemResume();
@@ -327,6 +615,123 @@ void QEMUController::Start() {
 	StartQEMU();
 }
 
+#ifndef _WIN32
+std::string QEMUController::GetOverlayPath() const {
+	return kOverlayPath + settings_->Name + ".qcow2";
+}
+
+bool QEMUController::CreateOverlay() {
+	std::string overlay = GetOverlayPath();
+	// A new overlay also keeps a VM using HD snapshots from
+	// running on top of an older version of the base image
+	if(settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots)
+		unlink(overlay.c_str());
+	else if(access(overlay.c_str(), F_OK) == 0)
+		return true;
+
+	// The path of the backing file is relative to the overlay
+	char base[PATH_MAX];
+	if(!realpath(settings_->BaseImage.c_str(), base)) {
+		Logger::Error("QEMU") << "The base image \"" << settings_->BaseImage << "\" of VM \"" << settings_->Name << "\" doesn't exist";
+		return false;
+	}
+	mkdir(kOverlayPath, 0755);
+	CheckKSM();
+
+	const char* args[] = { "qemu-img", "create", "-q", "-f", "qcow2", "-F", GetImageFormat(base), "-b", base, overlay.c_str(), nullptr };
+	pid_t pid;
+	if(posix_spawnp(&pid, args[0], nullptr, nullptr, const_cast<char* const*>(args), environ) != 0) {
+		Logger::Error("QEMU") << "Failed to run qemu-img to create the overlay of VM \"" << settings_->Name << '"';
+		return false;
+	}
+
+	// Creating an empty overlay only takes a moment, and
+	// HandleChildSignal() only reaps the QEMU process
+	int status;
+	while(waitpid(pid, &status, 0) < 0) {
+		if(errno != EINTR)
+			return false;
+	}
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		Logger::Error("QEMU") << "qemu-img failed to create the overlay \"" << overlay << "\" of VM \"" << settings_->Name << '"';
+		return false;
+	}
+	Logger::Info("QEMU") << "Created the overlay \"" << overlay << "\" of the base image \"" << base << '"';
+	return true;
+}
+
+std::string QEMUController::GetPidPath() const {
+	return kPidPath + settings_->Name + ".pid";
+}
+
+bool QEMUController::ReattachQEMU() {
+	FILE* file = fopen(GetPidPath().c_str(), "r");
+	if(!file)
+		return false;
+	int pid = 0;
+	int fields = fscanf(file, "%d", &pid);
+	fclose(file);
+
+	// The process ID may have been reused since the file was written,
+	// so it has to be a QEMU with the VM's QMP server
+	std::string qmp_arg = settings_->QMPSocketType == VMSettings::SocketType::kTCP ? "tcp:" : "unix:";
+	qmp_arg += qmp_address_;
+	qmp_arg += ',';
+	std::vector<std::string> args = fields == 1 && pid > 0 ? GetProcessArguments(pid) : std::vector<std::string>();
+	auto it = std::find(args.begin(), args.end(), "-qmp");
+	if(it == args.end() || ++it == args.end() || it->compare(0, qmp_arg.length(), qmp_arg) != 0) {
+		unlink(GetPidPath().c_str());
+		return false;
+	}
+
+	Logger::Info("QEMU") << "Reattaching to QEMU process " << pid << " of VM \"" << settings_->Name << '"';
+	qemu_pid_ = pid;
+	qemu_child_ = false;
+	// The previous server took the boot snapshot, and if it didn't,
+	// loading it fails and QEMU is restarted
+	boot_snapshot_saved_ = settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots;
+	#ifdef __linux__
+	if(std::shared_ptr<CGroup> cgroup = std::atomic_load(&cgroup_))
+		cgroup->AddProcess(pid);
+	WatchQEMUExit();
+	#endif
+	return true;
+}
+#endif
+
+#ifdef __linux__
+void QEMUController::WatchQEMUExit() {
+	#ifdef SYS_pidfd_open
+	int fd = syscall(SYS_pidfd_open, qemu_pid_, 0);
+	#else
+	int fd = -1;
+	#endif
+	if(fd == -1) {
+		Logger::Warning("QEMU") << "Can't watch for QEMU to exit, so the VM won't be restarted if it quits";
+		return;
+	}
+	boost::system::error_code ec;
+	qemu_exit_watch_.assign(fd, ec);
+	if(ec) {
+		close(fd);
+		return;
+	}
+
+	std::weak_ptr<QEMUController> con(std::static_pointer_cast<QEMUController>(shared_from_this()));
+	qemu_exit_watch_.async_wait(boost::asio::posix::stream_descriptor::wait_read, [con](const boost::system::error_code& ec) {
+		auto ptr = con.lock();
+		if(ec || !ptr || !ptr->qemu_running_)
+			return;
+
+		boost::system::error_code close_ec;
+		ptr->qemu_exit_watch_.close(close_ec);
+		// Its exit status goes to whichever process adopted it
+		Logger::Info() << "QEMU process with PID: " << ptr->qemu_pid_ << " has terminated";
+		ptr->OnQEMUExit(0);
+	});
+}
+#endif
+
 void QEMUController::SetCommand(const std::string& command) {
 	// Free all arguments
 	
@@ -371,10 +776,102 @@ void QEMUController::InitQMP() {
 		qmp_ = std::make_shared<QMPLocalClient>(*qmp_service_, qmp_address_);
 	}
 #endif
+	if(qmp_)
+		qmp_->SetRoundTripMetric(metrics_.qmp_round_trip);
+}
+
+void QEMUController::InitVNC() {
+	guac_client_.SetAudioEnabled(settings_->AudioEnabled);
+	guac_client_.SetVideoEnabled(settings_->VideoEnabled);
+	SetOverlays();
+	SetImageProfiles();
+	SetLatencyProbe();
+	SetCPUAffinity();
+	guac_client_.SetJoinRate(settings_->JoinRate);
+	guac_client_.SetTargetBitrate(settings_->TargetBitrate);
+	SetSessionRecording();
+	SetHLSStream();
+	guac_client_.SetEncodings(settings_->VNCEncodings, settings_->VNCCompressLevel, settings_->VNCQualityLevel);
+
+#ifndef _WIN32
+	if(settings_->VNCSocketType == VMSettings::SocketType::kLocal) {
+		if(settings_->VNCAddress.empty()) {
+			// Unix domain sockets need to have a valid file path
+			vnc_address_ = P_tmpdir "/collab-vm-vnc-";
+			vnc_address_ += settings_->Name;
+		} else
+			vnc_address_ = settings_->VNCAddress;
+
+		// libvncclient connects to a Unix domain socket when the host is its path
+		guac_client_.SetEndpoint(vnc_address_, 0);
+		return;
+	}
+#endif
+	vnc_address_.clear();
+	guac_client_.SetEndpoint(settings_->VNCAddress, settings_->VNCPort);
+}
+
+void QEMUController::SetOverlays() {
+	std::vector<guac_common_rect> rects;
+	GuacVNCClient::ParseOverlays(settings_->OverlayRegions, rects);
+	guac_client_.SetOverlays(rects);
+}
+
+void QEMUController::SetLatencyProbe() {
+	GuacVNCLatencyProbe probe;
+	GuacVNCClient::ParseLatencyProbe(settings_->LatencyProbe, probe);
+	guac_client_.SetLatencyProbe(probe);
+}
+
+void QEMUController::SetSessionRecording() {
+	guac_client_.SetSessionRecording(
+		settings_->SessionRecording ? server_.GetSessionRecordingPath() + settings_->Name + '-' : "");
+}
+
+void QEMUController::SetHLSStream() {
+	if(!settings_->HLSEnabled) {
+		guac_client_.SetHLSStream(nullptr);
+	} else if(HLSStream::IsSupported()) {
+		guac_client_.SetHLSStream(HLSStream::Create(settings_->Name));
+	} else {
+		guac_client_.SetHLSStream(nullptr);
+		Logger::Warning("QEMU") << "HLS is enabled for VM \"" << settings_->Name << "\" but the server was built without it";
+	}
+}
+
+void QEMUController::SetCPUAffinity() {
+	CPUSet cpus;
+	if(settings_->CPUAffinity == "auto") {
+#ifndef _WIN32
+		if(qemu_running_) {
+			std::vector<pid_t> threads = GetVCPUThreads(qemu_pid_);
+			cpus = CPUSet::OfThreads(threads.data(), threads.size());
+		}
+#endif
+	} else {
+		CPUSet::Parse(settings_->CPUAffinity, cpus);
+	}
+	guac_client_.SetCPUSet(cpus);
+}
+
+void QEMUController::SetImageProfiles() {
+	guac_png_profile png;
+	png.realtime_level = settings_->PNGRealtimeLevel;
+	png.keyframe_level = settings_->PNGKeyframeLevel;
+	png.palette = settings_->PNGPalette;
+	png.fast = settings_->PNGFast;
+	guac_client_.SetPNGProfile(png);
+
+	guac_jpeg_profile jpeg = {};
+	jpeg.quality = settings_->JPEGQuality;
+	jpeg.subsampling = static_cast<guac_jpeg_subsampling>(settings_->JPEGSubsampling);
+	guac_client_.SetJPEGProfile(jpeg);
 }
 
 void QEMUController::RestoreVMSnapshot() {
-	if(internal_state_ != InternalState::kConnected && internal_state_ != InternalState::kVNCConnecting)
+	// Restarting QEMU would boot a second copy of a VM that was migrated
+	if((internal_state_ != InternalState::kConnected && internal_state_ != InternalState::kVNCConnecting) ||
+	   migration_state_ == MigrationState::kMigrated)
 		return;
 
 	if(settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kVMSnapshots && !snapshot_.empty()) {
@@ -382,9 +879,10 @@ void QEMUController::RestoreVMSnapshot() {
 			StopQEMU();
 		else
 			qmp_->LoadSnapshot(snapshot_, QMPClient::ResultCallback());
-	} else if(settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots)
-		StopQEMU();
-	else
+	} else if(settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots) {
+		if(!LoadBootSnapshot())
+			StopQEMU();
+	} else
 		qmp_->SystemStop();
 }
 
@@ -398,15 +896,132 @@ void QEMUController::ResetVM() {
 		qmp_->SystemReset();
 }
 
+bool QEMUController::StartIncoming(uint16_t port) {
+#ifdef _WIN32
+	return false;
+#else
+	if(internal_state_ != InternalState::kInactive ||
+	   settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots)
+		return false;
+
+	incoming_port_ = port;
+	migration_state_ = MigrationState::kIncoming;
+	Start();
+	return true;
+#endif
+}
+
+bool QEMUController::Migrate(const std::string& host, uint16_t port, const std::string& vnc_host, uint16_t vnc_port) {
+	if(internal_state_ != InternalState::kConnected || migration_state_ != MigrationState::kNone ||
+	   settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots)
+		return false;
+
+	migration_uri_ = "tcp:";
+	if(host.find(':') != std::string::npos)
+		migration_uri_ += '[' + host + ']';
+	else
+		migration_uri_ += host;
+	migration_uri_ += ':' + std::to_string(port);
+	migrated_vnc_host_ = vnc_host;
+	migrated_vnc_port_ = vnc_port;
+	migration_attempts_ = 0;
+	migration_state_ = MigrationState::kOutgoing;
+
+	Logger::Info("QEMU") << "Migrating VM \"" << settings_->Name << "\" to " << migration_uri_ << "...";
+	StartMigration();
+	return true;
+}
+
+void QEMUController::StartMigration() {
+	std::weak_ptr<QEMUController> con(std::static_pointer_cast<QEMUController>(shared_from_this()));
+	std::vector<QMPClient::Command> commands;
+	// A paused VM would stay paused on the destination
+	if(idle_paused_)
+		commands.push_back({ "cont" });
+	// QEMU only sends MIGRATION events when the capability is enabled
+	commands.push_back({ "migrate-set-capabilities", nullptr, [](QMPClient::ArgumentWriter& writer) {
+		writer.String("capabilities");
+		writer.StartArray();
+		writer.StartObject();
+		writer.String("capability");
+		writer.String("events");
+		writer.String("state");
+		writer.Bool(true);
+		writer.EndObject();
+		writer.EndArray();
+	} });
+	commands.push_back({ "migrate",
+						 [con](rapidjson::Document& d) {
+							 auto ptr = con.lock();
+							 if(ptr && d.HasMember("error"))
+								 ptr->OnMigrationStatus("failed");
+						 },
+						 [uri = migration_uri_](QMPClient::ArgumentWriter& writer) {
+							 writer.String("uri");
+							 writer.String(uri.c_str(), uri.length());
+						 } });
+	qmp_->ExecuteBatch(std::move(commands));
+}
+
+void QEMUController::OnMigrationStatus(const std::string& status) {
+	if(migration_state_ != MigrationState::kOutgoing)
+		return;
+
+	if(status == "completed") {
+		OnMigrated();
+		return;
+	}
+
+	if(status != "failed" && status != "cancelled")
+		return;
+
+	if(status == "failed" && ++migration_attempts_ < kMaxMigrationAttempts) {
+		std::weak_ptr<QEMUController> con(std::static_pointer_cast<QEMUController>(shared_from_this()));
+		boost::system::error_code ec;
+		migration_timer_.expires_from_now(kRetryDelay, ec);
+		migration_timer_.async_wait([con](const boost::system::error_code& ec) {
+			auto ptr = con.lock();
+			if(!ec && ptr && ptr->migration_state_ == MigrationState::kOutgoing && ptr->qmp_->IsConnected())
+				ptr->StartMigration();
+		});
+		return;
+	}
+
+	Logger::Error("QEMU") << "Failed to migrate VM \"" << settings_->Name << "\", it will keep running here";
+	migration_state_ = MigrationState::kNone;
+}
+
+void QEMUController::OnMigrated() {
+	Logger::Info("QEMU") << "VM \"" << settings_->Name << "\" was migrated to " << migration_uri_
+						 << ", its display will be relayed from there";
+	migration_state_ = MigrationState::kMigrated;
+	server_.OnVMControllerMigrated(shared_from_this());
+	// QEMU isn't restarted when it quits after the VM was migrated
+	qmp_->QEMUQuit();
+	// The Guacamole client reconnects after it's disconnected,
+	// which sends the whole display to every user again
+	guac_client_.SetEndpoint(migrated_vnc_host_, migrated_vnc_port_);
+	guac_client_.Disconnect();
+}
+
 void QEMUController::StartQEMU() {
+	boot_snapshot_pending_ = false;
+	boot_snapshot_saved_ = false;
+	loading_boot_snapshot_ = false;
+	idle_paused_ = false;
+	migrated_here_ = incoming_port_ != 0;
 #ifdef _WIN32
 
 	if(settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kVMSnapshots && !snapshot_.empty()) {
 		// Append loadvm command to start with snapshot
 		qemu_command_.push_back("-loadvm");
 		qemu_command_.push_back(snapshot_.c_str());
-	} else if(settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots)
+	} else if(settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots) {
 		qemu_command_.push_back("-snapshot");
+		// Start paused so the boot snapshot is taken before the guest runs
+		qemu_command_.push_back("-S");
+		boot_snapshot_pending_ = true;
+	}
 
 	//if (settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::)
 	qemu_command_.push_back("-no-shutdown");
@@ -472,22 +1087,27 @@ void QEMUController::StartQEMU() {
 		}
 	}
 
+	// Append audio device for the VNC server to capture
+	if(settings_->AudioEnabled) {
+		qemu_command_.push_back("-audiodev");
+		qemu_command_.push_back("none,id=" QEMU_AUDIODEV_ID);
+	}
+
 	// Append VNC argument
 	qemu_command_.push_back("-vnc");
 	// Subtract 5900 from the port number and append it to the hostname
 	std::string vnc_arg = settings_->VNCAddress + ':' + std::to_string(settings_->VNCPort - 5900);
+	if(settings_->AudioEnabled)
+		vnc_arg += ",audiodev=" QEMU_AUDIODEV_ID;
 	qemu_command_.push_back(vnc_arg.c_str());
 
-	std::cout << "Starting QEMU with command:\n";
-
 	std::string qemu_cmdline;
 
 	for(auto it = qemu_command_.begin(); it != qemu_command_.end(); it++) {
-		std::cout << *it << ' ';
 		qemu_cmdline += std::string(*it);
 		qemu_cmdline += " ";
 	}
-	std::cout << "\n";
+	Logger::Info() << "Starting QEMU with command:\n" << qemu_cmdline;
 
 	STARTUPINFO si;
 
@@ -500,146 +1120,262 @@ void QEMUController::StartQEMU() {
 
 	BOOL ProcessCreateStatus = CreateProcess(NULL, QemuCmdLineMutable, NULL, NULL, FALSE, 0, NULL, NULL, &si, &qemu_process_);
 
-	std::cout << "QEMU PID: " << qemu_process_.dwProcessId << std::endl;
+	Logger::Info() << "QEMU PID: " << qemu_process_.dwProcessId;
 
 	// free the mutable buffer to avoid a memleak
 	free((char*)QemuCmdLineMutable);
 #else
+	qemu_child_ = true;
+	qemu_detached_ = false;
+	// A previous server may have left the VM running
+	if(settings_->QEMUDetached && !incoming_port_ && ReattachQEMU()) {
+		ConnectToQEMU();
+		return;
+	}
 
-	// pid of the child before forking
-	pid_t parent_before_fork = getpid();
-	pid_t pId = fork();
-
-	if(pId == 0) {
-		// TODO: Should a new process group or session be created for QEMU?
-		// Creating a new process group causes QEMU to freeze when the -nographic
-		// argument is specified
-		// Change process group
-		/*if (setpgid(0, 0))
-			std::cout << "setpgid failed. errorno: " << errno << std::endl;*/
-
-		// If the collab-vm-server dies, we need to be terminated as well
-		// so the server can restart alright.
-		int prctl_result = prctl(PR_SET_PDEATHSIG, SIGTERM);
-		if (prctl_result == -1) {
-			perror(0);
-			exit(1);
+	// The VM's disk is written to an overlay that the server keeps
+	// on top of the base image, which other VMs can share
+	std::string drive_arg;
+	if(!settings_->BaseImage.empty()) {
+		if(!CreateOverlay()) {
+			error_code_ = ErrorCode::kOverlayFailed;
+			stop_reason_ = StopReason::kError;
+			if(internal_state_ == InternalState::kInactive)
+				server_.OnVMControllerStateChange(shared_from_this(), VMController::ControllerState::kStopped);
+			else
+				Stop(StopReason::kError);
+			return;
 		}
 
-		// Test in case the original parent exited just before the prctl() call. 
-		// If it did, then we exit on our own accord.
-		if (getppid() != parent_before_fork)
-			exit(1);
-
-		// The qemu_command_ vector is only modified inside of the child process
-		if(settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kVMSnapshots && !snapshot_.empty()) {
-			// Append loadvm command to start with snapshot
-			qemu_command_.push_back("-loadvm");
-			qemu_command_.push_back(snapshot_.c_str());
-		} else if(settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots)
-			qemu_command_.push_back("-snapshot");
-
-		//if (settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::)
-		qemu_command_.push_back("-no-shutdown");
-
-		// QMP address
-		qemu_command_.push_back("-qmp");
-		std::string qmp_arg;
-		if(settings_->QMPSocketType == VMSettings::SocketType::kTCP) {
-			qmp_arg = "tcp:";
-			qmp_arg += qmp_address_;
-			qmp_arg += ",server,nodelay";
-			qemu_command_.push_back(qmp_arg.c_str());
-		} else {
-			qmp_arg = "unix:";
-			qmp_arg += qmp_address_;
-			qmp_arg += ",server";
-			qemu_command_.push_back(qmp_arg.c_str());
+		// Commas in the path have to be doubled in QEMU's options
+		drive_arg = "file=";
+		for(char c : GetOverlayPath()) {
+			drive_arg += c;
+			if(c == ',')
+				drive_arg += ',';
 		}
+		drive_arg += ",format=qcow2";
+	}
 
-		if(access(qmp_address_.c_str(), F_OK) == 0) {
-			std::cout << "[QEMU] Deleting old " << qmp_address_ << " socket so the VM will work\n";
-			unlink(qmp_address_.c_str());
-		}
+	#ifdef __linux__
+	// Watch for the sockets before QEMU can create them
+	WatchSockets();
+	#endif
 
-		std::string arg;
-		if(settings_->AgentEnabled) {
-			if(settings_->AgentUseVirtio) {
-				// -chardev socket,id=agent,host=10.0.2.15,port=5700,nodelay,server,nowait -device virtio-serial -device virtserialport,chardev=agent
-				qemu_command_.push_back("-chardev");
-				arg = "socket,id=agent,";
-				if(settings_->AgentSocketType == VMSettings::SocketType::kTCP) {
-					arg += "host=";
-					arg += settings_->AgentAddress;
-					arg += ",port=";
-					arg += std::to_string(settings_->AgentPort);
-					arg += ",nodelay";
-				} else {
-					arg += "path=";
-					arg += agent_address_;
-				}
-				arg += ",server,nowait";
-				qemu_command_.push_back(arg.c_str());
+	// The arguments are built before the child is started, because
+	// it runs on the server's memory until it calls exec
+	std::vector<const char*> command = qemu_command_;
+	if(!drive_arg.empty()) {
+		command.push_back("-drive");
+		command.push_back(drive_arg.c_str());
+	}
+	std::string incoming_arg;
+	if(incoming_port_) {
+		// The VM's state comes from the host it's migrated from
+		incoming_arg = "tcp:0.0.0.0:" + std::to_string(incoming_port_);
+		command.push_back("-incoming");
+		command.push_back(incoming_arg.c_str());
+	} else if(settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kVMSnapshots && !snapshot_.empty()) {
+		// Append loadvm command to start with snapshot
+		command.push_back("-loadvm");
+		command.push_back(snapshot_.c_str());
+	} else if(settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots) {
+		command.push_back("-snapshot");
+		// Start paused so the boot snapshot is taken before the guest runs
+		command.push_back("-S");
+		boot_snapshot_pending_ = true;
+	}
+
+	//if (settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::)
+	command.push_back("-no-shutdown");
+
+	// QMP address
+	command.push_back("-qmp");
+	std::string qmp_arg;
+	if(settings_->QMPSocketType == VMSettings::SocketType::kTCP) {
+		qmp_arg = "tcp:";
+		qmp_arg += qmp_address_;
+		qmp_arg += ",server,nodelay";
+		command.push_back(qmp_arg.c_str());
+	} else {
+		qmp_arg = "unix:";
+		qmp_arg += qmp_address_;
+		qmp_arg += ",server";
+		command.push_back(qmp_arg.c_str());
+	}
 
-				qemu_command_.push_back("-device");
-				qemu_command_.push_back("virtio-serial");
+	if(access(qmp_address_.c_str(), F_OK) == 0) {
+		Logger::Info("QEMU") << "Deleting old " << qmp_address_ << " socket so the VM will work";
+		unlink(qmp_address_.c_str());
+	}
 
-				qemu_command_.push_back("-device");
-				qemu_command_.push_back("virtserialport,chardev=agent");
+	std::string arg;
+	if(settings_->AgentEnabled) {
+		if(settings_->AgentUseVirtio) {
+			// -chardev socket,id=agent,host=10.0.2.15,port=5700,nodelay,server,nowait -device virtio-serial -device virtserialport,chardev=agent
+			command.push_back("-chardev");
+			arg = "socket,id=agent,";
+			if(settings_->AgentSocketType == VMSettings::SocketType::kTCP) {
+				arg += "host=";
+				arg += settings_->AgentAddress;
+				arg += ",port=";
+				arg += std::to_string(settings_->AgentPort);
+				arg += ",nodelay";
 			} else {
-				// Serial address
-				qemu_command_.push_back("-serial");
-				if(settings_->AgentSocketType == VMSettings::SocketType::kTCP) {
-					arg = "tcp:";
-					arg += agent_address_;
-					// nowait is used because the AgentClient does not connect
-					// until after the VM has been started with QMP
-					arg += ",server,nowait,nodelay";
-				} else {
-					arg = "unix:";
-					arg += agent_address_;
-					arg += ",server,nowait";
-				}
-				qemu_command_.push_back(arg.c_str());
+				arg += "path=";
+				arg += agent_address_;
+			}
+			arg += ",server,nowait";
+			command.push_back(arg.c_str());
+
+			command.push_back("-device");
+			command.push_back("virtio-serial");
+
+			command.push_back("-device");
+			command.push_back("virtserialport,chardev=agent");
+		} else {
+			// Serial address
+			command.push_back("-serial");
+			if(settings_->AgentSocketType == VMSettings::SocketType::kTCP) {
+				arg = "tcp:";
+				arg += agent_address_;
+				// nowait is used because the AgentClient does not connect
+				// until after the VM has been started with QMP
+				arg += ",server,nowait,nodelay";
+			} else {
+				arg = "unix:";
+				arg += agent_address_;
+				arg += ",server,nowait";
 			}
+			command.push_back(arg.c_str());
 		}
+	}
 
-		// Append VNC argument
-		qemu_command_.push_back("-vnc");
-		// Subtract 5900 from the port number and append it to the hostname
-		std::string vnc_arg = settings_->VNCAddress + ':' + std::to_string(settings_->VNCPort - 5900);
-		qemu_command_.push_back(vnc_arg.c_str());
+	// Append audio device for the VNC server to capture
+	if(settings_->AudioEnabled) {
+		command.push_back("-audiodev");
+		command.push_back("none,id=" QEMU_AUDIODEV_ID);
+	}
 
-		// Null terminate the arguments list
-		qemu_command_.push_back(nullptr);
-		std::cout << "Starting QEMU with command:\n";
+	// Append VNC argument
+	command.push_back("-vnc");
+	std::string vnc_arg;
+	if(!vnc_address_.empty()) {
+		vnc_arg = "unix:";
+		vnc_arg += vnc_address_;
+
+		if(access(vnc_address_.c_str(), F_OK) == 0)
+			unlink(vnc_address_.c_str());
+	} else {
+		// Subtract 5900 from the port number and append it to the hostname
+		vnc_arg = settings_->VNCAddress + ':' + std::to_string(settings_->VNCPort - 5900);
+	}
+	if(settings_->AudioEnabled)
+		vnc_arg += ",audiodev=" QEMU_AUDIODEV_ID;
+	command.push_back(vnc_arg.c_str());
 
-		for(auto & it : qemu_command_) {
+	// Null terminate the arguments list
+	command.push_back(nullptr);
+	{
+		Logger::Line line = Logger::Info();
+		line << "Starting QEMU with command:\n";
+		for(auto& it : command) {
 			if(it != nullptr)
-				std::cout << it << ' ';
+				line << it << ' ';
 		}
-		std::cout << std::endl;
+	}
 
-		/*if (redirect_fd(STDIN_FILENO, O_RDONLY)
-			|| redirect_fd(STDOUT_FILENO, O_WRONLY)
-			|| redirect_fd(STDERR_FILENO, O_WRONLY))
-		{
-			std::cout << "Failed to redirect standard output for QEMU child process" << std::endl;
-		}*/
+	// Block every signal so that none of the server's handlers can run in
+	// the child while it shares the server's memory
+	sigset_t all_signals, old_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
 
-		exit(execvp(qemu_command_[0], (char* const*)qemu_command_.data()));
-	} else if(pId < 0) {
+	// vfork() doesn't copy the server's page tables like fork() does, so starting
+	// QEMU takes the same time no matter how much memory the server is using.
+	// posix_spawn() would do the same, but it can't set the parent death signal.
+	pid_t parent_before_fork = getpid();
+	bool detached = settings_->QEMUDetached;
+	pid_t pId = vfork();
+
+	if(pId == 0) {
+		// Only async-signal-safe functions can be called until exec
+		struct sigaction default_action = {};
+		default_action.sa_handler = SIG_DFL;
+		for(int sig = 1; sig < NSIG; sig++) {
+			struct sigaction action;
+			if(sigaction(sig, nullptr, &action) == 0 && action.sa_handler != SIG_IGN)
+				sigaction(sig, &default_action, nullptr);
+		}
+
+		// TODO: Should a new process group or session be created for QEMU?
+		// Creating a new process group causes QEMU to freeze when the -nographic
+		// argument is specified
+
+		if(detached) {
+			// A QEMU that outlives the server gets its own session, so it
+			// isn't sent the terminal's signals, like Ctrl+C, with the server
+			setsid();
+			int null_fd = open("/dev/null", O_RDONLY);
+			if(null_fd != -1) {
+				dup2(null_fd, STDIN_FILENO);
+				close(null_fd);
+			}
+		} else {
+			// If the collab-vm-server dies, we need to be terminated as well
+			// so the server can restart alright.
+			if(prctl(PR_SET_PDEATHSIG, SIGTERM) == -1)
+				_exit(1);
+
+			// Test in case the original parent exited just before the prctl() call.
+			// If it did, then we exit on our own accord.
+			if(getppid() != parent_before_fork)
+				_exit(1);
+		}
+
+		pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+		execvp(command[0], const_cast<char* const*>(command.data()));
+		_exit(127);
+	}
+
+	int fork_errno = errno;
+	pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+	if(pId < 0) {
 		// Failed to fork
-		throw std::system_error(errno, std::system_category(), "fork() failed when trying to start QEMU");
+		throw std::system_error(fork_errno, std::system_category(), "vfork() failed when trying to start QEMU");
 	}
 
-	std::cout << "QEMU process ID: " << pId << std::endl;
+	Logger::Info() << "QEMU process ID: " << pId;
 	qemu_pid_ = pId;
+	#ifdef __linux__
+	if(std::shared_ptr<CGroup> cgroup = std::atomic_load(&cgroup_))
+		cgroup->AddProcess(pId);
+	#endif
+
+	// The next server finds QEMU by its process ID
+	unlink(GetPidPath().c_str());
+	if(detached) {
+		mkdir(kPidPath, 0755);
+		FILE* pid_file = fopen(GetPidPath().c_str(), "w");
+		if(!pid_file || fprintf(pid_file, "%d\n", pId) < 0)
+			Logger::Warning("QEMU") << "Couldn't write \"" << GetPidPath() << "\", so the VM will be booted again if the server restarts";
+		if(pid_file)
+			fclose(pid_file);
+	}
 #endif
+	ConnectToQEMU();
+}
+
+void QEMUController::ConnectToQEMU() {
 	qemu_running_ = true;
 	internal_state_ = InternalState::kQMPConnecting;
 	retry_count_ = 0;
+	vnc_retry_count_ = 0;
+	connecting_since_ = vnc_connecting_since_ = time_clock::now();
+	// QEMU opens its VNC server as early as its QMP server,
+	// so there's no need to wait for QMP before connecting to it
 	StartQMP();
+	StartGuacClient();
 }
 
 void QEMUController::StopQEMU() {
@@ -654,7 +1390,7 @@ void QEMUController::StopQEMU() {
 void QEMUController::OnQEMUStop() {
 	if(internal_state_ == InternalState::kStopping) {
 		IsStopped();
-	} else {
+	} else if(migration_state_ != MigrationState::kMigrated) {
 		// Restart QEMU
 		StartQEMU();
 	}
@@ -662,7 +1398,26 @@ void QEMUController::OnQEMUStop() {
 
 void QEMUController::KillQEMU() {
 #ifndef _WIN32
-	::kill(qemu_pid_, SIGKILL);
+	#ifdef __linux__
+	boost::system::error_code ec;
+	qemu_exit_watch_.close(ec);
+	#endif
+	if(qemu_running_ && ::kill(qemu_pid_, SIGKILL) == 0) {
+		if(qemu_child_) {
+			// Reap it here, since HandleChildSignal() only waits for the current QEMU process
+			waitpid(qemu_pid_, nullptr, 0);
+		} else {
+			// Only the process that adopted it can reap it, so wait until it's
+			// gone or a zombie, by which time it has released the VM's disk
+			for(int i = 0; i < 500; i++) {
+				std::vector<std::string> args = GetProcessArguments(qemu_pid_);
+				if(args.empty())
+					break;
+				usleep(10000);
+			}
+		}
+	}
+	unlink(GetPidPath().c_str());
 #else
 	// Open a handle to the QEMU process, then terminate it hard.
 	HANDLE hQemuProcess = OpenProcess(PROCESS_TERMINATE, FALSE, qemu_process_.dwProcessId);
@@ -677,34 +1432,174 @@ void QEMUController::StartQMPCallback(const boost::system::error_code& ec) {
 		qmp_->Connect(std::weak_ptr<QEMUController>(std::static_pointer_cast<QEMUController>(shared_from_this())));
 }
 
+bool QEMUController::IsFastRetryPeriod(time_clock::time_point since) const {
+	return time_clock::now() - since < kFastRetryPeriod;
+}
+
 void QEMUController::StartQMP() {
-	// Wait one second before attempting to connect to QEMU's QMP server
+	// Wait before attempting to connect to QEMU's QMP server
 	boost::system::error_code ec;
-	timer_.expires_from_now(std::chrono::seconds(1), ec);
+	timer_.expires_from_now(IsFastRetryPeriod(connecting_since_) ? kFastRetryDelay : kRetryDelay, ec);
 	// TODO:
 	// if (ec) ...
 	timer_.async_wait(std::bind(&QEMUController::StartQMPCallback,
 								std::static_pointer_cast<QEMUController>(shared_from_this()), std::placeholders::_1));
 }
 
+void QEMUController::SaveBootSnapshot() {
+	std::weak_ptr<QEMUController> con(std::static_pointer_cast<QEMUController>(shared_from_this()));
+	std::vector<QMPClient::Command> commands;
+	commands.push_back(QMPClient::MonitorCommand(std::string("savevm ") + kBootSnapshot, [con](rapidjson::Document& d) {
+		auto ptr = con.lock();
+		if(!ptr)
+			return;
+
+		ptr->boot_snapshot_saved_ = MonitorCommandSucceeded(d);
+		if(!ptr->boot_snapshot_saved_)
+			Logger::Error("QEMU") << "Failed to save the boot snapshot, QEMU will be restarted to reset the VM";
+	}));
+	// QEMU was started paused with -S
+	commands.push_back({ "cont" });
+	qmp_->ExecuteBatch(std::move(commands));
+}
+
+bool QEMUController::LoadBootSnapshot() {
+	if(!boot_snapshot_saved_ || !qmp_->IsConnected())
+		return false;
+
+	Logger::Info("QEMU") << "Loading the boot snapshot...";
+	loading_boot_snapshot_ = true;
+	std::weak_ptr<QEMUController> con(std::static_pointer_cast<QEMUController>(shared_from_this()));
+	std::vector<QMPClient::Command> commands;
+	commands.push_back(QMPClient::MonitorCommand(std::string("loadvm ") + kBootSnapshot, [con](rapidjson::Document& d) {
+		auto ptr = con.lock();
+		if(!ptr)
+			return;
+
+		ptr->loading_boot_snapshot_ = false;
+		if(!MonitorCommandSucceeded(d)) {
+			Logger::Error("QEMU") << "Failed to load the boot snapshot. Restarting QEMU...";
+			ptr->boot_snapshot_saved_ = false;
+			ptr->StopQEMU();
+		}
+	}));
+	// Resume without waiting for the result, since QEMU runs the commands in order
+	commands.push_back({ "cont" });
+	qmp_->ExecuteBatch(std::move(commands));
+	return true;
+}
+
+/**
+ * Adds the increase in a total that QEMU reports to a counter. A total
+ * that went down is from a new QEMU process, so all of it is added.
+ */
+static void CountUp(MetricCounter& counter, uint64_t& last, uint64_t total) {
+	counter.Add(total >= last ? total - last : total);
+	last = total;
+}
+
+void QEMUController::ScheduleTelemetry() {
+	boost::system::error_code ec;
+	telemetry_timer_.expires_from_now(kTelemetryInterval, ec);
+	std::weak_ptr<QEMUController> con(std::static_pointer_cast<QEMUController>(shared_from_this()));
+	telemetry_timer_.async_wait([con](const boost::system::error_code& ec) {
+		if(ec)
+			return;
+		if(auto ptr = con.lock())
+			ptr->PollTelemetry();
+	});
+}
+
+void QEMUController::PollTelemetry() {
+	// Polling starts again once QMP reconnects
+	if(!qmp_->IsConnected() || internal_state_ == InternalState::kStopping)
+		return;
+	ScheduleTelemetry();
+	if(telemetry_pending_)
+		return;
+	telemetry_pending_ = true;
+
+	// The queries are sent in one write, and answered in one round trip
+	std::weak_ptr<QEMUController> con(std::static_pointer_cast<QEMUController>(shared_from_this()));
+	std::vector<QMPClient::Command> commands;
+	commands.push_back({ "query-cpus-fast", [con](rapidjson::Document& d) {
+		auto ptr = con.lock();
+		auto result = d.FindMember("return");
+		if(!ptr || result == d.MemberEnd() || !result->value.IsArray())
+			return;
+#ifndef _WIN32
+		// The vCPU time is read from the threads that QEMU runs them on
+		uint64_t vcpu_time = 0;
+		for(auto cpu = result->value.Begin(); cpu != result->value.End(); cpu++) {
+			if(!cpu->IsObject())
+				continue;
+			auto thread = cpu->FindMember("thread-id");
+			if(thread != cpu->MemberEnd() && thread->value.IsInt())
+				vcpu_time += GetThreadCPUTime(ptr->qemu_pid_, thread->value.GetInt()).count();
+		}
+		CountUp(ptr->metrics_.guest_vcpu_time, ptr->last_vcpu_time_, vcpu_time);
+#endif
+	} });
+	commands.push_back({ "query-blockstats", [con](rapidjson::Document& d) {
+		auto ptr = con.lock();
+		auto result = d.FindMember("return");
+		if(!ptr || result == d.MemberEnd() || !result->value.IsArray())
+			return;
+
+		uint64_t reads = 0, writes = 0;
+		for(auto device = result->value.Begin(); device != result->value.End(); device++) {
+			if(!device->IsObject())
+				continue;
+			auto stats = device->FindMember("stats");
+			if(stats == device->MemberEnd() || !stats->value.IsObject())
+				continue;
+			auto rd = stats->value.FindMember("rd_operations");
+			auto wr = stats->value.FindMember("wr_operations");
+			if(rd != stats->value.MemberEnd() && rd->value.IsUint64())
+				reads += rd->value.GetUint64();
+			if(wr != stats->value.MemberEnd() && wr->value.IsUint64())
+				writes += wr->value.GetUint64();
+		}
+		CountUp(ptr->metrics_.guest_disk_reads, ptr->last_disk_reads_, reads);
+		CountUp(ptr->metrics_.guest_disk_writes, ptr->last_disk_writes_, writes);
+	} });
+	// This fails if the VM doesn't have a balloon device, which is reported as 0
+	commands.push_back({ "query-balloon", [con](rapidjson::Document& d) {
+		auto ptr = con.lock();
+		if(!ptr)
+			return;
+		ptr->telemetry_pending_ = false;
+
+		auto result = d.FindMember("return");
+		int64_t actual = 0;
+		if(result != d.MemberEnd() && result->value.IsObject()) {
+			auto it = result->value.FindMember("actual");
+			if(it != result->value.MemberEnd() && it->value.IsInt64())
+				actual = it->value.GetInt64();
+		}
+		ptr->metrics_.guest_balloon_bytes.Set(actual);
+	} });
+	qmp_->ExecuteBatch(std::move(commands));
+}
+
 void QEMUController::StartGuacClientCallback(const boost::system::error_code& ec) {
-	if(!ec && internal_state_ == InternalState::kVNCConnecting)
+	if(!ec && IsVNCConnecting())
 		guac_client_.Start();
 }
 
 void QEMUController::StartGuacClient() {
 	boost::system::error_code ec;
-	timer_.expires_from_now(std::chrono::seconds(1), ec);
+	vnc_timer_.expires_from_now(IsFastRetryPeriod(vnc_connecting_since_) ? kFastRetryDelay : kRetryDelay, ec);
 	// TODO:
 	// if (ec) ...
-	timer_.async_wait(std::bind(&QEMUController::StartGuacClientCallback,
+	vnc_timer_.async_wait(std::bind(&QEMUController::StartGuacClientCallback,
 								std::static_pointer_cast<QEMUController>(shared_from_this()), std::placeholders::_1));
 }
 
 void QEMUController::ProcessKillTimeout(const boost::system::error_code& ec) {
 	if(ec)
 		return;
-	std::cout << "QEMU did not terminate within 5 seconds. Killing process..." << std::endl;
+	Logger::Warning() << "QEMU did not terminate within 5 seconds. Killing process...";
 #ifndef _WIN32
 	boost::system::error_code err;
 	signal_.cancel(err);
@@ -718,18 +1613,45 @@ void QEMUController::Stop(VMController::StopReason reason) {
 	if(internal_state_ == InternalState::kInactive || internal_state_ == InternalState::kStopping)
 		return;
 
+	// The VM runs on another host now, so it can't be started here again
+	if(migration_state_ == MigrationState::kMigrated && reason == StopReason::kRestart)
+		reason = StopReason::kRemove;
+
 	internal_state_ = InternalState::kStopping;
 	stop_reason_ = reason;
+	incoming_port_ = 0;
+	migration_state_ = MigrationState::kNone;
 
 	VMController::Stop(reason);
 
-	// Stop the timer
+	// Stop the timers
 	boost::system::error_code ec;
 	timer_.cancel(ec);
+	vnc_timer_.cancel(ec);
+	migration_timer_.cancel(ec);
+	telemetry_timer_.cancel(ec);
+#ifdef __linux__
+	socket_watch_.close(ec);
+#endif
 
 	// Stop the Guacamole client
 	guac_client_.Stop();
 
+#ifndef _WIN32
+	// The server that replaces this one reattaches to QEMU
+	if(reason == StopReason::kShutdown && settings_->QEMUDetached && qemu_running_) {
+		Logger::Info("QEMU") << "Leaving QEMU running for VM \"" << settings_->Name << '"';
+		#ifdef __linux__
+		qemu_exit_watch_.close(ec);
+		#endif
+		qemu_detached_ = true;
+		qemu_running_ = false;
+		qmp_->Disconnect();
+		IsStopped();
+		return;
+	}
+#endif
+
 	StopQEMU();
 }
 
@@ -738,38 +1660,41 @@ void QEMUController::IsStopped() {
 	   !qmp_->IsConnected() && !qemu_running_) {
 		internal_state_ = InternalState::kInactive;
 
+#ifndef _WIN32
+		// The overlay of a VM using HD snapshots only lives as long as QEMU
+		if(!settings_->BaseImage.empty() && settings_->QEMUSnapshotMode == VMSettings::SnapshotMode::kHDSnapshots &&
+		   !qemu_detached_)
+			unlink(GetOverlayPath().c_str());
+#endif
+
 		//server_.OnVMControllerStop(shared_from_this(), stop_reason_);
 		server_.OnVMControllerStateChange(shared_from_this(), VMController::ControllerState::kStopped);
 	}
 }
 
 void QEMUController::GuacDisconnect() {
-	if(!qmp_->IsConnected())
-		return;
-
 	// Restart the Guacamole client if we are not stopping
-	if(internal_state_ == InternalState::kVNCConnecting) {
-		std::cout << "Gaucamole client failed to connect.";
+	if(IsVNCConnecting()) {
 		// If we have exceeded the max number of connection attempts
-		if(++retry_count_ >= settings_->MaxAttempts) {
-			std::cout << "Max number attempts has been exceeded. Stopping...";
+		if(!IsFastRetryPeriod(vnc_connecting_since_) && ++vnc_retry_count_ >= settings_->MaxAttempts) {
+			Logger::Error() << "Gaucamole client failed to connect. Max number attempts has been exceeded. Stopping...";
 
 			error_code_ = ErrorCode::kVNCFailed;
 			Stop(StopReason::kError);
 		} else {
-			std::cout << "Retrying...";
+			Logger::Warning() << "Gaucamole client failed to connect. Retrying...";
 			// Retry connecting
 			StartGuacClient();
 		}
-		std::cout << std::endl;
 	} else if(internal_state_ == InternalState::kConnected) {
 		// Check if the user initiated the disconnect
 		if(guac_client_.GetDisconnectReason() != GuacClient::DisconnectReason::kClient) {
-			std::cout << "Guacamole client unexpectedly disconnected (Code: " << guac_client_.GetDisconnectReason() << "). Reconnecting..." << std::endl;
+			Logger::Warning() << "Guacamole client unexpectedly disconnected (Code: " << guac_client_.GetDisconnectReason() << "). Reconnecting...";
 		}
 		internal_state_ = InternalState::kVNCConnecting;
 		// Reset retry counter
-		retry_count_ = 0;
+		vnc_retry_count_ = 0;
+		vnc_connecting_since_ = time_clock::now();
 		// Attempt to reconnect
 		StartGuacClient();
 	}
@@ -782,7 +1707,7 @@ void QEMUController::CleanUp() {
 }
 
 void QEMUController::OnGuacStarted() {
-	if(internal_state_ == InternalState::kVNCConnecting) {
+	if(IsVNCConnecting()) {
 		guac_client_.Connect();
 	}
 }
@@ -803,6 +1728,9 @@ void QEMUController::OnGuacConnect() {
 		internal_state_ = InternalState::kConnected;
 		//server_.OnVMControllerStart(shared_from_this());
 		server_.OnVMControllerStateChange(shared_from_this(), VMController::ControllerState::kRunning);
+	} else if(internal_state_ == InternalState::kQMPConnecting) {
+		// The VM is running once QMP connects as well
+		Logger::Info() << "Connected to VNC, waiting for QMP";
 	} else {
 		guac_client_.Disconnect();
 	}
@@ -824,19 +1752,30 @@ void QEMUController::OnQMPStateChange(QMPClient::QMPState state) {
 	switch(state) {
 		case QMPClient::QMPState::kConnected:
 			if(internal_state_ == InternalState::kQMPConnecting) {
-				std::cout << "Connected to QMP" << std::endl;
+				Logger::Info() << "Connected to QMP";
 #ifndef _WIN32
 				// Now that we know the QEMU process has started, let's renice it and all its threads.
 				constexpr auto NICE_LEVEL = 19;
 				ReniceAllTasks(qemu_pid_, NICE_LEVEL);
 #endif
-
-				// It's possible for the VNC client to already be connected
-				// if the QMP client disconnected after the VNC client was connected
-				if(guac_client_.GetState() != GuacClient::ClientState::kConnected) {
-					internal_state_ = InternalState::kVNCConnecting;
-					StartGuacClient();
+				// The vCPU threads have been created by now
+				if(settings_->CPUAffinity == "auto")
+					SetCPUAffinity();
+				if(boot_snapshot_pending_) {
+					boot_snapshot_pending_ = false;
+					SaveBootSnapshot();
 				}
+				telemetry_pending_ = false;
+				ScheduleTelemetry();
+
+				// The VNC client has been connecting since QEMU was started,
+				// and may have connected first or stayed connected while
+				// the QMP client reconnected
+				if(guac_client_.GetState() == GuacClient::ClientState::kConnected) {
+					internal_state_ = InternalState::kConnected;
+					server_.OnVMControllerStateChange(shared_from_this(), VMController::ControllerState::kRunning);
+				} else
+					internal_state_ = InternalState::kVNCConnecting;
 				if(agent_) {
 					agent_->Connect(std::weak_ptr<AgentCallback>(std::static_pointer_cast<AgentCallback>(shared_from_this())));
 				}
@@ -851,16 +1790,17 @@ void QEMUController::OnQMPStateChange(QMPClient::QMPState state) {
 				qemu_running_ = false;
 #endif
 				IsStopped();
+			} else if(migration_state_ == MigrationState::kMigrated) {
+				// QEMU quit after the VM was migrated to another host
 			} else if(internal_state_ == InternalState::kQMPConnecting) {
-				std::cout << "QMP failed to connect. ";
 				// If we have exceeded the max number of connection attempts
-				if(++retry_count_ >= settings_->MaxAttempts) {
-					std::cout << "Max number attempts has been exceeded. Stopping..." << std::endl;
+				if(!IsFastRetryPeriod(connecting_since_) && ++retry_count_ >= settings_->MaxAttempts) {
+					Logger::Error() << "QMP failed to connect. Max number attempts has been exceeded. Stopping...";
 
 					error_code_ = ErrorCode::kQMPFailed;
 					Stop(StopReason::kError);
 				} else {
-					std::cout << "Retrying..." << std::endl;
+					Logger::Warning() << "QMP failed to connect. Retrying...";
 					// Retry connecting
 					//KillQEMU();
 					//StartQEMU();
@@ -868,7 +1808,7 @@ void QEMUController::OnQMPStateChange(QMPClient::QMPState state) {
 				}
 			} else if(internal_state_ == InternalState::kVNCConnecting ||
 					  internal_state_ == InternalState::kConnected) {
-				std::cout << "QMP unexpectedly disconnected. Reconnecting..." << std::endl;
+				Logger::Warning() << "QMP unexpectedly disconnected. Reconnecting...";
 				internal_state_ = InternalState::kQMPConnecting;
 				// Reset retry counter
 				retry_count_ = 0;
@@ -1073,6 +2013,14 @@ VMController::ControllerState QEMUController::GetState() const {
 	}
 }
 
+std::chrono::microseconds QEMUController::GetCPUTime() const {
+#ifndef _WIN32
+	if(qemu_running_)
+		return GetProcessCPUTime(qemu_pid_);
+#endif
+	return std::chrono::microseconds::zero();
+}
+
 void QEMUController::OnAddUser(CollabVMUser& user) {
 	user.vm_controller = this;
 	guac_client_.AddUser(*user.guac_user);
@@ -1082,3 +2030,146 @@ void QEMUController::OnRemoveUser(CollabVMUser& user) {
 	guac_client_.RemoveUser(*user.guac_user);
 	user.vm_controller = nullptr;
 }
+
+void QEMUController::OnIdleChanged() {
+	const VMSettings& settings = *settings_;
+	bool idle = IsIdle() && !migrated_here_;
+
+	// The VM's display is only kept here for the users that were watching
+	// it when it was migrated
+	if(IsIdle() && migration_state_ == MigrationState::kMigrated) {
+		Logger::Info("QEMU") << "Stopping the display of migrated VM \"" << settings.Name << "\" because nobody is viewing it";
+		Stop(StopReason::kRemove);
+		return;
+	}
+	guac_client_.SetPaused(idle && settings.IdlePolicy == VMSettings::IdlePolicyEnum::kIdleStopUpdates);
+
+	if(idle && settings.IdlePolicy == VMSettings::IdlePolicyEnum::kIdlePause) {
+		if(!idle_paused_ && qmp_->IsConnected()) {
+			Logger::Info("QEMU") << "Pausing VM \"" << settings.Name << "\" because nobody is viewing it";
+			idle_paused_ = true;
+			qmp_->SystemStop();
+		}
+	} else if(idle_paused_) {
+		qmp_->SystemResume();
+	}
+
+#ifdef __linux__
+	if(std::shared_ptr<CGroup> cgroup = std::atomic_load(&cgroup_))
+		UpdateCPULimit(*cgroup);
+#endif
+}
+
+#ifdef __linux__
+/**
+ * Gets the file name at the end of a path.
+ */
+static std::string GetFileName(const std::string& path) {
+	size_t slash = path.rfind('/');
+	return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+void QEMUController::WatchSockets() {
+	boost::system::error_code ec;
+	socket_watch_.close(ec);
+
+	std::vector<std::string> paths;
+	if(settings_->QMPSocketType == VMSettings::SocketType::kLocal)
+		paths.push_back(qmp_address_);
+	if(!vnc_address_.empty())
+		paths.push_back(vnc_address_);
+	if(paths.empty())
+		return;
+
+	// Without the watch, connecting is still retried on the timers
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd == -1)
+		return;
+
+	for(const std::string& path : paths) {
+		size_t slash = path.rfind('/');
+		std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+		// Watching the same directory twice only adds one watch
+		if(inotify_add_watch(fd, dir.c_str(), IN_CREATE | IN_MOVED_TO) == -1)
+			Logger::Error("QEMU") << "Failed to watch " << dir << " for QEMU's sockets";
+	}
+
+	socket_watch_.assign(fd, ec);
+	if(ec) {
+		::close(fd);
+		return;
+	}
+	ReadSocketWatch();
+}
+
+void QEMUController::ReadSocketWatch() {
+	std::weak_ptr<QEMUController> con(std::static_pointer_cast<QEMUController>(shared_from_this()));
+	socket_watch_.async_read_some(boost::asio::buffer(socket_events_), [con](const boost::system::error_code& ec, size_t bytes) {
+		auto ptr = con.lock();
+		if(!ptr || ec)
+			return;
+
+		for(size_t offset = 0; offset + sizeof(inotify_event) <= bytes;) {
+			const inotify_event* event = reinterpret_cast<const inotify_event*>(ptr->socket_events_ + offset);
+			offset += sizeof(inotify_event) + event->len;
+			if(!event->len)
+				continue;
+			ptr->OnSocketCreated(event->name);
+		}
+
+		// Both clients have connected once neither is connecting
+		if(ptr->IsVNCConnecting())
+			ptr->ReadSocketWatch();
+		else {
+			boost::system::error_code ec;
+			ptr->socket_watch_.close(ec);
+		}
+	});
+}
+
+void QEMUController::OnSocketCreated(const std::string& name) {
+	// Only a pending wait is cut short, an attempt that's already
+	// running is left to finish or to be retried
+	boost::system::error_code ec;
+	if(internal_state_ == InternalState::kQMPConnecting &&
+	   settings_->QMPSocketType == VMSettings::SocketType::kLocal && name == GetFileName(qmp_address_) &&
+	   timer_.expires_from_now(std::chrono::seconds(0), ec))
+		timer_.async_wait(std::bind(&QEMUController::StartQMPCallback,
+									std::static_pointer_cast<QEMUController>(shared_from_this()), std::placeholders::_1));
+
+	if(IsVNCConnecting() && !vnc_address_.empty() && name == GetFileName(vnc_address_) &&
+	   vnc_timer_.expires_from_now(std::chrono::seconds(0), ec))
+		vnc_timer_.async_wait(std::bind(&QEMUController::StartGuacClientCallback,
+										std::static_pointer_cast<QEMUController>(shared_from_this()), std::placeholders::_1));
+}
+
+void QEMUController::UpdateResourceLimits() {
+	const VMSettings& settings = *settings_;
+	std::shared_ptr<CGroup> cgroup = std::atomic_load(&cgroup_);
+	if(!cgroup) {
+		if(!settings.CPULimit && !settings.CPUWeight && !settings.MemoryHigh && !settings.IOWeight && !settings.IdleCPULimit)
+			return;
+
+		// The group is kept once it's created, so that a QEMU process
+		// that's already in it keeps running under the new limits
+		cgroup = std::make_shared<CGroup>("vm-" + settings.Name);
+		std::atomic_store(&cgroup_, cgroup);
+		if(qemu_running_)
+			cgroup->AddProcess(qemu_pid_);
+	}
+
+	UpdateCPULimit(*cgroup);
+	cgroup->SetCPUWeight(settings.CPUWeight);
+	cgroup->SetMemoryHigh(settings.MemoryHigh);
+	cgroup->SetIOWeight(settings.IOWeight);
+}
+
+void QEMUController::UpdateCPULimit(CGroup& cgroup) {
+	const VMSettings& settings = *settings_;
+	uint32_t limit = settings.CPULimit;
+	// The idle limit can only lower the normal one
+	if(settings.IdleCPULimit && IsIdle() && (!limit || settings.IdleCPULimit < limit))
+		limit = settings.IdleCPULimit;
+	cgroup.SetCPUMax(limit);
+}
+#endif
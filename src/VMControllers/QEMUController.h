@@ -3,6 +3,10 @@
 #include "Database/VMSettings.h"
 #include "GuacVNCClient.h"
 #include "Sockets/QMPClient.h"
+#include "VMControllers/CGroup.h"
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <boost/asio.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/system/error_code.hpp>
@@ -18,7 +22,8 @@ class QEMUController : public VMController, public QMPCallback {
 	enum ErrorCode {
 		kQEMUError, // QEMU returned a nonzero status code after terminating
 		kQMPFailed, // The QMP client failed to connect
-		kVNCFailed	// The VNC client failed to connect
+		kVNCFailed,	// The VNC client failed to connect
+		kOverlayFailed // The overlay of the base image couldn't be created
 	};
 
 	/**
@@ -38,7 +43,8 @@ class QEMUController : public VMController, public QMPCallback {
 	/**
 	 * Loads the snapshot by either sending the loadvm command to the monitor
 	 * or stopping QEMU and restarting it with the loadvm command line argument
-	 * depending on RestartForSnapshot.
+	 * depending on RestartForSnapshot. With HD snapshots, the boot snapshot
+	 * is loaded instead of restarting QEMU when it's available.
 	 */
 	void RestoreVMSnapshot() override;
 
@@ -46,6 +52,19 @@ class QEMUController : public VMController, public QMPCallback {
 
 	void ResetVM() override;
 
+	/**
+	 * Starts QEMU with -incoming. VMs that use HD snapshots can't be
+	 * migrated, because the changes to their disks are only kept in
+	 * QEMU's temporary image.
+	 */
+	bool StartIncoming(uint16_t port) override;
+
+	bool Migrate(const std::string& host, uint16_t port, const std::string& vnc_host, uint16_t vnc_port) override;
+
+	MigrationState GetMigrationState() const override {
+		return migration_state_;
+	}
+
 	void Stop(VMController::StopReason reason) override;
 
 	void CleanUp() override;
@@ -74,6 +93,8 @@ class QEMUController : public VMController, public QMPCallback {
 
 	ControllerState GetState() const override;
 
+	std::chrono::microseconds GetCPUTime() const override;
+
 	StopReason GetStopReason() const override {
 		return stop_reason_;
 	}
@@ -82,6 +103,10 @@ class QEMUController : public VMController, public QMPCallback {
 		guac_client_.UpdateThumbnail();
 	}
 
+	GuacClient& GetGuacClient() override {
+		return guac_client_;
+	}
+
 	/**
 	 * Callback for QMP state changes.
 	 */
@@ -92,7 +117,19 @@ class QEMUController : public VMController, public QMPCallback {
 
 	void OnRemoveUser(CollabVMUser& user) override;
 
+	/**
+	 * Stops reading display updates or pauses the VM while it's idle,
+	 * depending on its idle policy, and lowers its CPU limit.
+	 */
+	void OnIdleChanged() override;
+
    private:
+#ifdef USE_SYSTEM_CLOCK
+	typedef std::chrono::system_clock time_clock;
+#else
+	typedef std::chrono::steady_clock time_clock;
+#endif
+
 	/**
 	* Sets the command used for starting QEMU. The comand should
 	* not contain any of the following arguments:
@@ -102,11 +139,55 @@ class QEMUController : public VMController, public QMPCallback {
 
 	void InitQMP();
 
+	/**
+	 * Sets the address the VNC client connects to, which is a Unix domain
+	 * socket for local VNC sockets.
+	 */
+	void InitVNC();
+
+	/**
+	 * Passes the overlay areas to the VNC client, which recreates the
+	 * overlays before its next frame.
+	 */
+	void SetOverlays();
+	void SetLatencyProbe();
+
+	/**
+	 * Passes the CPUs to run the VNC client's frames on to it. In auto
+	 * mode they're read from QEMU's vCPU threads, which only exist once
+	 * QEMU is running.
+	 */
+	void SetCPUAffinity();
+
+	/**
+	 * Starts or stops recording the VM's sessions, from the VNC client's
+	 * next frame.
+	 */
+	void SetSessionRecording();
+
+	/**
+	 * Starts a new HLS stream of the VM's screen if it's enabled, or stops
+	 * the old one.
+	 */
+	void SetHLSStream();
+
+	/**
+	 * Passes the PNG and JPEG compression settings to the VNC client,
+	 * which uses them from its next frame.
+	 */
+	void SetImageProfiles();
+
 	/**
 	 * Start the QEMU process using the specified command.
 	 */
 	void StartQEMU();
 
+	/**
+	 * Connects the QMP and VNC clients to the QEMU process that was
+	 * just started or reattached to.
+	 */
+	void ConnectToQEMU();
+
 	/**
 	 * Stop the QEMU process by either sending it a quit command
 	 * via QMP or with a kill signal.
@@ -118,6 +199,48 @@ class QEMUController : public VMController, public QMPCallback {
 	 */
 	void OnQEMUStop();
 
+#ifndef _WIN32
+	/**
+	 * Gets the path of the qcow2 overlay that the VM's disk is written
+	 * to when it uses a shared base image.
+	 */
+	std::string GetOverlayPath() const;
+
+	/**
+	 * Creates the overlay of the base image if it doesn't exist yet. VMs
+	 * using HD snapshots get a new one each time QEMU starts instead.
+	 *
+	 * @return false if qemu-img failed to create it.
+	 */
+	bool CreateOverlay();
+
+	/**
+	 * Gets the path of the file that QEMU's process ID is written to
+	 * when it's left running after the server exits.
+	 */
+	std::string GetPidPath() const;
+
+	/**
+	 * Takes over the QEMU process that a previous server left running
+	 * for the VM, if there is one.
+	 *
+	 * @return Whether QEMU is already running.
+	 */
+	bool ReattachQEMU();
+
+	/**
+	 * Called once the QEMU process has exited, to stop or restart the VM.
+	 */
+	void OnQEMUExit(int exit_status);
+#endif
+#ifdef __linux__
+	/**
+	 * Waits for a QEMU process that was reattached to to exit. Only its
+	 * parent gets SIGCHLD for it, which isn't this server anymore.
+	 */
+	void WatchQEMUExit();
+#endif
+
 	/**
 	 * Terminates the QEMU process by sending the kill signal to it.
 	 */
@@ -126,19 +249,78 @@ class QEMUController : public VMController, public QMPCallback {
 	void StartQMPCallback(const boost::system::error_code& ec);
 
 	/**
-	 * Wait one second and attempt to connect with QMP.
+	 * Wait and attempt to connect with QMP. The wait is short while
+	 * QEMU is still starting, and one second after that.
 	 */
 	void StartQMP();
 
+	/**
+	 * Saves the boot snapshot of a QEMU process that was started paused
+	 * for HD snapshots, and then lets the VM run.
+	 */
+	void SaveBootSnapshot();
+
+	/**
+	 * Resets the VM by loading the boot snapshot, which discards every
+	 * change made to the RAM and disks since QEMU was started.
+	 *
+	 * @return false if there isn't a boot snapshot, so QEMU has to be
+	 *         restarted instead.
+	 */
+	bool LoadBootSnapshot();
+
 	void StartGuacClientCallback(const boost::system::error_code& ec);
 
 	void ProcessKillTimeout(const boost::system::error_code& ec);
 
 	/**
-	 * Wait one second and attempt to connect with the Guacamole client.
+	 * Polls the guest's vCPU time, disk operations and balloon size with
+	 * one batch of QMP queries every few seconds while QMP is connected,
+	 * and adds them to the VM's metrics. A poll is skipped if the last
+	 * one hasn't been answered yet, so a busy QEMU never gets a backlog.
+	 */
+	void ScheduleTelemetry();
+	void PollTelemetry();
+
+	/**
+	 * Sends the migrate command, and again after a delay if it fails,
+	 * since QEMU on the destination may not be listening yet.
+	 */
+	void StartMigration();
+
+	/**
+	 * Called with the status from QEMU's MIGRATION events.
+	 */
+	void OnMigrationStatus(const std::string& status);
+
+	/**
+	 * Quits the local QEMU process once the VM is running on the
+	 * destination, and reconnects the Guacamole client to it there.
+	 */
+	void OnMigrated();
+
+	/**
+	 * Wait and attempt to connect with the Guacamole client, the same
+	 * way as StartQMP(). It's retried on its own timer, so it connects
+	 * while the QMP client is still connecting.
 	 */
 	void StartGuacClient();
 
+	/**
+	 * Whether the Guacamole client should be connecting, which it does
+	 * from when QEMU is started until it connects.
+	 */
+	inline bool IsVNCConnecting() const {
+		return internal_state_ == InternalState::kQMPConnecting || internal_state_ == InternalState::kVNCConnecting;
+	}
+
+	/**
+	 * Whether since was less than kFastRetryPeriod ago. Failed connection
+	 * attempts during that time are retried quickly and aren't counted
+	 * towards the VM's MaxAttempts.
+	 */
+	bool IsFastRetryPeriod(time_clock::time_point since) const;
+
 	/**
 	 * Signal callback used to detect when the QEMU process has terminated.
 	 */
@@ -162,6 +344,34 @@ class QEMUController : public VMController, public QMPCallback {
 
 	void OnAgentDisconnect(bool protocol_error) override;
 
+#ifdef __linux__
+	/**
+	 * Starts watching the directories of QEMU's Unix domain sockets, so
+	 * the clients connect as soon as QEMU creates the sockets instead of
+	 * at their next retry.
+	 */
+	void WatchSockets();
+	void ReadSocketWatch();
+
+	/**
+	 * Connects the client whose socket has the given file name now,
+	 * if it's waiting to retry.
+	 */
+	void OnSocketCreated(const std::string& name);
+
+	/**
+	 * Applies the VM's resource limits to its cgroup, which is created
+	 * the first time any of them are set.
+	 */
+	void UpdateResourceLimits();
+
+	/**
+	 * Sets the CPU limit of the cgroup to the idle limit while
+	 * the VM is idle, and the normal one otherwise.
+	 */
+	void UpdateCPULimit(CGroup& cgroup);
+#endif
+
 	enum class InternalState {
 		kInactive, // The controller hasn't been started
 		//kQEMUStarting,	// The QEMU hypervisor is starting
@@ -191,6 +401,11 @@ class QEMUController : public VMController, public QMPCallback {
 
 	std::string qmp_address_;
 
+	/**
+	 * The path of QEMU's VNC server socket, or empty if it listens on TCP.
+	 */
+	std::string vnc_address_;
+
 	/**
 	 * The command used to start QEMU.
 	 */
@@ -204,20 +419,82 @@ class QEMUController : public VMController, public QMPCallback {
 	std::string snapshot_;
 
 	/**
-	 * The number of times the client has failed to connect to
-	 * either the QMP or VNC server. Once the count reaches the
-	 * max number of attempts the client will stop trying and an
-	 * error will occur.
+	 * The number of times the client has failed to connect to the
+	 * QMP server. Once the count reaches the max number of attempts
+	 * the client will stop trying and an error will occur.
 	 */
 	size_t retry_count_;
 
-	ErrorCode error_code_;
+	/**
+	 * When the QMP client started connecting to a new QEMU process.
+	 */
+	time_clock::time_point connecting_since_;
 
-#ifdef USE_SYSTEM_CLOCK
-	typedef std::chrono::system_clock time_clock;
-#else
-	typedef std::chrono::steady_clock time_clock;
-#endif
+	/**
+	 * The same as retry_count_ and connecting_since_, for the VNC server.
+	 */
+	size_t vnc_retry_count_;
+	time_clock::time_point vnc_connecting_since_;
+
+	/**
+	 * Set when QEMU was started paused so that the boot snapshot can be
+	 * saved once QMP connects.
+	 */
+	bool boot_snapshot_pending_;
+
+	/**
+	 * Whether the current QEMU process has a boot snapshot. It is saved in
+	 * the temporary image created by -snapshot, so it's lost when QEMU exits.
+	 */
+	std::atomic<bool> boot_snapshot_saved_;
+
+	/**
+	 * Set while the boot snapshot is being loaded, so the STOP event
+	 * caused by loadvm isn't mistaken for the VM shutting down.
+	 */
+	std::atomic<bool> loading_boot_snapshot_;
+
+	/**
+	 * Set when the VM was paused because it's idle, until QEMU reports
+	 * that it has resumed, so the STOP event isn't mistaken for the VM
+	 * shutting down.
+	 */
+	std::atomic<bool> idle_paused_;
+
+	/**
+	 * The port that QEMU waits for the VM to be migrated to it on when
+	 * it's started, or 0 to boot the VM.
+	 */
+	uint16_t incoming_port_;
+
+	std::atomic<MigrationState> migration_state_;
+
+	/**
+	 * Set when the current QEMU process received the VM from another host.
+	 * Users of the source host may still be watching it through there, so
+	 * it isn't paused or limited while it's idle here.
+	 */
+	std::atomic<bool> migrated_here_;
+
+	/**
+	 * Where the VM is being migrated to, and the VNC server that the
+	 * Guacamole client connects to once it's there.
+	 */
+	std::string migration_uri_;
+	std::string migrated_vnc_host_;
+	uint16_t migrated_vnc_port_;
+
+	/**
+	 * The number of times the migrate command has failed.
+	 */
+	unsigned migration_attempts_;
+
+	/**
+	 * Waits before the migrate command is sent again.
+	 */
+	boost::asio::steady_timer migration_timer_;
+
+	ErrorCode error_code_;
 
 	/**
 	 * This timer is used before attempting to connect to the QMP
@@ -225,12 +502,65 @@ class QEMUController : public VMController, public QMPCallback {
 	 */
 	boost::asio::steady_timer timer_;
 
+	/**
+	 * Waits before attempting to connect to the VNC server.
+	 */
+	boost::asio::steady_timer vnc_timer_;
+
+	/**
+	 * Waits between polls of the guest's resource use, and whether the
+	 * queries of the last one are still waiting for their results.
+	 */
+	boost::asio::steady_timer telemetry_timer_;
+	bool telemetry_pending_;
+
+	/**
+	 * The totals QEMU reported last, which the metrics are counted up
+	 * from, so they don't go back to zero when QEMU restarts.
+	 */
+	uint64_t last_vcpu_time_;
+	uint64_t last_disk_reads_;
+	uint64_t last_disk_writes_;
+
 #ifndef _WIN32
 	/**
 	 * Process ID of QEMU. Only valid when state_ != kInactive.
 	 */
 	pid_t qemu_pid_;
 	boost::asio::signal_set signal_;
+
+	/**
+	 * Whether QEMU was started by this server, rather than reattached to
+	 * after a previous server left it running, so it can be waited for.
+	 */
+	bool qemu_child_;
+
+	/**
+	 * Whether QEMU was left running when the controller stopped.
+	 */
+	bool qemu_detached_;
+#endif
+#ifdef __linux__
+	/**
+	 * An inotify descriptor watching for QEMU's Unix domain sockets
+	 * to be created while the clients are connecting.
+	 */
+	boost::asio::posix::stream_descriptor socket_watch_;
+	alignas(struct inotify_event) char socket_events_[4096];
+
+	/**
+	 * A pidfd that becomes readable when a reattached QEMU process exits.
+	 */
+	boost::asio::posix::stream_descriptor qemu_exit_watch_;
+#endif
+#ifdef __linux__
+	/**
+	 * The cgroup QEMU is run in, or null if the VM doesn't have any
+	 * resource limits. It's accessed with std::atomic_load() and
+	 * std::atomic_store(), because settings are changed from the
+	 * processing thread while QEMU is started from the controller's.
+	 */
+	std::shared_ptr<CGroup> cgroup_;
 #else
 	/**
 	 * Process information of QEMU on Windows. State message applies here.
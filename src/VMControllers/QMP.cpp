@@ -1,4 +1,5 @@
 #include "QMP.h"
+#include "Logger.h"
 //#include "QEMUController.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/reader.h"
@@ -47,7 +48,7 @@ void QMP::StartConnection(tcp::resolver::iterator endpoint_iter) {
 		return;
 
 	if(endpoint_iter != tcp::resolver::iterator()) {
-		std::cout << "Trying " << endpoint_iter->endpoint() << "...\n";
+		Logger::Info() << "Trying " << endpoint_iter->endpoint() << "...";
 
 		boost::system::error_code ec;
 		timer_.expires_from_now(std::chrono::seconds(10), ec);
@@ -191,10 +192,10 @@ void QMP::OnConnect(const boost::system::error_code& ec, tcp::resolver::iterator
 	// If the socket is closed it means that the connection timed-out
 	// and the callback for the timer closed it
 	if(!socket_.is_open()) {
-		std::cout << "QMP connection timed out" << std::endl;
+		Logger::Warning() << "QMP connection timed out";
 		StartConnection(++iterator);
 	} else if(ec) {
-		std::cout << "QMP connection failed: " << ec.message() << endl;
+		Logger::Error() << "QMP connection failed: " << ec.message();
 		boost::system::error_code ec;
 		socket_.close(ec);
 		StartConnection(++iterator);
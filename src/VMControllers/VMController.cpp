@@ -3,21 +3,69 @@
 #include "Database/VMSettings.h"
 #include <boost/asio.hpp>
 
+VMMetrics::VMMetrics(const std::string& name)
+	: tracer(std::make_shared<FrameTracer>(name)),
+	  qmp_round_trip(std::make_shared<MetricHistogram>()) {
+	Metrics& metrics = Metrics::Get();
+	std::string labels = Metrics::Label("vm", name);
+	metrics.Add("collabvm_viewers", "Users viewing the VM.", labels, viewers);
+	metrics.Add("collabvm_frames_total", "Frames sent to the viewers of the VM.", labels, frames);
+	metrics.Add("collabvm_skipped_frames_total", "Frames skipped because the encoder couldn't keep up.", labels, skipped_frames);
+	metrics.Add("collabvm_sent_bytes_total", "Bytes of display updates sent to the viewers of the VM.", labels, sent_bytes);
+	metrics.Add("collabvm_qmp_round_trip_seconds", "How long QEMU took to answer a QMP command.", labels, *qmp_round_trip);
+	metrics.Add("collabvm_input_latency_seconds", "How long the guest took to show the latency probe's key press.", labels, input_latency);
+	metrics.Add("collabvm_input_probe_timeouts_total", "Latency probes the guest's screen never responded to.", labels, input_probe_timeouts);
+	metrics.Add("collabvm_guest_vcpu_microseconds_total", "CPU time used by the guest's vCPU threads.", labels, guest_vcpu_time);
+	metrics.Add("collabvm_guest_disk_reads_total", "Read operations completed by the guest's disks.", labels, guest_disk_reads);
+	metrics.Add("collabvm_guest_disk_writes_total", "Write operations completed by the guest's disks.", labels, guest_disk_writes);
+	metrics.Add("collabvm_guest_balloon_bytes", "Memory the guest has after ballooning.", labels, guest_balloon_bytes);
+	metrics.Add("collabvm_encode_wait_seconds", "How long the VM's encode jobs waited for an encoder thread.", labels, encode_wait);
+	metrics.Add("collabvm_egress_bytes_total", "Bytes written to the connections of the VM's viewers.", labels, egress_bytes);
+}
+
+VMMetrics::~VMMetrics() {
+	Metrics& metrics = Metrics::Get();
+	metrics.Remove(&viewers);
+	metrics.Remove(&frames);
+	metrics.Remove(&skipped_frames);
+	metrics.Remove(&sent_bytes);
+	metrics.Remove(qmp_round_trip.get());
+	metrics.Remove(&input_latency);
+	metrics.Remove(&input_probe_timeouts);
+	metrics.Remove(&guest_vcpu_time);
+	metrics.Remove(&guest_disk_reads);
+	metrics.Remove(&guest_disk_writes);
+	metrics.Remove(&guest_balloon_bytes);
+	metrics.Remove(&encode_wait);
+	metrics.Remove(&egress_bytes);
+}
+
 VMController::VMController(CollabVMServer& server, boost::asio::io_service& service, const std::shared_ptr<VMSettings>& settings)
 	: server_(server),
 	  io_service_(service),
 	  settings_(settings),
+	  metrics_(settings->Name),
+	  encoder_client_(&metrics_.encode_wait),
 	  turn_timer_(service),
 	  vote_state_(VoteState::kIdle),
 	  vote_count_yes_(0),
 	  vote_count_no_(0),
 	  vote_timer_(service),
+	  idle_timer_(service),
+	  idle_(false),
 	  current_turn_(nullptr),
 	  connected_users_(0),
 	  stop_reason_(StopReason::kNormal),
-	  thumbnail_str_(nullptr),
 	  agent_timer_(service),
-	  agent_connected_(false) {
+	  agent_connected_(false),
+	  thumbnail_version_(0) {
+	MemoryAccounting::Get().AddVM(settings->Name, memory_);
+	UpdateEncoderWeight(*settings);
+}
+
+VMController::~VMController() {
+	ClearVotes();
+	MemoryAccounting::Get().RemoveVM(memory_);
 }
 
 void VMController::InitAgent(const VMSettings& settings, boost::asio::io_service& service) {
@@ -65,18 +113,29 @@ void VMController::ChangeSettings(const std::shared_ptr<VMSettings>& settings) {
 			  !settings->MOTD.empty()) {
 		server_.BroadcastMOTD(*this, *settings);
 	}
+
+	if(settings->EncoderWeight != settings_->EncoderWeight)
+		UpdateEncoderWeight(*settings);
+}
+
+void VMController::UpdateEncoderWeight(const VMSettings& settings) {
+	// Every doubling of the viewers adds the weight once more, so a busy VM
+	// gets more of the threads without a crowd starving the rest
+	unsigned weight = settings.EncoderWeight ? settings.EncoderWeight : EncoderPool::kDefaultWeight;
+	unsigned share = 1;
+	for(size_t viewers = users_.GetCount(); viewers; viewers >>= 1)
+		share++;
+	encoder_client_.SetWeight(weight * share);
 }
 
 void VMController::Stop(StopReason reason) {
 	boost::system::error_code ec;
 	turn_timer_.cancel(ec);
 	vote_timer_.cancel(ec);
+	idle_timer_.cancel(ec);
 	agent_timer_.cancel(ec);
 
-	if(thumbnail_str_) {
-		delete thumbnail_str_;
-		thumbnail_str_ = nullptr;
-	}
+	SetThumbnail(nullptr, thumbnail_version_);
 
 	server_.OnVMControllerStateChange(shared_from_this(), VMController::ControllerState::kStopping);
 }
@@ -105,6 +164,7 @@ void VMController::Vote(CollabVMUser& user, bool vote) {
 					boost::system::error_code ec;
 					vote_timer_.expires_from_now(std::chrono::seconds(settings_->VoteTime), ec);
 					vote_timer_.async_wait(std::bind(&VMController::VoteEndedCallback, shared_from_this(), std::placeholders::_1));
+					SetVote(user.ip_data, IPData::VoteDecision::kYes);
 					server_.UserStartedVote(*this, users_, user);
 					server_.BroadcastVoteInfo(*this, users_, true, std::chrono::duration_cast<millisecs_t>(vote_timer_.expires_from_now()).count(), vote_count_yes_, vote_count_no_);
 				}
@@ -112,7 +172,7 @@ void VMController::Vote(CollabVMUser& user, bool vote) {
 			case VoteState::kVoting: {
 				int32_t time_remaining = std::chrono::duration_cast<millisecs_t>(vote_timer_.expires_from_now()).count();
 				if(time_remaining > 0) {
-					IPData::VoteDecision prev_vote = user.ip_data.votes[this];
+					IPData::VoteDecision prev_vote = GetVote(user.ip_data);
 					bool changed = false;
 					if(user.voted_limit == false) {
 						if(user.voted_amount >= 5) {
@@ -141,6 +201,7 @@ void VMController::Vote(CollabVMUser& user, bool vote) {
 					}
 
 					if(changed) {
+						SetVote(user.ip_data, vote ? IPData::VoteDecision::kYes : IPData::VoteDecision::kNo);
 						server_.UserVoted(*this, users_, user, vote);
 						server_.BroadcastVoteInfo(*this, users_, false, time_remaining, vote_count_yes_, vote_count_no_);
 					}
@@ -175,6 +236,7 @@ void VMController::SkipVote(bool pass) {
 
 void VMController::EndVoteCommonLogic(bool vote_passed) {
 	server_.BroadcastVoteEnded(*this, users_, vote_passed);
+	ClearVotes();
 
 	if(settings_->VoteCooldownTime) {
 		vote_state_ = VoteState::kCoolingdown;
@@ -193,6 +255,32 @@ void VMController::EndVoteCommonLogic(bool vote_passed) {
 		RestoreVMSnapshot();
 }
 
+IPData::VoteDecision VMController::GetVote(IPData& ip_data) const {
+	auto it = ballots_.find(&ip_data);
+	return it != ballots_.end() ? it->second : IPData::VoteDecision::kNotVoted;
+}
+
+void VMController::SetVote(IPData& ip_data, IPData::VoteDecision decision) {
+	auto it = ballots_.find(&ip_data);
+	if(decision == IPData::VoteDecision::kNotVoted) {
+		if(it != ballots_.end()) {
+			ballots_.erase(it);
+			ip_data.ballots--;
+		}
+	} else if(it != ballots_.end()) {
+		it->second = decision;
+	} else {
+		ballots_.emplace(&ip_data, decision);
+		ip_data.ballots++;
+	}
+}
+
+void VMController::ClearVotes() {
+	for(auto& ballot : ballots_)
+		ballot.first->ballots--;
+	ballots_.clear();
+}
+
 void VMController::TurnRequest(const std::shared_ptr<CollabVMUser>& user, bool turnJack, bool isStaff) {
 	// If the user is already in the queue or they are already
 	// in control don't allow them to make another turn request
@@ -201,14 +289,11 @@ void VMController::TurnRequest(const std::shared_ptr<CollabVMUser>& user, bool t
 		return;
 
 	if(user->waiting_turn) {
-		for(auto it = turn_queue_.begin(); it != turn_queue_.end(); it++) {
-			if(*it == user) {
-				turn_queue_.erase(it);
-				user->waiting_turn = false;
-				break;
-			}
-		}
-	};
+		turn_queue_.erase(user->turn_queue_it);
+		user->waiting_turn = false;
+	}
+
+	TurnUpdate update = { TurnUpdate::Type::kTake, user.get() };
 
 	if(!current_turn_) {
 		// If no one currently has a turn then give the requesting user control
@@ -220,11 +305,12 @@ void VMController::TurnRequest(const std::shared_ptr<CollabVMUser>& user, bool t
 	} else {
 		if(!turnJack) {
 			// Otherwise add them to the queue
-			turn_queue_.push_back(user);
+			user->turn_queue_it = turn_queue_.insert(turn_queue_.end(), user);
 			user->waiting_turn = true;
+			update.type = TurnUpdate::Type::kEnqueue;
 		} else {
 			// Turn-jack
-			turn_queue_.push_front(current_turn_);
+			current_turn_->turn_queue_it = turn_queue_.insert(turn_queue_.begin(), current_turn_);
 			current_turn_->waiting_turn = true;
 			current_turn_ = user;
 
@@ -235,8 +321,59 @@ void VMController::TurnRequest(const std::shared_ptr<CollabVMUser>& user, bool t
 		}
 	};
 
+	PublishTurn();
 	server_.BroadcastTurnInfo(*this, users_, turn_queue_, current_turn_.get(),
-							  std::chrono::duration_cast<millisecs_t>(turn_timer_.expires_from_now()).count());
+							  std::chrono::duration_cast<millisecs_t>(turn_timer_.expires_from_now()).count(), update);
+}
+
+size_t VMController::GetTurnPosition(const CollabVMUser& user) const {
+	if(current_turn_.get() == &user)
+		return 0;
+	if(!user.waiting_turn)
+		return kNoTurn;
+	return std::distance(turn_queue_.begin(), TurnQueue::const_iterator(user.turn_queue_it)) + 1;
+}
+
+std::vector<size_t> VMController::GetTurnPositions(const std::vector<std::shared_ptr<CollabVMUser>>& users) const {
+	std::vector<size_t> positions(users.size(), kNoTurn);
+	std::unordered_map<const CollabVMUser*, size_t> waiting;
+	for(size_t i = 0; i < users.size(); i++) {
+		if(current_turn_ == users[i])
+			positions[i] = 0;
+		else if(users[i]->waiting_turn)
+			waiting.emplace(users[i].get(), i);
+	}
+
+	size_t position = 1;
+	for(auto it = turn_queue_.begin(); it != turn_queue_.end() && !waiting.empty(); it++, position++) {
+		auto user = waiting.find(it->get());
+		if(user != waiting.end()) {
+			positions[user->second] = position;
+			waiting.erase(user);
+		}
+	}
+	return positions;
+}
+
+void VMController::ResumeTurn(const std::shared_ptr<CollabVMUser>& user, size_t position) {
+	if(position == kNoTurn || GetState() != ControllerState::kRunning || !settings_->TurnsEnabled ||
+	   user->waiting_turn || current_turn_ == user)
+		return;
+
+	// With nobody in control the user takes it like any request would
+	if(!current_turn_) {
+		TurnRequest(user, false, false);
+		return;
+	}
+
+	size_t index = std::min(position ? position - 1 : 0, turn_queue_.size());
+	TurnUpdate update = { index == turn_queue_.size() ? TurnUpdate::Type::kEnqueue : TurnUpdate::Type::kReset, user.get() };
+	user->turn_queue_it = turn_queue_.insert(std::next(turn_queue_.begin(), index), user);
+	user->waiting_turn = true;
+
+	PublishTurn();
+	server_.BroadcastTurnInfo(*this, users_, turn_queue_, current_turn_.get(),
+							  std::chrono::duration_cast<millisecs_t>(turn_timer_.expires_from_now()).count(), update);
 }
 
 void VMController::NextTurn() {
@@ -256,17 +393,38 @@ void VMController::NextTurn() {
 		time_remaining = 0;
 	}
 
-	server_.BroadcastTurnInfo(*this, users_, turn_queue_, current_turn_.get(), time_remaining);
+	PublishTurn();
+	server_.BroadcastTurnInfo(*this, users_, turn_queue_, current_turn_.get(), time_remaining,
+							  { TurnUpdate::Type::kAdvance, nullptr });
 }
 
-void VMController::ClearTurnQueue() {
-	auto it = turn_queue_.begin();
-	while(it != turn_queue_.end()) {
-		(*it)->waiting_turn = false;
-		it = turn_queue_.erase(it);
+void VMController::PublishTurn() {
+	if(published_turn_ == current_turn_)
+		return;
+
+	if(published_turn_) {
+		std::atomic_store(&published_turn_->input_client, std::shared_ptr<GuacClient>());
+		published_turn_->display_priority = published_turn_->user_rank == UserRank::kAdmin;
 	}
+
+	// The input client shares ownership of this controller so
+	// that it can't be destroyed while input is being sent to it
+	if(current_turn_) {
+		std::atomic_store(&current_turn_->input_client, std::shared_ptr<GuacClient>(shared_from_this(), &GetGuacClient()));
+		current_turn_->display_priority = true;
+	}
+
+	published_turn_ = current_turn_;
+}
+
+void VMController::ClearTurnQueue() {
+	for(const auto& user : turn_queue_)
+		user->waiting_turn = false;
+	turn_queue_.clear();
 	current_turn_ = nullptr;
-	server_.BroadcastTurnInfo(*this, users_, turn_queue_, current_turn_.get(), 0);
+	PublishTurn();
+	server_.BroadcastTurnInfo(*this, users_, turn_queue_, current_turn_.get(), 0,
+							  { TurnUpdate::Type::kReset, nullptr });
 }
 
 void VMController::TurnTimerCallback(const boost::system::error_code& ec) {
@@ -276,6 +434,43 @@ void VMController::TurnTimerCallback(const boost::system::error_code& ec) {
 	server_.OnVMControllerTurnChange(shared_from_this());
 }
 
+void VMController::IdleTimerCallback(const boost::system::error_code& ec) {
+	if(ec)
+		return;
+
+	server_.OnVMControllerIdle(shared_from_this());
+}
+
+void VMController::StartIdleTimer() {
+	idle_since_ = std::chrono::steady_clock::now();
+	if(!settings_->IdleTimeout) {
+		EnterIdle();
+		return;
+	}
+
+	boost::system::error_code ec;
+	idle_timer_.expires_from_now(std::chrono::seconds(settings_->IdleTimeout), ec);
+	idle_timer_.async_wait(std::bind(&VMController::IdleTimerCallback, shared_from_this(), std::placeholders::_1));
+}
+
+void VMController::ResetIdle() {
+	if(idle_) {
+		idle_ = false;
+		OnIdleChanged();
+	}
+	if(!users_.GetCount())
+		StartIdleTimer();
+}
+
+void VMController::EnterIdle() {
+	if(idle_ || users_.GetCount() ||
+	   std::chrono::steady_clock::now() - idle_since_ < std::chrono::seconds(settings_->IdleTimeout))
+		return;
+
+	idle_ = true;
+	OnIdleChanged();
+}
+
 void VMController::OnAgentConnect(const std::string& os_name, const std::string& service_pack,
 								  const std::string& pc_name, const std::string& username, uint32_t max_filename) {
 	server_.OnAgentConnect(shared_from_this(), os_name, service_pack, pc_name, username, max_filename);
@@ -311,46 +506,102 @@ void VMController::OnFileUploadExecFinished(const std::shared_ptr<UploadInfo>& i
 
 void VMController::EndTurn(const std::shared_ptr<CollabVMUser>& user) {
 	bool turn_change = false;
+	TurnUpdate update = {};
 	// Check if they are in the turn queue and remove them if they are
 	if(user->waiting_turn) {
-		for(auto it = turn_queue_.begin(); it != turn_queue_.end(); it++) {
-			if(*it == user) {
-				turn_change = true;
-				turn_queue_.erase(it);
-				user->waiting_turn = false;
-				// The client should not be in the queue more than once
-				break;
-			}
-		}
+		turn_change = true;
+		update = { TurnUpdate::Type::kRemove, user.get() };
+		turn_queue_.erase(user->turn_queue_it);
+		user->waiting_turn = false;
 	}
 
 	// Check if it is currently their turn
 	if(current_turn_ == user) {
-		// Cancel the pending timer callback
-		boost::system::error_code ec;
-		turn_timer_.cancel(ec);
-
-		if(!turn_queue_.empty()) {
-			current_turn_ = turn_queue_.front();
-			current_turn_->waiting_turn = false;
-			turn_queue_.pop_front();
-
-			// Set up the turn timer
-			turn_timer_.expires_from_now(std::chrono::seconds(settings_->TurnTime), ec);
-			turn_timer_.async_wait(std::bind(&VMController::TurnTimerCallback, shared_from_this(), std::placeholders::_1));
-		} else
-			current_turn_ = nullptr;
+		PassTurn();
 
+		// A user can't be waiting and in control at the same time, but
+		// resend the whole queue if that ever happens
+		update.type = turn_change ? TurnUpdate::Type::kReset : TurnUpdate::Type::kAdvance;
 		turn_change = true;
 	}
 
-	if(turn_change)
+	if(turn_change) {
+		PublishTurn();
 		server_.BroadcastTurnInfo(*this, users_, turn_queue_, current_turn_.get(),
-								  current_turn_ ? std::chrono::duration_cast<millisecs_t>(turn_timer_.expires_from_now()).count() : 0);
+								  current_turn_ ? std::chrono::duration_cast<millisecs_t>(turn_timer_.expires_from_now()).count() : 0, update);
+	}
+}
+
+void VMController::EndTurns(const std::vector<std::shared_ptr<CollabVMUser>>& users) {
+	if(users.size() == 1) {
+		EndTurn(users.front());
+		return;
+	}
+
+	// A single change is sent like EndTurn() would, and the whole queue
+	// is sent again after more than one
+	TurnUpdate update = {};
+	size_t changes = 0;
+	bool had_turn = false;
+	for(const std::shared_ptr<CollabVMUser>& user : users) {
+		if(user->waiting_turn) {
+			update = { TurnUpdate::Type::kRemove, user.get() };
+			turn_queue_.erase(user->turn_queue_it);
+			user->waiting_turn = false;
+			changes++;
+		}
+		if(current_turn_ == user)
+			had_turn = true;
+	}
+
+	// Everyone leaving was taken out of the queue first, so the turn
+	// isn't passed to one of them
+	if(had_turn) {
+		PassTurn();
+		update.type = TurnUpdate::Type::kAdvance;
+		changes++;
+	}
+
+	if(!changes)
+		return;
+	if(changes > 1)
+		update.type = TurnUpdate::Type::kReset;
+	PublishTurn();
+	server_.BroadcastTurnInfo(*this, users_, turn_queue_, current_turn_.get(),
+							  current_turn_ ? std::chrono::duration_cast<millisecs_t>(turn_timer_.expires_from_now()).count() : 0, update);
+}
+
+void VMController::PassTurn() {
+	// Cancel the pending timer callback
+	boost::system::error_code ec;
+	turn_timer_.cancel(ec);
+
+	if(!turn_queue_.empty()) {
+		current_turn_ = turn_queue_.front();
+		current_turn_->waiting_turn = false;
+		turn_queue_.pop_front();
+
+		// Set up the turn timer
+		turn_timer_.expires_from_now(std::chrono::seconds(settings_->TurnTime), ec);
+		turn_timer_.async_wait(std::bind(&VMController::TurnTimerCallback, shared_from_this(), std::placeholders::_1));
+	} else
+		current_turn_ = nullptr;
 }
 
 void VMController::AddUser(const std::shared_ptr<CollabVMUser>& user) {
 	users_.AddUser(*user, [this](CollabVMUser& user) { OnAddUser(user); });
+	metrics_.viewers.Set(users_.GetCount());
+	UpdateEncoderWeight(*settings_);
+
+	// Resume the VM as soon as someone is viewing it again
+	if(users_.GetCount() == 1) {
+		boost::system::error_code ec;
+		idle_timer_.cancel(ec);
+		if(idle_) {
+			idle_ = false;
+			OnIdleChanged();
+		}
+	}
 
 	int32_t time_remaining;
 	if(current_turn_) {
@@ -366,27 +617,39 @@ void VMController::AddUser(const std::shared_ptr<CollabVMUser>& user) {
 	}
 }
 
-void VMController::RemoveUser(const std::shared_ptr<CollabVMUser>& user) {
-	// Remove the user's vote
-	IPData::VoteDecision prev_vote = user->ip_data.votes[this];
+void VMController::RemoveUsers(const std::vector<std::shared_ptr<CollabVMUser>>& users) {
+	// Remove the users' votes, and send the new counts once
 	int32_t time_remaining = std::chrono::duration_cast<millisecs_t>(vote_timer_.expires_from_now()).count();
-	if(vote_state_ == VoteState::kVoting && time_remaining > 0 && prev_vote != IPData::VoteDecision::kNotVoted) {
-		if(prev_vote == IPData::VoteDecision::kYes)
-			vote_count_yes_--;
-		else if(prev_vote == IPData::VoteDecision::kNo)
-			vote_count_no_--;
-
-		user->ip_data.votes[this] = IPData::VoteDecision::kNotVoted;
-		server_.BroadcastVoteInfo(*this, users_, false, time_remaining, vote_count_yes_, vote_count_no_);
+	if(vote_state_ == VoteState::kVoting && time_remaining > 0) {
+		bool votes_changed = false;
+		for(const std::shared_ptr<CollabVMUser>& user : users) {
+			IPData::VoteDecision prev_vote = GetVote(user->ip_data);
+			if(prev_vote == IPData::VoteDecision::kNotVoted)
+				continue;
+			if(prev_vote == IPData::VoteDecision::kYes)
+				vote_count_yes_--;
+			else if(prev_vote == IPData::VoteDecision::kNo)
+				vote_count_no_--;
+
+			SetVote(user->ip_data, IPData::VoteDecision::kNotVoted);
+			votes_changed = true;
+		}
+		if(votes_changed)
+			server_.BroadcastVoteInfo(*this, users_, false, time_remaining, vote_count_yes_, vote_count_no_);
 	}
 
-	EndTurn(user);
+	EndTurns(users);
+
+	users_.RemoveUsers(users, [this](CollabVMUser& user) { OnRemoveUser(user); });
+	metrics_.viewers.Set(users_.GetCount());
+	UpdateEncoderWeight(*settings_);
 
-	users_.RemoveUser(*user, [this](CollabVMUser& user) { OnRemoveUser(user); });
+	if(!users_.GetCount() && IsRunning())
+		StartIdleTimer();
 }
 
-void VMController::NewThumbnail(std::string* str) {
-	server_.OnVMControllerThumbnailUpdate(shared_from_this(), str);
+void VMController::NewThumbnail(const std::shared_ptr<const VMThumbnail>& thumbnail) {
+	server_.OnVMControllerThumbnailUpdate(shared_from_this(), thumbnail);
 }
 
 bool VMController::IsFileUploadValid(const std::shared_ptr<CollabVMUser>& user, const std::string& filename, size_t file_size, bool run_file) {
@@ -5,18 +5,160 @@
 #include <mutex>
 #include <string>
 #include <deque>
+#include <list>
 #include <stdint.h>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 #include "CollabVMUser.h"
 #include "UploadInfo.h"
 #include "GuacClient.h"
+#include "MemoryAccounting.h"
+#include "FrameTrace.h"
+#include "Metrics.h"
+#include "EncoderPool.h"
+#include "ImageEncoder.h"
 #include "UserList.h"
 #include "Sockets/AgentClient.h"
 
 class CollabVMServer;
 struct VMSettings;
 
+/**
+ * A preview of a VM's display, which is served over HTTP for the VM list.
+ * It's rendered at a few widths, each encoded in every format the server
+ * can encode, so clients can pick the smallest image that fits.
+ */
+struct VMThumbnail {
+	/**
+	 * The length of the longest side of the image at each size, which is
+	 * smaller if the display is.
+	 */
+	constexpr static int kSizes[] = { 160, 400, 800 };
+	constexpr static size_t kSizeCount = sizeof(kSizes) / sizeof(*kSizes);
+
+	/**
+	 * The size that's saved to disk and sent when none is asked for.
+	 */
+	constexpr static size_t kDefaultSize = 1;
+
+	/**
+	 * The encoded images by size and format. Formats that couldn't be
+	 * encoded are empty, and a thumbnail loaded from disk only has the
+	 * PNG image of the default size.
+	 */
+	std::vector<uint8_t> images[kSizeCount][static_cast<size_t>(ImageFormat::kCount)];
+
+	/**
+	 * The copy of the display that the thumbnail was rendered from, in
+	 * RGB24, which screenshots are encoded from. Thumbnails loaded from
+	 * disk don't have one.
+	 */
+	std::shared_ptr<const std::vector<unsigned char>> screen;
+	int screen_width = 0;
+	int screen_height = 0;
+	int screen_stride = 0;
+
+	/**
+	 * The screenshots encoded from the screen, which are only encoded
+	 * when they're first asked for, once for each format.
+	 */
+	struct Screenshots {
+		std::mutex lock;
+		std::vector<uint8_t> images[static_cast<size_t>(ImageFormat::kCount)];
+	};
+	const std::unique_ptr<Screenshots> screenshots = std::make_unique<Screenshots>();
+
+	std::vector<uint8_t>& GetImage(size_t size, ImageFormat format) {
+		return images[size][static_cast<size_t>(format)];
+	}
+
+	const std::vector<uint8_t>& GetImage(size_t size, ImageFormat format) const {
+		return images[size][static_cast<size_t>(format)];
+	}
+
+	/**
+	 * The PNG image of the default size, which every thumbnail has.
+	 */
+	const std::vector<uint8_t>& GetDefaultImage() const {
+		return GetImage(kDefaultSize, ImageFormat::kPNG);
+	}
+
+	/**
+	 * The bytes of all of the images, for the memory accounting.
+	 */
+	size_t GetMemoryUsage() const {
+		size_t bytes = screen ? screen->size() : 0;
+		for(const auto& size : images)
+			for(const std::vector<uint8_t>& image : size)
+				bytes += image.size();
+		return bytes;
+	}
+};
+
+/**
+ * The metrics of a VM, which are labelled with its name.
+ */
+struct VMMetrics {
+	explicit VMMetrics(const std::string& name);
+	~VMMetrics();
+
+	MetricGauge viewers;
+
+	/**
+	 * The frames sent to viewers, and how long each stage of sending
+	 * them took. The tracer is shared with the traces of the frames,
+	 * which can outlive the VM's controller.
+	 */
+	MetricCounter frames;
+	std::shared_ptr<FrameTracer> tracer;
+
+	/**
+	 * The frames that weren't sent because encoding the previous one took
+	 * longer than a frame.
+	 */
+	MetricCounter skipped_frames;
+
+	/**
+	 * The bytes of the display updates broadcast to the viewers.
+	 */
+	MetricCounter sent_bytes;
+
+	/**
+	 * How long QMP commands took to be answered. It's shared with the
+	 * QMP client, which can outlive the VM's controller.
+	 */
+	std::shared_ptr<MetricHistogram> qmp_round_trip;
+
+	/**
+	 * How long the guest took to show the key presses of the latency
+	 * probe on its screen, and the probes it never responded to.
+	 */
+	MetricHistogram input_latency;
+	MetricCounter input_probe_timeouts;
+
+	/**
+	 * The guest's resource use, polled from the hypervisor. The vCPU time
+	 * is in microseconds, and the balloon is 0 without a balloon device.
+	 */
+	MetricCounter guest_vcpu_time;
+	MetricCounter guest_disk_reads;
+	MetricCounter guest_disk_writes;
+	MetricGauge guest_balloon_bytes;
+
+	/**
+	 * How long the VM's encode jobs waited for an encoder thread.
+	 */
+	MetricHistogram encode_wait;
+
+	/**
+	 * The bytes written to the connections of the VM's viewers, including
+	 * chat and everything else they were sent.
+	 */
+	MetricCounter egress_bytes;
+};
+
 /**
  * A base class that is responsible for starting the hypervisor, running the VM,
  * creating a Guacamole client, and possibly a guest service controller. Derived
@@ -27,7 +169,7 @@ class VMController : public std::enable_shared_from_this<VMController>, public A
 
    public:
 
-	virtual ~VMController() = default;
+	virtual ~VMController();
 
 	virtual void ChangeSettings(const std::shared_ptr<VMSettings>& settings);
 
@@ -40,7 +182,8 @@ class VMController : public std::enable_shared_from_this<VMController>, public A
 		kNormal,  // The controller was stopped normally
 		kRestart, // The controller should be restarted
 		kRemove,  // The controller is being deleted
-		kError	  // The controller failed to start
+		kError,	  // The controller failed to start
+		kShutdown // The server is exiting
 	};
 
 	enum ControllerState {
@@ -73,6 +216,47 @@ class VMController : public std::enable_shared_from_this<VMController>, public A
 
 	virtual void ResetVM() = 0;
 
+	enum class MigrationState {
+		kNone,
+		kIncoming, // Waiting for the VM to be migrated from another host
+		kOutgoing, // The VM is being migrated to another host
+		kMigrated  // The VM runs on another host, and its display is relayed to the users
+	};
+
+	/**
+	 * Starts the hypervisor waiting for the VM to be migrated to it over
+	 * TCP on the given port, instead of booting the VM.
+	 *
+	 * @return false if the VM can't be migrated.
+	 */
+	virtual bool StartIncoming(uint16_t port) {
+		return false;
+	}
+
+	/**
+	 * Migrates the running VM to a hypervisor on another host that was
+	 * started with StartIncoming(). Once the VM is there the local
+	 * hypervisor exits, and the Guacamole client connects to the VM's VNC
+	 * server on the other host instead, so the users stay connected.
+	 *
+	 * @return false if the VM can't be migrated.
+	 */
+	virtual bool Migrate(const std::string& host, uint16_t port, const std::string& vnc_host, uint16_t vnc_port) {
+		return false;
+	}
+
+	virtual MigrationState GetMigrationState() const {
+		return MigrationState::kNone;
+	}
+
+	/**
+	 * Gets the CPU time the hypervisor has used since it was started,
+	 * or zero if it isn't running or it can't be measured.
+	 */
+	virtual std::chrono::microseconds GetCPUTime() const {
+		return std::chrono::microseconds::zero();
+	}
+
 	/**
 	 * Callback for when the Guacamole client is initialized.
 	 */
@@ -106,11 +290,37 @@ class VMController : public std::enable_shared_from_this<VMController>, public A
 
 	virtual StopReason GetStopReason() const = 0;
 
+	/**
+	 * Describes a change to the turn queue, so that clients which support
+	 * turn updates can be sent the change instead of the whole queue.
+	 */
+	struct TurnUpdate {
+		enum class Type {
+			kEnqueue, // The user joined the end of the queue
+			kRemove,  // The user left the queue
+			kAdvance, // The user at the front of the queue was given control, or nobody if it's empty
+			kTake,	  // The user took control and the previous controller went to the front of the queue
+			kReset	  // The queue was changed in some other way and has to be sent again
+		} type;
+		CollabVMUser* user;
+	};
+
 	void EndTurn(const std::shared_ptr<CollabVMUser>& user);
 
+	/**
+	 * Ends the turns of several users at once, taking them all out of the
+	 * queue before the turn is passed on, and sending the change once.
+	 */
+	void EndTurns(const std::vector<std::shared_ptr<CollabVMUser>>& users);
+
 	void AddUser(const std::shared_ptr<CollabVMUser>& user);
 
-	void RemoveUser(const std::shared_ptr<CollabVMUser>& user);
+	/**
+	 * Removes users that disconnected, such as the thousands that leave at
+	 * once when a network drops, sending the changes to the votes and the
+	 * turn queue once for all of them.
+	 */
+	void RemoveUsers(const std::vector<std::shared_ptr<CollabVMUser>>& users);
 
 	void Vote(CollabVMUser& user, bool vote);
 
@@ -120,6 +330,32 @@ class VMController : public std::enable_shared_from_this<VMController>, public A
 
 	void TurnRequest(const std::shared_ptr<CollabVMUser>& user, bool turnJack, bool isStaff);
 
+	/**
+	 * The value of GetTurnPosition() for users that aren't in control or
+	 * waiting for a turn.
+	 */
+	constexpr static size_t kNoTurn = SIZE_MAX;
+
+	/**
+	 * @return Zero if the user is in control, one more than their index in
+	 *         the turn queue if they're waiting, or kNoTurn.
+	 */
+	size_t GetTurnPosition(const CollabVMUser& user) const;
+
+	/**
+	 * Gets the GetTurnPosition() of several users, walking the queue once.
+	 */
+	std::vector<size_t> GetTurnPositions(const std::vector<std::shared_ptr<CollabVMUser>>& users) const;
+
+	/**
+	 * Puts a user that resumed their session back where they were in the
+	 * turn queue, or as close to it as the queue is now long. A user that
+	 * was in control goes to the front of the queue.
+	 *
+	 * @param position The user's GetTurnPosition() when they disconnected.
+	 */
+	void ResumeTurn(const std::shared_ptr<CollabVMUser>& user, size_t position);
+
 	/**
 	 * After a turn has ended, this function will update the turn
 	 * queue and give the next user a turn.
@@ -130,30 +366,74 @@ class VMController : public std::enable_shared_from_this<VMController>, public A
 		return current_turn_;
 	}
 
-	const std::deque<std::shared_ptr<CollabVMUser>>& GetTurnQueue() const {
+	const TurnQueue& GetTurnQueue() const {
 		return turn_queue_;
 	}
 
 	void ClearTurnQueue();
 
+	/**
+	 * Ends the VM's idle state, and starts counting down to it again if
+	 * nobody is viewing the VM. Called when the VM starts running.
+	 */
+	void ResetIdle();
+
+	/**
+	 * Makes the VM idle if it hasn't had any viewers for the
+	 * idle timeout. Called after the idle timer expires.
+	 */
+	void EnterIdle();
+
 	virtual bool IsRunning() const = 0;
 
+	/**
+	 * The Guacamole client that sends input to the VM.
+	 */
+	virtual GuacClient& GetGuacClient() = 0;
+
 	virtual void UpdateThumbnail() = 0;
 
 	/**
 	 * Called by the Guacamole client after a new thumbnail has
 	 * been created.
 	 */
-	void NewThumbnail(std::string* str);
+	void NewThumbnail(const std::shared_ptr<const VMThumbnail>& thumbnail);
+
+	inline const std::shared_ptr<const VMThumbnail>& GetThumbnail() const {
+		return thumbnail_;
+	}
+
+	/**
+	 * The version of the current thumbnail, which changes every time
+	 * the thumbnail does so clients know when to fetch it again.
+	 */
+	inline uint64_t GetThumbnailVersion() const {
+		return thumbnail_version_;
+	}
 
-	inline std::string* GetThumbnail() const {
-		return thumbnail_str_;
+	inline void SetThumbnail(const std::shared_ptr<const VMThumbnail>& thumbnail, uint64_t version) {
+		memory_.Resize(MemoryCategory::kThumbnails, thumbnail_ ? thumbnail_->GetMemoryUsage() : 0,
+					   thumbnail ? thumbnail->GetMemoryUsage() : 0);
+		thumbnail_ = thumbnail;
+		thumbnail_version_ = version;
 	}
 
-	inline void SetThumbnail(std::string* str) {
-		if(thumbnail_str_)
-			delete thumbnail_str_;
-		thumbnail_str_ = str;
+	/**
+	 * Gets the account that memory used for the VM is charged to.
+	 */
+	inline MemoryAccount& GetMemoryAccount() {
+		return memory_;
+	}
+
+	inline VMMetrics& GetMetrics() {
+		return metrics_;
+	}
+
+	/**
+	 * Gets the client the VM's encode jobs are scheduled as.
+	 */
+	inline EncoderPool::Client& GetEncoderClient() {
+		return encoder_client_;
 	}
 
 	//inline std::string& GetTurnListCache()
@@ -187,6 +467,23 @@ class VMController : public std::enable_shared_from_this<VMController>, public A
 	bool agent_upload_in_progress_;
 	std::deque<std::shared_ptr<UploadInfo>> agent_upload_queue_;
 
+	/**
+	 * The users waiting for a slot to upload to this VM, once
+	 * CollabVMServer's limits have been reached.
+	 */
+	std::deque<std::shared_ptr<CollabVMUser>> upload_queue_;
+
+	/**
+	 * The number of uploads to this VM that hold a slot, from the
+	 * time their HTTP upload starts until the agent is done with them.
+	 */
+	size_t upload_count_ = 0;
+
+	/**
+	 * Whether the VM is in CollabVMServer::upload_vms_.
+	 */
+	bool upload_scheduled_ = false;
+
    protected:
 	VMController(CollabVMServer& server, boost::asio::io_service& service, const std::shared_ptr<VMSettings>& settings);
 
@@ -194,6 +491,21 @@ class VMController : public std::enable_shared_from_this<VMController>, public A
 
 	virtual void OnRemoveUser(CollabVMUser& user) = 0;
 
+	/**
+	 * Called on the processing thread when the VM becomes idle,
+	 * or stops being idle, to apply the idle policy.
+	 */
+	virtual void OnIdleChanged() {
+	}
+
+	/**
+	 * Whether it has been at least the idle timeout since the
+	 * VM had any viewers. Only accessed by the processing thread.
+	 */
+	inline bool IsIdle() const {
+		return idle_;
+	}
+
 	void InitAgent(const VMSettings& settings, boost::asio::io_service& service);
 
 	void OnAgentConnect(const std::string& os_name, const std::string& service_pack,
@@ -215,6 +527,14 @@ class VMController : public std::enable_shared_from_this<VMController>, public A
 
 	std::shared_ptr<VMSettings> settings_;
 
+	VMMetrics metrics_;
+
+	/**
+	 * Its weight is set by UpdateEncoderWeight(). Outlives the Guacamole
+	 * client of the derived class, which submits the jobs.
+	 */
+	EncoderPool::Client encoder_client_;
+
 	StopReason stop_reason_;
 
 	UserList users_;
@@ -241,20 +561,75 @@ class VMController : public std::enable_shared_from_this<VMController>, public A
 
 	void EndVoteCommonLogic(bool vote_passed);
 
+	/**
+	 * Gets the decision of an IP in the current vote.
+	 */
+	IPData::VoteDecision GetVote(IPData& ip_data) const;
+
+	/**
+	 * Records the decision of an IP in the current vote, keeping
+	 * IPData::ballots up to date.
+	 */
+	void SetVote(IPData& ip_data, IPData::VoteDecision decision);
+
+	/**
+	 * Forgets the decisions of every IP that voted, so their IPData
+	 * can be deleted.
+	 */
+	void ClearVotes();
+
 	void VoteEndedCallback(const boost::system::error_code& ec);
 
 	void TurnTimerCallback(const boost::system::error_code& ec);
 
+	void IdleTimerCallback(const boost::system::error_code& ec);
+
+	/**
+	 * Starts counting down to the idle state after the last viewer left.
+	 */
+	void StartIdleTimer();
+
+	/**
+	 * Gives the VM its share of the encoder threads, from its setting
+	 * and the number of viewers it has.
+	 */
+	void UpdateEncoderWeight(const VMSettings& settings);
+
+	/**
+	 * Lets the user with the current turn send input straight to the
+	 * Guacamole client from the websocket threads, and stops the user
+	 * that had it before from doing so. Called whenever current_turn_ changes.
+	 */
+	void PublishTurn();
+
+	/**
+	 * Gives control to the user at the front of the queue, or to nobody if
+	 * it's empty, after the user in control lost it.
+	 */
+	void PassTurn();
+
 	boost::asio::steady_timer turn_timer_;
 
-	std::deque<std::shared_ptr<CollabVMUser>> turn_queue_;
+	TurnQueue turn_queue_;
 	std::shared_ptr<CollabVMUser> current_turn_;
 
+	/**
+	 * The user that was last given the input client by PublishTurn().
+	 */
+	std::shared_ptr<CollabVMUser> published_turn_;
+
 	VoteState vote_state_;
 
 	uint32_t vote_count_yes_;
 	uint32_t vote_count_no_;
 
+	/**
+	 * The decision of each IP that has voted in the current vote.
+	 * Only IPs that voted are in the map, so ending a vote doesn't
+	 * have to look at every IP connected to the server.
+	 */
+	std::unordered_map<IPData*, IPData::VoteDecision> ballots_;
+
 	/**
 	 * This timer counts down the remaining time during a vote when
 	 * vote_running_ is true or the time until another vote can be
@@ -262,7 +637,19 @@ class VMController : public std::enable_shared_from_this<VMController>, public A
 	 */
 	boost::asio::steady_timer vote_timer_;
 
-	std::string* thumbnail_str_;
+	boost::asio::steady_timer idle_timer_;
+
+	/**
+	 * The last time that a viewer left the VM, so that an idle timer
+	 * that expired after someone joined and left again is ignored.
+	 */
+	std::chrono::steady_clock::time_point idle_since_;
+	bool idle_;
+
+	std::shared_ptr<const VMThumbnail> thumbnail_;
+	uint64_t thumbnail_version_;
+
+	MemoryAccount memory_;
 
 	//std::string turn_list_cache_;
 
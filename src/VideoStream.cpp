@@ -0,0 +1,190 @@
+#include "VideoStream.h"
+#include "GuacBroadcastSocket.h"
+#include "GuacClient.h"
+#include "Logger.h"
+#include "guacamole/protocol.h"
+#include "guacamole/timestamp.h"
+#include "guacamole/user-constants.h"
+#include <algorithm>
+
+/**
+ * The index of the video stream, after the ones used for images and audio.
+ */
+#define GUAC_VIDEO_STREAM_INDEX (GUAC_USER_MAX_STREAMS + 2)
+
+#ifdef USE_VPX
+/**
+ * The bitrate of the stream in kilobits per second for each thousand pixels
+ * of its frames, so 1280x720 is streamed at about 2.7 Mbit/s.
+ */
+#define GUAC_VIDEO_KBPS_PER_KILOPIXEL 3
+
+/**
+ * The lowest bitrate of the stream in kilobits per second.
+ */
+#define GUAC_VIDEO_MIN_KBPS 300
+
+/**
+ * The speed of the VP8 encoder, from 0 to 16. Higher values are faster at
+ * the cost of quality.
+ */
+#define GUAC_VIDEO_CPU_USED 8
+
+/**
+ * Converts a row of 32-bit RGB pixels to luma.
+ */
+static void __guac_video_convert_luma(const uint32_t* pixels, unsigned char* y, int width) {
+	for(int x = 0; x < width; x++) {
+		int r = (pixels[x] >> 16) & 0xFF;
+		int g = (pixels[x] >> 8) & 0xFF;
+		int b = pixels[x] & 0xFF;
+		y[x] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+	}
+}
+
+/**
+ * Converts two rows of 32-bit RGB pixels to a row of chroma, averaging
+ * each 2x2 block of pixels.
+ */
+static void __guac_video_convert_chroma(const uint32_t* top, const uint32_t* bottom, unsigned char* u,
+										unsigned char* v, int width) {
+	for(int x = 0; x < width; x += 2) {
+		int r = 0, g = 0, b = 0;
+		for(uint32_t pixel : { top[x], top[x + 1], bottom[x], bottom[x + 1] }) {
+			r += (pixel >> 16) & 0xFF;
+			g += (pixel >> 8) & 0xFF;
+			b += pixel & 0xFF;
+		}
+		r /= 4;
+		g /= 4;
+		b /= 4;
+		u[x / 2] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+		v[x / 2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+	}
+}
+#endif
+
+VideoStream::VideoStream(GuacBroadcastSocket& socket)
+	: socket_(socket),
+	  stream_(),
+	  open_(false),
+	  layer_(NULL),
+	  x_(0),
+	  y_(0),
+	  width_(0),
+	  height_(0),
+	  keyframe_(false),
+	  start_(0) {
+	stream_.index = GUAC_VIDEO_STREAM_INDEX;
+}
+
+VideoStream::~VideoStream() {
+	End();
+}
+
+bool VideoStream::Begin(const guac_layer* layer, int x, int y, int width, int height) {
+#ifdef USE_VPX
+	std::lock_guard<std::mutex> lock(mutex_);
+	if(open_)
+		return false;
+
+	// Chroma is subsampled in 2x2 blocks
+	width &= ~1;
+	height &= ~1;
+	if(width <= 0 || height <= 0)
+		return false;
+
+	vpx_codec_enc_cfg_t config;
+	if(vpx_codec_enc_config_default(vpx_codec_vp8_cx(), &config, 0) != VPX_CODEC_OK)
+		return false;
+
+	config.g_w = width;
+	config.g_h = height;
+	config.g_timebase.num = 1;
+	config.g_timebase.den = 1000;
+	config.g_lag_in_frames = 0;
+	config.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+	config.rc_end_usage = VPX_CBR;
+	config.rc_target_bitrate = std::max(width * height / 1000 * GUAC_VIDEO_KBPS_PER_KILOPIXEL, GUAC_VIDEO_MIN_KBPS);
+	// Keyframes are only sent when a viewer joins
+	config.kf_mode = VPX_KF_DISABLED;
+
+	if(vpx_codec_enc_init(&codec_, vpx_codec_vp8_cx(), &config, 0) != VPX_CODEC_OK) {
+		Logger::Error() << "Failed to create VP8 encoder: " << vpx_codec_error(&codec_);
+		return false;
+	}
+	vpx_codec_control(&codec_, VP8E_SET_CPUUSED, GUAC_VIDEO_CPU_USED);
+
+	if(!vpx_img_alloc(&image_, VPX_IMG_FMT_I420, width, height, 1)) {
+		vpx_codec_destroy(&codec_);
+		return false;
+	}
+
+	open_ = true;
+	layer_ = layer;
+	x_ = x;
+	y_ = y;
+	width_ = width;
+	height_ = height;
+	keyframe_ = true;
+	start_ = guac_timestamp_current();
+
+	guac_protocol_send_move(socket_, layer_, GuacClient::GUAC_DEFAULT_LAYER, x_, y_, 1);
+	guac_protocol_send_video(socket_, &stream_, layer_, GetMimetype(), 0);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void VideoStream::Write(const unsigned char* pixels, int stride) {
+#ifdef USE_VPX
+	std::lock_guard<std::mutex> lock(mutex_);
+	if(!open_)
+		return;
+
+	for(int y = 0; y < height_; y += 2) {
+		const uint32_t* top = (const uint32_t*)(pixels + y * stride);
+		const uint32_t* bottom = (const uint32_t*)(pixels + (y + 1) * stride);
+		__guac_video_convert_luma(top, image_.planes[VPX_PLANE_Y] + y * image_.stride[VPX_PLANE_Y], width_);
+		__guac_video_convert_luma(bottom, image_.planes[VPX_PLANE_Y] + (y + 1) * image_.stride[VPX_PLANE_Y], width_);
+		__guac_video_convert_chroma(top, bottom, image_.planes[VPX_PLANE_U] + y / 2 * image_.stride[VPX_PLANE_U],
+									image_.planes[VPX_PLANE_V] + y / 2 * image_.stride[VPX_PLANE_V], width_);
+	}
+
+	vpx_enc_frame_flags_t flags = keyframe_ ? VPX_EFLAG_FORCE_KF : 0;
+	keyframe_ = false;
+	if(vpx_codec_encode(&codec_, &image_, guac_timestamp_current() - start_, 1, flags, VPX_DL_REALTIME) != VPX_CODEC_OK)
+		return;
+
+	vpx_codec_iter_t iter = NULL;
+	while(const vpx_codec_cx_pkt_t* packet = vpx_codec_get_cx_data(&codec_, &iter)) {
+		if(packet->kind == VPX_CODEC_CX_FRAME_PKT)
+			guac_protocol_send_blob(socket_, &stream_, packet->data.frame.buf, packet->data.frame.sz);
+	}
+#endif
+}
+
+void VideoStream::End() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if(!open_)
+		return;
+
+	guac_protocol_send_end(socket_, &stream_);
+	open_ = false;
+
+#ifdef USE_VPX
+	vpx_img_free(&image_);
+	vpx_codec_destroy(&codec_);
+#endif
+}
+
+void VideoStream::Dup(GuacSocket& socket) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if(!open_)
+		return;
+
+	guac_protocol_send_move(socket, layer_, GuacClient::GUAC_DEFAULT_LAYER, x_, y_, 1);
+	guac_protocol_send_video(socket, &stream_, layer_, GetMimetype(), 0);
+	keyframe_ = true;
+}
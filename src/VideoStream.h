@@ -0,0 +1,110 @@
+#pragma once
+#include "guacamole/layer.h"
+#include "guacamole/stream.h"
+#include "guacamole/timestamp-types.h"
+#include <mutex>
+
+#ifdef USE_VPX
+#include <vpx/vp8cx.h>
+#include <vpx/vpx_encoder.h>
+#endif
+
+class GuacSocket;
+class GuacBroadcastSocket;
+
+/**
+ * A VP8 video stream of part of the screen, broadcast to every viewer of a
+ * VM. It is drawn to its own layer above the default layer, so areas that
+ * change continuously, like a video player or a game, can be sent as video
+ * instead of as a series of full images.
+ *
+ * Video is only available in builds with libvpx, otherwise Begin() always
+ * fails and the screen is sent as images.
+ */
+class VideoStream {
+   public:
+	explicit VideoStream(GuacBroadcastSocket& socket);
+	~VideoStream();
+
+	/**
+	 * Opens the stream on the viewers, playing on the given layer, and
+	 * creates an encoder for frames of the given size.
+	 *
+	 * @return Whether the stream was opened.
+	 */
+	bool Begin(const guac_layer* layer, int x, int y, int width, int height);
+
+	/**
+	 * Encodes a frame from 32-bit RGB pixels of the stream's size and
+	 * broadcasts it.
+	 */
+	void Write(const unsigned char* pixels, int stride);
+
+	/**
+	 * Closes the stream on the viewers and destroys the encoder.
+	 * Does nothing if the stream isn't open.
+	 */
+	void End();
+
+	/**
+	 * Opens the stream on a viewer that joined while it was open, and makes
+	 * the next frame a keyframe so that the viewer can start decoding.
+	 */
+	void Dup(GuacSocket& socket);
+
+	bool IsOpen() const {
+		return open_;
+	}
+
+	/**
+	 * Whether the server was built with video support.
+	 */
+	static bool IsSupported() {
+#ifdef USE_VPX
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/**
+	 * Gets the mimetype of the blobs sent on the stream. Each blob is a
+	 * single raw VP8 frame. Viewers list it when connecting if they can
+	 * decode it.
+	 */
+	static const char* GetMimetype() {
+		return "video/vp8";
+	}
+
+   private:
+	GuacBroadcastSocket& socket_;
+	guac_stream stream_;
+
+	/**
+	 * Guards every member below, since viewers are sent the stream
+	 * from the threads they join on.
+	 */
+	std::mutex mutex_;
+
+	bool open_;
+	const guac_layer* layer_;
+	int x_;
+	int y_;
+	int width_;
+	int height_;
+
+	/**
+	 * Whether the next frame must be a keyframe.
+	 */
+	bool keyframe_;
+
+	/**
+	 * When the stream was opened, which frame timestamps are relative to.
+	 */
+	guac_timestamp start_;
+
+#ifdef USE_VPX
+	vpx_codec_ctx_t codec_;
+	vpx_image_t image_;
+#endif
+};
@@ -0,0 +1,710 @@
+#include "config.h"
+#include "fast_png.h"
+#include "SIMD.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(SIMD_X86)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * The number of bytes of filtered rows that share a deflate block and its
+ * Huffman codes. A row that's longer than this gets a block of its own.
+ */
+#define GUAC_FAST_PNG_CHUNK_SIZE 65536
+
+/**
+ * The number of bytes the filter kernels may write past the end of a row.
+ */
+#define GUAC_FAST_PNG_ROW_SLACK 32
+
+#define GUAC_FAST_PNG_MAX_MATCH 258
+#define GUAC_FAST_PNG_MAX_STORED 65535
+#define GUAC_FAST_PNG_LITLEN_CODES 286
+#define GUAC_FAST_PNG_CLEN_CODES 19
+#define GUAC_FAST_PNG_END_OF_BLOCK 256
+
+/**
+ * The offsets of the red, green and blue bytes of a pixel in memory. The
+ * SIMD kernels assume they're little-endian.
+ */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define GUAC_FAST_PNG_RED 2
+#define GUAC_FAST_PNG_GREEN 1
+#define GUAC_FAST_PNG_BLUE 0
+#else
+#define GUAC_FAST_PNG_RED 1
+#define GUAC_FAST_PNG_GREEN 2
+#define GUAC_FAST_PNG_BLUE 3
+#endif
+
+/**
+ * Filters a row of pixels with both the Sub and Up filters, writing 3 bytes
+ * per pixel in RGB order to each output, and counts the zero bytes each
+ * filter leaves. The outputs may be written up to GUAC_FAST_PNG_ROW_SLACK
+ * bytes past their end.
+ *
+ * @param row The first pixel of the row.
+ * @param above The first pixel of the row above, or NULL for the first row.
+ * @param width The number of pixels in the row.
+ * @param sub The row filtered with Sub.
+ * @param up The row filtered with Up.
+ * @param zeros The number of zero bytes left by Sub and Up, which are added to.
+ */
+typedef void __guac_png_filter_func(const unsigned char* row, const unsigned char* above,
+        int width, unsigned char* sub, unsigned char* up, size_t* zeros);
+
+static void __guac_png_filter_tail(const unsigned char* row, const unsigned char* above,
+        int start, int width, unsigned char* sub, unsigned char* up, size_t* zeros) {
+
+    static const int offsets[3] = { GUAC_FAST_PNG_RED, GUAC_FAST_PNG_GREEN, GUAC_FAST_PNG_BLUE };
+
+    for (int x = start; x < width; x++) {
+        for (int c = 0; c < 3; c++) {
+            unsigned char value = row[x * 4 + offsets[c]];
+            unsigned char left = x ? row[(x - 1) * 4 + offsets[c]] : 0;
+            unsigned char top = above ? above[x * 4 + offsets[c]] : 0;
+            unsigned char filtered_sub = value - left;
+            unsigned char filtered_up = value - top;
+            sub[x * 3 + c] = filtered_sub;
+            up[x * 3 + c] = filtered_up;
+            zeros[0] += !filtered_sub;
+            zeros[1] += !filtered_up;
+        }
+    }
+
+}
+
+static void __guac_png_filter_scalar(const unsigned char* row, const unsigned char* above,
+        int width, unsigned char* sub, unsigned char* up, size_t* zeros) {
+    __guac_png_filter_tail(row, above, 0, width, sub, up, zeros);
+}
+
+#if defined(SIMD_X86)
+SIMD_TARGET_SSE42
+static void __guac_png_filter_sse42(const unsigned char* row, const unsigned char* above,
+        int width, unsigned char* sub, unsigned char* up, size_t* zeros) {
+
+    /* Packs 4 BGRX pixels into 12 bytes of RGB */
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i last = zero;
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i current = _mm_loadu_si128((const __m128i*) (row + x * 4));
+        __m128i left = _mm_alignr_epi8(current, last, 12);
+        __m128i top = above ? _mm_loadu_si128((const __m128i*) (above + x * 4)) : zero;
+
+        __m128i filtered_sub = _mm_shuffle_epi8(_mm_sub_epi8(current, left), shuffle);
+        __m128i filtered_up = _mm_shuffle_epi8(_mm_sub_epi8(current, top), shuffle);
+        _mm_storeu_si128((__m128i*) (sub + x * 3), filtered_sub);
+        _mm_storeu_si128((__m128i*) (up + x * 3), filtered_up);
+
+        zeros[0] += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(filtered_sub, zero)) & 0xFFF);
+        zeros[1] += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(filtered_up, zero)) & 0xFFF);
+        last = current;
+    }
+
+    __guac_png_filter_tail(row, above, x, width, sub, up, zeros);
+
+}
+
+SIMD_TARGET_AVX2
+static void __guac_png_filter_avx2(const unsigned char* row, const unsigned char* above,
+        int width, unsigned char* sub, unsigned char* up, size_t* zeros) {
+
+    /* Packs 4 BGRX pixels into 12 bytes of RGB in each lane, then the
+     * lanes into the low 24 bytes */
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                             2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    const __m256i rotate = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i last = zero;
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i current = _mm256_loadu_si256((const __m256i*) (row + x * 4));
+        __m256i left = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(current, rotate),
+                                          _mm256_permutevar8x32_epi32(last, rotate), 0x01);
+        __m256i top = above ? _mm256_loadu_si256((const __m256i*) (above + x * 4)) : zero;
+
+        __m256i filtered_sub = _mm256_permutevar8x32_epi32(
+                _mm256_shuffle_epi8(_mm256_sub_epi8(current, left), shuffle), pack);
+        __m256i filtered_up = _mm256_permutevar8x32_epi32(
+                _mm256_shuffle_epi8(_mm256_sub_epi8(current, top), shuffle), pack);
+        _mm256_storeu_si256((__m256i*) (sub + x * 3), filtered_sub);
+        _mm256_storeu_si256((__m256i*) (up + x * 3), filtered_up);
+
+        zeros[0] += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(filtered_sub, zero)) & 0xFFFFFF);
+        zeros[1] += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(filtered_up, zero)) & 0xFFFFFF);
+        last = current;
+    }
+
+    __guac_png_filter_tail(row, above, x, width, sub, up, zeros);
+
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void __guac_png_filter_neon(const unsigned char* row, const unsigned char* above,
+        int width, unsigned char* sub, unsigned char* up, size_t* zeros) {
+
+    const uint8x16_t zero = vdupq_n_u8(0);
+
+    /* Each lane counts at most 6 zeros per 16 pixels, so the counts can't
+     * overflow for any row a surface can have */
+    uint16x8_t sub_zeros = vdupq_n_u16(0);
+    uint16x8_t up_zeros = vdupq_n_u16(0);
+
+    uint8x16x4_t last;
+    last.val[0] = last.val[1] = last.val[2] = last.val[3] = zero;
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t current = vld4q_u8(row + x * 4);
+        uint8x16x4_t top;
+        if (above)
+            top = vld4q_u8(above + x * 4);
+        else
+            top.val[0] = top.val[1] = top.val[2] = top.val[3] = zero;
+
+        /* The planes are B, G, R and X, and the PNG is RGB */
+        uint8x16x3_t filtered_sub;
+        uint8x16x3_t filtered_up;
+        for (int c = 0; c < 3; c++) {
+            uint8x16_t plane = current.val[2 - c];
+            uint8x16_t left = vextq_u8(last.val[2 - c], plane, 15);
+            filtered_sub.val[c] = vsubq_u8(plane, left);
+            filtered_up.val[c] = vsubq_u8(plane, top.val[2 - c]);
+            sub_zeros = vpadalq_u8(sub_zeros, vshrq_n_u8(vceqq_u8(filtered_sub.val[c], zero), 7));
+            up_zeros = vpadalq_u8(up_zeros, vshrq_n_u8(vceqq_u8(filtered_up.val[c], zero), 7));
+        }
+        vst3q_u8(sub + x * 3, filtered_sub);
+        vst3q_u8(up + x * 3, filtered_up);
+        last = current;
+    }
+
+    uint64x2_t sub_total = vpaddlq_u32(vpaddlq_u16(sub_zeros));
+    uint64x2_t up_total = vpaddlq_u32(vpaddlq_u16(up_zeros));
+    zeros[0] += vgetq_lane_u64(sub_total, 0) + vgetq_lane_u64(sub_total, 1);
+    zeros[1] += vgetq_lane_u64(up_total, 0) + vgetq_lane_u64(up_total, 1);
+
+    __guac_png_filter_tail(row, above, x, width, sub, up, zeros);
+
+}
+#endif
+
+static __guac_png_filter_func* const __guac_png_filter = SIMD::Select<__guac_png_filter_func>("png_filter", {
+    __guac_png_filter_scalar,
+#if defined(SIMD_X86)
+    __guac_png_filter_sse42, __guac_png_filter_avx2, NULL,
+#else
+    NULL, NULL, NULL,
+#endif
+#if defined(__ARM_NEON)
+    __guac_png_filter_neon
+#else
+    NULL
+#endif
+});
+
+/**
+ * The deflate length code of each match length, with the extra bits that
+ * follow it.
+ */
+typedef struct __guac_png_length_code {
+    uint16_t symbol;
+    uint8_t extra_bits;
+    uint8_t extra;
+} __guac_png_length_code;
+
+static const __guac_png_length_code* __guac_png_get_length_codes() {
+
+    static __guac_png_length_code codes[GUAC_FAST_PNG_MAX_MATCH + 1];
+    static const int bases[] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    static const int extra_bits[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+
+    static const bool initialized = [] {
+        for (int i = 0; i < 29; i++) {
+            int end = i < 28 ? bases[i + 1] : GUAC_FAST_PNG_MAX_MATCH + 1;
+            for (int length = bases[i]; length < end; length++) {
+                codes[length].symbol = 257 + i;
+                codes[length].extra_bits = extra_bits[i];
+                codes[length].extra = length - bases[i];
+            }
+        }
+        return true;
+    }();
+    (void) initialized;
+
+    return codes;
+
+}
+
+/**
+ * Builds the lengths of a Huffman code for symbols with the given
+ * frequencies, none longer than max_bits. Unused symbols get a length of 0.
+ * The code is always complete, as deflate decoders require, so at least two
+ * symbols are given a length.
+ */
+static void __guac_png_huffman_lengths(const uint32_t* freqs, int count, int max_bits, uint8_t* lengths) {
+
+    uint32_t weights[GUAC_FAST_PNG_LITLEN_CODES];
+    int used = 0;
+    for (int i = 0; i < count; i++) {
+        weights[i] = freqs[i];
+        used += freqs[i] != 0;
+    }
+    for (int i = 0; used < 2 && i < count; i++) {
+        if (!weights[i]) {
+            weights[i] = 1;
+            used++;
+        }
+    }
+
+    int symbols[GUAC_FAST_PNG_LITLEN_CODES];
+    uint32_t node_weights[GUAC_FAST_PNG_LITLEN_CODES * 2];
+    int parents[GUAC_FAST_PNG_LITLEN_CODES * 2];
+    int depths[GUAC_FAST_PNG_LITLEN_CODES * 2];
+
+    while (true) {
+
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            if (weights[i])
+                symbols[n++] = i;
+        }
+        std::stable_sort(symbols, symbols + n, [&weights](int a, int b) { return weights[a] < weights[b]; });
+        for (int i = 0; i < n; i++)
+            node_weights[i] = weights[symbols[i]];
+
+        /* Internal nodes are made in order of weight, so the two lightest
+         * nodes are always at the front of the leaves or internal nodes */
+        int leaf = 0;
+        int internal = n;
+        for (int node = n; node < n * 2 - 1; node++) {
+            int children[2];
+            for (int c = 0; c < 2; c++) {
+                if (leaf < n && (internal >= node || node_weights[leaf] <= node_weights[internal]))
+                    children[c] = leaf++;
+                else
+                    children[c] = internal++;
+            }
+            node_weights[node] = node_weights[children[0]] + node_weights[children[1]];
+            parents[children[0]] = parents[children[1]] = node;
+        }
+
+        int max_depth = 0;
+        depths[n * 2 - 2] = 0;
+        for (int node = n * 2 - 3; node >= 0; node--) {
+            depths[node] = depths[parents[node]] + 1;
+            if (node < n)
+                max_depth = std::max(max_depth, depths[node]);
+        }
+
+        if (max_depth <= max_bits) {
+            memset(lengths, 0, count);
+            for (int i = 0; i < n; i++)
+                lengths[symbols[i]] = depths[i];
+            return;
+        }
+
+        /* Flatten the frequencies until the code is short enough */
+        for (int i = 0; i < count; i++) {
+            if (weights[i])
+                weights[i] = (weights[i] >> 1) | 1;
+        }
+
+    }
+
+}
+
+/**
+ * Assigns the canonical codes of a Huffman code, bit-reversed since
+ * deflate writes them starting from the most significant bit.
+ */
+static void __guac_png_huffman_codes(const uint8_t* lengths, int count, uint16_t* codes) {
+
+    int length_counts[16] = { 0 };
+    for (int i = 0; i < count; i++)
+        length_counts[lengths[i]]++;
+    length_counts[0] = 0;
+
+    int next_codes[16];
+    int code = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (code + length_counts[bits - 1]) << 1;
+        next_codes[bits] = code;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int length = lengths[i];
+        if (!length)
+            continue;
+        int value = next_codes[length]++;
+        int reversed = 0;
+        for (int bit = 0; bit < length; bit++)
+            reversed |= ((value >> bit) & 1) << (length - 1 - bit);
+        codes[i] = reversed;
+    }
+
+}
+
+/**
+ * Writes bits to the output starting from the least significant bit, as
+ * deflate packs them. Whole 32-bit words are written at once, so the
+ * output has to have room for 4 bytes more than what's written.
+ */
+typedef struct __guac_png_bit_writer {
+    unsigned char* out;
+    uint64_t bits;
+    int count;
+} __guac_png_bit_writer;
+
+static inline void __guac_png_put_bits(__guac_png_bit_writer* writer, uint32_t value, int count) {
+
+    writer->bits |= (uint64_t) value << writer->count;
+    writer->count += count;
+
+    if (writer->count >= 32) {
+        uint32_t word = (uint32_t) writer->bits;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(writer->out, &word, 4);
+#else
+        for (int i = 0; i < 4; i++)
+            writer->out[i] = word >> (i * 8);
+#endif
+        writer->out += 4;
+        writer->bits >>= 32;
+        writer->count -= 32;
+    }
+
+}
+
+/**
+ * Writes the bits that are left, padding them to a whole byte.
+ */
+static void __guac_png_flush_bits(__guac_png_bit_writer* writer) {
+
+    while (writer->count > 0) {
+        *writer->out++ = (unsigned char) writer->bits;
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+
+    writer->bits = 0;
+    writer->count = 0;
+
+}
+
+/**
+ * Makes room in the buffer for the given number of bytes after what the
+ * writer has written.
+ */
+static void __guac_png_reserve(std::vector<unsigned char>& buffer, __guac_png_bit_writer* writer, size_t size) {
+    size_t offset = writer->out - buffer.data();
+    buffer.resize(offset + size + 8);
+    writer->out = buffer.data() + offset;
+}
+
+/**
+ * Compresses filtered rows as stored blocks.
+ */
+static void __guac_png_store_chunk(const unsigned char* data, size_t length, int last,
+        std::vector<unsigned char>& buffer, __guac_png_bit_writer* writer) {
+
+    size_t blocks = (length + GUAC_FAST_PNG_MAX_STORED - 1) / GUAC_FAST_PNG_MAX_STORED;
+    __guac_png_reserve(buffer, writer, length + blocks * 5);
+
+    for (size_t offset = 0; offset < length; offset += GUAC_FAST_PNG_MAX_STORED) {
+        size_t size = std::min<size_t>(length - offset, GUAC_FAST_PNG_MAX_STORED);
+        __guac_png_put_bits(writer, last && offset + size == length, 1);
+        __guac_png_put_bits(writer, 0, 2);
+        __guac_png_flush_bits(writer);
+
+        unsigned char* out = writer->out;
+        out[0] = size & 0xFF;
+        out[1] = size >> 8;
+        out[2] = ~size & 0xFF;
+        out[3] = (~size >> 8) & 0xFF;
+        memcpy(out + 4, data + offset, size);
+        writer->out = out + 4 + size;
+    }
+
+}
+
+/**
+ * Compresses filtered rows as a deflate block with Huffman codes built for
+ * them, where runs of zero bytes are matches a byte back, or as stored
+ * blocks if they wouldn't be any smaller.
+ */
+static void __guac_png_deflate_chunk(const unsigned char* data, size_t length, int last,
+        std::vector<unsigned char>& buffer, __guac_png_bit_writer* writer) {
+
+    static const uint8_t clen_order[GUAC_FAST_PNG_CLEN_CODES] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+    const __guac_png_length_code* length_codes = __guac_png_get_length_codes();
+
+    /* Symbols below 256 are literals, and the rest are match lengths plus 256 */
+    static thread_local std::vector<uint16_t> tokens;
+    tokens.resize(length);
+    size_t token_count = 0;
+
+    uint32_t freqs[GUAC_FAST_PNG_LITLEN_CODES] = { 0 };
+    uint64_t extra_bits = 0;
+    size_t matches = 0;
+
+    size_t i = 0;
+    while (i < length) {
+
+        unsigned char value = data[i++];
+        tokens[token_count++] = value;
+        freqs[value]++;
+        if (value)
+            continue;
+
+        /* Measure the run of zeros after this one, a word at a time */
+        size_t run = 0;
+        uint64_t word;
+        while (i + run + 8 <= length && (memcpy(&word, data + i + run, 8), word == 0))
+            run += 8;
+        while (i + run < length && !data[i + run])
+            run++;
+
+        while (run >= 3) {
+            size_t match = std::min<size_t>(run, GUAC_FAST_PNG_MAX_MATCH);
+            const __guac_png_length_code& code = length_codes[match];
+            tokens[token_count++] = 256 + match;
+            freqs[code.symbol]++;
+            extra_bits += code.extra_bits;
+            matches++;
+            i += match;
+            run -= match;
+        }
+
+    }
+    freqs[GUAC_FAST_PNG_END_OF_BLOCK] = 1;
+
+    uint8_t lengths[GUAC_FAST_PNG_LITLEN_CODES];
+    uint16_t codes[GUAC_FAST_PNG_LITLEN_CODES];
+    __guac_png_huffman_lengths(freqs, GUAC_FAST_PNG_LITLEN_CODES, 15, lengths);
+    __guac_png_huffman_codes(lengths, GUAC_FAST_PNG_LITLEN_CODES, codes);
+
+    int litlen_count = GUAC_FAST_PNG_LITLEN_CODES;
+    while (litlen_count > 257 && !lengths[litlen_count - 1])
+        litlen_count--;
+
+    /* The code lengths, followed by the one distance code of 1 bit, are
+     * written with runs of zeros and repeats shortened */
+    uint8_t sequence[GUAC_FAST_PNG_LITLEN_CODES + 1];
+    memcpy(sequence, lengths, litlen_count);
+    sequence[litlen_count] = 1;
+    int sequence_length = litlen_count + 1;
+
+    uint8_t clen_symbols[GUAC_FAST_PNG_LITLEN_CODES + 1];
+    uint8_t clen_extra[GUAC_FAST_PNG_LITLEN_CODES + 1];
+    int clen_count = 0;
+    uint32_t clen_freqs[GUAC_FAST_PNG_CLEN_CODES] = { 0 };
+    for (int s = 0; s < sequence_length;) {
+        int length_value = sequence[s];
+        int run = 1;
+        while (s + run < sequence_length && sequence[s + run] == length_value)
+            run++;
+
+        if (length_value == 0 && run >= 3) {
+            int repeat = std::min(run, 138);
+            clen_symbols[clen_count] = repeat >= 11 ? 18 : 17;
+            clen_extra[clen_count] = repeat >= 11 ? repeat - 11 : repeat - 3;
+            s += repeat;
+        }
+        else if (length_value != 0 && run >= 4) {
+            clen_symbols[clen_count] = length_value;
+            clen_freqs[length_value]++;
+            clen_count++;
+            int repeat = std::min(run - 1, 6);
+            clen_symbols[clen_count] = 16;
+            clen_extra[clen_count] = repeat - 3;
+            s += 1 + repeat;
+        }
+        else {
+            clen_symbols[clen_count] = length_value;
+            s++;
+        }
+
+        clen_freqs[clen_symbols[clen_count]]++;
+        clen_count++;
+    }
+
+    uint8_t clen_lengths[GUAC_FAST_PNG_CLEN_CODES];
+    uint16_t clen_codes[GUAC_FAST_PNG_CLEN_CODES];
+    __guac_png_huffman_lengths(clen_freqs, GUAC_FAST_PNG_CLEN_CODES, 7, clen_lengths);
+    __guac_png_huffman_codes(clen_lengths, GUAC_FAST_PNG_CLEN_CODES, clen_codes);
+
+    int clen_order_count = GUAC_FAST_PNG_CLEN_CODES;
+    while (clen_order_count > 4 && !clen_lengths[clen_order[clen_order_count - 1]])
+        clen_order_count--;
+
+    /* The exact size of the block decides between it and stored blocks */
+    static const int clen_extra_bits[GUAC_FAST_PNG_CLEN_CODES] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7
+    };
+    uint64_t bits = 3 + 5 + 5 + 4 + 3 * clen_order_count + extra_bits + matches;
+    for (int c = 0; c < GUAC_FAST_PNG_CLEN_CODES; c++)
+        bits += (uint64_t) clen_freqs[c] * (clen_lengths[c] + clen_extra_bits[c]);
+    for (int c = 0; c < GUAC_FAST_PNG_LITLEN_CODES; c++)
+        bits += (uint64_t) freqs[c] * lengths[c];
+
+    size_t stored_size = length + (length + GUAC_FAST_PNG_MAX_STORED - 1) / GUAC_FAST_PNG_MAX_STORED * 5;
+    if (bits / 8 >= stored_size) {
+        __guac_png_store_chunk(data, length, last, buffer, writer);
+        return;
+    }
+
+    __guac_png_reserve(buffer, writer, bits / 8 + 8);
+
+    __guac_png_put_bits(writer, last, 1);
+    __guac_png_put_bits(writer, 2, 2);
+    __guac_png_put_bits(writer, litlen_count - 257, 5);
+    __guac_png_put_bits(writer, 0, 5);
+    __guac_png_put_bits(writer, clen_order_count - 4, 4);
+    for (int c = 0; c < clen_order_count; c++)
+        __guac_png_put_bits(writer, clen_lengths[clen_order[c]], 3);
+    for (int c = 0; c < clen_count; c++) {
+        int symbol = clen_symbols[c];
+        __guac_png_put_bits(writer, clen_codes[symbol], clen_lengths[symbol]);
+        if (clen_extra_bits[symbol])
+            __guac_png_put_bits(writer, clen_extra[c], clen_extra_bits[symbol]);
+    }
+
+    /* A match is followed by the distance code of 1, which is a 0 bit */
+    for (size_t t = 0; t < token_count; t++) {
+        int token = tokens[t];
+        if (token < 256) {
+            __guac_png_put_bits(writer, codes[token], lengths[token]);
+        }
+        else {
+            const __guac_png_length_code& code = length_codes[token - 256];
+            __guac_png_put_bits(writer, codes[code.symbol] | (uint32_t) code.extra << lengths[code.symbol],
+                    lengths[code.symbol] + code.extra_bits + 1);
+        }
+    }
+    __guac_png_put_bits(writer, codes[GUAC_FAST_PNG_END_OF_BLOCK], lengths[GUAC_FAST_PNG_END_OF_BLOCK]);
+
+}
+
+static void __guac_png_write_uint32(unsigned char* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+/**
+ * Appends a PNG chunk with its length and CRC.
+ */
+static void __guac_png_append_chunk(std::vector<unsigned char>& buffer, const char* type,
+        const unsigned char* data, size_t length) {
+
+    size_t offset = buffer.size();
+    buffer.resize(offset + length + 12);
+    unsigned char* out = buffer.data() + offset;
+    __guac_png_write_uint32(out, length);
+    memcpy(out + 4, type, 4);
+    if (length)
+        memcpy(out + 8, data, length);
+    __guac_png_write_uint32(out + 8 + length, crc32(0, out + 4, length + 4));
+
+}
+
+void guac_fast_png_encode(const unsigned char* data, int width, int height, int stride,
+        std::vector<unsigned char>& buffer) {
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    size_t row_size = 1 + (size_t) width * 3;
+    size_t chunk_rows = std::max<size_t>(1, GUAC_FAST_PNG_CHUNK_SIZE / row_size);
+
+    static thread_local std::vector<unsigned char> chunk;
+    static thread_local std::vector<unsigned char> scratch;
+    chunk.resize(row_size * chunk_rows + GUAC_FAST_PNG_ROW_SLACK);
+    scratch.resize(row_size + GUAC_FAST_PNG_ROW_SLACK);
+
+    buffer.assign(signature, signature + sizeof(signature));
+
+    /* 8-bit RGB without interlacing */
+    unsigned char header[13] = { 0 };
+    __guac_png_write_uint32(header, width);
+    __guac_png_write_uint32(header + 4, height);
+    header[8] = 8;
+    header[9] = 2;
+    __guac_png_append_chunk(buffer, "IHDR", header, sizeof(header));
+
+    /* The IDAT chunk is written in place, with its length filled in after */
+    size_t idat = buffer.size();
+    buffer.resize(idat + 10);
+    memcpy(buffer.data() + idat + 4, "IDAT", 4);
+
+    /* A zlib header for deflate with a 32 KiB window and the fastest level */
+    buffer[idat + 8] = 0x78;
+    buffer[idat + 9] = 0x01;
+
+    __guac_png_bit_writer writer = { buffer.data() + buffer.size(), 0, 0 };
+    uLong adler = adler32(0, NULL, 0);
+
+    for (size_t y = 0; y < (size_t) height; y += chunk_rows) {
+
+        size_t rows = std::min(chunk_rows, height - y);
+        for (size_t r = 0; r < rows; r++) {
+            const unsigned char* row = data + (y + r) * stride;
+            const unsigned char* above = y + r ? row - stride : NULL;
+            unsigned char* out = chunk.data() + r * row_size;
+
+            /* Sub is written in place, and replaced by Up if that leaves
+             * more zeros */
+            size_t zeros[2] = { 0, 0 };
+            __guac_png_filter(row, above, width, out + 1, scratch.data(), zeros);
+            if (zeros[1] > zeros[0]) {
+                out[0] = 2;
+                memcpy(out + 1, scratch.data(), row_size - 1);
+            }
+            else
+                out[0] = 1;
+        }
+
+        size_t length = rows * row_size;
+        adler = adler32(adler, chunk.data(), length);
+        __guac_png_deflate_chunk(chunk.data(), length, y + rows == (size_t) height, buffer, &writer);
+
+    }
+
+    __guac_png_reserve(buffer, &writer, 4);
+    __guac_png_flush_bits(&writer);
+    __guac_png_write_uint32(writer.out, adler);
+    buffer.resize(writer.out + 4 - buffer.data());
+
+    size_t idat_length = buffer.size() - idat - 8;
+    __guac_png_write_uint32(buffer.data() + idat, idat_length);
+    uint32_t crc = crc32(0, buffer.data() + idat + 4, idat_length + 4);
+    buffer.resize(buffer.size() + 4);
+    __guac_png_write_uint32(buffer.data() + buffer.size() - 4, crc);
+
+    __guac_png_append_chunk(buffer, "IEND", NULL, 0);
+
+}
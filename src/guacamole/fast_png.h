@@ -0,0 +1,31 @@
+#ifndef _GUAC_FAST_PNG_H
+#define _GUAC_FAST_PNG_H
+
+/**
+ * A PNG encoder for screen updates that trades a little size for a lot of
+ * speed, in the style of fpnge. Each row is filtered with Sub and Up at once
+ * using SIMD, keeping whichever leaves more zero bytes, and the filtered rows
+ * are compressed with deflate that only looks for runs of zero bytes, with
+ * Huffman codes built for every 64 KiB of rows. Flat areas and rows that
+ * repeat the one above, which make up most of a desktop, become a few bits
+ * per run, while text compresses less well than with zlib's match finder.
+ *
+ * @file fast_png.h
+ */
+
+#include <vector>
+
+/**
+ * Encodes 32-bit pixels with an unused high byte, like those of a
+ * CAIRO_FORMAT_RGB24 surface, as an 8-bit RGB PNG.
+ *
+ * @param data The first pixel of the image.
+ * @param width The width of the image, in pixels.
+ * @param height The height of the image, in pixels.
+ * @param stride The number of bytes between the start of each row.
+ * @param buffer Replaced with the PNG.
+ */
+void guac_fast_png_encode(const unsigned char* data, int width, int height, int stride,
+        std::vector<unsigned char>& buffer);
+
+#endif
@@ -98,6 +98,12 @@ static void __send_user_clipboard(GuacUser* user, void* data) {
 	user->FreeStream(stream);
 }
 
+/**
+ * Broadcasting the guest's clipboard is disabled: GuacVNCClient doesn't
+ * set GotXCutText and refuses clipboard streams from users. Before this is
+ * enabled again, unchanged contents should be skipped and broadcasts limited
+ * per VM, since every change is sent in full to every user.
+ */
 void guac_common_clipboard_send(guac_common_clipboard* clipboard, GuacClient* client) {
     //guac_client_log(client, GUAC_LOG_DEBUG, "Broadcasting clipboard to all connected users.");
     //guac_client_foreach_user(client, __send_user_clipboard, clipboard);
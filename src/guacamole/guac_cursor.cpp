@@ -24,6 +24,7 @@
 #include "guac_cursor.h"
 #include "guac_pointer_cursor.h"
 #include "guac_surface.h"
+#include "hash.h"
 
 #include <cairo/cairo.h>
 #include <guacamole/protocol.h>
@@ -57,6 +58,7 @@ guac_common_cursor* guac_common_cursor_alloc(GuacClient& client) {
     /* Start cursor in upper-left */
     cursor->x = 0;
     cursor->y = 0;
+    cursor->moved = false;
 
     return cursor;
 
@@ -69,28 +71,68 @@ void guac_common_cursor_free(guac_common_cursor* cursor) {
     if (cursor->surface != NULL)
         cairo_surface_destroy(cursor->surface);
 
-    /* Return layer to pool */
+    /* Return layer and cached image buffers to pool */
 	cursor->client.FreeLayer(cursor->layer);
+    for (guac_common_cursor_image& image : cursor->images)
+        if (image.buffer != NULL)
+            cursor->client.FreeBuffer(image.buffer);
 
-    free(cursor);
+    delete cursor;
 
 }
 
-void guac_common_cursor_dup(guac_common_cursor* cursor, GuacSocket& socket) {
+/**
+ * Sends the position of the cursor layer to every user, including the users
+ * of the scaled down display, where the image of the cursor keeps its size.
+ */
+static void __guac_common_cursor_send_move(guac_common_cursor* cursor) {
 
-    /* Synchronize location */
-    guac_protocol_send_move(socket, cursor->layer, GuacClient::GUAC_DEFAULT_LAYER,
+    guac_protocol_send_move(cursor->client.broadcast_socket_, cursor->layer,
+            GuacClient::GUAC_DEFAULT_LAYER,
             cursor->x - cursor->hotspot_x,
             cursor->y - cursor->hotspot_y,
             0);
 
+    if (cursor->client.HasScaledUsers())
+        guac_protocol_send_move(cursor->client.scaled_socket_, cursor->layer,
+                GuacClient::GUAC_DEFAULT_LAYER,
+                cursor->x / GuacClient::kScaledDisplayDivisor - cursor->hotspot_x,
+                cursor->y / GuacClient::kScaledDisplayDivisor - cursor->hotspot_y,
+                0);
+
+}
+
+void guac_common_cursor_dup(guac_common_cursor* cursor, GuacSocket& socket, int divisor) {
+
+    /* Synchronize location */
+    guac_protocol_send_move(socket, cursor->layer, GuacClient::GUAC_DEFAULT_LAYER,
+            cursor->x / divisor - cursor->hotspot_x,
+            cursor->y / divisor - cursor->hotspot_y,
+            0);
+
+    std::lock_guard<std::mutex> lock(cursor->images_lock);
+
+    /* Upload every cached image, so later cursor changes can refer to them */
+    for (const guac_common_cursor_image& image : cursor->images) {
+        if (image.buffer == NULL)
+            continue;
+
+        guac_protocol_send_size(socket, image.buffer, image.width, image.height);
+        guac_protocol_send_encoded_png(socket, GUAC_COMP_SRC,
+                image.buffer, 0, 0, image.png);
+    }
+
     /* Synchronize cursor image */
     if (cursor->surface != NULL) {
         guac_protocol_send_size(socket, cursor->layer,
                 cursor->width, cursor->height);
 
-        guac_protocol_send_png(socket, GUAC_COMP_SRC,
-                cursor->layer, 0, 0, cursor->surface);
+        if (cursor->current_image != NULL)
+            guac_protocol_send_copy(socket, cursor->current_image->buffer, 0, 0,
+                    cursor->width, cursor->height, GUAC_COMP_SRC, cursor->layer, 0, 0);
+        else
+            guac_protocol_send_png(socket, GUAC_COMP_SRC,
+                    cursor->layer, 0, 0, cursor->surface);
     }
 
     socket.Flush();
@@ -124,17 +166,21 @@ void guac_common_cursor_move(guac_common_cursor* cursor, GuacUser& user,
 
     }
 
-    /* Update cursor position */
+    /* Update cursor position, which is broadcast by the next flush */
     cursor->x = x;
     cursor->y = y;
+    cursor->moved = true;
+}
 
-    guac_protocol_send_move(cursor->client.broadcast_socket_, cursor->layer,
-			GuacClient::GUAC_DEFAULT_LAYER,
-            x - cursor->hotspot_x,
-            y - cursor->hotspot_y,
-            0);
+bool guac_common_cursor_flush(guac_common_cursor* cursor) {
+
+    if (!cursor->moved)
+        return false;
+
+    cursor->moved = false;
+    __guac_common_cursor_send_move(cursor);
+    return true;
 
-	cursor->client.broadcast_socket_.Flush();
 }
 
 /**
@@ -160,9 +206,76 @@ static void guac_common_cursor_resize(guac_common_cursor* cursor,
 
 }
 
+/**
+ * Finds the cached image with the same pixels as the current cursor image,
+ * uploading the image to a buffer on every user's display if it isn't
+ * cached yet. The least recently used image is replaced once the cache is
+ * full. The images_lock must be held.
+ *
+ * @return The cached image, or NULL if the image couldn't be encoded.
+ */
+static guac_common_cursor_image* guac_common_cursor_cache_image(guac_common_cursor* cursor) {
+
+    int width = cursor->width;
+    int height = cursor->height;
+    int stride = cairo_image_surface_get_stride(cursor->surface);
+    uint64_t hash = guac_hash_tile(cursor->image_buffer, width, height, stride);
+
+    guac_common_cursor_image* replaced = &cursor->images[0];
+    for (guac_common_cursor_image& image : cursor->images) {
+
+        if (image.buffer != NULL && image.hash == hash
+                && image.width == width && image.height == height
+                && guac_tile_equal(image.pixels.data(), width * 4,
+                                   cursor->image_buffer, stride, width, height)) {
+            image.last_used = ++cursor->use_count;
+            return &image;
+        }
+
+        /* Prefer unused entries, then the least recently used one */
+        if (replaced->buffer != NULL
+                && (image.buffer == NULL || image.last_used < replaced->last_used))
+            replaced = &image;
+
+    }
+
+    if (guac_protocol_encode_png(cursor->surface, replaced->png))
+        return NULL;
+
+    if (replaced->buffer == NULL)
+        replaced->buffer = cursor->client.AllocBuffer();
+
+    replaced->hash = hash;
+    replaced->width = width;
+    replaced->height = height;
+    replaced->last_used = ++cursor->use_count;
+    replaced->pixels.resize((size_t) width * height * 4);
+    for (int y = 0; y < height; y++)
+        memcpy(replaced->pixels.data() + (size_t) y * width * 4,
+               cursor->image_buffer + (size_t) y * stride, (size_t) width * 4);
+
+    /* Upload image to its buffer */
+    guac_protocol_send_size(cursor->client.broadcast_socket_, replaced->buffer,
+            width, height);
+    guac_protocol_send_encoded_png(cursor->client.broadcast_socket_, GUAC_COMP_SRC,
+            replaced->buffer, 0, 0, replaced->png);
+
+    if (cursor->client.HasScaledUsers()) {
+        guac_protocol_send_size(cursor->client.scaled_socket_, replaced->buffer,
+                width, height);
+        guac_protocol_send_encoded_png(cursor->client.scaled_socket_, GUAC_COMP_SRC,
+                replaced->buffer, 0, 0, replaced->png);
+    }
+
+    return replaced;
+
+}
+
 void guac_common_cursor_set_argb(guac_common_cursor* cursor, int hx, int hy,
     unsigned const char* data, int width, int height, int stride) {
 
+    std::lock_guard<std::mutex> lock(cursor->images_lock);
+
     /* Copy image data */
     guac_common_cursor_resize(cursor, width, height, stride);
     memcpy(cursor->image_buffer, data, height * stride);
@@ -180,25 +293,40 @@ void guac_common_cursor_set_argb(guac_common_cursor* cursor, int hx, int hy,
     cursor->hotspot_y = hy;
 
     /* Update location based on new hotspot */
-    guac_protocol_send_move(cursor->client.broadcast_socket_, cursor->layer,
-			GuacClient::GUAC_DEFAULT_LAYER,
-            cursor->x - hx,
-            cursor->y - hy,
-            0);
+    __guac_common_cursor_send_move(cursor);
+
+    /* Cursors that were used before are already in a buffer on every
+     * user's display, so switching to them is only a copy */
+    cursor->current_image = width > 0 && height > 0
+        ? guac_common_cursor_cache_image(cursor) : NULL;
 
     /* Broadcast new cursor image to all users */
-    guac_protocol_send_size(cursor->client.broadcast_socket_, cursor->layer,
-            width, height);
+    GuacBroadcastSocket* sockets[] = { &cursor->client.broadcast_socket_, &cursor->client.scaled_socket_ };
+    for (GuacBroadcastSocket* socket : sockets) {
+
+        if (socket == &cursor->client.scaled_socket_ && !cursor->client.HasScaledUsers())
+            continue;
 
-    guac_protocol_send_png(cursor->client.broadcast_socket_, GUAC_COMP_SRC,
-            cursor->layer, 0, 0, cursor->surface);
+        guac_protocol_send_size(*socket, cursor->layer, width, height);
+
+        if (cursor->current_image != NULL)
+            guac_protocol_send_copy(*socket,
+                    cursor->current_image->buffer, 0, 0, width, height,
+                    GUAC_COMP_SRC, cursor->layer, 0, 0);
+        else
+            guac_protocol_send_png(*socket, GUAC_COMP_SRC,
+                    cursor->layer, 0, 0, cursor->surface);
+
+    }
 
     cursor->client.broadcast_socket_.Flush();
 
     /* Update hardware cursor of current user */
     if (cursor->user != NULL) {
+        const guac_layer* source = cursor->current_image != NULL
+            ? cursor->current_image->buffer : cursor->layer;
         guac_protocol_send_cursor(cursor->user->socket_, hx, hy,
-                cursor->layer, 0, 0, width, height);
+                source, 0, 0, width, height);
 
         cursor->user->socket_.Flush();
     }
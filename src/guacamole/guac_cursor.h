@@ -31,6 +31,10 @@
 #include "GuacSocket.h"
 #include "GuacUser.h"
 
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
 class GuacClient;
 class GuacUser;
 
@@ -39,6 +43,56 @@ class GuacUser;
  */
 #define GUAC_COMMON_CURSOR_DEFAULT_SIZE 64*64*4
 
+/**
+ * The number of cursor images kept in buffers on every user's display.
+ */
+#define GUAC_COMMON_CURSOR_CACHE_SIZE 16
+
+/**
+ * A cursor image that was uploaded to a buffer on every user's display, so
+ * that switching back to it only needs a copy instead of a new image.
+ */
+typedef struct guac_common_cursor_image {
+
+    /**
+     * The buffer holding the image, or NULL if this entry is unused.
+     */
+    guac_layer* buffer;
+
+    /**
+     * The hash of the image's pixels, from guac_hash_tile().
+     */
+    uint64_t hash;
+
+    /**
+     * The width of the image, in pixels.
+     */
+    int width;
+
+    /**
+     * The height of the image, in pixels.
+     */
+    int height;
+
+    /**
+     * The ARGB pixels of the image, with rows of width * 4 bytes, used to
+     * tell apart images with the same hash.
+     */
+    std::vector<unsigned char> pixels;
+
+    /**
+     * The image encoded as PNG, which is sent to users who join later.
+     */
+    std::vector<unsigned char> png;
+
+    /**
+     * When the image was last used, for replacing the least recently used
+     * entry once the cache is full.
+     */
+    uint64_t last_used;
+
+} guac_common_cursor_image;
+
 /**
  * Cursor object which maintains and synchronizes the current mouse cursor
  * state across all users of a specific client.
@@ -46,7 +100,10 @@ class GuacUser;
 typedef struct guac_common_cursor {
 
 	guac_common_cursor(GuacClient& client) :
-		client(client)
+		client(client),
+		images(),
+		current_image(NULL),
+		use_count(0)
 	{
 	}
 
@@ -114,6 +171,33 @@ typedef struct guac_common_cursor {
      */
     int y;
 
+    /**
+     * Whether the cursor has moved since its position was last broadcast.
+     */
+    bool moved;
+
+    /**
+     * The cursor images uploaded to every user's display.
+     */
+    guac_common_cursor_image images[GUAC_COMMON_CURSOR_CACHE_SIZE];
+
+    /**
+     * The entry of images holding the current cursor image, or NULL if the
+     * cursor image isn't cached.
+     */
+    guac_common_cursor_image* current_image;
+
+    /**
+     * Incremented every time a cached image is used.
+     */
+    uint64_t use_count;
+
+    /**
+     * Guards the cached images, which are sent to joining users from
+     * another thread than the one that changes the cursor.
+     */
+    std::mutex images_lock;
+
 } guac_common_cursor;
 
 /**
@@ -139,8 +223,10 @@ void guac_common_cursor_free(guac_common_cursor* cursor);
  *
  * @param cursor The cursor to send.
  * @param socket The socket along which the cursor should be sent.
+ * @param divisor The number the size of the display the socket's user is sent
+ *                was divided by, which the cursor's position is divided by.
  */
-void guac_common_cursor_dup(guac_common_cursor* cursor, GuacSocket& socket);
+void guac_common_cursor_dup(guac_common_cursor* cursor, GuacSocket& socket, int divisor = 1);
 
 /**
  * Moves the mouse cursor, marking the given user as the most recent user of
@@ -155,6 +241,17 @@ void guac_common_cursor_dup(guac_common_cursor* cursor, GuacSocket& socket);
 void guac_common_cursor_move(guac_common_cursor* cursor, GuacUser& user,
         int x, int y);
 
+/**
+ * Broadcasts the position of the cursor if it has moved since it was last
+ * broadcast. Moves are only broadcast by this function, so that however
+ * often the mouse is moved the other users are sent at most one move each
+ * time it's called.
+ *
+ * @param cursor The cursor whose position should be broadcast.
+ * @return Whether the position was broadcast.
+ */
+bool guac_common_cursor_flush(guac_common_cursor* cursor);
+
 /**
  * Sets the cursor image to the given raw image data. This raw image data must
  * be in 32-bit ARGB format, having 8 bits per color component, where the
@@ -23,14 +23,39 @@
 #include "config.h"
 #include "guac_rect.h"
 #include "guac_surface.h"
+#include "EncoderPool.h"
+#include "ImageCache.h"
+#include "ImageEncoder.h"
+#include "MemoryAccounting.h"
+#include "SurfaceBufferPool.h"
+#include "Tracepoints.h"
 
 #include <cairo/cairo.h>
+#include <guacamole/hash.h>
 #include <guacamole/layer.h>
 #include <guacamole/protocol.h>
+#include <guacamole/screen_codec.h>
 #include <guacamole/socket.h>
+#include <guacamole/timestamp.h>
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 /**
  * The width of an update which should be considered negible and thus
@@ -52,12 +77,37 @@
 #define GUAC_SURFACE_DATA_FACTOR 16
 
 /**
- * The base cost of every update. Each update should be considered to have
- * this starting cost, plus any additional cost estimated from its
- * content.
+ * The base cost of every update, relative to a cost of one per pixel. Each
+ * update is considered to have this starting cost, plus one for each of its
+ * pixels, until the costs of a surface's updates have been measured.
  */
 #define GUAC_SURFACE_BASE_COST 4096
 
+/**
+ * The number of bytes each microsecond spent encoding an update is
+ * considered to cost, which weighs the server's CPU time against the
+ * bandwidth of its viewers.
+ */
+#define GUAC_SURFACE_ENCODE_COST 16
+
+/**
+ * How much the weight of each measured update decays with every update
+ * measured after it.
+ */
+#define GUAC_SURFACE_COST_DECAY 0.98
+
+/**
+ * The decayed number of measured updates needed before the measured costs
+ * are used instead of the defaults.
+ */
+#define GUAC_SURFACE_COST_MIN_SAMPLES 16
+
+/**
+ * The lowest measured cost per pixel that is used, in bytes, so that
+ * updates which happen to be alike can't make larger updates seem free.
+ */
+#define GUAC_SURFACE_MIN_PIXEL_COST 0.01
+
 /**
  * An increase in cost is negligible if it is less than
  * 1/GUAC_SURFACE_NEGLIGIBLE_INCREASE of the old cost.
@@ -71,6 +121,118 @@
  */
 #define GUAC_SURFACE_FILL_PATTERN_FACTOR 3
 
+/**
+ * The width and height of the tiles that large updates are split into, so
+ * that the tiles can be encoded concurrently by the EncoderPool. Tiles are
+ * aligned to a grid over the surface, so the same content shown by several
+ * VMs is split the same way and can be found in the ImageCache.
+ */
+#define GUAC_SURFACE_ENCODE_TILE_SIZE 256
+
+/**
+ * The minimum number of pixels an update must contain for it to be
+ * considered for JPEG. Smaller updates have too little image data for lossy
+ * compression to be worth its artifacts.
+ */
+#define GUAC_SURFACE_JPEG_MIN_BITMAP_SIZE 4096
+
+/**
+ * The minimum rate, in updates per second, an area must be updated at for
+ * JPEG to be considered. Areas that change less often are usually static
+ * content like text, which should stay sharp.
+ */
+#define GUAC_SURFACE_JPEG_FRAMERATE 3
+
+/**
+ * The rate, in updates per second, above which an area is considered to be
+ * video and is encoded at a reduced JPEG quality, as artifacts are hard to
+ * notice in content which changes that quickly.
+ */
+#define GUAC_SURFACE_JPEG_VIDEO_FRAMERATE 15
+
+/**
+ * The divisor applied to the JPEG quality of the images sent to users in the
+ * reduced quality tier, whose connections couldn't keep up with the display.
+ */
+#define GUAC_SURFACE_JPEG_REDUCED_DIVISOR 2
+
+/**
+ * The minimum time, in milliseconds, between two updates of the same heat
+ * map cell for them to be recorded separately. This keeps the several draws
+ * that make up a single frame from counting as several updates.
+ */
+#define GUAC_SURFACE_HEAT_MIN_INTERVAL 10
+
+/**
+ * The time, in milliseconds, after which the update history of a heat map
+ * cell is considered stale and no longer contributes to its update rate.
+ */
+#define GUAC_SURFACE_HEAT_HISTORY_TIMEOUT 1000
+
+/**
+ * The width and height of the tiles that drawn images are compared against
+ * the surface in, when tile diffing is enabled. This matches the heat map
+ * cells so that unchanged cells aren't counted as updated.
+ */
+#define GUAC_SURFACE_DIFF_TILE_SIZE GUAC_COMMON_SURFACE_HEAT_CELL_SIZE
+
+/**
+ * The minimum number of rows or columns that must have moved together, and
+ * the minimum width and height of a dirty rectangle, for a scroll to be sent
+ * as a copy.
+ */
+#define GUAC_SURFACE_SCROLL_MIN_SIZE 64
+
+/**
+ * The minimum number of changed rows or columns which must have moved by the
+ * same offset for that offset to be considered a scroll.
+ */
+#define GUAC_SURFACE_SCROLL_MIN_MATCHES 16
+
+/**
+ * Whether images drawn to surfaces are compared with the surface tile by
+ * tile, set with guac_common_surface_set_tile_diffing().
+ */
+static std::atomic<bool> __guac_common_surface_tile_diffing(true);
+
+/**
+ * Whether the screen is checked for content that moved since the last
+ * flush, set with guac_common_surface_set_scroll_detection().
+ */
+static std::atomic<bool> __guac_common_surface_scroll_detection(true);
+
+/**
+ * How long lossy parts of surfaces must be unchanged before they are sent
+ * again losslessly, in milliseconds, set with
+ * guac_common_surface_set_refine_delay().
+ */
+static std::atomic<int> __guac_common_surface_refine_delay(1000);
+
+/**
+ * Identifiers for how an update was encoded, used to tell apart entries of
+ * the ImageCache with the same pixels. Layers other than the screen are
+ * always lossless when sent as WebP, and JPEG images add their quality and
+ * GUAC_SURFACE_JPEG_QUALITIES times their subsampling to
+ * GUAC_SURFACE_FORMAT_JPEG, which comes after every lossless format.
+ */
+#define GUAC_SURFACE_FORMAT_PNG             0
+#define GUAC_SURFACE_FORMAT_WEBP            1
+#define GUAC_SURFACE_FORMAT_WEBP_LOSSLESS   2
+#define GUAC_SURFACE_FORMAT_SCREEN          3
+#define GUAC_SURFACE_FORMAT_SCREEN_ZSTD     4
+#define GUAC_SURFACE_FORMAT_JPEG            5
+
+/**
+ * Lossy WebP images of the screen with a quality of their own add it to
+ * this, past the identifiers of every JPEG quality and subsampling.
+ */
+#define GUAC_SURFACE_FORMAT_WEBP_QUALITY    1024
+
+/**
+ * The number of JPEG qualities, 0 - 100.
+ */
+#define GUAC_SURFACE_JPEG_QUALITIES 101
+
 /* Define cairo_format_stride_for_width() if missing */
 #ifndef HAVE_CAIRO_FORMAT_STRIDE_FOR_WIDTH
 #define cairo_format_stride_for_width(format, width) (width*4)
@@ -129,6 +291,63 @@ static void __guac_common_clip_rect(guac_common_surface* surface,
 
 }
 
+/**
+ * Estimates the cost of sending the given rectangle of the surface as an
+ * image, from the costs measured for the surface's recent updates. Large
+ * rectangles are encoded as several tiles, each with the base cost.
+ *
+ * @param surface The surface containing the rectangle.
+ * @param rect The rectangle to estimate the cost of.
+ * @return The estimated cost.
+ */
+static double __guac_common_surface_cost(const guac_common_surface* surface,
+        const guac_common_rect* rect) {
+
+    const guac_common_surface_cost_model& model = surface->cost_model;
+    double pixels = (double) rect->width * rect->height;
+
+    if (model.n < GUAC_SURFACE_COST_MIN_SAMPLES)
+        return GUAC_SURFACE_BASE_COST + pixels;
+
+    int tiles = 1;
+    if (EncoderPool::Get().GetThreadCount() > 0 && rect->width > 0 && rect->height > 0)
+        tiles = ((rect->x + rect->width - 1) / GUAC_SURFACE_ENCODE_TILE_SIZE - rect->x / GUAC_SURFACE_ENCODE_TILE_SIZE + 1)
+              * ((rect->y + rect->height - 1) / GUAC_SURFACE_ENCODE_TILE_SIZE - rect->y / GUAC_SURFACE_ENCODE_TILE_SIZE + 1);
+
+    return model.base_cost * tiles + model.pixel_cost * pixels;
+
+}
+
+/**
+ * Records the measured cost of an update sent for the given surface, and
+ * fits the surface's cost model to it and the updates measured before it.
+ *
+ * @param surface The surface the update was sent for.
+ * @param pixels The number of pixels in the update.
+ * @param cost The number of bytes sent, plus the cost of the time spent
+ *             encoding them.
+ */
+static void __guac_common_surface_measure_cost(guac_common_surface* surface,
+        double pixels, double cost) {
+
+    guac_common_surface_cost_model& model = surface->cost_model;
+    model.n      = model.n      * GUAC_SURFACE_COST_DECAY + 1;
+    model.sum_x  = model.sum_x  * GUAC_SURFACE_COST_DECAY + pixels;
+    model.sum_y  = model.sum_y  * GUAC_SURFACE_COST_DECAY + cost;
+    model.sum_xx = model.sum_xx * GUAC_SURFACE_COST_DECAY + pixels * pixels;
+    model.sum_xy = model.sum_xy * GUAC_SURFACE_COST_DECAY + pixels * cost;
+
+    /* Updates of a single size can't tell the two costs apart */
+    double denominator = model.n * model.sum_xx - model.sum_x * model.sum_x;
+    if (denominator <= 0)
+        return;
+
+    double slope = (model.n * model.sum_xy - model.sum_x * model.sum_y) / denominator;
+    model.pixel_cost = std::max(slope, GUAC_SURFACE_MIN_PIXEL_COST);
+    model.base_cost = std::max((model.sum_y - model.pixel_cost * model.sum_x) / model.n, 0.0);
+
+}
+
 /**
  * Returns whether the given rectangle should be combined into the existing
  * dirty rectangle, to be eventually flushed as a "png" instruction.
@@ -143,9 +362,13 @@ static void __guac_common_clip_rect(guac_common_surface* surface,
  */
 static int __guac_common_should_combine(guac_common_surface* surface, const guac_common_rect* rect, int rect_only) {
 
+    /* Nothing will be encoded, so keep a single dirty rect */
+    if (surface->suspended)
+        return 1;
+
     if (surface->dirty) {
 
-        int combined_cost, dirty_cost, update_cost;
+        double combined_cost, dirty_cost, update_cost;
 
         /* Simulate combination */
         guac_common_rect combined = surface->dirty_rect;
@@ -156,9 +379,9 @@ static int __guac_common_should_combine(guac_common_surface* surface, const guac
             return 1;
 
         /* Estimate costs of the existing update, new update, and both combined */
-        combined_cost = GUAC_SURFACE_BASE_COST + combined.width * combined.height;
-        dirty_cost    = GUAC_SURFACE_BASE_COST + surface->dirty_rect.width * surface->dirty_rect.height;
-        update_cost   = GUAC_SURFACE_BASE_COST + rect->width * rect->height;
+        combined_cost = __guac_common_surface_cost(surface, &combined);
+        dirty_cost    = __guac_common_surface_cost(surface, &surface->dirty_rect);
+        update_cost   = __guac_common_surface_cost(surface, rect);
 
         /* Reduce cost if no image data */
         if (rect_only)
@@ -195,197 +418,897 @@ static int __guac_common_should_combine(guac_common_surface* surface, const guac
  * @param surface The surface to mark as dirty.
  * @param rect The rectangle of the update which is dirtying the surface.
  */
-static void __guac_common_mark_dirty(guac_common_surface* surface, const guac_common_rect* rect) {
+/**
+ * Returns the number of heat map cells needed to cover the given number of
+ * pixels along one axis.
+ *
+ * @param length The width or height of the surface, in pixels.
+ * @return The number of heat map cells along that axis.
+ */
+static int __guac_common_surface_heat_cells(int length) {
+    return (length + GUAC_COMMON_SURFACE_HEAT_CELL_SIZE - 1) / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+}
 
-    /* Ignore empty rects */
-    if (rect->width <= 0 || rect->height <= 0)
-        return;
+/**
+ * Allocates a heat map with no recorded updates for a surface of the given
+ * size.
+ *
+ * @param w The width of the surface, in pixels.
+ * @param h The height of the surface, in pixels.
+ * @return A newly-allocated heat map, which must be freed with free().
+ */
+static guac_common_surface_heat_cell* __guac_common_surface_alloc_heat_map(int w, int h) {
+    return (guac_common_surface_heat_cell*) calloc(
+            (size_t) __guac_common_surface_heat_cells(w) * __guac_common_surface_heat_cells(h),
+            sizeof(guac_common_surface_heat_cell));
+}
 
-    /* If already dirty, update existing rect */
-    if (surface->dirty)
-        guac_common_rect_extend(&surface->dirty_rect, rect);
+/**
+ * Records an update to each heat map cell touched by the given rectangle.
+ *
+ * @param surface The surface being updated.
+ * @param rect The area of the surface being updated, which must be within
+ *             the bounds of the surface.
+ * @param time The time of the update.
+ */
+static void __guac_common_surface_touch_rect(guac_common_surface* surface,
+        const guac_common_rect* rect, guac_timestamp time) {
+
+    int columns = __guac_common_surface_heat_cells(surface->width);
+
+    int min_x = rect->x / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int min_y = rect->y / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int max_x = (rect->x + rect->width - 1) / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int max_y = (rect->y + rect->height - 1) / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+
+    for (int y = min_y; y <= max_y; y++) {
+
+        guac_common_surface_heat_cell* cell = surface->heat_map + y * columns + min_x;
+        for (int x = min_x; x <= max_x; x++, cell++) {
+
+            cell->generation = time;
+
+            /* Count draws that are part of the same frame only once */
+            int newest_entry = (cell->oldest_entry + GUAC_COMMON_SURFACE_HEAT_CELL_HISTORY_SIZE - 1)
+                             % GUAC_COMMON_SURFACE_HEAT_CELL_HISTORY_SIZE;
+            if (time - cell->history[newest_entry] < GUAC_SURFACE_HEAT_MIN_INTERVAL)
+                continue;
+
+            cell->history[cell->oldest_entry] = time;
+            cell->oldest_entry = (cell->oldest_entry + 1) % GUAC_COMMON_SURFACE_HEAT_CELL_HISTORY_SIZE;
+
+        }
 
-    /* Otherwise init dirty rect */
-    else {
-        surface->dirty_rect = *rect;
-        surface->dirty = 1;
     }
 
 }
 
 /**
- * Flushes the PNG update currently described by the dirty rectangle within the
- * given surface to that surface's PNG queue. There MUST be space within the
- * queue.
+ * Returns the time the given heat map cell was last updated.
  *
- * @param surface The surface to flush.
+ * @param cell The cell to check.
+ * @return The time of the latest update, or zero if there hasn't been one.
  */
-static void __guac_common_surface_flush_to_queue(guac_common_surface* surface) {
+static guac_timestamp __guac_common_surface_cell_last_update(const guac_common_surface_heat_cell* cell) {
+    return cell->history[(cell->oldest_entry + GUAC_COMMON_SURFACE_HEAT_CELL_HISTORY_SIZE - 1)
+                         % GUAC_COMMON_SURFACE_HEAT_CELL_HISTORY_SIZE];
+}
 
-    guac_common_surface_png_rect* rect;
+/**
+ * Records whether the image sent for the given rectangle was lossy. Cells
+ * only stop waiting to be refined when a lossless image covered all of them.
+ *
+ * @param surface The surface the image was sent for.
+ * @param rect The area of the surface covered by the image.
+ * @param lossy Non-zero if the image was lossy, zero otherwise.
+ */
+static void __guac_common_surface_mark_lossy(guac_common_surface* surface,
+        const guac_common_rect* rect, int lossy) {
 
-    /* Do not flush if not dirty */
-    if (!surface->dirty)
+    if (rect->width <= 0 || rect->height <= 0)
         return;
 
-    /* Add new rect to queue */
-    rect = &(surface->png_queue[surface->png_queue_length++]);
-    rect->rect = surface->dirty_rect;
-    rect->flushed = 0;
+    int columns = __guac_common_surface_heat_cells(surface->width);
 
-    /* Surface now flushed */
-    surface->dirty = 0;
+    int min_x = rect->x / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int min_y = rect->y / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int max_x = (rect->x + rect->width - 1) / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int max_y = (rect->y + rect->height - 1) / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
 
-}
+    for (int y = min_y; y <= max_y; y++) {
 
-void guac_common_surface_flush_deferred(guac_common_surface* surface) {
+        guac_common_surface_heat_cell* cell = surface->heat_map + y * columns + min_x;
+        for (int x = min_x; x <= max_x; x++, cell++) {
 
-    /* Do not flush if not dirty */
-    if (!surface->dirty)
-        return;
+            if (lossy) {
+                if (!cell->lossy) {
+                    cell->lossy = 1;
+                    surface->lossy_cells++;
+                }
+                continue;
+            }
 
-    /* Flush if queue size has reached maximum (space is reserved for the final dirty rect,
-     * as guac_common_surface_flush() MAY add an additional rect to the queue */
-    if (surface->png_queue_length == GUAC_COMMON_SURFACE_QUEUE_SIZE-1)
-        guac_common_surface_flush(surface);
+            if (!cell->lossy)
+                continue;
+
+            /* Cells at the edges of the surface are smaller */
+            guac_common_rect bounds;
+            guac_common_rect_init(&bounds, x * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE,
+                    y * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE,
+                    GUAC_COMMON_SURFACE_HEAT_CELL_SIZE, GUAC_COMMON_SURFACE_HEAT_CELL_SIZE);
+            __guac_common_bound_rect(surface, &bounds, NULL, NULL);
+
+            if (bounds.x >= rect->x && bounds.y >= rect->y
+                    && bounds.x + bounds.width <= rect->x + rect->width
+                    && bounds.y + bounds.height <= rect->y + rect->height) {
+                cell->lossy = 0;
+                surface->lossy_cells--;
+            }
 
-    /* Append dirty rect to queue */
-    __guac_common_surface_flush_to_queue(surface);
+        }
+
+    }
 
 }
 
 /**
- * Transfers a single uint32_t using the given transfer function.
+ * Returns the rate, in updates per second, at which the given heat map cell
+ * has been updated recently.
  *
- * @param op The transfer function to use.
- * @param src The source of the uint32_t value.
- * @param dst THe destination which will hold the result of the transfer.
- * @return Non-zero if the destination value was changed, zero otherwise.
+ * @param cell The cell to check.
+ * @param now The current time.
+ * @return The update rate of the cell.
  */
-static int __guac_common_surface_transfer_int(guac_transfer_function op, uint32_t* src, uint32_t* dst) {
+static int __guac_common_surface_cell_framerate(const guac_common_surface_heat_cell* cell,
+        guac_timestamp now) {
 
-    uint32_t orig = *dst;
+    guac_timestamp oldest = cell->history[cell->oldest_entry];
 
-    switch (op) {
+    /* Cells that haven't been updated enough, or not recently, are static */
+    if (oldest == 0 || now - oldest > GUAC_SURFACE_HEAT_HISTORY_TIMEOUT)
+        return 0;
 
-        case GUAC_TRANSFER_BINARY_BLACK:
-            *dst = 0xFF000000;
-            break;
+    guac_timestamp duration = now - oldest;
+    if (duration <= 0)
+        duration = 1;
 
-        case GUAC_TRANSFER_BINARY_WHITE:
-            *dst = 0xFFFFFFFF;
-            break;
+    return (int) (GUAC_COMMON_SURFACE_HEAT_CELL_HISTORY_SIZE * 1000 / duration);
 
-        case GUAC_TRANSFER_BINARY_SRC:
-            *dst = *src;
-            break;
+}
 
-        case GUAC_TRANSFER_BINARY_DEST:
-            /* NOP */
-            break;
+int guac_common_surface_get_framerate(guac_common_surface* surface, const guac_common_rect* rect) {
 
-        case GUAC_TRANSFER_BINARY_NSRC:
-            *dst = ~(*src);
-            break;
+    if (rect->width <= 0 || rect->height <= 0)
+        return 0;
 
-        case GUAC_TRANSFER_BINARY_NDEST:
-            *dst = ~(*dst);
-            break;
+    int columns = __guac_common_surface_heat_cells(surface->width);
 
-        case GUAC_TRANSFER_BINARY_AND:
-            *dst = (*dst) & (*src);
-            break;
+    int min_x = rect->x / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int min_y = rect->y / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int max_x = (rect->x + rect->width - 1) / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int max_y = (rect->y + rect->height - 1) / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
 
-        case GUAC_TRANSFER_BINARY_NAND:
-            *dst = ~((*dst) & (*src));
-            break;
+    guac_timestamp now = guac_timestamp_current();
+    int sum = 0;
+    int count = 0;
 
-        case GUAC_TRANSFER_BINARY_OR:
-            *dst = (*dst) | (*src);
-            break;
+    for (int y = min_y; y <= max_y; y++) {
+        const guac_common_surface_heat_cell* cell = surface->heat_map + y * columns + min_x;
+        for (int x = min_x; x <= max_x; x++, cell++) {
+            sum += __guac_common_surface_cell_framerate(cell, now);
+            count++;
+        }
+    }
 
-        case GUAC_TRANSFER_BINARY_NOR:
-            *dst = ~((*dst) | (*src));
-            break;
+    return sum / count;
 
-        case GUAC_TRANSFER_BINARY_XOR:
-            *dst = (*dst) ^ (*src);
-            break;
+}
 
-        case GUAC_TRANSFER_BINARY_XNOR:
-            *dst = ~((*dst) ^ (*src));
-            break;
+void guac_common_surface_get_heat_map(guac_common_surface* surface, std::vector<int>& framerates,
+                                      int* columns, int* rows) {
 
-        case GUAC_TRANSFER_BINARY_NSRC_AND:
-            *dst = (*dst) & ~(*src);
-            break;
+    *columns = __guac_common_surface_heat_cells(surface->width);
+    *rows = __guac_common_surface_heat_cells(surface->height);
 
-        case GUAC_TRANSFER_BINARY_NSRC_NAND:
-            *dst = ~((*dst) & ~(*src));
-            break;
+    guac_timestamp now = guac_timestamp_current();
+    size_t count = (size_t) *columns * *rows;
 
-        case GUAC_TRANSFER_BINARY_NSRC_OR:
-            *dst = (*dst) | ~(*src);
-            break;
+    framerates.resize(count);
+    for (size_t i = 0; i < count; i++)
+        framerates[i] = __guac_common_surface_cell_framerate(&surface->heat_map[i], now);
 
-        case GUAC_TRANSFER_BINARY_NSRC_NOR:
-            *dst = ~((*dst) | ~(*src));
-            break;
+}
 
-    }
+static void __guac_common_mark_dirty(guac_common_surface* surface, const guac_common_rect* rect) {
 
-    return *dst != orig;
+    /* Ignore empty rects */
+    if (rect->width <= 0 || rect->height <= 0)
+        return;
+
+    __guac_common_surface_touch_rect(surface, rect, guac_timestamp_current());
+    surface->revision++;
+
+    /* If already dirty, update existing rect */
+    if (surface->dirty)
+        guac_common_rect_extend(&surface->dirty_rect, rect);
+
+    /* Otherwise init dirty rect */
+    else {
+        surface->dirty_rect = *rect;
+        surface->dirty = 1;
+    }
 
 }
 
 /**
- * Draws a rectangle of solid color within the backing surface of the
- * given destination surface.
+ * Copies the given rectangle of the surface into its previous contents, once
+ * the viewers were sent that part of the surface. Nothing is copied if the
+ * previous contents aren't kept or must be copied entirely anyway.
  *
- * @param dst The destination surface.
- * @param rect The rectangle to draw.
- * @param red The red component of the color of the rectangle.
- * @param green The green component of the color of the rectangle.
- * @param blue The blue component of the color of the rectangle.
+ * @param surface The surface whose viewers were updated.
+ * @param rect The area of the surface the viewers were sent, which must be
+ *             within the bounds of the surface.
  */
-static void __guac_common_surface_rect(guac_common_surface* dst, guac_common_rect* rect,
-                                       int red, int green, int blue) {
+static void __guac_common_surface_sync_previous(guac_common_surface* surface,
+        const guac_common_rect* rect) {
 
-    int x, y;
+    if (surface->previous == NULL || surface->previous_stale)
+        return;
 
-    int dst_stride;
-    unsigned char* dst_buffer;
+    size_t offset = (size_t) rect->y * surface->stride + rect->x * 4;
+    for (int y = 0; y < rect->height; y++, offset += surface->stride)
+        memcpy(surface->previous + offset, surface->buffer + offset, (size_t) rect->width * 4);
 
-    uint32_t color = 0xFF000000 | (red << 16) | (green << 8) | blue;
+}
 
-    int min_x = rect->width - 1;
-    int min_y = rect->height - 1;
-    int max_x = 0;
-    int max_y = 0;
+/**
+ * Returns whether the given rectangle overlaps any of the areas of the surface
+ * hidden by layers above it.
+ *
+ * @param surface The surface to check.
+ * @param rect The area of the surface to check.
+ * @return Non-zero if part of the rectangle is covered, zero otherwise.
+ */
+static int __guac_common_surface_is_covered(guac_common_surface* surface,
+        const guac_common_rect* rect) {
 
-    dst_stride = dst->stride;
-    dst_buffer = dst->buffer + (dst_stride * rect->y) + (4 * rect->x);
+    for (const guac_common_rect& covered : surface->covered) {
+        guac_common_rect overlap = covered;
+        guac_common_rect_constrain(&overlap, rect);
+        if (overlap.width > 0 && overlap.height > 0)
+            return 1;
+    }
 
-    /* For each row */
-    for (y=0; y < rect->height; y++) {
+    return 0;
 
-        uint32_t* dst_current = (uint32_t*) dst_buffer;
+}
 
-        /* Set row */
-        for (x=0; x < rect->width; x++) {
+/**
+ * Splits the given rectangle into the parts which aren't hidden by layers
+ * above the surface.
+ *
+ * @param surface The surface containing the rectangle.
+ * @param rect The rectangle to split.
+ * @param visible Receives the visible parts of the rectangle.
+ */
+static void __guac_common_surface_uncover(guac_common_surface* surface,
+        const guac_common_rect& rect, std::vector<guac_common_rect>& visible) {
 
-            uint32_t old_color = *dst_current;
+    visible.assign(1, rect);
 
-            if (old_color != color) {
-                if (x < min_x) min_x = x;
-                if (y < min_y) min_y = y;
-                if (x > max_x) max_x = x;
-                if (y > max_y) max_y = y;
-                *dst_current = color;
+    for (const guac_common_rect& covered : surface->covered) {
+        for (size_t i = 0; i < visible.size();) {
+
+            guac_common_rect part = visible[i];
+            guac_common_rect overlap = covered;
+            guac_common_rect_constrain(&overlap, &part);
+            if (overlap.width <= 0 || overlap.height <= 0) {
+                i++;
+                continue;
+            }
+
+            /* Replace the part with what's above, below, left and right of the overlap */
+            visible.erase(visible.begin() + i);
+            guac_common_rect piece;
+            int bottom = overlap.y + overlap.height;
+            int right = overlap.x + overlap.width;
+            guac_common_rect_init(&piece, part.x, part.y, part.width, overlap.y - part.y);
+            if (piece.height > 0) visible.insert(visible.begin() + i++, piece);
+            guac_common_rect_init(&piece, part.x, bottom, part.width, part.y + part.height - bottom);
+            if (piece.height > 0) visible.insert(visible.begin() + i++, piece);
+            guac_common_rect_init(&piece, part.x, overlap.y, overlap.x - part.x, overlap.height);
+            if (piece.width > 0) visible.insert(visible.begin() + i++, piece);
+            guac_common_rect_init(&piece, right, overlap.y, part.x + part.width - right, overlap.height);
+            if (piece.width > 0) visible.insert(visible.begin() + i++, piece);
+
+        }
+    }
+
+}
+
+/**
+ * Returns the number of queue cells needed to cover the given number of
+ * pixels along one axis.
+ *
+ * @param length The width or height of the surface, in pixels.
+ * @return The number of queue cells along that axis.
+ */
+static int __guac_common_surface_queue_cells(int length) {
+    return (length + GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE - 1) / GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE;
+}
+
+/**
+ * Adds the update currently described by the dirty rectangle within the given
+ * surface to that surface's queue, recording it in each queue cell it touches.
+ *
+ * @param surface The surface to flush.
+ */
+static void __guac_common_surface_flush_to_queue(guac_common_surface* surface) {
+
+    /* Do not flush if not dirty */
+    if (!surface->dirty)
+        return;
+
+    /* Surface now flushed */
+    surface->dirty = 0;
+
+    guac_common_rect rect = surface->dirty_rect;
+    __guac_common_bound_rect(surface, &rect, NULL, NULL);
+    if (rect.width <= 0 || rect.height <= 0)
+        return;
+
+    int columns = __guac_common_surface_queue_cells(surface->width);
+    if (surface->queue_cells.empty()) {
+        guac_common_rect empty;
+        guac_common_rect_init(&empty, 0, 0, 0, 0);
+        surface->queue_cells.assign((size_t) columns
+                * __guac_common_surface_queue_cells(surface->height), empty);
+    }
+
+    int min_x = rect.x / GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE;
+    int min_y = rect.y / GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE;
+    int max_x = (rect.x + rect.width - 1) / GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE;
+    int max_y = (rect.y + rect.height - 1) / GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE;
+
+    for (int y = min_y; y <= max_y; y++) {
+        guac_common_rect* cell = &surface->queue_cells[(size_t) y * columns + min_x];
+        for (int x = min_x; x <= max_x; x++, cell++) {
+
+            /* Record the part of the update within the cell */
+            guac_common_rect part;
+            guac_common_rect_init(&part, x * GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE,
+                    y * GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE,
+                    GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE, GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE);
+            guac_common_rect_constrain(&part, &rect);
+
+            if (cell->width > 0)
+                guac_common_rect_extend(cell, &part);
+            else
+                *cell = part;
+
+        }
+    }
+
+    if (surface->queue_length++)
+        guac_common_rect_extend(&surface->queue_rect, &rect);
+    else
+        surface->queue_rect = rect;
+
+}
+
+void guac_common_surface_flush_deferred(guac_common_surface* surface) {
+
+    /* Append dirty rect to queue */
+    __guac_common_surface_flush_to_queue(surface);
+
+}
+
+/**
+ * Returns whether two updates should be sent as the single rectangle
+ * containing both of them, because the estimated cost of that rectangle is
+ * no more than the cost of sending them separately.
+ *
+ * @param surface The surface containing the updates.
+ * @param a The first update.
+ * @param b The second update.
+ * @return Non-zero if the updates should be combined, zero otherwise.
+ */
+static int __guac_common_surface_should_merge(const guac_common_surface* surface,
+        const guac_common_rect* a, const guac_common_rect* b) {
+
+    guac_common_rect combined = *a;
+    guac_common_rect_extend(&combined, b);
+
+    /* Combine if result is still small */
+    if (combined.width <= GUAC_SURFACE_NEGLIGIBLE_WIDTH && combined.height <= GUAC_SURFACE_NEGLIGIBLE_HEIGHT)
+        return 1;
+
+    return __guac_common_surface_cost(surface, &combined)
+        <= __guac_common_surface_cost(surface, a) + __guac_common_surface_cost(surface, b);
+
+}
+
+/**
+ * A group of queued updates being combined into a single rectangle, which
+ * spans a range of queue cell columns in the rows scanned so far.
+ */
+typedef struct guac_common_surface_queue_region {
+
+    /**
+     * The first and last queue cell columns of the region.
+     */
+    int first;
+    int last;
+
+    /**
+     * The bounds of the updates in the region.
+     */
+    guac_common_rect rect;
+
+} guac_common_surface_queue_region;
+
+/**
+ * Combines the updates in the queue of the given surface into rectangles and
+ * empties the queue. The queue cells are scanned once, row by row: runs of
+ * neighbouring cells with updates form one rectangle each, which is merged
+ * with an overlapping rectangle from the row above when that is estimated to
+ * be cheaper than sending both, so combining takes time proportional to the
+ * area covered by the queue instead of the square of its number of updates.
+ *
+ * @param surface The surface whose queue should be combined.
+ * @param combined Receives the combined rectangles, roughly top to bottom.
+ */
+static void __guac_common_surface_combine_queue(guac_common_surface* surface,
+        std::vector<guac_common_rect>& combined) {
+
+    if (!surface->queue_length)
+        return;
+
+    int columns = __guac_common_surface_queue_cells(surface->width);
+    const guac_common_rect& bounds = surface->queue_rect;
+    int min_x = bounds.x / GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE;
+    int min_y = bounds.y / GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE;
+    int max_x = (bounds.x + bounds.width - 1) / GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE;
+    int max_y = (bounds.y + bounds.height - 1) / GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE;
+
+    /* Regions that may still grow into the current row, and those that reach into it */
+    std::vector<guac_common_surface_queue_region> open;
+    std::vector<guac_common_surface_queue_region> next;
+
+    for (int y = min_y; y <= max_y; y++) {
+
+        guac_common_rect* row = &surface->queue_cells[(size_t) y * columns];
+        size_t o = 0;
+        next.clear();
+
+        for (int x = min_x; x <= max_x; x++) {
+
+            if (row[x].width <= 0)
+                continue;
+
+            /* Take the run of cells starting here, emptying them */
+            guac_common_surface_queue_region run;
+            run.first = x;
+            run.rect = row[x];
+            row[x].width = 0;
+            while (x + 1 <= max_x && row[x + 1].width > 0) {
+                guac_common_rect_extend(&run.rect, &row[++x]);
+                row[x].width = 0;
+            }
+            run.last = x;
+
+            /* Regions which ended left of the run can't grow any more */
+            while (o < open.size() && open[o].last < run.first)
+                combined.push_back(open[o++].rect);
+
+            /* Grow the region above if the run overlaps it and it's worth it */
+            if (o < open.size() && open[o].first <= run.last
+                    && __guac_common_surface_should_merge(surface, &open[o].rect, &run.rect)) {
+                guac_common_surface_queue_region& region = open[o++];
+                guac_common_rect_extend(&region.rect, &run.rect);
+                region.first = std::min(region.first, run.first);
+                region.last = std::max(region.last, run.last);
+                next.push_back(region);
+            }
+            else
+                next.push_back(run);
+
+        }
+
+        /* Regions which didn't reach this row are complete */
+        for (; o < open.size(); o++)
+            combined.push_back(open[o].rect);
+
+        open.swap(next);
+
+    }
+
+    for (const guac_common_surface_queue_region& region : open)
+        combined.push_back(region.rect);
+
+    surface->queue_length = 0;
+
+}
+
+/*
+ * Four pixels at a time, for the loops below that draw to a surface. Each
+ * loop also finds which of its pixels changed, so the lanes that were
+ * compared are turned into a mask with one bit per pixel.
+ */
+#if defined(__SSE2__)
+
+#define GUAC_SURFACE_VECTOR 1
+
+typedef __m128i guac_surface_vector;
+
+static inline guac_surface_vector __guac_vector_load(const uint32_t* pixels) {
+    return _mm_loadu_si128((const __m128i*) pixels);
+}
+
+static inline void __guac_vector_store(uint32_t* pixels, guac_surface_vector v) {
+    _mm_storeu_si128((__m128i*) pixels, v);
+}
+
+static inline guac_surface_vector __guac_vector_dup(uint32_t pixel) {
+    return _mm_set1_epi32((int) pixel);
+}
+
+static inline guac_surface_vector __guac_vector_or(guac_surface_vector a, guac_surface_vector b) {
+    return _mm_or_si128(a, b);
+}
+
+/* Lanes of a where the mask is set, and of b elsewhere */
+static inline guac_surface_vector __guac_vector_select(guac_surface_vector mask,
+        guac_surface_vector a, guac_surface_vector b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline guac_surface_vector __guac_vector_equal(guac_surface_vector a, guac_surface_vector b) {
+    return _mm_cmpeq_epi32(a, b);
+}
+
+/* Whether each pixel has no alpha */
+static inline guac_surface_vector __guac_vector_transparent(guac_surface_vector v) {
+    return _mm_cmpeq_epi32(_mm_and_si128(v, _mm_set1_epi32((int) 0xFF000000)), _mm_setzero_si128());
+}
+
+/* One bit for each lane of the comparison that is clear */
+static inline int __guac_vector_differs(guac_surface_vector equal) {
+    return ~_mm_movemask_ps(_mm_castsi128_ps(equal)) & 0xF;
+}
+
+#elif defined(__ARM_NEON)
+
+#define GUAC_SURFACE_VECTOR 1
+
+typedef uint32x4_t guac_surface_vector;
+
+static inline guac_surface_vector __guac_vector_load(const uint32_t* pixels) {
+    return vld1q_u32(pixels);
+}
+
+static inline void __guac_vector_store(uint32_t* pixels, guac_surface_vector v) {
+    vst1q_u32(pixels, v);
+}
+
+static inline guac_surface_vector __guac_vector_dup(uint32_t pixel) {
+    return vdupq_n_u32(pixel);
+}
+
+static inline guac_surface_vector __guac_vector_or(guac_surface_vector a, guac_surface_vector b) {
+    return vorrq_u32(a, b);
+}
+
+static inline guac_surface_vector __guac_vector_select(guac_surface_vector mask,
+        guac_surface_vector a, guac_surface_vector b) {
+    return vbslq_u32(mask, a, b);
+}
+
+static inline guac_surface_vector __guac_vector_equal(guac_surface_vector a, guac_surface_vector b) {
+    return vceqq_u32(a, b);
+}
+
+static inline guac_surface_vector __guac_vector_transparent(guac_surface_vector v) {
+    return vceqq_u32(vandq_u32(v, vdupq_n_u32(0xFF000000)), vdupq_n_u32(0));
+}
+
+static inline int __guac_vector_differs(guac_surface_vector equal) {
+    static const uint32_t bits[4] = { 1, 2, 4, 8 };
+    uint32x4_t set = vbicq_u32(vld1q_u32(bits), equal);
+    uint32x2_t sum = vadd_u32(vget_low_u32(set), vget_high_u32(set));
+    return (int) vget_lane_u32(vpadd_u32(sum, sum), 0);
+}
+
+#endif
+
+#ifdef GUAC_SURFACE_VECTOR
+
+/**
+ * The first and last pixel set in each mask from __guac_vector_differs().
+ */
+static const int8_t __guac_vector_first[16] = { -1, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0 };
+static const int8_t __guac_vector_last[16] = { -1, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3 };
+
+#endif
+
+/**
+ * Widens the range of changed pixels in a row, from first to last, to
+ * include the pixels set in a mask from __guac_vector_differs() for the
+ * four pixels starting at x, or the single pixel x if the mask is 1.
+ */
+static inline void __guac_row_changed(int x, int mask, int* first, int* last) {
+#ifdef GUAC_SURFACE_VECTOR
+    int lane_first = x + __guac_vector_first[mask];
+    int lane_last = x + __guac_vector_last[mask];
+#else
+    int lane_first = x;
+    int lane_last = x;
+#endif
+    if (lane_first < *first) *first = lane_first;
+    if (lane_last > *last) *last = lane_last;
+}
+
+/**
+ * Fills a row of pixels with a color.
+ *
+ * @param dst The first pixel of the row.
+ * @param width The number of pixels in the row.
+ * @param color The color to fill with.
+ * @param first Set to the first pixel that changed, if it's before the
+ *              pixel it already holds.
+ * @param last Set to the last pixel that changed, if it's after the pixel
+ *             it already holds.
+ */
+static void __guac_row_fill(uint32_t* dst, int width, uint32_t color,
+        int* first, int* last) {
+
+    int x = 0;
+
+#ifdef GUAC_SURFACE_VECTOR
+    guac_surface_vector fill = __guac_vector_dup(color);
+    for (; x + 4 <= width; x += 4) {
+        int changed = __guac_vector_differs(__guac_vector_equal(__guac_vector_load(dst + x), fill));
+        if (changed) {
+            __guac_vector_store(dst + x, fill);
+            __guac_row_changed(x, changed, first, last);
+        }
+    }
+#endif
+
+    for (; x < width; x++) {
+        if (dst[x] != color) {
+            dst[x] = color;
+            __guac_row_changed(x, 1, first, last);
+        }
+    }
+
+}
+
+/**
+ * Copies a row of pixels, made opaque. Unless the source is opaque, its
+ * pixels without any alpha are skipped. The changed range is updated as
+ * by __guac_row_fill().
+ */
+static void __guac_row_put(const uint32_t* src, uint32_t* dst, int width, int opaque,
+        int* first, int* last) {
+
+    int x = 0;
+
+#ifdef GUAC_SURFACE_VECTOR
+    guac_surface_vector alpha = __guac_vector_dup(0xFF000000);
+    for (; x + 4 <= width; x += 4) {
+        guac_surface_vector src_pixels = __guac_vector_load(src + x);
+        guac_surface_vector old_pixels = __guac_vector_load(dst + x);
+        guac_surface_vector new_pixels = __guac_vector_or(src_pixels, alpha);
+        if (!opaque)
+            new_pixels = __guac_vector_select(__guac_vector_transparent(src_pixels), old_pixels, new_pixels);
+        int changed = __guac_vector_differs(__guac_vector_equal(new_pixels, old_pixels));
+        if (changed) {
+            __guac_vector_store(dst + x, new_pixels);
+            __guac_row_changed(x, changed, first, last);
+        }
+    }
+#endif
+
+    for (; x < width; x++) {
+        if (opaque || (src[x] & 0xFF000000)) {
+            uint32_t new_color = src[x] | 0xFF000000;
+            if (dst[x] != new_color) {
+                dst[x] = new_color;
+                __guac_row_changed(x, 1, first, last);
+            }
+        }
+    }
+
+}
+
+/**
+ * Copies a row of pixels as they are, which may overlap the row they are
+ * copied to. The row is copied from its end if backwards is non-zero, which
+ * it must be if the destination is after the source. The changed range is
+ * updated as by __guac_row_fill().
+ */
+static void __guac_row_copy(const uint32_t* src, uint32_t* dst, int width, int backwards,
+        int* first, int* last) {
+
+    if (!backwards) {
+        int x = 0;
+#ifdef GUAC_SURFACE_VECTOR
+        for (; x + 4 <= width; x += 4) {
+            guac_surface_vector src_pixels = __guac_vector_load(src + x);
+            int changed = __guac_vector_differs(__guac_vector_equal(src_pixels, __guac_vector_load(dst + x)));
+            if (changed) {
+                __guac_vector_store(dst + x, src_pixels);
+                __guac_row_changed(x, changed, first, last);
             }
+        }
+#endif
+        for (; x < width; x++) {
+            if (dst[x] != src[x]) {
+                dst[x] = src[x];
+                __guac_row_changed(x, 1, first, last);
+            }
+        }
+        return;
+    }
+
+    int x = width;
+#ifdef GUAC_SURFACE_VECTOR
+    for (; x >= 4; x -= 4) {
+        guac_surface_vector src_pixels = __guac_vector_load(src + x - 4);
+        int changed = __guac_vector_differs(__guac_vector_equal(src_pixels, __guac_vector_load(dst + x - 4)));
+        if (changed) {
+            __guac_vector_store(dst + x - 4, src_pixels);
+            __guac_row_changed(x - 4, changed, first, last);
+        }
+    }
+#endif
+    for (x--; x >= 0; x--) {
+        if (dst[x] != src[x]) {
+            dst[x] = src[x];
+            __guac_row_changed(x, 1, first, last);
+        }
+    }
+
+}
+
+/**
+ * Widens the bounds of the changed pixels of a rectangle to include the
+ * range of changed pixels of row y, if any of them changed.
+ */
+static inline void __guac_rect_changed(int y, int first, int last,
+        int* min_x, int* min_y, int* max_x, int* max_y) {
+
+    if (first > last)
+        return;
+
+    if (first < *min_x) *min_x = first;
+    if (last > *max_x) *max_x = last;
+    if (y < *min_y) *min_y = y;
+    if (y > *max_y) *max_y = y;
+
+}
+
+/**
+ * Transfers a single uint32_t using the given transfer function.
+ *
+ * @param op The transfer function to use.
+ * @param src The source of the uint32_t value.
+ * @param dst THe destination which will hold the result of the transfer.
+ * @return Non-zero if the destination value was changed, zero otherwise.
+ */
+static int __guac_common_surface_transfer_int(guac_transfer_function op, uint32_t* src, uint32_t* dst) {
+
+    uint32_t orig = *dst;
+
+    switch (op) {
+
+        case GUAC_TRANSFER_BINARY_BLACK:
+            *dst = 0xFF000000;
+            break;
+
+        case GUAC_TRANSFER_BINARY_WHITE:
+            *dst = 0xFFFFFFFF;
+            break;
+
+        case GUAC_TRANSFER_BINARY_SRC:
+            *dst = *src;
+            break;
+
+        case GUAC_TRANSFER_BINARY_DEST:
+            /* NOP */
+            break;
+
+        case GUAC_TRANSFER_BINARY_NSRC:
+            *dst = ~(*src);
+            break;
+
+        case GUAC_TRANSFER_BINARY_NDEST:
+            *dst = ~(*dst);
+            break;
+
+        case GUAC_TRANSFER_BINARY_AND:
+            *dst = (*dst) & (*src);
+            break;
+
+        case GUAC_TRANSFER_BINARY_NAND:
+            *dst = ~((*dst) & (*src));
+            break;
+
+        case GUAC_TRANSFER_BINARY_OR:
+            *dst = (*dst) | (*src);
+            break;
+
+        case GUAC_TRANSFER_BINARY_NOR:
+            *dst = ~((*dst) | (*src));
+            break;
+
+        case GUAC_TRANSFER_BINARY_XOR:
+            *dst = (*dst) ^ (*src);
+            break;
+
+        case GUAC_TRANSFER_BINARY_XNOR:
+            *dst = ~((*dst) ^ (*src));
+            break;
+
+        case GUAC_TRANSFER_BINARY_NSRC_AND:
+            *dst = (*dst) & ~(*src);
+            break;
+
+        case GUAC_TRANSFER_BINARY_NSRC_NAND:
+            *dst = ~((*dst) & ~(*src));
+            break;
 
-            dst_current++;
-        }
+        case GUAC_TRANSFER_BINARY_NSRC_OR:
+            *dst = (*dst) | ~(*src);
+            break;
+
+        case GUAC_TRANSFER_BINARY_NSRC_NOR:
+            *dst = ~((*dst) | ~(*src));
+            break;
+
+    }
+
+    return *dst != orig;
+
+}
+
+/**
+ * Draws a rectangle of solid color within the backing surface of the
+ * given destination surface.
+ *
+ * @param dst The destination surface.
+ * @param rect The rectangle to draw.
+ * @param red The red component of the color of the rectangle.
+ * @param green The green component of the color of the rectangle.
+ * @param blue The blue component of the color of the rectangle.
+ */
+static void __guac_common_surface_rect(guac_common_surface* dst, guac_common_rect* rect,
+                                       int red, int green, int blue) {
+
+    int y;
+
+    int dst_stride;
+    unsigned char* dst_buffer;
+
+    uint32_t color = 0xFF000000 | (red << 16) | (green << 8) | blue;
+
+    int min_x = rect->width - 1;
+    int min_y = rect->height - 1;
+    int max_x = 0;
+    int max_y = 0;
+
+    dst_stride = dst->stride;
+    dst_buffer = dst->buffer + (dst_stride * rect->y) + (4 * rect->x);
+
+    /* For each row */
+    for (y=0; y < rect->height; y++) {
+
+        /* Set row */
+        int first = rect->width;
+        int last = -1;
+        __guac_row_fill((uint32_t*) dst_buffer, rect->width, color, &first, &last);
+        __guac_rect_changed(y, first, last, &min_x, &min_y, &max_x, &max_y);
 
         /* Next row */
         dst_buffer += dst_stride;
@@ -428,7 +1351,7 @@ static void __guac_common_surface_put(unsigned char* src_buffer, int src_stride,
     unsigned char* dst_buffer = dst->buffer;
     int dst_stride = dst->stride;
 
-    int x, y;
+    int y;
 
     int min_x = rect->width - 1;
     int min_y = rect->height - 1;
@@ -444,29 +1367,12 @@ static void __guac_common_surface_put(unsigned char* src_buffer, int src_stride,
     /* For each row */
     for (y=0; y < rect->height; y++) {
 
-        uint32_t* src_current = (uint32_t*) src_buffer;
-        uint32_t* dst_current = (uint32_t*) dst_buffer;
-
         /* Copy row */
-        for (x=0; x < rect->width; x++) {
-
-            if (opaque || (*src_current & 0xFF000000)) {
-
-                uint32_t new_color = *src_current | 0xFF000000;
-                uint32_t old_color = *dst_current;
-
-                if (old_color != new_color) {
-                    if (x < min_x) min_x = x;
-                    if (y < min_y) min_y = y;
-                    if (x > max_x) max_x = x;
-                    if (y > max_y) max_y = y;
-                    *dst_current = new_color;
-                }
-            }
-
-            src_current++;
-            dst_current++;
-        }
+        int first = rect->width;
+        int last = -1;
+        __guac_row_put((const uint32_t*) src_buffer, (uint32_t*) dst_buffer,
+                rect->width, opaque, &first, &last);
+        __guac_rect_changed(y, first, last, &min_x, &min_y, &max_x, &max_y);
 
         /* Next row */
         src_buffer += src_stride;
@@ -528,14 +1434,24 @@ static void __guac_common_surface_fill_mask(unsigned char* src_buffer, int src_s
         uint32_t* dst_current = (uint32_t*) dst_buffer;
 
         /* Stencil row */
-        for (x=0; x < rect->width; x++) {
+        x = 0;
+
+#ifdef GUAC_SURFACE_VECTOR
+        guac_surface_vector fill = __guac_vector_dup(color);
+        for (; x + 4 <= rect->width; x += 4) {
+            guac_surface_vector mask = __guac_vector_load(src_current + x);
+            guac_surface_vector old_pixels = __guac_vector_load(dst_current + x);
+            __guac_vector_store(dst_current + x,
+                    __guac_vector_select(__guac_vector_transparent(mask), old_pixels, fill));
+        }
+#endif
+
+        for (; x < rect->width; x++) {
 
             /* Fill with color if opaque */
-            if (*src_current & 0xFF000000)
-                *dst_current = color;
+            if (src_current[x] & 0xFF000000)
+                dst_current[x] = color;
 
-            src_current++;
-            dst_current++;
         }
 
         /* Next row */
@@ -601,6 +1517,27 @@ static void __guac_common_surface_transfer(guac_common_surface* src, int* sx, in
         uint32_t* src_current = (uint32_t*) src_buffer;
         uint32_t* dst_current = (uint32_t*) dst_buffer;
 
+        /* Copies are by far the most common transfer, so their rows are
+         * copied several pixels at a time. The range of changed pixels is
+         * counted from the end of the row when copying backwards, like x */
+        if (op == GUAC_TRANSFER_BINARY_SRC) {
+            int first = rect->width;
+            int last = -1;
+            int offset = step < 0 ? rect->width - 1 : 0;
+            __guac_row_copy(src_current - offset, dst_current - offset,
+                    rect->width, step < 0, &first, &last);
+            if (step < 0 && first <= last) {
+                int old_last = last;
+                last = rect->width - 1 - first;
+                first = rect->width - 1 - old_last;
+            }
+            __guac_rect_changed(y, first, last, &min_x, &min_y, &max_x, &max_y);
+
+            src_buffer += src_stride;
+            dst_buffer += dst_stride;
+            continue;
+        }
+
         /* Transfer each pixel in row */
         for (x=0; x < rect->width; x++) {
 
@@ -653,6 +1590,26 @@ static void __guac_common_surface_transfer(guac_common_surface* src, int* sx, in
 
 }
 
+/**
+ * Returns the number of bytes of pixel buffers allocated for the given
+ * surface, including the copy of what viewers have and the snapshot if
+ * there are those.
+ */
+static size_t __guac_common_surface_buffer_bytes(const guac_common_surface* surface) {
+    size_t size = (size_t) surface->height * surface->stride;
+    return size * (1 + (surface->previous != NULL) + (surface->snapshot != NULL));
+}
+
+/**
+ * Charges the change in the size of the pixel buffers of the given surface
+ * to its memory account, if it has one.
+ */
+static void __guac_common_surface_account(guac_common_surface* surface, size_t old_bytes) {
+    if (surface->memory_account != NULL)
+        surface->memory_account->Resize(MemoryCategory::kSurfaces, old_bytes,
+                __guac_common_surface_buffer_bytes(surface));
+}
+
 guac_common_surface* guac_common_surface_alloc(GuacSocket& socket, const guac_layer* layer, int w, int h) {
 
     /* Init surface */
@@ -660,7 +1617,9 @@ guac_common_surface* guac_common_surface_alloc(GuacSocket& socket, const guac_la
 
     /* Create corresponding Cairo surface */
     surface->stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, w);
-    surface->buffer = (unsigned char*)calloc(h, surface->stride);
+    surface->buffer = SurfaceBufferPool::Get().Allocate((size_t) h * surface->stride);
+    surface->heat_map = __guac_common_surface_alloc_heat_map(w, h);
+    surface->heat_map_time = guac_timestamp_current();
 
     /* Reset clipping rect */
     guac_common_surface_reset_clip(surface);
@@ -680,12 +1639,21 @@ guac_common_surface* guac_common_surface_alloc(GuacSocket& socket, const guac_la
 
 void guac_common_surface_free(guac_common_surface* surface) {
 
+    /* The encoder threads may still be reading the snapshot */
+    guac_common_surface_finish_flush(surface);
+
     /* Only dispose of surface if it exists */
     if (surface->realized)
         guac_protocol_send_dispose(surface->socket, surface->layer);
 
-    free(surface->buffer);
-    free(surface);
+    size_t size = (size_t) surface->height * surface->stride;
+    if (surface->memory_account != NULL)
+        surface->memory_account->Free(MemoryCategory::kSurfaces, __guac_common_surface_buffer_bytes(surface));
+    free(surface->heat_map);
+    SurfaceBufferPool::Get().Free(surface->snapshot, size);
+    SurfaceBufferPool::Get().Free(surface->previous, size);
+    SurfaceBufferPool::Get().Free(surface->buffer, size);
+    delete surface;
 
 }
 
@@ -695,30 +1663,75 @@ void guac_common_surface_resize(guac_common_surface* surface, int w, int h) {
     const guac_layer* layer = surface->layer;
 
     unsigned char* old_buffer;
+    unsigned char* old_previous;
     int old_stride;
+    size_t old_size;
     guac_common_rect old_rect;
 
     int sx = 0;
     int sy = 0;
 
+    /* Updates still being encoded are sent at the size they were flushed at */
+    guac_common_surface_finish_flush(surface);
+
+    size_t old_bytes = __guac_common_surface_buffer_bytes(surface);
+
+    /* The queue cells have a different layout at the new size, so everything
+     * queued becomes a single update */
+    if (surface->queue_length) {
+        std::vector<guac_common_rect> queued;
+        __guac_common_surface_combine_queue(surface, queued);
+        if (surface->dirty)
+            guac_common_rect_extend(&surface->dirty_rect, &surface->queue_rect);
+        else {
+            surface->dirty_rect = surface->queue_rect;
+            surface->dirty = 1;
+        }
+    }
+    surface->queue_cells.clear();
+
     /* Copy old surface data */
     old_buffer = surface->buffer;
+    old_previous = surface->previous;
     old_stride = surface->stride;
+    old_size = (size_t) surface->height * surface->stride;
     guac_common_rect_init(&old_rect, 0, 0, surface->width, surface->height);
 
     /* Re-initialize at new size */
     surface->width  = w;
     surface->height = h;
     surface->stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, w);
-    surface->buffer = (unsigned char*)calloc(h, surface->stride);
+    surface->buffer = SurfaceBufferPool::Get().Allocate((size_t) h * surface->stride);
     __guac_common_bound_rect(surface, &surface->clip_rect, NULL, NULL);
 
+    /* The layout of the heat map has changed, so start its history over */
+    free(surface->heat_map);
+    surface->heat_map = __guac_common_surface_alloc_heat_map(w, h);
+    surface->heat_map_time = guac_timestamp_current();
+    surface->lossy_cells = 0;
+    surface->revision++;
+
     /* Copy relevant old data */
     __guac_common_bound_rect(surface, &old_rect, NULL, NULL);
     __guac_common_surface_put(old_buffer, old_stride, &sx, &sy, surface, &old_rect, 1);
 
-    /* Free old data */
-    free(old_buffer);
+    /* Viewers keep the part of the layer that remains when it's resized, so
+     * what they were last sent of it still is */
+    if (old_previous != NULL) {
+        surface->previous = SurfaceBufferPool::Get().Allocate((size_t) h * surface->stride);
+        for (int y = 0; y < old_rect.height; y++)
+            memcpy(surface->previous + (size_t) y * surface->stride,
+                   old_previous + (size_t) y * old_stride, (size_t) old_rect.width * 4);
+        SurfaceBufferPool::Get().Free(old_previous, old_size);
+    }
+
+    /* The snapshot is allocated again at the new size when it's needed */
+    SurfaceBufferPool::Get().Free(surface->snapshot, old_size);
+    surface->snapshot = NULL;
+
+    /* Return old data to the pool, where the next resize can reuse it */
+    SurfaceBufferPool::Get().Free(old_buffer, old_size);
+    __guac_common_surface_account(surface, old_bytes);
 
     /* Resize dirty rect to fit new surface dimensions */
     if (surface->dirty) {
@@ -727,19 +1740,220 @@ void guac_common_surface_resize(guac_common_surface* surface, int w, int h) {
             surface->dirty = 0;
     }
 
+    /* Only the areas that were exposed have to be sent, as separate updates
+     * so the retained area between them isn't encoded again */
+    guac_common_surface_invalidate(surface, old_rect.width, 0, w - old_rect.width, h);
+    guac_common_surface_invalidate(surface, 0, old_rect.height, old_rect.width, h - old_rect.height);
+
     /* Update Guacamole layer */
     if (surface->realized)
         guac_protocol_send_size(socket, layer, w, h);
 
 }
 
-void guac_common_surface_draw(guac_common_surface* surface, int x, int y, cairo_surface_t* src) {
+void guac_common_surface_set_tile_diffing(int enabled) {
+    __guac_common_surface_tile_diffing = enabled != 0;
+}
 
-    unsigned char* buffer = cairo_image_surface_get_data(src);
-    cairo_format_t format = cairo_image_surface_get_format(src);
-    int stride = cairo_image_surface_get_stride(src);
-    int w = cairo_image_surface_get_width(src);
-    int h = cairo_image_surface_get_height(src);
+void guac_common_surface_set_refine_delay(int milliseconds) {
+    __guac_common_surface_refine_delay = milliseconds;
+}
+
+void guac_common_surface_set_scroll_detection(int enabled) {
+    __guac_common_surface_scroll_detection = enabled != 0;
+}
+
+void guac_common_surface_set_covered(guac_common_surface* surface,
+        const std::vector<guac_common_rect>& rects) {
+    surface->covered = rects;
+}
+
+void guac_common_surface_set_png_profile(guac_common_surface* surface,
+        const guac_png_profile& profile) {
+    surface->png_profile = profile;
+}
+
+void guac_common_surface_set_jpeg_profile(guac_common_surface* surface,
+        const guac_jpeg_profile& profile) {
+    surface->jpeg_profile = profile;
+}
+
+void guac_common_surface_set_memory_account(guac_common_surface* surface,
+        MemoryAccount* account) {
+    size_t bytes = __guac_common_surface_buffer_bytes(surface);
+    if (surface->memory_account != NULL)
+        surface->memory_account->Free(MemoryCategory::kSurfaces, bytes);
+    surface->memory_account = account;
+    if (account != NULL)
+        account->Allocate(MemoryCategory::kSurfaces, bytes);
+}
+
+/**
+ * The width of the spans that rows of pixels are converted in by
+ * guac_common_surface_draw_pixels(), small enough to stay on the stack.
+ */
+#define GUAC_SURFACE_CONVERT_SPAN 64
+
+/**
+ * An image being drawn to a surface, which is either a 32-bit image that can
+ * be copied directly or pixels that must be converted first.
+ */
+typedef struct guac_common_surface_source {
+
+    /**
+     * The first pixel of the image.
+     */
+    const unsigned char* buffer;
+
+    /**
+     * The number of bytes in each row of the image.
+     */
+    int stride;
+
+    /**
+     * The number of bytes in each pixel of the image.
+     */
+    int bpp;
+
+    /**
+     * Whether the image should be treated as opaque.
+     */
+    int opaque;
+
+    /**
+     * The function converting the pixels to 32-bit RGB, or NULL if the
+     * image is already in that format.
+     */
+    guac_common_surface_convert_func* convert;
+
+    /**
+     * The data passed to convert.
+     */
+    const void* data;
+
+} guac_common_surface_source;
+
+/**
+ * Converts pixels of the given source and copies them to the given
+ * destination rect, which MUST already be clipped. The rect is then
+ * restricted to the pixels which actually changed, as with
+ * __guac_common_surface_put().
+ *
+ * @param src The source image, which must have a conversion function.
+ * @param sx The X coordinate of the source rectangle.
+ * @param sy The Y coordinate of the source rectangle.
+ * @param dst The destination surface.
+ * @param rect The destination rectangle.
+ */
+static void __guac_common_surface_put_converted(const guac_common_surface_source* src,
+                                                int* sx, int* sy,
+                                                guac_common_surface* dst, guac_common_rect* rect) {
+
+    uint32_t span[GUAC_SURFACE_CONVERT_SPAN];
+
+    const unsigned char* src_buffer = src->buffer + src->stride * (*sy) + src->bpp * (*sx);
+    unsigned char* dst_buffer = dst->buffer + (dst->stride * rect->y) + (4 * rect->x);
+
+    int min_x = rect->width - 1;
+    int min_y = rect->height - 1;
+    int max_x = 0;
+    int max_y = 0;
+
+    int orig_x = rect->x;
+    int orig_y = rect->y;
+
+    for (int y = 0; y < rect->height; y++) {
+
+        uint32_t* dst_current = (uint32_t*) dst_buffer;
+
+        for (int x = 0; x < rect->width; x += GUAC_SURFACE_CONVERT_SPAN) {
+
+            int length = std::min(rect->width - x, GUAC_SURFACE_CONVERT_SPAN);
+            src->convert(src_buffer + x * src->bpp, span, length, src->data);
+
+            /* Copy span, noting which pixels changed */
+            for (int i = 0; i < length; i++, dst_current++) {
+                uint32_t new_color = span[i] | 0xFF000000;
+                if (*dst_current != new_color) {
+                    if (x + i < min_x) min_x = x + i;
+                    if (y < min_y) min_y = y;
+                    if (x + i > max_x) max_x = x + i;
+                    if (y > max_y) max_y = y;
+                    *dst_current = new_color;
+                }
+            }
+
+        }
+
+        /* Next row */
+        src_buffer += src->stride;
+        dst_buffer += dst->stride;
+
+    }
+
+    /* Restrict destination rect to only updated pixels */
+    if (max_x >= min_x && max_y >= min_y) {
+        rect->x += min_x;
+        rect->y += min_y;
+        rect->width = max_x - min_x + 1;
+        rect->height = max_y - min_y + 1;
+    }
+    else {
+        rect->width = 0;
+        rect->height = 0;
+    }
+
+    /* Update source X/Y */
+    *sx += rect->x - orig_x;
+    *sy += rect->y - orig_y;
+
+}
+
+/**
+ * Copies the given rectangle of an image to the surface and marks the pixels
+ * which actually changed as dirty.
+ *
+ * @param surface The surface to draw to.
+ * @param src The image to draw.
+ * @param sx The X coordinate of the rectangle within the image.
+ * @param sy The Y coordinate of the rectangle within the image.
+ * @param rect The destination rectangle, which must already be clipped.
+ */
+static void __guac_common_surface_draw_rect(guac_common_surface* surface,
+        const guac_common_surface_source* src, int sx, int sy, guac_common_rect* rect) {
+
+    /* Update backing surface */
+    if (src->convert != NULL)
+        __guac_common_surface_put_converted(src, &sx, &sy, surface, rect);
+    else
+        __guac_common_surface_put((unsigned char*) src->buffer, src->stride, &sx, &sy,
+                                  surface, rect, src->opaque);
+
+    if (rect->width <= 0 || rect->height <= 0)
+        return;
+
+    /* Flush if not combining */
+    if (!__guac_common_should_combine(surface, rect, 0))
+        guac_common_surface_flush_deferred(surface);
+
+    /* Always defer draws */
+    __guac_common_mark_dirty(surface, rect);
+
+}
+
+/**
+ * Draws an image to the surface at the given coordinates, comparing it with
+ * the surface tile by tile if enabled.
+ *
+ * @param surface The surface to draw to.
+ * @param src The image to draw.
+ * @param x The destination X coordinate.
+ * @param y The destination Y coordinate.
+ * @param w The width of the image.
+ * @param h The height of the image.
+ */
+static void __guac_common_surface_draw_source(guac_common_surface* surface,
+        const guac_common_surface_source* src, int x, int y, int w, int h) {
 
     int sx = 0;
     int sy = 0;
@@ -752,17 +1966,134 @@ void guac_common_surface_draw(guac_common_surface* surface, int x, int y, cairo_
     if (rect.width <= 0 || rect.height <= 0)
         return;
 
-    /* Update backing surface */
-    __guac_common_surface_put(buffer, stride, &sx, &sy, surface, &rect, format != CAIRO_FORMAT_ARGB32);
-    if (rect.width <= 0 || rect.height <= 0)
+    if (!__guac_common_surface_tile_diffing
+            || (rect.width <= GUAC_SURFACE_DIFF_TILE_SIZE && rect.height <= GUAC_SURFACE_DIFF_TILE_SIZE)) {
+        __guac_common_surface_draw_rect(surface, src, sx, sy, &rect);
         return;
+    }
+
+    /* VNC servers often report large rects where only a few pixels changed,
+     * so shrink each tile to the pixels that changed within it instead of
+     * marking a single bounding box of all changes as dirty */
+    int min_x = rect.x / GUAC_SURFACE_DIFF_TILE_SIZE * GUAC_SURFACE_DIFF_TILE_SIZE;
+    int min_y = rect.y / GUAC_SURFACE_DIFF_TILE_SIZE * GUAC_SURFACE_DIFF_TILE_SIZE;
+
+    for (int ty = min_y; ty < rect.y + rect.height; ty += GUAC_SURFACE_DIFF_TILE_SIZE) {
+        for (int tx = min_x; tx < rect.x + rect.width; tx += GUAC_SURFACE_DIFF_TILE_SIZE) {
+
+            guac_common_rect tile;
+            guac_common_rect_init(&tile, tx, ty, GUAC_SURFACE_DIFF_TILE_SIZE, GUAC_SURFACE_DIFF_TILE_SIZE);
+            guac_common_rect_constrain(&tile, &rect);
+
+            __guac_common_surface_draw_rect(surface, src,
+                    sx + tile.x - rect.x, sy + tile.y - rect.y, &tile);
+
+        }
+    }
+
+}
+
+void guac_common_surface_draw(guac_common_surface* surface, int x, int y, cairo_surface_t* src) {
+
+    guac_common_surface_source source;
+    source.buffer = cairo_image_surface_get_data(src);
+    source.stride = cairo_image_surface_get_stride(src);
+    source.bpp = 4;
+    source.opaque = cairo_image_surface_get_format(src) != CAIRO_FORMAT_ARGB32;
+    source.convert = NULL;
+    source.data = NULL;
+
+    __guac_common_surface_draw_source(surface, &source, x, y,
+            cairo_image_surface_get_width(src), cairo_image_surface_get_height(src));
+
+}
+
+void guac_common_surface_draw_pixels(guac_common_surface* surface, int x, int y, int w, int h,
+        const unsigned char* buffer, int stride, int bpp,
+        guac_common_surface_convert_func* convert, const void* data) {
+
+    guac_common_surface_source source;
+    source.buffer = buffer;
+    source.stride = stride;
+    source.bpp = bpp;
+    source.opaque = 1;
+    source.convert = convert;
+    source.data = data;
+
+    __guac_common_surface_draw_source(surface, &source, x, y, w, h);
+
+}
+
+/**
+ * Marks the given rectangle of the surface as dirty.
+ *
+ * @param surface The surface to mark.
+ * @param rect The area that changed, which must be within the bounds of the
+ *             surface.
+ */
+static void __guac_common_surface_invalidate_rect(guac_common_surface* surface,
+        const guac_common_rect* rect) {
 
     /* Flush if not combining */
-    if (!__guac_common_should_combine(surface, &rect, 0))
+    if (!__guac_common_should_combine(surface, rect, 0))
         guac_common_surface_flush_deferred(surface);
 
-    /* Always defer draws */
-    __guac_common_mark_dirty(surface, &rect);
+    __guac_common_mark_dirty(surface, rect);
+
+}
+
+/**
+ * Returns whether any pixel of the given rectangle differs from what viewers
+ * were last sent of it.
+ */
+static int __guac_common_surface_differs_from_previous(const guac_common_surface* surface,
+        const guac_common_rect* rect) {
+
+    size_t offset = (size_t) rect->y * surface->stride + rect->x * 4;
+    for (int y = 0; y < rect->height; y++, offset += surface->stride) {
+        if (memcmp(surface->buffer + offset, surface->previous + offset, (size_t) rect->width * 4) != 0)
+            return 1;
+    }
+
+    return 0;
+
+}
+
+void guac_common_surface_invalidate(guac_common_surface* surface, int x, int y, int w, int h) {
+
+    guac_common_rect rect;
+    guac_common_rect_init(&rect, x, y, w, h);
+
+    /* Clip operation */
+    __guac_common_clip_rect(surface, &rect, NULL, NULL);
+    if (rect.width <= 0 || rect.height <= 0)
+        return;
+
+    /* The pixels were changed in place, like by a VNC client decoding into
+     * the surface's buffer, so large areas are compared tile by tile with
+     * what viewers already have instead. This keeps the full update a VNC
+     * server sends after the screen is resized from encoding all of it. */
+    if (!__guac_common_surface_tile_diffing || surface->previous == NULL || surface->previous_stale
+            || (rect.width <= GUAC_SURFACE_DIFF_TILE_SIZE && rect.height <= GUAC_SURFACE_DIFF_TILE_SIZE)) {
+        __guac_common_surface_invalidate_rect(surface, &rect);
+        return;
+    }
+
+    int min_x = rect.x / GUAC_SURFACE_DIFF_TILE_SIZE * GUAC_SURFACE_DIFF_TILE_SIZE;
+    int min_y = rect.y / GUAC_SURFACE_DIFF_TILE_SIZE * GUAC_SURFACE_DIFF_TILE_SIZE;
+
+    for (int ty = min_y; ty < rect.y + rect.height; ty += GUAC_SURFACE_DIFF_TILE_SIZE) {
+        for (int tx = min_x; tx < rect.x + rect.width; tx += GUAC_SURFACE_DIFF_TILE_SIZE) {
+
+            guac_common_rect tile;
+            guac_common_rect_init(&tile, tx, ty, GUAC_SURFACE_DIFF_TILE_SIZE, GUAC_SURFACE_DIFF_TILE_SIZE);
+            guac_common_rect_constrain(&tile, &rect);
+
+            if (__guac_common_surface_differs_from_previous(surface, &tile))
+                __guac_common_surface_invalidate_rect(surface, &tile);
+
+        }
+    }
 
 }
 
@@ -819,8 +2150,16 @@ void guac_common_surface_copy(guac_common_surface* src, int sx, int sy, int w, i
             return;
     }
 
+    /* Viewers are sent the operation itself if it isn't combined */
+    int sent = 0;
+    guac_common_rect sent_rect = rect;
+
+    /* Viewers may not have the latest contents of covered areas to copy from */
+    guac_common_rect source_rect;
+    guac_common_rect_init(&source_rect, sx, sy, rect.width, rect.height);
+
     /* Defer if combining */
-    if (__guac_common_should_combine(dst, &rect, 1))
+    if (__guac_common_should_combine(dst, &rect, 1) || __guac_common_surface_is_covered(src, &source_rect))
         __guac_common_mark_dirty(dst, &rect);
 
     /* Otherwise, flush and draw immediately */
@@ -830,12 +2169,16 @@ void guac_common_surface_copy(guac_common_surface* src, int sx, int sy, int w, i
         guac_protocol_send_copy(socket, src_layer, sx, sy, rect.width, rect.height,
                                 GUAC_COMP_OVER, dst_layer, rect.x, rect.y);
         dst->realized = 1;
+        sent = 1;
     }
 
     /* Update backing surface last if destination rect can intersect source rect */
     if (src == dst)
         __guac_common_surface_transfer(src, &sx, &sy, GUAC_TRANSFER_BINARY_SRC, dst, &rect);
 
+    if (sent)
+        __guac_common_surface_sync_previous(dst, &sent_rect);
+
 }
 
 void guac_common_surface_transfer(guac_common_surface* src, int sx, int sy, int w, int h,
@@ -860,8 +2203,16 @@ void guac_common_surface_transfer(guac_common_surface* src, int sx, int sy, int
             return;
     }
 
+    /* Viewers are sent the operation itself if it isn't combined */
+    int sent = 0;
+    guac_common_rect sent_rect = rect;
+
+    /* Viewers may not have the latest contents of covered areas to copy from */
+    guac_common_rect source_rect;
+    guac_common_rect_init(&source_rect, sx, sy, rect.width, rect.height);
+
     /* Defer if combining */
-    if (__guac_common_should_combine(dst, &rect, 1))
+    if (__guac_common_should_combine(dst, &rect, 1) || __guac_common_surface_is_covered(src, &source_rect))
         __guac_common_mark_dirty(dst, &rect);
 
     /* Otherwise, flush and draw immediately */
@@ -870,12 +2221,16 @@ void guac_common_surface_transfer(guac_common_surface* src, int sx, int sy, int
         guac_common_surface_flush(src);
         guac_protocol_send_transfer(socket, src_layer, sx, sy, rect.width, rect.height, op, dst_layer, rect.x, rect.y);
         dst->realized = 1;
+        sent = 1;
     }
 
     /* Update backing surface last if destination rect can intersect source rect */
     if (src == dst)
         __guac_common_surface_transfer(src, &sx, &sy, op, dst, &rect);
 
+    if (sent)
+        __guac_common_surface_sync_previous(dst, &sent_rect);
+
 }
 
 void guac_common_surface_rect(guac_common_surface* surface,
@@ -908,6 +2263,7 @@ void guac_common_surface_rect(guac_common_surface* surface,
         guac_protocol_send_rect(socket, layer, rect.x, rect.y, rect.width, rect.height);
         guac_protocol_send_cfill(socket, GUAC_COMP_OVER, layer, red, green, blue, 0xFF);
         surface->realized = 1;
+        __guac_common_surface_sync_previous(surface, &rect);
     }
 
 }
@@ -932,30 +2288,297 @@ void guac_common_surface_reset_clip(guac_common_surface* surface) {
 }
 
 /**
- * Flushes the PNG update currently described by the dirty rectangle within the
- * given surface directly to a "png" instruction, which is sent on the socket
- * associated with the surface.
+ * Returns whether any cell of the heat map touched by the given rectangle
+ * is waiting to be refined.
+ *
+ * @param surface The surface to check.
+ * @param rect The area of the surface to check, which must be within the
+ *             bounds of the surface.
+ * @return Non-zero if any of the cells is lossy, zero otherwise.
+ */
+static int __guac_common_surface_is_lossy(guac_common_surface* surface,
+        const guac_common_rect* rect) {
+
+    if (!surface->lossy_cells)
+        return 0;
+
+    int columns = __guac_common_surface_heat_cells(surface->width);
+
+    int min_x = rect->x / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int min_y = rect->y / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int max_x = (rect->x + rect->width - 1) / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    int max_y = (rect->y + rect->height - 1) / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+
+    for (int y = min_y; y <= max_y; y++) {
+        const guac_common_surface_heat_cell* cell = surface->heat_map + y * columns + min_x;
+        for (int x = min_x; x <= max_x; x++, cell++) {
+            if (cell->lossy)
+                return 1;
+        }
+    }
+
+    return 0;
+
+}
+
+/**
+ * Finds the offset by which most of a list of lines (rows or columns) moved
+ * since they were last sent, and the longest run of lines which moved by
+ * that offset.
+ *
+ * @param current The hash of every line as it is now.
+ * @param previous The hash of every line as it was last sent, which must have
+ *                 as many entries as current.
+ * @param offset Receives the offset from the index of each moved line to
+ *               the index it had before it moved.
+ * @param start Receives the index of the first line of the run.
+ * @return The number of lines in the run, or zero if the lines didn't move.
+ */
+static int __guac_common_surface_find_shift(const std::vector<uint64_t>& current,
+        const std::vector<uint64_t>& previous, int* offset, int* start) {
+
+    int count = (int) current.size();
+
+    /* Index previous lines, ignoring lines that repeat (like blank lines),
+     * as they would match at any offset */
+    std::unordered_map<uint64_t, int> lines;
+    lines.reserve(count);
+    for (int i = 0; i < count; i++) {
+        auto line = lines.emplace(previous[i], i);
+        if (!line.second)
+            line.first->second = -1;
+    }
+
+    /* Each changed line votes for the offset it would have moved by */
+    std::unordered_map<int, int> votes;
+    int best_offset = 0;
+    int best_votes = 0;
+    for (int i = 0; i < count; i++) {
+
+        if (current[i] == previous[i])
+            continue;
+
+        auto line = lines.find(current[i]);
+        if (line == lines.end() || line->second < 0)
+            continue;
+
+        int line_votes = ++votes[line->second - i];
+        if (line_votes > best_votes) {
+            best_votes = line_votes;
+            best_offset = line->second - i;
+        }
+
+    }
+
+    if (best_votes < GUAC_SURFACE_SCROLL_MIN_MATCHES)
+        return 0;
+
+    /* Find the longest run of lines that match at that offset */
+    int first = std::max(0, -best_offset);
+    int last = std::min(count, count - best_offset);
+    int run_start = -1;
+    int length = 0;
+    for (int i = first; i <= last; i++) {
+
+        int match = i < last && current[i] == previous[i + best_offset];
+
+        if (match && run_start < 0)
+            run_start = i;
+
+        else if (!match && run_start >= 0) {
+            if (i - run_start > length) {
+                length = i - run_start;
+                *start = run_start;
+            }
+            run_start = -1;
+        }
+
+    }
+
+    if (length < GUAC_SURFACE_SCROLL_MIN_SIZE)
+        return 0;
+
+    *offset = best_offset;
+    return length;
+
+}
+
+/**
+ * Checks whether part of the given dirty rectangle is content that moved
+ * vertically or horizontally within it since it was last sent, like a
+ * scrolled window. QEMU rarely sends a CopyRect for this, so the moved
+ * content is found by comparing the hashes of each row and column with
+ * those of the previous contents of the surface. If found, the moved
+ * content is sent as a copy, and only the rest of the rectangle needs to be
+ * sent as images.
+ *
+ * @param surface The surface being flushed, which must have up to date
+ *                previous contents.
+ * @param rect The dirty rectangle.
+ * @param remaining Receives up to two rectangles which must still be sent as
+ *                  images.
+ * @return The number of rectangles stored in remaining.
+ */
+static int __guac_common_surface_send_scroll(guac_common_surface* surface,
+        const guac_common_rect* rect, guac_common_rect* remaining) {
+
+    remaining[0] = *rect;
+
+    if (rect->width < GUAC_SURFACE_SCROLL_MIN_SIZE || rect->height < GUAC_SURFACE_SCROLL_MIN_SIZE)
+        return 1;
+
+    int stride = surface->stride;
+    size_t rect_offset = (size_t) rect->y * stride + rect->x * 4;
+    const unsigned char* current = surface->buffer + rect_offset;
+    const unsigned char* previous = surface->previous + rect_offset;
+
+    std::vector<uint64_t> current_lines(rect->height);
+    std::vector<uint64_t> previous_lines(rect->height);
+    int offset = 0;
+    int start = 0;
+
+    /* Most scrolling is vertical, so compare rows first */
+    for (int y = 0; y < rect->height; y++) {
+        current_lines[y] = guac_hash_tile(current + y * stride, rect->width, 1, stride);
+        previous_lines[y] = guac_hash_tile(previous + y * stride, rect->width, 1, stride);
+    }
+
+    int vertical = 1;
+    int length = __guac_common_surface_find_shift(current_lines, previous_lines, &offset, &start);
+
+    /* Then columns */
+    if (!length) {
+
+        current_lines.resize(rect->width);
+        previous_lines.resize(rect->width);
+        for (int x = 0; x < rect->width; x++) {
+            current_lines[x] = guac_hash_tile(current + x * 4, 1, rect->height, stride);
+            previous_lines[x] = guac_hash_tile(previous + x * 4, 1, rect->height, stride);
+        }
+
+        vertical = 0;
+        length = __guac_common_surface_find_shift(current_lines, previous_lines, &offset, &start);
+
+    }
+
+    if (!length)
+        return 1;
+
+    guac_common_rect dst;
+    int sx = rect->x;
+    int sy = rect->y;
+    if (vertical) {
+        guac_common_rect_init(&dst, rect->x, rect->y + start, rect->width, length);
+        sy = dst.y + offset;
+    }
+    else {
+        guac_common_rect_init(&dst, rect->x + start, rect->y, length, rect->height);
+        sx = dst.x + offset;
+    }
+
+    /* Hashes can collide, so make sure the content really moved */
+    if (!guac_tile_equal(surface->buffer + (size_t) dst.y * stride + dst.x * 4, stride,
+                         surface->previous + (size_t) sy * stride + sx * 4, stride,
+                         dst.width, dst.height))
+        return 1;
+
+    guac_protocol_send_copy(surface->socket, surface->layer, sx, sy, dst.width, dst.height,
+                            GUAC_COMP_OVER, surface->layer, dst.x, dst.y);
+
+    /* Lossy content stays lossy when it is moved */
+    if (__guac_common_surface_refine_delay > 0) {
+        guac_common_rect src;
+        guac_common_rect_init(&src, sx, sy, dst.width, dst.height);
+        if (__guac_common_surface_is_lossy(surface, &src))
+            __guac_common_surface_mark_lossy(surface, &dst, 1);
+    }
+
+    /* Send the parts before and after the moved content as images */
+    int count = 0;
+    if (vertical) {
+        guac_common_rect_init(&remaining[count], rect->x, rect->y, rect->width, start);
+        if (start > 0) count++;
+        guac_common_rect_init(&remaining[count], rect->x, dst.y + length, rect->width,
+                rect->height - start - length);
+        if (remaining[count].height > 0) count++;
+    }
+    else {
+        guac_common_rect_init(&remaining[count], rect->x, rect->y, start, rect->height);
+        if (start > 0) count++;
+        guac_common_rect_init(&remaining[count], dst.x + length, rect->y,
+                rect->width - start - length, rect->height);
+        if (remaining[count].width > 0) count++;
+    }
+
+    return count;
+
+}
+
+/**
+ * Adds the PNG update currently described by the dirty rectangle within the
+ * given surface to the list of updates which will be encoded and sent by
+ * __guac_common_surface_send_updates(). When the EncoderPool has threads,
+ * large updates are split into tiles so they can be encoded concurrently.
+ * When scroll detection is used, content that moved within the dirty
+ * rectangle is sent as a copy right away instead.
  *
  * @param surface The surface to flush.
+ * @param updates The updates which will be sent when the flush completes.
+ * @param flushed The dirty rectangles flushed so far during this flush,
+ *                which receives the current one.
+ * @param scroll Non-zero to check the dirty rectangle for moved content.
  */
-static void __guac_common_surface_flush_to_png(guac_common_surface* surface) {
+static void __guac_common_surface_flush_to_png(guac_common_surface* surface,
+        std::vector<guac_common_rect>& updates, std::vector<guac_common_rect>& flushed,
+        int scroll) {
 
     if (surface->dirty) {
 
-        GuacSocket& socket = surface->socket;
-        const guac_layer* layer = surface->layer;
-
-        /* Get Cairo surface for specified rect */
-        unsigned char* buffer = surface->buffer + surface->dirty_rect.y * surface->stride + surface->dirty_rect.x * 4;
-        cairo_surface_t* rect = cairo_image_surface_create_for_data(buffer, CAIRO_FORMAT_RGB24,
-                                                                    surface->dirty_rect.width,
-                                                                    surface->dirty_rect.height,
-                                                                    surface->stride);
+        const guac_common_rect& dirty = surface->dirty_rect;
+        int tile_size = EncoderPool::Get().GetThreadCount() > 0
+            ? GUAC_SURFACE_ENCODE_TILE_SIZE : INT32_MAX;
+
+        /* Copies read what viewers have now, so content sent earlier in this
+         * flush mustn't be involved, nor content hidden from them */
+        for (const guac_common_rect& other : flushed) {
+            guac_common_rect overlap = other;
+            guac_common_rect_constrain(&overlap, &dirty);
+            if (overlap.width > 0 && overlap.height > 0)
+                scroll = 0;
+        }
+        if (__guac_common_surface_is_covered(surface, &dirty))
+            scroll = 0;
+
+        guac_common_rect remaining[2];
+        int count = 1;
+        remaining[0] = dirty;
+        if (scroll)
+            count = __guac_common_surface_send_scroll(surface, &dirty, remaining);
+
+        /* Split the visible parts along the tile grid, top to bottom and
+         * left to right */
+        std::vector<guac_common_rect> visible;
+        for (int i = 0; i < count; i++) {
+            __guac_common_surface_uncover(surface, remaining[i], visible);
+            for (const guac_common_rect& update : visible) {
+                if (tile_size == INT32_MAX) {
+                    updates.push_back(update);
+                    continue;
+                }
+                int min_x = update.x / tile_size * tile_size;
+                int min_y = update.y / tile_size * tile_size;
+                for (int y = min_y; y < update.y + update.height; y += tile_size) {
+                    for (int x = min_x; x < update.x + update.width; x += tile_size) {
+                        guac_common_rect tile;
+                        guac_common_rect_init(&tile, x, y, tile_size, tile_size);
+                        guac_common_rect_constrain(&tile, &update);
+                        updates.push_back(tile);
+                    }
+                }
+            }
+        }
 
-        /* Send PNG for rect */
-        guac_protocol_send_png(socket, GUAC_COMP_OVER, layer, surface->dirty_rect.x, surface->dirty_rect.y, rect);
-        cairo_surface_destroy(rect);
-        surface->realized = 1;
+        flushed.push_back(dirty);
 
         /* Surface is no longer dirty */
         surface->dirty = 0;
@@ -965,95 +2588,616 @@ static void __guac_common_surface_flush_to_png(guac_common_surface* surface) {
 }
 
 /**
- * Comparator for instances of guac_common_surface_png_rect, the elements
- * which make up a surface's PNG buffer.
+ * Updates of a surface to be encoded, with everything that decides how they
+ * are encoded taken from the surface when they were flushed, so the encoder
+ * threads only read the pixels.
+ */
+struct guac_common_surface_encoding {
+
+    std::vector<guac_common_rect> updates;
+
+    /**
+     * The pixels of the surface, which are the snapshot when encoding while
+     * the surface is drawn to.
+     */
+    const unsigned char* source;
+    int stride;
+
+    const guac_layer* layer;
+    guac_png_profile png_profile;
+    guac_jpeg_profile jpeg_profile;
+
+    /**
+     * Non-zero to send every update losslessly, to use WebP, to consider
+     * JPEG, and to encode JPEG images again for the reduced quality tier.
+     */
+    int lossless;
+    int webp;
+    int jpeg;
+    int reduced;
+
+    /**
+     * How the screen codec is used instead of PNG, as returned by
+     * guac_protocol_use_screen_codec().
+     */
+    int screen;
+
+    /**
+     * The rate each update's area was updated at, for choosing JPEG.
+     */
+    std::vector<int> framerates;
+
+    std::vector<std::vector<unsigned char>> images;
+    std::vector<std::vector<unsigned char>> reduced_images;
+    std::vector<int> results;
+    std::vector<int> formats;
+    std::vector<double> encode_times;
+
+    /**
+     * Set once every update has been encoded, when encoding asynchronously.
+     * Guarded by mutex.
+     */
+    int encoded;
+    std::mutex mutex;
+    std::condition_variable finished;
+
+};
+
+/**
+ * Returns a rough estimate of how well the given rectangle of an image
+ * would compress as a PNG. Runs of identical pixels, which are common in
+ * text and user interface elements, compress well as PNG but poorly as JPEG,
+ * while photographic content has few of them.
+ *
+ * @param source The first pixel of the image.
+ * @param stride The number of bytes in each row of the image.
+ * @param rect The rectangle to check.
+ * @return A positive value if PNG is likely to be better than JPEG, a
+ *         negative value otherwise.
+ */
+static int __guac_common_surface_png_optimality(const unsigned char* source, int stride,
+        const guac_common_rect* rect) {
+
+    int num_same = 0;
+    int num_different = 1;
+
+    /* Image must be at least 1x1 */
+    if (rect->width < 1 || rect->height < 1)
+        return 0;
+
+    const unsigned char* buffer = source + rect->y * stride + rect->x * 4;
+
+    for (int y = 0; y < rect->height; y++) {
+
+        const uint32_t* row = (const uint32_t*) buffer;
+        uint32_t last_pixel = row[0] & 0xFFFFFF;
+
+        for (int x = 1; x < rect->width; x++) {
+
+            uint32_t current_pixel = row[x] & 0xFFFFFF;
+
+            if (current_pixel == last_pixel)
+                num_same++;
+            else
+                num_different++;
+
+            last_pixel = current_pixel;
+
+        }
+
+        buffer += stride;
+
+    }
+
+    /* PNG wins once there are roughly four same pixels for every different one */
+    return 0x100 * num_same / num_different - 0x400;
+
+}
+
+/**
+ * Returns whether the given update should be encoded as JPEG rather than
+ * PNG. Only large updates whose contents look photographic are sent as JPEG.
  *
- * @see qsort
+ * @param encoding The updates being encoded.
+ * @param i The index of the update.
+ * @return Non-zero if JPEG should be used, zero otherwise.
  */
-static int __guac_common_surface_png_rect_compare(const void* a, const void* b) {
+static int __guac_common_surface_should_use_jpeg(const guac_common_surface_encoding* encoding, size_t i) {
 
-    guac_common_surface_png_rect* ra = (guac_common_surface_png_rect*) a;
-    guac_common_surface_png_rect* rb = (guac_common_surface_png_rect*) b;
+    const guac_common_rect* rect = &encoding->updates[i];
+    int framerate = encoding->jpeg_profile.lossy_framerate > 0 ? encoding->jpeg_profile.lossy_framerate
+                                                               : GUAC_SURFACE_JPEG_FRAMERATE;
 
-    /* Order roughly top to bottom, left to right */
-    if (ra->rect.y != rb->rect.y) return ra->rect.y - rb->rect.y;
-    if (ra->rect.x != rb->rect.x) return ra->rect.x - rb->rect.x;
+    return rect->width * rect->height >= GUAC_SURFACE_JPEG_MIN_BITMAP_SIZE
+        && encoding->framerates[i] >= framerate
+        && __guac_common_surface_png_optimality(encoding->source, encoding->stride, rect) < 0;
+
+}
 
-    /* Wider updates should come first (more likely to intersect later) */
-    if (ra->rect.width != rb->rect.width) return rb->rect.width - ra->rect.width;
+/**
+ * Decides how the given updates of the surface are encoded, as PNG or as
+ * JPEG or WebP depending on their contents and on who receives them.
+ *
+ * @param surface The surface being flushed.
+ * @param updates The updates to send.
+ * @param lossless Non-zero to send every update as PNG, zero otherwise.
+ * @param source The pixels to encode, laid out like the surface's buffer.
+ * @param encoding Receives the updates and how to encode them.
+ */
+static void __guac_common_surface_prepare_updates(guac_common_surface* surface,
+        const std::vector<guac_common_rect>& updates, int lossless,
+        const unsigned char* source, guac_common_surface_encoding* encoding) {
+
+    size_t count = updates.size();
+    encoding->updates = updates;
+    encoding->source = source;
+    encoding->stride = surface->stride;
+    encoding->layer = surface->layer;
+    encoding->png_profile = surface->png_profile;
+    encoding->jpeg_profile = surface->jpeg_profile;
+    encoding->lossless = lossless;
+    encoding->encoded = 0;
+
+    /* The screen codec is lossless and the fastest to encode, so it's
+     * preferred over WebP, though JPEG is still used for video */
+    encoding->screen = guac_protocol_use_screen_codec(surface->socket);
+
+    /* Use WebP if every user receiving the updates supports it */
+    encoding->webp = !lossless && !encoding->screen && guac_protocol_use_webp(surface->socket);
+
+    /* Only the screen can be lossy, other layers (like the cursor) must stay exact */
+    encoding->jpeg = !lossless && !encoding->webp && guac_protocol_jpeg_enabled()
+                  && surface->layer->index == 0;
+
+    /* JPEG images are encoded a second time for the reduced quality tier */
+    encoding->reduced = encoding->jpeg && surface->socket.HasReducedTier();
+
+    encoding->framerates.assign(count, 0);
+    if (encoding->jpeg) {
+        for (size_t i = 0; i < count; i++)
+            encoding->framerates[i] = guac_common_surface_get_framerate(surface, &updates[i]);
+    }
 
-    /* Shorter updates should come first (less likely to increase cost) */
-    return ra->rect.height - rb->rect.height;
+    encoding->images.assign(count, std::vector<unsigned char>());
+    encoding->reduced_images.assign(count, std::vector<unsigned char>());
+    encoding->results.assign(count, 0);
+    encoding->formats.assign(count, 0);
+    encoding->encode_times.assign(count, 0);
 
 }
 
-void guac_common_surface_flush(guac_common_surface* surface) {
+/**
+ * Encodes one of the updates. Only reads the encoding, so it can be called
+ * from any thread.
+ *
+ * @param encoding The updates being encoded.
+ * @param i The index of the update to encode.
+ */
+static void __guac_common_surface_encode_update(guac_common_surface_encoding* encoding, size_t i) {
+
+    const guac_common_rect& update = encoding->updates[i];
+    auto start = std::chrono::steady_clock::now();
+
+    /* Get Cairo surface for specified rect */
+    unsigned char* buffer = (unsigned char*) encoding->source + update.y * encoding->stride + update.x * 4;
+    cairo_surface_t* rect = cairo_image_surface_create_for_data(buffer, CAIRO_FORMAT_RGB24,
+                                                                update.width,
+                                                                update.height,
+                                                                encoding->stride);
+
+    int webp = encoding->webp;
+    int format = GUAC_SURFACE_FORMAT_PNG;
+    if (encoding->screen)
+        format = encoding->screen == GUAC_SCREEN_CODEC_ZSTD ? GUAC_SURFACE_FORMAT_SCREEN_ZSTD
+                                                            : GUAC_SURFACE_FORMAT_SCREEN;
+    if (webp) {
+        format = encoding->layer->index == 0 ? GUAC_SURFACE_FORMAT_WEBP
+                                             : GUAC_SURFACE_FORMAT_WEBP_LOSSLESS;
+        if (format == GUAC_SURFACE_FORMAT_WEBP && guac_protocol_webp_lossy()
+                && encoding->jpeg_profile.webp_quality > 0)
+            format = GUAC_SURFACE_FORMAT_WEBP_QUALITY + encoding->jpeg_profile.webp_quality;
+    }
+    else if (encoding->jpeg && __guac_common_surface_should_use_jpeg(encoding, i)) {
+
+        /* Artifacts are hard to notice in video, so trade quality for size */
+        int quality = encoding->jpeg_profile.quality > 0 ? encoding->jpeg_profile.quality
+                                                         : guac_protocol_jpeg_quality();
+        if (encoding->framerates[i] >= GUAC_SURFACE_JPEG_VIDEO_FRAMERATE)
+            quality = quality * 2 / 3;
+
+        format = GUAC_SURFACE_FORMAT_JPEG + quality
+               + encoding->jpeg_profile.subsampling * GUAC_SURFACE_JPEG_QUALITIES;
+    }
+    encoding->formats[i] = format;
+
+    /* Reuse the encoded image if these pixels have been sent before */
+    ImageCache& cache = ImageCache::Get();
+    int cached = cache.GetCapacity() != 0;
+    uint64_t hash = 0;
+    if (cached)
+        hash = guac_hash_tile(buffer, update.width, update.height, encoding->stride);
+
+    auto encode = [&](int format, std::vector<unsigned char>& image) {
+
+        if (cached && cache.Find(rect, hash, format, image))
+            return 0;
+
+        ImageEncodeParams params;
+        params.layer = encoding->layer;
+        if (webp) {
+            params.format = ImageFormat::kWebP;
+            if (format > GUAC_SURFACE_FORMAT_WEBP_QUALITY)
+                params.webp_quality = format - GUAC_SURFACE_FORMAT_WEBP_QUALITY;
+        }
+        else if (format >= GUAC_SURFACE_FORMAT_JPEG) {
+            params.format = ImageFormat::kJPEG;
+            params.jpeg_quality = (format - GUAC_SURFACE_FORMAT_JPEG) % GUAC_SURFACE_JPEG_QUALITIES;
+            params.jpeg_subsampling = encoding->jpeg_profile.subsampling;
+        }
+        else if (format >= GUAC_SURFACE_FORMAT_SCREEN) {
+            params.format = ImageFormat::kScreen;
+            params.screen_zstd = format == GUAC_SURFACE_FORMAT_SCREEN_ZSTD;
+        }
+        else {
+            params.format = ImageFormat::kPNG;
+            params.png_profile = &encoding->png_profile;
+            params.keyframe = encoding->lossless;
+        }
+        int result = ImageEncoders::Get().Encode(rect, params, image);
+
+        if (cached && result == 0)
+            cache.Insert(rect, hash, format, image);
+        else if (cached)
+            cache.Abandon(rect, hash, format);
+
+        return result;
+
+    };
+
+    encoding->results[i] = encode(format, encoding->images[i]);
 
-    guac_common_surface_png_rect* current = surface->png_queue;
+    /* The reduced tier gets the same update at a lower quality, which
+     * is left empty if it fails so the full quality image is sent */
+    if (encoding->reduced && encoding->results[i] == 0 && format >= GUAC_SURFACE_FORMAT_JPEG) {
+        int quality = (format - GUAC_SURFACE_FORMAT_JPEG) % GUAC_SURFACE_JPEG_QUALITIES;
+        if (encode(format - quality + quality / GUAC_SURFACE_JPEG_REDUCED_DIVISOR, encoding->reduced_images[i]))
+            encoding->reduced_images[i].clear();
+    }
+
+    cairo_surface_destroy(rect);
+
+    encoding->encode_times[i] = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start).count();
+
+}
+
+/**
+ * Sends the encoded updates as "png" instructions on the socket associated
+ * with the surface, in the order they were added.
+ *
+ * @param surface The surface being flushed.
+ * @param encoding The encoded updates.
+ */
+static void __guac_common_surface_send_encoded(guac_common_surface* surface,
+        guac_common_surface_encoding* encoding) {
+
+    const std::vector<guac_common_rect>& updates = encoding->updates;
+    int lossless = encoding->lossless;
+    int webp = encoding->webp;
+
+    /* Lossy images are refined later, unless refining is disabled */
+    int refine = __guac_common_surface_refine_delay > 0 && surface->layer->index == 0;
+    int webp_lossy = webp && guac_protocol_webp_lossy();
+
+    /* Send image for each rect */
+    for (size_t i = 0; i < updates.size(); i++) {
+        if (encoding->results[i] != 0)
+            continue;
+
+        std::vector<unsigned char>& image = encoding->images[i];
+        std::vector<unsigned char>& reduced_image = encoding->reduced_images[i];
+        int format = encoding->formats[i];
+
+        /* Learn what updates cost from the images sent as base64 */
+        if (!lossless)
+            __guac_common_surface_measure_cost(surface, (double) updates[i].width * updates[i].height,
+                    (image.size() + 2) / 3 * 4 + encoding->encode_times[i] * GUAC_SURFACE_ENCODE_COST);
+
+        if (refine)
+            __guac_common_surface_mark_lossy(surface, &updates[i], format >= GUAC_SURFACE_FORMAT_JPEG
+                    || (webp_lossy && format == GUAC_SURFACE_FORMAT_WEBP));
+
+        if (webp)
+            guac_protocol_send_encoded_img(surface->socket, GUAC_COMP_OVER, surface->layer,
+                    "image/webp", updates[i].x, updates[i].y, image);
+        else if (format == GUAC_SURFACE_FORMAT_SCREEN || format == GUAC_SURFACE_FORMAT_SCREEN_ZSTD)
+            guac_protocol_send_encoded_img(surface->socket, GUAC_COMP_OVER, surface->layer,
+                    GUAC_SCREEN_CODEC_MIMETYPE, updates[i].x, updates[i].y, image);
+        else
+            guac_protocol_send_encoded_png(surface->socket, GUAC_COMP_OVER, surface->layer,
+                    updates[i].x, updates[i].y, image,
+                    reduced_image.empty() ? NULL : &reduced_image);
+    }
+
+    surface->realized = 1;
+
+}
+
+/**
+ * Encodes the given updates concurrently using the EncoderPool, and then sends
+ * them as "png" instructions on the socket associated with the surface, in
+ * the order they were added. Each update of the default layer is encoded as
+ * PNG or JPEG depending on its contents.
+ *
+ * @param surface The surface being flushed.
+ * @param updates The updates to send.
+ * @param lossless Non-zero to send every update as PNG, zero otherwise.
+ */
+static void __guac_common_surface_send_updates(guac_common_surface* surface,
+        const std::vector<guac_common_rect>& updates, int lossless) {
+
+    if (updates.empty())
+        return;
+
+    guac_common_surface_encoding encoding;
+    __guac_common_surface_prepare_updates(surface, updates, lossless, surface->buffer, &encoding);
+
+    EncoderPool::Get().Run(updates.size(), [&encoding](size_t i) {
+        __guac_common_surface_encode_update(&encoding, i);
+    });
+
+    __guac_common_surface_send_encoded(surface, &encoding);
+
+}
+
+/**
+ * Combines every pending update of the surface into the updates that will
+ * be encoded, sending content that moved as copies right away, and brings
+ * the copy of what viewers have up to date. If the surface is suspended,
+ * the pending updates are dropped instead.
+ *
+ * @param surface The surface to flush.
+ * @param updates Receives the updates to encode.
+ */
+static void __guac_common_surface_collect_updates(guac_common_surface* surface,
+        std::vector<guac_common_rect>& updates) {
+
+    std::vector<guac_common_rect> flushed;
+
+    /* Drop the pending updates if nobody would receive them */
+    if (surface->suspended) {
+        surface->dirty = 0;
+        if (surface->queue_length) {
+            std::vector<guac_common_rect> dropped;
+            __guac_common_surface_combine_queue(surface, dropped);
+        }
+        surface->previous_stale = 1;
+        return;
+    }
+
+    /* Only the screen is checked for scrolling, as it needs a copy of it */
+    if (__guac_common_surface_scroll_detection && surface->layer->index == 0) {
+        if (surface->previous == NULL) {
+            size_t old_bytes = __guac_common_surface_buffer_bytes(surface);
+            surface->previous = SurfaceBufferPool::Get().Allocate((size_t) surface->height * surface->stride, false);
+            surface->previous_stale = 1;
+            __guac_common_surface_account(surface, old_bytes);
+        }
+    }
+    else if (surface->previous != NULL) {
+        size_t old_bytes = __guac_common_surface_buffer_bytes(surface);
+        SurfaceBufferPool::Get().Free(surface->previous, (size_t) surface->height * surface->stride);
+        surface->previous = NULL;
+        __guac_common_surface_account(surface, old_bytes);
+    }
 
-    int i, j;
-    int original_queue_length;
-    int flushed = 0;
+    int scroll = surface->previous != NULL && !surface->previous_stale;
 
-    /* Flush final dirty rect to queue */
+    /* Flush final dirty rect to queue, and combine everything queued */
     __guac_common_surface_flush_to_queue(surface);
-    original_queue_length = surface->png_queue_length;
+    std::vector<guac_common_rect> combined;
+    __guac_common_surface_combine_queue(surface, combined);
 
-    /* Sort updates to make combination less costly */
-    qsort(surface->png_queue, surface->png_queue_length, sizeof(guac_common_surface_png_rect),
-          __guac_common_surface_png_rect_compare);
+    size_t pixels = 0;
+    for (const guac_common_rect& rect : combined) {
+        surface->dirty_rect = rect;
+        surface->dirty = 1;
+        pixels += (size_t) rect.width * rect.height;
+        __guac_common_surface_flush_to_png(surface, updates, flushed, scroll);
+    }
 
-    /* Flush all rects in queue */
-    for (i=0; i < surface->png_queue_length; i++) {
+    COLLABVM_PROBE(surface_flush, surface->layer->index, combined.size(), pixels);
 
-        /* Get next unflushed candidate */
-        guac_common_surface_png_rect* candidate = current;
-        if (!candidate->flushed) {
+    /* Remember what viewers will have once the updates are sent, for
+     * detecting scrolling next time */
+    if (surface->previous != NULL) {
+        if (surface->previous_stale) {
+            memcpy(surface->previous, surface->buffer, (size_t) surface->height * surface->stride);
+            surface->previous_stale = 0;
+        }
+        else {
+            for (const guac_common_rect& rect : flushed)
+                __guac_common_surface_sync_previous(surface, &rect);
+        }
+    }
 
-            int combined = 0;
+}
 
-            /* Build up rect as much as possible */
-            for (j=i; j < surface->png_queue_length; j++) {
+void guac_common_surface_flush(guac_common_surface* surface) {
 
-                if (!candidate->flushed) {
+    guac_common_surface_finish_flush(surface);
 
-                    /* Clip candidate within current bounds */
-                    __guac_common_bound_rect(surface, &candidate->rect, NULL, NULL);
-                    if (candidate->rect.width <= 0 || candidate->rect.height <= 0)
-                        candidate->flushed = 1;
+    /* Updates which will be encoded once all rects have been combined */
+    std::vector<guac_common_rect> updates;
+    __guac_common_surface_collect_updates(surface, updates);
+    __guac_common_surface_send_updates(surface, updates, 0);
 
-                    /* Combine if reasonable */
-                    else if (__guac_common_should_combine(surface, &candidate->rect, 0) || !surface->dirty) {
-                        __guac_common_mark_dirty(surface, &candidate->rect);
-                        candidate->flushed = 1;
-                        combined++;
-                    }
+}
 
-                }
+int guac_common_surface_flush_async(guac_common_surface* surface, std::function<void()> on_encoded) {
+
+    /* Without encoder threads, nothing would be encoded while drawing */
+    if (EncoderPool::Get().GetThreadCount() == 0) {
+        guac_common_surface_flush(surface);
+        return 0;
+    }
+
+    guac_common_surface_finish_flush(surface);
+
+    std::vector<guac_common_rect> updates;
+    __guac_common_surface_collect_updates(surface, updates);
+    if (updates.empty())
+        return 0;
+
+    size_t size = (size_t) surface->height * surface->stride;
+    if (surface->snapshot == NULL) {
+        size_t old_bytes = __guac_common_surface_buffer_bytes(surface);
+        surface->snapshot = SurfaceBufferPool::Get().Allocate(size, false);
+        __guac_common_surface_account(surface, old_bytes);
+    }
 
-                candidate++;
+    /* Only the updated areas are copied, the rest of the snapshot is stale */
+    for (const guac_common_rect& update : updates) {
+        size_t offset = (size_t) update.y * surface->stride + update.x * 4;
+        for (int y = 0; y < update.height; y++, offset += surface->stride)
+            memcpy(surface->snapshot + offset, surface->buffer + offset, (size_t) update.width * 4);
+    }
 
+    guac_common_surface_encoding* encoding = new guac_common_surface_encoding();
+    __guac_common_surface_prepare_updates(surface, updates, 0, surface->snapshot, encoding);
+    surface->encoding = encoding;
+
+    /* The encoding can be sent and deleted as soon as it's marked as
+     * encoded, so it mustn't be touched after the mutex is released */
+    EncoderPool::Get().RunAsync(updates.size(),
+        [encoding](size_t i) {
+            __guac_common_surface_encode_update(encoding, i);
+        },
+        [encoding, on_encoded = std::move(on_encoded)] {
+            {
+                std::lock_guard<std::mutex> lock(encoding->mutex);
+                encoding->encoded = 1;
+                encoding->finished.notify_all();
             }
+            on_encoded();
+        });
+
+    return 1;
+
+}
+
+void guac_common_surface_finish_flush(guac_common_surface* surface) {
+
+    guac_common_surface_encoding* encoding = surface->encoding;
+    if (encoding == NULL)
+        return;
 
-            /* Re-add to queue if there's room and this update was modified or we expect others might be */
-            if ((combined > 1 || i < original_queue_length)
-                    && surface->png_queue_length < GUAC_COMMON_SURFACE_QUEUE_SIZE)
-                __guac_common_surface_flush_to_queue(surface);
+    {
+        std::unique_lock<std::mutex> lock(encoding->mutex);
+        encoding->finished.wait(lock, [encoding] { return encoding->encoded; });
+    }
+
+    surface->encoding = NULL;
+    __guac_common_surface_send_encoded(surface, encoding);
+    delete encoding;
+
+}
+
+int guac_common_surface_refine(guac_common_surface* surface) {
+
+    /* Refinements go out after the updates they refine */
+    guac_common_surface_finish_flush(surface);
+
+    int delay = __guac_common_surface_refine_delay;
+    if (!surface->lossy_cells || surface->suspended || delay <= 0)
+        return 0;
+
+    int columns = __guac_common_surface_heat_cells(surface->width);
+    int rows = __guac_common_surface_heat_cells(surface->height);
+    int max_run = GUAC_SURFACE_ENCODE_TILE_SIZE / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+    guac_timestamp now = guac_timestamp_current();
 
-            /* Flush as PNG otherwise */
-            else {
-                if (surface->dirty) flushed++;
-                __guac_common_surface_flush_to_png(surface);
+    /* Combine each row's runs of settled cells into a single update */
+    std::vector<guac_common_rect> updates;
+    for (int y = 0; y < rows; y++) {
+
+        int run_start = -1;
+        for (int x = 0; x <= columns; x++) {
+
+            int settled = 0;
+            if (x < columns) {
+                guac_common_surface_heat_cell* cell = surface->heat_map + y * columns + x;
+                settled = cell->lossy && now - __guac_common_surface_cell_last_update(cell) >= delay;
+                if (settled)
+                    cell->generation = now;
+            }
+
+            if (run_start >= 0 && (!settled || x - run_start == max_run)) {
+                guac_common_rect rect;
+                guac_common_rect_init(&rect, run_start * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE,
+                        y * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE,
+                        (x - run_start) * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE,
+                        GUAC_COMMON_SURFACE_HEAT_CELL_SIZE);
+                __guac_common_bound_rect(surface, &rect, NULL, NULL);
+                updates.push_back(rect);
+                run_start = -1;
             }
 
+            if (settled && run_start < 0)
+                run_start = x;
+
         }
 
-        current++;
+    }
+
+    /* Sending the images marks the cells as lossless */
+    __guac_common_surface_send_updates(surface, updates, 1);
+    return !updates.empty();
+
+}
+
+/**
+ * Picks the format of images that are only sent on the given socket, like
+ * those sent to a viewer that just joined.
+ *
+ * @param socket The socket the images are sent on.
+ * @param params Set to encode images in the format.
+ * @return The index of the surface's keyframe in the format.
+ */
+static int __guac_common_surface_keyframe_format(GuacSocket& socket, ImageEncodeParams* params) {
+
+    int screen = guac_protocol_use_screen_codec(socket);
+    if (screen) {
+        params->format = ImageFormat::kScreen;
+        params->screen_zstd = screen == GUAC_SCREEN_CODEC_ZSTD;
+        return params->screen_zstd ? 3 : 2;
+    }
 
+    if (guac_protocol_use_webp(socket)) {
+        params->format = ImageFormat::kWebP;
+        return 1;
     }
 
-    /* Flush complete */
-    surface->png_queue_length = 0;
+    params->format = ImageFormat::kPNG;
+    return 0;
+
+}
+
+/**
+ * Sends an image encoded in the format picked by
+ * __guac_common_surface_keyframe_format().
+ */
+static void __guac_common_surface_send_keyframe(GuacSocket& socket, const guac_layer* layer,
+        ImageFormat format, int x, int y, const std::vector<unsigned char>& image) {
+
+    if (format == ImageFormat::kScreen)
+        guac_protocol_send_encoded_img(socket, GUAC_COMP_OVER, layer,
+                GUAC_SCREEN_CODEC_MIMETYPE, x, y, image);
+    else if (format == ImageFormat::kWebP)
+        guac_protocol_send_encoded_img(socket, GUAC_COMP_OVER, layer,
+                "image/webp", x, y, image);
+    else
+        guac_protocol_send_encoded_png(socket, GUAC_COMP_OVER, layer, x, y, image);
 
 }
 
@@ -1063,17 +3207,123 @@ void guac_common_surface_dup(guac_common_surface* surface, GuacSocket& socket) {
     if (!surface->realized)
         return;
 
+    /* The new viewer is sent the pending changes too, so viewers no longer
+     * all have the previous contents */
+    surface->previous_stale = 1;
+
     /* Sync size to new socket */
     guac_protocol_send_size(socket, surface->layer, surface->width, surface->height);
 
-    /* Get entire surface */
-    cairo_surface_t* rect = cairo_image_surface_create_for_data(
-            surface->buffer, CAIRO_FORMAT_RGB24,
-            surface->width, surface->height, surface->stride);
+    /* Re-encode the entire surface only if it changed since the last viewer joined */
+    ImageEncodeParams params;
+    guac_common_surface_keyframe* keyframe = &surface->keyframes[
+            __guac_common_surface_keyframe_format(socket, &params)];
+    if (keyframe->image.empty() || keyframe->revision != surface->revision) {
 
-    /* Send PNG for rect */
-    guac_protocol_send_png(socket, GUAC_COMP_OVER, surface->layer, 0, 0, rect);
-    cairo_surface_destroy(rect);
+        /* Anything drawn while encoding marks the surface dirty again */
+        keyframe->revision = surface->revision;
+
+        /* Get entire surface */
+        cairo_surface_t* rect = cairo_image_surface_create_for_data(
+                surface->buffer, CAIRO_FORMAT_RGB24,
+                surface->width, surface->height, surface->stride);
+
+        params.layer = surface->layer;
+        params.png_profile = &surface->png_profile;
+        params.keyframe = true;
+        int error = ImageEncoders::Get().Encode(rect, params, keyframe->image);
+        cairo_surface_destroy(rect);
+
+        if (error) {
+            keyframe->image.clear();
+            return;
+        }
+
+    }
+
+    /* Send image for rect */
+    __guac_common_surface_send_keyframe(socket, surface->layer, params.format, 0, 0, keyframe->image);
 
 }
 
+
+int guac_common_surface_dup_since(guac_common_surface* surface, GuacSocket& socket,
+        guac_timestamp since, int64_t max_area) {
+
+    /* Do nothing if not realized */
+    if (!surface->realized)
+        return 1;
+
+    /* What changed before the surface was resized isn't known */
+    if (since < surface->heat_map_time)
+        return 0;
+
+    int columns = __guac_common_surface_heat_cells(surface->width);
+    int rows = __guac_common_surface_heat_cells(surface->height);
+    int max_run = GUAC_SURFACE_ENCODE_TILE_SIZE / GUAC_COMMON_SURFACE_HEAT_CELL_SIZE;
+
+    /* Combine each row's runs of changed cells into a single update. Cells
+     * drawn in the same millisecond as the frame may not have been part of
+     * it, so they're sent too. */
+    std::vector<guac_common_rect> updates;
+    int64_t area = 0;
+    for (int y = 0; y < rows; y++) {
+
+        int run_start = -1;
+        for (int x = 0; x <= columns; x++) {
+
+            int changed = x < columns && surface->heat_map[y * columns + x].generation >= since;
+
+            if (run_start >= 0 && (!changed || x - run_start == max_run)) {
+                guac_common_rect rect;
+                guac_common_rect_init(&rect, run_start * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE,
+                        y * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE,
+                        (x - run_start) * GUAC_COMMON_SURFACE_HEAT_CELL_SIZE,
+                        GUAC_COMMON_SURFACE_HEAT_CELL_SIZE);
+                __guac_common_bound_rect(surface, &rect, NULL, NULL);
+                area += (int64_t) rect.width * rect.height;
+                if (area > max_area)
+                    return 0;
+                updates.push_back(rect);
+                run_start = -1;
+            }
+
+            if (changed && run_start < 0)
+                run_start = x;
+
+        }
+
+    }
+
+    /* The viewer is sent the pending changes too, so viewers no longer all
+     * have the previous contents */
+    surface->previous_stale = 1;
+
+    ImageEncodeParams params;
+    __guac_common_surface_keyframe_format(socket, &params);
+    params.layer = surface->layer;
+    params.png_profile = &surface->png_profile;
+    params.keyframe = true;
+
+    std::vector<unsigned char> image;
+    for (const guac_common_rect& update : updates) {
+
+        cairo_surface_t* rect = cairo_image_surface_create_for_data(
+                surface->buffer + update.y * surface->stride + update.x * 4,
+                CAIRO_FORMAT_RGB24, update.width, update.height, surface->stride);
+
+        int error = ImageEncoders::Get().Encode(rect, params, image);
+        cairo_surface_destroy(rect);
+
+        /* The keyframe sent instead draws over what was sent so far */
+        if (error)
+            return 0;
+
+        __guac_common_surface_send_keyframe(socket, surface->layer, params.format,
+                update.x, update.y, image);
+
+    }
+
+    return 1;
+
+}
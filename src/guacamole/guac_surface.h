@@ -30,29 +30,122 @@
 #include <guacamole/layer.h>
 #include <guacamole/protocol.h>
 #include <guacamole/socket.h>
+#include <guacamole/timestamp-types.h>
+
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+class MemoryAccount;
+struct guac_common_surface_encoding;
+
+/**
+ * The width and height of the cells of the grid that queued updates are
+ * recorded in, in pixels. The area of a cell is below the base cost of an
+ * update, so updates in neighbouring cells are always worth combining.
+ */
+#define GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE 32
+
+/**
+ * The width and height of each cell of a surface's heat map, in pixels.
+ */
+#define GUAC_COMMON_SURFACE_HEAT_CELL_SIZE 64
+
+/**
+ * The number of update timestamps remembered by each heat map cell.
+ */
+#define GUAC_COMMON_SURFACE_HEAT_CELL_HISTORY_SIZE 5
+
+/**
+ * A cell of a surface's heat map, recording when its area of the surface was
+ * last updated so that the rate it changes at can be estimated.
+ */
+typedef struct guac_common_surface_heat_cell {
+
+    /**
+     * The timestamps of the most recent updates to this cell, as a ring
+     * buffer. Unused entries are zero.
+     */
+    guac_timestamp history[GUAC_COMMON_SURFACE_HEAT_CELL_HISTORY_SIZE];
+
+    /**
+     * The index of the oldest entry in history, which will be replaced by
+     * the next update.
+     */
+    int oldest_entry;
+
+    /**
+     * Non-zero if a lossy image was the last one sent for part of this cell,
+     * so that it's sent again losslessly once the cell stops changing.
+     */
+    int lossy;
+
+    /**
+     * The time viewers were last sent a new image of this cell, because it
+     * was drawn to or refined, or zero if it hasn't been since the heat map
+     * was allocated. Unlike history, every update is recorded.
+     */
+    guac_timestamp generation;
+
+} guac_common_surface_heat_cell;
+
+/**
+ * Converts a row of pixels into the 32-bit RGB format used by surfaces, as
+ * used by guac_common_surface_draw_pixels().
+ *
+ * @param src The first pixel to convert.
+ * @param dst The buffer which will receive the converted pixels.
+ * @param width The number of pixels to convert.
+ * @param data Arbitrary data describing the format of the pixels.
+ */
+typedef void guac_common_surface_convert_func(const unsigned char* src, uint32_t* dst,
+                                              int width, const void* data);
 
 /**
- * The maximum number of updates to allow within the PNG queue.
+ * Estimates what sending an update of a surface costs, learned from the
+ * updates recently sent, as a fixed cost per update plus a cost per pixel.
+ * Costs are in bytes sent to viewers, with the time spent encoding converted
+ * to bytes. The line is fitted by least squares over sums that decay with
+ * each sample, so the estimate follows changes in the screen's content.
  */
-#define GUAC_COMMON_SURFACE_QUEUE_SIZE 256
+typedef struct guac_common_surface_cost_model {
+
+    /**
+     * The decayed number of samples and sums of the pixel counts (x) and
+     * costs (y) of the samples, for fitting the line.
+     */
+    double n;
+    double sum_x;
+    double sum_y;
+    double sum_xx;
+    double sum_xy;
+
+    /**
+     * The fitted cost of every update, and of each of its pixels.
+     */
+    double base_cost;
+    double pixel_cost;
+
+} guac_common_surface_cost_model;
 
 /**
- * Representation of a PNG update, having a rectangle of image data (stored
- * elsewhere) and a flushed/not-flushed state.
+ * An image of an entire surface, encoded for the viewers that start viewing
+ * it. The same image is sent to every new viewer until the surface changes.
  */
-typedef struct guac_common_surface_png_rect {
+typedef struct guac_common_surface_keyframe {
 
     /**
-     * Whether this rectangle has been flushed.
+     * The encoded image, which is only valid when it isn't empty.
      */
-    int flushed;
+    std::vector<unsigned char> image;
 
     /**
-     * The rectangle containing the PNG update.
+     * The revision of the surface that the image was encoded from.
      */
-    guac_common_rect rect;
+    unsigned int revision;
 
-} guac_common_surface_png_rect;
+} guac_common_surface_keyframe;
 
 /**
  * Surface which backs a Guacamole buffer or layer, automatically
@@ -60,13 +153,25 @@ typedef struct guac_common_surface_png_rect {
  */
 typedef struct guac_common_surface {
 
-	guac_common_surface(const guac_layer* layer, GuacSocket& socket, int width, int height, int dirty, int png_queue_length) :
+	guac_common_surface(const guac_layer* layer, GuacSocket& socket, int width, int height, int dirty, int queue_length) :
 		layer(layer),
 		socket(socket),
 		width(width),
 		height(height),
 		dirty(dirty),
-		png_queue_length(png_queue_length)
+		queue_length(queue_length),
+		revision(0),
+		heat_map_time(0),
+		suspended(0),
+		lossy_cells(0),
+		cost_model(),
+		previous(NULL),
+		previous_stale(1),
+		png_profile(GUAC_PNG_DEFAULT_PROFILE),
+		jpeg_profile(),
+		memory_account(NULL),
+		snapshot(NULL),
+		encoding(NULL)
 	{
 	}
 
@@ -127,14 +232,117 @@ typedef struct guac_common_surface {
     guac_common_rect clip_rect;
 
     /**
-     * The number of updates in the PNG queue.
+     * The number of updates queued since the last flush.
+     */
+    int queue_length;
+
+    /**
+     * Grid of GUAC_COMMON_SURFACE_QUEUE_CELL_SIZE cells covering the surface,
+     * row by row, holding the bounds of the queued updates within each cell.
+     * Cells without queued updates are empty rectangles. Allocated when an
+     * update is first queued.
+     */
+    std::vector<guac_common_rect> queue_cells;
+
+    /**
+     * The bounds of every queued update.
+     */
+    guac_common_rect queue_rect;
+
+    /**
+     * Grid of GUAC_COMMON_SURFACE_HEAT_CELL_SIZE cells covering the surface,
+     * in row-major order, recording how often each area is updated.
+     */
+    guac_common_surface_heat_cell* heat_map;
+
+    /**
+     * Incremented whenever any part of the surface is marked dirty, so that
+     * work derived from its contents can be skipped if nothing changed.
+     */
+    unsigned int revision;
+
+    /**
+     * When the heat map was last allocated. The generations of its cells
+     * don't say what changed before then.
+     */
+    guac_timestamp heat_map_time;
+
+    /**
+     * Non-zero while nobody is viewing the surface. Every update is then
+     * combined into the dirty rectangle, and flushing discards it instead
+     * of encoding it, since anyone who starts viewing the surface is sent
+     * all of it with guac_common_surface_dup().
+     */
+    int suspended;
+
+    /**
+     * The last images sent by guac_common_surface_dup(), as PNG, as WebP,
+     * and in the screen codec without and with zstd.
+     */
+    guac_common_surface_keyframe keyframes[4];
+
+    /**
+     * The number of heat map cells waiting to be refined.
+     */
+    int lossy_cells;
+
+    /**
+     * The costs of updates measured from recent flushes, which decide
+     * whether updates are combined.
+     */
+    guac_common_surface_cost_model cost_model;
+
+    /**
+     * The contents of the surface as its viewers have them, with the same
+     * stride as buffer, so that content which moved can be found when
+     * flushing. NULL unless scroll detection is used for this surface.
+     */
+    unsigned char* previous;
+
+    /**
+     * Non-zero if previous may no longer match what the viewers have, such
+     * as after a viewer joined, in which case it is copied entirely from
+     * buffer after the next flush instead of being used.
+     */
+    int previous_stale;
+
+    /**
+     * Areas of the surface hidden by layers above it. They are kept up to
+     * date in buffer, so copies within the surface stay correct, but they
+     * aren't sent to viewers when flushing.
+     */
+    std::vector<guac_common_rect> covered;
+
+    /**
+     * How PNG images of the surface are encoded.
+     */
+    guac_png_profile png_profile;
+
+    /**
+     * How JPEG images of the surface are encoded.
+     */
+    guac_jpeg_profile jpeg_profile;
+
+    /**
+     * The account that the pixel buffers of the surface are charged to,
+     * or NULL if they aren't accounted.
      */
-    int png_queue_length;
+    MemoryAccount* memory_account;
 
     /**
-     * All queued PNG updates.
+     * The second buffer of the surface, with the same stride as buffer,
+     * holding the pixels of the updates of guac_common_surface_flush_async()
+     * as they were when it was called. Only the updated areas are copied
+     * into it, and the encoder threads read them from here while buffer is
+     * drawn to. NULL until the surface is first flushed that way.
      */
-    guac_common_surface_png_rect png_queue[GUAC_COMMON_SURFACE_QUEUE_SIZE];
+    unsigned char* snapshot;
+
+    /**
+     * The updates being encoded from snapshot, which are sent by
+     * guac_common_surface_finish_flush(), or NULL if there are none.
+     */
+    guac_common_surface_encoding* encoding;
 
 } guac_common_surface;
 
@@ -157,6 +365,119 @@ guac_common_surface* guac_common_surface_alloc(GuacSocket& socket, const guac_la
  */
 void guac_common_surface_free(guac_common_surface* surface);
 
+/**
+ * Sets whether images drawn with guac_common_surface_draw() are compared
+ * with every surface tile by tile, so that only the tiles which changed are
+ * marked dirty, each shrunk to the pixels that changed within it. When
+ * disabled, the bounding box of all changed pixels is marked dirty instead.
+ * Enabled by default.
+ *
+ * @param enabled Non-zero to enable tile diffing, zero to disable it.
+ */
+void guac_common_surface_set_tile_diffing(int enabled);
+
+/**
+ * Sets how long parts of a surface that were sent as lossy JPEG or WebP
+ * images must stay unchanged before they are sent again as PNG, so that
+ * viewers get fast lossy updates while the screen changes without keeping
+ * the artifacts once it settles. Set to 1000 milliseconds by default.
+ *
+ * @param milliseconds The delay before refining, or 0 to never refine.
+ */
+void guac_common_surface_set_refine_delay(int milliseconds);
+
+/**
+ * Sets whether the screen is checked for content that moved since it was
+ * last flushed, like a scrolled window, by comparing the hashes of its rows
+ * and columns with those of a copy of what viewers have. Moved content is
+ * sent as a "copy" instruction, so that only the newly exposed part needs
+ * an image. Enabled by default.
+ *
+ * @param enabled Non-zero to enable scroll detection, zero to disable it.
+ */
+void guac_common_surface_set_scroll_detection(int enabled);
+
+/**
+ * Sets the areas of the given surface which are hidden by layers above it.
+ * Changes within those areas no longer cause the surrounding updates to be
+ * re-encoded, and parts of the surface that viewers may not have the latest
+ * contents of are never the source of a "copy" instruction.
+ *
+ * @param surface The surface to set the covered areas of.
+ * @param rects The covered areas, which replace any set before.
+ */
+void guac_common_surface_set_covered(guac_common_surface* surface,
+        const std::vector<guac_common_rect>& rects);
+
+/**
+ * Sets how PNG images of the given surface are encoded. Updates use the
+ * realtime compression level of the profile, while images sent to users
+ * that join and lossless refinements use the keyframe level.
+ *
+ * @param surface The surface to set the PNG profile of.
+ * @param profile The PNG profile to use.
+ */
+void guac_common_surface_set_png_profile(guac_common_surface* surface,
+        const guac_png_profile& profile);
+
+/**
+ * Sets how JPEG images of the given surface are encoded, overriding the
+ * quality set with SetJPEGQuality() if the profile has one. JPEG can still
+ * only be used if it is enabled with SetJPEGQuality().
+ *
+ * @param surface The surface to set the JPEG profile of.
+ * @param profile The JPEG profile to use.
+ */
+void guac_common_surface_set_jpeg_profile(guac_common_surface* surface,
+        const guac_jpeg_profile& profile);
+
+/**
+ * Sets the account that the pixel buffers of the given surface are charged
+ * to as surfaces, moving what is already allocated from the previous one.
+ *
+ * @param surface The surface to set the memory account of.
+ * @param account The account to charge, or NULL to stop accounting.
+ */
+void guac_common_surface_set_memory_account(guac_common_surface* surface,
+        MemoryAccount* account);
+
+/**
+ * Sends the parts of the surface that were sent as lossy images and haven't
+ * changed for the refine delay again as PNG images. Nothing is sent while
+ * the surface is suspended.
+ *
+ * @param surface The surface to refine.
+ * @return Non-zero if any images were sent, zero otherwise.
+ */
+int guac_common_surface_refine(guac_common_surface* surface);
+
+/**
+ * Returns the average rate, in updates per second, at which the cells of the
+ * heat map covering the given rectangle have recently been updated.
+ *
+ * This function must be called from the thread that draws to the surface.
+ *
+ * @param surface The surface to check.
+ * @param rect The area of the surface to check.
+ * @return The average update rate of the area.
+ */
+int guac_common_surface_get_framerate(guac_common_surface* surface, const guac_common_rect* rect);
+
+/**
+ * Copies the update rate of every cell of the surface's heat map, in updates
+ * per second, so that the areas of the screen that change often can be
+ * inspected.
+ *
+ * This function must be called from the thread that draws to the surface.
+ *
+ * @param surface The surface to check.
+ * @param framerates Receives the update rate of each cell, in row-major order.
+ * @param columns Receives the number of cells in each row.
+ * @param rows Receives the number of rows.
+ */
+void guac_common_surface_get_heat_map(guac_common_surface* surface, std::vector<int>& framerates,
+                                      int* columns, int* rows);
+
  /**
  * Resizes the given surface to the given size.
  *
@@ -176,6 +497,41 @@ void guac_common_surface_resize(guac_common_surface* surface, int w, int h);
  */
 void guac_common_surface_draw(guac_common_surface* surface, int x, int y, cairo_surface_t* src);
 
+/**
+ * Draws opaque pixels in an arbitrary format directly to the given
+ * guac_common_surface, without first copying them into a Cairo surface. The
+ * pixels are converted in small spans as they are compared with the
+ * surface, so no buffer needs to be allocated for the converted image.
+ *
+ * @param surface The surface to draw to.
+ * @param x The X coordinate of the draw location.
+ * @param y The Y coordinate of the draw location.
+ * @param w The width of the image to draw.
+ * @param h The height of the image to draw.
+ * @param buffer The first pixel of the image to draw.
+ * @param stride The number of bytes in each row of the image.
+ * @param bpp The number of bytes in each pixel of the image.
+ * @param convert The function converting rows of the image to 32-bit RGB, or
+ *                NULL if the image is already in that format.
+ * @param data The data passed to convert.
+ */
+void guac_common_surface_draw_pixels(guac_common_surface* surface, int x, int y, int w, int h,
+        const unsigned char* buffer, int stride, int bpp,
+        guac_common_surface_convert_func* convert, const void* data);
+
+/**
+ * Marks the given rectangle of the surface as dirty after its buffer was
+ * written to directly. As the previous contents of the buffer are gone, the
+ * whole rectangle is sent, even if some of its pixels are unchanged.
+ *
+ * @param surface The surface whose buffer was modified.
+ * @param x The X coordinate of the modified rectangle.
+ * @param y The Y coordinate of the modified rectangle.
+ * @param w The width of the modified rectangle.
+ * @param h The height of the modified rectangle.
+ */
+void guac_common_surface_invalidate(guac_common_surface* surface, int x, int y, int w, int h);
+
 /**
  * Paints to the given guac_common_surface using the given data as a stencil,
  * filling opaque regions with the specified color, and leaving transparent
@@ -261,17 +617,51 @@ void guac_common_surface_reset_clip(guac_common_surface* surface);
 
 /**
  * Flushes the given surface, drawing any pending operations on the remote
- * display.
+ * display. If the surface is suspended, the pending operations are dropped.
  *
  * @param surface The surface to flush.
  */
 void guac_common_surface_flush(guac_common_surface* surface);
 
+/**
+ * Flushes the given surface like guac_common_surface_flush(), except that the
+ * updates are encoded by the EncoderPool without waiting for them, so the
+ * surface can be drawn to while they are. The pixels of the updates are
+ * copied to the surface's snapshot first, and the updates are sent by
+ * guac_common_surface_finish_flush(), which flushing, refining, resizing or
+ * freeing the surface calls first. Content that moved is still sent as
+ * copies before this returns.
+ *
+ * Viewers sent the surface with guac_common_surface_dup() meanwhile may be
+ * sent the updates after newer contents, which the next flush corrects, as
+ * everything drawn since the snapshot is part of it.
+ *
+ * When the EncoderPool has no threads, this is the same as
+ * guac_common_surface_flush().
+ *
+ * @param surface The surface to flush.
+ * @param on_encoded Called from an encoder thread once the updates are
+ *                   encoded, so they can be sent without waiting.
+ * @return Non-zero if updates are being encoded, in which case on_encoded
+ *         will be called, zero if everything was sent already.
+ */
+int guac_common_surface_flush_async(guac_common_surface* surface, std::function<void()> on_encoded);
+
+/**
+ * Sends the updates of the last call to guac_common_surface_flush_async(),
+ * waiting for them to finish encoding if they haven't yet. Does nothing if
+ * they were sent already.
+ *
+ * @param surface The surface whose updates should be sent.
+ */
+void guac_common_surface_finish_flush(guac_common_surface* surface);
+
 /**
  * Schedules a deferred flush of the given surface. This will not immediately
  * flush the surface to the client. Instead, the result of the flush is
- * added to a queue which is reinspected and combined (if possible) with other
- * deferred flushes during the call to guac_common_surface_flush().
+ * added to a queue which is combined (if possible) with other deferred
+ * flushes during the call to guac_common_surface_flush(). The queue has no
+ * limit, so this never flushes the surface.
  *
  * @param surface The surface to flush.
  */
@@ -286,5 +676,25 @@ void guac_common_surface_flush_deferred(guac_common_surface* surface);
  */
 void guac_common_surface_dup(guac_common_surface* surface, GuacSocket& socket);
 
+/**
+ * Sends a viewer that already has the surface as it was at the given time
+ * only the heat map cells that changed since then, as lossless images, like
+ * guac_common_surface_dup() but without the rest of the surface. Pending
+ * changes are not flushed.
+ *
+ * This function must be called from the thread that draws to the surface.
+ *
+ * @param surface The surface to duplicate.
+ * @param socket The socket to send the changed cells to.
+ * @param since The timestamp of the last frame the viewer applied.
+ * @param max_area The most pixels worth sending this way. When more than
+ *                 that changed, the cached keyframe is cheaper.
+ * @return Non-zero if the viewer was sent the changes, zero if the surface
+ *         changed too much since then, or was resized, and should be sent
+ *         with guac_common_surface_dup() instead.
+ */
+int guac_common_surface_dup_since(guac_common_surface* surface, GuacSocket& socket,
+        guac_timestamp since, int64_t max_area);
+
 #endif
 
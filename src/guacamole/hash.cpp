@@ -21,12 +21,40 @@
  */
 
 #include "config.h"
+#include "SIMD.h"
 
 #include <cairo/cairo.h>
 
 #include <stdint.h>
 #include <string.h>
 
+#if defined(SIMD_X86)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * Primes used by guac_hash_tile(), taken from xxHash.
+ */
+#define GUAC_HASH_PRIME32_1 0x9E3779B1U
+#define GUAC_HASH_PRIME32_2 0x85EBCA77U
+#define GUAC_HASH_PRIME32_3 0xC2B2AE3DU
+#define GUAC_HASH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define GUAC_HASH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define GUAC_HASH_PRIME64_3 0x165667B19E3779F9ULL
+
+/**
+ * The number of 32-bit lanes guac_hash_tile() hashes in parallel. Each lane
+ * consumes one word of every 64-byte chunk.
+ */
+#define GUAC_HASH_LANES 16
+
+/**
+ * The number of bytes consumed by one round of every lane.
+ */
+#define GUAC_HASH_CHUNK_SIZE (GUAC_HASH_LANES * 4)
+
 /*
  * Arbitrary hash function whhich maps ALL 32-bit numbers onto 24-bit numbers
  * evenly, while guaranteeing that all 24-bit numbers are mapped onto
@@ -136,3 +164,278 @@ int guac_surface_cmp(cairo_surface_t* a, cairo_surface_t* b) {
     return 0;
 
 }
+
+/**
+ * Mixes a 32-bit word into the given lane accumulator, as in xxHash32.
+ */
+static inline uint32_t __guac_hash_round(uint32_t acc, uint32_t input) {
+    acc += input * GUAC_HASH_PRIME32_2;
+    acc = (acc << 13) | (acc >> 19);
+    return acc * GUAC_HASH_PRIME32_1;
+}
+
+/*
+ * The variants of the kernel that mixes 64-byte chunks into the lane
+ * accumulators. Every variant computes the same hash.
+ *
+ * @param lanes The GUAC_HASH_LANES lane accumulators.
+ * @param data The first chunk.
+ * @param chunks The number of chunks to hash.
+ */
+typedef void __guac_hash_chunks_func(uint32_t* lanes, const unsigned char* data, int chunks);
+
+static void __guac_hash_chunks_scalar(uint32_t* lanes, const unsigned char* data, int chunks) {
+
+    for (int i = 0; i < chunks; i++, data += GUAC_HASH_CHUNK_SIZE) {
+        for (int j = 0; j < GUAC_HASH_LANES; j++) {
+            uint32_t word;
+            memcpy(&word, data + j * 4, sizeof(word));
+            lanes[j] = __guac_hash_round(lanes[j], word);
+        }
+    }
+
+}
+
+#if defined(SIMD_X86)
+SIMD_TARGET_SSE42
+static void __guac_hash_chunks_sse42(uint32_t* lanes, const unsigned char* data, int chunks) {
+
+    const __m128i prime1 = _mm_set1_epi32((int) GUAC_HASH_PRIME32_1);
+    const __m128i prime2 = _mm_set1_epi32((int) GUAC_HASH_PRIME32_2);
+
+    __m128i acc[4];
+    for (int j = 0; j < 4; j++)
+        acc[j] = _mm_loadu_si128((const __m128i*) (lanes + j * 4));
+
+    for (int i = 0; i < chunks; i++, data += GUAC_HASH_CHUNK_SIZE) {
+        for (int j = 0; j < 4; j++) {
+            __m128i in = _mm_loadu_si128((const __m128i*) (data + j * 16));
+            __m128i a = _mm_add_epi32(acc[j], _mm_mullo_epi32(in, prime2));
+            a = _mm_or_si128(_mm_slli_epi32(a, 13), _mm_srli_epi32(a, 19));
+            acc[j] = _mm_mullo_epi32(a, prime1);
+        }
+    }
+
+    for (int j = 0; j < 4; j++)
+        _mm_storeu_si128((__m128i*) (lanes + j * 4), acc[j]);
+
+}
+
+SIMD_TARGET_AVX2
+static void __guac_hash_chunks_avx2(uint32_t* lanes, const unsigned char* data, int chunks) {
+
+    const __m256i prime1 = _mm256_set1_epi32((int) GUAC_HASH_PRIME32_1);
+    const __m256i prime2 = _mm256_set1_epi32((int) GUAC_HASH_PRIME32_2);
+
+    __m256i acc0 = _mm256_loadu_si256((const __m256i*) lanes);
+    __m256i acc1 = _mm256_loadu_si256((const __m256i*) (lanes + 8));
+
+    for (int i = 0; i < chunks; i++, data += GUAC_HASH_CHUNK_SIZE) {
+        __m256i in0 = _mm256_loadu_si256((const __m256i*) data);
+        __m256i in1 = _mm256_loadu_si256((const __m256i*) (data + 32));
+
+        acc0 = _mm256_add_epi32(acc0, _mm256_mullo_epi32(in0, prime2));
+        acc1 = _mm256_add_epi32(acc1, _mm256_mullo_epi32(in1, prime2));
+        acc0 = _mm256_or_si256(_mm256_slli_epi32(acc0, 13), _mm256_srli_epi32(acc0, 19));
+        acc1 = _mm256_or_si256(_mm256_slli_epi32(acc1, 13), _mm256_srli_epi32(acc1, 19));
+        acc0 = _mm256_mullo_epi32(acc0, prime1);
+        acc1 = _mm256_mullo_epi32(acc1, prime1);
+    }
+
+    _mm256_storeu_si256((__m256i*) lanes, acc0);
+    _mm256_storeu_si256((__m256i*) (lanes + 8), acc1);
+
+}
+
+/* Every lane fits in one register */
+SIMD_TARGET_AVX512
+static void __guac_hash_chunks_avx512(uint32_t* lanes, const unsigned char* data, int chunks) {
+
+    const __m512i prime1 = _mm512_set1_epi32((int) GUAC_HASH_PRIME32_1);
+    const __m512i prime2 = _mm512_set1_epi32((int) GUAC_HASH_PRIME32_2);
+
+    __m512i acc = _mm512_loadu_si512(lanes);
+
+    for (int i = 0; i < chunks; i++, data += GUAC_HASH_CHUNK_SIZE) {
+        __m512i in = _mm512_loadu_si512(data);
+        acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(in, prime2));
+        acc = _mm512_mullo_epi32(_mm512_rol_epi32(acc, 13), prime1);
+    }
+
+    _mm512_storeu_si512(lanes, acc);
+
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void __guac_hash_chunks_neon(uint32_t* lanes, const unsigned char* data, int chunks) {
+
+    const uint32x4_t prime1 = vdupq_n_u32(GUAC_HASH_PRIME32_1);
+    const uint32x4_t prime2 = vdupq_n_u32(GUAC_HASH_PRIME32_2);
+
+    uint32x4_t acc[4];
+    for (int j = 0; j < 4; j++)
+        acc[j] = vld1q_u32(lanes + j * 4);
+
+    for (int i = 0; i < chunks; i++, data += GUAC_HASH_CHUNK_SIZE) {
+        for (int j = 0; j < 4; j++) {
+            uint32x4_t in = vreinterpretq_u32_u8(vld1q_u8(data + j * 16));
+            uint32x4_t a = vmlaq_u32(acc[j], in, prime2);
+            a = vorrq_u32(vshlq_n_u32(a, 13), vshrq_n_u32(a, 19));
+            acc[j] = vmulq_u32(a, prime1);
+        }
+    }
+
+    for (int j = 0; j < 4; j++)
+        vst1q_u32(lanes + j * 4, acc[j]);
+
+}
+#endif
+
+static __guac_hash_chunks_func* const __guac_hash_chunks = SIMD::Select<__guac_hash_chunks_func>("hash", {
+    __guac_hash_chunks_scalar,
+#if defined(SIMD_X86)
+    __guac_hash_chunks_sse42, __guac_hash_chunks_avx2, __guac_hash_chunks_avx512,
+#else
+    NULL, NULL, NULL,
+#endif
+#if defined(__ARM_NEON)
+    __guac_hash_chunks_neon
+#else
+    NULL
+#endif
+});
+
+uint64_t guac_hash_tile(const unsigned char* data, int width, int height, int stride) {
+
+    uint32_t lanes[GUAC_HASH_LANES];
+    for (int i = 0; i < GUAC_HASH_LANES; i++)
+        lanes[i] = GUAC_HASH_PRIME32_3 + i * GUAC_HASH_PRIME32_1;
+
+    /* Pixels that don't fill a whole chunk at the end of each row */
+    uint32_t tail = GUAC_HASH_PRIME32_3;
+
+    int chunks = width * 4 / GUAC_HASH_CHUNK_SIZE;
+    int remaining = width - chunks * GUAC_HASH_LANES;
+
+    for (int y = 0; y < height; y++, data += stride) {
+
+        __guac_hash_chunks(lanes, data, chunks);
+
+        const unsigned char* pixel = data + chunks * GUAC_HASH_CHUNK_SIZE;
+        for (int x = 0; x < remaining; x++, pixel += 4) {
+            uint32_t word;
+            memcpy(&word, pixel, sizeof(word));
+            tail = __guac_hash_round(tail, word);
+        }
+
+    }
+
+    /* Fold the lanes and dimensions together */
+    uint64_t hash = ((uint64_t) width << 32) ^ (uint64_t) height ^ GUAC_HASH_PRIME64_3;
+    for (int i = 0; i < GUAC_HASH_LANES; i++) {
+        hash ^= lanes[i];
+        hash *= GUAC_HASH_PRIME64_1;
+        hash = (hash << 31) | (hash >> 33);
+    }
+    hash ^= tail;
+
+    /* Avalanche so every input bit affects every output bit */
+    hash ^= hash >> 33;
+    hash *= GUAC_HASH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= GUAC_HASH_PRIME64_3;
+    hash ^= hash >> 32;
+
+    return hash;
+
+}
+
+/*
+ * The variants of the kernel that returns whether the given number of bytes
+ * at a and b are identical.
+ */
+typedef int __guac_row_equal_func(const unsigned char* a, const unsigned char* b, int length);
+
+static int __guac_row_equal_scalar(const unsigned char* a, const unsigned char* b, int length) {
+    return memcmp(a, b, length) == 0;
+}
+
+#if defined(SIMD_X86)
+SIMD_TARGET_SSE42
+static int __guac_row_equal_sse42(const unsigned char* a, const unsigned char* b, int length) {
+
+    int i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i diff = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (a + i)),
+                                     _mm_loadu_si128((const __m128i*) (b + i)));
+        if (!_mm_testz_si128(diff, diff))
+            return 0;
+    }
+
+    return memcmp(a + i, b + i, length - i) == 0;
+
+}
+
+SIMD_TARGET_AVX2
+static int __guac_row_equal_avx2(const unsigned char* a, const unsigned char* b, int length) {
+
+    int i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i diff = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (a + i)),
+                                        _mm256_loadu_si256((const __m256i*) (b + i)));
+        if (!_mm256_testz_si256(diff, diff))
+            return 0;
+    }
+
+    return memcmp(a + i, b + i, length - i) == 0;
+
+}
+#endif
+
+#if defined(__ARM_NEON)
+static int __guac_row_equal_neon(const unsigned char* a, const unsigned char* b, int length) {
+
+    int i = 0;
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t diff = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        uint64x2_t wide = vreinterpretq_u64_u8(diff);
+        if (vgetq_lane_u64(wide, 0) | vgetq_lane_u64(wide, 1))
+            return 0;
+    }
+
+    return memcmp(a + i, b + i, length - i) == 0;
+
+}
+#endif
+
+static __guac_row_equal_func* const __guac_row_equal = SIMD::Select<__guac_row_equal_func>("tile_equal", {
+    __guac_row_equal_scalar,
+#if defined(SIMD_X86)
+    __guac_row_equal_sse42, __guac_row_equal_avx2, NULL,
+#else
+    NULL, NULL, NULL,
+#endif
+#if defined(__ARM_NEON)
+    __guac_row_equal_neon
+#else
+    NULL
+#endif
+});
+
+int guac_tile_equal(const unsigned char* a, int stride_a, const unsigned char* b, int stride_b,
+                    int width, int height) {
+
+    for (int y = 0; y < height; y++) {
+
+        if (!__guac_row_equal(a, b, width * 4))
+            return 0;
+
+        a += stride_a;
+        b += stride_b;
+
+    }
+
+    return 1;
+
+}
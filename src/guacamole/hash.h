@@ -33,6 +33,8 @@
 
 #include <cairo/cairo.h>
 
+#include <stdint.h>
+
 /**
  * Produces a 24-bit hash value from all pixels of the given surface. The
  * surface provided must be RGB or ARGB with each pixel stored in 32 bits.
@@ -58,5 +60,35 @@ unsigned int guac_hash_surface(cairo_surface_t* surface);
  */
 int guac_surface_cmp(cairo_surface_t* a, cairo_surface_t* b);
 
+/**
+ * Produces a 64-bit hash value from a rectangle of 32-bit pixels. Unlike
+ * guac_hash_surface(), the pixels are hashed in independent lanes of 64-byte
+ * chunks, which are processed with AVX2 or NEON when the server is built for
+ * a CPU that supports them. Every implementation produces the same values.
+ *
+ * @param data The first pixel of the rectangle.
+ * @param width The width of the rectangle, in pixels.
+ * @param height The height of the rectangle, in pixels.
+ * @param stride The number of bytes between the start of each row.
+ * @return An arbitrary 64-bit unsigned integer value intended to be well
+ *         distributed across different images.
+ */
+uint64_t guac_hash_tile(const unsigned char* data, int width, int height, int stride);
+
+/**
+ * Returns whether two rectangles of 32-bit pixels of the same size are
+ * identical, using AVX2 or NEON when available.
+ *
+ * @param a The first pixel of the first rectangle.
+ * @param stride_a The number of bytes between the start of each row of a.
+ * @param b The first pixel of the second rectangle.
+ * @param stride_b The number of bytes between the start of each row of b.
+ * @param width The width of both rectangles, in pixels.
+ * @param height The height of both rectangles, in pixels.
+ * @return Non-zero if every pixel is the same, zero otherwise.
+ */
+int guac_tile_equal(const unsigned char* a, int stride_a, const unsigned char* b, int stride_b,
+                    int width, int height);
+
 #endif
 
@@ -31,7 +31,24 @@
 #include <stdlib.h>
 #include <string.h>
 
+/**
+ * The palette that was last freed on this thread, with all of its entries
+ * cleared, or NULL.
+ */
+static thread_local guac_palette* __guac_palette_spare = NULL;
+
+/**
+ * Hashes a color to its first entry in the palette's table.
+ */
+static inline int __guac_palette_hash(int color) {
+    return ((color & 0xFFF000) >> 12) ^ (color & 0xFFF);
+}
+
 guac_palette* guac_palette_alloc(cairo_surface_t* surface) {
+    return guac_palette_alloc_indexed(surface, NULL);
+}
+
+guac_palette* guac_palette_alloc_indexed(cairo_surface_t* surface, unsigned char* indexes) {
 
     int x, y;
 
@@ -40,9 +57,19 @@ guac_palette* guac_palette_alloc(cairo_surface_t* surface) {
     int stride = cairo_image_surface_get_stride(surface);
     unsigned char* data = cairo_image_surface_get_data(surface);
 
-    /* Allocate palette */
-    guac_palette* palette = (guac_palette*) malloc(sizeof(guac_palette));
-    memset(palette, 0, sizeof(guac_palette));
+    /* Reuse the last palette freed on this thread if possible */
+    guac_palette* palette = __guac_palette_spare;
+    if (palette != NULL)
+        __guac_palette_spare = NULL;
+    else {
+        palette = (guac_palette*) malloc(sizeof(guac_palette));
+        memset(palette, 0, sizeof(guac_palette));
+    }
+
+    /* Screen content is mostly runs of one color, which are only
+     * looked up once */
+    int last_color = -1;
+    int last_index = 0;
 
     for (y=0; y<height; y++) {
         for (x=0; x<width; x++) {
@@ -50,53 +77,67 @@ guac_palette* guac_palette_alloc(cairo_surface_t* surface) {
             /* Get pixel color */
             int color = ((uint32_t*) data)[x] & 0xFFFFFF;
 
-            /* Calculate hash code */
-            int hash = ((color & 0xFFF000) >> 12) ^ (color & 0xFFF);
+            if (color != last_color) {
 
-            guac_palette_entry* entry;
+                /* Calculate hash code */
+                int hash = __guac_palette_hash(color);
 
-            /* Search for open palette entry */
-            for (;;) {
-                
-                entry = &(palette->entries[hash]);
+                guac_palette_entry* entry;
 
-                /* If we've found a free space, use it */
-                if (entry->index == 0) {
+                /* Search for open palette entry */
+                for (;;) {
 
-                    png_color* c;
+                    entry = &(palette->entries[hash]);
 
-                    /* Stop if already at capacity */
-                    if (palette->size == 256) {
-                        guac_palette_free(palette);
-                        return NULL;
-                    }
+                    /* If we've found a free space, use it */
+                    if (entry->index == 0) {
 
-                    /* Store in palette */
-                    c = &(palette->colors[palette->size]);
-                    c->blue  = (color      ) & 0xFF;
-                    c->green = (color >> 8 ) & 0xFF;
-                    c->red   = (color >> 16) & 0xFF;
+                        png_color* c;
 
-                    /* Add color to map */
-                    entry->index = ++palette->size;
-                    entry->color = color;
+                        /* Stop if already at capacity */
+                        if (palette->size == 256) {
+                            guac_palette_free(palette);
+                            return NULL;
+                        }
 
-                    break;
+                        /* Store in palette */
+                        c = &(palette->colors[palette->size]);
+                        c->blue  = (color      ) & 0xFF;
+                        c->green = (color >> 8 ) & 0xFF;
+                        c->red   = (color >> 16) & 0xFF;
 
-                }
+                        /* Add color to map */
+                        palette->slots[palette->size] = hash;
+                        entry->index = ++palette->size;
+                        entry->color = color;
 
-                /* Otherwise, if already stored here, done */
-                if (entry->color == color)
-                    break;
+                        break;
 
-                /* Otherwise, collision. Move on to another bucket */
-                hash = (hash+1) & 0xFFF;
+                    }
+
+                    /* Otherwise, if already stored here, done */
+                    if (entry->color == color)
+                        break;
+
+                    /* Otherwise, collision. Move on to another bucket */
+                    hash = (hash+1) & 0xFFF;
+
+                }
+
+                last_color = color;
+                last_index = entry->index - 1;
 
             }
+
+            if (indexes != NULL)
+                indexes[x] = last_index;
+
         }
 
         /* Advance to next data row */
         data += stride;
+        if (indexes != NULL)
+            indexes += width;
 
     }
 
@@ -107,7 +148,7 @@ guac_palette* guac_palette_alloc(cairo_surface_t* surface) {
 int guac_palette_find(guac_palette* palette, int color) {
 
     /* Calculate hash code */
-    int hash = ((color & 0xFFF000) >> 12) ^ (color & 0xFFF);
+    int hash = __guac_palette_hash(color);
 
     guac_palette_entry* entry;
 
@@ -132,6 +173,18 @@ int guac_palette_find(guac_palette* palette, int color) {
 }
 
 void guac_palette_free(guac_palette* palette) {
+
+    /* Keep one palette for the thread's next image, clearing only the
+     * entries that were used */
+    if (__guac_palette_spare == NULL) {
+        for (int i = 0; i < palette->size; i++)
+            palette->entries[palette->slots[i]].index = 0;
+        palette->size = 0;
+        __guac_palette_spare = palette;
+        return;
+    }
+
     free(palette);
+
 }
 
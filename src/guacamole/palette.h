@@ -40,9 +40,28 @@ typedef struct guac_palette {
     png_color colors[256];
     int size;
 
+    /**
+     * The entry each color was stored in, so only the used entries have to
+     * be cleared before the palette is reused.
+     */
+    short slots[256];
+
 } guac_palette;
 
+/**
+ * Builds a palette of the colors in an RGB24 surface, or returns NULL if it
+ * has more than 256. Palettes are reused by the thread that frees them, so
+ * building one for each image doesn't allocate or clear the whole table.
+ */
 guac_palette* guac_palette_alloc(cairo_surface_t* surface);
+
+/**
+ * Builds a palette like guac_palette_alloc(), and also writes the palette
+ * index of each pixel to indexes, one byte per pixel and width bytes per
+ * row, so the image doesn't have to be looked up again. The contents of
+ * indexes are undefined if NULL is returned.
+ */
+guac_palette* guac_palette_alloc_indexed(cairo_surface_t* surface, unsigned char* indexes);
 int guac_palette_find(guac_palette* palette, int color);
 void guac_palette_free(guac_palette* palette);
 
@@ -244,5 +244,14 @@ typedef enum guac_line_join_style {
     GUAC_LINE_JOIN_ROUND = 0x2
 } guac_line_join_style;
 
+/**
+ * How images are encoded for users that support WebP.
+ */
+typedef enum guac_webp_mode {
+    GUAC_WEBP_DISABLED = 0x0,
+    GUAC_WEBP_LOSSLESS = 0x1,
+    GUAC_WEBP_LOSSY    = 0x2
+} guac_webp_mode;
+
 #endif
 
@@ -23,19 +23,20 @@
 #include "config.h"
 
 #include "error.h"
+#include "fast_png.h"
 #include "layer.h"
 #include "palette.h"
 #include "protocol.h"
+#include "screen_codec.h"
 #include "GuacSocket.h"
 #include "stream.h"
 #include "unicode.h"
+#include "user-constants.h"
 
 
-#ifdef USE_JPEG
 extern "C" {
 	#include <cairo_jpg.h>
 }
-#else
 
 #ifdef __cplusplus
 extern "C" {
@@ -50,6 +51,12 @@ extern "C" {
 	#include <pngstruct.h>
 #endif
 
+#ifdef USE_WEBP
+	#include <webp/encode.h>
+#endif
+
+#ifdef USE_TURBOJPEG
+	#include <turbojpeg.h>
 #endif
 
 #include <inttypes.h>
@@ -61,27 +68,65 @@ extern "C" {
 #include <string.h>
 #include <sys/types.h>
 
-#ifdef USE_JPEG
+#include <charconv>
+#include <vector>
+
 /**
  * JPEG compression quality
  *
  * Lower values will produce images quicker,
  * but the image quality will be reduced significantly.
  *
- * The range of this value is from 0 - 100. Other values above this will cause errors during runtime.
+ * The range of this value is from 0 - 100. Values above this disable JPEG.
  */
 uint8_t JPEG_COMPRESSION_QUALITY = 75;
 
 void SetJPEGQuality(uint8_t quality)
 {
-	if (quality > 100)
-		JPEG_COMPRESSION_QUALITY = 75;
-	else
-		JPEG_COMPRESSION_QUALITY = quality;
-	return;
+	JPEG_COMPRESSION_QUALITY = quality;
+}
+
+int guac_protocol_jpeg_enabled()
+{
+	return JPEG_COMPRESSION_QUALITY <= 100;
+}
+
+int guac_protocol_jpeg_quality()
+{
+	return JPEG_COMPRESSION_QUALITY;
+}
+
+#ifdef USE_WEBP
+/**
+ * How images are encoded for users that support WebP.
+ */
+guac_webp_mode WEBP_MODE = GUAC_WEBP_LOSSLESS;
+
+/**
+ * Quality of lossy WebP images, 0 - 100.
+ */
+uint8_t WEBP_QUALITY = 75;
+
+void SetWebPMode(guac_webp_mode mode, uint8_t quality)
+{
+	WEBP_MODE = mode;
+	WEBP_QUALITY = quality > 100 ? 75 : quality;
 }
 #endif
 
+/**
+ * The stream index used for images sent with img instructions. It is outside
+ * of the range of user stream indexes, so it can't collide with a stream that
+ * was allocated by a user.
+ */
+#define GUAC_PROTOCOL_IMAGE_STREAM GUAC_USER_MAX_STREAMS
+
+/**
+ * The effort used for lossless WebP images, 0 - 100. Lower values are
+ * faster, at the cost of slightly larger images.
+ */
+#define GUAC_PROTOCOL_WEBP_LOSSLESS_EFFORT 25
+
 /* Output formatting functions */
 // TODO: Move into GuacSocket
 size_t __guac_socket_write_length_string(GuacSocket& socket, const char* str)
@@ -106,171 +151,291 @@ size_t __guac_socket_write_length_double(GuacSocket& socket, double d)
     return __guac_socket_write_length_string(socket, buffer);
 }
 
-/* PNG output formatting */
+/**
+ * Writes the comma before an integer argument, and the argument with its
+ * length prefix, to the given buffer, which must have room for 24 bytes.
+ *
+ * @return A pointer to the end of what was written.
+ */
+static inline char* __guac_write_length_int(char* out, int64_t i)
+{
+    char digits[20];
+    char* end = std::to_chars(digits, digits + sizeof(digits), i).ptr;
+    size_t length = end - digits;
 
-typedef struct __guac_socket_write_png_data
+    *out++ = ',';
+    if (length >= 10)
+        *out++ = '0' + length / 10;
+    *out++ = '0' + length % 10;
+    *out++ = '.';
+    memcpy(out, digits, length);
+    return out + length;
+}
+
+/**
+ * Writes an instruction whose arguments are all integers, like copy or move.
+ * The length prefix of the opcode is worked out at compile time, and each
+ * argument is formatted straight into a buffer on the stack that is big
+ * enough for any values, so the instruction is appended to the socket's
+ * buffers at once.
+ */
+template<size_t N, typename... Args>
+static int __guac_socket_write_instruction(GuacSocket& socket,
+        const char (&opcode)[N], Args... args)
 {
-	__guac_socket_write_png_data(GuacSocket& socket, int buffer_size, int data_size) :
-		socket(socket),
-		//buffer(new char[buffer_size]),
-		buffer((char*)malloc(buffer_size)),
-		buffer_size(buffer_size),
-		data_size(data_size)
-	{
-	}
+    constexpr size_t length = N - 1;
+    static_assert(length < 100, "The opcode's length prefix is at most two digits");
 
-	//~__guac_socket_write_png_data()
-	//{
-	//	free(buffer);
-	//}
+    char buffer[3 + length + sizeof...(Args) * 24 + 1];
+    char* out = buffer;
 
-    GuacSocket& socket;
+    if constexpr (length >= 10)
+        *out++ = '0' + length / 10;
+    *out++ = '0' + length % 10;
+    *out++ = '.';
+    memcpy(out, opcode, length);
+    out += length;
 
-    char* buffer;
-    int buffer_size;
-    int data_size;
+    ((out = __guac_write_length_int(out, static_cast<int64_t>(args))), ...);
+    *out++ = ';';
 
-} __guac_socket_write_png_data;
+    return socket.Write(buffer, out - buffer);
+}
 
-cairo_status_t __guac_socket_write_png_cairo(void* closure, const unsigned char* data, unsigned int length)
-{
-    __guac_socket_write_png_data* png_data = (__guac_socket_write_png_data*) closure;
+/* PNG output formatting */
 
-    /* Calculate next buffer size */
-    int next_size = png_data->data_size + length;
+/**
+ * The initial capacity reserved for an encoded image.
+ */
+#define GUAC_PROTOCOL_IMAGE_BUFFER_SIZE 8192
 
-    /* If need resizing, double buffer size until big enough */
-    if (next_size > png_data->buffer_size)
-	{
-        char* new_buffer;
+/**
+ * The compression ratio assumed when reserving space for a PNG image. Screen
+ * content usually compresses far better than this, so the buffer seldom
+ * has to grow.
+ */
+#define GUAC_PROTOCOL_PNG_EXPECTED_RATIO 4
 
-        do {
-            png_data->buffer_size <<= 1;
-        } while (next_size > png_data->buffer_size);
+/**
+ * The number of pixels below which PNG images are written without row
+ * filters.
+ */
+#define GUAC_PROTOCOL_PNG_FILTER_PIXELS 4096
 
-        /* Resize buffer */
-        new_buffer = (char*)realloc(png_data->buffer, png_data->buffer_size);
-        png_data->buffer = new_buffer;
-	}
+const guac_png_profile GUAC_PNG_DEFAULT_PROFILE = {
+    2, /* realtime_level */
+    6, /* keyframe_level */
+    1, /* palette */
+    0  /* fast */
+};
+
+cairo_status_t __guac_socket_write_png_cairo(void* closure, const unsigned char* data, unsigned int length)
+{
+    std::vector<unsigned char>* buffer = (std::vector<unsigned char>*) closure;
 
     /* Append data to buffer */
-    memcpy(png_data->buffer + png_data->data_size, data, length);
-    png_data->data_size += length;
+    buffer->insert(buffer->end(), data, data + length);
 
     return CAIRO_STATUS_SUCCESS;
 }
 
-int __guac_socket_write_length_png_cairo(GuacSocket& socket, cairo_surface_t* surface)
+int __guac_encode_png_cairo(cairo_surface_t* surface, std::vector<unsigned char>& buffer)
 {
-    __guac_socket_write_png_data png_data(socket, 8192, 0);
-    int base64_length;
+    buffer.clear();
+    buffer.reserve(GUAC_PROTOCOL_IMAGE_BUFFER_SIZE);
 
     /* Write surface */
 	cairo_status_t status;
-    if ((status = cairo_surface_write_to_png_stream(surface, __guac_socket_write_png_cairo, &png_data)) != CAIRO_STATUS_SUCCESS)
+    if ((status = cairo_surface_write_to_png_stream(surface, __guac_socket_write_png_cairo, &buffer)) != CAIRO_STATUS_SUCCESS)
 	{
 		const char* status_str = cairo_status_to_string(status);
         guac_error = GUAC_STATUS_INTERNAL_ERROR;
         guac_error_message = "Cairo PNG backend failed";
         return -1;
 	}
-    base64_length = (png_data.data_size + 2) / 3 * 4;
 
-    /* Write length and data */
-    if (socket.WriteInt(base64_length)
-        || socket.WriteString(".")
-        || socket.WriteBase64(png_data.buffer, png_data.data_size)
-        || socket.FlushBase64())
-	{
-        free(png_data.buffer);
+    return 0;
+}
+
+#ifdef USE_TURBOJPEG
+/**
+ * A TurboJPEG compressor, created the first time a thread encodes a JPEG
+ * image and kept until the thread exits, so encoder threads don't have to
+ * set one up for every image.
+ */
+class TurboJPEGCompressor {
+public:
+    TurboJPEGCompressor() : handle_(tjInitCompress()) {}
+
+    ~TurboJPEGCompressor() {
+        if (handle_ != NULL)
+            tjDestroy(handle_);
+    }
+
+    tjhandle Get() const {
+        return handle_;
+    }
+
+private:
+    tjhandle handle_;
+};
+
+/**
+ * Compresses an RGB24 surface with TurboJPEG, reading the pixels straight
+ * from the surface.
+ */
+static int __guac_encode_jpeg_turbo(cairo_surface_t* surface, std::vector<unsigned char>& buffer, int quality,
+        guac_jpeg_subsampling subsampling)
+{
+    static thread_local TurboJPEGCompressor compressor;
+    if (compressor.Get() == NULL) {
+        guac_error = GUAC_STATUS_INTERNAL_ERROR;
+        guac_error_message = "TurboJPEG failed to create compressor";
         return -1;
-	}
+    }
+
+    int tj_subsampling;
+    switch (subsampling) {
+        case GUAC_JPEG_SUBSAMPLING_422: tj_subsampling = TJSAMP_422; break;
+        case GUAC_JPEG_SUBSAMPLING_444: tj_subsampling = TJSAMP_444; break;
+        default:                        tj_subsampling = TJSAMP_420; break;
+    }
+
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+
+    /* Size the buffer for the worst case, so TurboJPEG never reallocates it */
+    buffer.resize(tjBufSize(width, height, tj_subsampling));
+    unsigned char* output = buffer.data();
+    unsigned long length = buffer.size();
 
-    free(png_data.buffer);
+    /* Each pixel is a native-endian 32-bit word with an unused high byte */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    int format = TJPF_BGRX;
+#else
+    int format = TJPF_XRGB;
+#endif
+
+    if (tjCompress2(compressor.Get(), cairo_image_surface_get_data(surface), width,
+                    cairo_image_surface_get_stride(surface), height, format, &output, &length,
+                    tj_subsampling, quality, TJFLAG_NOREALLOC | TJFLAG_FASTDCT) != 0) {
+        buffer.clear();
+        guac_error = GUAC_STATUS_INTERNAL_ERROR;
+        guac_error_message = "TurboJPEG compression failed";
+        return -1;
+    }
+
+    buffer.resize(length);
     return 0;
 }
+#endif
 
-#ifdef USE_JPEG
-int __guac_socket_write_length_jpeg(GuacSocket& socket, cairo_surface_t* surface)
+int guac_protocol_encode_jpeg(cairo_surface_t* surface, std::vector<unsigned char>& buffer, int quality,
+        guac_jpeg_subsampling subsampling)
 {
-    __guac_socket_write_png_data png_data(socket, 8192, 0);
-    int base64_length;
+#ifdef USE_TURBOJPEG
+    if (cairo_image_surface_get_format(surface) == CAIRO_FORMAT_RGB24
+            && cairo_image_surface_get_data(surface) != NULL) {
+        cairo_surface_flush(surface);
+        return __guac_encode_jpeg_turbo(surface, buffer, quality, subsampling);
+    }
+#endif
+
+    buffer.clear();
+    buffer.reserve(GUAC_PROTOCOL_IMAGE_BUFFER_SIZE);
 
 	// Write JPEG surface
 	cairo_status_t status;
-    if ((status = cairo_image_surface_write_to_jpeg_stream(surface, __guac_socket_write_png_cairo, &png_data, JPEG_COMPRESSION_QUALITY)) != CAIRO_STATUS_SUCCESS)
+    if ((status = cairo_image_surface_write_to_jpeg_stream(surface, __guac_socket_write_png_cairo, &buffer, quality)) != CAIRO_STATUS_SUCCESS)
 	{
 		const char* status_str = cairo_status_to_string(status);
 	        guac_error = GUAC_STATUS_INTERNAL_ERROR;
 	        guac_error_message = "Cairo JPEG backend failed";
         	return -1;
 	}
-    base64_length = (png_data.data_size + 2) / 3 * 4;
-
-    /* Write length and data */
-    if (socket.WriteInt(base64_length)
-        || socket.WriteString(".")
-        || socket.WriteBase64(png_data.buffer, png_data.data_size)
-        || socket.FlushBase64())
-	{
-        free(png_data.buffer);
-        return -1;
-	}
 
-    free(png_data.buffer);
     return 0;
 }
+
+#ifdef USE_WEBP
+static int __guac_socket_write_webp(const uint8_t* data, size_t data_size, const WebPPicture* picture)
+{
+    std::vector<unsigned char>* buffer = (std::vector<unsigned char>*) picture->custom_ptr;
+
+    /* Append data to buffer */
+    buffer->insert(buffer->end(), data, data + data_size);
+
+    return 1;
+}
 #endif
 
-#ifndef USE_JPEG
 void __guac_socket_write_png(png_structp png,
         png_bytep data, png_size_t length)
 {
     /* Get png buffer structure */
-    __guac_socket_write_png_data* png_data;
+    std::vector<unsigned char>* buffer;
 #ifdef HAVE_PNG_GET_IO_PTR
-    png_data = (__guac_socket_write_png_data*) png_get_io_ptr(png);
+    buffer = (std::vector<unsigned char>*) png_get_io_ptr(png);
 #else
-    png_data = (__guac_socket_write_png_data*) png->io_ptr;
+    buffer = (std::vector<unsigned char>*) png->io_ptr;
 #endif
 
-    /* Calculate next buffer size */
-    int next_size = png_data->data_size + length;
+    /* Append data to buffer */
+    buffer->insert(buffer->end(), data, data + length);
+}
 
-    /* If need resizing, double buffer size until big enough */
-    if (next_size > png_data->buffer_size)
+void __guac_socket_flush_png(png_structp png)
 {
-        char* new_buffer;
-
-        do {
-            png_data->buffer_size <<= 1;
-        } while (next_size > png_data->buffer_size);
-
-        /* Resize buffer */
-        new_buffer = (char*)realloc(png_data->buffer, png_data->buffer_size);
-        png_data->buffer = new_buffer;
+    /* Dummy function */
 }
 
-    /* Append data to buffer */
-    memcpy(png_data->buffer + png_data->data_size, data, length);
-    png_data->data_size += length;
+/**
+ * Returns the initial capacity to reserve for a PNG image of the given size,
+ * so the buffer rarely has to grow while the image is written.
+ *
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param bytes_per_pixel The number of bytes of each uncompressed pixel.
+ * @return The number of bytes to reserve.
+ */
+static size_t __guac_png_buffer_size(int width, int height, int bytes_per_pixel)
+{
+    size_t size = (size_t) width * height * bytes_per_pixel
+                / GUAC_PROTOCOL_PNG_EXPECTED_RATIO;
+
+    return size > GUAC_PROTOCOL_IMAGE_BUFFER_SIZE ? size : GUAC_PROTOCOL_IMAGE_BUFFER_SIZE;
 }
 
-void __guac_socket_flush_png(png_structp png)
+/**
+ * Returns the PNG row filters to try for an image of the given size. Small
+ * images are mostly headers, so filtering them costs more time than it
+ * saves bytes, while larger images of screen content compress well after
+ * the cheap Sub and Up filters. Keyframes can afford to try Paeth as well.
+ *
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param keyframe Non-zero if the image is a keyframe.
+ * @return The filters to pass to png_set_filter().
+ */
+static int __guac_png_filters(int width, int height, int keyframe)
 {
-    /* Dummy function */
+    if (width * height < GUAC_PROTOCOL_PNG_FILTER_PIXELS)
+        return PNG_FILTER_NONE;
+
+    if (keyframe)
+        return PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_PAETH;
+
+    return PNG_FILTER_SUB | PNG_FILTER_UP;
 }
 
-int __guac_socket_write_length_png(GuacSocket& socket, cairo_surface_t* surface)
+int __guac_encode_png(cairo_surface_t* surface, std::vector<unsigned char>& buffer,
+        const guac_png_profile& profile, int keyframe)
 {
     png_structp png;
     png_infop png_info;
-    png_byte** png_rows;
     int bpp;
 
-    int x, y;
-
-    int base64_length;
+    int y;
 
     /* Get image surface properties and data */
     cairo_format_t format = cairo_image_surface_get_format(surface);
@@ -281,27 +446,53 @@ int __guac_socket_write_length_png(GuacSocket& socket, cairo_surface_t* surface)
 
     /* If not RGB24, use Cairo PNG writer */
     if (format != CAIRO_FORMAT_RGB24 || data == NULL)
-        return __guac_socket_write_length_png_cairo(socket, surface);
+        return __guac_encode_png_cairo(surface, buffer);
 
     /* Flush pending operations to surface */
     cairo_surface_flush(surface);
 
-    /* Attempt to build palette */
-    guac_palette* palette = guac_palette_alloc(surface);
-
-    /* If not possible, resort to Cairo PNG writer */
-    if (palette == NULL)
-        return __guac_socket_write_length_png_cairo(socket, surface);
-
-    /* Calculate BPP from palette size */
-    if      (palette->size <= 2)  bpp = 1;
-    else if (palette->size <= 4)  bpp = 2;
-    else if (palette->size <= 16) bpp = 4;
-    else                          bpp = 8;
+    /* Attempt to build palette, falling back to 24-bit color if there are
+     * too many colors. Palette indexes are written to separate rows while
+     * the colors are counted, and 24-bit rows are read straight from the
+     * surface */
+    static thread_local std::vector<png_byte> indexes;
+    guac_palette* palette = NULL;
+    if (profile.palette) {
+        indexes.resize((size_t) width * height);
+        palette = guac_palette_alloc_indexed(surface, indexes.data());
+    }
+
+    if (palette == NULL && profile.fast && !keyframe) {
+        guac_fast_png_encode(data, width, height, stride, buffer);
+        return 0;
+    }
+
+    int level = keyframe ? profile.keyframe_level : profile.realtime_level;
+    if (level < 0) level = 0;
+    if (level > 9) level = 9;
+
+    std::vector<png_byte*> png_rows(height);
+    if (palette != NULL) {
+
+        /* Calculate BPP from palette size */
+        if      (palette->size <= 2)  bpp = 1;
+        else if (palette->size <= 4)  bpp = 2;
+        else if (palette->size <= 16) bpp = 4;
+        else                          bpp = 8;
+
+        for (y=0; y<height; y++)
+            png_rows[y] = &indexes[(size_t) y * width];
+    }
+    else {
+        for (y=0; y<height; y++)
+            png_rows[y] = data + (size_t) y * stride;
+    }
 
     /* Set up PNG writer */
     png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png) {
+        if (palette != NULL)
+            guac_palette_free(palette);
         guac_error = GUAC_STATUS_INTERNAL_ERROR;
         guac_error_message = "libpng failed to create write structure";
         return -1;
@@ -310,6 +501,8 @@ int __guac_socket_write_length_png(GuacSocket& socket, cairo_surface_t* surface)
     png_info = png_create_info_struct(png);
     if (!png_info) {
         png_destroy_write_struct(&png, NULL);
+        if (palette != NULL)
+            guac_palette_free(palette);
         guac_error = GUAC_STATUS_INTERNAL_ERROR;
         guac_error_message = "libpng failed to create info structure";
         return -1;
@@ -318,87 +511,83 @@ int __guac_socket_write_length_png(GuacSocket& socket, cairo_surface_t* surface)
     /* Set error handler */
     if (setjmp(png_jmpbuf(png))) {
         png_destroy_write_struct(&png, &png_info);
+        if (palette != NULL)
+            guac_palette_free(palette);
         guac_error = GUAC_STATUS_IO_ERROR;
         guac_error_message = "libpng output error";
         return -1;
 	}
 
     /* Set up buffer structure */
-	__guac_socket_write_png_data png_data(socket, 8192, 0);
+    buffer.clear();
+    buffer.reserve(__guac_png_buffer_size(width, height, palette != NULL ? 1 : 3));
 
     /* Set up writer */
-    png_set_write_fn(png, &png_data,
+    png_set_write_fn(png, &buffer,
             __guac_socket_write_png,
             __guac_socket_flush_png);
 
-    /* Copy data from surface into PNG data */
-    png_rows = (png_byte**) malloc(sizeof(png_byte*) * height);
-    for (y=0; y<height; y++)
-	{
-        /* Allocate new PNG row */
-        png_byte* row = (png_byte*) malloc(sizeof(png_byte) * width);
-        png_rows[y] = row;
-
-        /* Copy data from surface into current row */
-        for (x=0; x<width; x++)
-		{
-            /* Get pixel color */
-            int color = ((uint32_t*) data)[x] & 0xFFFFFF;
-
-            /* Set index in row */
-            row[x] = guac_palette_find(palette, color);
-		}
-
-        /* Advance to next data row */
-        data += stride;
-	}
-
-    /* Write image info */
-    png_set_IHDR(
-        png,
-        png_info,
-        width,
-        height,
-        bpp,
-        PNG_COLOR_TYPE_PALETTE,
-        PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT,
-        PNG_FILTER_TYPE_DEFAULT
-    );
-
-    /* Write palette */
-    png_set_PLTE(png, png_info, palette->colors, palette->size);
+    png_set_compression_level(png, level);
+
+    /* Filtering rarely helps indexed images */
+    png_set_filter(png, PNG_FILTER_TYPE_BASE,
+            palette != NULL ? PNG_FILTER_NONE : __guac_png_filters(width, height, keyframe));
+
+    int transforms;
+    if (palette != NULL) {
+
+        /* Write image info */
+        png_set_IHDR(
+            png,
+            png_info,
+            width,
+            height,
+            bpp,
+            PNG_COLOR_TYPE_PALETTE,
+            PNG_INTERLACE_NONE,
+            PNG_COMPRESSION_TYPE_DEFAULT,
+            PNG_FILTER_TYPE_DEFAULT
+        );
+
+        /* Write palette */
+        png_set_PLTE(png, png_info, palette->colors, palette->size);
+        transforms = PNG_TRANSFORM_PACKING;
+    }
+    else {
+
+        png_set_IHDR(
+            png,
+            png_info,
+            width,
+            height,
+            8,
+            PNG_COLOR_TYPE_RGB,
+            PNG_INTERLACE_NONE,
+            PNG_COMPRESSION_TYPE_DEFAULT,
+            PNG_FILTER_TYPE_DEFAULT
+        );
+
+        /* Each pixel is a native-endian 32-bit word with an unused high byte */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        transforms = PNG_TRANSFORM_BGR | PNG_TRANSFORM_STRIP_FILLER_AFTER;
+#else
+        transforms = PNG_TRANSFORM_STRIP_FILLER_BEFORE;
+#endif
+    }
 
     /* Write image */
-    png_set_rows(png, png_info, png_rows);
-    png_write_png(png, png_info, PNG_TRANSFORM_PACKING, NULL);
+    png_set_rows(png, png_info, png_rows.data());
+    png_write_png(png, png_info, transforms, NULL);
 
     /* Finish write */
     png_destroy_write_struct(&png, &png_info);
 
     /* Free palette */
-    guac_palette_free(palette);
-
-    /* Free PNG data */
-    for (y=0; y<height; y++)
-        free(png_rows[y]);
-    free(png_rows);
-
-    base64_length = (png_data.data_size + 2) / 3 * 4;
-    /* Write length and data */
-    if (socket.WriteInt(base64_length)
-        || socket.WriteString(".")
-        || socket.WriteBase64(png_data.buffer, png_data.data_size)
-        || socket.FlushBase64())
-	{
-        free(png_data.buffer);
-        return -1;
-	}
+    if (palette != NULL)
+        guac_palette_free(palette);
 
-	free(png_data.buffer);
 	return 0;
 }
-#endif
 
 /* Protocol functions */
 
@@ -528,20 +717,8 @@ int guac_protocol_send_cfill(GuacSocket& socket,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("5.cfill,")
-        || __guac_socket_write_length_int(socket, mode)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, r)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, g)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, b)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, a)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "cfill", mode,
+            layer->index, r, g, b, a);
 
     socket.InstructionEnd();
     return ret_val;
@@ -552,10 +729,7 @@ int guac_protocol_send_close(GuacSocket& socket, const guac_layer* layer)
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("5.close,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "close", layer->index);
 
     socket.InstructionEnd();
     return ret_val;
@@ -595,10 +769,7 @@ int guac_protocol_send_clip(GuacSocket& socket, const guac_layer* layer)
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("4.clip,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "clip", layer->index);
 
     socket.InstructionEnd();
     return ret_val;
@@ -628,26 +799,8 @@ int guac_protocol_send_copy(GuacSocket& socket,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("4.copy,")
-        || __guac_socket_write_length_int(socket, srcl->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, srcx)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, srcy)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, w)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, h)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, mode)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, dstl->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, dstx)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, dsty)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "copy", srcl->index,
+            srcx, srcy, w, h, mode, dstl->index, dstx, dsty);
 
     socket.InstructionEnd();
     return ret_val;
@@ -661,26 +814,8 @@ int guac_protocol_send_cstroke(GuacSocket& socket,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("7.cstroke,")
-        || __guac_socket_write_length_int(socket, mode)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, cap)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, join)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, thickness)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, r)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, g)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, b)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, a)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "cstroke", mode,
+            layer->index, cap, join, thickness, r, g, b, a);
 
     socket.InstructionEnd();
     return ret_val;
@@ -691,22 +826,8 @@ int guac_protocol_send_cursor(GuacSocket& socket, int x, int y,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("6.cursor,")
-        || __guac_socket_write_length_int(socket, x)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, y)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, srcl->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, srcx)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, srcy)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, w)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, h)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "cursor", x, y,
+            srcl->index, srcx, srcy, w, h);
 
     socket.InstructionEnd();
     return ret_val;
@@ -718,22 +839,8 @@ int guac_protocol_send_curve(GuacSocket& socket, const guac_layer* layer,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("5.curve,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, cp1x)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, cp1y)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, cp2x)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, cp2y)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, x)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, y)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "curve", layer->index,
+            cp1x, cp1y, cp2x, cp2y, x, y);
 
     socket.InstructionEnd();
     return ret_val;
@@ -753,10 +860,7 @@ int guac_protocol_send_dispose(GuacSocket& socket, const guac_layer* layer)
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("7.dispose,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "dispose", layer->index);
 
     socket.InstructionEnd();
     return ret_val;
@@ -795,10 +899,7 @@ int guac_protocol_send_end(GuacSocket& socket, const guac_stream* stream)
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("3.end,")
-        || __guac_socket_write_length_int(socket, stream->index)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "end", stream->index);
 
     socket.InstructionEnd();
     return ret_val;
@@ -877,10 +978,7 @@ int guac_protocol_send_identity(GuacSocket& socket, const guac_layer* layer)
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("8.identity,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "identity", layer->index);
 
     socket.InstructionEnd();
     return ret_val;
@@ -893,14 +991,8 @@ int guac_protocol_send_lfill(GuacSocket& socket,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("5.lfill,")
-        || __guac_socket_write_length_int(socket, mode)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, srcl->index)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "lfill", mode,
+            layer->index, srcl->index);
 
     socket.InstructionEnd();
     return ret_val;
@@ -912,14 +1004,8 @@ int guac_protocol_send_line(GuacSocket& socket, const guac_layer* layer,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("4.line,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, x)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, y)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "line", layer->index, x,
+            y);
 
     socket.InstructionEnd();
     return ret_val;
@@ -933,20 +1019,8 @@ int guac_protocol_send_lstroke(GuacSocket& socket,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("7.lstroke,")
-        || __guac_socket_write_length_int(socket, mode)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, cap)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, join)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, thickness)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, srcl->index)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "lstroke", mode,
+            layer->index, cap, join, thickness, srcl->index);
 
     socket.InstructionEnd();
     return ret_val;
@@ -958,18 +1032,8 @@ int guac_protocol_send_move(GuacSocket& socket, const guac_layer* layer,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("4.move,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, parent->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, x)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, y)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, z)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "move", layer->index,
+            parent->index, x, y, z);
 
     socket.InstructionEnd();
     return ret_val;
@@ -1036,90 +1100,235 @@ int guac_protocol_send_pipe(GuacSocket& socket, const guac_stream* stream,
     return ret_val;
 }
 
-int guac_protocol_send_png(GuacSocket& socket, guac_composite_mode mode,
-        const guac_layer* layer, int x, int y, cairo_surface_t* surface)
+int guac_protocol_encode_png(cairo_surface_t* surface, std::vector<unsigned char>& buffer,
+        const guac_png_profile* profile, int keyframe)
 {
-    int ret_val;
-    socket.InstructionBegin();
-	
-#ifdef USE_JPEG
-	// Force PNG for any layer that is not the screen
-	if (layer->index != 0) {
-		ret_val =
-			socket.WriteString("3.png,")
-			|| __guac_socket_write_length_int(socket, mode)
-			|| socket.WriteString(",")
-			|| __guac_socket_write_length_int(socket, layer->index)
-			|| socket.WriteString(",")
-			|| __guac_socket_write_length_int(socket, x)
-			|| socket.WriteString(",")
-			|| __guac_socket_write_length_int(socket, y)
-			|| socket.WriteString(",")
-			// We use the Cairo fallback function for forcing png as the internal protocol function
-			// to use libpng natively will not be compiled into builds that use JPEG compression support.
-			|| __guac_socket_write_length_png_cairo(socket, surface)
-			|| socket.WriteString(";");
-	} else {
-		// Screen layer
-		ret_val =
-			socket.WriteString("3.png,")
-			|| __guac_socket_write_length_int(socket, mode)
-			|| socket.WriteString(",")
-			|| __guac_socket_write_length_int(socket, layer->index)
-			|| socket.WriteString(",")
-			|| __guac_socket_write_length_int(socket, x)
-			|| socket.WriteString(",")
-			|| __guac_socket_write_length_int(socket, y)
-			|| socket.WriteString(",")
-			|| __guac_socket_write_length_jpeg(socket, surface)
-			|| socket.WriteString(";");
-	}
+	return __guac_encode_png(surface, buffer,
+			profile != NULL ? *profile : GUAC_PNG_DEFAULT_PROFILE, keyframe);
+}
+
+int guac_protocol_use_webp(GuacSocket& socket)
+{
+#ifdef USE_WEBP
+	return WEBP_MODE != GUAC_WEBP_DISABLED && socket.IsWebP();
+#else
+	return 0;
+#endif
+}
+
+int guac_protocol_webp_lossy()
+{
+#ifdef USE_WEBP
+	return WEBP_MODE == GUAC_WEBP_LOSSY;
+#else
+	return 0;
+#endif
+}
+
+int guac_protocol_encode_webp(const guac_layer* layer, cairo_surface_t* surface,
+        std::vector<unsigned char>& buffer, int quality)
+{
+#ifdef USE_WEBP
+    WebPConfig config;
+    WebPPicture picture;
+
+    unsigned char* data = cairo_image_surface_get_data(surface);
+
+    /* Only RGB24 surfaces can be imported directly */
+    if (cairo_image_surface_get_format(surface) != CAIRO_FORMAT_RGB24 || data == NULL) {
+        guac_error = GUAC_STATUS_INTERNAL_ERROR;
+        guac_error_message = "WebP images can only be encoded from RGB24 surfaces";
+        return -1;
+    }
+
+    /* Flush pending operations to surface */
+    cairo_surface_flush(surface);
+
+    if (!WebPConfigInit(&config) || !WebPPictureInit(&picture)) {
+        guac_error = GUAC_STATUS_INTERNAL_ERROR;
+        guac_error_message = "libwebp version mismatch";
+        return -1;
+    }
+
+    /* Only the screen can be lossy, other layers (like the cursor) must stay exact */
+    config.lossless = WEBP_MODE == GUAC_WEBP_LOSSLESS || layer->index != 0;
+    config.quality = config.lossless ? GUAC_PROTOCOL_WEBP_LOSSLESS_EFFORT
+                                     : quality > 0 ? quality : WEBP_QUALITY;
+
+    /* Favour encoding speed, updates are encoded while the screen is being drawn */
+    config.method = 1;
+
+    picture.use_argb = config.lossless;
+    picture.width = cairo_image_surface_get_width(surface);
+    picture.height = cairo_image_surface_get_height(surface);
+    picture.writer = __guac_socket_write_webp;
+    picture.custom_ptr = &buffer;
+
+    /* Cairo stores RGB24 pixels as BGRX in memory on little-endian hosts */
+    if (!WebPPictureImportBGRX(&picture, data, cairo_image_surface_get_stride(surface))) {
+        WebPPictureFree(&picture);
+        guac_error = GUAC_STATUS_NO_MEMORY;
+        guac_error_message = "libwebp failed to import surface";
+        return -1;
+    }
+
+    buffer.clear();
+    buffer.reserve(GUAC_PROTOCOL_IMAGE_BUFFER_SIZE);
+
+    int success = WebPEncode(&config, &picture);
+    WebPPictureFree(&picture);
+
+    if (!success) {
+        guac_error = GUAC_STATUS_INTERNAL_ERROR;
+        guac_error_message = "libwebp failed to encode image";
+        return -1;
+    }
+
+    return 0;
 #else
-	ret_val =
-			socket.WriteString("3.png,")
-			|| __guac_socket_write_length_int(socket, mode)
-			|| socket.WriteString(",")
-			|| __guac_socket_write_length_int(socket, layer->index)
-			|| socket.WriteString(",")
-			|| __guac_socket_write_length_int(socket, x)
-			|| socket.WriteString(",")
-			|| __guac_socket_write_length_int(socket, y)
-			|| socket.WriteString(",")
-			|| __guac_socket_write_length_png(socket, surface)
-			|| socket.WriteString(";");
+    guac_error = GUAC_STATUS_NOT_SUPPORTED;
+    guac_error_message = "WebP support was not compiled in";
+    return -1;
 #endif
+}
+
+int guac_protocol_use_screen_codec(GuacSocket& socket)
+{
+    if (!socket.IsScreenCodec())
+        return 0;
+#ifdef USE_ZSTD
+    if (socket.IsScreenCodecZstd())
+        return GUAC_SCREEN_CODEC_ZSTD;
+#endif
+    return GUAC_SCREEN_CODEC_PLAIN;
+}
+
+int guac_protocol_encode_screen(cairo_surface_t* surface, std::vector<unsigned char>& buffer,
+        int zstd)
+{
+    unsigned char* data = cairo_image_surface_get_data(surface);
+
+    if (cairo_image_surface_get_format(surface) != CAIRO_FORMAT_RGB24 || data == NULL) {
+        guac_error = GUAC_STATUS_INTERNAL_ERROR;
+        guac_error_message = "Screen codec images can only be encoded from RGB24 surfaces";
+        return -1;
+    }
+
+    return guac_screen_codec_encode(data, cairo_image_surface_get_width(surface),
+            cairo_image_surface_get_height(surface), cairo_image_surface_get_stride(surface),
+            zstd, buffer);
+}
+
+int guac_protocol_send_encoded_img(GuacSocket& socket, guac_composite_mode mode,
+        const guac_layer* layer, const char* mimetype, int x, int y,
+        const std::vector<unsigned char>& buffer)
+{
+    guac_stream stream;
+    stream.index = GUAC_PROTOCOL_IMAGE_STREAM;
+
+    int ret_val = guac_protocol_send_img(socket, &stream, mode, layer, mimetype, x, y);
+    if (ret_val)
+        return ret_val;
+
+    /* The blob is written as image data so it isn't base64 encoded for binary clients */
+    socket.InstructionBegin();
+    ret_val =
+           socket.WriteString("4.blob,")
+        || __guac_socket_write_length_int(socket, stream.index)
+        || socket.WriteString(",")
+        || socket.WriteImage(buffer.data(), buffer.size())
+        || socket.WriteString(";");
     socket.InstructionEnd();
-    return ret_val;
+
+    return ret_val || guac_protocol_send_end(socket, &stream);
 }
 
-int guac_protocol_send_pop(GuacSocket& socket, const guac_layer* layer)
+int guac_protocol_send_img(GuacSocket& socket, const guac_stream* stream,
+        guac_composite_mode mode, const guac_layer* layer,
+        const char* mimetype, int x, int y)
 {
     int ret_val;
 
     socket.InstructionBegin();
     ret_val =
-           socket.WriteString("3.pop,")
+           socket.WriteString("3.img,")
+        || __guac_socket_write_length_int(socket, stream->index)
+        || socket.WriteString(",")
+        || __guac_socket_write_length_int(socket, mode)
+        || socket.WriteString(",")
         || __guac_socket_write_length_int(socket, layer->index)
+        || socket.WriteString(",")
+        || __guac_socket_write_length_string(socket, mimetype)
+        || socket.WriteString(",")
+        || __guac_socket_write_length_int(socket, x)
+        || socket.WriteString(",")
+        || __guac_socket_write_length_int(socket, y)
         || socket.WriteString(";");
 
     socket.InstructionEnd();
     return ret_val;
 }
 
-int guac_protocol_send_push(GuacSocket& socket, const guac_layer* layer)
+int guac_protocol_send_encoded_png(GuacSocket& socket, guac_composite_mode mode,
+        const guac_layer* layer, int x, int y, const std::vector<unsigned char>& buffer,
+        const std::vector<unsigned char>* reduced)
 {
+    if (reduced == NULL)
+        reduced = &buffer;
+
     int ret_val;
 
     socket.InstructionBegin();
     ret_val =
-           socket.WriteString("4.push,")
+           socket.WriteString("3.png,")
+        || __guac_socket_write_length_int(socket, mode)
+        || socket.WriteString(",")
         || __guac_socket_write_length_int(socket, layer->index)
+        || socket.WriteString(",")
+        || __guac_socket_write_length_int(socket, x)
+        || socket.WriteString(",")
+        || __guac_socket_write_length_int(socket, y)
+        || socket.WriteString(",")
+        || socket.WriteImage(buffer.data(), buffer.size(), reduced->data(), reduced->size())
         || socket.WriteString(";");
 
     socket.InstructionEnd();
     return ret_val;
 }
 
+int guac_protocol_send_png(GuacSocket& socket, guac_composite_mode mode,
+        const guac_layer* layer, int x, int y, cairo_surface_t* surface)
+{
+    std::vector<unsigned char> buffer;
+
+    if (guac_protocol_encode_png(surface, buffer))
+        return -1;
+
+    return guac_protocol_send_encoded_png(socket, mode, layer, x, y, buffer);
+}
+
+int guac_protocol_send_pop(GuacSocket& socket, const guac_layer* layer)
+{
+    int ret_val;
+
+    socket.InstructionBegin();
+    ret_val = __guac_socket_write_instruction(socket, "pop", layer->index);
+
+    socket.InstructionEnd();
+    return ret_val;
+}
+
+int guac_protocol_send_push(GuacSocket& socket, const guac_layer* layer)
+{
+    int ret_val;
+
+    socket.InstructionBegin();
+    ret_val = __guac_socket_write_instruction(socket, "push", layer->index);
+
+    socket.InstructionEnd();
+    return ret_val;
+}
+
 int guac_protocol_send_ready(GuacSocket& socket, const char* id)
 {
     int ret_val;
@@ -1140,18 +1349,8 @@ int guac_protocol_send_rect(GuacSocket& socket,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("4.rect,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, x)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, y)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, width)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, height)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "rect", layer->index, x,
+            y, width, height);
 
     socket.InstructionEnd();
     return ret_val;
@@ -1162,10 +1361,7 @@ int guac_protocol_send_reset(GuacSocket& socket, const guac_layer* layer)
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("5.reset,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "reset", layer->index);
 
     socket.InstructionEnd();
     return ret_val;
@@ -1210,12 +1406,7 @@ int guac_protocol_send_shade(GuacSocket& socket, const guac_layer* layer,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("5.shade,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, a)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "shade", layer->index, a);
 
     socket.InstructionEnd();
     return ret_val;
@@ -1227,14 +1418,8 @@ int guac_protocol_send_size(GuacSocket& socket, const guac_layer* layer,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("4.size,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, w)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, h)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "size", layer->index, w,
+            h);
 
     socket.InstructionEnd();
     return ret_val;
@@ -1246,14 +1431,8 @@ int guac_protocol_send_start(GuacSocket& socket, const guac_layer* layer,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("5.start,")
-        || __guac_socket_write_length_int(socket, layer->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, x)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, y)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "start", layer->index, x,
+            y);
 
     socket.InstructionEnd();
     return ret_val;
@@ -1264,10 +1443,7 @@ int guac_protocol_send_sync(GuacSocket& socket, guac_timestamp timestamp)
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val = 
-           socket.WriteString("4.sync,")
-        || __guac_socket_write_length_int(socket, timestamp)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "sync", timestamp);
 
     socket.InstructionEnd();
     return ret_val;
@@ -1280,26 +1456,8 @@ int guac_protocol_send_transfer(GuacSocket& socket,
     int ret_val;
 
     socket.InstructionBegin();
-    ret_val =
-           socket.WriteString("8.transfer,")
-        || __guac_socket_write_length_int(socket, srcl->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, srcx)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, srcy)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, w)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, h)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, fn)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, dstl->index)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, dstx)
-        || socket.WriteString(",")
-        || __guac_socket_write_length_int(socket, dsty)
-        || socket.WriteString(";");
+    ret_val = __guac_socket_write_instruction(socket, "transfer", srcl->index,
+            srcx, srcy, w, h, fn, dstl->index, dstx, dsty);
 
     socket.InstructionEnd();
     return ret_val;
@@ -41,15 +41,118 @@
 #include <cairo/cairo.h>
 #include <stdarg.h>
 
-#ifdef USE_JPEG
+#include <vector>
+
 /**
  * Sets the JPEG quality used to the specified value.
  *
- * @param quality The JPEG quality to use (0-100).
+ * @param quality The JPEG quality to use (0-100). Values above 100 disable
+ *                JPEG, so every update is sent losslessly.
  */
 void SetJPEGQuality(uint8_t quality);
+
+/**
+ * Returns whether updates may be encoded as JPEG, which is the case unless
+ * it was disabled with SetJPEGQuality().
+ *
+ * @return Non-zero if JPEG is enabled, zero otherwise.
+ */
+int guac_protocol_jpeg_enabled();
+
+/**
+ * Returns the JPEG quality set with SetJPEGQuality().
+ *
+ * @return The JPEG quality, from 0 to 100 if JPEG is enabled.
+ */
+int guac_protocol_jpeg_quality();
+
+#ifdef USE_WEBP
+/**
+ * Sets how images are encoded for users that support WebP.
+ *
+ * @param mode Whether WebP is used, and if it is lossless or lossy.
+ * @param quality The quality of lossy WebP images (0-100).
+ */
+void SetWebPMode(guac_webp_mode mode, uint8_t quality);
 #endif
 
+/**
+ * How PNG images are encoded. Screen updates have to be encoded quickly, so
+ * they use a low zlib level, while images that aren't as urgent, like the
+ * full screen sent to users that join, are worth compressing harder.
+ */
+typedef struct guac_png_profile {
+
+    /**
+     * The zlib compression level of screen updates, 0 - 9.
+     */
+    int realtime_level;
+
+    /**
+     * The zlib compression level of keyframes and lossless refinements, 0 - 9.
+     */
+    int keyframe_level;
+
+    /**
+     * Whether images with at most 256 colors are written with a palette.
+     */
+    int palette;
+
+    /**
+     * Whether screen updates that can't use a palette are written with
+     * guac_fast_png_encode() rather than libpng and zlib, which is several
+     * times faster for slightly larger images. Keyframes still use zlib.
+     */
+    int fast;
+
+} guac_png_profile;
+
+/**
+ * The PNG profile used when none is given.
+ */
+extern const guac_png_profile GUAC_PNG_DEFAULT_PROFILE;
+
+/**
+ * The chroma subsampling of JPEG images. Subsampling makes images smaller
+ * and faster to encode, but blurs colored text.
+ */
+typedef enum guac_jpeg_subsampling {
+    GUAC_JPEG_SUBSAMPLING_420,
+    GUAC_JPEG_SUBSAMPLING_422,
+    GUAC_JPEG_SUBSAMPLING_444
+} guac_jpeg_subsampling;
+
+/**
+ * How JPEG images are encoded.
+ */
+typedef struct guac_jpeg_profile {
+
+    /**
+     * The JPEG quality (1-100), or 0 to use guac_protocol_jpeg_quality().
+     */
+    int quality;
+
+    /**
+     * The chroma subsampling of images. Only TurboJPEG builds can change
+     * it, the cairo encoder always uses 4:2:0.
+     */
+    guac_jpeg_subsampling subsampling;
+
+    /**
+     * The quality of lossy WebP images (1-100), or 0 to use the quality
+     * set with SetWebPMode().
+     */
+    int webp_quality;
+
+    /**
+     * The rate, in updates per second, an area must be updated at for JPEG
+     * to be considered, or 0 for the default. Lowering it sends more of the
+     * screen lossy.
+     */
+    int lossy_framerate;
+
+} guac_jpeg_profile;
+
 /* CONTROL INSTRUCTIONS */
 
 /**
@@ -551,6 +654,175 @@ int guac_protocol_send_lstroke(GuacSocket& socket,
 int guac_protocol_send_png(GuacSocket& socket, guac_composite_mode mode,
         const guac_layer* layer, int x, int y, cairo_surface_t* surface);
 
+/**
+ * Encodes the given surface as a PNG image without sending it, so the
+ * encoding can be done on another thread. The image is encoded the same way
+ * guac_protocol_send_png() would encode it, unless a profile is given.
+ *
+ * If an error occurs encoding the image, a non-zero value is returned, and
+ * guac_error is set appropriately.
+ *
+ * @param surface A cairo surface containing the image data to encode.
+ * @param buffer The buffer which will receive the encoded image.
+ * @param profile The compression settings to use, or NULL for the defaults.
+ * @param keyframe Non-zero to use the keyframe compression level of the
+ *                 profile rather than the realtime one.
+ * @return Zero on success, non-zero on error.
+ */
+int guac_protocol_encode_png(cairo_surface_t* surface, std::vector<unsigned char>& buffer,
+        const guac_png_profile* profile = NULL, int keyframe = 0);
+
+/**
+ * Encodes the given surface as a JPEG image at the given quality, which is
+ * normally guac_protocol_jpeg_quality(). The result can be sent with
+ * guac_protocol_send_encoded_png(), as browsers detect the format of the
+ * image data themselves.
+ *
+ * With TurboJPEG, RGB24 surfaces are compressed straight from their memory
+ * by an encoder kept for each thread, into a buffer sized for the worst case
+ * beforehand.
+ *
+ * If an error occurs encoding the image, a non-zero value is returned, and
+ * guac_error is set appropriately.
+ *
+ * @param surface A cairo surface containing the image data to encode.
+ * @param buffer The buffer which will receive the encoded image.
+ * @param quality The JPEG quality to use (0-100).
+ * @param subsampling The chroma subsampling to use, if it can be changed.
+ * @return Zero on success, non-zero on error.
+ */
+int guac_protocol_encode_jpeg(cairo_surface_t* surface, std::vector<unsigned char>& buffer, int quality,
+        guac_jpeg_subsampling subsampling = GUAC_JPEG_SUBSAMPLING_420);
+
+/**
+ * Sends a png instruction containing image data that was encoded by
+ * guac_protocol_encode_png() or guac_protocol_encode_jpeg().
+ *
+ * If an error occurs sending the instruction, a non-zero value is
+ * returned, and guac_error is set appropriately.
+ *
+ * @param socket The guac_socket connection to use.
+ * @param mode The composite mode to use.
+ * @param layer The destination layer.
+ * @param x The destination X coordinate.
+ * @param y The destination Y coordinate.
+ * @param buffer The encoded image data.
+ * @param reduced The image data sent to users in the reduced quality tier
+ *                instead, or NULL to send them buffer as well.
+ * @return Zero on success, non-zero on error.
+ */
+int guac_protocol_send_encoded_png(GuacSocket& socket, guac_composite_mode mode,
+        const guac_layer* layer, int x, int y, const std::vector<unsigned char>& buffer,
+        const std::vector<unsigned char>* reduced = NULL);
+
+/**
+ * Returns whether images sent on the given socket should be encoded as WebP,
+ * which is the case when WebP support was compiled in and enabled, and every
+ * user receiving instructions from the socket supports it.
+ *
+ * @param socket The guac_socket connection images will be sent on.
+ * @return Non-zero if WebP should be used, zero otherwise.
+ */
+int guac_protocol_use_webp(GuacSocket& socket);
+
+/**
+ * Returns whether images of the default layer are encoded as lossy WebP,
+ * when WebP is used.
+ *
+ * @return Non-zero if the WebP mode is lossy, zero otherwise.
+ */
+int guac_protocol_webp_lossy();
+
+/**
+ * Encodes the given surface as a WebP image, using the mode set by
+ * SetWebPMode(). Images for layers other than the default layer are always
+ * lossless.
+ *
+ * If an error occurs encoding the image, a non-zero value is returned, and
+ * guac_error is set appropriately.
+ *
+ * @param layer The destination layer.
+ * @param surface A cairo surface containing the image data to encode.
+ * @param buffer The buffer which will receive the encoded image.
+ * @param quality The quality of lossy images (1-100), or 0 to use the
+ *                quality set with SetWebPMode().
+ * @return Zero on success, non-zero on error.
+ */
+int guac_protocol_encode_webp(const guac_layer* layer, cairo_surface_t* surface,
+        std::vector<unsigned char>& buffer, int quality = 0);
+
+/**
+ * The ways guac_protocol_use_screen_codec() says the screen codec is used.
+ */
+#define GUAC_SCREEN_CODEC_PLAIN 1
+#define GUAC_SCREEN_CODEC_ZSTD  2
+
+/**
+ * Returns whether images sent on the given socket should be encoded with the
+ * screen codec described in screen_codec.h, which is the case when every user
+ * receiving instructions from the socket supports it.
+ *
+ * @param socket The guac_socket connection images will be sent on.
+ * @return GUAC_SCREEN_CODEC_ZSTD if the codec should be used with zstd,
+ *         GUAC_SCREEN_CODEC_PLAIN if it should be used without, and zero if
+ *         it shouldn't be used.
+ */
+int guac_protocol_use_screen_codec(GuacSocket& socket);
+
+/**
+ * Encodes the given surface with the screen codec. The result is sent with
+ * guac_protocol_send_encoded_img() as GUAC_SCREEN_CODEC_MIMETYPE.
+ *
+ * If an error occurs encoding the image, a non-zero value is returned, and
+ * guac_error is set appropriately.
+ *
+ * @param surface A cairo surface containing the image data to encode.
+ * @param buffer The buffer which will receive the encoded image.
+ * @param zstd Non-zero if the image may be compressed with zstd.
+ * @return Zero on success, non-zero on error.
+ */
+int guac_protocol_encode_screen(cairo_surface_t* surface, std::vector<unsigned char>& buffer,
+        int zstd);
+
+/**
+ * Sends an img instruction over the given guac_socket connection.
+ *
+ * If an error occurs sending the instruction, a non-zero value is
+ * returned, and guac_error is set appropriately.
+ *
+ * @param socket The guac_socket connection to use.
+ * @param stream The stream to use.
+ * @param mode The composite mode to use.
+ * @param layer The destination layer.
+ * @param mimetype The mimetype of the image being sent.
+ * @param x The destination X coordinate.
+ * @param y The destination Y coordinate.
+ * @return Zero on success, non-zero on error.
+ */
+int guac_protocol_send_img(GuacSocket& socket, const guac_stream* stream,
+        guac_composite_mode mode, const guac_layer* layer,
+        const char* mimetype, int x, int y);
+
+/**
+ * Sends already encoded image data as an img instruction, followed by a blob
+ * containing the image and an end instruction closing the stream.
+ *
+ * If an error occurs sending the instructions, a non-zero value is
+ * returned, and guac_error is set appropriately.
+ *
+ * @param socket The guac_socket connection to use.
+ * @param mode The composite mode to use.
+ * @param layer The destination layer.
+ * @param mimetype The mimetype of the image being sent.
+ * @param x The destination X coordinate.
+ * @param y The destination Y coordinate.
+ * @param buffer The encoded image data.
+ * @return Zero on success, non-zero on error.
+ */
+int guac_protocol_send_encoded_img(GuacSocket& socket, guac_composite_mode mode,
+        const guac_layer* layer, const char* mimetype, int x, int y,
+        const std::vector<unsigned char>& buffer);
+
 /**
  * Sends a pop instruction over the given guac_socket connection.
  *
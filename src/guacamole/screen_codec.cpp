@@ -0,0 +1,358 @@
+#include "config.h"
+#include "screen_codec.h"
+#include "error.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#define GUAC_SCREEN_CODEC_TILE_SIZE 16
+#define GUAC_SCREEN_CODEC_HEADER_SIZE 9
+#define GUAC_SCREEN_CODEC_MAX_COLORS 16
+
+#define GUAC_SCREEN_CODEC_SOLID   0
+#define GUAC_SCREEN_CODEC_LEFT    1
+#define GUAC_SCREEN_CODEC_ABOVE   2
+#define GUAC_SCREEN_CODEC_PALETTE 3
+#define GUAC_SCREEN_CODEC_PIXELS  4
+
+#define GUAC_SCREEN_CODEC_FLAG_ZSTD 1
+
+#define GUAC_QOI_OP_INDEX 0x00
+#define GUAC_QOI_OP_DIFF  0x40
+#define GUAC_QOI_OP_LUMA  0x80
+#define GUAC_QOI_OP_RUN   0xc0
+#define GUAC_QOI_OP_RGB   0xfe
+#define GUAC_QOI_MAX_RUN  62
+
+/**
+ * Tiles are only compressed with zstd when there are enough of them for it
+ * to be worth the time, and with a level that keeps up with the display.
+ */
+#define GUAC_SCREEN_CODEC_ZSTD_MIN_SIZE 1024
+#define GUAC_SCREEN_CODEC_ZSTD_LEVEL 1
+
+/**
+ * The state of the QOI operations, which carries on between tiles.
+ */
+typedef struct guac_screen_codec_qoi {
+
+    uint32_t previous;
+    uint32_t index[64];
+
+} guac_screen_codec_qoi;
+
+static inline uint32_t __guac_screen_codec_pixel(const unsigned char* row, int x) {
+    return ((const uint32_t*) row)[x] & 0xFFFFFF;
+}
+
+/**
+ * The position of a pixel in the array of recently seen pixels, which is
+ * QOI's hash with an alpha of 255.
+ */
+static inline int __guac_screen_codec_hash(uint32_t pixel) {
+    int r = (pixel >> 16) & 0xFF;
+    int g = (pixel >> 8) & 0xFF;
+    int b = pixel & 0xFF;
+    return (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+}
+
+static inline void __guac_screen_codec_put_rgb(std::vector<unsigned char>& out, uint32_t pixel) {
+    out.push_back((pixel >> 16) & 0xFF);
+    out.push_back((pixel >> 8) & 0xFF);
+    out.push_back(pixel & 0xFF);
+}
+
+/**
+ * Returns whether a tile has the same pixels as the area the given distance
+ * to the left and above it.
+ */
+static int __guac_screen_codec_tile_equals(const unsigned char* tile, int width, int height,
+        int stride, int dx, int dy) {
+
+    const unsigned char* other = tile - dy * stride - dx * 4;
+    for (int y = 0; y < height; y++) {
+        const uint32_t* a = (const uint32_t*) (tile + y * stride);
+        const uint32_t* b = (const uint32_t*) (other + y * stride);
+        for (int x = 0; x < width; x++) {
+            if ((a[x] ^ b[x]) & 0xFFFFFF)
+                return 0;
+        }
+    }
+
+    return 1;
+
+}
+
+/**
+ * Finds the colors of a tile, if it has no more than
+ * GUAC_SCREEN_CODEC_MAX_COLORS.
+ *
+ * @return The number of colors, or zero if there are too many.
+ */
+static int __guac_screen_codec_tile_colors(const unsigned char* tile, int width, int height,
+        int stride, uint32_t* colors) {
+
+    int count = 0;
+    uint32_t last = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = tile + y * stride;
+        for (int x = 0; x < width; x++) {
+
+            /* Most pixels repeat the one before them */
+            uint32_t pixel = __guac_screen_codec_pixel(row, x);
+            if (count && pixel == last)
+                continue;
+            last = pixel;
+
+            int i = 0;
+            while (i < count && colors[i] != pixel)
+                i++;
+            if (i == count) {
+                if (count == GUAC_SCREEN_CODEC_MAX_COLORS)
+                    return 0;
+                colors[count++] = pixel;
+            }
+
+        }
+    }
+
+    return count;
+
+}
+
+static void __guac_screen_codec_write_palette(std::vector<unsigned char>& out,
+        const unsigned char* tile, int width, int height, int stride,
+        const uint32_t* colors, int count) {
+
+    out.push_back(GUAC_SCREEN_CODEC_PALETTE);
+    out.push_back(count - 1);
+    for (int i = 0; i < count; i++)
+        __guac_screen_codec_put_rgb(out, colors[i]);
+
+    int bits = count <= 2 ? 1 : count <= 4 ? 2 : 4;
+    int packed = 0;
+    int filled = 0;
+    int last_index = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = tile + y * stride;
+        for (int x = 0; x < width; x++) {
+
+            uint32_t pixel = __guac_screen_codec_pixel(row, x);
+            if (colors[last_index] != pixel) {
+                last_index = 0;
+                while (colors[last_index] != pixel)
+                    last_index++;
+            }
+
+            packed = (packed << bits) | last_index;
+            filled += bits;
+            if (filled == 8) {
+                out.push_back(packed);
+                packed = 0;
+                filled = 0;
+            }
+
+        }
+    }
+
+    if (filled)
+        out.push_back(packed << (8 - filled));
+
+}
+
+static void __guac_screen_codec_write_pixels(std::vector<unsigned char>& out,
+        const unsigned char* tile, int width, int height, int stride,
+        guac_screen_codec_qoi* qoi) {
+
+    out.push_back(GUAC_SCREEN_CODEC_PIXELS);
+
+    uint32_t previous = qoi->previous;
+    int run = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = tile + y * stride;
+        for (int x = 0; x < width; x++) {
+
+            uint32_t pixel = __guac_screen_codec_pixel(row, x);
+            if (pixel == previous) {
+                if (++run == GUAC_QOI_MAX_RUN) {
+                    out.push_back(GUAC_QOI_OP_RUN | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run) {
+                out.push_back(GUAC_QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+
+            int hash = __guac_screen_codec_hash(pixel);
+            if (qoi->index[hash] == pixel) {
+                out.push_back(GUAC_QOI_OP_INDEX | hash);
+                previous = pixel;
+                continue;
+            }
+            qoi->index[hash] = pixel;
+
+            int dr = (int) ((pixel >> 16) & 0xFF) - (int) ((previous >> 16) & 0xFF);
+            int dg = (int) ((pixel >> 8) & 0xFF) - (int) ((previous >> 8) & 0xFF);
+            int db = (int) (pixel & 0xFF) - (int) (previous & 0xFF);
+
+            /* Differences wrap around, like those of QOI */
+            dr = (signed char) dr;
+            dg = (signed char) dg;
+            db = (signed char) db;
+            int dr_dg = dr - dg;
+            int db_dg = db - dg;
+
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                out.push_back(GUAC_QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                out.push_back(GUAC_QOI_OP_LUMA | (dg + 32));
+                out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+            }
+            else {
+                out.push_back(GUAC_QOI_OP_RGB);
+                __guac_screen_codec_put_rgb(out, pixel);
+            }
+
+            previous = pixel;
+
+        }
+    }
+
+    if (run)
+        out.push_back(GUAC_QOI_OP_RUN | (run - 1));
+
+    qoi->previous = previous;
+
+}
+
+/**
+ * Encodes a tile, picking whichever mode is smallest.
+ */
+static void __guac_screen_codec_write_tile(std::vector<unsigned char>& out,
+        const unsigned char* tile, int x, int y, int width, int height, int stride,
+        guac_screen_codec_qoi* qoi) {
+
+    if (x >= GUAC_SCREEN_CODEC_TILE_SIZE && __guac_screen_codec_tile_equals(tile, width, height,
+                stride, GUAC_SCREEN_CODEC_TILE_SIZE, 0)) {
+        out.push_back(GUAC_SCREEN_CODEC_LEFT);
+        return;
+    }
+
+    if (y >= GUAC_SCREEN_CODEC_TILE_SIZE && __guac_screen_codec_tile_equals(tile, width, height,
+                stride, 0, GUAC_SCREEN_CODEC_TILE_SIZE)) {
+        out.push_back(GUAC_SCREEN_CODEC_ABOVE);
+        return;
+    }
+
+    uint32_t colors[GUAC_SCREEN_CODEC_MAX_COLORS];
+    int count = __guac_screen_codec_tile_colors(tile, width, height, stride, colors);
+    if (count == 1) {
+        out.push_back(GUAC_SCREEN_CODEC_SOLID);
+        __guac_screen_codec_put_rgb(out, colors[0]);
+        return;
+    }
+
+    /* Text is usually smaller with a palette, but a tile with a few pixels
+     * of another color is smaller as runs */
+    size_t start = out.size();
+    guac_screen_codec_qoi saved;
+    if (count)
+        saved = *qoi;
+
+    __guac_screen_codec_write_pixels(out, tile, width, height, stride, qoi);
+
+    if (count) {
+        int bits = count <= 2 ? 1 : count <= 4 ? 2 : 4;
+        size_t palette_size = 2 + count * 3 + (width * height * bits + 7) / 8;
+        if (palette_size <= out.size() - start) {
+            out.resize(start);
+            *qoi = saved;
+            __guac_screen_codec_write_palette(out, tile, width, height, stride, colors, count);
+        }
+    }
+
+}
+
+#ifdef USE_ZSTD
+/**
+ * Compresses the tiles after the header with zstd if that makes them
+ * smaller, using a context kept by each encoder thread.
+ */
+static void __guac_screen_codec_compress(std::vector<unsigned char>& buffer) {
+
+    struct context {
+        ZSTD_CCtx* cctx = ZSTD_createCCtx();
+        ~context() { ZSTD_freeCCtx(cctx); }
+    };
+    static thread_local context zstd;
+    static thread_local std::vector<unsigned char> compressed;
+
+    size_t size = buffer.size() - GUAC_SCREEN_CODEC_HEADER_SIZE;
+    if (zstd.cctx == NULL || size < GUAC_SCREEN_CODEC_ZSTD_MIN_SIZE)
+        return;
+
+    compressed.resize(GUAC_SCREEN_CODEC_HEADER_SIZE + 4 + ZSTD_compressBound(size));
+    size_t result = ZSTD_compressCCtx(zstd.cctx, compressed.data() + GUAC_SCREEN_CODEC_HEADER_SIZE + 4,
+            compressed.size() - GUAC_SCREEN_CODEC_HEADER_SIZE - 4,
+            buffer.data() + GUAC_SCREEN_CODEC_HEADER_SIZE, size, GUAC_SCREEN_CODEC_ZSTD_LEVEL);
+    if (ZSTD_isError(result) || result + 4 >= size)
+        return;
+
+    memcpy(compressed.data(), buffer.data(), GUAC_SCREEN_CODEC_HEADER_SIZE);
+    compressed[GUAC_SCREEN_CODEC_HEADER_SIZE - 1] |= GUAC_SCREEN_CODEC_FLAG_ZSTD;
+    for (int i = 0; i < 4; i++)
+        compressed[GUAC_SCREEN_CODEC_HEADER_SIZE + i] = (size >> (i * 8)) & 0xFF;
+    compressed.resize(GUAC_SCREEN_CODEC_HEADER_SIZE + 4 + result);
+    buffer.swap(compressed);
+
+}
+#endif
+
+int guac_screen_codec_encode(const unsigned char* data, int width, int height, int stride,
+        int zstd, std::vector<unsigned char>& buffer) {
+
+    if (width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF) {
+        guac_error = GUAC_STATUS_INVALID_ARGUMENT;
+        guac_error_message = "Image dimensions out of range for the screen codec";
+        return -1;
+    }
+
+    const unsigned char header[GUAC_SCREEN_CODEC_HEADER_SIZE] = {
+        'C', 'V', 'S', '1',
+        (unsigned char) (width & 0xFF), (unsigned char) (width >> 8),
+        (unsigned char) (height & 0xFF), (unsigned char) (height >> 8),
+        0
+    };
+    buffer.assign(header, header + GUAC_SCREEN_CODEC_HEADER_SIZE);
+    buffer.reserve(GUAC_SCREEN_CODEC_HEADER_SIZE + (size_t) width * height / 4);
+
+    guac_screen_codec_qoi qoi;
+    qoi.previous = 0;
+    memset(qoi.index, 0, sizeof(qoi.index));
+
+    for (int y = 0; y < height; y += GUAC_SCREEN_CODEC_TILE_SIZE) {
+        int tile_height = height - y < GUAC_SCREEN_CODEC_TILE_SIZE ? height - y : GUAC_SCREEN_CODEC_TILE_SIZE;
+        for (int x = 0; x < width; x += GUAC_SCREEN_CODEC_TILE_SIZE) {
+            int tile_width = width - x < GUAC_SCREEN_CODEC_TILE_SIZE ? width - x : GUAC_SCREEN_CODEC_TILE_SIZE;
+            __guac_screen_codec_write_tile(buffer, data + y * stride + x * 4,
+                    x, y, tile_width, tile_height, stride, &qoi);
+        }
+    }
+
+#ifdef USE_ZSTD
+    if (zstd)
+        __guac_screen_codec_compress(buffer);
+#else
+    (void) zstd;
+#endif
+
+    return 0;
+
+}
@@ -0,0 +1,64 @@
+#ifndef _GUAC_SCREEN_CODEC_H
+#define _GUAC_SCREEN_CODEC_H
+
+/**
+ * A lossless image format made for screen updates, which encodes several
+ * times faster than PNG and decodes without zlib. Clients that support it
+ * list GUAC_SCREEN_CODEC_MIMETYPE when connecting to a VM, and also
+ * GUAC_SCREEN_CODEC_ZSTD_MIMETYPE if they can decompress zstd.
+ *
+ * An image starts with the bytes "CVS1", its width and height as 16-bit
+ * little endian integers, and a flags byte. When bit 0 of the flags is set,
+ * the rest of the image is a 32-bit little endian length followed by a zstd
+ * frame that decompresses to that many bytes, which are read instead.
+ *
+ * The image is split into 16x16 tiles, sent left to right and top to bottom,
+ * with the tiles on the right and bottom edges cut short. Each starts with a
+ * byte saying how its pixels are encoded:
+ *
+ *  - 0 (solid): an RGB color that fills the tile.
+ *  - 1 (left): the same pixels as the 16 columns to the left of the tile.
+ *  - 2 (above): the same pixels as the 16 rows above the tile.
+ *  - 3 (palette): the number of colors minus one (1 - 15), then each color
+ *    as RGB, then the index of each pixel's color, row by row, packed into
+ *    1, 2 or 4 bits for up to 2, 4 or 16 colors. The highest bits of a byte
+ *    are the first pixel, and the indices of the tile are padded to a whole
+ *    byte.
+ *  - 4 (pixels): the pixels of the tile row by row, as the operations of
+ *    QOI (https://qoiformat.org) without alpha. The previous pixel and the
+ *    array of recently seen pixels carry on from one such tile to the next,
+ *    starting at black with the array filled with black, but runs end with
+ *    each tile.
+ *
+ * @file screen_codec.h
+ */
+
+#include <vector>
+
+/**
+ * The mimetype of images in the format, and of images whose tiles may be
+ * compressed with zstd.
+ */
+#define GUAC_SCREEN_CODEC_MIMETYPE "image/x-collabvm-screen"
+#define GUAC_SCREEN_CODEC_ZSTD_MIMETYPE "image/x-collabvm-screen+zstd"
+
+/**
+ * Encodes 32-bit pixels with an unused high byte, like those of a
+ * CAIRO_FORMAT_RGB24 surface.
+ *
+ * If an error occurs encoding the image, a non-zero value is returned, and
+ * guac_error is set appropriately.
+ *
+ * @param data The first pixel of the image.
+ * @param width The width of the image, in pixels.
+ * @param height The height of the image, in pixels.
+ * @param stride The number of bytes between the start of each row.
+ * @param zstd Non-zero to compress the tiles with zstd when it makes them
+ *             smaller, if the server was built with zstd.
+ * @param buffer Replaced with the image.
+ * @return Zero on success, non-zero on error.
+ */
+int guac_screen_codec_encode(const unsigned char* data, int width, int height, int stride,
+        int zstd, std::vector<unsigned char>& buffer);
+
+#endif
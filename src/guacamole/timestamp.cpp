@@ -35,6 +35,13 @@
 #include <time.h>
 #endif
 
+#include <atomic>
+
+/**
+ * The timestamp set with guac_timestamp_set_fixed(), or zero.
+ */
+static std::atomic<guac_timestamp> fixed_timestamp(0);
+
 #ifdef _WIN32
 int gettimeofday(struct timeval * tp, struct timezone * tzp)
 {
@@ -56,8 +63,16 @@ int gettimeofday(struct timeval * tp, struct timezone * tzp)
 }
 #endif
 
+void guac_timestamp_set_fixed(guac_timestamp timestamp) {
+    fixed_timestamp = timestamp;
+}
+
 guac_timestamp guac_timestamp_current() {
 
+    guac_timestamp fixed = fixed_timestamp.load(std::memory_order_relaxed);
+    if (fixed != 0)
+        return fixed;
+
 #ifdef HAVE_CLOCK_GETTIME
 
     struct timespec current;
@@ -41,5 +41,14 @@
  */
 guac_timestamp guac_timestamp_current();
 
+/**
+ * Makes guac_timestamp_current() return the given timestamp instead of
+ * reading the clock, so that recordings of a display can be replayed faster
+ * than they were recorded while surfaces still see the recorded timing.
+ *
+ * @param timestamp The timestamp to return, or zero to read the clock again.
+ */
+void guac_timestamp_set_fixed(guac_timestamp timestamp);
+
 #endif
 
@@ -1,52 +0,0 @@
-/*
- * Copyright (C) 2013 Glyptodon LLC
- *
- * Permission is hereby granted, free of charge, to any person obtaining a copy
- * of this software and associated documentation files (the "Software"), to deal
- * in the Software without restriction, including without limitation the rights
- * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
- * copies of the Software, and to permit persons to whom the Software is
- * furnished to do so, subject to the following conditions:
- *
- * The above copyright notice and this permission notice shall be included in
- * all copies or substantial portions of the Software.
- *
- * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
- * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
- * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
- * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
- * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
- * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
- * THE SOFTWARE.
- */
-
-#include "config.h"
-
-#include "guac_cursor.h"
-#include "vnc.h"
-
-#include <guacamole/user.h>
-#include <rfb/rfbclient.h>
-
-int guac_vnc_user_mouse_handler(guac_user* user, int x, int y, int mask) {
-
-    guac_client* client = user->client;
-    guac_vnc_client* vnc_client = (guac_vnc_client*) client->data;
-
-    /* Store current mouse location */
-    guac_common_cursor_move(vnc_client->cursor, user, x, y);
-
-    SendPointerEvent(vnc_client->rfb_client, x, y, mask);
-
-    return 0;
-}
-
-int guac_vnc_user_key_handler(guac_user* user, int keysym, int pressed) {
-
-    guac_vnc_client* vnc_client = (guac_vnc_client*) user->client->data;
-
-    SendKeyEvent(vnc_client->rfb_client, keysym, pressed);
-
-    return 0;
-}
-
@@ -1,129 +0,0 @@
-/*
- * Copyright (C) 2014 Glyptodon LLC
- *
- * Permission is hereby granted, free of charge, to any person obtaining a copy
- * of this software and associated documentation files (the "Software"), to deal
- * in the Software without restriction, including without limitation the rights
- * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
- * copies of the Software, and to permit persons to whom the Software is
- * furnished to do so, subject to the following conditions:
- *
- * The above copyright notice and this permission notice shall be included in
- * all copies or substantial portions of the Software.
- *
- * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
- * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
- * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
- * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
- * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
- * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
- * THE SOFTWARE.
- */
-
-#define __GUAC_VNC_SETTINGS_H
-
-#include "../config.h"
-
-/**
- * VNC-specific client data.
- */
-typedef struct guac_vnc_settings {
-
-    /**
-     * The hostname of the VNC server (or repeater) to connect to.
-     */
-    char* hostname;
-
-    /**
-     * The port of the VNC server (or repeater) to connect to.
-     */
-    int port;
-
-    /**
-     * The password given in the arguments.
-     */
-    char* password;
-
-    /**
-     * Space-separated list of encodings to use within the VNC session.
-     */
-    char* encodings;
-
-    /**
-     * Whether the red and blue components of each color should be swapped.
-     * This is mainly used for VNC servers that do not properly handle
-     * colors.
-     */
-    int swap_red_blue;
-
-    /**
-     * The color depth to request, in bits.
-     */
-    int color_depth;
-
-    /**
-     * Whether this connection is read-only, and user input should be dropped.
-     */
-    int read_only;
-
-    /**
-     * The VNC host to connect to, if using a repeater.
-     */
-    char* dest_host;
-
-    /**
-     * The VNC port to connect to, if using a repeater.
-     */
-    int dest_port;
-
-#ifdef ENABLE_VNC_LISTEN
-    /**
-     * Whether not actually connecting to a VNC server, but rather listening
-     * for a connection from the VNC server (reverse connection).
-     */
-    int reverse_connect;
-
-    /**
-     * The maximum amount of time to wait when listening for connections, in
-     * milliseconds.
-     */
-    int listen_timeout;
-#endif
-
-    /**
-     * Whether the cursor should be rendered on the server (remote) or on the
-     * client (local).
-     */
-    int remote_cursor;
-
-    /**
-     * Whether audio is enabled.
-     */
-    int audio_enabled;
-    
-#ifdef ENABLE_PULSE
-    /**
-     * The name of the PulseAudio server to connect to.
-     */
-    char* pa_servername;
-#endif
-
-    /**
-     * The number of connection attempts to make before giving up.
-     */
-    int retries;
-
-} guac_vnc_settings;
-
-/**
- * Parses all given args, storing them in the given settings. If the args are
- * successfully parsed, zero is returned. Non-zero is returned if an error
- * occurs.
- */
-int guac_vnc_parse_args(guac_vnc_settings* settings, int argc, const char** argv);
-
-/**
- * NULL-terminated array of accepted client args.
- */
-extern const char* GUAC_VNC_CLIENT_ARGS[];
-
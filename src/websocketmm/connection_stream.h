@@ -0,0 +1,130 @@
+#ifndef WEBSOCKETMM_CONNECTION_STREAM_H
+#define WEBSOCKETMM_CONNECTION_STREAM_H
+
+#include <websocketmm/beast/net.h>
+#include <websocketmm/beast/beast.h>
+
+#ifdef USE_TLS
+	#include <boost/beast/ssl.hpp>
+	#include <boost/beast/websocket/ssl.hpp>
+
+	#include <memory>
+	#include <optional>
+	#include <utility>
+#endif
+
+namespace websocketmm {
+
+#ifdef USE_TLS
+	/**
+	 * The stream of an accepted connection, which is either plain TCP or
+	 * TLS over TCP depending on whether the server had a certificate when
+	 * it was accepted. It's handed from the HTTP session to the websocket_user
+	 * as is, so a TLS connection keeps its session when it's upgraded.
+	 */
+	class connection_stream {
+	   public:
+		using executor_type = beast::tcp_stream::executor_type;
+		using next_layer_type = beast::tcp_stream;
+		using tls_stream_type = beast::ssl_stream<beast::tcp_stream>;
+
+		/**
+		 * \param[in] context The TLS context to serve the connection with,
+		 *                    or nullptr for plain TCP. It's kept alive
+		 *                    for as long as the connection is open.
+		 */
+		connection_stream(tcp::socket&& socket, std::shared_ptr<net::ssl::context> context)
+			: context_(std::move(context)) {
+			if(context_)
+				tls_.emplace(std::move(socket), *context_);
+			else
+				tcp_.emplace(std::move(socket));
+		}
+
+		connection_stream(connection_stream&&) = default;
+		connection_stream& operator=(connection_stream&&) = default;
+
+		inline bool is_tls() const {
+			return tls_.has_value();
+		}
+
+		inline executor_type get_executor() {
+			return next_layer().get_executor();
+		}
+
+		inline beast::tcp_stream& next_layer() {
+			return tls_ ? tls_->next_layer() : *tcp_;
+		}
+
+		inline tcp::socket& socket() {
+			return next_layer().socket();
+		}
+
+		template<class Duration>
+		inline void expires_after(Duration duration) {
+			next_layer().expires_after(duration);
+		}
+
+		inline void expires_never() {
+			next_layer().expires_never();
+		}
+
+		/**
+		 * Perform the server side of the TLS handshake.
+		 * Only call this on a TLS connection.
+		 */
+		template<class HandshakeHandler>
+		void async_handshake(HandshakeHandler&& handler) {
+			tls_->async_handshake(net::ssl::stream_base::server, std::forward<HandshakeHandler>(handler));
+		}
+
+		template<class MutableBufferSequence, class ReadHandler>
+		void async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler) {
+			if(tls_)
+				tls_->async_read_some(buffers, std::forward<ReadHandler>(handler));
+			else
+				tcp_->async_read_some(buffers, std::forward<ReadHandler>(handler));
+		}
+
+		template<class ConstBufferSequence, class WriteHandler>
+		void async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler) {
+			if(tls_)
+				tls_->async_write_some(buffers, std::forward<WriteHandler>(handler));
+			else
+				tcp_->async_write_some(buffers, std::forward<WriteHandler>(handler));
+		}
+
+		// Used by websocket::stream to close the connection
+		friend void teardown(beast::role_type role, connection_stream& stream, beast::error_code& ec) {
+			using beast::websocket::teardown;
+			if(stream.tls_)
+				teardown(role, *stream.tls_, ec);
+			else
+				teardown(role, stream.tcp_->socket(), ec);
+		}
+
+		template<class TeardownHandler>
+		friend void async_teardown(beast::role_type role, connection_stream& stream, TeardownHandler&& handler) {
+			using beast::websocket::async_teardown;
+			if(stream.tls_)
+				async_teardown(role, *stream.tls_, std::forward<TeardownHandler>(handler));
+			else
+				async_teardown(role, *stream.tcp_, std::forward<TeardownHandler>(handler));
+		}
+
+	   private:
+		std::shared_ptr<net::ssl::context> context_;
+
+		/**
+		 * Only one of the two is set.
+		 */
+		std::optional<beast::tcp_stream> tcp_;
+		std::optional<tls_stream_type> tls_;
+	};
+#else
+	using connection_stream = beast::tcp_stream;
+#endif
+
+} // namespace websocketmm
+
+#endif //WEBSOCKETMM_CONNECTION_STREAM_H
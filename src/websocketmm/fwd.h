@@ -12,6 +12,7 @@ namespace websocketmm {
 	struct server;
 	struct websocket_user;
 	struct websocket_message;
+	struct http_body_sink;
 
 } // namespace websocketmm
 
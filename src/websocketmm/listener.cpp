@@ -2,74 +2,424 @@
 #include <websocketmm/server.h>
 #include <websocketmm/websocket_user.h>
 
+#include <algorithm>
+#include <limits>
+#include <optional>
 #include <utility>
+#include <vector>
+
+#ifndef _WIN32
+	#include <unistd.h>
+#endif
+
+#ifdef WEBSOCKETMM_HAS_SENDFILE
+	#include <sys/sendfile.h>
+	#include <cerrno>
+#endif
 
 namespace websocketmm {
 
-	// TODO: Move this to a seperate file, and make it work with POSTs
-	// (so we can get the agent to work???) and serve files statically
+	/**
+	 * The largest body of a request that is read into memory.
+	 */
+	constexpr static std::uint64_t kMaxBodySize = 1024 * 1024;
+
+	/**
+	 * How many bytes of a streamed body are read before they're passed to the sink.
+	 */
+	constexpr static std::size_t kBodyChunkSize = 64 * 1024;
+
+	/**
+	 * How long a streamed body can go without sending anything.
+	 */
+	constexpr static std::chrono::seconds kBodyIdleTimeout { 30 };
+
+	// TODO: Move this to a seperate file.
+	// Plain HTTP requests are passed to the server's HTTP handler,
+	// and then to its static file server. Bodies the server's body
+	// handler wants, such as file uploads, are streamed to it instead.
 
 	struct session : public std::enable_shared_from_this<session> {
-		beast::tcp_stream stream_;
+		connection_stream stream_;
 		beast::flat_buffer buffer_;
-		http::request<http::string_body> req_;
-		const std::shared_ptr<server>& server_;
 
-		explicit session(tcp::socket&& socket, const std::shared_ptr<server>& server)
+		/**
+		 * Reads the header of a request, and is then converted to
+		 * parser_ or body_parser_ to read the body.
+		 */
+		std::optional<http::request_parser<http::empty_body>> header_parser_;
+		std::optional<http::request_parser<http::string_body>> parser_;
+		http_request req_;
+
+		/**
+		 * Reads a body that is streamed to body_sink_ in chunks of body_buffer_.
+		 */
+		std::optional<http::request_parser<http::buffer_body>> body_parser_;
+		std::shared_ptr<http_body_sink> body_sink_;
+		std::vector<char> body_buffer_;
+
+		std::shared_ptr<http_response> res_;
+		static_file_response file_res_;
+		std::shared_ptr<server> server_;
+
+#ifdef WEBSOCKETMM_HAS_SENDFILE
+		/**
+		 * How much of file_res_.file has been sent.
+		 */
+		off_t file_offset_ { 0 };
+#endif
+
+		/**
+		 * The address the connection was admitted for.
+		 */
+		net::ip::address address_;
+
+		/**
+		 * Whether the first request hasn't been read yet.
+		 */
+		bool pending_ { true };
+
+		/**
+		 * Set once the connection has been handed to a websocket_user,
+		 * which releases it when it's closed.
+		 */
+		bool upgraded_ { false };
+
+		explicit session(tcp::socket&& socket, const net::ip::address& address, const std::shared_ptr<server>& server)
+#ifdef USE_TLS
+			: stream_(std::move(socket), server->get_tls_context()),
+#else
 			: stream_(std::move(socket)),
-			  server_(server) {
+#endif
+			  server_(server),
+			  address_(address) {
+		}
+
+		~session() {
+			if(body_sink_)
+				body_sink_->fail();
+			if(pending_)
+				server_->end_handshake(address_, false);
+			if(!upgraded_)
+				server_->release_connection();
 		}
 
 		void run() {
 			net::dispatch(stream_.get_executor(),
 						  beast::bind_front_handler(
-						  &session::do_read,
+						  &session::do_start,
 						  shared_from_this()));
 		}
 
+		void do_start() {
+#ifdef USE_TLS
+			if(stream_.is_tls()) {
+				// The handshake has as long to finish as the first request
+				stream_.expires_after(std::chrono::seconds(2));
+				stream_.async_handshake(beast::bind_front_handler(
+										&session::on_handshake,
+										shared_from_this()));
+				return;
+			}
+#endif
+			do_read();
+		}
+
+#ifdef USE_TLS
+		void on_handshake(beast::error_code ec) {
+			if(ec) {
+				pending_ = false;
+				server_->end_handshake(address_, ec == beast::error::timeout);
+				return;
+			}
+
+			do_read();
+		}
+#endif
+
+		/**
+		 * The address of the client, which is the first address of the
+		 * X-Forwarded-For header of the request when behind a proxy.
+		 */
+		net::ip::address client_address() const {
+#ifdef WEBSOCKETMM_SUPPORT_PROXYING
+			auto header = req_.find("X-Forwarded-For");
+			if(header != req_.end()) {
+				beast::string_view value = header->value();
+				beast::error_code ec;
+				auto ip = net::ip::make_address(std::string_view(value.data(), std::min(value.find(','), value.size())), ec);
+				if(!ec)
+					return ip;
+			}
+#endif
+			return address_;
+		}
+
 		void do_read() {
-			// Make the request empty before reading,
-			// otherwise the operation behavior is undefined.
-			req_ = {};
+			// A parser can only read one message. Its body limit is
+			// checked once it's known how the body will be read
+			header_parser_.emplace();
+			header_parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
 
 			// Set the timeout.
 			stream_.expires_after(std::chrono::seconds(2));
 
-			// Read a request
-			http::async_read(stream_, buffer_, req_,
+			// Read the header of a request
+			http::async_read_header(stream_, buffer_, *header_parser_,
+									beast::bind_front_handler(
+									&session::on_read_header,
+									shared_from_this()));
+		}
+
+		void on_read_header(beast::error_code ec, std::size_t bytes_transferred) {
+			boost::ignore_unused(bytes_transferred);
+
+			if(pending_) {
+				pending_ = false;
+				server_->end_handshake(address_, ec == beast::error::timeout);
+			}
+
+			// This means they closed the connection
+			if(ec == http::error::end_of_stream)
+				return do_close();
+
+			if(ec)
+				return do_close();
+
+			const http_request_header& header = header_parser_->get().base();
+			if(!websocket::is_upgrade(header))
+				body_sink_ = server_->stream_body(header);
+
+			if(body_sink_) {
+				// The sink decides how much it will accept
+				body_parser_.emplace(std::move(*header_parser_));
+				header_parser_.reset();
+				body_buffer_.resize(kBodyChunkSize);
+				return do_read_body();
+			}
+
+			if(header_parser_->content_length().value_or(0) > kMaxBodySize)
+				return do_close();
+
+			// The rest of the request has to arrive before the original timeout
+			parser_.emplace(std::move(*header_parser_));
+			header_parser_.reset();
+			parser_->body_limit(kMaxBodySize);
+			http::async_read(stream_, buffer_, *parser_,
 							 beast::bind_front_handler(
 							 &session::on_read,
 							 shared_from_this()));
 		}
 
+		void do_read_body() {
+			// The idle timeout only runs while a chunk is being read
+			auto resume = [self = shared_from_this()]() {
+				net::post(self->stream_.get_executor(),
+						  beast::bind_front_handler(&session::do_read_body, self));
+			};
+			if(!body_sink_->ready(body_buffer_.size(), std::move(resume)))
+				return;
+
+			auto& body = body_parser_->get().body();
+			body.data = body_buffer_.data();
+			body.size = body_buffer_.size();
+
+			stream_.expires_after(kBodyIdleTimeout);
+			http::async_read(stream_, buffer_, *body_parser_,
+							 beast::bind_front_handler(
+							 &session::on_read_body,
+							 shared_from_this()));
+		}
+
+		void on_read_body(beast::error_code ec, std::size_t bytes_transferred) {
+			boost::ignore_unused(bytes_transferred);
+
+			// The buffer is full, which isn't an error
+			if(ec == http::error::need_buffer)
+				ec = {};
+
+			std::size_t size = body_buffer_.size() - body_parser_->get().body().size;
+			if(ec || (size && !body_sink_->write(body_buffer_.data(), size))) {
+				body_sink_->fail();
+				body_sink_ = nullptr;
+				return do_close();
+			}
+
+			if(!body_parser_->is_done())
+				return do_read_body();
+			do_finish_body();
+		}
+
+		void do_finish_body() {
+			// A sink that writes the body asynchronously is finished once it's done
+			auto resume = [self = shared_from_this()]() {
+				net::post(self->stream_.get_executor(),
+						  beast::bind_front_handler(&session::do_finish_body, self));
+			};
+			if(!body_sink_->ready(0, std::move(resume)))
+				return;
+
+			res_ = body_sink_->finish();
+			body_sink_ = nullptr;
+			body_buffer_ = {};
+			if(!res_)
+				return do_close();
+
+			res_->version(body_parser_->get().version());
+			res_->keep_alive(body_parser_->get().keep_alive());
+			body_parser_.reset();
+
+			http::async_write(stream_, *res_,
+							  beast::bind_front_handler(
+							  &session::on_write,
+							  shared_from_this(),
+							  res_->need_eof()));
+		}
+
 		void on_read(beast::error_code ec, std::size_t bytes_transferred) {
 			boost::ignore_unused(bytes_transferred);
 
-			// This means they closed the connection
-			if(ec == http::error::end_of_stream)
+			if(ec)
 				return do_close();
 
+			req_ = parser_->release();
+			parser_.reset();
+
 			// Spawn a websocket connection,
-			// or close
+			// or let the server's HTTP handler respond
 			if(websocket::is_upgrade(req_)) {
-				std::make_shared<websocket_user>(server_, std::move(stream_.release_socket()))->run(req_);
-			} else {
-				// TODO: process request in this case, for either static server or POST callback
+				// The WebSocket has its own timeouts
+				upgraded_ = true;
+				stream_.expires_never();
+				std::make_shared<websocket_user>(server_, std::move(stream_))->run(req_);
+				return;
+			}
+
+			res_ = server_->serve(req_, client_address());
+			if(!res_) {
+				if(!server_->serve_file(req_, file_res_))
+					return do_close();
+
+				// The body points into file_res_, which is kept until the write completes
+				http::async_write(stream_, file_res_.response,
+								  beast::bind_front_handler(
+								  &session::on_file_write,
+								  shared_from_this(),
+								  file_res_.response.need_eof()));
+				return;
+			}
+
+			// The response is kept alive by res_ until the write completes
+			http::async_write(stream_, *res_,
+							  beast::bind_front_handler(
+							  &session::on_write,
+							  shared_from_this(),
+							  res_->need_eof()));
+		}
+
+		void on_file_write(bool close, beast::error_code ec, std::size_t bytes_transferred) {
+#ifdef WEBSOCKETMM_HAS_SENDFILE
+			// Only the header of a file that wasn't cached has been written
+			if(!ec && file_res_.file.is_open()) {
+				file_offset_ = 0;
+#ifdef USE_TLS
+				if(stream_.is_tls())
+					return do_write_file(close);
+#endif
+				return do_sendfile(close);
+			}
+#endif
+			on_write(close, ec, bytes_transferred);
+		}
+
+#ifdef WEBSOCKETMM_HAS_SENDFILE
+		void do_sendfile(bool close) {
+			beast::error_code ec;
+			tcp::socket& socket = stream_.socket();
+			socket.native_non_blocking(true, ec);
+			if(ec)
+				return do_close();
+
+			// Copy the file to the socket in the kernel, waiting
+			// whenever the socket's send buffer is full
+			while(static_cast<std::uint64_t>(file_offset_) < file_res_.file_size) {
+				ssize_t sent = ::sendfile(socket.native_handle(), file_res_.file.native_handle(), &file_offset_,
+										  file_res_.file_size - file_offset_);
+				if(sent > 0)
+					continue;
+
+				if(sent < 0 && errno == EINTR)
+					continue;
+
+				if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					socket.async_wait(tcp::socket::wait_write,
+									  beast::bind_front_handler(
+									  &session::on_sendfile_ready,
+									  shared_from_this(),
+									  close));
+					return;
+				}
+
+				// The file was truncated after the header was
+				// sent, so the response can't be completed
 				return do_close();
 			}
 
-			//if(ec)
-			//   return fail(ec, "read");
+			on_write(close, {}, file_res_.file_size);
+		}
+
+		void on_sendfile_ready(bool close, beast::error_code ec) {
+			if(ec)
+				return do_close();
 
-			// Send the response
-			//handle_request(*doc_root_, std::move(req_), lambda_);
+			do_sendfile(close);
 		}
 
+#ifdef USE_TLS
+		/**
+		 * Send a file over TLS, which has to encrypt it, so it's
+		 * read and written in chunks instead of with sendfile().
+		 */
+		void do_write_file(bool close) {
+			std::uint64_t remaining = file_res_.file_size - file_offset_;
+			if(!remaining) {
+				body_buffer_ = {};
+				return on_write(close, {}, file_res_.file_size);
+			}
+
+			beast::error_code ec;
+			body_buffer_.resize(kBodyChunkSize);
+			std::size_t size = file_res_.file.read(body_buffer_.data(), std::min<std::uint64_t>(remaining, body_buffer_.size()), ec);
+
+			// The file was truncated after the header was sent
+			if(ec || !size)
+				return do_close();
+
+			file_offset_ += size;
+			stream_.expires_after(kBodyIdleTimeout);
+			net::async_write(stream_, net::buffer(body_buffer_.data(), size),
+							 beast::bind_front_handler(
+							 &session::on_write_file,
+							 shared_from_this(),
+							 close));
+		}
+
+		void on_write_file(bool close, beast::error_code ec, std::size_t bytes_transferred) {
+			boost::ignore_unused(bytes_transferred);
+
+			if(ec)
+				return do_close();
+
+			do_write_file(close);
+		}
+#endif
+#endif
+
 		void on_write(bool close, beast::error_code ec, std::size_t bytes_transferred) {
 			boost::ignore_unused(bytes_transferred);
 
-			//if(ec)
-			//   return fail(ec, "write");
+			if(ec)
+				return do_close();
 
 			if(close) {
 				// This means we should close the connection, usually because
@@ -78,7 +428,8 @@ namespace websocketmm {
 			}
 
 			// We're done with the response so delete it
-			//res_ = nullptr;
+			res_ = nullptr;
+			file_res_ = {};
 
 			// Read another request
 			do_read();
@@ -94,16 +445,29 @@ namespace websocketmm {
 		}
 	};
 
-	listener::listener(net::io_context& ioc, tcp::endpoint ep, const std::shared_ptr<server>& server)
+	listener::listener(net::io_context& ioc, tcp::endpoint ep, const std::shared_ptr<server>& server, bool reuse_port,
+					   int handle)
 		: ioc_(ioc),
 		  acceptor_(ioc),
 		  endpoint(std::move(ep)),
+		  reuse_port_(reuse_port),
+		  handle_(handle),
 		  server_(server) {
 	}
 
 	void listener::start() {
 		beast::error_code ec;
 
+		// The socket is already bound and listening
+		if(handle_ != -1) {
+			acceptor_.assign(endpoint.protocol(), handle_, ec);
+			if(ec)
+				return;
+			endpoint = acceptor_.local_endpoint(ec);
+			acceptor_.async_accept(net::make_strand(ioc_), beast::bind_front_handler(&listener::on_accept, shared_from_this()));
+			return;
+		}
+
 		// Open the acceptor
 		acceptor_.open(endpoint.protocol(), ec);
 		if(ec)
@@ -114,6 +478,15 @@ namespace websocketmm {
 		if(ec)
 			return;
 
+#ifdef SO_REUSEPORT
+		// Let the acceptors of the other network threads bind to the same port
+		if(reuse_port_) {
+			acceptor_.set_option(net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true), ec);
+			if(ec)
+				return;
+		}
+#endif
+
 		// Bind to the server address
 		acceptor_.bind(endpoint, ec);
 		if(ec)
@@ -132,11 +505,31 @@ namespace websocketmm {
 		acceptor_.cancel(ec);
 	}
 
+	int listener::duplicate() {
+#ifndef _WIN32
+		if(acceptor_.is_open())
+			return ::dup(acceptor_.native_handle());
+#endif
+		return -1;
+	}
+
+	void listener::close() {
+		net::post(acceptor_.get_executor(), [self = shared_from_this()]() {
+			boost::system::error_code ec;
+			self->acceptor_.close(ec);
+		});
+	}
+
 	void listener::on_accept(beast::error_code ec, tcp::socket socket) {
 		if(ec)
 			return;
 
-		std::make_shared<session>(std::move(socket), server_)->run();
+		// Rejected sockets are closed when they go out of scope,
+		// before anything is read from them
+		beast::error_code endpoint_ec;
+		tcp::endpoint remote = socket.remote_endpoint(endpoint_ec);
+		if(!endpoint_ec && server_->admit_connection(remote.address()))
+			std::make_shared<session>(std::move(socket), remote.address(), server_)->run();
 
 		// Accept another connection
 		acceptor_.async_accept(net::make_strand(ioc_),
@@ -9,17 +9,37 @@ namespace websocketmm {
 	struct server;
 
 	struct listener : public std::enable_shared_from_this<listener> {
-		listener(net::io_context& ioc, tcp::endpoint ep, const std::shared_ptr<server>& server);
+		/**
+		 * \param[in] reuse_port Whether to bind with SO_REUSEPORT, so that
+		 *                       the listeners of each network thread can
+		 *                       share the same port.
+		 * \param[in] handle A listening socket handed over by another process,
+		 *                   which is used instead of binding to ep, or -1.
+		 */
+		listener(net::io_context& ioc, tcp::endpoint ep, const std::shared_ptr<server>& server, bool reuse_port,
+				 int handle = -1);
 
 		void start();
 		void stop();
 
+		/**
+		 * \return A duplicate of the listening socket, or -1 if it couldn't be made.
+		 */
+		int duplicate();
+
+		/**
+		 * Closes the listening socket from the listener's thread.
+		 */
+		void close();
+
 	   private:
 		void on_accept(beast::error_code ec, tcp::socket socket);
 
 		net::io_context& ioc_;
 		tcp::acceptor acceptor_;
 		tcp::endpoint endpoint;
+		bool reuse_port_;
+		int handle_;
 
 		std::shared_ptr<server> server_;
 	};
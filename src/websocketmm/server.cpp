@@ -2,23 +2,83 @@
 #include <websocketmm/listener.h>
 #include <websocketmm/websocket_user.h>
 
+#include <algorithm>
 #include <mutex>
 
+#ifdef USE_TLS
+	#include <openssl/rand.h>
+	#include <openssl/ssl.h>
+	#include <sys/stat.h>
+#endif
+
 namespace websocketmm {
 
 	server::server(net::io_context& context)
 		: ioc_(context) {
 	}
 
-	void server::start(const std::string& host, const std::uint16_t port) {
-		listener_ = std::make_shared<listener>(ioc_, tcp::endpoint { net::ip::make_address(host), port }, shared_from_this());
-		listener_->start();
+	void server::start(const std::string& host, const std::uint16_t port, std::size_t threads, const std::vector<int>& inherited) {
+		tcp::endpoint endpoint { net::ip::make_address(host), port };
+		if(threads == 0) {
+			if(inherited.empty())
+				listeners_.push_back(std::make_shared<listener>(ioc_, endpoint, shared_from_this(), false));
+			for(int handle : inherited)
+				listeners_.push_back(std::make_shared<listener>(ioc_, endpoint, shared_from_this(), false, handle));
+			for(auto& listener : listeners_)
+				listener->start();
+			return;
+		}
+
+		// The kernel already spreads connections across the inherited sockets
+		if(!inherited.empty())
+			threads = inherited.size();
+
+#ifndef SO_REUSEPORT
+		// Only one acceptor can be bound to the port, so connections
+		// are handled by a single network thread
+		threads = 1;
+#endif
+
+		for(std::size_t i = 0; i < threads; i++) {
+			network_contexts_.push_back(std::make_unique<net::io_context>(1));
+			network_work_.push_back(net::make_work_guard(*network_contexts_.back()));
+			listeners_.push_back(std::make_shared<listener>(*network_contexts_.back(), endpoint, shared_from_this(), true,
+															inherited.empty() ? -1 : inherited[i]));
+			listeners_.back()->start();
+		}
+
+		for(auto& context : network_contexts_)
+			network_threads_.emplace_back([&ioc = *context]() { ioc.run(); });
 	}
 
 	void server::stop() {
-		// TODO
-		listener_->stop();
-		listener_.reset();
+		for(auto& listener : listeners_)
+			listener->stop();
+		listeners_.clear();
+
+		network_work_.clear();
+		for(auto& context : network_contexts_)
+			context->stop();
+
+		for(auto& thread : network_threads_)
+			thread.join();
+		network_threads_.clear();
+	}
+
+	std::vector<int> server::duplicate_listeners() {
+		std::vector<int> handles;
+		for(auto& listener : listeners_) {
+			int handle = listener->duplicate();
+			if(handle != -1)
+				handles.push_back(handle);
+		}
+		return handles;
+	}
+
+	void server::close_listeners() {
+		for(auto& listener : listeners_)
+			listener->close();
+		listeners_.clear();
 	}
 
 	/*
@@ -59,6 +119,272 @@ namespace websocketmm {
 			close_handler(user);
 	}
 
+	void server::resync(const std::weak_ptr<websocketmm::websocket_user>& user) {
+		if(resync_handler)
+			resync_handler(user);
+	}
+
+	std::shared_ptr<http_response> server::serve(const http_request& request, const net::ip::address& address) {
+		if(http_handler)
+			return http_handler(request, address);
+
+		return nullptr;
+	}
+
+	std::shared_ptr<http_body_sink> server::stream_body(const http_request_header& header) {
+		if(body_handler)
+			return body_handler(header);
+
+		return nullptr;
+	}
+
+	bool server::serve_file(const http_request& request, static_file_response& response) {
+		return static_files_ && static_files_->serve(request, response);
+	}
+
+	void server::set_admission_limits(std::size_t max_connections, std::size_t max_pending, std::uint32_t accept_rate) {
+		std::lock_guard<std::mutex> lock(admission_lock_);
+		max_connections_ = max_connections;
+		max_pending_ = max_pending;
+		if(accept_rate != accept_rate_) {
+			accept_rate_ = accept_rate;
+			accept_tokens_ = accept_rate;
+			accept_refill_time_ = std::chrono::steady_clock::now();
+		}
+	}
+
+	connection_stats server::get_connection_stats() const {
+		return { accepted_, rejected_, handshake_timeouts_, open_ };
+	}
+
+	bool server::admit_connection(const net::ip::address& address) {
+		std::lock_guard<std::mutex> lock(admission_lock_);
+		if(accept_rate_) {
+			// Refill the bucket for the time since the last connection
+			auto now = std::chrono::steady_clock::now();
+			std::chrono::duration<double> elapsed = now - accept_refill_time_;
+			accept_refill_time_ = now;
+			accept_tokens_ = std::min<double>(accept_tokens_ + elapsed.count() * accept_rate_, accept_rate_);
+		}
+
+		std::size_t& pending = pending_[address];
+		if((accept_rate_ && accept_tokens_ < 1) ||
+		   (max_connections_ && open_ >= max_connections_) ||
+		   (max_pending_ && pending >= max_pending_)) {
+			if(!pending)
+				pending_.erase(address);
+			rejected_++;
+			return false;
+		}
+
+		if(accept_rate_)
+			accept_tokens_--;
+		pending++;
+		open_++;
+		accepted_++;
+		return true;
+	}
+
+	void server::end_handshake(const net::ip::address& address, bool timed_out) {
+		if(timed_out)
+			handshake_timeouts_++;
+
+		std::lock_guard<std::mutex> lock(admission_lock_);
+		auto it = pending_.find(address);
+		if(it != pending_.end() && !--it->second)
+			pending_.erase(it);
+	}
+
+	void server::release_connection() {
+		open_--;
+	}
+
+	/**
+	 * The number of connections worth of messages that all of the
+	 * connections from one address can send.
+	 */
+	constexpr static double kAddressReceiveShare = 4;
+
+	/**
+	 * The longest a connection's reads are paused for. A message that would
+	 * take longer than this to refill the budget closes the connection.
+	 */
+	constexpr static std::chrono::seconds kMaxReceiveDelay(5);
+
+	/**
+	 * Refill a bucket for the time since it was last refilled, and take a message
+	 * from it. The tokens can go negative, they're paid back before the next read.
+	 *
+	 * \return The number of seconds until the bucket isn't in debt.
+	 */
+	static double take_tokens(receive_bucket& bucket, double message_rate, double byte_rate, std::size_t bytes) {
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::duration<double> elapsed = now - bucket.refill_time;
+		bucket.refill_time = now;
+
+		double wait = 0;
+		if(message_rate) {
+			bucket.messages = std::min(bucket.messages + elapsed.count() * message_rate, message_rate) - 1;
+			wait = std::max(wait, -bucket.messages / message_rate);
+		}
+		if(byte_rate) {
+			bucket.bytes = std::min(bucket.bytes + elapsed.count() * byte_rate, byte_rate) - bytes;
+			wait = std::max(wait, -bucket.bytes / byte_rate);
+		}
+		return wait;
+	}
+
+	void server::set_receive_limits(std::uint32_t messages, std::size_t bytes) {
+		std::lock_guard<std::mutex> lock(receive_lock_);
+		message_rate_ = messages;
+		byte_rate_ = bytes;
+	}
+
+	void server::add_receiver(receive_bucket& bucket, const net::ip::address& address) {
+		std::lock_guard<std::mutex> lock(receive_lock_);
+		auto now = std::chrono::steady_clock::now();
+		bucket.messages = message_rate_;
+		bucket.bytes = byte_rate_;
+		bucket.refill_time = now;
+
+		receive_bucket& shared = receivers_[address];
+		if(!shared.connections++) {
+			shared.messages = message_rate_ * kAddressReceiveShare;
+			shared.bytes = byte_rate_ * kAddressReceiveShare;
+			shared.refill_time = now;
+		}
+	}
+
+	void server::remove_receiver(const net::ip::address& address) {
+		std::lock_guard<std::mutex> lock(receive_lock_);
+		auto it = receivers_.find(address);
+		if(it != receivers_.end() && !--it->second.connections)
+			receivers_.erase(it);
+	}
+
+	std::optional<std::chrono::steady_clock::duration> server::take_receive_tokens(receive_bucket& bucket, const net::ip::address& address, std::size_t bytes) {
+		std::lock_guard<std::mutex> lock(receive_lock_);
+		if(!message_rate_ && !byte_rate_)
+			return std::chrono::steady_clock::duration::zero();
+
+		double wait = take_tokens(bucket, message_rate_, byte_rate_, bytes);
+		auto it = receivers_.find(address);
+		if(it != receivers_.end())
+			wait = std::max(wait, take_tokens(it->second, message_rate_ * kAddressReceiveShare, byte_rate_ * kAddressReceiveShare, bytes));
+
+		std::chrono::duration<double> delay(wait);
+		if(delay > kMaxReceiveDelay)
+			return std::nullopt;
+		return std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay);
+	}
+
+#ifdef USE_TLS
+	/**
+	 * How often the certificate and key files are checked for changes.
+	 */
+	constexpr static std::chrono::seconds kTLSCheckInterval(10);
+
+	/**
+	 * The number of sessions kept for clients that resume
+	 * them by their ID instead of with a ticket.
+	 */
+	constexpr static long kTLSSessionCacheSize = 16 * 1024;
+
+	static std::time_t get_modified_time(const std::string& path) {
+		struct stat st;
+		if(::stat(path.c_str(), &st) != 0)
+			return 0;
+		return st.st_mtime;
+	}
+
+	/**
+	 * Only HTTP/1.1 is served, so clients that offer HTTP/2 as well
+	 * are told to use it instead of falling back after the handshake.
+	 */
+	static int select_alpn(SSL* ssl, const unsigned char** out, unsigned char* out_length, const unsigned char* in, unsigned int in_length, void* arg) {
+		static const unsigned char protocols[] = "\x08http/1.1";
+		unsigned char* selected;
+		if(SSL_select_next_proto(&selected, out_length, protocols, sizeof(protocols) - 1, in, in_length) != OPENSSL_NPN_NEGOTIATED)
+			return SSL_TLSEXT_ERR_NOACK;
+
+		*out = selected;
+		return SSL_TLSEXT_ERR_OK;
+	}
+
+	bool server::set_tls_files(const std::string& certificate, const std::string& key) {
+		std::lock_guard<std::mutex> lock(tls_lock_);
+		tls_check_time_ = std::chrono::steady_clock::now();
+		if(certificate.empty() || key.empty()) {
+			tls_certificate_.clear();
+			tls_key_.clear();
+			tls_context_ = nullptr;
+			return true;
+		}
+
+		// Saving the config shouldn't throw away the session cache
+		if(tls_context_ && certificate == tls_certificate_ && key == tls_key_ &&
+		   get_modified_time(certificate) == tls_certificate_time_ && get_modified_time(key) == tls_key_time_)
+			return true;
+
+		tls_certificate_ = certificate;
+		tls_key_ = key;
+		return load_tls_context();
+	}
+
+	std::shared_ptr<net::ssl::context> server::get_tls_context() {
+		std::lock_guard<std::mutex> lock(tls_lock_);
+		if(tls_certificate_.empty())
+			return nullptr;
+
+		auto now = std::chrono::steady_clock::now();
+		if(now - tls_check_time_ >= kTLSCheckInterval) {
+			tls_check_time_ = now;
+			if(get_modified_time(tls_certificate_) != tls_certificate_time_ || get_modified_time(tls_key_) != tls_key_time_)
+				load_tls_context();
+		}
+		return tls_context_;
+	}
+
+	bool server::load_tls_context() {
+		// A file that fails to load isn't tried again until it changes
+		tls_certificate_time_ = get_modified_time(tls_certificate_);
+		tls_key_time_ = get_modified_time(tls_key_);
+
+		auto context = std::make_shared<net::ssl::context>(net::ssl::context::tls_server);
+		beast::error_code ec;
+		context->set_options(net::ssl::context::default_workarounds | net::ssl::context::no_sslv2 | net::ssl::context::no_sslv3 |
+							 net::ssl::context::no_tlsv1 | net::ssl::context::no_tlsv1_1, ec);
+		if(!ec)
+			context->use_certificate_chain_file(tls_certificate_, ec);
+		if(!ec)
+			context->use_private_key_file(tls_key_, net::ssl::context::pem, ec);
+		if(ec)
+			return false;
+
+		SSL_CTX* native = context->native_handle();
+
+		// Free the buffers of connections that have nothing left to read or
+		// write, which is most of the memory an idle TLS connection uses
+		SSL_CTX_set_mode(native, SSL_MODE_RELEASE_BUFFERS);
+
+		// Clients that reconnect resume their session with a ticket, or by
+		// its ID from the cache, instead of doing a full handshake
+		static const unsigned char session_id_context[] = "websocketmm";
+		SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(native, kTLSSessionCacheSize);
+		SSL_CTX_set_session_id_context(native, session_id_context, sizeof(session_id_context) - 1);
+		if(!has_tls_ticket_keys_)
+			has_tls_ticket_keys_ = RAND_bytes(tls_ticket_keys_.data(), tls_ticket_keys_.size()) == 1;
+		if(has_tls_ticket_keys_)
+			SSL_CTX_set_tlsext_ticket_keys(native, tls_ticket_keys_.data(), tls_ticket_keys_.size());
+
+		SSL_CTX_set_alpn_select_cb(native, select_alpn, nullptr);
+
+		tls_context_ = std::move(context);
+		return true;
+	}
+#endif
+
 	bool server::send_message(std::weak_ptr<websocketmm::websocket_user>& user, const std::shared_ptr<const websocket_message>& message) {
 		try {
 			// If the user is expired,
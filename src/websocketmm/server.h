@@ -6,8 +6,23 @@
 #include <set>
 #include <memory>
 #include <functional>
+#include <mutex>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <thread>
+#include <vector>
 
 #include <websocketmm/beast/net.h>
+#include <websocketmm/beast/beast.h>
+#include <websocketmm/static_files.h>
+#include <websocketmm/connection_stream.h>
+
+#ifdef USE_TLS
+	#include <array>
+	#include <ctime>
+#endif
 
 namespace websocketmm {
 
@@ -17,16 +32,133 @@ namespace websocketmm {
 
 	struct websocket_message;
 
+	using http_request = http::request<http::string_body>;
+	using http_request_header = http::request_header<>;
+	using http_response = http::response<http::vector_body<std::uint8_t>>;
+
+	/**
+	 * Receives the body of a request as it's read from the connection,
+	 * so that large bodies such as file uploads never have to be held
+	 * in memory. Only one of finish() and fail() is called.
+	 */
+	struct http_body_sink {
+		virtual ~http_body_sink() = default;
+
+		/**
+		 * Called with each chunk of the body as it arrives.
+		 *
+		 * \return false to stop reading the body and close the connection.
+		 */
+		virtual bool write(const char* data, std::size_t size) = 0;
+
+		/**
+		 * Called before each chunk is read, so a sink that forwards the
+		 * body somewhere slower can hold the client back. It's called
+		 * with a size of 0 before finish(), to wait for the sink to
+		 * finish with the last chunk.
+		 *
+		 * \return false if the sink can't take a chunk of up to size
+		 *         bytes yet. The body isn't read until resume is called,
+		 *         which may be done from any thread.
+		 */
+		virtual bool ready(std::size_t size, std::function<void()> resume) {
+			return true;
+		}
+
+		/**
+		 * Called once the whole body has been written. The version and
+		 * keep-alive of the response are set to match the request.
+		 *
+		 * \return The response to send, or nullptr to close the connection.
+		 */
+		virtual std::shared_ptr<http_response> finish() = 0;
+
+		/**
+		 * Called instead of finish() when the body couldn't be read,
+		 * or write() returned false.
+		 */
+		virtual void fail() = 0;
+	};
+
+	/**
+	 * Counters for the connections that have gone through the listener.
+	 */
+	struct connection_stats {
+		/**
+		 * Connections that passed the admission limits.
+		 */
+		std::uint64_t accepted;
+
+		/**
+		 * Connections that were closed as soon as they were accepted
+		 * because of the admission limits.
+		 */
+		std::uint64_t rejected;
+
+		/**
+		 * Connections that were closed because their first HTTP
+		 * request didn't arrive in time.
+		 */
+		std::uint64_t handshake_timeouts;
+
+		/**
+		 * Connections that are currently open, including WebSockets.
+		 */
+		std::uint64_t open;
+	};
+
+	/**
+	 * A token bucket of the messages and bytes received, which holds up
+	 * to one second of them at the receive rates.
+	 */
+	struct receive_bucket {
+		double messages { 0 };
+		double bytes { 0 };
+		std::chrono::steady_clock::time_point refill_time;
+
+		/**
+		 * The number of connections that share the bucket.
+		 */
+		std::size_t connections { 0 };
+	};
+
 	struct server : public std::enable_shared_from_this<server> {
 		friend struct websocket_user;
 		friend struct listener;
+		friend struct session;
 
 		explicit server(net::io_context& context_);
 
-		void start(const std::string& host, std::uint16_t port);
+		/**
+		 * Start listening for connections.
+		 *
+		 * \param[in] threads The number of threads that handle network I/O, each with
+		 *                    its own io_context and acceptor bound with SO_REUSEPORT so
+		 *                    the kernel spreads new connections across them. Connections
+		 *                    stay on the thread that accepted them. When 0, connections
+		 *                    are handled by the io_context the server was created with.
+		 * \param[in] inherited Listening sockets handed over by the server this one
+		 *                      replaces, which are used instead of binding to the port.
+		 *                      When there are network threads, there is one for each.
+		 */
+		void start(const std::string& host, std::uint16_t port, std::size_t threads = 0,
+				   const std::vector<int>& inherited = {});
 
 		void stop();
 
+		/**
+		 * Duplicates the listening sockets, so they can be handed over to
+		 * another process without this one giving them up yet.
+		 *
+		 * \return The new descriptors, which the caller closes. Empty on Windows.
+		 */
+		std::vector<int> duplicate_listeners();
+
+		/**
+		 * Stops accepting connections, leaving the ones that are open alone.
+		 */
+		void close_listeners();
+
 
 		//void broadcast_message(const std::shared_ptr<const websocket_message> message);
 
@@ -53,6 +185,132 @@ namespace websocketmm {
 			close_handler = std::move(handler);
 		}
 
+		/**
+		 * Set the handler called when a user that had display updates dropped
+		 * has caught up, and should be sent the full display again.
+		 */
+		inline void set_resync_handler(std::function<void(std::weak_ptr<websocketmm::websocket_user>)> handler) {
+			resync_handler = std::move(handler);
+		}
+
+		/**
+		 * Set the handler called for plain HTTP requests that aren't WebSocket
+		 * upgrades, with the address of the client. The handler returns the
+		 * response to send, or nullptr to close the connection without responding.
+		 */
+		inline void set_http_handler(std::function<std::shared_ptr<http_response>(const http_request&, const net::ip::address&)> handler) {
+			http_handler = std::move(handler);
+		}
+
+		/**
+		 * Set the handler called with the header of each plain HTTP request,
+		 * before its body is read. The handler can return a sink to stream
+		 * the body into, or nullptr to read the body into memory and pass the
+		 * request to the HTTP handler as usual.
+		 */
+		inline void set_body_handler(std::function<std::shared_ptr<http_body_sink>(const http_request_header&)> handler) {
+			body_handler = std::move(handler);
+		}
+
+		/**
+		 * Set the directory that files are served from for HTTP requests that
+		 * the HTTP handler doesn't respond to. Must be called before start().
+		 *
+		 * \param[in] root The directory, without a trailing slash
+		 */
+		inline void set_doc_root(const std::string& root) {
+			static_files_ = std::make_unique<static_files>(root);
+		}
+
+		/**
+		 * Set the maximum number of bytes that can be queued for a user
+		 * before droppable messages are discarded. 0 disables the limit.
+		 *
+		 * \param[in] bytes The send budget for each user
+		 */
+		inline void set_send_budget(std::size_t bytes) {
+			send_budget_ = bytes;
+		}
+
+		inline std::size_t get_send_budget() const {
+			return send_budget_;
+		}
+
+		/**
+		 * Set how long a connection can go without receiving anything before
+		 * it's closed. Connections are pinged once half of it has passed,
+		 * and the pong counts as activity. 0 disables the timeout.
+		 * Connections that are already open keep the timeout they were accepted with.
+		 *
+		 * \param[in] timeout The idle timeout
+		 */
+		inline void set_idle_timeout(std::chrono::seconds timeout) {
+			idle_timeout_ = timeout;
+		}
+
+		inline std::chrono::seconds get_idle_timeout() const {
+			return idle_timeout_;
+		}
+
+		/**
+		 * Set the permessage-deflate options offered to new connections.
+		 * Connections that are already open keep the options they were accepted with.
+		 *
+		 * \param[in] options The deflate options
+		 */
+		inline void set_deflate_options(const websocket::permessage_deflate& options) {
+			std::lock_guard<std::mutex> lock(deflate_lock_);
+			deflate_options_ = options;
+		}
+
+		inline websocket::permessage_deflate get_deflate_options() {
+			std::lock_guard<std::mutex> lock(deflate_lock_);
+			return deflate_options_;
+		}
+
+		/**
+		 * Set the limits checked by the listener when it accepts a connection,
+		 * before the connection has used any memory for reading its handshake.
+		 * A limit of 0 disables it.
+		 *
+		 * \param[in] max_connections The maximum number of open connections
+		 * \param[in] max_pending The maximum number of connections from one address
+		 *                        that haven't sent their first request yet
+		 * \param[in] accept_rate The number of connections accepted per second,
+		 *                        with bursts of up to the same amount
+		 */
+		void set_admission_limits(std::size_t max_connections, std::size_t max_pending, std::uint32_t accept_rate);
+
+		connection_stats get_connection_stats() const;
+
+		/**
+		 * Set the rates that each WebSocket connection can send messages at.
+		 * All of the connections from one address share a budget of a few
+		 * times the rates. A connection that goes over its budget isn't read
+		 * from until the budget has refilled, and one whose message would take
+		 * too long to refill is closed before the message is handled.
+		 * A rate of 0 disables it.
+		 *
+		 * \param[in] messages The number of messages per second
+		 * \param[in] bytes The number of bytes per second
+		 */
+		void set_receive_limits(std::uint32_t messages, std::size_t bytes);
+
+#ifdef USE_TLS
+		/**
+		 * Serve new connections over TLS with a certificate chain and a
+		 * private key from PEM files, or over plain TCP when either path
+		 * is empty. The files are checked for changes every few seconds
+		 * and loaded again, so a renewed certificate is used for new
+		 * connections without restarting. Connections that are already
+		 * open keep the certificate they were accepted with.
+		 *
+		 * \return false if the files couldn't be loaded, in which case
+		 *         connections keep being served as they were before.
+		 */
+		bool set_tls_files(const std::string& certificate, const std::string& key);
+#endif
+
 	   protected:
 		//void join_to_server(websocket_user* user);
 		//void leave_server(websocket_user* user);
@@ -65,13 +323,81 @@ namespace websocketmm {
 		void message(const std::weak_ptr<websocketmm::websocket_user>& user, std::shared_ptr<const websocket_message> message);
 
 		void close(const std::weak_ptr<websocketmm::websocket_user>& user);
+		void resync(const std::weak_ptr<websocketmm::websocket_user>& user);
+		std::shared_ptr<http_response> serve(const http_request& request, const net::ip::address& address);
+		std::shared_ptr<http_body_sink> stream_body(const http_request_header& header);
+
+		/**
+		 * Build the response for a request from the doc root.
+		 *
+		 * \return false if there is no doc root, or the request can't be served from it.
+		 */
+		bool serve_file(const http_request& request, static_file_response& response);
+
+		/**
+		 * Check a newly accepted connection against the admission limits.
+		 * When it's admitted, it counts as open and pending until
+		 * end_handshake() and release_connection() are called.
+		 */
+		bool admit_connection(const net::ip::address& address);
+
+		/**
+		 * Called once a connection has read its first request, or failed to.
+		 */
+		void end_handshake(const net::ip::address& address, bool timed_out);
+
+		/**
+		 * Called when an admitted connection is closed.
+		 */
+		void release_connection();
+
+		/**
+		 * Start or stop counting a WebSocket connection towards the
+		 * receive budget of its address. The connection's own budget
+		 * starts out full.
+		 */
+		void add_receiver(receive_bucket& bucket, const net::ip::address& address);
+		void remove_receiver(const net::ip::address& address);
+
+		/**
+		 * Take a message from the budgets of a connection and its address.
+		 *
+		 * \return How long to wait before reading the next message, or
+		 *         std::nullopt if the connection should be closed instead.
+		 */
+		std::optional<std::chrono::steady_clock::duration> take_receive_tokens(receive_bucket& bucket, const net::ip::address& address, std::size_t bytes);
+
+#ifdef USE_TLS
+		/**
+		 * Get the TLS context to serve a new connection with,
+		 * or nullptr if it should be plain TCP.
+		 */
+		std::shared_ptr<net::ssl::context> get_tls_context();
+#endif
 
 	   private:
+#ifdef USE_TLS
+		/**
+		 * Load the certificate and key files into a new TLS context.
+		 * Must be called with tls_lock_ held.
+		 */
+		bool load_tls_context();
+#endif
+
 		/**
          * A reference to the io_context held here.
          */
 		net::io_context& ioc_;
-		std::shared_ptr<listener> listener_;
+		std::vector<std::shared_ptr<listener>> listeners_;
+
+		/**
+		 * The io_contexts run by the network threads. They aren't destroyed
+		 * when the server is stopped, because connections that are still
+		 * open use their executors.
+		 */
+		std::vector<std::unique_ptr<net::io_context>> network_contexts_;
+		std::vector<net::executor_work_guard<net::io_context::executor_type>> network_work_;
+		std::vector<std::thread> network_threads_;
 
 		std::mutex users_lock_;
 		//std::set<websocket_user*> users_;
@@ -82,6 +408,73 @@ namespace websocketmm {
 		std::function<void(std::weak_ptr<websocket_user>)> open_handler;
 		std::function<void(std::weak_ptr<websocket_user>, std::shared_ptr<const websocket_message>)> message_handler;
 		std::function<void(std::weak_ptr<websocket_user>)> close_handler;
+		std::function<void(std::weak_ptr<websocket_user>)> resync_handler;
+		std::function<std::shared_ptr<http_response>(const http_request&, const net::ip::address&)> http_handler;
+		std::function<std::shared_ptr<http_body_sink>(const http_request_header&)> body_handler;
+
+		std::unique_ptr<static_files> static_files_;
+
+		std::size_t send_budget_ { 0 };
+		std::chrono::seconds idle_timeout_ { 0 };
+
+		std::mutex deflate_lock_;
+		websocket::permessage_deflate deflate_options_;
+
+		/**
+		 * Guards the admission limits, the pending connections
+		 * and the accept rate bucket.
+		 */
+		std::mutex admission_lock_;
+		std::size_t max_connections_ { 0 };
+		std::size_t max_pending_ { 0 };
+		std::uint32_t accept_rate_ { 0 };
+
+		/**
+		 * The number of connections from each address that haven't
+		 * finished reading their first request.
+		 */
+		std::map<net::ip::address, std::size_t> pending_;
+
+		/**
+		 * The connections that can be accepted before the accept rate
+		 * is exceeded, and the last time the bucket was refilled.
+		 */
+		double accept_tokens_ { 0 };
+		std::chrono::steady_clock::time_point accept_refill_time_;
+
+		/**
+		 * Guards the receive rates and the budgets of the addresses.
+		 */
+		std::mutex receive_lock_;
+		std::uint32_t message_rate_ { 0 };
+		std::size_t byte_rate_ { 0 };
+		std::map<net::ip::address, receive_bucket> receivers_;
+
+#ifdef USE_TLS
+		/**
+		 * Guards the TLS files and the context loaded from them.
+		 */
+		std::mutex tls_lock_;
+		std::string tls_certificate_;
+		std::string tls_key_;
+		std::time_t tls_certificate_time_ { 0 };
+		std::time_t tls_key_time_ { 0 };
+		std::chrono::steady_clock::time_point tls_check_time_;
+		std::shared_ptr<net::ssl::context> tls_context_;
+
+		/**
+		 * The keys that session tickets are encrypted with, which are
+		 * given to every context so that tickets stay valid when the
+		 * certificate is reloaded.
+		 */
+		std::array<unsigned char, 80> tls_ticket_keys_;
+		bool has_tls_ticket_keys_ { false };
+#endif
+
+		std::atomic<std::uint64_t> accepted_ { 0 };
+		std::atomic<std::uint64_t> rejected_ { 0 };
+		std::atomic<std::uint64_t> handshake_timeouts_ { 0 };
+		std::atomic<std::uint64_t> open_ { 0 };
 	};
 
 } // namespace websocketmm
@@ -0,0 +1,320 @@
+#include <websocketmm/static_files.h>
+
+#include <sys/stat.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <utility>
+
+namespace websocketmm {
+
+	/**
+	 * Files larger than this are sent from disk instead of being cached.
+	 */
+	constexpr static std::uint64_t kMaxCachedFileSize = 1024 * 1024;
+
+	/**
+	 * The total size of the files that can be kept in memory.
+	 */
+	constexpr static std::size_t kMaxCacheBytes = 32 * 1024 * 1024;
+
+	/**
+	 * How long a cached file is used before it's compared with the disk again.
+	 */
+	constexpr static std::chrono::seconds kRevalidateInterval { 1 };
+
+	/**
+	 * The extension of each encoding's file, and its Content-Encoding.
+	 */
+	constexpr static const char* kEncodingSuffixes[] = { "", ".gz", ".br" };
+	constexpr static const char* kEncodingNames[] = { "", "gzip", "br" };
+
+	static std::string FormatHTTPDate(std::time_t time) {
+		std::tm tm;
+#ifdef _WIN32
+		gmtime_s(&tm, &time);
+#else
+		gmtime_r(&time, &tm);
+#endif
+		char buffer[32];
+		std::size_t length = std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+		return std::string(buffer, length);
+	}
+
+	static int HexDigit(char c) {
+		if(c >= '0' && c <= '9')
+			return c - '0';
+		if(c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		if(c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		return -1;
+	}
+
+	static_files::static_files(std::string root)
+		: root_(std::move(root)) {
+	}
+
+	bool static_files::serve(const http_request& request, static_file_response& res) {
+		if(request.method() != http::verb::get && request.method() != http::verb::head)
+			return false;
+
+		auto& response = res.response;
+		response.version(request.version());
+		response.keep_alive(request.keep_alive());
+
+		std::string path;
+		if(!get_path(request.target(), path)) {
+			response.result(http::status::not_found);
+			response.content_length(0);
+			return true;
+		}
+
+		// Find the compressed versions the client can decode
+		bool accepted[encoding_count] = { true, false, false };
+		for(const auto& ext : http::ext_list(request[http::field::accept_encoding])) {
+			bool enabled = true;
+			for(const auto& param : ext.second)
+				if(beast::iequals(param.first, "q"))
+					enabled = std::atof(std::string(param.second).c_str()) > 0;
+
+			if(beast::iequals(ext.first, "gzip"))
+				accepted[gzip] = enabled;
+			else if(beast::iequals(ext.first, "br"))
+				accepted[brotli] = enabled;
+		}
+
+		encoding selected = identity;
+		file_variant variant;
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			const cached_file* file = lookup(path);
+			if(file) {
+				for(int i = encoding_count - 1; i > identity; i--) {
+					if(accepted[i] && file->variants[i].exists) {
+						selected = static_cast<encoding>(i);
+						break;
+					}
+				}
+				variant = file->variants[selected];
+			}
+		}
+
+		if(!variant.exists) {
+			// Redirect directories to a path ending in a slash, so that
+			// relative links in their index.html resolve to the right place
+			struct stat st;
+			if(::stat(path.c_str(), &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR) {
+				beast::string_view target = request.target();
+				std::string location(target.substr(0, target.find('?')));
+				location += '/';
+				response.result(http::status::moved_permanently);
+				response.set(http::field::location, location);
+			} else {
+				response.result(http::status::not_found);
+			}
+			response.content_length(0);
+			return true;
+		}
+
+		response.set(http::field::content_type, get_content_type(path));
+		response.set(http::field::etag, variant.etag);
+		response.set(http::field::last_modified, variant.last_modified);
+		response.set(http::field::cache_control, "no-cache");
+		response.set(http::field::vary, "Accept-Encoding");
+		if(selected != identity)
+			response.set(http::field::content_encoding, kEncodingNames[selected]);
+
+		auto if_none_match = request.find(http::field::if_none_match);
+		if(if_none_match != request.end()) {
+			if(if_none_match->value() == "*" || if_none_match->value().find(variant.etag) != beast::string_view::npos) {
+				response.result(http::status::not_modified);
+				return true;
+			}
+		} else if(request[http::field::if_modified_since] == variant.last_modified) {
+			response.result(http::status::not_modified);
+			return true;
+		}
+
+		response.content_length(variant.size);
+		if(request.method() == http::verb::head)
+			return true;
+
+		if(!variant.data) {
+			path += kEncodingSuffixes[selected];
+#ifdef WEBSOCKETMM_HAS_SENDFILE
+			beast::error_code ec;
+			res.file.open(path.c_str(), beast::file_mode::scan, ec);
+			if(!ec)
+				res.file_size = res.file.size(ec);
+#else
+			std::ifstream stream(path, std::ios::binary);
+			auto data = std::make_shared<std::string>(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+			bool ec = !stream.eof() && stream.fail();
+			variant.data = data;
+#endif
+			if(ec) {
+				response = {};
+				response.version(request.version());
+				response.keep_alive(request.keep_alive());
+				response.result(http::status::not_found);
+				response.content_length(0);
+				return true;
+			}
+
+#ifdef WEBSOCKETMM_HAS_SENDFILE
+			// The file may have changed since it was checked
+			response.content_length(res.file_size);
+			return true;
+#else
+			response.content_length(variant.data->size());
+#endif
+		}
+
+		res.data = variant.data;
+		response.body() = { res.data->data(), res.data->size() };
+		return true;
+	}
+
+	const static_files::cached_file* static_files::lookup(const std::string& path) {
+		auto now = std::chrono::steady_clock::now();
+		auto it = cache_.find(path);
+		if(it != cache_.end() && now - it->second.checked < kRevalidateInterval)
+			return &it->second;
+
+		if(it == cache_.end())
+			it = cache_.emplace(path, cached_file()).first;
+
+		cached_file& file = it->second;
+		file.checked = now;
+		refresh(file.variants[identity], path);
+
+		// Only files that exist are kept, so requests for
+		// random paths don't fill up the cache
+		if(!file.variants[identity].exists) {
+			for(auto& variant : file.variants)
+				evict(variant);
+			cache_.erase(it);
+			return nullptr;
+		}
+
+		for(int i = identity + 1; i < encoding_count; i++)
+			refresh(file.variants[i], path + kEncodingSuffixes[i]);
+		return &file;
+	}
+
+	void static_files::refresh(file_variant& variant, const std::string& path) {
+		struct stat st;
+		if(::stat(path.c_str(), &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG) {
+			evict(variant);
+			variant.exists = false;
+			return;
+		}
+
+		if(variant.exists && variant.modified == st.st_mtime && variant.size == static_cast<std::uint64_t>(st.st_size))
+			return;
+
+		evict(variant);
+		variant.exists = true;
+		variant.modified = st.st_mtime;
+		variant.size = st.st_size;
+		variant.etag = '"' + std::to_string(variant.size) + '-' + std::to_string(variant.modified) + '"';
+		variant.last_modified = FormatHTTPDate(variant.modified);
+
+		if(variant.size > kMaxCachedFileSize || cached_bytes_ + variant.size > kMaxCacheBytes)
+			return;
+
+		std::ifstream stream(path, std::ios::binary);
+		auto data = std::make_shared<std::string>(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+		if(data->size() != variant.size)
+			return;
+
+		variant.data = std::move(data);
+		cached_bytes_ += variant.size;
+	}
+
+	void static_files::evict(file_variant& variant) {
+		if(variant.data) {
+			cached_bytes_ -= variant.data->size();
+			variant.data.reset();
+		}
+	}
+
+	bool static_files::get_path(beast::string_view target, std::string& path) const {
+		target = target.substr(0, target.find('?'));
+		if(target.empty() || target[0] != '/')
+			return false;
+
+		// Decode the percent-encoded characters
+		std::string decoded;
+		decoded.reserve(target.length());
+		for(std::size_t i = 0; i < target.length(); i++) {
+			char c = target[i];
+			if(c == '%') {
+				int high, low;
+				if(i + 2 >= target.length() || (high = HexDigit(target[i + 1])) < 0 || (low = HexDigit(target[i + 2])) < 0)
+					return false;
+				c = static_cast<char>(high << 4 | low);
+				i += 2;
+			}
+
+			if(c == '\0' || c == '\\')
+				return false;
+			decoded += c;
+		}
+
+		// Don't allow any segments that would leave the root
+		for(std::size_t start = 0; start < decoded.length();) {
+			std::size_t end = decoded.find('/', start + 1);
+			if(end == std::string::npos)
+				end = decoded.length();
+			if(decoded.compare(start, end - start, "/..") == 0)
+				return false;
+			start = end;
+		}
+
+		if(decoded.back() == '/')
+			decoded += "index.html";
+
+		path = root_ + decoded;
+		return true;
+	}
+
+	beast::string_view static_files::get_content_type(beast::string_view path) {
+		const static std::pair<beast::string_view, beast::string_view> types[] = {
+			{ ".html", "text/html; charset=utf-8" },
+			{ ".htm", "text/html; charset=utf-8" },
+			{ ".css", "text/css; charset=utf-8" },
+			{ ".js", "application/javascript; charset=utf-8" },
+			{ ".json", "application/json" },
+			{ ".map", "application/json" },
+			{ ".txt", "text/plain; charset=utf-8" },
+			{ ".xml", "application/xml" },
+			{ ".svg", "image/svg+xml" },
+			{ ".png", "image/png" },
+			{ ".jpg", "image/jpeg" },
+			{ ".jpeg", "image/jpeg" },
+			{ ".gif", "image/gif" },
+			{ ".webp", "image/webp" },
+			{ ".ico", "image/x-icon" },
+			{ ".woff", "font/woff" },
+			{ ".woff2", "font/woff2" },
+			{ ".ttf", "font/ttf" },
+			{ ".wasm", "application/wasm" },
+			{ ".mp3", "audio/mpeg" },
+			{ ".ogg", "audio/ogg" },
+			{ ".wav", "audio/wav" }
+		};
+
+		std::size_t dot = path.rfind('.');
+		if(dot != beast::string_view::npos && path.find('/', dot) == beast::string_view::npos) {
+			beast::string_view ext = path.substr(dot);
+			for(const auto& type : types)
+				if(beast::iequals(ext, type.first))
+					return type.second;
+		}
+		return "application/octet-stream";
+	}
+
+} // namespace websocketmm
@@ -0,0 +1,145 @@
+#ifndef WEBSOCKETMM_STATIC_FILES_H
+#define WEBSOCKETMM_STATIC_FILES_H
+
+#include <websocketmm/beast/net.h>
+#include <websocketmm/beast/beast.h>
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#ifdef __linux__
+	// Large files are sent straight from the page cache to the socket
+	#define WEBSOCKETMM_HAS_SENDFILE
+#endif
+
+namespace websocketmm {
+
+	using http_request = http::request<http::string_body>;
+
+	/**
+	 * The response to a request for a static file. The body of a file that is
+	 * small enough to be cached points into the cache, and is shared by all
+	 * of the responses for it.
+	 */
+	struct static_file_response {
+		http::response<http::span_body<const char>> response;
+
+		/**
+		 * Keeps the memory response.body() points to alive.
+		 */
+		std::shared_ptr<const std::string> data;
+
+#ifdef WEBSOCKETMM_HAS_SENDFILE
+		/**
+		 * A file that was too large to cache, which should be sent with
+		 * sendfile() once the header has been written. The header has the
+		 * file's Content-Length, but the body is empty.
+		 */
+		beast::file file;
+		std::uint64_t file_size { 0 };
+#endif
+	};
+
+	/**
+	 * Serves the files in a directory for GET and HEAD requests. Files are
+	 * revalidated against the disk at most once a second, so most requests
+	 * don't touch the filesystem. A gzip or brotli version of a file that was
+	 * compressed ahead of time, such as app.js.gz next to app.js, is sent
+	 * instead to clients that accept it.
+	 */
+	struct static_files {
+		/**
+		 * \param[in] root The directory to serve, without a trailing slash
+		 */
+		explicit static_files(std::string root);
+
+		/**
+		 * Build the response to a request.
+		 *
+		 * \return false if the request isn't a GET or HEAD, so there is no response.
+		 */
+		bool serve(const http_request& request, static_file_response& res);
+
+	   private:
+		enum encoding {
+			identity,
+			gzip,
+			brotli,
+			encoding_count
+		};
+
+		/**
+		 * A file, or one of its compressed versions.
+		 */
+		struct file_variant {
+			/**
+			 * Whether the file exists and is a regular file.
+			 */
+			bool exists { false };
+
+			std::time_t modified { 0 };
+			std::uint64_t size { 0 };
+			std::string etag;
+			std::string last_modified;
+
+			/**
+			 * The contents of the file, or null if it's too large to cache.
+			 */
+			std::shared_ptr<const std::string> data;
+		};
+
+		struct cached_file {
+			file_variant variants[encoding_count];
+			std::chrono::steady_clock::time_point checked;
+		};
+
+		/**
+		 * Get the cache entry for a path, loading it again if it's been
+		 * more than a second since it was compared with the files on disk.
+		 * Must be called with lock_ locked.
+		 *
+		 * \return The entry, or null if the file doesn't exist.
+		 */
+		const cached_file* lookup(const std::string& path);
+
+		/**
+		 * Compare a variant with the file on disk, and read it into
+		 * the cache again if it has changed.
+		 * Must be called with lock_ locked.
+		 */
+		void refresh(file_variant& variant, const std::string& path);
+
+		/**
+		 * Remove the data of a variant from the cache.
+		 * Must be called with lock_ locked.
+		 */
+		void evict(file_variant& variant);
+
+		/**
+		 * Convert the target of a request to a path in the root directory.
+		 *
+		 * \return false if the target is outside of the root.
+		 */
+		bool get_path(beast::string_view target, std::string& path) const;
+
+		static beast::string_view get_content_type(beast::string_view path);
+
+		const std::string root_;
+
+		std::mutex lock_;
+		std::unordered_map<std::string, cached_file> cache_;
+
+		/**
+		 * The total size of the files held in the cache.
+		 */
+		std::size_t cached_bytes_ { 0 };
+	};
+
+} // namespace websocketmm
+
+#endif //WEBSOCKETMM_STATIC_FILES_H
@@ -1,6 +1,8 @@
 #include <websocketmm/websocket_user.h>
 #include <websocketmm/server.h>
+#include "Tracepoints.h"
 
+#include <algorithm>
 #include <utility>
 
 // Uncomment if you're going to use Websocket-- under a proxy.
@@ -30,11 +32,106 @@ namespace websocketmm {
 		return BuildWebsocketMessage(websocket_message::type::text, (std::uint8_t*)str.data(), str.length());
 	}
 
+	std::shared_ptr<const websocket_message> BuildWebsocketMessage(websocket_message::type t, std::vector<std::uint8_t>&& data, bool droppable,
+																   std::shared_ptr<FrameTrace> trace, bool superseding) {
+		auto m = std::make_shared<websocket_message>();
+		m->message_type = t;
+		m->data = std::move(data);
+		m->droppable = droppable;
+		m->trace = std::move(trace);
+		m->superseding = superseding;
+		return m;
+	}
+
+	std::shared_ptr<const websocket_message> BuildPriorityMessage(const std::string& str) {
+		auto m = std::make_shared<websocket_message>();
+		m->message_type = websocket_message::type::text;
+		m->data.assign(str.begin(), str.end());
+		m->priority = true;
+		return m;
+	}
+
+	std::shared_ptr<const websocket_message> BuildPriorityMessage(std::vector<std::uint8_t>&& data) {
+		auto m = std::make_shared<websocket_message>();
+		m->message_type = websocket_message::type::text;
+		m->data = std::move(data);
+		m->priority = true;
+		return m;
+	}
+
 	// TODO utf-16 overloads
 
-	websocket_user::websocket_user(std::shared_ptr<server> server, tcp::socket&& socket)
+	/**
+	 * The initial capacity of the message queue. It grows if more messages are
+	 * queued, and shrinks back once the queue drains, since most connections
+	 * are idle viewers.
+	 */
+	constexpr static std::size_t kInitialQueueCapacity = 16;
+
+	/**
+	 * The maximum number of text messages that are combined into a single write.
+	 */
+	constexpr static std::size_t kMaxGatheredMessages = 64;
+
+	/**
+	 * The size of the pieces that large text messages are written in, so
+	 * priority messages only wait for one piece on a slow link. Text messages
+	 * are gathered up to this size as well.
+	 */
+	constexpr static std::size_t kWritePieceSize = 64 * 1024;
+
+	/**
+	 * Finds the end of the first Guacamole instruction in the data that ends
+	 * at or after the target, starting from the beginning of an instruction.
+	 * Element lengths count code points, not bytes. Returns the size of the
+	 * data if there's no such instruction or it can't be parsed.
+	 */
+	static std::size_t find_instruction_end(const std::vector<std::uint8_t>& data, std::size_t offset, std::size_t target) {
+		const std::size_t size = data.size();
+		while(offset < size) {
+			std::size_t length = 0;
+			for(; offset < size && data[offset] != '.'; offset++) {
+				if(data[offset] < '0' || data[offset] > '9')
+					return size;
+				length = length * 10 + (data[offset] - '0');
+			}
+			offset++;
+
+			// Skip the element, along with the continuation bytes of its code points
+			for(; length && offset < size; length--) {
+				offset++;
+				while(offset < size && (data[offset] & 0xC0) == 0x80)
+					offset++;
+			}
+			if(offset >= size)
+				return size;
+
+			if(data[offset] == ';') {
+				if(++offset >= target)
+					return offset;
+			} else if(data[offset] == ',') {
+				offset++;
+			} else {
+				return size;
+			}
+		}
+		return size;
+	}
+
+	websocket_user::websocket_user(std::shared_ptr<server> server, connection_stream&& stream)
 		: server_(std::move(server)),
-		  ws_(std::move(socket)) {
+		  ws_(std::move(stream)),
+		  read_timer_(ws_.get_executor()),
+		  message_queue_(kInitialQueueCapacity),
+		  priority_queue_(kInitialQueueCapacity) {
+		memory_.Allocate(MemoryCategory::kConnections, sizeof(websocket_user));
+		account_buffers();
+	}
+
+	websocket_user::~websocket_user() {
+		if(receive_address_.has_value())
+			server_->remove_receiver(receive_address_.value());
+		server_->release_connection();
 	}
 
 	beast::string_view websocket_user::GetSubprotocols() {
@@ -71,11 +168,6 @@ namespace websocketmm {
 	void websocket_user::run(http::request<http::string_body> upgrade) {
 		upgrade_request_ = upgrade;
 
-		// Set suggested timeout settings for the websocket
-		// this apparently needs to be done *after* the handshake
-		// go figure
-		//ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
-
 		// some fancy useragent stuffs
 		ws_.set_option(websocket::stream_base::decorator([&](websocket::response_type& res) {
 			res.set(http::field::server, "collab-vm-server/1.2.11");
@@ -89,10 +181,8 @@ namespace websocketmm {
 				res.set(http::field::sec_websocket_protocol, selected_subprotocol_.value());
 		}));
 
-		// Enable permessage deflate
-		//		websocket::permessage_deflate deflate;
-		//		deflate.server_enable = true;
-		//		ws_.set_option(deflate);
+		// Enable permessage deflate, if the server has it configured
+		ws_.set_option(server_->get_deflate_options());
 
 		// We wrap validation and accepting inside of the strand we were given by the
 		// listener object to avoid concurrency issues.
@@ -160,15 +250,42 @@ namespace websocketmm {
 		// (i.e: when this completion handler is called)
 		selected_subprotocol_.reset();
 
+		// The request was only needed to verify the connection
+		upgrade_request_.reset();
+
+		// Dead connections are found by Beast's pings, so clients don't
+		// have to send messages to the server just to stay connected.
+		// The timeouts are only set after the handshake, which the listener times
+		auto timeout = websocket::stream_base::timeout::suggested(beast::role_type::server);
+		if(server_->get_idle_timeout().count()) {
+			timeout.idle_timeout = server_->get_idle_timeout();
+			timeout.keep_alive_pings = true;
+		} else {
+			timeout.idle_timeout = websocket::stream_base::none();
+		}
+		ws_.set_option(timeout);
+
 		net::post(ws_.get_executor(), [self = shared_from_this()]() {
 			// Call the defined open callback
 			self->server_->open(self);
 
+			// The address is final once the connection has been verified
+			beast::error_code ec;
+			auto endpoint = self->ws_.next_layer().socket().remote_endpoint(ec);
+			self->receive_address_ = self->proxy_address_.value_or(endpoint.address());
+			self->server_->add_receiver(self->receive_bucket_, self->receive_address_.value());
+
 			// Start the asynchronous loop by reading a message
-			self->ws_.async_read(self->buffer_, beast::bind_front_handler(&websocket_user::on_read, self->shared_from_this()));
+			self->do_read();
 		});
 	}
 
+	void websocket_user::do_read() {
+		read_data_.clear();
+		read_buffer_.emplace(read_data_);
+		ws_.async_read(*read_buffer_, beast::bind_front_handler(&websocket_user::on_read, shared_from_this()));
+	}
+
 	void websocket_user::on_read(beast::error_code ec, std::size_t bytes_transferred) {
 		boost::ignore_unused(bytes_transferred);
 
@@ -189,14 +306,31 @@ namespace websocketmm {
 			if(ws_.binary())
 				type = websocket_message::type::binary;
 
-			// Call the server's message handler.
-			// BuildWebsocketMessage is used to return a temporary copied buffer which the server code can make last longer if it needs to.
+			// Flooding is stopped here, before the message costs the server anything else
+			read_buffer_.reset();
+			auto delay = server_->take_receive_tokens(receive_bucket_, receive_address_.value(), read_data_.size());
+			if(!delay.has_value()) {
+				server_->close(weak_from_this());
+				close();
+				return;
+			}
 
-			server_->message(weak_from_this(), BuildWebsocketMessage(type, (std::uint8_t*)buffer_.data().data(), buffer_.size()));
-			buffer_.clear();
+			// Call the server's message handler.
+			// The message takes the data that was read, so the server code can make it last longer if it needs to.
+			server_->message(weak_from_this(), BuildWebsocketMessage(type, std::move(read_data_)));
 
-			// Queue up another read operation.
-			ws_.async_read(buffer_, beast::bind_front_handler(&websocket_user::on_read, shared_from_this()));
+			// Queue up another read operation. While the connection is over its budget
+			// nothing is read, so TCP makes the client wait as well.
+			if(delay.value() == std::chrono::steady_clock::duration::zero()) {
+				do_read();
+				return;
+			}
+			boost::system::error_code timer_ec;
+			read_timer_.expires_from_now(delay.value(), timer_ec);
+			read_timer_.async_wait([self = shared_from_this()](const boost::system::error_code& ec) {
+				if(!ec)
+					self->do_read();
+			});
 	}
 
 	void websocket_user::Send(const std::shared_ptr<const websocket_message>& message) {
@@ -211,42 +345,199 @@ namespace websocketmm {
 		if(closing_)
 			return;
 
-		message_queue_.push_back(message);
+		if(message->droppable) {
+			// The display is going to be resynced, so this update is useless
+			if(needs_resync_) {
+				dropped_bytes_ += message->data.size();
+				dropped_messages_++;
+				return;
+			}
+
+			// If the connection can't keep up, throw away the queued display updates.
+			// A message that is larger than the budget by itself is still sent
+			// when the queue is empty, otherwise the user would never catch up.
+			std::size_t budget = server_->get_send_budget();
+			if(budget && !message_queue_.empty() && queued_bytes_ + message->data.size() > budget) {
+				drop_queued_messages();
+				dropped_bytes_ += message->data.size();
+				dropped_messages_++;
+				needs_resync_ = true;
+				return;
+			}
+		}
+
+		if(message->superseding)
+			drop_superseded_messages();
+
+		// Priority messages only go ahead of display updates
+		auto& queue = message->priority && message->message_type == websocket_message::type::text && !ordered_messages_
+						  ? priority_queue_ : message_queue_;
+		if(queue.full()) {
+			queue.set_capacity(queue.capacity() * 2);
+			account_buffers();
+		}
+
+		queue.push_back(message);
+		if(&queue == &message_queue_ && !message->droppable)
+			ordered_messages_++;
+		queued_bytes_ += message->data.size();
+		memory_.Allocate(MemoryCategory::kSendQueue, message->data.size());
 
 		// If we are already trying to write a message,
 		// return early so that whatever is writing can do it for us.
-		if(message_queue_.size() > 1)
+		if(writing_count_)
 			return;
 
 		// Otherwise, we should write the message immediately.
-		write_message(message_queue_.front());
+		write_messages();
 	}
 
-	void websocket_user::write_message(const std::shared_ptr<const websocket_message>& message) {
+	void websocket_user::write_messages() {
 		// Return immediately if the socket is pending a close,
 		// so we can empty the message queue without scheduling writes
 		// (which is bad once the closing sequence has begin)
 		if(closing_)
 			return;
 
+		write_buffers_.clear();
+
+		// WebSocket messages can't be interleaved, so rather than fragments of one
+		// message, large text messages are written as several messages that each
+		// end with a complete instruction, and priority messages go in between
+		writing_priority_ = !priority_queue_.empty();
+		auto& queue = writing_priority_ ? priority_queue_ : message_queue_;
+		const auto type = queue.front()->message_type;
+		const auto& front = queue.front()->data;
+		if(!writing_priority_ && type == websocket_message::type::text && (write_offset_ || front.size() > kWritePieceSize)) {
+			write_end_ = find_instruction_end(front, write_offset_, write_offset_ + kWritePieceSize);
+			write_buffers_.emplace_back(net::buffer(front.data() + write_offset_, write_end_ - write_offset_));
+		} else {
+			// Text messages contain complete Guacamole instructions, so consecutive ones
+			// can be sent as one WebSocket message. Binary messages are written one at a time.
+			std::size_t gathered = 0;
+			for(const auto& message : queue) {
+				if(message->message_type != type || write_buffers_.size() == kMaxGatheredMessages)
+					break;
+				if(!write_buffers_.empty() && gathered + message->data.size() > kWritePieceSize)
+					break;
+
+				write_buffers_.emplace_back(net::buffer(message->data));
+				gathered += message->data.size();
+
+				if(type == websocket_message::type::binary)
+					break;
+			}
+		}
+
+		writing_count_ = write_buffers_.size();
+		account_buffers();
+
 		// Configure the message type and schedule a asynchronous write.
-		ws_.binary(message->message_type == websocket_message::type::binary);
-		ws_.async_write(net::buffer(message->data), beast::bind_front_handler(&websocket_user::on_write, shared_from_this()));
+		ws_.binary(type == websocket_message::type::binary);
+		ws_.async_write(write_buffers_, beast::bind_front_handler(&websocket_user::on_write, shared_from_this()));
 	}
 
 	void websocket_user::on_write(beast::error_code ec, std::size_t bytes_transferred) {
-		boost::ignore_unused(bytes_transferred);
+		sent_bytes_.fetch_add(bytes_transferred, std::memory_order_relaxed);
 
 		if(ec) {
 			message_queue_.clear();
+			priority_queue_.clear();
+			memory_.Free(MemoryCategory::kSendQueue, queued_bytes_);
+			queued_bytes_ = 0;
+			ordered_messages_ = 0;
+			writing_count_ = 0;
+			write_offset_ = write_end_ = 0;
+			return;
+		}
+
+		if(writing_priority_) {
+			for(; writing_count_; writing_count_--)
+				pop_message(priority_queue_);
+		} else if(write_end_ && write_end_ < message_queue_.front()->data.size()) {
+			// More pieces of the message are left
+			write_offset_ = write_end_;
+			write_end_ = 0;
+			writing_count_ = 0;
+		} else {
+			write_offset_ = write_end_ = 0;
+			for(; writing_count_; writing_count_--)
+				pop_message(message_queue_);
+		}
+		COLLABVM_PROBE(ws_write, bytes_transferred, message_queue_.size() + priority_queue_.size(), queued_bytes_);
+
+		// Write more messages to empty the queues
+		if(!message_queue_.empty() || !priority_queue_.empty()) {
+			write_messages();
 			return;
 		}
 
-		message_queue_.erase(message_queue_.begin());
+		// Give back what a burst grew the queues to
+		if(message_queue_.capacity() > kInitialQueueCapacity || priority_queue_.capacity() > kInitialQueueCapacity) {
+			message_queue_.set_capacity(kInitialQueueCapacity);
+			priority_queue_.set_capacity(kInitialQueueCapacity);
+			write_buffers_ = std::vector<net::const_buffer>();
+			account_buffers();
+		}
+
+		if(needs_resync_ && !closing_) {
+			// The user has caught up, so send them the current display
+			needs_resync_ = false;
+			server_->resync(weak_from_this());
+		}
+	}
+
+	void websocket_user::pop_message(boost::circular_buffer<std::shared_ptr<const websocket_message>>& queue) {
+		const auto& message = queue.front();
+		if(message->trace)
+			message->trace->Delivered();
+		if(&queue == &message_queue_ && !message->droppable)
+			ordered_messages_--;
+		queued_bytes_ -= message->data.size();
+		memory_.Free(MemoryCategory::kSendQueue, message->data.size());
+		queue.pop_front();
+	}
+
+	std::size_t websocket_user::pinned_messages() const {
+		if(write_offset_ || write_end_)
+			return 1;
+		return writing_priority_ ? 0 : writing_count_;
+	}
+
+	void websocket_user::drop_queued_messages() {
+		// The messages at the front of the queue are currently being written
+		auto it = std::remove_if(message_queue_.begin() + pinned_messages(), message_queue_.end(), [this](const std::shared_ptr<const websocket_message>& message) {
+			if(!message->droppable)
+				return false;
+
+			queued_bytes_ -= message->data.size();
+			memory_.Free(MemoryCategory::kSendQueue, message->data.size());
+			dropped_bytes_ += message->data.size();
+			dropped_messages_++;
+			return true;
+		});
+		message_queue_.erase(it, message_queue_.end());
+	}
+
+	void websocket_user::drop_superseded_messages() {
+		auto it = std::remove_if(message_queue_.begin() + pinned_messages(), message_queue_.end(), [this](const std::shared_ptr<const websocket_message>& message) {
+			if(!message->superseding)
+				return false;
+
+			if(!message->droppable)
+				ordered_messages_--;
+			queued_bytes_ -= message->data.size();
+			memory_.Free(MemoryCategory::kSendQueue, message->data.size());
+			return true;
+		});
+		message_queue_.erase(it, message_queue_.end());
+	}
 
-		// Write more messages to empty the queue
-		if(!message_queue_.empty())
-			write_message(message_queue_.front());
+	void websocket_user::account_buffers() {
+		std::size_t bytes = (message_queue_.capacity() + priority_queue_.capacity()) * sizeof(message_queue_[0]) +
+							write_buffers_.capacity() * sizeof(net::const_buffer);
+		memory_.Resize(MemoryCategory::kConnections, buffer_bytes_, bytes);
+		buffer_bytes_ = bytes;
 	}
 
 	void websocket_user::close() {
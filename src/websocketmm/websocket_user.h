@@ -3,12 +3,19 @@
 
 #include <websocketmm/beast/net.h>
 #include <websocketmm/beast/beast.h>
+#include <websocketmm/server.h>
 
 #include <cstdint>
 #include <memory>
 #include <vector>
+#include <atomic>
 #include <optional> // wow, we can use this now!
 
+#include <boost/circular_buffer.hpp>
+
+#include "../FrameTrace.h"
+#include "../MemoryAccounting.h"
+
 // forward decl in thing
 struct CollabVMUser;
 
@@ -22,6 +29,36 @@ namespace websocketmm {
 
 		type message_type;
 		std::vector<std::uint8_t> data;
+
+		/**
+		 * Whether this message may be discarded when the connection
+		 * falls behind. Only display updates, which can be recovered
+		 * with a resync, should be marked as droppable.
+		 */
+		bool droppable { false };
+
+		/**
+		 * Whether this message makes the earlier superseding messages that
+		 * are still queued useless, like the position of the cursor. Those
+		 * are removed when it's queued, so a connection that falls behind
+		 * isn't sent every position it missed.
+		 */
+		bool superseding { false };
+
+		/**
+		 * Whether this text message is small and urgent, like chat, turns
+		 * and nops. It may be written ahead of the display updates that are
+		 * queued before it, between the pieces of a large update, but never
+		 * ahead of another message that can't be dropped, so the order of
+		 * everything else the client is told stays the same.
+		 */
+		bool priority { false };
+
+		/**
+		 * The trace of the frame this message belongs to, which is told
+		 * when the message has been written to a user.
+		 */
+		std::shared_ptr<FrameTrace> trace;
 	};
 
 	/**
@@ -30,6 +67,18 @@ namespace websocketmm {
 	std::shared_ptr<const websocket_message> BuildWebsocketMessage(websocket_message::type t, std::uint8_t* data, std::size_t size);
 	std::shared_ptr<const websocket_message> BuildWebsocketMessage(const std::string& str);
 
+	/**
+	 * Build a websocket message which takes ownership of an existing buffer, avoiding a copy.
+	 */
+	std::shared_ptr<const websocket_message> BuildWebsocketMessage(websocket_message::type t, std::vector<std::uint8_t>&& data, bool droppable = false,
+																   std::shared_ptr<FrameTrace> trace = nullptr, bool superseding = false);
+
+	/**
+	 * Build a text message marked as priority.
+	 */
+	std::shared_ptr<const websocket_message> BuildPriorityMessage(const std::string& str);
+	std::shared_ptr<const websocket_message> BuildPriorityMessage(std::vector<std::uint8_t>&& data);
+
 	struct server;
 
 	/**
@@ -47,7 +96,12 @@ namespace websocketmm {
 		friend struct listener;
 		friend struct session;
 
-		websocket_user(std::shared_ptr<server> server, tcp::socket&& socket);
+		/**
+		 * Takes over a connection that was admitted by the listener,
+		 * which is released when the websocket_user is destroyed.
+		 */
+		websocket_user(std::shared_ptr<server> server, connection_stream&& stream);
+		~websocket_user();
 
 		per_user_data& GetUserData();
 
@@ -83,6 +137,51 @@ namespace websocketmm {
 
 		net::ip::address GetAddress();
 
+		/**
+		 * Set the address returned by GetAddress() instead of the peer's,
+		 * for connections made by a trusted proxy on behalf of a client.
+		 * Only call this during the verification stage of the connection.
+		 */
+		inline void SetProxyAddress(const net::ip::address& address) {
+			proxy_address_ = address;
+		}
+
+		/**
+		 * Get the number of bytes of messages that have been written to
+		 * the connection, before the WebSocket framing and compression.
+		 */
+		inline std::uint64_t GetSentBytes() const {
+			return sent_bytes_.load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * Get the number of bytes of display updates that were dropped
+		 * because this connection exceeded its send budget.
+		 */
+		inline std::uint64_t GetDroppedBytes() const {
+			return dropped_bytes_;
+		}
+
+		/**
+		 * Get the number of display update messages that were dropped
+		 * because this connection exceeded its send budget.
+		 */
+		inline std::uint64_t GetDroppedMessages() const {
+			return dropped_messages_;
+		}
+
+		/**
+		 * Get the account that the messages queued on this connection, and the
+		 * memory kept for it, are charged to.
+		 */
+		inline const MemoryAccount& GetMemoryAccount() const {
+			return memory_;
+		}
+
+		inline MemoryAccount& GetMemoryAccount() {
+			return memory_;
+		}
+
 		/**
 		 * Close the WebSocket connection.
 		 * This function also clears the send queue for this connection entirely,
@@ -96,6 +195,11 @@ namespace websocketmm {
 
 	   private:
 		void on_accept(beast::error_code ec);
+
+		/**
+		 * Start reading the next message into an empty read_data_.
+		 */
+		void do_read();
 		void on_read(beast::error_code ec, std::size_t bytes_transferred);
 		void on_write(beast::error_code ec, std::size_t bytes_transferred);
 
@@ -103,13 +207,61 @@ namespace websocketmm {
 
 		void on_close(beast::error_code ec);
 
-		void write_message(const std::shared_ptr<const websocket_message>& message);
+		/**
+		 * Write as many of the queued messages as possible with a single gathered write,
+		 * or the next piece of a large text message.
+		 */
+		void write_messages();
+
+		/**
+		 * Remove the message at the front of a queue once it has been written.
+		 */
+		void pop_message(boost::circular_buffer<std::shared_ptr<const websocket_message>>& queue);
+
+		/**
+		 * The number of messages at the front of message_queue_ that mustn't
+		 * be removed, because they're being written or were partly written.
+		 */
+		std::size_t pinned_messages() const;
+
+		/**
+		 * Drop all of the queued droppable messages, except for the one being written.
+		 */
+		void drop_queued_messages();
+
+		/**
+		 * Remove the queued superseding messages, except for the one being written.
+		 */
+		void drop_superseded_messages();
+
+		/**
+		 * Charge the capacity of the message queue and write buffers to the
+		 * connection's account, after it may have changed.
+		 */
+		void account_buffers();
 
 		std::shared_ptr<server> server_;
 		per_user_data user_data_;
 
-		beast::flat_buffer buffer_;
-		websocket::stream<beast::tcp_stream> ws_;
+		/**
+		 * The message being read. Once it has been read, its storage is moved
+		 * into the websocket_message given to the server instead of copied.
+		 */
+		std::vector<std::uint8_t> read_data_;
+		std::optional<net::dynamic_vector_buffer<std::uint8_t, std::allocator<std::uint8_t>>> read_buffer_;
+		websocket::stream<connection_stream> ws_;
+
+		/**
+		 * The address whose receive budget the connection counts towards,
+		 * set once the connection has been opened, and its own budget.
+		 */
+		std::optional<net::ip::address> receive_address_;
+		receive_bucket receive_bucket_;
+
+		/**
+		 * Waits for the receive budget to refill before the next read.
+		 */
+		net::steady_timer read_timer_;
 
 		/**
 		 * A optional containing the HTTP request that spawned the session.
@@ -132,7 +284,65 @@ namespace websocketmm {
 		/**
 		 * internal queue of websocket messages
 		 */
-		std::vector<std::shared_ptr<const websocket_message>> message_queue_;
+		boost::circular_buffer<std::shared_ptr<const websocket_message>> message_queue_;
+
+		/**
+		 * Priority messages, which are written before message_queue_ while
+		 * it only holds droppable messages.
+		 */
+		boost::circular_buffer<std::shared_ptr<const websocket_message>> priority_queue_;
+
+		/**
+		 * The number of messages in message_queue_ that can't be dropped.
+		 */
+		std::size_t ordered_messages_ { 0 };
+
+		/**
+		 * The number of messages at the front of the queue that are currently being written,
+		 * and whether that queue is priority_queue_.
+		 */
+		std::size_t writing_count_ { 0 };
+		bool writing_priority_ { false };
+
+		/**
+		 * The bytes of the message at the front of message_queue_ that have been
+		 * written, and where the piece of it being written ends, while a large
+		 * text message is written in pieces. The end is 0 otherwise.
+		 */
+		std::size_t write_offset_ { 0 };
+		std::size_t write_end_ { 0 };
+
+		/**
+		 * Buffers for the messages that are currently being written.
+		 */
+		std::vector<net::const_buffer> write_buffers_;
+
+		/**
+		 * The total size of all messages in the queue.
+		 */
+		std::size_t queued_bytes_ { 0 };
+
+		/**
+		 * Accounts for the bytes in the queue, as the send queue, and for
+		 * the connection's own memory.
+		 */
+		MemoryAccount memory_;
+
+		/**
+		 * The capacity of the queue and write buffers that was last charged.
+		 */
+		std::size_t buffer_bytes_ { 0 };
+
+		/**
+		 * Set once display updates have been dropped. The server is asked
+		 * to resync the display once the queue drains, until then
+		 * droppable messages are discarded.
+		 */
+		bool needs_resync_ { false };
+
+		std::atomic<std::uint64_t> sent_bytes_ { 0 };
+		std::atomic<std::uint64_t> dropped_bytes_ { 0 };
+		std::atomic<std::uint64_t> dropped_messages_ { 0 };
 	};
 } // namespace websocketmm
 